@@ -0,0 +1,14 @@
+# Find OSMesa
+#
+# OSMESA_INCLUDE_DIR
+# OSMESA_LIBRARY
+# OSMESA_FOUND
+
+FIND_PATH(OSMESA_INCLUDE_DIR NAMES GL/osmesa.h)
+
+FIND_LIBRARY(OSMESA_LIBRARY NAMES OSMesa)
+
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(OSMesa DEFAULT_MSG OSMESA_LIBRARY OSMESA_INCLUDE_DIR)
+
+MARK_AS_ADVANCED(OSMESA_INCLUDE_DIR OSMESA_LIBRARY)
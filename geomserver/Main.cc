@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/MmapOsmDatasource.hh>
+#include <glosm/DummyHeightmap.hh>
+#include <glosm/SRTMDatasource.hh>
+#include <glosm/GeometryCache.hh>
+#include <glosm/GeometryDiskCache.hh>
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/GeometryProtocol.hh>
+#include <glosm/GeometryServer.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Timer.hh>
+#include <glosm/Trace.hh>
+#include <glosm/geomath.h>
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+void usage(const char* progname) {
+	fprintf(stderr, "Usage: %s [-l [host:]port|path] [-j threads] [-m cachesize] [-c cachedir] [-t srtmpath] [-f key[=value][,...]] [-b minlon,minlat,maxlon,maxlat] [-p file.poly] [-R] <infile.osm[.gz|.bz2|.zst]|infile.osm.pbf|infile.snapshot>\n", progname);
+	fprintf(stderr, "Options:\n");
+	//               [==================================72==================================]
+	fprintf(stderr, "  -l addr  - listen on given TCP port of loopback, or of given host\n");
+	fprintf(stderr, "             (* for all addresses), or on unix socket if argument\n");
+	fprintf(stderr, "             contains a slash (default %d)\n", GeometryProtocol::DEFAULT_PORT);
+	fprintf(stderr, "  -j num   - number of geometry threads shared by all clients\n");
+	fprintf(stderr, "             (default is number of CPUs)\n");
+	fprintf(stderr, "  -m size  - keep up to given megabytes of served geometry in memory\n");
+	fprintf(stderr, "             (default 256, 0 disables)\n");
+	fprintf(stderr, "  -c path  - cache generated geometry in given directory, so it's\n");
+	fprintf(stderr, "             reused by next runs on the same data\n");
+	fprintf(stderr, "  -t path  - place objects on terrain from SRTM data in given directory\n");
+	fprintf(stderr, "  -f tags  - only load ways with any of given tags, either key or\n");
+	fprintf(stderr, "             key=value, separated by commas\n");
+	fprintf(stderr, "  -b bbox  - only load ways within given bounding box\n");
+	fprintf(stderr, "  -p path  - only load ways within polygon from given .poly file\n");
+	fprintf(stderr, "  -R       - drop relations after multipolygons are made of them\n");
+	exit(1);
+}
+
+static bool HasSuffix(const char* str, const char* suffix) {
+	size_t len = strlen(str);
+	size_t suffixlen = strlen(suffix);
+	return len > suffixlen && strcmp(str + len - suffixlen, suffix) == 0;
+}
+
+/* osmosis polygon format: name, then sections of "lon lat" lines
+ * terminated by END; only first outer ring is used */
+static void LoadPolyFile(const char* path, std::vector<Vector2i>& polygon) {
+	std::ifstream file(path);
+	if (!file)
+		throw Exception() << "cannot open polygon file " << path;
+
+	std::string line;
+	std::getline(file, line);
+
+	bool in_ring = false;
+	while (std::getline(file, line)) {
+		std::istringstream stream(line);
+		std::string word;
+		if (!(stream >> word))
+			continue;
+
+		if (!in_ring) {
+			if (word == "END")
+				break;
+			in_ring = word[0] != '!';
+			if (!in_ring)
+				throw Exception() << "hole before outer ring in " << path;
+			continue;
+		}
+
+		if (word == "END")
+			break;
+
+		double lon, lat;
+		std::istringstream coords(line);
+		if (!(coords >> lon >> lat))
+			throw Exception() << "bad coordinates in " << path << ": " << line;
+		polygon.push_back(Vector2i(lon * GEOM_UNITSINDEGREE, lat * GEOM_UNITSINDEGREE));
+	}
+
+	if (polygon.size() < 3)
+		throw Exception() << "no polygon in " << path;
+}
+
+static void SplitTags(const char* str, std::vector<std::string>& tags) {
+	std::istringstream stream(str);
+	std::string tag;
+	while (std::getline(stream, tag, ','))
+		if (!tag.empty())
+			tags.push_back(tag);
+}
+
+int real_main(int argc, char** argv) {
+	const char* progname = argv[0];
+
+	Trace::Init();
+
+	char default_address[16];
+	snprintf(default_address, sizeof(default_address), "%d", GeometryProtocol::DEFAULT_PORT);
+
+	const char* address = default_address;
+	const char* srtmpath = NULL;
+	const char* cachedir = NULL;
+	int nthreads = 0;
+	int cachesize = 256;
+	PreloadedXmlDatasource::LoadFilter filter;
+	std::string filter_id;
+	double minlon, minlat, maxlon, maxlat;
+
+	int c;
+	while ((c = getopt(argc, argv, "l:j:m:c:t:f:b:p:R")) != -1) {
+		switch (c) {
+		case 'l': address = optarg; break;
+		case 'j': nthreads = (int)strtol(optarg, NULL, 10); break;
+		case 'm': cachesize = (int)strtol(optarg, NULL, 10); break;
+		case 'c': cachedir = optarg; break;
+		case 't': srtmpath = optarg; break;
+		case 'f': SplitTags(optarg, filter.tags); filter_id += std::string("|f:") + optarg; break;
+		case 'b':
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat) != 4)
+				usage(progname);
+			filter.clip_bbox = BBoxi(minlon * GEOM_UNITSINDEGREE, minlat * GEOM_UNITSINDEGREE, maxlon * GEOM_UNITSINDEGREE, maxlat * GEOM_UNITSINDEGREE);
+			filter_id += std::string("|b:") + optarg;
+			break;
+		case 'p': LoadPolyFile(optarg, filter.clip_polygon); filter_id += std::string("|p:") + GeometryDiskCache::GetFileId(optarg); break;
+		case 'R': filter.drop_relations = true; break;
+		default:
+			usage(progname);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nthreads < 0 || cachesize < 0)
+		usage(progname);
+
+	const char* infile = argv[0];
+
+	if (!filter.IsEmpty() && HasSuffix(infile, ".snapshot"))
+		throw Exception() << "load filters can't be applied to snapshots";
+
+	/* failed writes are handled per connection */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* listen before loading, so address problems show up early */
+	int listen_fd = GeometryProtocol::Listen(address);
+
+	fprintf(stderr, "Loading %s...\n", infile);
+	Timer t;
+	std::auto_ptr<OsmDatasource> osm_datasource;
+	if (HasSuffix(infile, ".snapshot")) {
+		MmapOsmDatasource* datasource = new MmapOsmDatasource;
+		osm_datasource.reset(datasource);
+		datasource->Load(infile);
+	} else if (HasSuffix(infile, ".pbf")) {
+		PreloadedPbfDatasource* datasource = new PreloadedPbfDatasource(PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::OVERVIEW_LAYERS | PreloadedXmlDatasource::SPATIAL_LAYOUT | PreloadedXmlDatasource::NODE_TAGS);
+		osm_datasource.reset(datasource);
+		datasource->SetLoadFilter(filter);
+		datasource->Load(infile);
+	} else {
+		PreloadedXmlDatasource* datasource = new PreloadedXmlDatasource(PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::OVERVIEW_LAYERS | PreloadedXmlDatasource::SPATIAL_LAYOUT | PreloadedXmlDatasource::PIPELINED_LOAD | PreloadedXmlDatasource::FAST_XML_SCAN | PreloadedXmlDatasource::NODE_TAGS);
+		osm_datasource.reset(datasource);
+		datasource->SetLoadFilter(filter);
+		datasource->Load(infile);
+	}
+	fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
+
+	std::auto_ptr<HeightmapDatasource> heightmap;
+	if (srtmpath)
+		heightmap.reset(new SRTMDatasource(srtmpath, SRTMDatasource::MMAP_CHUNKS));
+	else
+		heightmap.reset(new DummyHeightmap);
+
+	/* concurrency comes from server threads processing requests
+	 * in parallel, so each request is generated in single thread */
+	GeometryGenerator geometry_generator(*osm_datasource, *heightmap);
+	const GeometryDatasource* geometry_source = &geometry_generator;
+
+	/* so requests don't wait for terrain to be sampled */
+	if (srtmpath) {
+		t.Count();
+		geometry_generator.PrecomputeElevations();
+		fprintf(stderr, "Building elevations sampled in %.3f seconds\n", t.Count());
+	}
+
+	std::auto_ptr<GeometryDiskCache> geometry_disk_cache;
+	if (cachedir) {
+		std::string dataset_id = GeometryDiskCache::GetFileId(infile);
+		if (dataset_id.empty()) {
+			fprintf(stderr, "Cannot stat %s, not using geometry cache\n", infile);
+		} else {
+			/* terrain affects geometry as well */
+			if (srtmpath)
+				dataset_id += std::string("|srtm:") + srtmpath;
+			/* and so does filtering */
+			dataset_id += filter_id;
+			geometry_disk_cache.reset(new GeometryDiskCache(*geometry_source, cachedir, dataset_id));
+			geometry_source = geometry_disk_cache.get();
+		}
+	}
+
+	/* tiles near popular places are requested by many clients */
+	std::auto_ptr<GeometryCache> geometry_cache;
+	if (cachesize > 0) {
+		geometry_cache.reset(new GeometryCache(*geometry_source, (size_t)cachesize*1024*1024));
+		geometry_source = geometry_cache.get();
+	}
+
+	GeometryServer server(*geometry_source, osm_datasource->GetMaxHeight(), nthreads);
+
+	fprintf(stderr, "Serving geometry on %s with %d threads\n", address, server.GetThreads());
+	server.Run(listen_fd);
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	try {
+		return real_main(argc, argv);
+	} catch (std::exception &e) {
+		fprintf(stderr, "Exception: %s\n", e.what());
+	} catch (...) {
+		fprintf(stderr, "Unknown exception\n");
+	}
+
+	return 1;
+}
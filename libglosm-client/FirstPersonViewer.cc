@@ -31,13 +31,13 @@
 
 #include <stdio.h>
 
-FirstPersonViewer::FirstPersonViewer(): heightmap_(NULL), pos_(), landscape_height_(0), yaw_(0), pitch_(0), fov_(90.0), aspect_(1.0) {
+FirstPersonViewer::FirstPersonViewer(): heightmap_(NULL), pos_(), landscape_height_(0), velocity_(), yaw_(0), pitch_(0), fov_(90.0), aspect_(1.0) {
 }
 
-FirstPersonViewer::FirstPersonViewer(const Vector3i& pos): heightmap_(NULL), pos_(pos), landscape_height_(0), yaw_(0), pitch_(0), fov_(90.0), aspect_(1.0) {
+FirstPersonViewer::FirstPersonViewer(const Vector3i& pos): heightmap_(NULL), pos_(pos), landscape_height_(0), velocity_(), yaw_(0), pitch_(0), fov_(90.0), aspect_(1.0) {
 }
 
-FirstPersonViewer::FirstPersonViewer(const Vector3i& pos, float yaw, float pitch): heightmap_(NULL), pos_(pos), landscape_height_(0), yaw_(yaw), pitch_(pitch), fov_(90.0), aspect_(1.0) {
+FirstPersonViewer::FirstPersonViewer(const Vector3i& pos, float yaw, float pitch): heightmap_(NULL), pos_(pos), landscape_height_(0), velocity_(), yaw_(yaw), pitch_(pitch), fov_(90.0), aspect_(1.0) {
 }
 
 void FirstPersonViewer::SetupViewerMatrix(const Projection& projection) const {
@@ -72,6 +72,17 @@ Vector3i FirstPersonViewer::GetPos(const Projection& /* unused*/) const {
 	return pos_;
 }
 
+bool FirstPersonViewer::GetViewCone(Vector2f& direction, float& halfangle) const {
+	direction = Vector2f(sin(yaw_), cos(yaw_));
+	halfangle = atan(tan(fov_ / 2.0f) * aspect_);
+	return true;
+}
+
+bool FirstPersonViewer::GetVelocity(Vector3f& velocity) const {
+	velocity = velocity_;
+	return true;
+}
+
 void FirstPersonViewer::SetFov(float fov) {
 	fov_ = fov;
 }
@@ -103,26 +114,38 @@ void FirstPersonViewer::Move(int flags, float speed, float time) {
 	Vector3f right = dir.CrossProduct(worldup).Normalized();
 	Vector3f relup = right.CrossProduct(dir).Normalized();
 
+	Vector3f velocity;
 	if (flags & FORWARD)
-		pos_ += dirbasis * dir * speed * time;
+		velocity += dir;
 	if (flags & BACKWARD)
-		pos_ -= dirbasis * dir * speed * time;
+		velocity -= dir;
 	if (flags & LEFT)
-		pos_ -= dirbasis * right * speed * time;
+		velocity -= right;
 	if (flags & RIGHT)
-		pos_ += dirbasis * right * speed * time;
+		velocity += right;
 	if (flags & UP)
-		pos_ += dirbasis * relup * speed * time;
+		velocity += relup;
 	if (flags & DOWN)
-		pos_ -= dirbasis * relup * speed * time;
+		velocity -= relup;
 	if (flags & HIGHER)
-		pos_ += dirbasis * worldup * speed * time;
+		velocity += worldup;
 	if (flags & LOWER)
-		pos_ -= dirbasis * worldup * speed * time;
+		velocity -= worldup;
+
+	velocity_ = velocity * speed;
+
+	if (flags == 0)
+		return;
+
+	pos_ += dirbasis * velocity_ * time;
 
 	FixPosition();
 }
 
+void FirstPersonViewer::SetVelocity(const Vector3f& velocity) {
+	velocity_ = velocity;
+}
+
 void FirstPersonViewer::FixPosition() {
 	/* Update landscape height */
 	if (heightmap_)
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/FrameScheduler.hh>
+
+FrameScheduler::Statistics::Statistics() : frames(0), overruns(0), time(0.0), max_time(0.0f) {
+}
+
+FrameScheduler::FrameScheduler(float budget) : budget_(budget), clients_(0), frame_(0), frame_time_(0.0) {
+}
+
+void FrameScheduler::BeginFrame() {
+	if (stats_.frames > 0) {
+		if (frame_time_ > budget_)
+			stats_.overruns++;
+		if (frame_time_ > stats_.max_time)
+			stats_.max_time = frame_time_;
+	}
+
+	frame_++;
+	frame_time_ = 0.0;
+	stats_.frames++;
+}
+
+void FrameScheduler::Charge(double seconds) {
+	frame_time_ += seconds;
+	stats_.time += seconds;
+}
+
+unsigned int FrameScheduler::GetFrame() const {
+	return frame_;
+}
+
+float FrameScheduler::GetShare() const {
+	return clients_ > 1 ? budget_ / clients_ : budget_;
+}
+
+void FrameScheduler::SetBudget(float budget) {
+	budget_ = budget;
+}
+
+void FrameScheduler::Attach() {
+	clients_++;
+}
+
+void FrameScheduler::Detach() {
+	clients_--;
+}
+
+void FrameScheduler::GetStatistics(Statistics& stats) const {
+	stats = stats_;
+}
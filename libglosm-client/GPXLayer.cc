@@ -24,6 +24,7 @@
 #include <glosm/HeightmapDatasource.hh>
 #include <glosm/GPXTile.hh>
 #include <glosm/Projection.hh>
+#include <glosm/TileShader.hh>
 #include <glosm/Viewer.hh>
 
 #include <glosm/util/gl.h>
@@ -46,6 +47,19 @@ void GPXLayer::Render(const Viewer& viewer) {
 	glShadeModel(GL_FLAT);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+	if (shader_) {
+		/* tracks are not lit */
+		glDepthFunc(GL_LEQUAL);
+		shader_->Begin();
+		shader_->SetColor(1.0f, 0.0f, 1.0f, 0.5f);
+		shader_->SetPointSize(3.0f);
+
+		TileManager::Render(viewer);
+
+		shader_->End();
+		return;
+	}
+
 	/* Lighting */
 	GLfloat global_ambient[] = {0.0, 0.0, 0.0, 1.0};
 	GLfloat light_position[] = {-0.2, -0.777, 0.63, 0.0};
@@ -27,25 +27,75 @@
 
 #include <glosm/Projection.hh>
 #include <glosm/VertexBuffer.hh>
+#include <glosm/TileShader.hh>
 
-GPXTile::GPXTile(const Projection& projection, const GPXDatasource& datasource, const HeightmapDatasource& heightmap, const Vector2i& ref, const BBoxi& bbox) : Tile(ref), size_(0) {
-	std::vector<Vector3i> points;
-	datasource.GetPoints(points, bbox);
+#include <glosm/geomath.h>
 
-	if (!points.empty()) {
+#include <algorithm>
+#include <cmath>
+
+GPXTile::GPXTile(const Projection& projection, const GPXDatasource& datasource, const HeightmapDatasource& heightmap, const Vector2i& ref, const BBoxi& bbox) : Tile(ref), pairs_count_(0), batch_(NULL), size_(0) {
+	/* tracks are simplified for tile level, so distant tiles,
+	 * which are coarser, get less points */
+	int level = (int)floor(log((double)GEOM_LONSPAN / std::max((osmlong_t)1, (osmlong_t)bbox.right - bbox.left)) / log(2.0) + 0.5);
+
+	std::vector<Vector3i> track;
+	std::vector<size_t> lengths;
+	datasource.GetTracks(track, lengths, bbox, level);
+
+	if (!track.empty()) {
 		points_.reset(new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER));
 
-		points_->Data().reserve(2 * points.size());
-		for (std::vector<Vector3i>::const_iterator i = points.begin(); i != points.end(); ++i) {
-			points_->Data().push_back(projection.Project(*i, ref));
-			points_->Data().push_back(projection.Project(Vector3i(i->x, i->y, heightmap.GetHeight(*i)), ref));
+		/* last points of polylines may belong to neighbor tiles */
+		std::vector<Vector2i> ground;
+		for (std::vector<Vector3i>::const_iterator i = track.begin(); i != track.end(); ++i)
+			if (bbox.Contains(*i))
+				ground.push_back(*i);
+
+		std::vector<osmint_t> heights(ground.size());
+		if (!ground.empty())
+			heightmap.GetHeights(&ground[0], ground.size(), &heights[0]);
+
+		/* each point is paired with its projection onto the
+		 * ground, and these pairs are followed by polylines */
+		std::vector<Vector3i> vertices;
+		vertices.reserve(2 * ground.size() + track.size());
+		for (size_t i = 0, n = 0; i < track.size(); ++i) {
+			if (bbox.Contains(track[i])) {
+				vertices.push_back(track[i]);
+				vertices.push_back(Vector3i(track[i].x, track[i].y, heights[n++]));
+			}
+		}
+		pairs_count_ = ground.size();
+
+		size_t first = vertices.size();
+		for (std::vector<size_t>::const_iterator i = lengths.begin(); i != lengths.end(); ++i) {
+			if (*i > 1) {
+				strip_firsts_.push_back(first);
+				strip_counts_.push_back(*i);
+			}
+			first += *i;
+		}
+		vertices.insert(vertices.end(), track.begin(), track.end());
+
+		min_height_ = max_height_ = vertices.front().z;
+		for (std::vector<Vector3i>::const_iterator i = vertices.begin(); i != vertices.end(); ++i) {
+			min_height_ = std::min(min_height_, i->z);
+			max_height_ = std::max(max_height_, i->z);
 		}
 
+		points_->Data().resize(vertices.size());
+		projection.ProjectMany(&vertices[0], vertices.size(), ref, &points_->Data()[0]);
+
 		size_ = points_->GetFootprint();
 	}
 }
 
 GPXTile::~GPXTile() {
+	if (batch_) {
+		batch_->Remove(points_handle_);
+		batch_->Remove(lines_handle_);
+	}
 }
 
 void GPXTile::Render() {
@@ -60,15 +110,95 @@ void GPXTile::Render() {
 		glEnableClientState(GL_VERTEX_ARRAY);
 
 		glVertexPointer(3, GL_FLOAT, sizeof(Vector3f)*2, BUFFER_OFFSET(0));
-		glDrawArrays(GL_POINTS, 0, points_->GetSize()/2);
+		glDrawArrays(GL_POINTS, 0, pairs_count_);
 
 		glVertexPointer(3, GL_FLOAT, sizeof(Vector3f), BUFFER_OFFSET(0));
-		glDrawArrays(GL_LINES, 0, points_->GetSize());
+		glDrawArrays(GL_LINES, 0, pairs_count_ * 2);
+
+		for (size_t i = 0; i < strip_firsts_.size(); ++i)
+			glDrawArrays(GL_LINE_STRIP, strip_firsts_[i], strip_counts_[i]);
 
 		glDisableClientState(GL_VERTEX_ARRAY);
 	}
 }
 
+void GPXTile::Render(TileShader& /* unused */) {
+	if (!points_.get())
+		return;
+
+	if (points_array_.Bind()) {
+		points_->Bind();
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vector3f)*2, 0);
+	}
+	glDrawArrays(GL_POINTS, 0, pairs_count_);
+
+	if (lines_array_.Bind()) {
+		points_->Bind();
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vector3f), 0);
+	}
+	glDrawArrays(GL_LINES, 0, pairs_count_ * 2);
+
+	for (size_t i = 0; i < strip_firsts_.size(); ++i)
+		glDrawArrays(GL_LINE_STRIP, strip_firsts_[i], strip_counts_[i]);
+}
+
+void GPXTile::Render(TileBatch& batch, const float modelview[16]) {
+	if (!batch_)
+		Upload(batch);
+
+	int instance = batch.AddInstance(modelview, NULL);
+	batch.Draw(points_handle_, instance);
+	batch.Draw(lines_handle_, instance);
+}
+
 size_t GPXTile::GetSize() const {
 	return size_;
 }
+
+size_t GPXTile::GetUploadSize() const {
+	size_t size = 0;
+	if (points_.get())
+		size += points_->GetPendingFootprint();
+	return size;
+}
+
+void GPXTile::Upload() {
+	if (points_.get())
+		points_->Freeze();
+}
+
+void GPXTile::Upload(TileBatch& batch) {
+	static const GLfloat color[4] = { 1.0f, 0.0f, 1.0f, 0.5f };
+
+	if (batch_)
+		return;
+	batch_ = &batch;
+
+	if (!points_.get())
+		return;
+
+	/* batch only draws indexed geometry, so points and lines
+	 * get index lists over the same vertices; as strips can't
+	 * be restarted there, polylines are drawn as lines too */
+	std::vector<GLuint> point_indices;
+	for (GLsizei i = 0; i < pairs_count_; ++i)
+		point_indices.push_back(i * 2);
+
+	std::vector<GLuint> indices;
+	for (GLsizei i = 0; i < pairs_count_ * 2; ++i)
+		indices.push_back(i);
+	for (size_t i = 0; i < strip_firsts_.size(); ++i) {
+		for (GLint j = strip_firsts_[i]; j < strip_firsts_[i] + strip_counts_[i] - 1; ++j) {
+			indices.push_back(j);
+			indices.push_back(j + 1);
+		}
+	}
+
+	int points_group = batch.GetGroup(TileBatch::POSITION_FLOAT, GL_POINTS, GL_UNSIGNED_INT, false, color);
+	points_handle_ = batch.Add(points_group, points_->Data().data(), points_->GetSize(), point_indices.data(), point_indices.size());
+
+	int lines_group = batch.GetGroup(TileBatch::POSITION_FLOAT, GL_LINES, GL_UNSIGNED_INT, false, color);
+	lines_handle_ = batch.Add(lines_group, points_->Data().data(), points_->GetSize(), indices.data(), indices.size());
+
+	points_.reset(NULL);
+}
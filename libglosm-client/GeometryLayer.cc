@@ -24,14 +24,44 @@
 #include <glosm/GeometryDatasource.hh>
 #include <glosm/GeometryTile.hh>
 #include <glosm/Projection.hh>
+#include <glosm/TileShader.hh>
 #include <glosm/Viewer.hh>
 
 #include <glosm/util/gl.h>
 
-GeometryLayer::GeometryLayer(const Projection projection, const GeometryDatasource& datasource): TileManager(projection), projection_(projection), datasource_(datasource) {
+#include <memory>
+
+/**
+ * Tile waiting for geometry of asynchronous request
+ */
+class GeometryTileRequest : public TileManager::TileRequest {
+protected:
+	const Projection& projection_;
+	std::auto_ptr<GeometryRequest> request_;
+	BBoxi bbox_;
+	int tile_flags_;
+
+public:
+	GeometryTileRequest(const Projection& projection, GeometryRequest* request, const BBoxi& bbox, int tile_flags) : projection_(projection), request_(request), bbox_(bbox), tile_flags_(tile_flags) {
+	}
+
+	virtual bool IsReady() const {
+		return request_->IsReady();
+	}
+
+	virtual Tile* Finish() {
+		Geometry geom;
+		request_->Wait(geom);
+		return new GeometryTile(projection_, geom, bbox_.GetCenter(), bbox_, tile_flags_);
+	}
+};
+
+GeometryLayer::GeometryLayer(const Projection projection, const GeometryDatasource& datasource): TileManager(projection), projection_(projection), datasource_(datasource), tile_flags_(0), notifier_(*this) {
 }
 
 GeometryLayer::~GeometryLayer() {
+	/* requests notify notifier_ */
+	StopLoading();
 }
 
 void GeometryLayer::Render(const Viewer& viewer) {
@@ -53,6 +83,22 @@ void GeometryLayer::Render(const Viewer& viewer) {
 	GLfloat light_ambient[] = {0.33, 0.33, 0.33, 1.0};
 	GLfloat material_diffuse[] = {1.0, 1.0, 1.0, 0.9};
 
+	if (shader_) {
+		shader_->Begin();
+		shader_->SetLight(light_position, light_ambient, light_diffuse, material_diffuse);
+
+		/* polygon offset is only needed for convex geometry,
+		 * but doesn't affect lines, so is set for whole layer */
+		glPolygonOffset(1.0, 1.0);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+
+		TileManager::Render(viewer);
+
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		shader_->End();
+		return;
+	}
+
 	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, global_ambient);
 
 	glLightfv(GL_LIGHT0, GL_POSITION, light_position);
@@ -69,5 +115,13 @@ void GeometryLayer::Render(const Viewer& viewer) {
 Tile* GeometryLayer::SpawnTile(const BBoxi& bbox, int flags) const {
 	Geometry geom;
 	datasource_.GetGeometry(geom, bbox, flags);
-	return new GeometryTile(projection_, geom, bbox.GetCenter(), bbox);
+	return new GeometryTile(projection_, geom, bbox.GetCenter(), bbox, tile_flags_);
+}
+
+TileManager::TileRequest* GeometryLayer::RequestTile(const BBoxi& bbox, int flags) const {
+	return new GeometryTileRequest(projection_, datasource_.Submit(bbox, flags, &notifier_), bbox, tile_flags_);
+}
+
+void GeometryLayer::SetTileFlags(int flags) {
+	tile_flags_ = flags;
 }
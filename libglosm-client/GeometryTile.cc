@@ -22,14 +22,61 @@
 
 #include <glosm/GeometryTile.hh>
 
-#include <glosm/Projection.hh>
+#include <glosm/MercatorProjection.hh>
+#include <glosm/SphericalProjection.hh>
 #include <glosm/Geometry.hh>
+#include <glosm/GeometryOperations.hh>
+#include <glosm/Model.hh>
+#include <glosm/ModelInstances.hh>
 #include <glosm/VertexBuffer.hh>
+#include <glosm/TileShader.hh>
+#include <glosm/MeshOptimizer.hh>
 
-GeometryTile::GeometryTile(const Projection& projection, const Geometry& geometry, const Vector2i& ref, const BBoxi& bbox) : Tile(ref), size_(0) {
+#include <algorithm>
+
+/* extends height range with z of given vertices */
+static void IncludeHeights(const Geometry::VertexVector& vertices, osmint_t& min, osmint_t& max) {
+	for (Geometry::VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i) {
+		min = std::min(min, i->z);
+		max = std::max(max, i->z);
+	}
+}
+
+/* extends height range with extents of instanced models */
+static void IncludeInstanceHeights(const Geometry::InstanceVector& instances, osmint_t& min, osmint_t& max) {
+	for (Geometry::InstanceVector::const_iterator i = instances.begin(); i != instances.end(); ++i) {
+		const Model& model = Model::Get(i->model);
+		min = std::min(min, i->pos.z + (osmint_t)(model.GetMinHeight() * GEOM_UNITSINMETER));
+		max = std::max(max, i->pos.z + (osmint_t)(model.GetMaxHeight() * GEOM_UNITSINMETER));
+	}
+}
+
+GeometryTile::GeometryTile(const Projection& projection, const Geometry& geometry, const Vector2i& ref, const BBoxi& bbox, int flags) : Tile(ref), convex_mode_(GL_TRIANGLES), quantized_(false), batch_(NULL), size_(0) {
+	min_height_ = std::numeric_limits<osmint_t>::max();
+	max_height_ = std::numeric_limits<osmint_t>::min();
+	IncludeHeights(geometry.GetLinesVertices(), min_height_, max_height_);
+	IncludeHeights(geometry.GetConvexVertices(), min_height_, max_height_);
+	IncludeInstanceHeights(geometry.GetInstances(), min_height_, max_height_);
+	if (min_height_ > max_height_)
+		min_height_ = max_height_ = 0;
+
+	if (projection.Is<MercatorProjection>()) {
+		MercatorProjection::Projector projector(ref);
+		Build(projector, geometry, flags);
+	} else if (projection.Is<SphericalProjection>()) {
+		SphericalProjection::Projector projector(ref);
+		Build(projector, geometry, flags);
+	} else {
+		Projection::Projector projector(projection, ref);
+		Build(projector, geometry, flags);
+	}
+}
+
+template <class PROJECTOR>
+void GeometryTile::Build(PROJECTOR& projector, const Geometry& geometry, int flags) {
 	if (!geometry.GetLinesLengths().empty()) {
 		lines_vertices_.reset(new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER));
-		lines_indices_.reset(new VertexBuffer<GLuint>(GL_ELEMENT_ARRAY_BUFFER));
+		lines_indices_.reset(new IndexBuffer);
 
 		const Geometry::VertexVector& vertices = geometry.GetLinesVertices();
 		const Geometry::LengthVector& lengths = geometry.GetLinesLengths();
@@ -45,7 +92,7 @@ GeometryTile::GeometryTile(const Projection& projection, const Geometry& geometr
 #endif
 
 			for (int j = 0; j < lengths[i]; ++j) {
-				lines_vertices_->Data().push_back(projection.Project(vertices[curpos + j], ref));
+				lines_vertices_->Data().push_back(projector(vertices[curpos + j]));
 			}
 
 			for (int j = 1; j < lengths[i]; ++j) {
@@ -56,34 +103,40 @@ GeometryTile::GeometryTile(const Projection& projection, const Geometry& geometr
 			curpos += lengths[i];
 		}
 
-		size_ += lines_vertices_->GetFootprint() + lines_indices_->GetFootprint();
+		if (flags & WELD_VERTICES)
+			WeldLines(geometry);
+
+		lines_indices_->Pack();
+
 	}
 
 	if (!geometry.GetConvexLengths().empty()) {
 		convex_vertices_.reset(new VertexBuffer<Vertex>(GL_ARRAY_BUFFER));
-		convex_indices_.reset(new VertexBuffer<GLuint>(GL_ELEMENT_ARRAY_BUFFER));
+		convex_indices_.reset(new IndexBuffer);
 
 		const Geometry::VertexVector& vertices = geometry.GetConvexVertices();
 		const Geometry::LengthVector& lengths = geometry.GetConvexLengths();
 
-		convex_vertices_->Data().reserve(vertices.size());
-
-		for (unsigned int i = 0, curpos = 0; i < lengths.size(); ++i) {
+		size_t max_vertices = (size_t)-1;
 #if defined(WITH_GLES)
-			/* GL ES doesn't support VBOs larger than 65536 elements */
-			/* @todo split into multiple VBOs */
-			if (curpos + lengths[i] > 65536)
-				break;
+		/* GL ES doesn't support VBOs larger than 65536 elements */
+		/* @todo split into multiple VBOs */
+		max_vertices = 65536;
 #endif
 
-			for (int j = 0; j < lengths[i]; ++j) {
-				convex_vertices_->Data().push_back(Vertex(projection.Project(vertices[curpos + j], ref)));
-			}
+		size_t nvertices;
+		if (flags & TRIANGLE_STRIPS) {
+			convex_mode_ = GL_TRIANGLE_STRIP;
+			nvertices = geometry.GetConvexStrip(convex_indices_->Data(), max_vertices);
+		} else {
+			nvertices = geometry.GetConvexTriangles(convex_indices_->Data(), max_vertices);
+		}
+
+		convex_vertices_->Data().reserve(nvertices);
 
-			for (int j = 2; j < lengths[i]; ++j) {
-				convex_indices_->Data().push_back(curpos);
-				convex_indices_->Data().push_back(curpos + j - 1);
-				convex_indices_->Data().push_back(curpos + j);
+		for (unsigned int i = 0, curpos = 0; curpos < nvertices; ++i) {
+			for (int j = 0; j < lengths[i]; ++j) {
+				convex_vertices_->Data().push_back(Vertex(projector(vertices[curpos + j])));
 			}
 
 			CalcFanNormal(&convex_vertices_->Data()[curpos], lengths[i]);
@@ -91,11 +144,152 @@ GeometryTile::GeometryTile(const Projection& projection, const Geometry& geometr
 			curpos += lengths[i];
 		}
 
-		size_ += convex_vertices_->GetFootprint() + convex_indices_->GetFootprint();
+		if (flags & WELD_VERTICES)
+			WeldConvex(geometry);
+
+		convex_indices_->Pack();
+
 	}
+
+	if (flags & QUANTIZE_VERTICES)
+		Quantize();
+
+	if (lines_vertices_.get())
+		size_ += lines_vertices_->GetFootprint();
+	if (packed_lines_vertices_.get())
+		size_ += packed_lines_vertices_->GetFootprint();
+	if (lines_indices_.get())
+		size_ += lines_indices_->GetFootprint();
+	if (convex_vertices_.get())
+		size_ += convex_vertices_->GetFootprint();
+	if (packed_convex_vertices_.get())
+		size_ += packed_convex_vertices_->GetFootprint();
+	if (convex_indices_.get())
+		size_ += convex_indices_->GetFootprint();
+
+	if (!geometry.GetInstances().empty())
+		BuildInstances(projector, geometry);
+}
+
+template <class PROJECTOR>
+void GeometryTile::BuildInstances(PROJECTOR& projector, const Geometry& geometry) {
+	/* models are placed with a linear transform, which is taken
+	 * from projected offsets along model axes; these are long
+	 * enough to not lose precision and short enough for the
+	 * projection to be linear at model scale */
+	static const double step = 100.0;
+
+	models_.reset(new ModelInstances);
+
+	const Geometry::InstanceVector& instances = geometry.GetInstances();
+	for (Geometry::InstanceVector::const_iterator i = instances.begin(); i != instances.end(); ++i) {
+		Vector3d axes[3] = {
+			Vector3d(i->direction.x, i->direction.y, 0.0),
+			Vector3d(-i->direction.y, i->direction.x, 0.0),
+			Vector3d(0.0, 0.0, 1.0),
+		};
+
+		Vector3f origin = projector(i->pos);
+
+		GLfloat matrix[16];
+		for (int axis = 0; axis < 3; ++axis) {
+			Vector3f column = (projector(FromLocalMetric(axes[axis] * step, i->pos)) - origin) * (float)(1.0 / step);
+			matrix[axis * 4 + 0] = column.x;
+			matrix[axis * 4 + 1] = column.y;
+			matrix[axis * 4 + 2] = column.z;
+			matrix[axis * 4 + 3] = 0.0f;
+		}
+		matrix[12] = origin.x;
+		matrix[13] = origin.y;
+		matrix[14] = origin.z;
+		matrix[15] = 1.0f;
+
+		models_->Add(i->model, matrix);
+	}
+
+	models_->Build();
+	size_ += models_->GetSize();
 }
 
 GeometryTile::~GeometryTile() {
+	if (batch_) {
+		batch_->Remove(lines_handle_);
+		batch_->Remove(convex_handle_);
+	}
+}
+
+void GeometryTile::WeldLines(const Geometry& geometry) {
+	/* vertex array may be a prefix of geometry ones, see GLES limit */
+	const Geometry::VertexVector& vertices = geometry.GetLinesVertices();
+	std::vector<Vector3f>& data = lines_vertices_->Data();
+
+	std::vector<MeshOptimizer::WeldKey> keys;
+	keys.reserve(data.size());
+	for (size_t i = 0; i < data.size(); ++i)
+		keys.push_back(MeshOptimizer::WeldKey(vertices[i]));
+
+	std::vector<unsigned int> remap;
+	size_t count = MeshOptimizer::BuildWeldMap(keys, remap);
+	MeshOptimizer::RemapVertices(data, lines_indices_->Data(), remap, count);
+}
+
+void GeometryTile::WeldConvex(const Geometry& geometry) {
+	const Geometry::VertexVector& vertices = geometry.GetConvexVertices();
+	std::vector<Vertex>& data = convex_vertices_->Data();
+	std::vector<GLuint>& indices = convex_indices_->Data();
+
+	std::vector<MeshOptimizer::WeldKey> keys;
+	keys.reserve(data.size());
+	for (size_t i = 0; i < data.size(); ++i)
+		keys.push_back(MeshOptimizer::WeldKey(vertices[i], data[i].norm));
+
+	std::vector<unsigned int> remap;
+	size_t count = MeshOptimizer::BuildWeldMap(keys, remap);
+	MeshOptimizer::RemapVertices(data, indices, remap, count);
+
+	/* strips are already cache friendly */
+	if (convex_mode_ == GL_TRIANGLES)
+		MeshOptimizer::OptimizeVertexCache(indices, data.size());
+
+	count = MeshOptimizer::BuildFetchMap(indices, data.size(), remap);
+	MeshOptimizer::RemapVertices(data, indices, remap, count);
+}
+
+void GeometryTile::Quantize() {
+	/* single transform for both lines and polygons */
+	if (lines_vertices_.get())
+		for (std::vector<Vector3f>::const_iterator i = lines_vertices_->Data().begin(); i != lines_vertices_->Data().end(); ++i)
+			quantizer_.Include(*i);
+	if (convex_vertices_.get())
+		for (std::vector<Vertex>::const_iterator i = convex_vertices_->Data().begin(); i != convex_vertices_->Data().end(); ++i)
+			quantizer_.Include(i->pos);
+
+	quantizer_.Prepare();
+	quantized_ = true;
+
+	if (lines_vertices_.get()) {
+		packed_lines_vertices_.reset(new VertexBuffer<PackedPosition>(GL_ARRAY_BUFFER));
+		packed_lines_vertices_->Data().resize(lines_vertices_->Data().size());
+		for (size_t i = 0; i < lines_vertices_->Data().size(); ++i) {
+			PackedPosition& packed = packed_lines_vertices_->Data()[i];
+			quantizer_.QuantizePosition(lines_vertices_->Data()[i], packed.pos);
+			packed.pos[3] = 0;
+		}
+		lines_vertices_.reset(NULL);
+	}
+
+	if (convex_vertices_.get()) {
+		packed_convex_vertices_.reset(new VertexBuffer<PackedVertex>(GL_ARRAY_BUFFER));
+		packed_convex_vertices_->Data().resize(convex_vertices_->Data().size());
+		for (size_t i = 0; i < convex_vertices_->Data().size(); ++i) {
+			PackedVertex& packed = packed_convex_vertices_->Data()[i];
+			quantizer_.QuantizePosition(convex_vertices_->Data()[i].pos, packed.pos);
+			VertexQuantizer::QuantizeNormal(convex_vertices_->Data()[i].norm, packed.norm);
+			packed.pos[3] = 0;
+			packed.norm[3] = 0;
+		}
+		convex_vertices_.reset(NULL);
+	}
 }
 
 void GeometryTile::CalcFanNormal(Vertex* vertices, int count) {
@@ -114,23 +308,36 @@ void GeometryTile::CalcFanNormal(Vertex* vertices, int count) {
 }
 
 void GeometryTile::Render() {
-	if (lines_vertices_.get()) {
-		glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
+	bool quantized = packed_lines_vertices_.get() || packed_convex_vertices_.get();
+	if (quantized) {
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		quantizer_.Apply();
+		glEnable(GL_NORMALIZE);
+	}
 
-		lines_vertices_->Bind();
+	if (lines_indices_.get()) {
+		glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
 
 		glEnableClientState(GL_VERTEX_ARRAY);
-		glVertexPointer(3, GL_FLOAT, sizeof(Vector3f), BUFFER_OFFSET(0));
+		if (packed_lines_vertices_.get()) {
+			packed_lines_vertices_->Bind();
+			glVertexPointer(3, GL_SHORT, sizeof(PackedPosition), BUFFER_OFFSET(0));
+		} else {
+			lines_vertices_->Bind();
+			glVertexPointer(3, GL_FLOAT, sizeof(Vector3f), BUFFER_OFFSET(0));
+		}
+
+		lines_indices_->Bind();
+		glDrawElements(GL_LINES, lines_indices_->GetSize(), lines_indices_->GetType(), BUFFER_OFFSET(0));
+		lines_indices_->UnBind();
 
-//		lines_indices_->Bind();
-//		glDrawElements(GL_LINES, lines_indices_->GetSize(), GL_UNSIGNED_INT, 0);
-		glDrawElements(GL_LINES, lines_indices_->GetSize(), GL_UNSIGNED_INT, lines_indices_->Data().data());
-//		lines_indices_->UnBind();
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 		glDisableClientState(GL_VERTEX_ARRAY);
 	}
 
-	if (convex_vertices_.get()) {
+	if (convex_indices_.get()) {
 		/* zpass */
 		/*glColor4f(0.0f, 0.0f, 0.0f, 0.0f);
 		triangles_->Render();
@@ -142,22 +349,27 @@ void GeometryTile::Render() {
 		glEnable(GL_LIGHTING);
 		glEnable(GL_LIGHT0);
 
-		convex_vertices_->Bind();
-
 		glEnableClientState(GL_VERTEX_ARRAY);
-		glVertexPointer(3, GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(0));
-
 		glEnableClientState(GL_NORMAL_ARRAY);
-		glNormalPointer(GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(12));
+		if (packed_convex_vertices_.get()) {
+			packed_convex_vertices_->Bind();
+			glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), BUFFER_OFFSET(0));
+			glNormalPointer(GL_BYTE, sizeof(PackedVertex), BUFFER_OFFSET(8));
+		} else {
+			convex_vertices_->Bind();
+			glVertexPointer(3, GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(0));
+			glNormalPointer(GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(12));
+		}
 
 		/* XXX: since we can't do PolygonOffset for lines, we offset all polygons instead */
 		glPolygonOffset(1.0, 1.0);
 		glEnable(GL_POLYGON_OFFSET_FILL);
 
-//		convex_indices_->Bind();
-//		glDrawElements(GL_TRIANGLES, convex_indices_->GetSize(), GL_UNSIGNED_INT, 0);
-		glDrawElements(GL_TRIANGLES, convex_indices_->GetSize(), GL_UNSIGNED_INT, convex_indices_->Data().data());
-//		convex_indices_->UnBind();
+		convex_indices_->Bind();
+		glDrawElements(convex_mode_, convex_indices_->GetSize(), convex_indices_->GetType(), BUFFER_OFFSET(0));
+		convex_indices_->UnBind();
+
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 		glDisable(GL_POLYGON_OFFSET_FILL);
 
@@ -167,8 +379,144 @@ void GeometryTile::Render() {
 		glDisable(GL_LIGHT0);
 		glDisable(GL_LIGHTING);
 	}
+
+	if (quantized) {
+		glDisable(GL_NORMALIZE);
+		glPopMatrix();
+	}
+
+	if (models_.get())
+		models_->Render();
+}
+
+void GeometryTile::Render(TileShader& shader) {
+	bool quantized = packed_lines_vertices_.get() || packed_convex_vertices_.get();
+	shader.SetQuantizer(quantized ? &quantizer_ : NULL);
+
+	if (lines_indices_.get()) {
+		shader.SetLighting(false);
+		shader.SetColor(0.0f, 0.0f, 0.0f, 0.5f);
+
+		if (lines_array_.Bind()) {
+			if (packed_lines_vertices_.get()) {
+				packed_lines_vertices_->Bind();
+				VertexArray::SetAttribute(TileShader::POSITION, 3, GL_SHORT, false, sizeof(PackedPosition), 0);
+			} else {
+				lines_vertices_->Bind();
+				VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vector3f), 0);
+			}
+			lines_indices_->Bind();
+		}
+
+		glDrawElements(GL_LINES, lines_indices_->GetSize(), lines_indices_->GetType(), BUFFER_OFFSET(0));
+	}
+
+	if (convex_indices_.get()) {
+		shader.SetLighting(true);
+
+		if (convex_array_.Bind()) {
+			if (packed_convex_vertices_.get()) {
+				packed_convex_vertices_->Bind();
+				VertexArray::SetAttribute(TileShader::POSITION, 3, GL_SHORT, false, sizeof(PackedVertex), 0);
+				VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_BYTE, true, sizeof(PackedVertex), 8);
+			} else {
+				convex_vertices_->Bind();
+				VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vertex), 0);
+				VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_FLOAT, false, sizeof(Vertex), 12);
+			}
+			convex_indices_->Bind();
+		}
+
+		glDrawElements(convex_mode_, convex_indices_->GetSize(), convex_indices_->GetType(), BUFFER_OFFSET(0));
+	}
+
+	if (models_.get())
+		models_->Render(shader);
+}
+
+void GeometryTile::Render(TileBatch& batch, const float modelview[16]) {
+	if (!batch_)
+		Upload(batch);
+
+	int instance = batch.AddInstance(modelview, quantized_ ? &quantizer_ : NULL);
+	batch.Draw(lines_handle_, instance);
+	batch.Draw(convex_handle_, instance);
+
+	if (models_.get())
+		models_->Render(batch, modelview);
 }
 
 size_t GeometryTile::GetSize() const {
 	return size_;
 }
+
+size_t GeometryTile::GetUploadSize() const {
+	size_t size = 0;
+	if (lines_vertices_.get())
+		size += lines_vertices_->GetPendingFootprint();
+	if (lines_indices_.get())
+		size += lines_indices_->GetPendingFootprint();
+	if (convex_vertices_.get())
+		size += convex_vertices_->GetPendingFootprint();
+	if (convex_indices_.get())
+		size += convex_indices_->GetPendingFootprint();
+	if (packed_lines_vertices_.get())
+		size += packed_lines_vertices_->GetPendingFootprint();
+	if (packed_convex_vertices_.get())
+		size += packed_convex_vertices_->GetPendingFootprint();
+	if (models_.get())
+		size += models_->GetUploadSize();
+	return size;
+}
+
+void GeometryTile::Upload() {
+	if (lines_vertices_.get())
+		lines_vertices_->Freeze();
+	if (lines_indices_.get())
+		lines_indices_->Freeze();
+	if (convex_vertices_.get())
+		convex_vertices_->Freeze();
+	if (convex_indices_.get())
+		convex_indices_->Freeze();
+	if (packed_lines_vertices_.get())
+		packed_lines_vertices_->Freeze();
+	if (packed_convex_vertices_.get())
+		packed_convex_vertices_->Freeze();
+	if (models_.get())
+		models_->Upload();
+}
+
+void GeometryTile::Upload(TileBatch& batch) {
+	static const GLfloat lines_color[4] = { 0.0f, 0.0f, 0.0f, 0.5f };
+	static const GLfloat convex_color[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+	if (batch_)
+		return;
+	batch_ = &batch;
+
+	if (lines_indices_.get()) {
+		int group = batch.GetGroup(packed_lines_vertices_.get() ? TileBatch::POSITION_SHORT : TileBatch::POSITION_FLOAT, GL_LINES, lines_indices_->GetType(), false, lines_color);
+		if (packed_lines_vertices_.get())
+			lines_handle_ = batch.Add(group, packed_lines_vertices_->Data().data(), packed_lines_vertices_->GetSize(), lines_indices_->GetRamData(), lines_indices_->GetSize());
+		else
+			lines_handle_ = batch.Add(group, lines_vertices_->Data().data(), lines_vertices_->GetSize(), lines_indices_->GetRamData(), lines_indices_->GetSize());
+	}
+
+	if (convex_indices_.get()) {
+		int group = batch.GetGroup(packed_convex_vertices_.get() ? TileBatch::POSITION_NORMAL_SHORT : TileBatch::POSITION_NORMAL_FLOAT, convex_mode_, convex_indices_->GetType(), true, convex_color);
+		if (packed_convex_vertices_.get())
+			convex_handle_ = batch.Add(group, packed_convex_vertices_->Data().data(), packed_convex_vertices_->GetSize(), convex_indices_->GetRamData(), convex_indices_->GetSize());
+		else
+			convex_handle_ = batch.Add(group, convex_vertices_->Data().data(), convex_vertices_->GetSize(), convex_indices_->GetRamData(), convex_indices_->GetSize());
+	}
+
+	lines_vertices_.reset(NULL);
+	lines_indices_.reset(NULL);
+	convex_vertices_.reset(NULL);
+	convex_indices_.reset(NULL);
+	packed_lines_vertices_.reset(NULL);
+	packed_convex_vertices_.reset(NULL);
+
+	if (models_.get())
+		models_->Upload(batch);
+}
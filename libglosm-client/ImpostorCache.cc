@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/ImpostorCache.hh>
+
+#include <glosm/Tile.hh>
+
+#include <glosm/util/gl.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+/* impostors rendered per frame at most; tiles waiting for theirs
+ * are drawn as is meanwhile */
+static const int MAX_IMPOSTOR_UPDATES_PER_FRAME = 4;
+
+/* impostor is rendered again when distance from viewer to the
+ * tile changes by this factor either way, so its texels stay close
+ * to screen pixels; minified image loses thin lines */
+static const float IMPOSTOR_MAX_DISTANCE_RATIO = 1.25f;
+
+/* tiles which stretch in depth to closer than this part of distance
+ * to their center are too distorted on a flat impostor */
+static const float IMPOSTOR_MIN_DEPTH_RATIO = 0.25f;
+
+/**
+ * Transforms point by inverse of column-major matrix of rotation
+ * and translation, such as ones made by TileManager::GetTransform()
+ */
+static Vector3f InverseTransformPoint(const float m[16], const Vector3f& p) {
+	Vector3f d(p.x - m[12], p.y - m[13], p.z - m[14]);
+	return Vector3f(
+			m[0] * d.x + m[1] * d.y + m[2] * d.z,
+			m[4] * d.x + m[5] * d.y + m[6] * d.z,
+			m[8] * d.x + m[9] * d.y + m[10] * d.z
+		);
+}
+
+ImpostorCache::ImpostorCache() : distance_(0.0f), resolution_(256), max_angle_(0.05f), framebuffer_(0), depthbuffer_(0), updates_left_(0), min_distance_(0.0f), count_(0) {
+	pixel_scale_[0] = pixel_scale_[1] = 0.0f;
+}
+
+ImpostorCache::~ImpostorCache() {
+	DestroyFramebuffer();
+}
+
+void ImpostorCache::DestroyFramebuffer() {
+#if defined(WITH_IMPOSTORS)
+	if (framebuffer_) {
+		glDeleteFramebuffers(1, &framebuffer_);
+		glDeleteRenderbuffers(1, &depthbuffer_);
+		framebuffer_ = depthbuffer_ = 0;
+	}
+#endif
+}
+
+bool ImpostorCache::IsSupported() {
+#if defined(WITH_IMPOSTORS)
+	/* framebuffer objects are core since OpenGL 3.0 */
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version == NULL)
+		return false;
+
+	if (atoi(version) >= 3)
+		return true;
+
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions != NULL && strstr(extensions, "GL_ARB_framebuffer_object") != NULL;
+#else
+	return false;
+#endif
+}
+
+void ImpostorCache::SetParameters(float distance, int resolution, float max_angle) {
+	DestroyFramebuffer();
+
+	distance_ = distance;
+	resolution_ = resolution;
+	max_angle_ = max_angle;
+}
+
+bool ImpostorCache::IsEnabled() const {
+	return distance_ > 0.0f;
+}
+
+void ImpostorCache::BeginFrame(const float projection[16], const int viewport[4], float meter) {
+	/* diagonal of perspective projection is cotangent of half
+	 * of view angle */
+	pixel_scale_[0] = projection[0] * viewport[2] / 2.0f;
+	pixel_scale_[1] = projection[5] * viewport[3] / 2.0f;
+
+	min_distance_ = distance_ * meter;
+	updates_left_ = MAX_IMPOSTOR_UPDATES_PER_FRAME;
+}
+
+bool ImpostorCache::IsTooClose(const Vector3f& min, const Vector3f& max) const {
+	/* viewer is at the origin */
+	Vector3f nearest(
+			std::max(min.x, std::min(max.x, 0.0f)),
+			std::max(min.y, std::min(max.y, 0.0f)),
+			std::max(min.z, std::min(max.z, 0.0f))
+		);
+	return nearest.LengthSquare() < min_distance_ * min_distance_;
+}
+
+bool ImpostorCache::IsValid(const Impostor& impostor, const float model[16]) const {
+	/* compare directions to the viewer in tile coordinates, which
+	 * don't change with render origin */
+	Vector3f current = InverseTransformPoint(model, Vector3f(0.0f, 0.0f, 0.0f)) - impostor.center;
+	Vector3f original = impostor.eye - impostor.center;
+	float current_length = current.Length();
+	float original_length = original.Length();
+
+	return current_length * IMPOSTOR_MAX_DISTANCE_RATIO >= original_length &&
+			current_length <= original_length * IMPOSTOR_MAX_DISTANCE_RATIO &&
+			current.DotProduct(original) >= cos(max_angle_) * current_length * original_length;
+}
+
+bool ImpostorCache::TakeUpdate() {
+	if (updates_left_ <= 0)
+		return false;
+	updates_left_--;
+	return true;
+}
+
+bool ImpostorCache::GetImageSize(float width, float height, float distance, int& pixel_width, int& pixel_height) const {
+	pixel_width = (int)ceil(width / distance * pixel_scale_[0]);
+	pixel_height = (int)ceil(height / distance * pixel_scale_[1]);
+	if (pixel_width > resolution_ || pixel_height > resolution_)
+		return false;
+	pixel_width = std::max(pixel_width, 1);
+	pixel_height = std::max(pixel_height, 1);
+	return true;
+}
+
+bool ImpostorCache::Update(Impostor*& impostor, Tile& tile, const float model[16], const Vector3f& min, const Vector3f& max, const float viewer_modelview[16]) {
+#if defined(WITH_IMPOSTORS)
+	Vector3f center = (min + max) / 2.0f;
+	float distance = center.Length();
+	Vector3f forward = center / distance;
+
+	/* image is kept upright, unless tile is right below */
+	Vector3f side = forward.CrossProduct(Vector3f(0.0f, 0.0f, 1.0f));
+	if (side.LengthSquare() < 0.0001f)
+		side = forward.CrossProduct(Vector3f(0.0f, 1.0f, 0.0f));
+	side.Normalize();
+	Vector3f up = side.CrossProduct(forward);
+
+	/* bounds of box corners projected from the viewer onto the
+	 * plane through box center, which is what image covers */
+	float left = std::numeric_limits<float>::max(), right = -left;
+	float bottom = left, top = -left;
+	float znear = left, zfar = 0.0f;
+	for (int i = 0; i < 8; ++i) {
+		Vector3f corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z);
+		float depth = corner.DotProduct(forward);
+		if (depth < distance * IMPOSTOR_MIN_DEPTH_RATIO)
+			return false;
+
+		float s = corner.DotProduct(side) * distance / depth;
+		float t = corner.DotProduct(up) * distance / depth;
+		left = std::min(left, s);
+		right = std::max(right, s);
+		bottom = std::min(bottom, t);
+		top = std::max(top, t);
+		znear = std::min(znear, depth);
+		zfar = std::max(zfar, depth);
+	}
+
+	/* image size matching screen pixels */
+	int width, height;
+	if (!GetImageSize(right - left, top - bottom, distance, width, height))
+		return false;
+
+	if (!framebuffer_) {
+		glGenRenderbuffers(1, &depthbuffer_);
+		glBindRenderbuffer(GL_RENDERBUFFER, depthbuffer_);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, resolution_, resolution_);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glGenFramebuffers(1, &framebuffer_);
+	}
+
+	glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_LIGHTING_BIT | GL_TEXTURE_BIT);
+
+	if (!impostor)
+		impostor = Create();
+
+	if (!impostor->texture) {
+		glGenTextures(1, &impostor->texture);
+		glBindTexture(GL_TEXTURE_2D, impostor->texture);
+		/* texels match screen pixels, so filtering would only
+		 * blur thin lines */
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution_, resolution_, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	GLint framebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostor->texture, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthbuffer_);
+
+	/* won't get better in following frames */
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "Impostor framebuffer is incomplete, not using impostors\n");
+		distance_ = 0.0f;
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glPopAttrib();
+		return false;
+	}
+
+	glViewport(0, 0, width, height);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glDepthMask(GL_TRUE);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	/* with alpha accumulated this way, colors are premultiplied
+	 * by coverage, so image composes over the scene the same way
+	 * geometry would */
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	/* light was set in viewer's eye coordinates; set it for
+	 * impostor camera, assuming it's directional */
+	GLfloat light[4];
+	glGetLightfv(GL_LIGHT0, GL_POSITION, light);
+	const float* v = viewer_modelview;
+	GLfloat light_direction[4] = {
+		v[0] * light[0] + v[1] * light[1] + v[2] * light[2],
+		v[4] * light[0] + v[5] * light[1] + v[6] * light[2],
+		v[8] * light[0] + v[9] * light[1] + v[10] * light[2],
+		light[3],
+	};
+
+	/* camera at the viewer looking at box center, with frustum
+	 * cut to the image bounds */
+	GLfloat view[16] = {
+		side.x, up.x, -forward.x, 0.0f,
+		side.y, up.y, -forward.y, 0.0f,
+		side.z, up.z, -forward.z, 0.0f,
+		0.0f,   0.0f, 0.0f,       1.0f,
+	};
+
+	znear *= 0.99f;
+	zfar *= 1.01f;
+	float scale = znear / distance;
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glFrustum(left * scale, right * scale, bottom * scale, top * scale, znear, zfar);
+
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadMatrixf(view);
+	glLightfv(GL_LIGHT0, GL_POSITION, light_direction);
+	glMultMatrixf(model);
+
+	tile.Render();
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glPopAttrib();
+
+	/* in tile coordinates */
+	Vector3f plane = forward * distance;
+	impostor->corners[0] = InverseTransformPoint(model, plane + side * left + up * bottom);
+	impostor->corners[1] = InverseTransformPoint(model, plane + side * right + up * bottom);
+	impostor->corners[2] = InverseTransformPoint(model, plane + side * right + up * top);
+	impostor->corners[3] = InverseTransformPoint(model, plane + side * left + up * top);
+	impostor->texcoords[0] = (float)width / resolution_;
+	impostor->texcoords[1] = (float)height / resolution_;
+	impostor->eye = InverseTransformPoint(model, Vector3f(0.0f, 0.0f, 0.0f));
+	impostor->center = InverseTransformPoint(model, center);
+
+	return true;
+#else
+	(void)impostor;
+	(void)tile;
+	(void)model;
+	(void)min;
+	(void)max;
+	(void)viewer_modelview;
+	return false;
+#endif
+}
+
+void ImpostorCache::Render(const Impostor& impostor, const float transform[16]) const {
+#if defined(WITH_IMPOSTORS)
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glMultMatrixf(transform);
+
+	glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, impostor.texture);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	/* so empty parts of the quad don't hide what's behind */
+	glEnable(GL_ALPHA_TEST);
+	glAlphaFunc(GL_GREATER, 0.0f);
+
+	const float s = impostor.texcoords[0];
+	const float t = impostor.texcoords[1];
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.0f, 0.0f);
+	glVertex3f(impostor.corners[0].x, impostor.corners[0].y, impostor.corners[0].z);
+	glTexCoord2f(s, 0.0f);
+	glVertex3f(impostor.corners[1].x, impostor.corners[1].y, impostor.corners[1].z);
+	glTexCoord2f(s, t);
+	glVertex3f(impostor.corners[2].x, impostor.corners[2].y, impostor.corners[2].z);
+	glTexCoord2f(0.0f, t);
+	glVertex3f(impostor.corners[3].x, impostor.corners[3].y, impostor.corners[3].z);
+	glEnd();
+
+	glPopAttrib();
+	glPopMatrix();
+#else
+	(void)impostor;
+	(void)transform;
+#endif
+}
+
+ImpostorCache::Impostor* ImpostorCache::Create() {
+	Impostor* impostor = new Impostor;
+	impostor->texture = 0;
+	count_++;
+	return impostor;
+}
+
+void ImpostorCache::Destroy(Impostor*& impostor) {
+	if (!impostor)
+		return;
+
+#if defined(WITH_IMPOSTORS)
+	if (impostor->texture)
+		glDeleteTextures(1, &impostor->texture);
+#endif
+	delete impostor;
+	impostor = NULL;
+	count_--;
+}
+
+size_t ImpostorCache::GetCount() const {
+	return count_;
+}
+
+size_t ImpostorCache::GetImpostorSize() const {
+	return (size_t)resolution_ * resolution_ * 4;
+}
+
+size_t ImpostorCache::GetBytes() const {
+	return count_ * GetImpostorSize();
+}
@@ -24,15 +24,17 @@
 
 #include <cmath>
 
-MercatorProjection::MercatorProjection() : Projection(&ProjectImpl, &UnProjectImpl) {
+MercatorProjection::MercatorProjection() : Projection(&ProjectImpl, &UnProjectImpl, &ProjectManyImpl) {
 }
 
 Vector3f MercatorProjection::ProjectImpl(const Vector3i& point, const Vector3i& ref) {
-	return Vector3f(
-			(double)((osmlong_t)point.x - ref.x) * GEOM_DEG_TO_RAD,
-			mercator((double)point.y * GEOM_DEG_TO_RAD) - mercator((double)ref.y * GEOM_DEG_TO_RAD),
-			(double)(point.z - ref.z) / GEOM_UNITSINMETER / (WGS84_EARTH_EQ_RADIUS * cos((double)(point.y * GEOM_DEG_TO_RAD)))
-		);
+	return Projector(ref)(point);
+}
+
+void MercatorProjection::ProjectManyImpl(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out) {
+	Projector projector(ref);
+	for (size_t i = 0; i < n; ++i)
+		out[i] = projector(in[i]);
 }
 
 Vector3i MercatorProjection::UnProjectImpl(const Vector3f& point, const Vector3i& ref) {
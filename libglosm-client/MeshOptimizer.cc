@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/MeshOptimizer.hh>
+
+#include <algorithm>
+#include <cmath>
+
+/* normals are quantized to this many steps per unit */
+static const float NORMAL_QUANTUM = 1024.0f;
+
+namespace MeshOptimizer {
+
+WeldKey::WeldKey(const Vector3i& p, const Vector3f& n)
+	: pos(p),
+	  norm((int)round(n.x * NORMAL_QUANTUM), (int)round(n.y * NORMAL_QUANTUM), (int)round(n.z * NORMAL_QUANTUM)) {
+}
+
+bool WeldKey::operator<(const WeldKey& other) const {
+	if (pos.x != other.pos.x) return pos.x < other.pos.x;
+	if (pos.y != other.pos.y) return pos.y < other.pos.y;
+	if (pos.z != other.pos.z) return pos.z < other.pos.z;
+	if (norm.x != other.norm.x) return norm.x < other.norm.x;
+	if (norm.y != other.norm.y) return norm.y < other.norm.y;
+	return norm.z < other.norm.z;
+}
+
+bool WeldKey::operator==(const WeldKey& other) const {
+	return pos == other.pos && norm == other.norm;
+}
+
+/* orders vertex numbers by their keys, then by number */
+struct KeyOrder {
+	const std::vector<WeldKey>& keys;
+
+	KeyOrder(const std::vector<WeldKey>& k) : keys(k) {
+	}
+
+	bool operator()(unsigned int a, unsigned int b) const {
+		if (keys[a] < keys[b])
+			return true;
+		if (keys[b] < keys[a])
+			return false;
+		return a < b;
+	}
+};
+
+size_t BuildWeldMap(const std::vector<WeldKey>& keys, std::vector<unsigned int>& remap) {
+	std::vector<unsigned int> order(keys.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), KeyOrder(keys));
+
+	/* first vertex of each group of equal ones represents it */
+	std::vector<unsigned int> first(keys.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		if (i > 0 && keys[order[i]] == keys[order[i - 1]])
+			first[order[i]] = first[order[i - 1]];
+		else
+			first[order[i]] = order[i];
+	}
+
+	/* representative always precedes vertices it represents */
+	remap.resize(keys.size());
+	size_t count = 0;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		if (first[i] == i)
+			remap[i] = count++;
+		else
+			remap[i] = remap[first[i]];
+	}
+
+	return count;
+}
+
+/* picks next fanning vertex among last triangles' vertices, or
+ * from dead-end stack, or by scanning all vertices */
+static int GetNextVertex(const std::vector<unsigned int>& candidates, const std::vector<int>& live, const std::vector<int>& timestamps, int time, int cache_size, std::vector<unsigned int>& deadends, size_t& cursor) {
+	int best = -1;
+	int best_priority = -1;
+	for (std::vector<unsigned int>::const_iterator v = candidates.begin(); v != candidates.end(); ++v) {
+		if (live[*v] <= 0)
+			continue;
+
+		/* prefer freshest vertex which is going to stay in cache
+		 * while all its remaining triangles are emitted */
+		int priority = 0;
+		if (time - timestamps[*v] + 2 * live[*v] <= cache_size)
+			priority = time - timestamps[*v];
+
+		if (priority > best_priority) {
+			best_priority = priority;
+			best = *v;
+		}
+	}
+
+	if (best != -1)
+		return best;
+
+	while (!deadends.empty()) {
+		unsigned int v = deadends.back();
+		deadends.pop_back();
+		if (live[v] > 0)
+			return v;
+	}
+
+	for (; cursor < live.size(); ++cursor)
+		if (live[cursor] > 0)
+			return cursor;
+
+	return -1;
+}
+
+void OptimizeVertexCache(std::vector<unsigned int>& indices, size_t nvertices, int cache_size) {
+	size_t ntriangles = indices.size() / 3;
+	if (ntriangles < 2)
+		return;
+
+	/* vertex -> triangles adjacency, in compressed form */
+	std::vector<int> live(nvertices, 0);
+	for (size_t i = 0; i < ntriangles * 3; ++i)
+		live[indices[i]]++;
+
+	std::vector<unsigned int> offsets(nvertices + 1, 0);
+	for (size_t v = 0; v < nvertices; ++v)
+		offsets[v + 1] = offsets[v] + live[v];
+
+	std::vector<unsigned int> adjacency(ntriangles * 3);
+	std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < ntriangles * 3; ++i)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	std::vector<int> timestamps(nvertices, 0);
+	std::vector<bool> emitted(ntriangles, false);
+	std::vector<unsigned int> deadends;
+	std::vector<unsigned int> candidates;
+	std::vector<unsigned int> output;
+	output.reserve(ntriangles * 3);
+
+	int time = cache_size + 1;
+	size_t cursor = 0;
+	int fanning = GetNextVertex(candidates, live, timestamps, time, cache_size, deadends, cursor);
+
+	while (fanning >= 0) {
+		candidates.clear();
+
+		for (unsigned int a = offsets[fanning]; a < offsets[fanning + 1]; ++a) {
+			unsigned int t = adjacency[a];
+			if (emitted[t])
+				continue;
+
+			for (int k = 0; k < 3; ++k) {
+				unsigned int v = indices[t * 3 + k];
+				output.push_back(v);
+				deadends.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - timestamps[v] > cache_size)
+					timestamps[v] = time++;
+			}
+
+			emitted[t] = true;
+		}
+
+		fanning = GetNextVertex(candidates, live, timestamps, time, cache_size, deadends, cursor);
+	}
+
+	/* trailing indices which don't form a triangle, if any */
+	output.insert(output.end(), indices.begin() + ntriangles * 3, indices.end());
+	indices.swap(output);
+}
+
+size_t BuildFetchMap(const std::vector<unsigned int>& indices, size_t nvertices, std::vector<unsigned int>& remap) {
+	remap.assign(nvertices, NO_VERTEX);
+
+	size_t count = 0;
+	for (std::vector<unsigned int>::const_iterator i = indices.begin(); i != indices.end(); ++i)
+		if (remap[*i] == NO_VERTEX)
+			remap[*i] = count++;
+
+	return count;
+}
+
+float GetACMR(const std::vector<unsigned int>& indices, size_t nvertices, int cache_size) {
+	size_t ntriangles = indices.size() / 3;
+	if (ntriangles == 0)
+		return 0.0f;
+
+	/* FIFO cache: vertex is cached if it entered the cache
+	 * less than cache_size misses ago */
+	std::vector<int> entered(nvertices, -cache_size - 1);
+	int misses = 0;
+	for (size_t i = 0; i < ntriangles * 3; ++i) {
+		if (misses - entered[indices[i]] > cache_size) {
+			entered[indices[i]] = misses;
+			misses++;
+		}
+	}
+
+	return (float)misses / (float)ntriangles;
+}
+
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/util/gl.h>
+
+#include <glosm/ModelInstances.hh>
+
+#include <glosm/Model.hh>
+#include <glosm/VertexBuffer.hh>
+#include <glosm/TileShader.hh>
+
+#include <algorithm>
+#include <cstring>
+
+/* result = a * b, column-major */
+static void MultiplyInstanceMatrix(const GLfloat a[16], const GLfloat b[16], GLfloat result[16]) {
+	for (int col = 0; col < 4; ++col)
+		for (int row = 0; row < 4; ++row)
+			result[col * 4 + row] =
+				a[0 * 4 + row] * b[col * 4 + 0] +
+				a[1 * 4 + row] * b[col * 4 + 1] +
+				a[2 * 4 + row] * b[col * 4 + 2] +
+				a[3 * 4 + row] * b[col * 4 + 3];
+}
+
+ModelInstances::ModelInstances() : batch_(NULL) {
+}
+
+ModelInstances::~ModelInstances() {
+	if (batch_) {
+		for (RangeVector::iterator i = ranges_.begin(); i != ranges_.end(); ++i) {
+			batch_->Remove(i->lines_handle);
+			batch_->Remove(i->convex_handle);
+		}
+	}
+}
+
+void ModelInstances::Add(int model, const GLfloat matrix[16]) {
+	size_t range = 0;
+	while (range < ranges_.size() && ranges_[range].model != model)
+		range++;
+	if (range == ranges_.size())
+		ranges_.push_back(ModelRange(model));
+
+	Placement placement;
+	placement.range = range;
+	memcpy(placement.matrix, matrix, sizeof(placement.matrix));
+	placements_.push_back(placement);
+}
+
+void ModelInstances::Build() {
+	/* instances of a model go in a row, so they may be drawn
+	 * with a single instanced draw */
+	std::stable_sort(placements_.begin(), placements_.end(), PlacementRangeLess());
+
+	lines_vertices_.reset(new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER));
+	lines_indices_.reset(new IndexBuffer);
+	convex_vertices_.reset(new VertexBuffer<Vertex>(GL_ARRAY_BUFFER));
+	convex_indices_.reset(new IndexBuffer);
+
+	for (RangeVector::iterator i = ranges_.begin(); i != ranges_.end(); ++i)
+		BuildModel(*i);
+
+	/* indices are kept 32 bit, so ranges may be taken from
+	 * them for Upload(TileBatch&) */
+	if (lines_indices_->Data().empty()) {
+		lines_vertices_.reset(NULL);
+		lines_indices_.reset(NULL);
+	}
+	if (convex_indices_->Data().empty()) {
+		convex_vertices_.reset(NULL);
+		convex_indices_.reset(NULL);
+	}
+}
+
+void ModelInstances::BuildModel(ModelRange& range) {
+	const Model& model = Model::Get(range.model);
+
+	std::vector<Vector3f>& lines_vertices = lines_vertices_->Data();
+	IndexBuffer::DataVector& lines_indices = lines_indices_->Data();
+
+	range.lines.first_vertex = lines_vertices.size();
+	range.lines.first_index = lines_indices.size();
+
+	const Model::LengthVector& lines_lengths = model.GetLinesLengths();
+	for (unsigned int i = 0, curpos = 0; i < lines_lengths.size(); curpos += lines_lengths[i++]) {
+		for (int j = 1; j < lines_lengths[i]; ++j) {
+			lines_indices.push_back(range.lines.first_vertex + curpos + j - 1);
+			lines_indices.push_back(range.lines.first_vertex + curpos + j);
+		}
+	}
+	lines_vertices.insert(lines_vertices.end(), model.GetLinesVertices().begin(), model.GetLinesVertices().end());
+
+	range.lines.nvertices = lines_vertices.size() - range.lines.first_vertex;
+	range.lines.nindices = lines_indices.size() - range.lines.first_index;
+
+	std::vector<Vertex>& convex_vertices = convex_vertices_->Data();
+	IndexBuffer::DataVector& convex_indices = convex_indices_->Data();
+
+	range.convex.first_vertex = convex_vertices.size();
+	range.convex.first_index = convex_indices.size();
+
+	const Model::VertexVector& vertices = model.GetConvexVertices();
+	const Model::LengthVector& convex_lengths = model.GetConvexLengths();
+	for (unsigned int i = 0, curpos = 0; i < convex_lengths.size(); curpos += convex_lengths[i++]) {
+		/* flat normal of polygon, same as GeometryTile does */
+		Vector3f first = vertices[curpos + 1] - vertices[curpos];
+		Vector3f normal;
+		for (int j = 1; j < convex_lengths[i]; ++j)
+			if ((normal = first.CrossProduct(vertices[curpos + j] - vertices[curpos])).LengthSquare() > 0)
+				break;
+		normal.Normalize();
+
+		size_t base = convex_vertices.size();
+		for (int j = 0; j < convex_lengths[i]; ++j) {
+			convex_vertices.push_back(Vertex(vertices[curpos + j]));
+			convex_vertices.back().norm = normal;
+		}
+
+		for (int j = 2; j < convex_lengths[i]; ++j) {
+			convex_indices.push_back(base);
+			convex_indices.push_back(base + j - 1);
+			convex_indices.push_back(base + j);
+		}
+	}
+
+	range.convex.nvertices = convex_vertices.size() - range.convex.first_vertex;
+	range.convex.nindices = convex_indices.size() - range.convex.first_index;
+}
+
+void ModelInstances::Render() {
+	glMatrixMode(GL_MODELVIEW);
+
+	/* instance matrices scale meters into tile units */
+	glEnable(GL_NORMALIZE);
+
+	if (lines_indices_.get()) {
+		glColor4f(0.0f, 0.0f, 0.0f, 0.5f);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		lines_vertices_->Bind();
+		glVertexPointer(3, GL_FLOAT, sizeof(Vector3f), BUFFER_OFFSET(0));
+		lines_indices_->Bind();
+
+		for (PlacementVector::const_iterator i = placements_.begin(); i != placements_.end(); ++i) {
+			const Span& span = ranges_[i->range].lines;
+			if (span.nindices == 0)
+				continue;
+
+			glPushMatrix();
+			glMultMatrixf(i->matrix);
+			glDrawElements(GL_LINES, span.nindices, GL_UNSIGNED_INT, BUFFER_OFFSET(span.first_index * sizeof(GLuint)));
+			glPopMatrix();
+		}
+
+		lines_indices_->UnBind();
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glDisableClientState(GL_VERTEX_ARRAY);
+	}
+
+	if (convex_indices_.get()) {
+		glEnable(GL_LIGHTING);
+		glEnable(GL_LIGHT0);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		convex_vertices_->Bind();
+		glVertexPointer(3, GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(0));
+		glNormalPointer(GL_FLOAT, sizeof(Vertex), BUFFER_OFFSET(12));
+		convex_indices_->Bind();
+
+		/* same as for GeometryTile polygons */
+		glPolygonOffset(1.0, 1.0);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+
+		for (PlacementVector::const_iterator i = placements_.begin(); i != placements_.end(); ++i) {
+			const Span& span = ranges_[i->range].convex;
+			if (span.nindices == 0)
+				continue;
+
+			glPushMatrix();
+			glMultMatrixf(i->matrix);
+			glDrawElements(GL_TRIANGLES, span.nindices, GL_UNSIGNED_INT, BUFFER_OFFSET(span.first_index * sizeof(GLuint)));
+			glPopMatrix();
+		}
+
+		glDisable(GL_POLYGON_OFFSET_FILL);
+
+		convex_indices_->UnBind();
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
+
+		glDisable(GL_LIGHT0);
+		glDisable(GL_LIGHTING);
+	}
+
+	glDisable(GL_NORMALIZE);
+}
+
+void ModelInstances::Render(TileShader& shader) {
+	GLfloat tile_modelview[16];
+	memcpy(tile_modelview, shader.GetModelview(), sizeof(tile_modelview));
+
+	GLfloat modelview[16];
+	shader.SetQuantizer(NULL);
+
+	if (lines_indices_.get()) {
+		shader.SetLighting(false);
+		shader.SetColor(0.0f, 0.0f, 0.0f, 0.5f);
+
+		if (lines_array_.Bind()) {
+			lines_vertices_->Bind();
+			VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vector3f), 0);
+			lines_indices_->Bind();
+		}
+
+		for (PlacementVector::const_iterator i = placements_.begin(); i != placements_.end(); ++i) {
+			const Span& span = ranges_[i->range].lines;
+			if (span.nindices == 0)
+				continue;
+
+			MultiplyInstanceMatrix(tile_modelview, i->matrix, modelview);
+			shader.SetModelview(modelview);
+			glDrawElements(GL_LINES, span.nindices, GL_UNSIGNED_INT, BUFFER_OFFSET(span.first_index * sizeof(GLuint)));
+		}
+	}
+
+	if (convex_indices_.get()) {
+		shader.SetLighting(true);
+
+		if (convex_array_.Bind()) {
+			convex_vertices_->Bind();
+			VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vertex), 0);
+			VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_FLOAT, false, sizeof(Vertex), 12);
+			convex_indices_->Bind();
+		}
+
+		for (PlacementVector::const_iterator i = placements_.begin(); i != placements_.end(); ++i) {
+			const Span& span = ranges_[i->range].convex;
+			if (span.nindices == 0)
+				continue;
+
+			MultiplyInstanceMatrix(tile_modelview, i->matrix, modelview);
+			shader.SetModelview(modelview);
+			glDrawElements(GL_TRIANGLES, span.nindices, GL_UNSIGNED_INT, BUFFER_OFFSET(span.first_index * sizeof(GLuint)));
+		}
+	}
+
+	shader.SetModelview(tile_modelview);
+}
+
+void ModelInstances::Render(TileBatch& batch, const GLfloat modelview[16]) {
+	if (!batch_)
+		Upload(batch);
+
+	PlacementVector::const_iterator placement = placements_.begin();
+	for (size_t range = 0; range < ranges_.size(); ++range) {
+		int first = -1, count = 0;
+		for (; placement != placements_.end() && placement->range == (int)range; ++placement) {
+			GLfloat instance_modelview[16];
+			MultiplyInstanceMatrix(modelview, placement->matrix, instance_modelview);
+
+			int instance = batch.AddInstance(instance_modelview, NULL);
+			if (first < 0)
+				first = instance;
+			count++;
+		}
+
+		batch.Draw(ranges_[range].lines_handle, first, count);
+		batch.Draw(ranges_[range].convex_handle, first, count);
+	}
+}
+
+size_t ModelInstances::GetSize() const {
+	size_t size = placements_.size() * sizeof(Placement);
+	if (lines_vertices_.get())
+		size += lines_vertices_->GetFootprint();
+	if (lines_indices_.get())
+		size += lines_indices_->GetFootprint();
+	if (convex_vertices_.get())
+		size += convex_vertices_->GetFootprint();
+	if (convex_indices_.get())
+		size += convex_indices_->GetFootprint();
+	return size;
+}
+
+size_t ModelInstances::GetUploadSize() const {
+	size_t size = 0;
+	if (lines_vertices_.get())
+		size += lines_vertices_->GetPendingFootprint();
+	if (lines_indices_.get())
+		size += lines_indices_->GetPendingFootprint();
+	if (convex_vertices_.get())
+		size += convex_vertices_->GetPendingFootprint();
+	if (convex_indices_.get())
+		size += convex_indices_->GetPendingFootprint();
+	return size;
+}
+
+void ModelInstances::Upload() {
+	if (lines_vertices_.get())
+		lines_vertices_->Freeze();
+	if (lines_indices_.get())
+		lines_indices_->Freeze();
+	if (convex_vertices_.get())
+		convex_vertices_->Freeze();
+	if (convex_indices_.get())
+		convex_indices_->Freeze();
+}
+
+void ModelInstances::Upload(TileBatch& batch) {
+	static const GLfloat lines_color[4] = { 0.0f, 0.0f, 0.0f, 0.5f };
+	static const GLfloat convex_color[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+	if (batch_)
+		return;
+	batch_ = &batch;
+
+	/* each model gets its own range in batch, with indices
+	 * relative to its first vertex */
+	std::vector<GLuint> indices;
+	for (RangeVector::iterator i = ranges_.begin(); i != ranges_.end(); ++i) {
+		if (i->lines.nindices > 0) {
+			const IndexBuffer::DataVector& data = lines_indices_->Data();
+			indices.assign(data.begin() + i->lines.first_index, data.begin() + i->lines.first_index + i->lines.nindices);
+			for (std::vector<GLuint>::iterator index = indices.begin(); index != indices.end(); ++index)
+				*index -= i->lines.first_vertex;
+
+			int group = batch.GetGroup(TileBatch::POSITION_FLOAT, GL_LINES, GL_UNSIGNED_INT, false, lines_color);
+			i->lines_handle = batch.Add(group, &lines_vertices_->Data()[i->lines.first_vertex], i->lines.nvertices, &indices[0], indices.size());
+		}
+
+		if (i->convex.nindices > 0) {
+			const IndexBuffer::DataVector& data = convex_indices_->Data();
+			indices.assign(data.begin() + i->convex.first_index, data.begin() + i->convex.first_index + i->convex.nindices);
+			for (std::vector<GLuint>::iterator index = indices.begin(); index != indices.end(); ++index)
+				*index -= i->convex.first_vertex;
+
+			int group = batch.GetGroup(TileBatch::POSITION_NORMAL_FLOAT, GL_TRIANGLES, GL_UNSIGNED_INT, true, convex_color);
+			i->convex_handle = batch.Add(group, &convex_vertices_->Data()[i->convex.first_vertex], i->convex.nvertices, &indices[0], indices.size());
+		}
+	}
+
+	lines_vertices_.reset(NULL);
+	lines_indices_.reset(NULL);
+	convex_vertices_.reset(NULL);
+	convex_indices_.reset(NULL);
+}
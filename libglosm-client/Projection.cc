@@ -20,7 +20,7 @@
 
 #include <glosm/Projection.hh>
 
-Projection::Projection(ProjectFunction pf, UnProjectFunction uf): project_(pf), unproject_(uf) {
+Projection::Projection(ProjectFunction pf, UnProjectFunction uf, ProjectManyFunction pmf): project_(pf), unproject_(uf), project_many_(pmf) {
 }
 
 Vector3f Projection::Project(const Vector3i& point, const Vector3i& ref) const {
@@ -31,11 +31,21 @@ Vector3i Projection::UnProject(const Vector3f& point, const Vector3i& ref) const
 	return unproject_(point, ref);
 }
 
+void Projection::ProjectMany(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out) const {
+	if (project_many_) {
+		project_many_(in, n, ref, out);
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		out[i] = project_(in[i], ref);
+}
+
 void Projection::ProjectPoints(const std::vector<Vector3i>& in, const Vector3i& ref, std::vector<Vector3f>& out) const {
-	/* "slow" fallback implementation; though virtual calls
-	 * add overhead, it's too small (~3%) to even care; but this
-	 * may be redefined in subclasses */
-	out.reserve(out.size() + in.size());
-	for (std::vector<Vector3i>::const_iterator i = in.begin(); i != in.end(); ++i)
-		out.push_back(project_(*i, ref));
+	if (in.empty())
+		return;
+
+	size_t start = out.size();
+	out.resize(start + in.size());
+	ProjectMany(&in[0], in.size(), ref, &out[start]);
 }
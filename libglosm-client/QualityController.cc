@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/QualityController.hh>
+#include <glosm/TileManager.hh>
+
+#include <algorithm>
+
+/* frame time ratios to target out of which quality is changed;
+ * lowering is faster than raising, so it doesn't oscillate */
+static const float QUALITY_SLOW_RATIO = 1.15f;
+static const float QUALITY_FAST_RATIO = 0.85f;
+static const float QUALITY_DOWN_STEP = 0.1f;
+static const float QUALITY_BACKLOG_STEP = 0.05f;
+static const float QUALITY_UP_STEP = 0.02f;
+
+template <class T>
+static T LerpQuality(T min, T max, float quality) {
+	return (T)(min + (max - min) * quality);
+}
+
+QualityController::LayerBounds::LayerBounds(float minrange, float maxrange, float minlod, float maxlod, size_t minsize, size_t maxsize)
+	: min_range(minrange), max_range(maxrange), min_lod_factor(minlod), max_lod_factor(maxlod), min_size_limit(minsize), max_size_limit(maxsize) {
+}
+
+QualityController::QualityController(float target_fps)
+	: target_frame_time_(1.0f / target_fps), interval_(1.0f), max_backlog_(64), quality_(0.5f), elapsed_(0.0f), frames_(0), last_backlog_(0) {
+}
+
+void QualityController::Apply() {
+	for (LayerVector::iterator i = layers_.begin(); i != layers_.end(); ++i) {
+		i->manager->SetRange(LerpQuality(i->bounds.min_range, i->bounds.max_range, quality_));
+		i->manager->SetLodFactor(LerpQuality(i->bounds.min_lod_factor, i->bounds.max_lod_factor, quality_));
+		/* sizes may not fit float precisely */
+		i->manager->SetSizeLimit(i->bounds.min_size_limit + (size_t)((double)(i->bounds.max_size_limit - i->bounds.min_size_limit) * quality_));
+	}
+}
+
+size_t QualityController::GetBacklog() const {
+	size_t backlog = 0;
+	for (LayerVector::const_iterator i = layers_.begin(); i != layers_.end(); ++i) {
+		TileManager::Statistics stats;
+		i->manager->GetStatistics(stats);
+		backlog += stats.queued + stats.loading;
+	}
+	return backlog;
+}
+
+void QualityController::AddLayer(TileManager* manager, const LayerBounds& bounds) {
+	layers_.push_back(Layer(manager, bounds));
+	Apply();
+}
+
+void QualityController::Update(float frame_time) {
+	elapsed_ += frame_time;
+	frames_++;
+
+	if (elapsed_ < interval_)
+		return;
+
+	float frame_ratio = elapsed_ / frames_ / target_frame_time_;
+	size_t backlog = GetBacklog();
+
+	float quality = quality_;
+	if (frame_ratio > QUALITY_SLOW_RATIO)
+		quality -= QUALITY_DOWN_STEP;
+	else if (backlog > max_backlog_ && backlog >= last_backlog_)
+		quality -= QUALITY_BACKLOG_STEP; /* loaders don't keep up */
+	else if (frame_ratio < QUALITY_FAST_RATIO && backlog <= max_backlog_)
+		quality += QUALITY_UP_STEP;
+
+	elapsed_ = 0.0f;
+	frames_ = 0;
+	last_backlog_ = backlog;
+
+	SetQuality(quality);
+}
+
+void QualityController::SetQuality(float quality) {
+	quality = std::max(0.0f, std::min(1.0f, quality));
+	if (quality == quality_)
+		return;
+
+	quality_ = quality;
+	Apply();
+}
+
+float QualityController::GetQuality() const {
+	return quality_;
+}
+
+void QualityController::SetInterval(float interval) {
+	interval_ = interval;
+}
+
+void QualityController::SetMaxBacklog(size_t tiles) {
+	max_backlog_ = tiles;
+}
@@ -24,45 +24,17 @@
 
 #include <cmath>
 
-SphericalProjection::SphericalProjection() : Projection(&ProjectImpl, &UnProjectImpl) {
+SphericalProjection::SphericalProjection() : Projection(&ProjectImpl, &UnProjectImpl, &ProjectManyImpl) {
 }
 
 Vector3f SphericalProjection::ProjectImpl(const Vector3i& point, const Vector3i& ref) {
-	double point_angle_x = ((double)point.x - (double)ref.x) * GEOM_DEG_TO_RAD;
-	double point_angle_y = (double)point.y * GEOM_DEG_TO_RAD;
-	double point_height = (double)point.z / GEOM_UNITSINMETER;
-
-	double ref_angle_y = (double)ref.y * GEOM_DEG_TO_RAD;
-	double ref_height = (double)ref.z / GEOM_UNITSINMETER;
-
-#ifdef HAVE_SINCOS
-	double sinx, cosx, siny, cosy;
-	sincos(point_angle_x, &sinx, &cosx);
-	sincos(point_angle_y, &siny, &cosy);
-#else
-	double cosx = cos(point_angle_x);
-	double cosy = cos(point_angle_y);
-	double sinx = sin(point_angle_x);
-	double siny = sin(point_angle_y);
-#endif
-	Vector3d point_vector(
-		(WGS84_EARTH_EQ_RADIUS + point_height) * sinx * cosy,
-		(WGS84_EARTH_EQ_RADIUS + point_height) * siny,
-		(WGS84_EARTH_EQ_RADIUS + point_height) * cosx * cosy
-	);
+	return Projector(ref)(point);
+}
 
-#ifdef HAVE_SINCOS
-	double sinay, cosay;
-	sincos(ref_angle_y, &sinay, &cosay);
-#else
-	double sinay = sin(ref_angle_y);
-	double cosay = cos(ref_angle_y);
-#endif
-	return Vector3f(
-		point_vector.x,
-		point_vector.y * cosay - point_vector.z * sinay,
-		point_vector.y * sinay + point_vector.z * cosay - WGS84_EARTH_EQ_RADIUS - ref_height
-	);
+void SphericalProjection::ProjectManyImpl(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out) {
+	Projector projector(ref);
+	for (size_t i = 0; i < n; ++i)
+		out[i] = projector(in[i]);
 }
 
 Vector3i SphericalProjection::UnProjectImpl(const Vector3f& point, const Vector3i& ref) {
@@ -23,11 +23,14 @@
 #include <glosm/HeightmapDatasource.hh>
 #include <glosm/TerrainTile.hh>
 #include <glosm/Projection.hh>
+#include <glosm/MercatorProjection.hh>
+#include <glosm/CheckGL.hh>
+#include <glosm/TileShader.hh>
 #include <glosm/Viewer.hh>
 
 #include <glosm/util/gl.h>
 
-TerrainLayer::TerrainLayer(const Projection projection, HeightmapDatasource& datasource): TileManager(projection), projection_(projection), datasource_(datasource) {
+TerrainLayer::TerrainLayer(const Projection projection, HeightmapDatasource& datasource): TileManager(projection), projection_(projection), datasource_(datasource), tile_flags_(0) {
 }
 
 TerrainLayer::~TerrainLayer() {
@@ -53,6 +56,22 @@ void TerrainLayer::Render(const Viewer& viewer) {
 	float l = 0.85;
 	GLfloat material_diffuse[] = {l, l, l, 1.0};
 
+	/* XXX: we use 2 here as 1 is used for geometry */
+	glPolygonOffset(2.0, 2.0);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+
+	if (shader_) {
+		shader_->Begin();
+		shader_->SetLight(light_position, light_ambient, light_diffuse, material_diffuse);
+		shader_->SetLighting(true);
+
+		TileManager::Render(viewer);
+
+		shader_->End();
+		glDisable(GL_POLYGON_OFFSET_FILL);
+		return;
+	}
+
 	glLightModelfv(GL_LIGHT_MODEL_AMBIENT, global_ambient);
 
 	glLightfv(GL_LIGHT0, GL_POSITION, light_position);
@@ -66,11 +85,6 @@ void TerrainLayer::Render(const Viewer& viewer) {
 	glEnable(GL_LIGHT0);
 
 	/* Render tile(s) */
-
-	/* XXX: we use 2 here as 1 is used for geometry */
-	glPolygonOffset(2.0, 2.0);
-	glEnable(GL_POLYGON_OFFSET_FILL);
-
 	TileManager::Render(viewer);
 
 	glDisable(GL_POLYGON_OFFSET_FILL);
@@ -80,5 +94,16 @@ void TerrainLayer::Render(const Viewer& viewer) {
 }
 
 Tile* TerrainLayer::SpawnTile(const BBoxi& bbox, int flags) const {
-	return new TerrainTile(projection_, datasource_, bbox.GetCenter(), bbox);
+	return new TerrainTile(projection_, datasource_, bbox.GetCenter(), bbox, tile_flags_);
+}
+
+void TerrainLayer::SetTileFlags(int flags) {
+	if ((flags & TerrainTile::HEIGHT_TEXTURE) && !projection_.Is<MercatorProjection>())
+		throw Exception() << "Terrain height textures are only supported with mercator projection";
+#if !defined(WITH_HEIGHT_TEXTURES)
+	if (flags & TerrainTile::HEIGHT_TEXTURE)
+		throw GLUnsupportedException() << "Terrain height textures are not supported with OpenGL ES";
+#endif
+
+	tile_flags_ = flags;
 }
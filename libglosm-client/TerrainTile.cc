@@ -23,50 +23,337 @@
 #include <glosm/TerrainTile.hh>
 #include <glosm/HeightmapDatasource.hh>
 
-#include <glosm/Projection.hh>
+#include <glosm/MercatorProjection.hh>
+#include <glosm/SphericalProjection.hh>
 #include <glosm/VertexBuffer.hh>
+#include <glosm/TileShader.hh>
+#include <glosm/geomath.h>
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <cassert>
-#include <stdexcept>
+#include <cmath>
+#include <map>
 
-TerrainTile::TerrainTile(const Projection& projection, HeightmapDatasource& datasource, const Vector2i& ref, const BBoxi& bbox) : Tile(ref) {
+/**
+ * Selects heightmap lines used for the tile grid: margin lines,
+ * every step-th line of the interior and the last interior line,
+ * so grid still covers whole tile
+ */
+static void SelectTerrainGridLines(int size, int step, std::vector<int>& out) {
+	out.push_back(0);
+	for (int i = 1; i < size - 2; i += step)
+		out.push_back(i);
+	out.push_back(size - 2);
+	out.push_back(size - 1);
+}
+
+/**
+ * Returns power of two step at which size heightmap lines are
+ * sampled to produce at most maxsize grid lines
+ */
+static int GetTerrainGridStep(int size, int maxsize) {
+	int step = 1;
+	while ((size - 2 + step - 1) / step + 1 > maxsize)
+		step *= 2;
+	return step;
+}
+
+/**
+ * Returns coordinate of n-th of size heightmap lines
+ */
+static osmint_t GetTerrainLineCoord(osmint_t first, osmint_t last, int n, int size) {
+	return (osmint_t)((double)first + ((double)last - (double)first) * ((double)n / (double)(size - 1)));
+}
+
+/**
+ * Projects selected heightmap grid points; instantiated per
+ * concrete projection type, so projection is inlined into the loop
+ */
+template <class PROJECTOR>
+static void ProjectGrid(PROJECTOR& projector, const HeightmapDatasource::Heightmap& heightmap, const std::vector<int>& xs, const std::vector<int>& ys, std::vector<Vector3f>& out) {
+	for (std::vector<int>::const_iterator y = ys.begin(); y != ys.end(); ++y) {
+		for (std::vector<int>::const_iterator x = xs.begin(); x != xs.end(); ++x) {
+			out.push_back(projector(Vector3i(
+							GetTerrainLineCoord(heightmap.bbox.left, heightmap.bbox.right, *x, heightmap.width),
+							GetTerrainLineCoord(heightmap.bbox.bottom, heightmap.bbox.top, *y, heightmap.height),
+							heightmap.points[*y * heightmap.width + *x]
+						)));
+		}
+	}
+}
+
+/**
+ * Appends triangle strip to another one, joining them with
+ * degenerate triangles; keeps winding of appended strip
+ */
+static void AppendTerrainStrip(std::vector<GLuint>& indices, const std::vector<GLuint>& strip) {
+	if (strip.empty())
+		return;
+
+	if (!indices.empty()) {
+		indices.push_back(indices.back());
+		indices.push_back(strip.front());
+		/* odd triangles in a strip have reversed winding */
+		if (indices.size() % 2 == 1)
+			indices.push_back(strip.front());
+	}
+
+	indices.insert(indices.end(), strip.begin(), strip.end());
+}
+
+/**
+ * Lists vertices on tile grid perimeter, counterclockwise
+ */
+static void GetTerrainEdge(int width, int height, std::vector<GLuint>& edge) {
+	for (int x = 0; x < width - 1; ++x)
+		edge.push_back(x);
+	for (int y = 0; y < height - 1; ++y)
+		edge.push_back(y * width + width - 1);
+	for (int x = width - 1; x > 0; --x)
+		edge.push_back((height - 1) * width + x);
+	for (int y = height - 1; y > 0; --y)
+		edge.push_back(y * width);
+}
+
+/**
+ * Builds triangle strip for a grid of given size followed by
+ * its skirt, which vertices are placed after grid ones
+ */
+static void BuildTerrainIndices(int width, int height, std::vector<GLuint>& indices) {
+	indices.reserve((height - 1) * (width * 2 + 2) + (width + height) * 4 + 4);
+	for (int y = 0; y < height - 1; ++y) {
+		/* since strip is arranged per-row, we duplicate last and first
+		 * vertices in each row to make triangle between rows degraded
+		 * and thus not renderable */
+		if (y > 0)
+			indices.push_back((y + 1) * width);
+		for (int x = 0; x < width; ++x) {
+			indices.push_back((y + 1) * width + x);
+			indices.push_back(y * width + x);
+		}
+		if (y < height - 2)
+			indices.push_back(y * width + width - 1);
+	}
+
+	/* perimeter is walked counterclockwise, so that skirt faces
+	 * outwards */
+	std::vector<GLuint> edge;
+	GetTerrainEdge(width, height, edge);
+
+	std::vector<GLuint> strip;
+	strip.reserve(edge.size() * 2 + 2);
+	for (size_t i = 0; i <= edge.size(); ++i) {
+		strip.push_back(edge[i % edge.size()]);
+		strip.push_back(width * height + i % edge.size());
+	}
+
+	AppendTerrainStrip(indices, strip);
+}
+
+/* index buffers and flat grids are the same for all tiles with
+ * the same grid size, so these are shared, with reference count */
+struct TerrainGrid {
+	IndexBuffer* indices;
+	VertexBuffer<Vector3f>* vertices;
+	int refs;
+};
+
+typedef std::map<std::pair<int, int>, TerrainGrid> TerrainGridMap;
+
+static TerrainGridMap terrain_grids;
+static pthread_mutex_t terrain_grids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns shared index buffer and, if requested, flat grid for
+ * a given grid size, building these if needed; may be called
+ * from loading threads
+ *
+ * Flat grid vertices are grid coordinates, including margin,
+ * with z = 1 for skirt.
+ */
+static void AcquireTerrainGrid(int width, int height, IndexBuffer** indices, VertexBuffer<Vector3f>** vertices) {
+	pthread_mutex_lock(&terrain_grids_mutex);
+
+	TerrainGridMap::iterator entry = terrain_grids.find(std::make_pair(width, height));
+	if (entry == terrain_grids.end()) {
+		TerrainGrid grid;
+		/* grid size is limited, so these are always 16 bit,
+		 * which is also the only index type GL ES supports */
+		grid.indices = new IndexBuffer;
+		BuildTerrainIndices(width, height, grid.indices->Data());
+		grid.indices->Pack();
+		grid.vertices = NULL;
+		grid.refs = 0;
+		entry = terrain_grids.insert(std::make_pair(std::make_pair(width, height), grid)).first;
+	}
+
+	if (vertices && !entry->second.vertices) {
+		VertexBuffer<Vector3f>* flat = new VertexBuffer<Vector3f>(GL_ARRAY_BUFFER);
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+				flat->Data().push_back(Vector3f(x + 1, y + 1, 0));
+
+		std::vector<GLuint> edge;
+		GetTerrainEdge(width, height, edge);
+		for (std::vector<GLuint>::const_iterator i = edge.begin(); i != edge.end(); ++i)
+			flat->Data().push_back(Vector3f(*i % width + 1, *i / width + 1, 1));
+
+		entry->second.vertices = flat;
+	}
+
+	entry->second.refs++;
+	*indices = entry->second.indices;
+	if (vertices)
+		*vertices = entry->second.vertices;
+
+	pthread_mutex_unlock(&terrain_grids_mutex);
+}
+
+/**
+ * Drops reference to shared grid, freeing it when it's no
+ * longer used; must be called from GL thread
+ */
+static void ReleaseTerrainGrid(int width, int height) {
+	pthread_mutex_lock(&terrain_grids_mutex);
+
+	TerrainGridMap::iterator entry = terrain_grids.find(std::make_pair(width, height));
+	assert(entry != terrain_grids.end());
+	if (--entry->second.refs == 0) {
+		delete entry->second.indices;
+		delete entry->second.vertices;
+		terrain_grids.erase(entry);
+	}
+
+	pthread_mutex_unlock(&terrain_grids_mutex);
+}
+
+TerrainTile::TerrainTile(const Projection& projection, HeightmapDatasource& datasource, const Vector2i& ref, const BBoxi& bbox, int flags) : Tile(ref), ibo_(NULL), grid_vbo_(NULL), heights_texture_(0), skirt_depth_(0.0f), quantized_(false), batch_(NULL) {
 	HeightmapDatasource::Heightmap heightmap;
 
 	/* we request heightmap with extra 1-point margin so we can
 	 * calculate correct normals for edge vertices */
 	datasource.GetHeightmap(bbox, 1, heightmap);
 
-	int width = heightmap.width - 2;
-	int height = heightmap.height - 2;
+	if (!heightmap.points.empty()) {
+		min_height_ = *std::min_element(heightmap.points.begin(), heightmap.points.end());
+		max_height_ = *std::max_element(heightmap.points.begin(), heightmap.points.end());
+	}
+
+	/* large (that is, distant) tiles use only each step-th
+	 * heightmap point, so all tiles have comparable size;
+	 * steps are powers of two, so every coarser tile level
+	 * halves grid resolution */
+	int xstep = GetTerrainGridStep(heightmap.width, MAX_GRID_SIZE);
+	int ystep = GetTerrainGridStep(heightmap.height, MAX_GRID_SIZE);
+
+	std::vector<int> xs, ys;
+	SelectTerrainGridLines(heightmap.width, xstep, xs);
+	SelectTerrainGridLines(heightmap.height, ystep, ys);
+
+	int gridwidth = xs.size();
+	int gridheight = ys.size();
+
+	int width = gridwidth - 2;
+	int height = gridheight - 2;
+
+	/* grid edges are clamped with tile bounds; these are
+	 * calculated in grid coordinates, keeping in mind that
+	 * edge grid cells may span several heightmap cells */
+	double cellheight = ((double)heightmap.bbox.top - (double)heightmap.bbox.bottom) / (double)(heightmap.height - 1);
+	double cellwidth = ((double)heightmap.bbox.right - (double)heightmap.bbox.left) / (double)(heightmap.width - 1);
+
+	double bounds[4] = {
+		1.0 + (((double)bbox.left - (double)heightmap.bbox.left) / cellwidth - 1.0) / (double)(xs[2] - xs[1]),
+		1.0 + (((double)bbox.bottom - (double)heightmap.bbox.bottom) / cellheight - 1.0) / (double)(ys[2] - ys[1]),
+		(double)(gridwidth - 2) - (((double)heightmap.bbox.right - (double)bbox.right) / cellwidth - 1.0) / (double)(xs[gridwidth - 2] - xs[gridwidth - 3]),
+		(double)(gridheight - 2) - (((double)heightmap.bbox.top - (double)bbox.top) / cellheight - 1.0) / (double)(ys[gridheight - 2] - ys[gridheight - 3]),
+	};
+
+	/* neighbour tiles may be of different level and thus have
+	 * different grid resolution, so there may be cracks between
+	 * them; these are hidden by skirt - vertical strip going
+	 * down from tile edges. It's deep enough to cover height
+	 * error of coarser grid, which can't exceed height range
+	 * of a tile, plus a grid cell for tiles which are flat */
+	Vector3i corner1(GetTerrainLineCoord(heightmap.bbox.left, heightmap.bbox.right, xs[1], heightmap.width), GetTerrainLineCoord(heightmap.bbox.bottom, heightmap.bbox.top, ys[1], heightmap.height), 0);
+	Vector3i corner2(GetTerrainLineCoord(heightmap.bbox.left, heightmap.bbox.right, xs[2], heightmap.width), GetTerrainLineCoord(heightmap.bbox.bottom, heightmap.bbox.top, ys[2], heightmap.height), 0);
+	Vector3f up = projection.Project(Vector3i(ref, GEOM_UNITSINMETER), Vector3i(ref, 0)) - projection.Project(Vector3i(ref, 0), Vector3i(ref, 0));
+	float depth = up.Length() * (float)(max_height_ - min_height_) / (float)GEOM_UNITSINMETER + (projection.Project(corner2, Vector3i(ref, 0)) - projection.Project(corner1, Vector3i(ref, 0))).Length();
+
+	width_ = width;
+	height_ = height;
+
+#if defined(WITH_HEIGHT_TEXTURES)
+	if (flags & HEIGHT_TEXTURE) {
+		/* only heights are stored, and tile building is just
+		 * copying these; the rest is done in vertex shader */
+		assert(projection.Is<MercatorProjection>());
+		assert(gridwidth <= TileShader::MAX_TERRAIN_LINES && gridheight <= TileShader::MAX_TERRAIN_LINES);
+
+		heights_.reserve(gridwidth * gridheight);
+		for (std::vector<int>::const_iterator y = ys.begin(); y != ys.end(); ++y) {
+			for (std::vector<int>::const_iterator x = xs.begin(); x != xs.end(); ++x) {
+				int meters = (int)round((double)heightmap.points[*y * heightmap.width + *x] / (double)GEOM_UNITSINMETER);
+				heights_.push_back(std::max(-32768, std::min(32767, meters)) + 32768);
+			}
+		}
+
+		/* with mercator, projected x only depends on longitude,
+		 * and y and height scale only on latitude */
+		MercatorProjection::Projector projector(ref);
+		lines_.resize(std::max(gridwidth, gridheight) * 4);
+		for (int i = 0; i < gridwidth; ++i)
+			lines_[i * 4] = projector(Vector3i(GetTerrainLineCoord(heightmap.bbox.left, heightmap.bbox.right, xs[i], heightmap.width), ref.y, 0)).x;
+		for (int i = 0; i < gridheight; ++i) {
+			osmint_t lat = GetTerrainLineCoord(heightmap.bbox.bottom, heightmap.bbox.top, ys[i], heightmap.height);
+			Vector3f ground = projector(Vector3i(ref.x, lat, 0));
+			lines_[i * 4 + 1] = ground.y;
+			lines_[i * 4 + 2] = projector(Vector3i(ref.x, lat, GEOM_UNITSINMETER)).z - ground.z;
+		}
+
+		for (int i = 0; i < 4; ++i)
+			bounds_[i] = bounds[i];
+		skirt_depth_ = depth;
+
+		AcquireTerrainGrid(width, height, &ibo_, &grid_vbo_);
+
+		size_ = heights_.size() * sizeof(GLushort) + lines_.size() * sizeof(GLfloat);
+		return;
+	}
+#endif
 
 	/* for each tile, we store position and normal for each
-	 * vertex in the grid; we also store index array which
-	 * arranges vertices into a single triangle strip */
+	 * vertex in the grid and for vertices of skirt around it;
+	 * we also store index array which arranges vertices into
+	 * a single triangle strip */
 
 	vbo_.reset(new VertexBuffer<TerrainVertex>(GL_ARRAY_BUFFER));
 	vbo_->Data().resize(width * height);
 
 	/* temporary array of projected points */
 	std::vector<Vector3f> projected;
-	projected.reserve(heightmap.width * heightmap.height);
-	for (int y = 0; y < heightmap.height; ++y) {
-		for (int x = 0; x < heightmap.width; ++x) {
-			projected.push_back(projection.Project(Vector3i(
-								(osmint_t)((double)heightmap.bbox.left) + ((double)heightmap.bbox.right - (double)heightmap.bbox.left) * ((double)x / (double)(heightmap.width - 1)),
-								(osmint_t)((double)heightmap.bbox.bottom) + ((double)heightmap.bbox.top - (double)heightmap.bbox.bottom) * ((double)y / (double)(heightmap.height - 1)),
-								heightmap.points[y * heightmap.width + x]
-							), ref));
-		}
+	projected.reserve(gridwidth * gridheight);
+	if (projection.Is<MercatorProjection>()) {
+		MercatorProjection::Projector projector(ref);
+		ProjectGrid(projector, heightmap, xs, ys, projected);
+	} else if (projection.Is<SphericalProjection>()) {
+		SphericalProjection::Projector projector(ref);
+		ProjectGrid(projector, heightmap, xs, ys, projected);
+	} else {
+		Projection::Projector projector(projection, ref);
+		ProjectGrid(projector, heightmap, xs, ys, projected);
 	}
 
 	/* prepare vertices & normals */
 	int n = 0;
-	for (int y = 1; y < heightmap.height - 1; ++y) {
-		for (int x = 1; x < heightmap.width - 1; ++x) {
-			Vector3f v1 = projected[y * heightmap.width + x + 1] - projected[y * heightmap.width + x - 1];
-			Vector3f v2 = projected[(y + 1) * heightmap.width + x] - projected[(y - 1) * heightmap.width + x];
+	for (int y = 1; y < gridheight - 1; ++y) {
+		for (int x = 1; x < gridwidth - 1; ++x) {
+			Vector3f v1 = projected[y * gridwidth + x + 1] - projected[y * gridwidth + x - 1];
+			Vector3f v2 = projected[(y + 1) * gridwidth + x] - projected[(y - 1) * gridwidth + x];
 
-			vbo_->Data()[n].pos = projected[y * heightmap.width + x];
+			vbo_->Data()[n].pos = projected[y * gridwidth + x];
 			vbo_->Data()[n].norm = v1.CrossProduct(v2).Normalized();
 
 			n++;
@@ -75,19 +362,17 @@ TerrainTile::TerrainTile(const Projection& projection, HeightmapDatasource& data
 
 	/* clamp grid edges with tile bounds */
 
-	double k1, k2;
-	double cellheight = ((double)heightmap.bbox.top - (double)heightmap.bbox.bottom) / (double)(heightmap.height - 1);
-	double cellwidth = ((double)heightmap.bbox.right - (double)heightmap.bbox.left) / (double)(heightmap.width - 1);
-
 	/*
 	 * @todo this clamping is not quite correct: it doesn't
 	 * take the fact that terrain grid consists of triangles
 	 * into account
 	 */
 
+	double k1, k2;
+
 	/* clamp bottom & top */
-	k1 = ((double)bbox.bottom - (double)heightmap.bbox.bottom) / cellheight - 1.0;
-	k2 = ((double)heightmap.bbox.top - (double)bbox.top) / cellheight - 1.0;
+	k1 = bounds[1] - 1.0;
+	k2 = (double)(gridheight - 2) - bounds[3];
 	for (int x = 0; x < width; ++x) {
 		vbo_->Data()[x].pos = vbo_->Data()[x].pos * (1.0 - k1) + vbo_->Data()[width + x].pos * (k1);
 		vbo_->Data()[x].norm = vbo_->Data()[x].norm * (1.0 - k1) + vbo_->Data()[width + x].norm * (k1);
@@ -97,8 +382,8 @@ TerrainTile::TerrainTile(const Projection& projection, HeightmapDatasource& data
 	}
 
 	/* clamp left & right */
-	k1 = ((double)bbox.left - (double)heightmap.bbox.left) / cellwidth - 1.0;
-	k2 = ((double)heightmap.bbox.right - (double)bbox.right) / cellwidth - 1.0;
+	k1 = bounds[0] - 1.0;
+	k2 = (double)(gridwidth - 2) - bounds[2];
 	for (int y = 0; y < height; ++y) {
 		vbo_->Data()[y * width].pos = vbo_->Data()[y * width].pos * (1.0 - k1) + vbo_->Data()[y * width + 1].pos * (k1);
 		vbo_->Data()[y * width].norm = vbo_->Data()[y * width].norm * (1.0 - k1) + vbo_->Data()[y * width + 1].norm * (k1);
@@ -107,52 +392,210 @@ TerrainTile::TerrainTile(const Projection& projection, HeightmapDatasource& data
 		vbo_->Data()[y * width + width - 1].norm = vbo_->Data()[y * width + width - 1].norm * (1.0 - k2) + vbo_->Data()[y * width + width - 2].norm * (k2);
 	}
 
-	/* ought to be enough for anybody? test with hires hawaii heightmaps */
-	if (vbo_->GetSize() > 65536)
-		throw std::logic_error("error constructing TerrainTile: attempt to store more than 65536 vertices in a VBO indexed with SHORTs");
+	/* add skirt */
+	std::vector<GLuint> edge;
+	GetTerrainEdge(width, height, edge);
 
-	/* prepare indices */
-	ibo_.reset(new VertexBuffer<GLushort>(GL_ELEMENT_ARRAY_BUFFER));
-	ibo_->Data().reserve((height - 1) * (width * 2 + 2) - 2);
-	for (int y = 0; y < height - 1; ++y) {
-		/* since strip is arranged per-row, we duplicate last and first
-		 * vertices in each row to make triangle between rows degraded
-		 * and thus not renderable */
-		if (y > 0)
-			ibo_->Data().push_back((y + 1) * width);
-		for (int x = 0; x < width; ++x) {
-			ibo_->Data().push_back((y + 1) * width + x);
-			ibo_->Data().push_back(y * width + x);
-		}
-		if (y < height - 2)
-			ibo_->Data().push_back(y * width + width - 1);
+	Vector3f skirt = up.Normalized() * -depth;
+	for (std::vector<GLuint>::const_iterator i = edge.begin(); i != edge.end(); ++i) {
+		TerrainVertex bottom = vbo_->Data()[*i];
+		bottom.pos += skirt;
+		vbo_->Data().push_back(bottom);
+	}
+
+	AcquireTerrainGrid(width, height, &ibo_, NULL);
+
+	if (flags & QUANTIZE_VERTICES) {
+		Quantize();
+		size_ = packed_vbo_->GetFootprint();
+	} else {
+		size_ = vbo_->GetFootprint();
 	}
+}
 
-	size_ = vbo_->GetFootprint() + ibo_->GetFootprint();
+void TerrainTile::Quantize() {
+	for (std::vector<TerrainVertex>::const_iterator i = vbo_->Data().begin(); i != vbo_->Data().end(); ++i)
+		quantizer_.Include(i->pos);
+
+	quantizer_.Prepare();
+	quantized_ = true;
+
+	packed_vbo_.reset(new VertexBuffer<PackedTerrainVertex>(GL_ARRAY_BUFFER));
+	packed_vbo_->Data().resize(vbo_->Data().size());
+	for (size_t i = 0; i < vbo_->Data().size(); ++i) {
+		PackedTerrainVertex& packed = packed_vbo_->Data()[i];
+		quantizer_.QuantizePosition(vbo_->Data()[i].pos, packed.pos);
+		VertexQuantizer::QuantizeNormal(vbo_->Data()[i].norm, packed.norm);
+		packed.pos[3] = 0;
+		packed.norm[3] = 0;
+	}
+	vbo_.reset(NULL);
+}
+
+void TerrainTile::UploadHeights() {
+#if defined(WITH_HEIGHT_TEXTURES)
+	if (heights_texture_ || heights_.empty())
+		return;
+
+	glGenTextures(1, &heights_texture_);
+	glBindTexture(GL_TEXTURE_2D, heights_texture_);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	/* rows are not 4 byte aligned */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE16, width_ + 2, height_ + 2, 0, GL_LUMINANCE, GL_UNSIGNED_SHORT, heights_.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	std::vector<GLushort>().swap(heights_);
+#endif
 }
 
 TerrainTile::~TerrainTile() {
+	if (batch_)
+		batch_->Remove(handle_);
+	if (ibo_)
+		ReleaseTerrainGrid(width_, height_);
+	if (heights_texture_)
+		glDeleteTextures(1, &heights_texture_);
 }
 
 void TerrainTile::Render() {
-	vbo_->Bind();
+	/* height textures need shader */
+	if (!ibo_ || grid_vbo_)
+		return;
 
 	glEnableClientState(GL_VERTEX_ARRAY);
-	glVertexPointer(3, GL_FLOAT, sizeof(TerrainVertex), BUFFER_OFFSET(0));
-
 	glEnableClientState(GL_NORMAL_ARRAY);
-	glNormalPointer(GL_FLOAT, sizeof(TerrainVertex), BUFFER_OFFSET(12));
+
+	if (packed_vbo_.get()) {
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		quantizer_.Apply();
+		glEnable(GL_NORMALIZE);
+
+		packed_vbo_->Bind();
+		glVertexPointer(3, GL_SHORT, sizeof(PackedTerrainVertex), BUFFER_OFFSET(0));
+		glNormalPointer(GL_BYTE, sizeof(PackedTerrainVertex), BUFFER_OFFSET(8));
+	} else {
+		vbo_->Bind();
+		glVertexPointer(3, GL_FLOAT, sizeof(TerrainVertex), BUFFER_OFFSET(0));
+		glNormalPointer(GL_FLOAT, sizeof(TerrainVertex), BUFFER_OFFSET(12));
+	}
 
 	ibo_->Bind();
 
-	glDrawElements(GL_TRIANGLE_STRIP, ibo_->GetSize(), GL_UNSIGNED_SHORT, BUFFER_OFFSET(0));
+	glDrawElements(GL_TRIANGLE_STRIP, ibo_->GetSize(), ibo_->GetType(), BUFFER_OFFSET(0));
 
 	ibo_->UnBind();
 
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (packed_vbo_.get()) {
+		glDisable(GL_NORMALIZE);
+		glPopMatrix();
+	}
+
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
 }
 
+void TerrainTile::Render(TileShader& shader) {
+	if (!ibo_)
+		return;
+
+	if (grid_vbo_) {
+		UploadHeights();
+
+		shader.SetTerrainGrid(width_ + 2, height_ + 2, bounds_, lines_.data(), skirt_depth_);
+
+		if (array_.Bind()) {
+			grid_vbo_->Bind();
+			VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(Vector3f), 0);
+			ibo_->Bind();
+		}
+
+		glBindTexture(GL_TEXTURE_2D, heights_texture_);
+		glDrawElements(GL_TRIANGLE_STRIP, ibo_->GetSize(), ibo_->GetType(), BUFFER_OFFSET(0));
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return;
+	}
+
+	shader.SetQuantizer(packed_vbo_.get() ? &quantizer_ : NULL);
+
+	if (array_.Bind()) {
+		if (packed_vbo_.get()) {
+			packed_vbo_->Bind();
+			VertexArray::SetAttribute(TileShader::POSITION, 3, GL_SHORT, false, sizeof(PackedTerrainVertex), 0);
+			VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_BYTE, true, sizeof(PackedTerrainVertex), 8);
+		} else {
+			vbo_->Bind();
+			VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, sizeof(TerrainVertex), 0);
+			VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_FLOAT, false, sizeof(TerrainVertex), 12);
+		}
+		ibo_->Bind();
+	}
+
+	glDrawElements(GL_TRIANGLE_STRIP, ibo_->GetSize(), ibo_->GetType(), BUFFER_OFFSET(0));
+}
+
+void TerrainTile::Render(TileBatch& batch, const float modelview[16]) {
+	if (!batch_)
+		Upload(batch);
+
+	if (batch_)
+		batch.Draw(handle_, batch.AddInstance(modelview, quantized_ ? &quantizer_ : NULL));
+}
+
 size_t TerrainTile::GetSize() const {
 	return size_;
 }
+
+size_t TerrainTile::GetUploadSize() const {
+	size_t size = heights_.size() * sizeof(GLushort);
+	if (vbo_.get())
+		size += vbo_->GetPendingFootprint();
+	if (packed_vbo_.get())
+		size += packed_vbo_->GetPendingFootprint();
+	if (grid_vbo_)
+		size += grid_vbo_->GetPendingFootprint();
+	if (ibo_)
+		size += ibo_->GetPendingFootprint();
+	return size;
+}
+
+void TerrainTile::Upload() {
+	if (vbo_.get())
+		vbo_->Freeze();
+	if (packed_vbo_.get())
+		packed_vbo_->Freeze();
+	if (grid_vbo_)
+		grid_vbo_->Freeze();
+	if (ibo_)
+		ibo_->Freeze();
+	UploadHeights();
+}
+
+void TerrainTile::Upload(TileBatch& batch) {
+	static const GLfloat color[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+	/* height textures are not batched */
+	if (batch_ || grid_vbo_)
+		return;
+	batch_ = &batch;
+
+	int group = batch.GetGroup(packed_vbo_.get() ? TileBatch::POSITION_NORMAL_SHORT : TileBatch::POSITION_NORMAL_FLOAT, GL_TRIANGLE_STRIP, ibo_->GetType(), true, color);
+	if (packed_vbo_.get())
+		handle_ = batch.Add(group, packed_vbo_->Data().data(), packed_vbo_->GetSize(), ibo_->GetRamData(), ibo_->GetSize());
+	else
+		handle_ = batch.Add(group, vbo_->Data().data(), vbo_->GetSize(), ibo_->GetRamData(), ibo_->GetSize());
+
+	vbo_.reset(NULL);
+	packed_vbo_.reset(NULL);
+	ReleaseTerrainGrid(width_, height_);
+	ibo_ = NULL;
+}
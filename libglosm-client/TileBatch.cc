@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/TileBatch.hh>
+
+#include <glosm/TileShader.hh>
+#include <glosm/VertexArray.hh>
+#include <glosm/VertexQuantizer.hh>
+#include <glosm/CheckGL.hh>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if defined(WITH_MULTIDRAW)
+
+/* initial size of shared buffers, in items */
+static const size_t TILEBATCH_MIN_CAPACITY = 65536;
+
+static size_t GetTileBatchVertexSize(TileBatch::VertexFormat format) {
+	switch (format) {
+	case TileBatch::POSITION_FLOAT: return sizeof(GLfloat) * 3;
+	case TileBatch::POSITION_SHORT: return sizeof(GLshort) * 4;
+	case TileBatch::POSITION_NORMAL_FLOAT: return sizeof(GLfloat) * 6;
+	case TileBatch::POSITION_NORMAL_SHORT: return sizeof(GLshort) * 4 + sizeof(GLbyte) * 4;
+	}
+	return 0;
+}
+
+TileBatch::BufferArena::BufferArena(size_t item_size) : buffer_(0), item_size_(item_size), capacity_(0) {
+}
+
+TileBatch::BufferArena::~BufferArena() {
+	if (buffer_)
+		glDeleteBuffers(1, &buffer_);
+}
+
+bool TileBatch::BufferArena::Add(const void* data, size_t count, size_t& offset) {
+	bool grown = false;
+
+	FreeMap::iterator range;
+	while (true) {
+		for (range = free_.begin(); range != free_.end() && range->second < count; ++range)
+			;
+
+		if (range != free_.end())
+			break;
+
+		Grow(capacity_ + count);
+		grown = true;
+	}
+
+	offset = range->first;
+	size_t size = range->second;
+	free_.erase(range);
+	if (size > count)
+		free_[offset + count] = size - count;
+
+	/* copy targets are used for uploads, so bindings of
+	 * vertex arrays are not disturbed */
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, offset * item_size_, count * item_size_, data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	return grown;
+}
+
+void TileBatch::BufferArena::Remove(size_t offset, size_t count) {
+	Free(offset, count);
+}
+
+void TileBatch::BufferArena::Grow(size_t min_capacity) {
+	size_t capacity = std::max(capacity_ * 2, std::max(min_capacity, TILEBATCH_MIN_CAPACITY));
+
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, capacity * item_size_, NULL, GL_STATIC_DRAW);
+
+	if (buffer_) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer_);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, capacity_ * item_size_);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &buffer_);
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	size_t old_capacity = capacity_;
+	buffer_ = buffer;
+	capacity_ = capacity;
+	Free(old_capacity, capacity - old_capacity);
+}
+
+void TileBatch::BufferArena::Free(size_t offset, size_t count) {
+	/* merge with adjacent free ranges */
+	FreeMap::iterator next = free_.lower_bound(offset);
+	if (next != free_.end() && offset + count == next->first) {
+		count += next->second;
+		free_.erase(next++);
+	}
+
+	if (next != free_.begin()) {
+		FreeMap::iterator prev = next;
+		--prev;
+		if (prev->first + prev->second == offset) {
+			prev->second += count;
+			return;
+		}
+	}
+
+	free_[offset] = count;
+}
+
+TileBatch::TileBatch() : instance_buffer_(0), command_buffer_(0) {
+	if (!IsSupported())
+		throw GLUnsupportedException() << "Tile batching requires OpenGL 4.3";
+
+	glGenBuffers(1, &instance_buffer_);
+	glGenBuffers(1, &command_buffer_);
+}
+
+TileBatch::~TileBatch() {
+	for (GroupVector::iterator i = groups_.begin(); i != groups_.end(); ++i) {
+		if (i->array)
+			glDeleteVertexArrays(1, &i->array);
+		delete i->vertices;
+		delete i->indices;
+	}
+
+	glDeleteBuffers(1, &instance_buffer_);
+	glDeleteBuffers(1, &command_buffer_);
+}
+
+bool TileBatch::IsSupported() {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version == NULL || strncmp(version, "OpenGL ES", 9) == 0)
+		return false;
+
+	/* multi-draw indirect with base instance */
+	int major = 0, minor = 0;
+	if (sscanf(version, "%d.%d", &major, &minor) != 2)
+		return false;
+
+	return major > 4 || (major == 4 && minor >= 3);
+}
+
+int TileBatch::GetGroup(VertexFormat format, GLenum mode, GLenum index_type, bool lighting, const GLfloat color[4]) {
+	for (size_t i = 0; i < groups_.size(); ++i) {
+		const Group& group = groups_[i];
+		if (group.format == format && group.mode == mode && group.index_type == index_type && group.lighting == lighting && std::equal(color, color + 4, group.color))
+			return i;
+	}
+
+	Group group;
+	group.format = format;
+	group.mode = mode;
+	group.index_type = index_type;
+	group.lighting = lighting;
+	std::copy(color, color + 4, group.color);
+	group.vertices = new BufferArena(GetTileBatchVertexSize(format));
+	group.indices = new BufferArena(index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+	group.array = 0;
+	group.array_valid = false;
+
+	groups_.push_back(group);
+	return groups_.size() - 1;
+}
+
+TileBatch::Handle TileBatch::Add(int group, const void* vertices, size_t nvertices, const void* indices, size_t nindices) {
+	Handle handle;
+	if (nvertices == 0 || nindices == 0)
+		return handle;
+
+	Group& g = groups_[group];
+	if (g.vertices->Add(vertices, nvertices, handle.first_vertex))
+		g.array_valid = false;
+	if (g.indices->Add(indices, nindices, handle.first_index))
+		g.array_valid = false;
+
+	handle.group = group;
+	handle.nvertices = nvertices;
+	handle.nindices = nindices;
+
+	return handle;
+}
+
+void TileBatch::Remove(Handle& handle) {
+	if (!handle.IsValid())
+		return;
+
+	Group& g = groups_[handle.group];
+	g.vertices->Remove(handle.first_vertex, handle.nvertices);
+	g.indices->Remove(handle.first_index, handle.nindices);
+
+	handle = Handle();
+}
+
+int TileBatch::AddInstance(const GLfloat modelview[16], const VertexQuantizer* quantizer) {
+	Instance instance;
+	std::copy(modelview, modelview + 16, instance.modelview);
+	if (quantizer) {
+		instance.dequantize[0] = quantizer->GetCenter().x;
+		instance.dequantize[1] = quantizer->GetCenter().y;
+		instance.dequantize[2] = quantizer->GetCenter().z;
+		instance.dequantize[3] = quantizer->GetScale();
+	} else {
+		instance.dequantize[0] = instance.dequantize[1] = instance.dequantize[2] = 0.0f;
+		instance.dequantize[3] = 1.0f;
+	}
+
+	instances_.push_back(instance);
+	return instances_.size() - 1;
+}
+
+void TileBatch::Draw(const Handle& handle, int instance, int ninstances) {
+	if (!handle.IsValid() || ninstances <= 0)
+		return;
+
+	DrawCommand command;
+	command.count = handle.nindices;
+	command.instance_count = ninstances;
+	command.first_index = handle.first_index;
+	command.base_vertex = handle.first_vertex;
+	command.base_instance = instance;
+
+	groups_[handle.group].commands.push_back(command);
+}
+
+void TileBatch::SetupArray(Group& group) {
+	if (!group.array)
+		glGenVertexArrays(1, &group.array);
+	glBindVertexArray(group.array);
+
+	glBindBuffer(GL_ARRAY_BUFFER, group.vertices->GetBuffer());
+	GLsizei stride = GetTileBatchVertexSize(group.format);
+	switch (group.format) {
+	case POSITION_FLOAT:
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, stride, 0);
+		break;
+	case POSITION_SHORT:
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_SHORT, false, stride, 0);
+		break;
+	case POSITION_NORMAL_FLOAT:
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_FLOAT, false, stride, 0);
+		VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_FLOAT, false, stride, sizeof(GLfloat) * 3);
+		break;
+	case POSITION_NORMAL_SHORT:
+		VertexArray::SetAttribute(TileShader::POSITION, 3, GL_SHORT, false, stride, 0);
+		VertexArray::SetAttribute(TileShader::NORMAL, 3, GL_BYTE, true, stride, sizeof(GLshort) * 4);
+		break;
+	}
+
+	/* instance attributes, picked by base instance of a draw */
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer_);
+	for (int column = 0; column < 4; ++column) {
+		VertexArray::SetAttribute(TileShader::MODELVIEW + column, 4, GL_FLOAT, false, sizeof(Instance), sizeof(GLfloat) * 4 * column);
+		glVertexAttribDivisor(TileShader::MODELVIEW + column, 1);
+	}
+	VertexArray::SetAttribute(TileShader::DEQUANTIZE, 4, GL_FLOAT, false, sizeof(Instance), sizeof(GLfloat) * 16);
+	glVertexAttribDivisor(TileShader::DEQUANTIZE, 1);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, group.indices->GetBuffer());
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	group.array_valid = true;
+}
+
+void TileBatch::Flush(TileShader& shader) {
+	if (instances_.empty())
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer_);
+	glBufferData(GL_ARRAY_BUFFER, instances_.size() * sizeof(Instance), &instances_[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	/* commands of all groups go into a single buffer */
+	std::vector<size_t> offsets;
+	for (GroupVector::const_iterator i = groups_.begin(); i != groups_.end(); ++i) {
+		offsets.push_back(commands_.size());
+		commands_.insert(commands_.end(), i->commands.begin(), i->commands.end());
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer_);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, commands_.size() * sizeof(DrawCommand), &commands_[0], GL_STREAM_DRAW);
+
+	for (size_t i = 0; i < groups_.size(); ++i) {
+		Group& group = groups_[i];
+		if (group.commands.empty())
+			continue;
+
+		if (!group.array_valid)
+			SetupArray(group);
+
+		shader.SetLighting(group.lighting);
+		shader.SetColor(group.color[0], group.color[1], group.color[2], group.color[3]);
+
+		glBindVertexArray(group.array);
+		glMultiDrawElementsIndirect(group.mode, group.index_type, (const char*)NULL + offsets[i] * sizeof(DrawCommand), group.commands.size(), 0);
+
+		group.commands.clear();
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	instances_.clear();
+	commands_.clear();
+}
+
+size_t TileBatch::GetFootprint() const {
+	size_t size = 0;
+	for (GroupVector::const_iterator i = groups_.begin(); i != groups_.end(); ++i)
+		size += i->vertices->GetFootprint() + i->indices->GetFootprint();
+	return size;
+}
+
+#else
+
+TileBatch::BufferArena::BufferArena(size_t item_size) : buffer_(0), item_size_(item_size), capacity_(0) {
+}
+
+TileBatch::BufferArena::~BufferArena() {
+}
+
+TileBatch::TileBatch() : instance_buffer_(0), command_buffer_(0) {
+	throw GLUnsupportedException() << "Tile batching is not supported with OpenGL ES";
+}
+
+TileBatch::~TileBatch() {
+}
+
+bool TileBatch::IsSupported() {
+	return false;
+}
+
+int TileBatch::GetGroup(VertexFormat, GLenum, GLenum, bool, const GLfloat*) {
+	return -1;
+}
+
+TileBatch::Handle TileBatch::Add(int, const void*, size_t, const void*, size_t) {
+	return Handle();
+}
+
+void TileBatch::Remove(Handle&) {
+}
+
+int TileBatch::AddInstance(const GLfloat*, const VertexQuantizer*) {
+	return -1;
+}
+
+void TileBatch::Draw(const Handle&, int, int) {
+}
+
+void TileBatch::Flush(TileShader&) {
+}
+
+size_t TileBatch::GetFootprint() const {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/TileLoader.hh>
+
+#include <glosm/TileManager.hh>
+#include <glosm/Exception.hh>
+
+#include <unistd.h>
+
+TileLoader::TileLoader(int nthreads) {
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	die_flag_ = false;
+
+	int errn;
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_cond_init(&cond_, 0)) != 0) {
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if ((errn = pthread_cond_init(&idle_cond_, 0)) != 0) {
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	/* work with what was created, like TileManager does */
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_t thread;
+		if ((errn = pthread_create(&thread, NULL, LoadingThreadFuncWrapper, (void*)this)) != 0) {
+			if (threads_.empty()) {
+				pthread_cond_destroy(&idle_cond_);
+				pthread_cond_destroy(&cond_);
+				pthread_mutex_destroy(&mutex_);
+				throw SystemError(errn) << "pthread_create failed";
+			}
+			break;
+		}
+		threads_.push_back(thread);
+	}
+}
+
+TileLoader::~TileLoader() {
+	pthread_mutex_lock(&mutex_);
+	die_flag_ = true;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	for (ThreadVector::iterator i = threads_.begin(); i != threads_.end(); ++i)
+		pthread_join(*i, NULL);
+
+	pthread_cond_destroy(&idle_cond_);
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+TileLoader::Client* TileLoader::FindClient(TileManager* manager) {
+	for (ClientVector::iterator i = clients_.begin(); i != clients_.end(); ++i)
+		if (i->manager == manager)
+			return &*i;
+	return NULL;
+}
+
+void TileLoader::LoadingThreadFunc() {
+	pthread_mutex_lock(&mutex_);
+	while (!die_flag_) {
+		/* find the most important task of all managers; this
+		 * takes their queue mutexes, so managers must never
+		 * call loader with these held */
+		TileManager* best = NULL;
+		float best_priority = 0.0f;
+		for (ClientVector::iterator i = clients_.begin(); i != clients_.end(); ++i) {
+			float priority;
+			if (!i->detaching && i->manager->GetNextTaskPriority(priority) && (best == NULL || priority < best_priority)) {
+				best = i->manager;
+				best_priority = priority;
+			}
+		}
+
+		/* found nothing, sleep */
+		if (best == NULL) {
+			pthread_cond_wait(&cond_, &mutex_);
+			continue;
+		}
+
+		FindClient(best)->running++;
+		pthread_mutex_unlock(&mutex_);
+
+		/* another thread may have taken the task meanwhile,
+		 * then this just does nothing */
+		best->LoadNextTile();
+
+		pthread_mutex_lock(&mutex_);
+		/* client is not removed while its tiles are loaded */
+		FindClient(best)->running--;
+		pthread_cond_broadcast(&idle_cond_);
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void* TileLoader::LoadingThreadFuncWrapper(void* arg) {
+	static_cast<TileLoader*>(arg)->LoadingThreadFunc();
+	return NULL;
+}
+
+void TileLoader::Attach(TileManager* manager) {
+	pthread_mutex_lock(&mutex_);
+	if (FindClient(manager) == NULL)
+		clients_.push_back(Client(manager));
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
+
+void TileLoader::Detach(TileManager* manager) {
+	pthread_mutex_lock(&mutex_);
+	Client* client = FindClient(manager);
+	if (client != NULL) {
+		client->detaching = true;
+		while ((client = FindClient(manager))->running > 0)
+			pthread_cond_wait(&idle_cond_, &mutex_);
+
+		clients_.erase(clients_.begin() + (client - &clients_[0]));
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void TileLoader::Wakeup() {
+	pthread_mutex_lock(&mutex_);
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
@@ -25,16 +25,246 @@
 #include <glosm/GeometryDatasource.hh>
 #include <glosm/GeometryOperations.hh>
 #include <glosm/Tile.hh>
+#include <glosm/TileShader.hh>
+#include <glosm/TileBatch.hh>
+#include <glosm/TileLoader.hh>
+#include <glosm/FrameScheduler.hh>
+#include <glosm/ImpostorCache.hh>
+#include <glosm/CheckGL.hh>
 #include <glosm/Exception.hh>
+#include <glosm/Timer.hh>
+#include <glosm/Trace.hh>
+#include <glosm/geomath.h>
 
 #include <glosm/util/gl.h>
 
+#include <time.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* max number of tiles waiting for loading */
+static const size_t MAX_QUEUE_SIZE = 100;
+
+/* priority multiplier for tiles outside of view */
+static const float OUT_OF_VIEW_PENALTY = 4.0f;
+
+/* priority of tiles ahead of moving viewer is multiplied by
+ * (1 - weight), tiles behind it by (1 + weight) */
+static const float MOVEMENT_WEIGHT = 0.5f;
+
+/* locality load only traverses quadtree when viewer has moved
+ * by this part of range or turned by this angle (in radians)
+ * since last traversal */
+static const float LOAD_PASS_DISTANCE = 0.01f;
+static const float LOAD_PASS_ANGLE = 0.1f;
+
+/* priority of prefetched tiles is offset by this many ranges, so
+ * these always go after needed tiles, which priority is at most
+ * range * OUT_OF_VIEW_PENALTY * (1 + MOVEMENT_WEIGHT) */
+static const float PREFETCH_PRIORITY_RANGES = 8.0f;
+
+/* once started, garbage collection continues until tiles size
+ * falls below this fraction of size limit */
+static const float GC_LOW_WATERMARK = 0.8f;
+
+/* number of quadtree nodes allocated at once */
+static const size_t NODE_SLAB_SIZE = 256;
+
+/* max number of tiles dropped by single GarbageCollect() call */
+static const int GC_MAX_EVICTIONS = 16;
+
+/* number of least recently used tiles to choose victim from */
+static const int GC_WINDOW = 8;
+
+/* lower bound on tile cost in seconds, so tiles which took no
+ * measurable time to spawn don't get infinite score */
+static const float GC_MIN_COST = 0.001f;
+
+/* distance in geo units viewer may go from render origin before it
+ * is moved, so cached tile transforms stay precise in float */
+static const osmint_t RENDER_ORIGIN_MAX_SHIFT = 100000;
+
+/* default amount of tile data uploaded to GPU per frame */
+static const size_t DEFAULT_UPLOAD_BUDGET = 4 * 1024 * 1024;
+
+/* asynchronous tile requests kept in flight at once */
+static const size_t MAX_REQUESTS_IN_FLIGHT = 32;
+
+/* seconds before tile which failed to load is requested again,
+ * so unavailable datasource is not flooded with requests */
+static const double LOAD_RETRY_DELAY = 2.0;
+
+/* dropped tiles destroyed per frame; destruction mostly frees
+ * GL objects, so large Clear() is spread over several frames */
+static const size_t MAX_RECLAIMS_PER_FRAME = 64;
+
+/* consecutive frames a locality load pass may be postponed when
+ * out of maintenance time, so loading doesn't starve */
+static const int MAX_DEFERRED_LOAD_PASSES = 4;
+
+/* occlusion query results older than this many frames are
+ * ignored; a few frames of latency are normal for the GPU */
+static const int MAX_OCCLUSION_QUERY_AGE = 3;
+
+/* tile boxes closer to viewer than this many near plane distances
+ * are not queried and are considered visible, as near plane may
+ * clip their faces off */
+static const float OCCLUSION_NEAR_MARGIN = 4.0f;
+
+/* fractional bits of fixed point longitude scale of range checks */
+static const int RANGE_CHECK_SCALE_BITS = 16;
+
+/* components of range check distances are clamped to this many
+ * latitude units (about 24000 km), so squares of three of them
+ * sum without overflow */
+static const osmlong_t RANGE_CHECK_MAX_OFFSET = (osmlong_t)1 << 31;
+
+static double GetTileManagerClock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* distance from coordinate to segment, zero inside it */
+static inline osmlong_t GetRangeOffset(osmint_t pos, osmint_t min, osmint_t max) {
+	if (pos < min)
+		return (osmlong_t)min - pos;
+	if (pos > max)
+		return (osmlong_t)pos - max;
+	return 0;
+}
+
+static inline uint64_t GetRangeSquare(osmlong_t offset) {
+	offset = std::min(offset, RANGE_CHECK_MAX_OFFSET);
+	return (uint64_t)(offset * offset);
+}
+
+/* longitude offset in latitude units, by fixed point cosine */
+static inline osmlong_t ScaleRangeOffset(osmlong_t offset, osmlong_t lon_scale) {
+	return (offset * lon_scale) >> RANGE_CHECK_SCALE_BITS;
+}
+
+/* part of tile size still held in system memory; estimates
+ * of the two may disagree slightly, so it's clamped */
+static size_t GetTileRamSize(const Tile* tile) {
+	return std::min(tile->GetUploadSize(), tile->GetSize());
+}
+
+static osmlong_t AbsDifference(osmint_t a, osmint_t b) {
+	return a > b ? (osmlong_t)a - b : (osmlong_t)b - a;
+}
+
+/**
+ * Moves position by velocity in meters per second for given time,
+ * wrapping and clamping it the same way FirstPersonViewer does
+ */
+static Vector3i ExtrapolateViewerPos(const Vector3i& pos, const Vector3f& velocity, float time) {
+	const double coslat = cos(pos.y * GEOM_DEG_TO_RAD);
+	const double scale = (double)GEOM_LONSPAN / WGS84_EARTH_EQ_LENGTH;
+
+	double x = pos.x + velocity.x * time * scale / coslat;
+	double y = pos.y + velocity.y * time * scale;
+	double z = pos.z + velocity.z * time * GEOM_UNITSINMETER;
+
+	if (x > GEOM_MAXLON)
+		x -= GEOM_LONSPAN;
+	if (x < GEOM_MINLON)
+		x += GEOM_LONSPAN;
+
+	y = std::max((double)GEOM_MERCATOR_MINLAT, std::min((double)GEOM_MERCATOR_MAXLAT, y));
+	z = std::max(0.0, std::min((double)std::numeric_limits<osmint_t>::max(), z));
+
+	return Vector3i((osmint_t)x, (osmint_t)y, (osmint_t)z);
+}
+
+/**
+ * Multiplies column-major matrices
+ */
+static void MultiplyMatrix(const float a[16], const float b[16], float result[16]) {
+	for (int col = 0; col < 4; ++col) {
+		for (int row = 0; row < 4; ++row) {
+			result[col * 4 + row] = 0.0f;
+			for (int k = 0; k < 4; ++k)
+				result[col * 4 + row] += a[k * 4 + row] * b[col * 4 + k];
+		}
+	}
+}
 
-TileManager::TileManager(const Projection projection): projection_(projection), loading_(-1, -1, -1) {
+/**
+ * Post-multiplies column-major matrix by another one, like glMultMatrix
+ */
+static void MultiplyTileTransform(double matrix[16], const double other[16]) {
+	double result[16];
+	for (int col = 0; col < 4; ++col) {
+		for (int row = 0; row < 4; ++row) {
+			result[col * 4 + row] = 0.0;
+			for (int k = 0; k < 4; ++k)
+				result[col * 4 + row] += matrix[k * 4 + row] * other[col * 4 + k];
+		}
+	}
+	std::copy(result, result + 16, matrix);
+}
+
+/**
+ * Post-multiplies column-major matrix by rotation, like glRotate
+ */
+static void RotateTileTransform(double matrix[16], double angle, const Vector3d& axis) {
+	double s = sin(angle * GEOM_DEG_TO_RAD);
+	double c = cos(angle * GEOM_DEG_TO_RAD);
+	double x = axis.x, y = axis.y, z = axis.z;
+
+	double rotation[16] = {
+		x * x * (1.0 - c) + c,     y * x * (1.0 - c) + z * s, x * z * (1.0 - c) - y * s, 0.0,
+		x * y * (1.0 - c) - z * s, y * y * (1.0 - c) + c,     y * z * (1.0 - c) + x * s, 0.0,
+		x * z * (1.0 - c) + y * s, y * z * (1.0 - c) - x * s, z * z * (1.0 - c) + c,     0.0,
+		0.0,                       0.0,                       0.0,                       1.0,
+	};
+
+	MultiplyTileTransform(matrix, rotation);
+}
+
+TileManager::Statistics::Statistics() : queued(0), loading(0), tiles(0), bytes(0), speculative_bytes(0), size_limit(0), gpu_bytes(0), ram_bytes(0), gpu_size_limit(0), reclaiming(0), requests(0), loaded(0), dropped(0), evicted(0), cancelled(0), failed(0), load_passes(0), spawn_time(0.0), gc_time(0.0), popins(0), popin_time(0.0), popin_max(0.0f), impostors(0), impostor_bytes(0), impostor_updates(0), maintenance_time(0.0), maintenance_overruns(0), deferred_passes(0) {
+	std::fill(spawn_times, spawn_times + NUM_SPAWN_TIME_BUCKETS, 0);
+	std::fill(popin_times, popin_times + NUM_POPIN_TIME_BUCKETS, 0);
+}
+
+TileManager::TileManager(const Projection projection): projection_(projection) {
 	generation_ = 0;
+	data_version_ = 0;
 	thread_die_flag_ = false;
+	loader_ = NULL;
+	scheduler_ = NULL;
+	maintenance_frame_ = 0;
+	maintenance_spent_ = 0.0;
+	maintenance_start_ = 0.0;
+	maintenance_time_ = 0.0;
+	maintenance_overruns_ = 0;
+	deferred_passes_ = 0;
+	deferred_pass_run_ = 0;
+	has_placed_frame_ = false;
+	placed_frame_ = 0;
+	load_pass_ = 0;
+	queue_truncated_ = false;
+	force_load_pass_ = true;
+	shader_ = NULL;
+	has_render_origin_ = false;
+	render_origin_version_ = 0;
+	finished_ = NULL;
+	upload_head_ = upload_tail_ = NULL;
+	upload_budget_ = DEFAULT_UPLOAD_BUDGET;
+	occlusion_culling_ = false;
+	render_frame_ = 0;
+	prefetch_time_ = 0.0f;
+	prefetch_limit_ = 0;
+	speculative_size_ = 0;
+	cancelled_count_ = 0;
+	failed_count_ = 0;
+	failure_reported_ = false;
 
 	int errn;
 
@@ -52,43 +282,68 @@ TileManager::TileManager(const Projection projection): projection_(projection),
 		throw SystemError(errn) << "pthread_cond_init failed";
 	}
 
-	if ((errn = pthread_create(&loading_thread_, NULL, LoadingThreadFuncWrapper, (void*)this)) != 0) {
+	try {
+		StartLoadingThreads(1);
+	} catch (...) {
 		pthread_mutex_destroy(&tiles_mutex_);
 		pthread_mutex_destroy(&queue_mutex_);
 		pthread_cond_destroy(&queue_cond_);
-		throw SystemError(errn) << "pthread_create failed";
+		throw;
 	}
 
 	level_ = 12;
+	min_level_ = 12;
+	lod_factor_ = 1.0f;
 	range_ = 1000.0f;
 	flags_ = 0;
 	height_effect_ = false;
 
 	total_size_ = 0;
 	tile_count_ = 0;
+	ram_size_ = 0;
+	upload_size_ = 0;
+	gpu_size_limit_ = 0;
+
+	lru_head_ = lru_tail_ = NULL;
+	free_nodes_ = NULL;
+	collecting_ = false;
 }
 
 
 TileManager::~TileManager() {
-	thread_die_flag_ = true;
-	pthread_cond_signal(&queue_cond_);
-
-	/* @todo check exit code? */
-	pthread_join(loading_thread_, NULL);
+	StopLoading();
+	SetScheduler(NULL);
 
 	pthread_cond_destroy(&queue_cond_);
 	pthread_mutex_destroy(&queue_mutex_);
 	pthread_mutex_destroy(&tiles_mutex_);
 
+	PlaceFinishedTiles(false);
+
+	/* tiles which were never uploaded */
+	while (upload_head_ != NULL) {
+		FinishedTile* next = upload_head_->next;
+		upload_size_ -= upload_head_->tile->GetSize();
+		delete upload_head_->tile;
+		delete upload_head_;
+		upload_head_ = next;
+	}
+
 	fprintf(stderr, "Tile statistics before cleanup: %u tiles, %u bytes\n", (unsigned int)tile_count_, (unsigned int)total_size_);
+
+	/* tiles free their geometry in batch, so go before it */
 	RecDestroyTiles(&root_);
+	ReclaimTiles(reclaim_.size());
+
+	for (std::vector<QuadNode*>::iterator i = node_slabs_.begin(); i != node_slabs_.end(); ++i)
+		delete[] *i;
 }
 
 /*
  * recursive quadtree processing
  */
 
-void TileManager::RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, int level, int x, int y) {
+void TileManager::RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, QuadNode* parent, int level, int x, int y) {
 	QuadNode* node;
 
 	if (*pnode == NULL) {
@@ -96,8 +351,7 @@ void TileManager::RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, int
 		BBoxi bbox = BBoxi::ForGeoTile(level, x, y);
 		if (!info.bbox->Intersects(bbox))
 			return;
-		node = *pnode = new QuadNode;
-		node->bbox = bbox;
+		node = *pnode = CreateNode(parent, bbox);
 	} else {
 		/* node exists, visit it if it's in bbox */
 		node = *pnode;
@@ -109,18 +363,18 @@ void TileManager::RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, int
 	node->generation = generation_;
 
 	if (level == level_) {
-		if (node->tile)
-			return; /* tile already loaded */
+		node->leaf_generation = generation_;
+
+		if (node->tile) {
+			TouchTile(node);
+			if (!IsOutdated(node))
+				return; /* tile already loaded */
+		}
 
 		if (info.flags & SYNC) {
-			node->tile = SpawnTile(node->bbox, flags_);
-			tile_count_++;
-			total_size_ += node->tile->GetSize();
-		} else if (loading_ != TileId(level, x, y)) {
-			if (info.queue_size < 100) {
-				queue_.push_front(TileTask(TileId(level, x, y), node->bbox));
-				info.queue_size++;
-			}
+			SpawnTileSync(node, level);
+		} else {
+			EnqueueTile(TileId(level, x, y), node->bbox, 0.0f, GetLevelFlags(level));
 		}
 
 		/* no more recursion is needed */
@@ -128,81 +382,535 @@ void TileManager::RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, int
 	}
 
 	/* recurse */
-	RecLoadTilesBBox(info, node->childs, level+1, x * 2, y * 2);
-	RecLoadTilesBBox(info, node->childs + 1, level+1, x * 2 + 1, y * 2);
-	RecLoadTilesBBox(info, node->childs + 2, level+1, x * 2, y * 2 + 1);
-	RecLoadTilesBBox(info, node->childs + 3, level+1, x * 2 + 1, y * 2 + 1);
+	RecLoadTilesBBox(info, node->childs, node, level+1, x * 2, y * 2);
+	RecLoadTilesBBox(info, node->childs + 1, node, level+1, x * 2 + 1, y * 2);
+	RecLoadTilesBBox(info, node->childs + 2, node, level+1, x * 2, y * 2 + 1);
+	RecLoadTilesBBox(info, node->childs + 3, node, level+1, x * 2 + 1, y * 2 + 1);
 
 	return;
 }
 
-void TileManager::RecLoadTilesLocality(RecLoadTilesInfo& info, QuadNode** pnode, int level, int x, int y) {
-	QuadNode* node;
-	float thisdist;
+void TileManager::RecLoadTilesLocality(RecLoadTilesInfo& info, QuadNode** pnode, float thisdist, QuadNode* parent, int level, int x, int y) {
+	/* range check passed; create node if there's none */
+	if (*pnode == NULL)
+		*pnode = CreateNode(parent, BBoxi::ForGeoTile(level, x, y));
+	QuadNode* node = *pnode;
 
-	if (*pnode == NULL) {
-		/* no node; check if it's in view and if yes, create it */
-		BBoxi bbox = BBoxi::ForGeoTile(level, x, y);
-		thisdist = ApproxDistanceSquare(bbox, info.viewer_pos);
-		if (thisdist > range_ * range_)
+	if (info.prefetch) {
+		if (level >= level_ || (level >= min_level_ && !NeedsRefinement(info, node))) {
+			/* tiles needed now are loaded by regular pass */
+			if (node->tile || node->leaf_generation == generation_ || speculative_size_ >= prefetch_limit_)
+				return;
+
+			float priority = GetTilePriority(info, node->bbox, thisdist) + range_ * PREFETCH_PRIORITY_RANGES;
+			EnqueueTile(TileId(level, x, y), node->bbox, priority, GetLevelFlags(level), true);
 			return;
-		node = *pnode = new QuadNode;
-		node->bbox = bbox;
+		}
 	} else {
-		/* node exists, visit it if it's in view */
-		node = *pnode;
-		thisdist = ApproxDistanceSquare(node->bbox, info.viewer_pos);
-		if (thisdist > range_ * range_)
-			return;
+		node->generation = generation_;
 	}
-	/* range check passed and node exists */
 
-	node->generation = generation_;
+	if (level >= level_ || (level >= min_level_ && !NeedsRefinement(info, node))) {
+		LoadLeafTile(info, node, thisdist, level, x, y);
 
-	if (level == level_) {
-		if (node->tile)
+		/* no more recursion is needed */
+		return;
+	}
+
+	/* earlier view needed this node as a leaf; finer tiles
+	 * needed by this one replace it */
+	if (!info.prefetch) {
+		node->refine_generation = generation_;
+		if (node->leaf_generation == generation_)
+			SplitLeafTile(info, node, level, x, y);
+	}
+
+	/* recurse into childs in range; quadrants split at middle
+	 * may differ from tile bboxes by rounding, which doesn't
+	 * matter for range check */
+	float dists[4];
+	int mask = GetQuadrantsInRange(info, node->bbox, dists);
+	for (int i = 0; i < 4; ++i)
+		if (mask & (1 << i))
+			RecLoadTilesLocality(info, node->childs + i, dists[i], node, level+1, x * 2 + (i & 1), y * 2 + (i >> 1));
+}
+
+void TileManager::LoadLeafTile(RecLoadTilesInfo& info, QuadNode* node, float thisdist, int level, int x, int y) {
+	if (node->refine_generation == generation_) {
+		SplitLeafTile(info, node, level, x, y);
+		return;
+	}
+
+	node->leaf_generation = generation_;
+
+	if (node->tile) {
+		TouchTile(node);
+		if (!IsOutdated(node))
 			return; /* tile already loaded */
+	}
 
-		if (info.flags & SYNC) {
-			node->tile = SpawnTile(node->bbox, flags_);
-			tile_count_++;
-			total_size_ += node->tile->GetSize();
-		} else if (loading_ != TileId(level, x, y)) {
-			if (queue_.empty()) {
-				info.closest_distance = thisdist;
-				queue_.push_front(TileTask(TileId(level, x, y), node->bbox));
-				info.queue_size++;
-			} else {
-				if (thisdist < info.closest_distance) {
-					/* this tile is closer than the best we have in the queue - push to front so it's downloaded faster */
-					queue_.push_front(TileTask(TileId(level, x, y), node->bbox));
-					info.closest_distance = thisdist;
-					info.queue_size++;
-				} else if (info.queue_size < 100) {
-					/* push into the back of the queue, but not if queue is too long */
-					queue_.push_back(TileTask(TileId(level, x, y), node->bbox));
-					info.queue_size++;
-				}
-			}
+	if (info.flags & SYNC) {
+		SpawnTileSync(node, level);
+	} else {
+		EnqueueTile(TileId(level, x, y), node->bbox, GetTilePriority(info, node->bbox, thisdist), GetLevelFlags(level));
+	}
+}
+
+void TileManager::SplitLeafTile(RecLoadTilesInfo& info, QuadNode* node, int level, int x, int y) {
+	node->leaf_generation = -1;
+
+	for (int i = 0; i < 4; ++i) {
+		int childx = x * 2 + (i & 1);
+		int childy = y * 2 + (i >> 1);
+
+		if (node->childs[i] == NULL)
+			node->childs[i] = CreateNode(node, BBoxi::ForGeoTile(level + 1, childx, childy));
+		QuadNode* child = node->childs[i];
+		child->generation = generation_;
+
+		float dist = (float)(GetHorizontalDistanceSquare(info, child->bbox) + info.height2) * info.unit2;
+		LoadLeafTile(info, child, dist, level + 1, childx, childy);
+	}
+}
+
+uint64_t TileManager::GetHorizontalDistanceSquare(const RecLoadTilesInfo& info, const BBoxi& bbox) const {
+	return GetRangeSquare(ScaleRangeOffset(GetRangeOffset(info.viewer_pos.x, bbox.left, bbox.right), info.lon_scale)) +
+		GetRangeSquare(GetRangeOffset(info.viewer_pos.y, bbox.bottom, bbox.top));
+}
+
+int TileManager::GetQuadrantsInRange(const RecLoadTilesInfo& info, const BBoxi& bbox, float dists[4]) const {
+	osmint_t midx = bbox.left + ((osmlong_t)bbox.right - bbox.left) / 2;
+	osmint_t midy = bbox.bottom + ((osmlong_t)bbox.top - bbox.bottom) / 2;
+
+	uint64_t west = GetRangeSquare(ScaleRangeOffset(GetRangeOffset(info.viewer_pos.x, bbox.left, midx), info.lon_scale));
+	uint64_t east = GetRangeSquare(ScaleRangeOffset(GetRangeOffset(info.viewer_pos.x, midx, bbox.right), info.lon_scale));
+	uint64_t north = GetRangeSquare(GetRangeOffset(info.viewer_pos.y, midy, bbox.top)) + info.height2;
+	uint64_t south = GetRangeSquare(GetRangeOffset(info.viewer_pos.y, bbox.bottom, midy)) + info.height2;
+
+	uint64_t dist2[4] = { west + north, east + north, west + south, east + south };
+
+	int mask = 0;
+	for (int i = 0; i < 4; ++i) {
+		if (dist2[i] <= info.range2) {
+			dists[i] = (float)dist2[i] * info.unit2;
+			mask |= 1 << i;
 		}
+	}
+	return mask;
+}
 
-		/* no more recursion is needed */
+void TileManager::InitRangeCheck(RecLoadTilesInfo& info) const {
+	const double unit = WGS84_EARTH_EQ_LENGTH / GEOM_LONSPAN;
+
+	info.coslat = cos(info.viewer_pos.y * GEOM_DEG_TO_RAD);
+	info.lon_scale = (osmlong_t)round(info.coslat * (1 << RANGE_CHECK_SCALE_BITS));
+	info.height2 = GetRangeSquare((osmlong_t)(fabs((double)info.viewer_pos.z) / GEOM_UNITSINMETER / unit));
+	info.lod_height2 = GetRangeSquare((osmlong_t)(fabs((double)info.lod_pos.z) / GEOM_UNITSINMETER / unit));
+	info.range2 = GetRangeSquare((osmlong_t)(range_ / unit));
+	info.unit2 = unit * unit;
+}
+
+void TileManager::SpawnTileSync(QuadNode* node, int level) {
+	TRACE_SCOPE("TileManager::SpawnTile");
+	Timer timer;
+	Tile* tile = SpawnTile(node->bbox, GetLevelFlags(level));
+
+	/* outdated one */
+	if (node->tile)
+		DestroyTile(node);
+
+	AttachTile(node, tile, timer.Count(), data_version_, false, -1.0);
+}
+
+void TileManager::AttachTile(QuadNode* node, Tile* tile, float cost, int version, bool speculative, double requested) {
+	node->tile = tile;
+	node->cost = cost;
+	node->requested = requested;
+	node->tile_version = version;
+	node->transform_origin = -1;
+	tile_count_++;
+	total_size_ += tile->GetSize();
+	node->ram_size = GetTileRamSize(tile);
+	ram_size_ += node->ram_size;
+	TouchTile(node);
+
+	stats_.loaded++;
+	stats_.spawn_time += cost;
+	int bucket = 0;
+	while (bucket < NUM_SPAWN_TIME_BUCKETS - 1 && cost * 1000.0f >= (float)(1 << bucket))
+		bucket++;
+	stats_.spawn_times[bucket]++;
+
+	if (speculative) {
+		node->speculative = true;
+		speculative_size_ += tile->GetSize();
+	}
+
+	/* propagate height range up until it's already covered */
+	for (QuadNode* n = node; n && (tile->GetMinHeight() < n->min_height || tile->GetMaxHeight() > n->max_height); n = n->parent) {
+		n->min_height = std::min(n->min_height, tile->GetMinHeight());
+		n->max_height = std::max(n->max_height, tile->GetMaxHeight());
+	}
+}
+
+void TileManager::DestroyTile(QuadNode* node) {
+#if defined(WITH_OCCLUSION_QUERIES)
+	if (node->occlusion_query) {
+		glDeleteQueries(1, &node->occlusion_query);
+		node->occlusion_query = 0;
+	}
+#endif
+	node->query_pending = false;
+	node->occluded = false;
+
+	impostors_.Destroy(node->impostor);
+
+	if (node->speculative) {
+		node->speculative = false;
+		speculative_size_ -= node->tile->GetSize();
+	}
+
+	UnlinkTile(node);
+	tile_count_--;
+	total_size_ -= node->tile->GetSize();
+	ram_size_ -= node->ram_size;
+	node->ram_size = 0;
+	reclaim_.push_back(node->tile);
+	node->tile = NULL;
+}
+
+void TileManager::ReclaimTiles(size_t count) {
+	TRACE_SCOPE("TileManager::ReclaimTiles");
+
+	for (size_t reclaimed = 0; reclaimed < count && !reclaim_.empty(); ++reclaimed) {
+		if (reclaimed > 0 && !HasMaintenanceTime())
+			break;
+
+		delete reclaim_.back();
+		reclaim_.pop_back();
+	}
+}
+
+void TileManager::BeginMaintenance() {
+	if (scheduler_ == NULL)
 		return;
+
+	/* share is per frame, so previous frame is checked
+	 * for overrun when layer first works in the next one */
+	if (maintenance_frame_ != scheduler_->GetFrame()) {
+		if (maintenance_spent_ > scheduler_->GetShare())
+			maintenance_overruns_++;
+		maintenance_frame_ = scheduler_->GetFrame();
+		maintenance_spent_ = 0.0;
 	}
 
-	/* recurse */
-	RecLoadTilesLocality(info, node->childs, level+1, x * 2, y * 2);
-	RecLoadTilesLocality(info, node->childs + 1, level+1, x * 2 + 1, y * 2);
-	RecLoadTilesLocality(info, node->childs + 2, level+1, x * 2, y * 2 + 1);
-	RecLoadTilesLocality(info, node->childs + 3, level+1, x * 2 + 1, y * 2 + 1);
+	maintenance_start_ = GetTileManagerClock();
+}
 
-	return;
+void TileManager::EndMaintenance() {
+	if (scheduler_ == NULL)
+		return;
+
+	double elapsed = GetTileManagerClock() - maintenance_start_;
+	maintenance_spent_ += elapsed;
+	maintenance_time_ += elapsed;
+	scheduler_->Charge(elapsed);
+}
+
+bool TileManager::HasMaintenanceTime() const {
+	if (scheduler_ == NULL)
+		return true;
+
+	return maintenance_spent_ + (GetTileManagerClock() - maintenance_start_) < scheduler_->GetShare();
+}
+
+void TileManager::UpdateRamSize(QuadNode* node) {
+	/* tiles placed without upload (sync loads) upload
+	 * on first render */
+	if (node->ram_size == 0)
+		return;
+
+	ram_size_ -= node->ram_size;
+	node->ram_size = GetTileRamSize(node->tile);
+	ram_size_ += node->ram_size;
+}
+
+void TileManager::TouchTile(QuadNode* node) {
+	if (node->speculative) {
+		node->speculative = false;
+		speculative_size_ -= node->tile->GetSize();
+	}
+
+	if (node == lru_head_)
+		return;
+
+	UnlinkTile(node);
+
+	node->lru_next = lru_head_;
+	if (lru_head_)
+		lru_head_->lru_prev = node;
+	lru_head_ = node;
+	if (!lru_tail_)
+		lru_tail_ = node;
 }
 
-void TileManager::RecPlaceTile(QuadNode* node, Tile* tile, int level, int x, int y) {
+void TileManager::UnlinkTile(QuadNode* node) {
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else if (lru_head_ == node)
+		lru_head_ = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else if (lru_tail_ == node)
+		lru_tail_ = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+}
+
+void TileManager::EnqueueTile(const TileId& id, const BBoxi& bbox, float priority, int flags, bool speculative) {
+	if (loading_.find(id) != loading_.end()) {
+		/* keep asynchronous request from being cancelled */
+		InflightMap::iterator inflight = inflight_.find(id);
+		if (inflight != inflight_.end() && !(speculative && !inflight->second.speculative && inflight->second.pass == load_pass_)) {
+			if (!speculative && inflight->second.requested < 0.0)
+				inflight->second.requested = GetTileManagerClock();
+			if (inflight->second.pass != load_pass_ || inflight->second.speculative != speculative || priority < inflight->second.priority)
+				inflight->second.priority = priority;
+			inflight->second.pass = load_pass_;
+			inflight->second.speculative = speculative;
+		}
+		return;
+	}
+
+	TileRetryMap::iterator failed = failed_.find(id);
+	if (failed != failed_.end()) {
+		if (failed->second > GetTileManagerClock())
+			return;
+		failed_.erase(failed);
+	}
+
+	TileTaskMap::iterator task = tasks_.find(id);
+	if (task == tasks_.end()) {
+		tasks_.insert(std::make_pair(id, TileTask(bbox, priority, load_pass_, flags, speculative, speculative ? -1.0 : GetTileManagerClock())));
+		queue_.insert(std::make_pair(priority, id));
+		return;
+	}
+
+	/* needed tile is not demoted by prefetch in the same pass */
+	if (speculative && !task->second.speculative && task->second.pass == load_pass_)
+		return;
+
+	/* with several viewers, tile keeps best priority of the pass */
+	if (speculative == task->second.speculative && task->second.pass == load_pass_ && task->second.priority <= priority)
+		return;
+
+	/* prefetched tile became needed before it was loaded */
+	if (!speculative && task->second.requested < 0.0)
+		task->second.requested = GetTileManagerClock();
+
+	/* already queued; just move it to the new place */
+	task->second.pass = load_pass_;
+	task->second.speculative = speculative;
+	if (task->second.priority != priority) {
+		queue_.erase(std::make_pair(task->second.priority, id));
+		queue_.insert(std::make_pair(priority, id));
+		task->second.priority = priority;
+	}
+}
+
+float TileManager::GetTilePriority(const RecLoadTilesInfo& info, const BBoxi& bbox, float distsq) const {
+	float priority = sqrt(distsq);
+
+	/* vector from viewer to tile center and tile radius, in meters */
+	const float coslat = info.coslat;
+	const float scale = WGS84_EARTH_EQ_LENGTH / GEOM_LONSPAN;
+
+	Vector2i center = bbox.GetCenter();
+	Vector2f dir((float)(center.x - info.viewer_pos.x) * scale * coslat, (float)(center.y - info.viewer_pos.y) * scale);
+	Vector2f halfsize((float)((osmlong_t)bbox.right - bbox.left) * scale * coslat / 2.0f, (float)((osmlong_t)bbox.top - bbox.bottom) * scale / 2.0f);
+
+	float dist = sqrt(dir.x * dir.x + dir.y * dir.y);
+	float radius = sqrt(halfsize.x * halfsize.x + halfsize.y * halfsize.y);
+
+	/* viewer is over the tile; it's always in view */
+	if (dist <= radius)
+		return priority;
+
+	dir /= dist;
+
+	if (info.has_view) {
+		float angle = acos(std::max(-1.0f, std::min(1.0f, (float)dir.DotProduct(info.view_dir))));
+		if (angle - asin(radius / dist) > info.view_halfangle)
+			priority *= OUT_OF_VIEW_PENALTY;
+	}
+
+	if (info.has_movement)
+		priority *= 1.0f - MOVEMENT_WEIGHT * dir.DotProduct(info.movement_dir);
+
+	return priority;
+}
+
+bool TileManager::NeedsRefinement(const RecLoadTilesInfo& info, const QuadNode* node) const {
+	/* tile width in meters */
+	float size = (float)((osmlong_t)node->bbox.right - node->bbox.left) / GEOM_LONSPAN * WGS84_EARTH_EQ_LENGTH * cos(node->bbox.GetCenter().y * GEOM_DEG_TO_RAD);
+
+	return (float)(GetHorizontalDistanceSquare(info, node->bbox) + info.lod_height2) * info.unit2 < size * size * lod_factor_ * lod_factor_;
+}
+
+bool TileManager::NeedsLoadPass(const RecLoadTilesInfoVector& views) const {
+	/* viewers are matched with previous ones by order */
+	if (force_load_pass_ || last_viewers_.size() != views.size())
+		return true;
+
+	/* some needed tiles were dropped from queue to be
+	 * requested again when there's place for them */
+	if (queue_truncated_)
+		return true;
+
+	for (size_t i = 0; i < views.size(); ++i) {
+		const RecLoadTilesInfo& info = views[i];
+
+		Vector3d moved = ToLocalMetric(info.lod_pos, last_viewers_[i].pos);
+		if (moved.LengthSquare() > range_ * range_ * LOAD_PASS_DISTANCE * LOAD_PASS_DISTANCE)
+			return true;
+
+		/* look direction only affects priorities of queued tiles */
+		if (!queue_.empty() && info.has_view && info.view_dir.DotProduct(last_viewers_[i].view_dir) < cos(LOAD_PASS_ANGLE))
+			return true;
+	}
+
+	/* failed tiles are requested again once their delay passes */
+	if (!failed_.empty()) {
+		double now = GetTileManagerClock();
+		for (TileRetryMap::const_iterator i = failed_.begin(); i != failed_.end(); ++i)
+			if (i->second <= now)
+				return true;
+	}
+
+	return false;
+}
+
+int TileManager::GetLevelFlags(int level) const {
+	LevelFlagsMap::const_iterator i = level_flags_.find(level);
+	return i == level_flags_.end() ? flags_ : i->second;
+}
+
+void TileManager::PruneQueue() {
+	for (TileTaskMap::iterator task = tasks_.begin(); task != tasks_.end(); ) {
+		if (task->second.pass != load_pass_) {
+			queue_.erase(std::make_pair(task->second.priority, task->first));
+			tasks_.erase(task++);
+		} else {
+			++task;
+		}
+	}
+
+	/* failed tiles due for retry were requested again by
+	 * this pass if still needed */
+	double now = GetTileManagerClock();
+	for (TileRetryMap::iterator failed = failed_.begin(); failed != failed_.end(); ) {
+		if (failed->second <= now)
+			failed_.erase(failed++);
+		else
+			++failed;
+	}
+
+	/* requests are cancelled rather than built and dropped */
+	for (InflightMap::iterator inflight = inflight_.begin(); inflight != inflight_.end(); ) {
+		if (inflight->second.pass != load_pass_) {
+			cancelled_.push_back(inflight->second.request);
+			cancelled_count_++;
+			loading_.erase(inflight->first);
+			inflight_.erase(inflight++);
+		} else {
+			++inflight;
+		}
+	}
+
+	queue_truncated_ = queue_.size() > MAX_QUEUE_SIZE;
+	while (queue_.size() > MAX_QUEUE_SIZE) {
+		TilesQueue::iterator last = --queue_.end();
+		tasks_.erase(last->second);
+		queue_.erase(last);
+	}
+}
+
+void TileManager::PushFinishedTile(FinishedTile* finished) {
+	FinishedTile* head;
+	do {
+		head = finished_;
+		finished->next = head;
+	} while (!__sync_bool_compare_and_swap(&finished_, head, finished));
+}
+
+void TileManager::PlaceFinishedTiles(bool upload) {
+	TRACE_SCOPE("TileManager::PlaceFinishedTiles");
+
+	/* only this function removes items, so taking the whole
+	 * stack at once is not subject to ABA problem */
+	FinishedTile* list = __sync_lock_test_and_set(&finished_, (FinishedTile*)NULL);
+
+	/* stack is LIFO, restore loading order and append
+	 * to upload queue; stack top becomes queue tail */
+	FinishedTile* last = list;
+	FinishedTile* reversed = NULL;
+	while (list != NULL) {
+		FinishedTile* next = list->next;
+		upload_size_ += list->tile->GetSize();
+		list->next = reversed;
+		reversed = list;
+		list = next;
+	}
+
+	if (reversed != NULL) {
+		if (upload_tail_ != NULL)
+			upload_tail_->next = reversed;
+		else
+			upload_head_ = reversed;
+		upload_tail_ = last;
+	}
+
+	size_t uploaded = 0;
+	while (upload_head_ != NULL) {
+		FinishedTile* finished = upload_head_;
+
+		size_t upload_size = finished->tile->GetUploadSize();
+		if (upload_size > 0) {
+			if (!upload)
+				break;
+
+			/* always upload at least one tile, so a tile larger
+			 * than budget doesn't stall the queue */
+			if (upload_budget_ != 0 && uploaded > 0 && uploaded + upload_size > upload_budget_)
+				break;
+
+			if (uploaded > 0 && !HasMaintenanceTime())
+				break;
+
+			if (batch_.get())
+				finished->tile->Upload(*batch_);
+			else
+				finished->tile->Upload();
+			uploaded += upload_size;
+		}
+
+		upload_head_ = finished->next;
+		if (upload_head_ == NULL)
+			upload_tail_ = NULL;
+		upload_size_ -= finished->tile->GetSize();
+
+		RecPlaceTile(&root_, finished->tile, finished->cost, finished->version, finished->speculative, finished->requested, finished->id.level, finished->id.x, finished->id.y);
+		placed_ids_.push_back(finished->id);
+		delete finished;
+	}
+}
+
+void TileManager::RecPlaceTile(QuadNode* node, Tile* tile, float cost, int version, bool speculative, double requested, int level, int x, int y) {
 	if (node == NULL) {
 		/* part of quadtree was garbage collected -> tile
 		 * is no longer needed and should just be dropped */
+		stats_.dropped++;
 		delete tile;
 		return;
 	}
@@ -210,122 +918,350 @@ void TileManager::RecPlaceTile(QuadNode* node, Tile* tile, int level, int x, int
 	if (level == 0) {
 		if (node->tile != NULL) {
 			/* tile already loaded for some reason (sync loading?)
-			 * -> drop copy */
-			delete tile;
-			return;
+			 * -> drop copy, unless it replaces outdated one */
+			if (!IsOutdated(node) || version < node->valid_version) {
+				stats_.dropped++;
+				delete tile;
+				return;
+			}
+			DestroyTile(node);
 		}
-		node->tile = tile;
-		tile_count_++;
-		total_size_ += tile->GetSize();
+		AttachTile(node, tile, cost, version, speculative, requested);
 	} else {
 		int mask = 1 << (level-1);
 		int nchild = (!!(y & mask) << 1) | !!(x & mask);
-		RecPlaceTile(node->childs[nchild], tile, level-1, x, y);
+		RecPlaceTile(node->childs[nchild], tile, cost, version, speculative, requested, level-1, x, y);
 	}
 }
 
+bool TileManager::IsOutdated(const QuadNode* node) const {
+	return node->tile_version < node->valid_version;
+}
+
+void TileManager::RecInvalidateArea(QuadNode* node, const BBoxi& bbox) {
+	if (node == NULL || !node->bbox.Intersects(bbox))
+		return;
+
+	/* set for nodes without tiles too, for tiles being loaded */
+	node->valid_version = data_version_;
+
+	for (int i = 0; i < 4; ++i)
+		RecInvalidateArea(node->childs[i], bbox);
+}
+
 void TileManager::RecDestroyTiles(QuadNode* node) {
 	if (!node)
 		return;
 
-	if (node->tile) {
-		tile_count_--;
-		total_size_ -= node->tile->GetSize();
-		delete node->tile;
-		node->tile = NULL;
-	}
+	if (node->tile)
+		DestroyTile(node);
 
 	for (int i = 0; i < 4; ++i) {
 		RecDestroyTiles(node->childs[i]);
 		if (node->childs[i]) {
-			delete node->childs[i];
+			FreeNode(node->childs[i]);
 			node->childs[i] = NULL;
 		}
 	}
 }
 
-void TileManager::RecGarbageCollectTiles(QuadNode* node, GCQueue& gcqueue) {
-	/* simplest garbage collection that drops all inactive
-	 * tiles. This should become much more clever */
-	for (int i = 0; i < 4; ++i) {
-		if (node->childs[i] == NULL)
-			continue;
+bool TileManager::IsCollectable(const QuadNode* node) const {
+	/* not visited by last load */
+	if (node->generation != generation_)
+		return true;
 
-		if (node->childs[i]->generation != generation_) {
-			gcqueue.push_back(&node->childs[i]);
-		} else {
-			RecGarbageCollectTiles(node->childs[i], gcqueue);
+	/* needed leaf */
+	if (node->leaf_generation == generation_)
+		return false;
+
+	/* coarse tile is still rendered in place of finer ones */
+	return RecIsComplete(node->childs[0]) && RecIsComplete(node->childs[1]) && RecIsComplete(node->childs[2]) && RecIsComplete(node->childs[3]);
+}
+
+size_t TileManager::GetHeldSize() const {
+	return total_size_ + impostors_.GetBytes();
+}
+
+size_t TileManager::GetHeldGpuSize() const {
+	return total_size_ - ram_size_ + impostors_.GetBytes();
+}
+
+bool TileManager::HasRoomForImpostor() const {
+	size_t size = impostors_.GetImpostorSize();
+	return GetHeldSize() + size <= size_limit_ && (gpu_size_limit_ == 0 || GetHeldGpuSize() + size <= gpu_size_limit_);
+}
+
+float TileManager::GetCollectScore(const QuadNode* node, bool gpu) const {
+	size_t size = node->tile->GetSize();
+	if (gpu)
+		size -= node->ram_size;
+
+	/* impostor goes away with the tile */
+	if (node->impostor)
+		size += impostors_.GetImpostorSize();
+
+	float score = (float)size / std::max(node->cost, GC_MIN_COST);
+
+	/* tiles are as valuable as they're close to nearest viewer */
+	if (!gc_viewer_pos_.empty()) {
+		float distsq = ApproxDistanceSquare(node->bbox, gc_viewer_pos_.front());
+		for (PositionVector::const_iterator i = gc_viewer_pos_.begin() + 1; i != gc_viewer_pos_.end(); ++i)
+			distsq = std::min(distsq, (float)ApproxDistanceSquare(node->bbox, *i));
+		score *= 1.0f + sqrt(distsq) / range_;
+	}
+
+	return score;
+}
+
+void TileManager::PruneNodes(QuadNode* node) {
+	while (node->parent && !node->tile && node->generation != generation_) {
+		for (int i = 0; i < 4; ++i)
+			if (node->childs[i])
+				return;
+
+		QuadNode* parent = node->parent;
+		for (int i = 0; i < 4; ++i)
+			if (parent->childs[i] == node)
+				parent->childs[i] = NULL;
+
+		FreeNode(node);
+		node = parent;
+	}
+}
+
+TileManager::QuadNode* TileManager::CreateNode(QuadNode* parent, const BBoxi& bbox) {
+	if (free_nodes_ == NULL) {
+		QuadNode* slab = new QuadNode[NODE_SLAB_SIZE];
+		node_slabs_.push_back(slab);
+
+		/* link in reverse, so nodes are taken in memory order */
+		for (size_t i = NODE_SLAB_SIZE; i > 0; --i) {
+			slab[i - 1].parent = free_nodes_;
+			free_nodes_ = &slab[i - 1];
 		}
 	}
+
+	QuadNode* node = free_nodes_;
+	free_nodes_ = node->parent;
+
+	*node = QuadNode(parent);
+	node->bbox = bbox;
+	return node;
+}
+
+void TileManager::FreeNode(QuadNode* node) {
+	node->parent = free_nodes_;
+	free_nodes_ = node;
 }
 
-int TileManager::RecRenderTiles(QuadNode* node, const Viewer& viewer) {
+int TileManager::RecRenderTiles(QuadNode* node, const Viewer& viewer, const ViewFrustum& frustum) {
 	if (!node || node->generation != generation_)
 		return 0;
 
-	/* traverse tree depth-first */
-	int childs = 0;
-	childs += RecRenderTiles(node->childs[0], viewer);
-	childs += RecRenderTiles(node->childs[1], viewer);
-	childs += RecRenderTiles(node->childs[2], viewer);
-	childs += RecRenderTiles(node->childs[3], viewer);
-
-	/* ...and do not render a tile where all its childs were
-	 * fully rendered */
-	if (childs == 4)
+	/* nothing is missing if it can't be seen anyway */
+	NodeBox box;
+	if (!IsInFrustum(node, frustum, box))
 		return 1;
 
-	/* no tile */
-	if (!node->tile)
+	if (node->leaf_generation == generation_) {
+		if (node->tile) {
+			RenderTile(node, viewer, box);
+			return 1;
+		}
+
+		/* not loaded yet; show finer tiles still left from the
+		 * time viewer was closer, if any */
+		for (int i = 0; i < 4; ++i)
+			RecRenderStaleTiles(node->childs[i], viewer, frustum);
 		return 0;
+	}
 
-	/* empty tile */
-	if (node->tile->GetSize() == 0)
+	/* keep showing coarse tile until all finer tiles which
+	 * replace it are loaded */
+	if (node->tile && !(RecIsComplete(node->childs[0]) && RecIsComplete(node->childs[1]) && RecIsComplete(node->childs[2]) && RecIsComplete(node->childs[3]))) {
+		RenderTile(node, viewer, box);
 		return 1;
+	}
 
-	glMatrixMode(GL_MODELVIEW);
-	glPushMatrix();
+	/* traverse tree depth-first */
+	int childs = 0;
+	childs += RecRenderTiles(node->childs[0], viewer, frustum);
+	childs += RecRenderTiles(node->childs[1], viewer, frustum);
+	childs += RecRenderTiles(node->childs[2], viewer, frustum);
+	childs += RecRenderTiles(node->childs[3], viewer, frustum);
 
-	/* prepare modelview matrix for the tile: position
-	 * it in the right place given that viewer is always
-	 * at (0, 0, 0) */
-	Vector3f offset = projection_.Project(node->tile->GetReference(), Vector2i(viewer.GetPos(projection_))) +
-			projection_.Project(Vector2i(viewer.GetPos(projection_)), viewer.GetPos(projection_));
+	return childs == 4;
+}
 
-	glTranslatef(offset.x, offset.y, offset.z);
+void TileManager::RecRenderStaleTiles(QuadNode* node, const Viewer& viewer, const ViewFrustum& frustum) {
+	NodeBox box;
+	if (!node || !IsInFrustum(node, frustum, box))
+		return;
 
-	/* same for rotation */
-	Vector3i ref = node->tile->GetReference();
-	Vector3i pos = viewer.GetPos(projection_);
+	if (node->tile) {
+		RenderTile(node, viewer, box);
+		return;
+	}
 
-	/* normal at tile's reference point */
-	Vector3d refnormal = (
-			(Vector3d)projection_.Project(Vector3i(ref.x, ref.y, std::numeric_limits<osmint_t>::max()), pos) -
-			(Vector3d)projection_.Project(Vector3i(ref.x, ref.y, 0), pos)
-		).Normalized();
+	for (int i = 0; i < 4; ++i)
+		RecRenderStaleTiles(node->childs[i], viewer, frustum);
+}
 
-	/* normal at north pole */
-	Vector3d polenormal = (
-			(Vector3d)projection_.Project(Vector3i(ref.x, 900000000, std::numeric_limits<osmint_t>::max()), pos) -
-			(Vector3d)projection_.Project(Vector3i(ref.x, 900000000, 0), pos)
-		).Normalized();
+void TileManager::GetViewFrustum(const Viewer& viewer, ViewFrustum& frustum) const {
+	GLfloat projection[16], modelview[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
 
-	/* @todo IsValid() check basically detects
-	 * MercatorProjection and does no rotation for it.
-	 * While is's ok for now, this may need more generic
-	 * approach in future */
-	if (polenormal.IsValid()) {
-		Vector3d side = refnormal.CrossProduct(polenormal).Normalized();
+	float clip[16];
+	MultiplyMatrix(projection, modelview, clip);
+
+	/* clip space planes are -w <= x, y, z <= w, which are sums and
+	 * differences of last row of clip matrix with other rows */
+	for (int axis = 0; axis < 3; ++axis) {
+		for (int coord = 0; coord < 4; ++coord) {
+			frustum.planes[axis * 2][coord] = clip[coord * 4 + 3] + clip[coord * 4 + axis];
+			frustum.planes[axis * 2 + 1][coord] = clip[coord * 4 + 3] - clip[coord * 4 + axis];
+		}
+	}
+
+	frustum.viewer_pos = viewer.GetPos(projection_);
+	frustum.ground_offset = projection_.Project(Vector2i(frustum.viewer_pos), frustum.viewer_pos);
+}
+
+bool TileManager::IsInFrustum(const QuadNode* node, const ViewFrustum& frustum, NodeBox& box) const {
+	/* no tiles in subtree */
+	if (node->min_height > node->max_height)
+		return false;
+
+	/* sample node area with a grid, slightly expanded as
+	 * tile contents may stick out of its bbox */
+	static const int GRID = 3;
+	const osmlong_t width = (osmlong_t)node->bbox.right - node->bbox.left;
+	const osmlong_t height = (osmlong_t)node->bbox.top - node->bbox.bottom;
+	const osmlong_t left = node->bbox.left - width / 16;
+	const osmlong_t bottom = node->bbox.bottom - height / 16;
+	const osmlong_t xstep = (width + width / 8) / (GRID - 1);
+	const osmlong_t ystep = (height + height / 8) / (GRID - 1);
+	const Vector2i ground(frustum.viewer_pos);
+
+	Vector3f projected[GRID][GRID][2];
+	for (int x = 0; x < GRID; ++x) {
+		for (int y = 0; y < GRID; ++y) {
+			Vector2i point(
+					(osmint_t)std::max<osmlong_t>(std::numeric_limits<osmint_t>::min(), std::min<osmlong_t>(std::numeric_limits<osmint_t>::max(), left + xstep * x)),
+					(osmint_t)std::max<osmlong_t>(GEOM_MINLAT, std::min<osmlong_t>(GEOM_MAXLAT, bottom + ystep * y))
+				);
+			projected[x][y][0] = projection_.Project(Vector3i(point, node->min_height), ground) + frustum.ground_offset;
+			projected[x][y][1] = projection_.Project(Vector3i(point, node->max_height), ground) + frustum.ground_offset;
+		}
+	}
+
+	Vector3f min = projected[0][0][0];
+	Vector3f max = projected[0][0][0];
+	for (int x = 0; x < GRID; ++x) {
+		for (int y = 0; y < GRID; ++y) {
+			for (int h = 0; h < 2; ++h) {
+				const Vector3f& p = projected[x][y][h];
+				min = Vector3f(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+				max = Vector3f(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+			}
+		}
+	}
+
+	/* on curved projections surface between grid points bulges
+	 * out of them; pad by how much center deviates from corners,
+	 * which is more than that */
+	for (int h = 0; h < 2; ++h) {
+		Vector3f corners = (projected[0][0][h] + projected[GRID - 1][0][h] + projected[0][GRID - 1][h] + projected[GRID - 1][GRID - 1][h]) / 4.0f;
+		float sag = (projected[GRID / 2][GRID / 2][h] - corners).Length();
+		min -= Vector3f(sag, sag, sag);
+		max += Vector3f(sag, sag, sag);
+	}
+
+	/* outside if box is wholly behind any plane; nan (e.g. from
+	 * projecting poles) never culls */
+	for (int i = 0; i < 6; ++i) {
+		const float* plane = frustum.planes[i];
+		float dist = plane[0] * (plane[0] > 0.0f ? max.x : min.x) +
+				plane[1] * (plane[1] > 0.0f ? max.y : min.y) +
+				plane[2] * (plane[2] > 0.0f ? max.z : min.z) +
+				plane[3];
+		if (dist < 0.0f)
+			return false;
+	}
+
+	box.min = min;
+	box.max = max;
+
+	return true;
+}
 
-		glRotatef((double)((osmlong_t)ref.y - (osmlong_t)pos.y) / 10000000.0, side.x, side.y, side.z);
-		glRotatef((double)((osmlong_t)ref.x - (osmlong_t)pos.x) / 10000000.0, polenormal.x, polenormal.y, polenormal.z);
+bool TileManager::RecIsComplete(const QuadNode* node) const {
+	if (!node || node->generation != generation_)
+		return false;
+
+	if (node->leaf_generation == generation_)
+		return node->tile != NULL;
+
+	return RecIsComplete(node->childs[0]) && RecIsComplete(node->childs[1]) && RecIsComplete(node->childs[2]) && RecIsComplete(node->childs[3]);
+}
+
+void TileManager::RenderTile(QuadNode* node, const Viewer& viewer, const NodeBox& box) {
+	TouchTile(node);
+
+	if (node->requested >= 0.0) {
+		float popin = GetTileManagerClock() - node->requested;
+		node->requested = -1.0;
+
+		stats_.popins++;
+		stats_.popin_time += popin;
+		stats_.popin_max = std::max(stats_.popin_max, popin);
+		int bucket = 0;
+		while (bucket < NUM_POPIN_TIME_BUCKETS - 1 && popin * 1000.0f >= (float)(1 << bucket))
+			bucket++;
+		stats_.popin_times[bucket]++;
+	}
+
+	/* empty tile */
+	if (node->tile->GetSize() == 0)
+		return;
+
+	if (occlusion_culling_ && IsOccluded(node, box))
+		return;
+
+	if (node->transform_origin != render_origin_version_) {
+		GetTransform(node->tile->GetReference(), render_origin_, node->transform);
+		node->transform_origin = render_origin_version_;
+	}
+
+	if (impostors_.IsEnabled() && !shader_ && RenderImpostor(node, box))
+		return;
+
+	if (shader_) {
+		GLfloat modelview[16];
+		MultiplyMatrix(origin_modelview_, node->transform, modelview);
+
+		if (batch_.get()) {
+			node->tile->Render(*batch_, modelview);
+		} else {
+			shader_->SetModelview(modelview);
+			node->tile->Render(*shader_);
+		}
+		UpdateRamSize(node);
+		return;
 	}
 
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glMultMatrixf(node->transform);
+
 	/* @todo make it return bool and check return value,
 	 * tile may be half-ready here */
 	node->tile->Render();
+	UpdateRamSize(node);
 
 #if defined(DEBUG_TILING) && !defined(WITH_GLES) && !defined(WITH_GLES2)
+	Vector3i ref = node->tile->GetReference();
 	Vector3f bound_1[4];
 	Vector3f bound_2[40];
 
@@ -374,8 +1310,177 @@ int TileManager::RecRenderTiles(QuadNode* node, const Viewer& viewer) {
 
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
+}
+
+bool TileManager::IsOccluded(QuadNode* node, const NodeBox& box) {
+	/* tested again after this frame regardless of the result,
+	 * to notice when tile becomes visible */
+	occlusion_candidates_.push_back(OcclusionCandidate(node, box));
+
+#if defined(WITH_OCCLUSION_QUERIES)
+	if (node->query_pending) {
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(node->occlusion_query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint samples = 0;
+			glGetQueryObjectuiv(node->occlusion_query, GL_QUERY_RESULT, &samples);
+			node->occluded = samples == 0;
+			node->query_pending = false;
+		}
+	}
+#endif
+
+	/* tile may have been out of view since, or query is lagging */
+	if (node->query_frame < render_frame_ - MAX_OCCLUSION_QUERY_AGE)
+		node->occluded = false;
+
+	return node->occluded;
+}
+
+void TileManager::RenderOcclusionQueries(const ViewFrustum& frustum) {
+#if defined(WITH_OCCLUSION_QUERIES)
+	if (occlusion_candidates_.empty())
+		return;
+
+	/* viewer is at the origin, so distance from it to near
+	 * plane is just the plane's free term over normal length */
+	const float* near_plane = frustum.planes[4];
+	float margin = OCCLUSION_NEAR_MARGIN * -near_plane[3] / sqrt(near_plane[0] * near_plane[0] + near_plane[1] * near_plane[1] + near_plane[2] * near_plane[2]);
+
+	/* boxes are drawn with fixed function, as they are in
+	 * viewer coordinates */
+	GLint program = 0;
+	if (shader_) {
+		glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+		glUseProgram(0);
+	}
+
+	glPushAttrib(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_ENABLE_BIT);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_BLEND);
+
+	for (OcclusionCandidateVector::iterator i = occlusion_candidates_.begin(); i != occlusion_candidates_.end(); ++i) {
+		QuadNode* node = i->node;
+		const Vector3f& min = i->box.min;
+		const Vector3f& max = i->box.max;
+
+		if (min.x - margin <= 0.0f && max.x + margin >= 0.0f &&
+				min.y - margin <= 0.0f && max.y + margin >= 0.0f &&
+				min.z - margin <= 0.0f && max.z + margin >= 0.0f) {
+			node->occluded = false;
+			continue;
+		}
+
+		/* result of previous query is still on its way */
+		if (node->query_pending)
+			continue;
+
+		if (!node->occlusion_query)
+			glGenQueries(1, &node->occlusion_query);
+
+		glBeginQuery(GL_SAMPLES_PASSED, node->occlusion_query);
+		glBegin(GL_QUAD_STRIP);
+		glVertex3f(min.x, min.y, min.z); glVertex3f(min.x, min.y, max.z);
+		glVertex3f(max.x, min.y, min.z); glVertex3f(max.x, min.y, max.z);
+		glVertex3f(max.x, max.y, min.z); glVertex3f(max.x, max.y, max.z);
+		glVertex3f(min.x, max.y, min.z); glVertex3f(min.x, max.y, max.z);
+		glVertex3f(min.x, min.y, min.z); glVertex3f(min.x, min.y, max.z);
+		glEnd();
+		glBegin(GL_QUADS);
+		glVertex3f(min.x, min.y, min.z); glVertex3f(min.x, max.y, min.z);
+		glVertex3f(max.x, max.y, min.z); glVertex3f(max.x, min.y, min.z);
+		glVertex3f(min.x, min.y, max.z); glVertex3f(max.x, min.y, max.z);
+		glVertex3f(max.x, max.y, max.z); glVertex3f(min.x, max.y, max.z);
+		glEnd();
+		glEndQuery(GL_SAMPLES_PASSED);
+
+		node->query_frame = render_frame_;
+		node->query_pending = true;
+	}
+
+	glPopAttrib();
+
+	if (shader_)
+		glUseProgram(program);
+#else
+	(void)frustum;
+#endif
+
+	occlusion_candidates_.clear();
+}
+
+bool TileManager::RenderImpostor(QuadNode* node, const NodeBox& box) {
+	if (impostors_.IsTooClose(box.min, box.max)) {
+		impostors_.Destroy(node->impostor);
+		return false;
+	}
+
+	float model[16];
+	MultiplyMatrix(origin_transform_, node->transform, model);
 
-	return 1;
+	if (!node->impostor || !impostors_.IsValid(*node->impostor, model)) {
+		/* tiles in view can't be collected, so new impostors
+		 * would only push memory over the limits */
+		if (!node->impostor && !HasRoomForImpostor())
+			return false;
+
+		if (!impostors_.TakeUpdate())
+			return false;
+
+		if (!impostors_.Update(node->impostor, *node->tile, model, box.min, box.max, viewer_modelview_)) {
+			impostors_.Destroy(node->impostor);
+			return false;
+		}
+
+		UpdateRamSize(node);
+		stats_.impostor_updates++;
+	}
+
+	impostors_.Render(*node->impostor, node->transform);
+
+	return true;
+}
+
+void TileManager::GetTransform(const Vector3i& ref, const Vector3i& pos, float matrix[16]) const {
+	/* position geometry in the right place given that pos
+	 * is at (0, 0, 0) */
+	Vector3f offset = projection_.Project(ref, Vector2i(pos)) + projection_.Project(Vector2i(pos), pos);
+
+	double transform[16] = {
+		1.0, 0.0, 0.0, 0.0,
+		0.0, 1.0, 0.0, 0.0,
+		0.0, 0.0, 1.0, 0.0,
+		offset.x, offset.y, offset.z, 1.0,
+	};
+
+	/* normal at reference point */
+	Vector3d refnormal = (
+			(Vector3d)projection_.Project(Vector3i(ref.x, ref.y, std::numeric_limits<osmint_t>::max()), pos) -
+			(Vector3d)projection_.Project(Vector3i(ref.x, ref.y, 0), pos)
+		).Normalized();
+
+	/* normal at north pole */
+	Vector3d polenormal = (
+			(Vector3d)projection_.Project(Vector3i(ref.x, 900000000, std::numeric_limits<osmint_t>::max()), pos) -
+			(Vector3d)projection_.Project(Vector3i(ref.x, 900000000, 0), pos)
+		).Normalized();
+
+	/* @todo IsValid() check basically detects
+	 * MercatorProjection and does no rotation for it.
+	 * While is's ok for now, this may need more generic
+	 * approach in future */
+	if (polenormal.IsValid()) {
+		Vector3d side = refnormal.CrossProduct(polenormal).Normalized();
+
+		RotateTileTransform(transform, (double)((osmlong_t)ref.y - (osmlong_t)pos.y) / 10000000.0, side);
+		RotateTileTransform(transform, (double)((osmlong_t)ref.x - (osmlong_t)pos.x) / 10000000.0, polenormal);
+	}
+
+	std::copy(transform, transform + 16, matrix);
 }
 
 /*
@@ -386,44 +1491,195 @@ void TileManager::LoadingThreadFunc() {
 	pthread_mutex_lock(&queue_mutex_);
 	while (!thread_die_flag_) {
 		/* found nothing, sleep */
-		if (queue_.empty()) {
+		if (!RunLoadingTask())
 			pthread_cond_wait(&queue_cond_, &queue_mutex_);
-			continue;
+	}
+	pthread_mutex_unlock(&queue_mutex_);
+}
+
+void TileManager::SpawnQueuedTile() {
+	/* take the most important task from the queue */
+	TileId id = queue_.begin()->second;
+	queue_.erase(queue_.begin());
+	int version = data_version_;
+
+	TileTaskMap::iterator task = tasks_.find(id);
+	BBoxi bbox = task->second.bbox;
+	float priority = task->second.priority;
+	int flags = task->second.flags;
+	bool speculative = task->second.speculative;
+	double requested = task->second.requested;
+	tasks_.erase(task);
+
+	/* mark it as loading */
+	loading_.insert(id);
+
+	pthread_mutex_unlock(&queue_mutex_);
+
+	/* asynchronous request is finished when ready */
+	TileRequest* request;
+	try {
+		request = RequestTile(bbox, flags);
+	} catch (std::exception& e) {
+		pthread_mutex_lock(&queue_mutex_);
+		FailTile(id, e);
+		return;
+	}
+
+	if (request != NULL) {
+		pthread_mutex_lock(&queue_mutex_);
+		inflight_.insert(std::make_pair(id, InflightTile(request, priority, version, load_pass_, speculative, requested)));
+		return;
+	}
+
+	/* load tile and pass it to the main thread; it stays in
+	 * loading_ until placed, see PlaceFinishedTiles() */
+	{
+		TRACE_SCOPE("TileManager::SpawnTile");
+		Timer timer;
+		Tile* tile;
+		try {
+			tile = SpawnTile(bbox, flags);
+		} catch (std::exception& e) {
+			pthread_mutex_lock(&queue_mutex_);
+			FailTile(id, e);
+			return;
 		}
+		PushFinishedTile(new FinishedTile(id, tile, timer.Count(), version, speculative, requested));
+	}
 
-		/* take a task from the queue */
-		TileTask task = queue_.front();
-		queue_.pop_front();
+	pthread_mutex_lock(&queue_mutex_);
+}
 
-		/* mark it as loading */
-		loading_ = task.id;
+TileManager::InflightMap::iterator TileManager::FindReadyRequest() {
+	InflightMap::iterator best = inflight_.end();
+	for (InflightMap::iterator i = inflight_.begin(); i != inflight_.end(); ++i)
+		if ((best == inflight_.end() || i->second.priority < best->second.priority) && i->second.request->IsReady())
+			best = i;
+	return best;
+}
 
-		pthread_mutex_unlock(&queue_mutex_);
+void TileManager::FinishRequest(InflightMap::iterator inflight) {
+	TileId id = inflight->first;
+	InflightTile finished = inflight->second;
+	inflight_.erase(inflight);
 
-		/* load tile */
-		Tile* tile = SpawnTile(task.bbox, flags_);
+	pthread_mutex_unlock(&queue_mutex_);
 
-		pthread_mutex_lock(&tiles_mutex_);
-		RecPlaceTile(&root_, tile, task.id.level, task.id.x, task.id.y);
+	{
+		TRACE_SCOPE("TileManager::SpawnTile");
+		Timer timer;
+		Tile* tile;
+		try {
+			tile = finished.request->Finish();
+		} catch (std::exception& e) {
+			delete finished.request;
+			pthread_mutex_lock(&queue_mutex_);
+			FailTile(id, e);
+			return;
+		}
+		float cost = timer.Count();
+		delete finished.request;
+		PushFinishedTile(new FinishedTile(id, tile, cost, finished.version, finished.speculative, finished.requested));
+	}
 
-		pthread_mutex_unlock(&tiles_mutex_);
+	pthread_mutex_lock(&queue_mutex_);
+}
 
-		/* The following happens:
-		 * - main thread finishes Render and unlocks tiles_mutex_
-		 * - this thread wakes up and loads MANY tiles without main
-		 *   thread able to run
-		 * - main thread finally runs after ~0.1 sec delay, which
-		 *   is noticeable lag in realtime renderer
-		 *
-		 * Nut sure yet how to fix ot properly, but this sched_yield
-		 * works for now.
-		 */
-		sched_yield();
+void TileManager::FailTile(const TileId& id, const std::exception& e) {
+	loading_.erase(id);
+	failed_[id] = GetTileManagerClock() + LOAD_RETRY_DELAY;
+	failed_count_++;
 
-		pthread_mutex_lock(&queue_mutex_);
-		loading_ = TileId(-1, -1, -1);
+	if (!failure_reported_) {
+		fprintf(stderr, "Tile loading failed, will retry: %s\n", e.what());
+		failure_reported_ = true;
+	}
+}
+
+bool TileManager::RunLoadingTask() {
+	InflightMap::iterator ready = FindReadyRequest();
+	if (ready != inflight_.end()) {
+		FinishRequest(ready);
+		return true;
+	}
+
+	if (!queue_.empty() && inflight_.size() < MAX_REQUESTS_IN_FLIGHT) {
+		SpawnQueuedTile();
+		return true;
+	}
+
+	return false;
+}
+
+bool TileManager::GetNextTaskPriority(float& priority) {
+	pthread_mutex_lock(&queue_mutex_);
+	InflightMap::iterator ready = FindReadyRequest();
+	bool found = false;
+	if (!queue_.empty() && inflight_.size() < MAX_REQUESTS_IN_FLIGHT) {
+		priority = queue_.begin()->first;
+		found = true;
+	}
+	if (ready != inflight_.end() && (!found || ready->second.priority < priority)) {
+		priority = ready->second.priority;
+		found = true;
+	}
+	pthread_mutex_unlock(&queue_mutex_);
+	return found;
+}
+
+bool TileManager::LoadNextTile() {
+	pthread_mutex_lock(&queue_mutex_);
+	bool found = RunLoadingTask();
+	pthread_mutex_unlock(&queue_mutex_);
+	return found;
+}
+
+void TileManager::StartLoadingThreads(int nthreads) {
+	thread_die_flag_ = false;
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_t thread;
+		int errn;
+		if ((errn = pthread_create(&thread, NULL, LoadingThreadFuncWrapper, (void*)this)) != 0) {
+			if (loading_threads_.empty())
+				throw SystemError(errn) << "pthread_create failed";
+			break;
+		}
+		loading_threads_.push_back(thread);
 	}
+}
+
+void TileManager::StopLoadingThreads() {
+	pthread_mutex_lock(&queue_mutex_);
+	thread_die_flag_ = true;
+	pthread_cond_broadcast(&queue_cond_);
 	pthread_mutex_unlock(&queue_mutex_);
+
+	/* @todo check exit code? */
+	for (ThreadVector::iterator i = loading_threads_.begin(); i != loading_threads_.end(); ++i)
+		pthread_join(*i, NULL);
+
+	loading_threads_.clear();
+}
+
+void TileManager::StopLoading() {
+	StopLoadingThreads();
+	if (loader_) {
+		loader_->Detach(this);
+		loader_ = NULL;
+	}
+
+	/* no loading threads run now, so no locking is needed */
+	for (InflightMap::iterator i = inflight_.begin(); i != inflight_.end(); ++i) {
+		loading_.erase(i->first);
+		delete i->second.request;
+	}
+	inflight_.clear();
+
+	for (TileRequestVector::iterator i = cancelled_.begin(); i != cancelled_.end(); ++i)
+		delete *i;
+	cancelled_.clear();
 }
 
 void* TileManager::LoadingThreadFuncWrapper(void* arg) {
@@ -435,41 +1691,219 @@ void* TileManager::LoadingThreadFuncWrapper(void* arg) {
  * protected interface
  */
 
+TileManager::TileRequest* TileManager::RequestTile(const BBoxi& /*unused*/, int /*unused*/) const {
+	return NULL;
+}
+
 void TileManager::Render(const Viewer& viewer) {
+	TRACE_SCOPE("TileManager::Render");
+
+	/* loading threads never take tiles_mutex_, so this only
+	 * serializes with other calls from the main thread */
 	pthread_mutex_lock(&tiles_mutex_);
-	RecRenderTiles(&root_, viewer);
+
+	/* further viewports of a frame only draw */
+	if (scheduler_ == NULL || !has_placed_frame_ || placed_frame_ != scheduler_->GetFrame()) {
+		BeginMaintenance();
+		PlaceFinishedTiles(true);
+		ReclaimTiles(MAX_RECLAIMS_PER_FRAME);
+		EndMaintenance();
+
+		if (scheduler_ != NULL) {
+			placed_frame_ = scheduler_->GetFrame();
+			has_placed_frame_ = true;
+		}
+	}
+
+	ViewFrustum frustum;
+	GetViewFrustum(viewer, frustum);
+
+	/* tiles are placed relative to render origin with their
+	 * cached transforms, and origin itself is placed relative
+	 * to viewer once per frame */
+	Vector3i pos = viewer.GetPos(projection_);
+	if (!has_render_origin_ ||
+			AbsDifference(pos.x, render_origin_.x) > RENDER_ORIGIN_MAX_SHIFT ||
+			AbsDifference(pos.y, render_origin_.y) > RENDER_ORIGIN_MAX_SHIFT) {
+		render_origin_ = pos.Flattened();
+		render_origin_version_++;
+		has_render_origin_ = true;
+	}
+
+	GetTransform(render_origin_, pos, origin_transform_);
+	glGetFloatv(GL_MODELVIEW_MATRIX, viewer_modelview_);
+
+	render_frame_++;
+
+	if (impostors_.IsEnabled() && !shader_) {
+		GLint viewport[4];
+		GLfloat projection[16];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glGetFloatv(GL_PROJECTION_MATRIX, projection);
+
+		/* projected coordinates are not meters; scale is taken at the
+		 * viewer, which is close enough for distances of a layer */
+		Vector3f meter = projection_.Project(Vector3i(pos.x, pos.y, pos.z + GEOM_UNITSINMETER), pos);
+		impostors_.BeginFrame(projection, viewport, meter.Length());
+	}
+
+	if (shader_) {
+		MultiplyMatrix(viewer_modelview_, origin_transform_, origin_modelview_);
+
+		RecRenderTiles(&root_, viewer, frustum);
+
+		if (batch_.get())
+			batch_->Flush(*shader_);
+	} else {
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		glMultMatrixf(origin_transform_);
+
+		RecRenderTiles(&root_, viewer, frustum);
+
+		glMatrixMode(GL_MODELVIEW);
+		glPopMatrix();
+	}
+
+	if (occlusion_culling_)
+		RenderOcclusionQueries(frustum);
 	pthread_mutex_unlock(&tiles_mutex_);
 }
 
-void TileManager::Load(RecLoadTilesInfo& info) {
+void TileManager::Load(RecLoadTilesInfoVector& views) {
+	TRACE_SCOPE("TileManager::Load");
+
 	QuadNode* root = &root_;
 
+	/* all views of a single load share mode and flags */
+	const int flags = views.front().flags;
+	const int mode = views.front().mode;
+
 	/* @todo add guard here instead of implicit locking,
 	 * so we don't deadlock on exception */
-	if (!(info.flags & SYNC)) {
+	if (!(flags & SYNC))
 		pthread_mutex_lock(&queue_mutex_);
-		queue_.clear();
+
+	if (mode == RecLoadTilesInfo::LOCALITY) {
+		for (RecLoadTilesInfoVector::iterator info = views.begin(); info != views.end(); ++info) {
+			Vector3i pos = info->viewer->GetPos(projection_);
+			info->viewer_pos = height_effect_ ? pos : pos.Flattened();
+			info->lod_pos = pos;
+			info->has_view = info->viewer->GetViewCone(info->view_dir, info->view_halfangle);
+			InitRangeCheck(*info);
+		}
+	}
+
+	/* last position is only touched under queue_mutex_, and
+	 * synchronous loads don't use priorities anyway */
+	bool pass = (flags & SYNC) || mode != RecLoadTilesInfo::LOCALITY || NeedsLoadPass(views);
+
+	/* traversal may be postponed when frame is busy, but
+	 * not for long, as tiles around the viewer are missing */
+	if (pass && !(flags & SYNC) && mode == RecLoadTilesInfo::LOCALITY) {
+		if (!HasMaintenanceTime() && deferred_pass_run_ < MAX_DEFERRED_LOAD_PASSES) {
+			pass = false;
+			deferred_pass_run_++;
+			deferred_passes_++;
+		} else {
+			deferred_pass_run_ = 0;
+		}
+	}
+	if (pass && !(flags & SYNC)) {
+		load_pass_++;
+
+		if (mode == RecLoadTilesInfo::LOCALITY) {
+			bool has_last = last_viewers_.size() == views.size();
+			last_viewers_.resize(views.size());
+
+			for (size_t i = 0; i < views.size(); ++i) {
+				RecLoadTilesInfo& info = views[i];
+				ViewerState& last = last_viewers_[i];
+				const Vector3i& pos = info.lod_pos;
+				if (has_last && (pos.x != last.pos.x || pos.y != last.pos.y)) {
+					const float coslat = cos(pos.y * GEOM_DEG_TO_RAD);
+					info.movement_dir = Vector2f((float)(pos.x - last.pos.x) * coslat, (float)(pos.y - last.pos.y));
+					info.movement_dir.Normalize();
+					info.has_movement = true;
+				}
+				last.pos = pos;
+				last.view_dir = info.has_view ? info.view_dir : Vector2f();
+			}
+			force_load_pass_ = false;
+		}
 	}
 
 	pthread_mutex_lock(&tiles_mutex_);
 
-	switch (info.mode) {
-	case RecLoadTilesInfo::BBOX:
-		RecLoadTilesBBox(info, &root);
-		break;
-	case RecLoadTilesInfo::LOCALITY:
-		info.viewer_pos = height_effect_ ? info.viewer->GetPos(projection_) : info.viewer->GetPos(projection_).Flattened();
-		RecLoadTilesLocality(info, &root);
-		break;
+	if (mode == RecLoadTilesInfo::LOCALITY) {
+		gc_viewer_pos_.clear();
+		for (RecLoadTilesInfoVector::const_iterator info = views.begin(); info != views.end(); ++info)
+			gc_viewer_pos_.push_back(info->viewer_pos);
+	}
+
+	PlaceFinishedTiles(false);
+	if (!(flags & SYNC)) {
+		for (TileIdVector::const_iterator i = placed_ids_.begin(); i != placed_ids_.end(); ++i)
+			loading_.erase(*i);
+		placed_ids_.clear();
+	}
+
+	if (pass) {
+		/* nodes not visited by this pass are no longer needed;
+		 * tiles shared by several views are visited once per view */
+		generation_++;
+
+		for (RecLoadTilesInfoVector::iterator info = views.begin(); info != views.end(); ++info) {
+			switch (mode) {
+			case RecLoadTilesInfo::BBOX:
+				RecLoadTilesBBox(*info, &root);
+				break;
+			case RecLoadTilesInfo::LOCALITY: {
+					uint64_t dist2 = GetHorizontalDistanceSquare(*info, root->bbox) + info->height2;
+					if (dist2 <= info->range2)
+						RecLoadTilesLocality(*info, &root, (float)dist2 * info->unit2);
+				} break;
+			}
+		}
+	}
+
+	/* second pass around where viewers will be */
+	if (pass && mode == RecLoadTilesInfo::LOCALITY && !(flags & SYNC) && prefetch_time_ > 0.0f) {
+		for (RecLoadTilesInfoVector::const_iterator info = views.begin(); info != views.end() && speculative_size_ < prefetch_limit_; ++info) {
+			Vector3f velocity;
+			if (!info->viewer->GetVelocity(velocity) || (velocity.x == 0.0f && velocity.y == 0.0f && velocity.z == 0.0f))
+				continue;
+
+			RecLoadTilesInfo ahead = *info;
+			ahead.prefetch = true;
+			ahead.lod_pos = ExtrapolateViewerPos(info->lod_pos, velocity, prefetch_time_);
+			ahead.viewer_pos = height_effect_ ? ahead.lod_pos : ahead.lod_pos.Flattened();
+			InitRangeCheck(ahead);
+
+			uint64_t dist2 = GetHorizontalDistanceSquare(ahead, root->bbox) + ahead.height2;
+			if (dist2 <= ahead.range2)
+				RecLoadTilesLocality(ahead, &root, (float)dist2 * ahead.unit2);
+		}
 	}
 
 	pthread_mutex_unlock(&tiles_mutex_);
 
-	if (!(info.flags & SYNC)) {
+	if (!(flags & SYNC)) {
+		TileRequestVector cancelled;
+		if (pass)
+			PruneQueue();
+		cancelled.swap(cancelled_);
+		bool queued = !queue_.empty();
 		pthread_mutex_unlock(&queue_mutex_);
 
-		if (!queue_.empty())
-			pthread_cond_signal(&queue_cond_);
+		for (TileRequestVector::iterator i = cancelled.begin(); i != cancelled.end(); ++i)
+			delete *i;
+
+		if (queued) {
+			pthread_cond_broadcast(&queue_cond_);
+			if (loader_)
+				loader_->Wakeup();
+		}
 	}
 }
 
@@ -478,75 +1912,290 @@ void TileManager::Load(RecLoadTilesInfo& info) {
  */
 
 void TileManager::LoadArea(const BBoxi& bbox, int flags) {
-	RecLoadTilesInfo info;
+	RecLoadTilesInfoVector views(1);
+	RecLoadTilesInfo& info = views.front();
 
 	info.bbox = &bbox;
 	info.flags = flags;
 	info.mode = RecLoadTilesInfo::BBOX;
 
-	Load(info);
+	Load(views);
 }
 
 void TileManager::LoadLocality(const Viewer& viewer, int flags) {
-	RecLoadTilesInfo info;
+	LoadLocality(ViewerVector(1, &viewer), flags);
+}
 
-	info.viewer = &viewer;
-	info.flags = flags;
-	info.mode = RecLoadTilesInfo::LOCALITY;
+void TileManager::LoadLocality(const ViewerVector& viewers, int flags) {
+	if (viewers.empty())
+		return;
 
-	Load(info);
-}
+	RecLoadTilesInfoVector views(viewers.size());
+	for (size_t i = 0; i < viewers.size(); ++i) {
+		views[i].viewer = viewers[i];
+		views[i].flags = flags;
+		views[i].mode = RecLoadTilesInfo::LOCALITY;
+	}
 
-bool TileManager::GenerationCompare(QuadNode** x, QuadNode** y) {
-	return (*x)->generation < (*y)->generation;
+	BeginMaintenance();
+	Load(views);
+	EndMaintenance();
 }
 
 void TileManager::GarbageCollect() {
-	pthread_mutex_lock(&tiles_mutex_);
-	if (total_size_ > size_limit_) {
-		GCQueue gcqueue;
-		gcqueue.reserve(tile_count_);
+	TRACE_SCOPE("TileManager::GarbageCollect");
 
-		/* collect tiles for garbage collecting */
-		RecGarbageCollectTiles(&root_, gcqueue);
+	pthread_mutex_lock(&tiles_mutex_);
+	BeginMaintenance();
+	Timer timer;
+
+	/* hysteresis: start over the limit, stop below low watermark,
+	 * so collection doesn't run on each frame near the limit */
+	if (GetHeldSize() > size_limit_ || (gpu_size_limit_ != 0 && GetHeldGpuSize() > gpu_size_limit_))
+		collecting_ = true;
+
+	for (int evicted = 0; collecting_ && evicted < GC_MAX_EVICTIONS; ++evicted) {
+		if (evicted > 0 && !HasMaintenanceTime())
+			break;
+
+		bool over_total = GetHeldSize() > size_limit_ * GC_LOW_WATERMARK;
+		bool over_gpu = gpu_size_limit_ != 0 && GetHeldGpuSize() > gpu_size_limit_ * GC_LOW_WATERMARK;
+		if (!over_total && !over_gpu) {
+			collecting_ = false;
+			break;
+		}
 
-		/* sort by generation */
-		std::sort(gcqueue.begin(), gcqueue.end(), GenerationCompare);
+		/* when only GPU memory is short, tiles without GPU
+		 * data or impostor won't help */
+		bool gpu_only = over_gpu && !over_total;
+
+		/* choose best victim among least recently used tiles */
+		QuadNode* victim = NULL;
+		float victim_score = 0.0f;
+		int examined = 0;
+		for (QuadNode* node = lru_tail_; node != NULL && examined < GC_WINDOW; node = node->lru_prev, ++examined) {
+			if (!IsCollectable(node))
+				continue;
+
+			if (gpu_only && node->tile->GetSize() == node->ram_size && !node->impostor)
+				continue;
+
+			float score = GetCollectScore(node, gpu_only);
+			if (victim == NULL || score > victim_score) {
+				victim = node;
+				victim_score = score;
+			}
+		}
 
-		for (GCQueue::iterator i = gcqueue.begin(); i != gcqueue.end() && total_size_ > size_limit_; ++i) {
-			RecDestroyTiles(**i);
-			delete **i;
-			**i = NULL;
+		/* needed tiles are touched on each frame, so if there's
+		 * nothing to drop at the tail, everything is needed */
+		if (victim == NULL) {
+			collecting_ = false;
+			break;
 		}
+
+		DestroyTile(victim);
+		PruneNodes(victim);
+		stats_.evicted++;
 	}
 
-	generation_++;
+	stats_.gc_time += timer.Count();
+	EndMaintenance();
 	pthread_mutex_unlock(&tiles_mutex_);
 }
 
 void TileManager::Clear() {
+	pthread_mutex_lock(&queue_mutex_);
 	pthread_mutex_lock(&tiles_mutex_);
 	RecDestroyTiles(&root_);
 	generation_++;
+	force_load_pass_ = true;
+	pthread_mutex_unlock(&tiles_mutex_);
+	pthread_mutex_unlock(&queue_mutex_);
+}
+
+void TileManager::InvalidateArea(const BBoxi& bbox) {
+	pthread_mutex_lock(&queue_mutex_);
+	pthread_mutex_lock(&tiles_mutex_);
+	data_version_++;
+	RecInvalidateArea(&root_, bbox);
+	force_load_pass_ = true;
 	pthread_mutex_unlock(&tiles_mutex_);
+	pthread_mutex_unlock(&queue_mutex_);
 }
 
 void TileManager::SetLevel(int level) {
-	level_ = level;
+	level_ = min_level_ = level;
+	force_load_pass_ = true;
+}
+
+void TileManager::SetLevelRange(int minlevel, int maxlevel) {
+	min_level_ = minlevel;
+	level_ = maxlevel;
+	force_load_pass_ = true;
+}
+
+void TileManager::SetLodFactor(float factor) {
+	lod_factor_ = factor;
+	force_load_pass_ = true;
+}
+
+void TileManager::SetLevelFlags(int level, int flags) {
+	level_flags_[level] = flags;
+	force_load_pass_ = true;
 }
 
 void TileManager::SetRange(float range) {
 	range_ = range;
+	force_load_pass_ = true;
 }
 
 void TileManager::SetFlags(int flags) {
 	flags_ = flags;
+	force_load_pass_ = true;
 }
 
 void TileManager::SetHeightEffect(bool enabled) {
 	height_effect_ = enabled;
+	force_load_pass_ = true;
 }
 
 void TileManager::SetSizeLimit(size_t limit) {
 	size_limit_ = limit;
 }
+
+void TileManager::SetGpuSizeLimit(size_t limit) {
+	gpu_size_limit_ = limit;
+}
+
+void TileManager::SetUploadBudget(size_t budget) {
+	upload_budget_ = budget;
+}
+
+void TileManager::SetLoadingThreads(int nthreads) {
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	if (loader_) {
+		loader_->Detach(this);
+		loader_ = NULL;
+	}
+
+	StopLoadingThreads();
+	StartLoadingThreads(nthreads);
+}
+
+void TileManager::SetLoader(TileLoader* loader) {
+	if (loader == loader_)
+		return;
+
+	StopLoadingThreads();
+	if (loader_)
+		loader_->Detach(this);
+
+	loader_ = loader;
+
+	if (loader_)
+		loader_->Attach(this);
+	else
+		StartLoadingThreads(1);
+}
+
+void TileManager::SetScheduler(FrameScheduler* scheduler) {
+	if (scheduler == scheduler_)
+		return;
+
+	if (scheduler_)
+		scheduler_->Detach();
+
+	scheduler_ = scheduler;
+
+	if (scheduler_)
+		scheduler_->Attach();
+}
+
+void TileManager::SetShader(TileShader* shader) {
+	shader_ = shader;
+
+	if (shader_ && shader_->IsBatched()) {
+		if (!batch_.get())
+			batch_.reset(new TileBatch);
+	} else {
+		batch_.reset(NULL);
+	}
+}
+
+void TileManager::SetPrefetch(float time, size_t limit) {
+	prefetch_time_ = time;
+	prefetch_limit_ = limit;
+}
+
+void TileManager::SetOcclusionCulling(bool enabled) {
+#if defined(WITH_OCCLUSION_QUERIES)
+	occlusion_culling_ = enabled;
+#else
+	(void)enabled;
+#endif
+}
+
+void TileManager::SetImpostors(float distance, int resolution, float max_angle) {
+#if defined(WITH_IMPOSTORS)
+	if (distance > 0.0f && !ImpostorCache::IsSupported())
+		throw GLUnsupportedException() << "Impostors require framebuffer objects support";
+
+	pthread_mutex_lock(&tiles_mutex_);
+
+	/* existing impostors and framebuffer may be of other resolution */
+	for (QuadNode* node = lru_head_; node != NULL; node = node->lru_next)
+		impostors_.Destroy(node->impostor);
+
+	impostors_.SetParameters(distance, resolution, max_angle);
+
+	pthread_mutex_unlock(&tiles_mutex_);
+#else
+	(void)resolution;
+	(void)max_angle;
+	if (distance > 0.0f)
+		throw GLUnsupportedException() << "Impostors are not supported on OpenGL ES";
+#endif
+}
+
+void TileManager::NotifyRequestReady() {
+	pthread_mutex_lock(&queue_mutex_);
+	pthread_cond_broadcast(&queue_cond_);
+	pthread_mutex_unlock(&queue_mutex_);
+
+	if (loader_)
+		loader_->Wakeup();
+}
+
+void TileManager::GetStatistics(Statistics& stats) const {
+	pthread_mutex_lock(&queue_mutex_);
+	pthread_mutex_lock(&tiles_mutex_);
+
+	stats = stats_;
+	stats.queued = queue_.size();
+	stats.loading = loading_.size();
+	stats.tiles = tile_count_;
+	stats.bytes = total_size_;
+	stats.speculative_bytes = speculative_size_;
+	stats.size_limit = size_limit_;
+	stats.gpu_bytes = total_size_ - ram_size_;
+	stats.ram_bytes = ram_size_ + upload_size_;
+	stats.gpu_size_limit = gpu_size_limit_;
+	stats.reclaiming = reclaim_.size();
+	stats.requests = inflight_.size();
+	stats.cancelled = cancelled_count_;
+	stats.failed = failed_count_;
+	stats.load_passes = load_pass_;
+	stats.impostors = impostors_.GetCount();
+	stats.impostor_bytes = impostors_.GetBytes();
+	stats.maintenance_time = maintenance_time_;
+	stats.maintenance_overruns = maintenance_overruns_;
+	stats.deferred_passes = deferred_passes_;
+
+	pthread_mutex_unlock(&tiles_mutex_);
+	pthread_mutex_unlock(&queue_mutex_);
+}
@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/TileShader.hh>
+
+#include <glosm/VertexQuantizer.hh>
+#include <glosm/CheckGL.hh>
+#include <glosm/Exception.hh>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#if defined(WITH_SHADERS)
+
+/* lighting is the same as fixed function one layers set up: single
+ * directional light with no specular, zero global ambient */
+static const char* TILE_VERTEX_SHADER =
+	"#ifdef BATCHED\n"
+	"attribute mat4 a_modelview;\n"
+	"attribute vec4 a_dequantize;\n"
+	"#define MODELVIEW a_modelview\n"
+	"#define DEQUANTIZE a_dequantize\n"
+	"#else\n"
+	"uniform mat4 u_modelview;\n"
+	"uniform vec4 u_dequantize;\n"
+	"#define MODELVIEW u_modelview\n"
+	"#define DEQUANTIZE u_dequantize\n"
+	"#endif\n"
+	"\n"
+	"uniform mat4 u_projection;\n"
+	"uniform float u_lighting;\n"
+	"uniform vec4 u_color;\n"
+	"uniform float u_point_size;\n"
+	"uniform vec3 u_light_direction;\n"
+	"uniform vec4 u_light_ambient;\n"
+	"uniform vec4 u_light_diffuse;\n"
+	"\n"
+	"attribute vec3 a_position;\n"
+	"attribute vec3 a_normal;\n"
+	"\n"
+	"varying vec4 v_color;\n"
+	"\n"
+	"#ifdef TERRAIN\n"
+	"uniform sampler2D u_heights;\n"
+	"uniform vec4 u_terrain_grid;\n"
+	"uniform vec4 u_terrain_bounds;\n"
+	"uniform vec4 u_terrain_lines[MAX_TERRAIN_LINES];\n"
+	"uniform float u_skirt_depth;\n"
+	"\n"
+	"/* point at given grid coordinates; heights are interpolated\n"
+	" * by texture filtering, line positions - explicitly */\n"
+	"vec3 terrain_point(vec2 grid) {\n"
+	"	vec2 line = min(floor(grid), u_terrain_grid.zw - 2.0);\n"
+	"	vec2 k = grid - line;\n"
+	"	float x = mix(u_terrain_lines[int(line.x)].x, u_terrain_lines[int(line.x) + 1].x, k.x);\n"
+	"	vec2 yz = mix(u_terrain_lines[int(line.y)].yz, u_terrain_lines[int(line.y) + 1].yz, k.y);\n"
+	"	float height = texture2DLod(u_heights, (grid + 0.5) * u_terrain_grid.xy, 0.0).r * 65535.0 - 32768.0;\n"
+	"	return vec3(x, yz.x, height * yz.y);\n"
+	"}\n"
+	"#endif\n"
+	"\n"
+	"void main() {\n"
+	"#ifdef TERRAIN\n"
+	"	vec2 grid = clamp(a_position.xy, u_terrain_bounds.xy, u_terrain_bounds.zw);\n"
+	"	vec3 position = terrain_point(grid);\n"
+	"	vec3 normal = cross(terrain_point(grid + vec2(1.0, 0.0)) - terrain_point(grid - vec2(1.0, 0.0)), terrain_point(grid + vec2(0.0, 1.0)) - terrain_point(grid - vec2(0.0, 1.0)));\n"
+	"	position.z -= a_position.z * u_skirt_depth;\n"
+	"#else\n"
+	"	vec3 position = a_position * DEQUANTIZE.w + DEQUANTIZE.xyz;\n"
+	"	vec3 normal = a_normal;\n"
+	"#endif\n"
+	"\n"
+	"	vec4 eye = MODELVIEW * vec4(position, 1.0);\n"
+	"	gl_Position = u_projection * eye;\n"
+	"	gl_PointSize = u_point_size;\n"
+	"\n"
+	"	if (u_lighting > 0.5) {\n"
+	"		vec3 eye_normal = normalize((MODELVIEW * vec4(normal, 0.0)).xyz);\n"
+	"		float diffuse = max(dot(eye_normal, u_light_direction), 0.0);\n"
+	"		v_color = vec4(clamp(u_light_ambient.rgb + u_light_diffuse.rgb * diffuse, 0.0, 1.0), u_light_diffuse.a);\n"
+	"	} else {\n"
+	"		v_color = u_color;\n"
+	"	}\n"
+	"}\n";
+
+static const char* TILE_FRAGMENT_SHADER =
+	"#ifdef GL_ES\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"\n"
+	"varying vec4 v_color;\n"
+	"\n"
+	"void main() {\n"
+	"	gl_FragColor = v_color;\n"
+	"}\n";
+
+TileShader::TileShader(int flags) : program_(0), flags_(flags) {
+	if (!IsSupported())
+		throw GLUnsupportedException() << "Shader render path requires OpenGL 3.0, OpenGL ES 2.0 or vertex array object support";
+
+	if ((flags_ & BATCHED) && (flags_ & TERRAIN))
+		throw Exception() << "Batched terrain shader is not supported";
+
+	if (flags_ & TERRAIN) {
+#if defined(WITH_HEIGHT_TEXTURES)
+		GLint units = 0;
+		glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+		if (units < 1)
+#endif
+			throw GLUnsupportedException() << "Terrain shader requires vertex texture fetch support";
+	}
+
+	/* batched variant takes per-draw data from instance attributes,
+	 * and terrain one does displacement */
+	std::stringstream prefix;
+	if (flags_ & BATCHED)
+		prefix << "#define BATCHED\n";
+	if (flags_ & TERRAIN)
+		prefix << "#define TERRAIN\n#define MAX_TERRAIN_LINES " << MAX_TERRAIN_LINES << "\n";
+
+	GLuint vertex = CompileShader(GL_VERTEX_SHADER, prefix.str().c_str(), TILE_VERTEX_SHADER);
+	GLuint fragment;
+	try {
+		fragment = CompileShader(GL_FRAGMENT_SHADER, prefix.str().c_str(), TILE_FRAGMENT_SHADER);
+	} catch (...) {
+		glDeleteShader(vertex);
+		throw;
+	}
+
+	program_ = glCreateProgram();
+	glAttachShader(program_, vertex);
+	glAttachShader(program_, fragment);
+	glBindAttribLocation(program_, POSITION, "a_position");
+	glBindAttribLocation(program_, NORMAL, "a_normal");
+	glBindAttribLocation(program_, MODELVIEW, "a_modelview");
+	glBindAttribLocation(program_, DEQUANTIZE, "a_dequantize");
+	glLinkProgram(program_);
+
+	/* shaders are freed along with program */
+	glDeleteShader(vertex);
+	glDeleteShader(fragment);
+
+	GLint status;
+	glGetProgramiv(program_, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		GLint length = 0;
+		glGetProgramiv(program_, GL_INFO_LOG_LENGTH, &length);
+		std::vector<char> log(length + 1);
+		glGetProgramInfoLog(program_, length, NULL, &log[0]);
+		glDeleteProgram(program_);
+		throw Exception() << "Cannot link tile shader: " << &log[0];
+	}
+
+	modelview_location_ = glGetUniformLocation(program_, "u_modelview");
+	projection_location_ = glGetUniformLocation(program_, "u_projection");
+	dequantize_location_ = glGetUniformLocation(program_, "u_dequantize");
+	lighting_location_ = glGetUniformLocation(program_, "u_lighting");
+	color_location_ = glGetUniformLocation(program_, "u_color");
+	point_size_location_ = glGetUniformLocation(program_, "u_point_size");
+	light_direction_location_ = glGetUniformLocation(program_, "u_light_direction");
+	light_ambient_location_ = glGetUniformLocation(program_, "u_light_ambient");
+	light_diffuse_location_ = glGetUniformLocation(program_, "u_light_diffuse");
+	heights_location_ = glGetUniformLocation(program_, "u_heights");
+	terrain_grid_location_ = glGetUniformLocation(program_, "u_terrain_grid");
+	terrain_bounds_location_ = glGetUniformLocation(program_, "u_terrain_bounds");
+	terrain_lines_location_ = glGetUniformLocation(program_, "u_terrain_lines");
+	skirt_depth_location_ = glGetUniformLocation(program_, "u_skirt_depth");
+}
+
+TileShader::~TileShader() {
+	glDeleteProgram(program_);
+}
+
+GLuint TileShader::CompileShader(GLenum type, const char* prefix, const char* source) {
+	const char* sources[2] = { prefix, source };
+
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 2, sources, NULL);
+	glCompileShader(shader);
+
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::vector<char> log(length + 1);
+		glGetShaderInfoLog(shader, length, NULL, &log[0]);
+		glDeleteShader(shader);
+		throw Exception() << "Cannot compile tile " << (type == GL_VERTEX_SHADER ? "vertex" : "fragment") << " shader: " << &log[0];
+	}
+
+	return shader;
+}
+
+bool TileShader::IsSupported() {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version == NULL)
+		return false;
+
+	if (strncmp(version, "OpenGL ES ", 10) == 0)
+		version += 10;
+
+	int major = atoi(version);
+	if (major < 2)
+		return false;
+	if (major >= 3)
+		return true;
+
+	/* 2.x needs extension for vertex array objects */
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions != NULL && (strstr(extensions, "GL_ARB_vertex_array_object") != NULL || strstr(extensions, "GL_OES_vertex_array_object") != NULL);
+}
+
+void TileShader::Begin() {
+	glUseProgram(program_);
+#if !defined(WITH_GLES2)
+	glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+#endif
+
+	GLfloat projection[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+	glUniformMatrix4fv(projection_location_, 1, GL_FALSE, projection);
+
+	SetQuantizer(NULL);
+	SetLighting(false);
+	SetColor(1.0f, 1.0f, 1.0f, 1.0f);
+	SetPointSize(1.0f);
+
+	/* heights are always taken from unit 0 */
+	glUniform1i(heights_location_, 0);
+}
+
+void TileShader::End() {
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+#if !defined(WITH_GLES2)
+	glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+#endif
+	glUseProgram(0);
+}
+
+void TileShader::SetLight(const GLfloat position[4], const GLfloat light_ambient[4], const GLfloat light_diffuse[4], const GLfloat material[4]) {
+	GLfloat modelview[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+
+	/* only directional light is supported, so only rotation matters */
+	Vector3f direction(
+			modelview[0] * position[0] + modelview[4] * position[1] + modelview[8] * position[2],
+			modelview[1] * position[0] + modelview[5] * position[1] + modelview[9] * position[2],
+			modelview[2] * position[0] + modelview[6] * position[1] + modelview[10] * position[2]
+		);
+	direction.Normalize();
+
+	glUniform3f(light_direction_location_, direction.x, direction.y, direction.z);
+	glUniform4f(light_ambient_location_, light_ambient[0] * material[0], light_ambient[1] * material[1], light_ambient[2] * material[2], 0.0f);
+	glUniform4f(light_diffuse_location_, light_diffuse[0] * material[0], light_diffuse[1] * material[1], light_diffuse[2] * material[2], material[3]);
+}
+
+void TileShader::SetModelview(const GLfloat matrix[16]) {
+	memcpy(modelview_, matrix, sizeof(modelview_));
+	glUniformMatrix4fv(modelview_location_, 1, GL_FALSE, matrix);
+}
+
+void TileShader::SetQuantizer(const VertexQuantizer* quantizer) {
+	if (quantizer) {
+		Vector3f center = quantizer->GetCenter();
+		glUniform4f(dequantize_location_, center.x, center.y, center.z, quantizer->GetScale());
+	} else {
+		glUniform4f(dequantize_location_, 0.0f, 0.0f, 0.0f, 1.0f);
+	}
+}
+
+void TileShader::SetLighting(bool enabled) {
+	glUniform1f(lighting_location_, enabled ? 1.0f : 0.0f);
+}
+
+void TileShader::SetColor(float r, float g, float b, float a) {
+	glUniform4f(color_location_, r, g, b, a);
+}
+
+void TileShader::SetPointSize(float size) {
+	glUniform1f(point_size_location_, size);
+}
+
+void TileShader::SetTerrainGrid(int width, int height, const GLfloat bounds[4], const GLfloat* lines, GLfloat skirt) {
+	glUniform4f(terrain_grid_location_, 1.0f / (float)width, 1.0f / (float)height, (float)width, (float)height);
+	glUniform4fv(terrain_bounds_location_, 1, bounds);
+	glUniform4fv(terrain_lines_location_, std::max(width, height), lines);
+	glUniform1f(skirt_depth_location_, skirt);
+}
+
+#else
+
+TileShader::TileShader(int flags) : program_(0), flags_(flags) {
+	throw GLUnsupportedException() << "Shader render path is not supported with OpenGL ES 1.1";
+}
+
+TileShader::~TileShader() {
+}
+
+GLuint TileShader::CompileShader(GLenum, const char*, const char*) {
+	return 0;
+}
+
+bool TileShader::IsSupported() {
+	return false;
+}
+
+void TileShader::Begin() {
+}
+
+void TileShader::End() {
+}
+
+void TileShader::SetLight(const GLfloat*, const GLfloat*, const GLfloat*, const GLfloat*) {
+}
+
+void TileShader::SetModelview(const GLfloat*) {
+}
+
+void TileShader::SetQuantizer(const VertexQuantizer*) {
+}
+
+void TileShader::SetLighting(bool) {
+}
+
+void TileShader::SetColor(float, float, float, float) {
+}
+
+void TileShader::SetPointSize(float) {
+}
+
+void TileShader::SetTerrainGrid(int, int, const GLfloat*, const GLfloat*, GLfloat) {
+}
+
+#endif
@@ -62,6 +62,8 @@ public:
 
 	virtual void SetupViewerMatrix(const Projection& projection) const;
 	virtual Vector3i GetPos(const Projection& projection) const;
+	virtual bool GetViewCone(Vector2f& direction, float& halfangle) const;
+	virtual bool GetVelocity(Vector3f& velocity) const;
 
 	void SetFov(float fov);
 	void SetAspect(float aspect);
@@ -71,6 +73,9 @@ public:
 	/**
 	 * Move viewer smoothly
 	 *
+	 * This also sets velocity of the viewer, so it should be
+	 * called with no flags when viewer stops.
+	 *
 	 * @param flags combination of Direction constants which
 	 *              represents direction for viewer to move to
 	 * @param speed movement speed in meters/second
@@ -78,6 +83,17 @@ public:
 	 */
 	void Move(int flags, float speed, float time);
 
+	/**
+	 * Sets velocity reported by GetVelocity()
+	 *
+	 * For viewers which are moved with SetPos() instead of
+	 * Move(), so tile prefetch still knows where they go.
+	 *
+	 * @param velocity in meters per second; x is east, y is
+	 *        north, z is up
+	 */
+	void SetVelocity(const Vector3f& velocity);
+
 	void SetRotation(float yaw, float pitch);
 
 	void Rotate(float yawspeed, float pitchspeed, float time);
@@ -102,6 +118,9 @@ protected:
 	/** Terrain elevation at eye point */
 	osmint_t landscape_height_;
 
+	/** Velocity of last Move(), in meters per second */
+	Vector3f velocity_;
+
 	float yaw_;
 	float pitch_;
 
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESCHEDULER_HH
+#define FRAMESCHEDULER_HH
+
+#include <glosm/NonCopyable.hh>
+
+/**
+ * Splits main thread maintenance time of a frame between layers
+ *
+ * Layers attached with TileManager::SetScheduler() do their per
+ * frame maintenance (garbage collection, load passes, tile uploads
+ * and destruction of dropped tiles) within an equal share of the
+ * frame budget, and leave the rest for following frames, so work
+ * piling up at once (e.g. after Clear() or a jump) doesn't make a
+ * single frame slow. Each kind of work still does minimal progress
+ * on each frame, so budget may be overrun; overruns are counted.
+ *
+ * Scheduler is only used from the main thread and must outlive
+ * all layers attached to it.
+ */
+class FrameScheduler : private NonCopyable {
+public:
+	/**
+	 * Runtime statistics, see GetStatistics()
+	 *
+	 * Counters are cumulative since construction.
+	 */
+	struct Statistics {
+		/* frames begun, and frames which took more maintenance
+		 * time than budget */
+		unsigned int frames;
+		unsigned int overruns;
+
+		/* total and maximal per frame maintenance seconds */
+		double time;
+		float max_time;
+
+		Statistics();
+	};
+
+protected:
+	float budget_;
+	int clients_;
+
+	unsigned int frame_;
+	double frame_time_;
+
+	Statistics stats_;
+
+public:
+	/**
+	 * Constructs scheduler
+	 *
+	 * @param budget maintenance seconds per frame for all layers
+	 */
+	FrameScheduler(float budget);
+
+	/**
+	 * Starts new frame; should be called before any layer
+	 * maintenance of the frame
+	 */
+	void BeginFrame();
+
+	/**
+	 * Accounts maintenance time spent in current frame
+	 */
+	void Charge(double seconds);
+
+	/**
+	 * Returns number of current frame
+	 */
+	unsigned int GetFrame() const;
+
+	/**
+	 * Returns maintenance seconds per frame of a single layer
+	 */
+	float GetShare() const;
+
+	/**
+	 * Sets maintenance seconds per frame for all layers
+	 */
+	void SetBudget(float budget);
+
+	/**
+	 * Registers layer; called by TileManager::SetScheduler()
+	 */
+	void Attach();
+
+	/**
+	 * Unregisters layer; called by TileManager::SetScheduler()
+	 */
+	void Detach();
+
+	/**
+	 * Returns runtime statistics
+	 */
+	void GetStatistics(Statistics& stats) const;
+};
+
+#endif
@@ -24,6 +24,8 @@
 #include <glosm/Tile.hh>
 #include <glosm/NonCopyable.hh>
 #include <glosm/BBox.hh>
+#include <glosm/VertexArray.hh>
+#include <glosm/TileBatch.hh>
 
 #include <memory>
 #include <vector>
@@ -42,16 +44,37 @@ class HeightmapDatasource;
  */
 class GPXTile : public Tile, private NonCopyable {
 protected:
+	/* points paired with their projections onto the ground,
+	 * followed by track polylines */
 	std::auto_ptr<VertexBuffer<Vector3f> > points_;
+	GLsizei pairs_count_;
+
+	/* polylines of more than one point, for GL_LINE_STRIP */
+	std::vector<GLint> strip_firsts_;
+	std::vector<GLsizei> strip_counts_;
+
+	/* attribute setup of points_ for TileShader, for drawing
+	 * every other point and all of them as lines */
+	VertexArray points_array_;
+	VertexArray lines_array_;
+
+	/* points in TileBatch, which replace points_ */
+	TileBatch* batch_;
+	TileBatch::Handle points_handle_;
+	TileBatch::Handle lines_handle_;
 
 	size_t size_;
 
 public:
 	/**
-	 * Constructs tile from vector of points
+	 * Constructs tile from tracks in given bbox
+	 *
+	 * Tracks are simplified according to tile level, which is
+	 * found from bbox width.
 	 *
 	 * @param projection projection used to convert fixed-point geometry
-	 * @param points source points
+	 * @param datasource source of tracks
+	 * @param heightmap source of ground heights
 	 * @param ref reference point of this tile
 	 * @param bbox bounding box of this tile
 	 */
@@ -67,10 +90,35 @@ public:
 	 */
 	virtual void Render();
 
+	/**
+	 * Render this tile with shader
+	 */
+	virtual void Render(TileShader& shader);
+
+	/**
+	 * Queue this tile for drawing with batch
+	 */
+	virtual void Render(TileBatch& batch, const float modelview[16]);
+
 	/**
 	 * Returns tile size in bytes
 	 */
 	virtual size_t GetSize() const;
+
+	/**
+	 * Returns size of data not yet uploaded to GPU, in bytes
+	 */
+	virtual size_t GetUploadSize() const;
+
+	/**
+	 * Uploads tile data to GPU
+	 */
+	virtual void Upload();
+
+	/**
+	 * Moves tile data into batch
+	 */
+	virtual void Upload(TileBatch& batch);
 };
 
 #endif
@@ -22,20 +22,42 @@
 #define GEOMETRYLAYER_HH
 
 #include <glosm/Layer.hh>
+#include <glosm/GeometryDatasource.hh>
 #include <glosm/Projection.hh>
 #include <glosm/NonCopyable.hh>
 #include <glosm/TileManager.hh>
 
 class Viewer;
-class GeometryDatasource;
 
 /**
  * Layer with 3D OpenStreetMap data.
+ *
+ * Geometry is requested with GeometryDatasource::Submit(), so
+ * with asynchronous sources many tiles are kept in flight.
  */
 class GeometryLayer : public Layer, public TileManager, private NonCopyable {
+protected:
+	/**
+	 * Passes geometry request completion to the layer
+	 */
+	class RequestNotifier : public GeometryRequest::Callback {
+	protected:
+		TileManager& manager_;
+
+	public:
+		RequestNotifier(TileManager& manager) : manager_(manager) {
+		}
+
+		virtual void OnRequestReady() {
+			manager_.NotifyRequestReady();
+		}
+	};
+
 protected:
 	const Projection projection_;
 	const GeometryDatasource& datasource_;
+	volatile int tile_flags_;
+	mutable RequestNotifier notifier_;
 
 public:
 	GeometryLayer(const Projection projection, const GeometryDatasource& datasource);
@@ -43,6 +65,14 @@ public:
 
 	void Render(const Viewer& viewer);
 	virtual Tile* SpawnTile(const BBoxi& bbox, int flags) const;
+	virtual TileRequest* RequestTile(const BBoxi& bbox, int flags) const;
+
+	/**
+	 * Sets flags for constructing tiles
+	 *
+	 * @param flags combination of GeometryTile::Flags
+	 */
+	void SetTileFlags(int flags);
 };
 
 #endif
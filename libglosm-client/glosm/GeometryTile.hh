@@ -24,6 +24,9 @@
 #include <glosm/Tile.hh>
 #include <glosm/BBox.hh>
 #include <glosm/NonCopyable.hh>
+#include <glosm/VertexQuantizer.hh>
+#include <glosm/VertexArray.hh>
+#include <glosm/TileBatch.hh>
 
 #include <glosm/util/gl.h>
 
@@ -32,9 +35,11 @@
 
 template<class T>
 class VertexBuffer;
+class IndexBuffer;
 
 class Projection;
 class Geometry;
+class ModelInstances;
 
 /**
  * A tile of renderable geometry
@@ -42,6 +47,21 @@ class Geometry;
  * This tile type is used in GeometryLayer
  */
 class GeometryTile : public Tile, private NonCopyable {
+public:
+	enum Flags {
+		/* share vertices between primitives and reorder them
+		 * for vertex cache, see MeshOptimizer */
+		WELD_VERTICES = 0x01,
+
+		/* render polygons as a single triangle strip instead
+		 * of triangle list, see Geometry::GetConvexStrip() */
+		TRIANGLE_STRIPS = 0x02,
+
+		/* store vertices in compact 16 bit format, see
+		 * VertexQuantizer */
+		QUANTIZE_VERTICES = 0x04,
+	};
+
 protected:
 	struct Vertex {
 		Vector3f pos;
@@ -51,18 +71,79 @@ protected:
 		}
 	};
 
+	/* quantized formats; padded for alignment */
+	struct PackedPosition {
+		GLshort pos[4];
+	};
+
+	struct PackedVertex {
+		GLshort pos[4];
+		GLbyte norm[4];
+	};
+
 protected:
 	std::auto_ptr<VertexBuffer<Vector3f> > lines_vertices_;
-	std::auto_ptr<VertexBuffer<GLuint> > lines_indices_;
+	std::auto_ptr<IndexBuffer> lines_indices_;
 
 	std::auto_ptr<VertexBuffer<Vertex> > convex_vertices_;
-	std::auto_ptr<VertexBuffer<GLuint> > convex_indices_;
+	std::auto_ptr<IndexBuffer> convex_indices_;
+	GLenum convex_mode_;
+
+	/* replace float vertex buffers if vertices are quantized */
+	std::auto_ptr<VertexBuffer<PackedPosition> > packed_lines_vertices_;
+	std::auto_ptr<VertexBuffer<PackedVertex> > packed_convex_vertices_;
+	VertexQuantizer quantizer_;
+	bool quantized_;
+
+	/* attribute setup of the above for TileShader */
+	VertexArray lines_array_;
+	VertexArray convex_array_;
+
+	/* geometry in TileBatch, which replaces all the buffers */
+	TileBatch* batch_;
+	TileBatch::Handle lines_handle_;
+	TileBatch::Handle convex_handle_;
+
+	/* instances of shared models, see Geometry::Instance */
+	std::auto_ptr<ModelInstances> models_;
 
 	size_t size_;
 
 protected:
 	void CalcFanNormal(Vertex* vertices, int count);
 
+	/**
+	 * Builds vertex buffers from geometry
+	 *
+	 * Instantiated per concrete projection type, so projection
+	 * of each vertex is inlined into the loops.
+	 */
+	template <class PROJECTOR>
+	void Build(PROJECTOR& projector, const Geometry& geometry, int flags);
+
+	/**
+	 * Welds line vertices sharing position
+	 */
+	void WeldLines(const Geometry& geometry);
+
+	/**
+	 * Welds polygon vertices sharing position and normal, and
+	 * reorders triangles (unless in strip mode) and vertices
+	 * for locality
+	 */
+	void WeldConvex(const Geometry& geometry);
+
+	/**
+	 * Converts vertices into quantized format
+	 */
+	void Quantize();
+
+	/**
+	 * Places model instances into tile coordinates
+	 */
+	template <class PROJECTOR>
+	void BuildInstances(PROJECTOR& projector, const Geometry& geometry);
+
 public:
 	/**
 	 * Constructs tile from given geometry
@@ -71,8 +152,9 @@ public:
 	 * @param geometry source geometry
 	 * @param ref reference point of this tile
 	 * @param bbox bounding box of this tile
+	 * @param flags combination of Flags
 	 */
-	GeometryTile(const Projection& projection, const Geometry& geometry, const Vector2i& ref, const BBoxi& bbox);
+	GeometryTile(const Projection& projection, const Geometry& geometry, const Vector2i& ref, const BBoxi& bbox, int flags = 0);
 
 	/**
 	 * Destructor
@@ -84,10 +166,35 @@ public:
 	 */
 	virtual void Render();
 
+	/**
+	 * Render this tile with shader
+	 */
+	virtual void Render(TileShader& shader);
+
+	/**
+	 * Queue this tile for drawing with batch
+	 */
+	virtual void Render(TileBatch& batch, const float modelview[16]);
+
 	/**
 	 * Returns tile size in bytes
 	 */
 	virtual size_t GetSize() const;
+
+	/**
+	 * Returns size of data not yet uploaded to GPU, in bytes
+	 */
+	virtual size_t GetUploadSize() const;
+
+	/**
+	 * Uploads tile data to GPU
+	 */
+	virtual void Upload();
+
+	/**
+	 * Moves tile data into batch
+	 */
+	virtual void Upload(TileBatch& batch);
 };
 
 #endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMPOSTORCACHE_HH
+#define IMPOSTORCACHE_HH
+
+#include <glosm/NonCopyable.hh>
+#include <glosm/Math.hh>
+
+#include <cstddef>
+
+class Tile;
+
+/**
+ * Renders tiles into textures drawn on a single quad instead of
+ * tile geometry
+ *
+ * Holds framebuffer impostors are rendered into, parameters set
+ * by TileManager::SetImpostors() and per frame state, and decides
+ * whether an impostor may be used, must be rendered again or
+ * can't be made at all. Impostors themselves are owned by tiles
+ * of TileManager, which creates and destroys them through the
+ * cache. Used only from the main thread, with GL context.
+ */
+class ImpostorCache : private NonCopyable {
+public:
+	/**
+	 * Image of a tile drawn instead of its geometry
+	 *
+	 * Image is taken from the viewer position it's made for, and
+	 * is drawn on a quad through the middle of tile contents,
+	 * facing that position. Coordinates are relative to tile
+	 * reference point, so it stays in place as viewer moves.
+	 */
+	struct Impostor {
+		/* texture with premultiplied alpha (GLuint, 0 if not
+		 * created yet) */
+		unsigned int texture;
+
+		/* quad corners, counter-clockwise from bottom left
+		 * corner of texture */
+		Vector3f corners[4];
+
+		/* part of texture image takes, which is sized to
+		 * match screen pixels */
+		float texcoords[2];
+
+		/* viewer position image was taken from, and center
+		 * of tile contents */
+		Vector3f eye;
+		Vector3f center;
+	};
+
+protected:
+	/* see SetParameters() */
+	float distance_;
+	int resolution_;
+	float max_angle_;
+
+	/* framebuffer impostors are rendered into and its depth
+	 * buffer (GLuint, 0 if not created yet) */
+	unsigned int framebuffer_;
+	unsigned int depthbuffer_;
+
+	/* impostors which may still be rendered in current frame,
+	 * horizontal and vertical screen pixels per unit of tangent
+	 * of view angle, and impostor distance in projected
+	 * coordinates */
+	int updates_left_;
+	float pixel_scale_[2];
+	float min_distance_;
+
+	int count_;
+
+protected:
+	/**
+	 * Destroys framebuffer, if any
+	 */
+	void DestroyFramebuffer();
+
+public:
+	ImpostorCache();
+
+	/**
+	 * Destroys framebuffer; all impostors must be destroyed
+	 * already
+	 */
+	~ImpostorCache();
+
+	/**
+	 * Checks whether framebuffer objects impostors need are
+	 * available; must be called with GL context
+	 */
+	static bool IsSupported();
+
+	/**
+	 * Sets parameters, see TileManager::SetImpostors()
+	 *
+	 * Existing framebuffer is dropped as it may be of other
+	 * resolution, so all impostors must be destroyed first.
+	 */
+	void SetParameters(float distance, int resolution, float max_angle);
+
+	/**
+	 * Tells whether impostors are in use
+	 */
+	bool IsEnabled() const;
+
+	/**
+	 * Prepares for new frame
+	 *
+	 * @param projection projection matrix of the frame
+	 * @param viewport viewport of the frame
+	 * @param meter length of a meter in projected coordinates
+	 *        at the viewer
+	 */
+	void BeginFrame(const float projection[16], const int viewport[4], float meter);
+
+	/**
+	 * Tells whether tile is too close to the viewer to be drawn
+	 * as impostor
+	 *
+	 * @param min, max box around tile contents, viewer is at
+	 *        the origin
+	 */
+	bool IsTooClose(const Vector3f& min, const Vector3f& max) const;
+
+	/**
+	 * Tells whether existing impostor still matches the view,
+	 * that is both direction from tile to viewer and distance
+	 * to it haven't changed too much
+	 *
+	 * @param model model matrix of tile relative to viewer
+	 */
+	bool IsValid(const Impostor& impostor, const float model[16]) const;
+
+	/**
+	 * Takes one of impostor updates allowed per frame
+	 *
+	 * @return false if none are left in current frame
+	 */
+	bool TakeUpdate();
+
+	/**
+	 * Calculates size of image matching screen pixels
+	 *
+	 * @param width, height image bounds on the plane at given
+	 *        distance from the viewer
+	 * @param distance distance to the plane
+	 * @param pixel_width, pixel_height resulting image size
+	 * @return false if image doesn't fit into texture
+	 */
+	bool GetImageSize(float width, float height, float distance, int& pixel_width, int& pixel_height) const;
+
+	/**
+	 * Renders tile into its impostor for current viewer
+	 * position, creating impostor if there's none
+	 *
+	 * On failure impostor may still be created and should be
+	 * destroyed by the caller.
+	 *
+	 * @param model model matrix of tile relative to viewer
+	 * @param min, max box around tile contents
+	 * @param viewer_modelview modelview matrix of the viewer,
+	 *        used for light direction
+	 * @return false if tile can't have an impostor from here
+	 */
+	bool Update(Impostor*& impostor, Tile& tile, const float model[16], const Vector3f& min, const Vector3f& max, const float viewer_modelview[16]);
+
+	/**
+	 * Draws impostor in fixed function mode
+	 *
+	 * Must be called with modelview matrix for render origin.
+	 *
+	 * @param transform transform of tile relative to render origin
+	 */
+	void Render(const Impostor& impostor, const float transform[16]) const;
+
+	/**
+	 * Creates impostor without image
+	 *
+	 * Texture is made by the first Update(), so this doesn't
+	 * need GL context.
+	 */
+	Impostor* Create();
+
+	/**
+	 * Destroys impostor, if any
+	 */
+	void Destroy(Impostor*& impostor);
+
+	/**
+	 * Returns number of impostors held
+	 */
+	size_t GetCount() const;
+
+	/**
+	 * Returns bytes of texture of a single impostor
+	 */
+	size_t GetImpostorSize() const;
+
+	/**
+	 * Returns bytes of textures of impostors held
+	 */
+	size_t GetBytes() const;
+};
+
+#endif
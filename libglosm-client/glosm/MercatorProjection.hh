@@ -22,6 +22,9 @@
 #define MERCATORPROJECTION_HH
 
 #include <glosm/Projection.hh>
+#include <glosm/geomath.h>
+
+#include <cmath>
 
 /**
  * Mercator/EPSG:3857 projection
@@ -29,12 +32,131 @@
  * This represents Spherical Mercator projection common to OpenStreetMap.
  */
 class MercatorProjection : public Projection {
+	friend class Projection;
+
+public:
+	/**
+	 * Inlineable projector bound to a reference point
+	 *
+	 * This is used for code specialized for this projection at
+	 * compile time, see Projection::Is(). Latitude-dependent terms
+	 * are cached, as consecutive points often share latitude.
+	 *
+	 * Points near the reference point (as all points of a tile
+	 * are) are projected with Taylor series of mercator and cos
+	 * around reference latitude, which are computed once, instead
+	 * of transcendental functions. Series range is chosen so the
+	 * error is below 1e-11 radians (around 0.1mm), far below float
+	 * resolution of the result; farther points are projected
+	 * exactly.
+	 */
+	class Projector {
+	protected:
+		Vector3i ref_;
+		double ref_lat_;
+		double ref_y_;
+
+		/* series of mercator(ref_lat_ + d) - ref_y_ by powers of
+		 * d, and limits of d^2 and |d|^5 where it's used */
+		double ycoef_[4];
+		double ref_sin_;
+		double ref_cos_;
+		double max_d2_;
+		double max_d5_;
+
+		bool cached_;
+		osmint_t last_y_;
+		double y_;
+		double zdiv_;
+
+	public:
+		Projector(const Vector3i& ref);
+
+		Vector3f operator()(const Vector3i& point);
+	};
+
 protected:
 	static Vector3f ProjectImpl(const Vector3i& point, const Vector3i& ref);
 	static Vector3i UnProjectImpl(const Vector3f& point, const Vector3i& ref);
+	static void ProjectManyImpl(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out);
 
 public:
 	MercatorProjection();
 };
 
+inline MercatorProjection::Projector::Projector(const Vector3i& ref): ref_(ref), ref_lat_((double)ref.y * GEOM_DEG_TO_RAD), cached_(false), last_y_(0), y_(0.0), zdiv_(0.0) {
+#ifdef HAVE_SINCOS
+	sincos(ref_lat_, &ref_sin_, &ref_cos_);
+#else
+	ref_sin_ = sin(ref_lat_);
+	ref_cos_ = cos(ref_lat_);
+#endif
+	ref_y_ = 0.5*log((1.0+ref_sin_)/(1.0-ref_sin_));
+
+	/* derivatives of mercator are sec, sec*tan, sec*(1+2tan^2),
+	 * sec*tan*(5+6tan^2) and sec*(5+28tan^2+24tan^4) */
+	double secant = 1.0 / ref_cos_;
+	double tangent = ref_sin_ * secant;
+	double tangent2 = tangent * tangent;
+	ycoef_[0] = secant;
+	ycoef_[1] = secant * tangent / 2.0;
+	ycoef_[2] = secant * (1.0 + 2.0 * tangent2) / 6.0;
+	ycoef_[3] = secant * tangent * (5.0 + 6.0 * tangent2) / 24.0;
+
+	/* max latitude difference and error of series, and cos
+	 * and sin of the former */
+	static const double SERIES_RANGE = 0.01;
+	static const double MAX_SERIES_ERROR = 1e-11;
+	static const double COS_SERIES_RANGE = 0.99995000041666526;
+	static const double SIN_SERIES_RANGE = 0.0099998333341666645;
+	static const double COS_89_DEG = 0.017452406437283376;
+
+	/* truncation error is bounded by fifth derivative, which
+	 * grows with latitude, at the edge of series range, times
+	 * d^5/120; near poles it grows too fast for series to help */
+	double edge_cos = ref_cos_ * COS_SERIES_RANGE - fabs(ref_sin_) * SIN_SERIES_RANGE;
+	if (edge_cos < COS_89_DEG) {
+		max_d2_ = max_d5_ = 0.0;
+		return;
+	}
+
+	double edge_sec = 1.0 / edge_cos;
+	double edge_tan2 = edge_sec * edge_sec - 1.0;
+	double d5 = edge_sec * (5.0 + 28.0 * edge_tan2 + 24.0 * edge_tan2 * edge_tan2);
+
+	max_d2_ = SERIES_RANGE * SERIES_RANGE;
+	max_d5_ = 120.0 * MAX_SERIES_ERROR / d5;
+}
+
+inline Vector3f MercatorProjection::Projector::operator()(const Vector3i& point) {
+	if (!cached_ || point.y != last_y_) {
+		double lat = (double)point.y * GEOM_DEG_TO_RAD;
+		double d = lat - ref_lat_;
+		double d2 = d * d;
+		if (d2 < max_d2_ && d2 * d2 * fabs(d) < max_d5_) {
+			y_ = d * (ycoef_[0] + d * (ycoef_[1] + d * (ycoef_[2] + d * ycoef_[3])));
+			/* cos(ref + d) */
+			zdiv_ = WGS84_EARTH_EQ_RADIUS * (ref_cos_ * (1.0 - d2 / 2.0 * (1.0 - d2 / 12.0)) - ref_sin_ * d * (1.0 - d2 / 6.0 * (1.0 - d2 / 20.0)));
+		} else {
+#ifdef HAVE_SINCOS
+			double sinlat, coslat;
+			sincos(lat, &sinlat, &coslat);
+#else
+			double sinlat = sin(lat);
+			double coslat = cos(lat);
+#endif
+			y_ = 0.5*log((1.0+sinlat)/(1.0-sinlat)) - ref_y_;
+			zdiv_ = WGS84_EARTH_EQ_RADIUS * coslat;
+		}
+		last_y_ = point.y;
+		cached_ = true;
+	}
+
+	return Vector3f(
+			(double)((osmlong_t)point.x - ref_.x) * GEOM_DEG_TO_RAD,
+			y_,
+			(double)(point.z - ref_.z) / GEOM_UNITSINMETER / zdiv_
+		);
+}
+
 #endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MESHOPTIMIZER_HH
+#define MESHOPTIMIZER_HH
+
+#include <glosm/Math.hh>
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Mesh optimization routines for tile geometry
+ *
+ * Vertices are first welded into a shared pool with
+ * BuildWeldMap(), then triangles are reordered for
+ * post-transform vertex cache with OptimizeVertexCache(),
+ * and finally vertices are reordered for fetch locality with
+ * BuildFetchMap(). Maps are applied with RemapVertices().
+ */
+namespace MeshOptimizer {
+	/**
+	 * Welding key of a vertex
+	 *
+	 * Vertices are merged if they originate from the same
+	 * fixed-point position and have close normals.
+	 */
+	struct WeldKey {
+		Vector3i pos;
+		Vector3i norm;
+
+		WeldKey(const Vector3i& p, const Vector3f& n = Vector3f());
+
+		bool operator<(const WeldKey& other) const;
+		bool operator==(const WeldKey& other) const;
+	};
+
+	/** Value of remap entry for dropped vertex */
+	static const unsigned int NO_VERTEX = (unsigned int)-1;
+
+	/**
+	 * Builds map which merges vertices with equal keys
+	 *
+	 * Merged vertices are numbered in order of their first
+	 * occurrence.
+	 *
+	 * @param keys keys of vertices
+	 * @param remap vertex map, remap[old] == new
+	 * @return number of unique vertices
+	 */
+	size_t BuildWeldMap(const std::vector<WeldKey>& keys, std::vector<unsigned int>& remap);
+
+	/**
+	 * Reorders triangles for post-transform vertex cache
+	 *
+	 * This implements Tipsify algorithm from Sander, Nehab and
+	 * Barczak, "Fast Triangle Reordering for Vertex Locality and
+	 * Reduced Overdraw", 2007. Winding of triangles is preserved.
+	 *
+	 * @param indices triangle list indices
+	 * @param nvertices number of vertices
+	 * @param cache_size target vertex cache size
+	 */
+	void OptimizeVertexCache(std::vector<unsigned int>& indices, size_t nvertices, int cache_size = 16);
+
+	/**
+	 * Builds map which numbers vertices in order of first use
+	 *
+	 * Vertices not referenced by any index are dropped.
+	 *
+	 * @return number of used vertices
+	 */
+	size_t BuildFetchMap(const std::vector<unsigned int>& indices, size_t nvertices, std::vector<unsigned int>& remap);
+
+	/**
+	 * Returns average number of vertex cache misses per triangle
+	 *
+	 * Simulates FIFO cache of given size; used to evaluate
+	 * OptimizeVertexCache().
+	 */
+	float GetACMR(const std::vector<unsigned int>& indices, size_t nvertices, int cache_size = 16);
+
+	/**
+	 * Applies vertex map to vertices and indices
+	 *
+	 * @param vertices vertex array, replaced with remapped one
+	 * @param indices index array, remapped in place
+	 * @param remap vertex map, remap[old] == new or NO_VERTEX
+	 * @param count number of vertices after remapping
+	 */
+	template <class T>
+	void RemapVertices(std::vector<T>& vertices, std::vector<unsigned int>& indices, const std::vector<unsigned int>& remap, size_t count) {
+		std::vector<unsigned int> source(count, NO_VERTEX);
+		for (size_t i = 0; i < remap.size(); ++i)
+			if (remap[i] != NO_VERTEX && source[remap[i]] == NO_VERTEX)
+				source[remap[i]] = i;
+
+		std::vector<T> remapped;
+		remapped.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+			remapped.push_back(vertices[source[i]]);
+		vertices.swap(remapped);
+
+		for (size_t i = 0; i < indices.size(); ++i)
+			indices[i] = remap[indices[i]];
+	}
+}
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MODELINSTANCES_HH
+#define MODELINSTANCES_HH
+
+#include <glosm/NonCopyable.hh>
+#include <glosm/Math.hh>
+#include <glosm/VertexArray.hh>
+#include <glosm/TileBatch.hh>
+
+#include <glosm/util/gl.h>
+
+#include <memory>
+#include <vector>
+
+template<class T>
+class VertexBuffer;
+class IndexBuffer;
+
+class TileShader;
+
+/**
+ * Renderable copies of shared models within a tile
+ *
+ * Each model used by the tile is stored once, in meters, and
+ * every instance of it only takes a matrix which places the
+ * model into tile coordinates. Instances of a model are drawn
+ * with a single instanced draw with TileBatch, and with a draw
+ * per instance otherwise.
+ *
+ * @see Model, Geometry::Instance
+ */
+class ModelInstances : private NonCopyable {
+protected:
+	struct Vertex {
+		Vector3f pos;
+		Vector3f norm;
+
+		Vertex(const Vector3f& p): pos(p) {
+		}
+	};
+
+	/**
+	 * Part of vertex and index buffers taken by a model
+	 */
+	struct Span {
+		size_t first_vertex;
+		size_t nvertices;
+		size_t first_index;
+		size_t nindices;
+
+		Span() : first_vertex(0), nvertices(0), first_index(0), nindices(0) {
+		}
+	};
+
+	/**
+	 * Model used by the tile
+	 */
+	struct ModelRange {
+		int model;
+		Span lines;
+		Span convex;
+
+		/* geometry in TileBatch */
+		TileBatch::Handle lines_handle;
+		TileBatch::Handle convex_handle;
+
+		ModelRange(int m) : model(m) {
+		}
+	};
+
+	/**
+	 * Instance of a model, refers to ModelRange
+	 */
+	struct Placement {
+		int range;
+		GLfloat matrix[16];
+	};
+
+	struct PlacementRangeLess {
+		bool operator()(const Placement& a, const Placement& b) const {
+			return a.range < b.range;
+		}
+	};
+
+	typedef std::vector<ModelRange> RangeVector;
+	typedef std::vector<Placement> PlacementVector;
+
+protected:
+	std::auto_ptr<VertexBuffer<Vector3f> > lines_vertices_;
+	std::auto_ptr<IndexBuffer> lines_indices_;
+
+	std::auto_ptr<VertexBuffer<Vertex> > convex_vertices_;
+	std::auto_ptr<IndexBuffer> convex_indices_;
+
+	RangeVector ranges_;
+	PlacementVector placements_;
+
+	/* attribute setup of the above for TileShader */
+	VertexArray lines_array_;
+	VertexArray convex_array_;
+
+	/* batch which replaces all the buffers */
+	TileBatch* batch_;
+
+protected:
+	void BuildModel(ModelRange& range);
+
+public:
+	/**
+	 * Constructs empty set of instances
+	 */
+	ModelInstances();
+
+	/**
+	 * Destructor
+	 */
+	~ModelInstances();
+
+	/**
+	 * Adds instance of a model
+	 *
+	 * @param model see Model::Id
+	 * @param matrix transform from model metric coordinates
+	 *        to tile coordinates
+	 */
+	void Add(int model, const GLfloat matrix[16]);
+
+	/**
+	 * Builds buffers of used models; called after all Add()s
+	 */
+	void Build();
+
+	/**
+	 * Renders instances with fixed function pipeline
+	 */
+	void Render();
+
+	/**
+	 * Renders instances with shader, relative to its modelview
+	 */
+	void Render(TileShader& shader);
+
+	/**
+	 * Queues instances for drawing with batch
+	 *
+	 * @param modelview modelview matrix of the tile
+	 */
+	void Render(TileBatch& batch, const GLfloat modelview[16]);
+
+	/**
+	 * Returns size of buffers in bytes
+	 */
+	size_t GetSize() const;
+
+	/**
+	 * Returns size of data not yet uploaded to GPU, in bytes
+	 */
+	size_t GetUploadSize() const;
+
+	/**
+	 * Uploads buffers to GPU
+	 */
+	void Upload();
+
+	/**
+	 * Moves buffers into batch
+	 */
+	void Upload(TileBatch& batch);
+};
+
+#endif
@@ -24,6 +24,7 @@
 #include <glosm/Math.hh>
 
 #include <vector>
+#include <cstddef>
 
 /**
  * Abstract base class for all projections.
@@ -44,13 +45,21 @@ class Projection {
 private:
 	typedef Vector3f(*ProjectFunction)(const Vector3i&, const Vector3i&);
 	typedef Vector3i(*UnProjectFunction)(const Vector3f&, const Vector3i&);
+	typedef void(*ProjectManyFunction)(const Vector3i*, size_t, const Vector3i&, Vector3f*);
 
 private:
 	ProjectFunction project_;
 	UnProjectFunction unproject_;
+	ProjectManyFunction project_many_;
 
 protected:
-	Projection(ProjectFunction pf, UnProjectFunction uf);
+	/**
+	 * Constructs projection from a set of implementation functions
+	 *
+	 * @param pmf batched projection function; if NULL, batches
+	 *            are projected point by point with pf
+	 */
+	Projection(ProjectFunction pf, UnProjectFunction uf, ProjectManyFunction pmf = NULL);
 
 public:
 	/**
@@ -75,6 +84,21 @@ public:
 	 */
 	Vector3i UnProject(const Vector3f& point, const Vector3i& ref) const;
 
+	/**
+	 * Translates array of points from global fixed-point to
+	 * relative floating-point coordinate system.
+	 *
+	 * This is much faster than calling Project() for each point,
+	 * as ref-dependent terms are only calculated once per batch.
+	 *
+	 * @param in input array of points
+	 * @param n number of points
+	 * @param ref reference point which denotes the center of
+	 *            local coordinate system
+	 * @param out output array of at least n points
+	 */
+	void ProjectMany(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out) const;
+
 	/**
 	 * Translates bunch of points from relative floating-point
 	 * to global fixed-point coordinate system.
@@ -86,6 +110,39 @@ public:
 	 *            local coordinate system
 	 */
 	void ProjectPoints(const std::vector<Vector3i>& in, const Vector3i& ref, std::vector<Vector3f>& out) const;
+
+	/**
+	 * Checks whether this is a given concrete projection
+	 *
+	 * As projections are passed by value, this is the way to
+	 * select code specialized for concrete projection type,
+	 * which uses its inlineable Projector instead of runtime
+	 * dispatch.
+	 */
+	template <class P>
+	bool Is() const {
+		return project_ == &P::ProjectImpl;
+	}
+
+	/**
+	 * Projector bound to a reference point, with runtime dispatch
+	 *
+	 * Has the same interface as concrete projection Projectors,
+	 * so it's used as a fallback in specialized code.
+	 */
+	class Projector {
+	protected:
+		const Projection& projection_;
+		Vector3i ref_;
+
+	public:
+		Projector(const Projection& projection, const Vector3i& ref): projection_(projection), ref_(ref) {
+		}
+
+		Vector3f operator()(const Vector3i& point) const {
+			return projection_.Project(point, ref_);
+		}
+	};
 };
 
 #endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUALITYCONTROLLER_HH
+#define QUALITYCONTROLLER_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <vector>
+#include <cstddef>
+
+class TileManager;
+
+/**
+ * Adjusts layer settings to hold target frame rate
+ *
+ * Single quality value from 0 to 1 is mapped to range, level of
+ * detail factor and size limit of each attached layer, between
+ * bounds given for each of them; 0.5 is the middle of bounds.
+ * Quality is lowered when frame time exceeds the target, and
+ * slowly raised when frames are done well within it and loaders
+ * keep up with tile requests; when tiles are requested faster
+ * than they are loaded, quality is lowered as well, as larger
+ * ranges only make backlog grow.
+ *
+ * Frame times are averaged over adjustment interval, so single
+ * slow frames (e.g. when tiles are uploaded) are not reacted to.
+ */
+class QualityController : private NonCopyable {
+public:
+	/**
+	 * Bounds of settings of a single layer
+	 *
+	 * Equal min and max keep a setting constant.
+	 */
+	struct LayerBounds {
+		float min_range;
+		float max_range;
+
+		float min_lod_factor;
+		float max_lod_factor;
+
+		size_t min_size_limit;
+		size_t max_size_limit;
+
+		LayerBounds(float minrange, float maxrange, float minlod, float maxlod, size_t minsize, size_t maxsize);
+	};
+
+protected:
+	struct Layer {
+		TileManager* manager;
+		LayerBounds bounds;
+
+		Layer(TileManager* m, const LayerBounds& b) : manager(m), bounds(b) {
+		}
+	};
+
+	typedef std::vector<Layer> LayerVector;
+
+protected:
+	LayerVector layers_;
+
+	float target_frame_time_;
+	float interval_;
+	size_t max_backlog_;
+
+	float quality_;
+
+	/* accumulated over current interval */
+	float elapsed_;
+	unsigned int frames_;
+
+	/* backlog at the end of previous interval */
+	size_t last_backlog_;
+
+protected:
+	/**
+	 * Applies current quality to all layers
+	 */
+	void Apply();
+
+	/**
+	 * Returns number of tiles queued and loading in all layers
+	 */
+	size_t GetBacklog() const;
+
+public:
+	/**
+	 * Constructs controller
+	 *
+	 * @param target_fps frame rate to hold
+	 */
+	QualityController(float target_fps);
+
+	/**
+	 * Attaches layer to control
+	 *
+	 * Layer settings are changed immediately according to
+	 * current quality. Layer is not owned and must outlive the
+	 * controller or be used no longer by it.
+	 */
+	void AddLayer(TileManager* manager, const LayerBounds& bounds);
+
+	/**
+	 * Accounts a rendered frame, adjusting quality when
+	 * adjustment interval passes
+	 *
+	 * @param frame_time seconds the frame took
+	 */
+	void Update(float frame_time);
+
+	/**
+	 * Sets quality and applies it to layers
+	 *
+	 * @param quality value from 0 (all at min bounds) to 1
+	 *        (all at max bounds); clamped to that range
+	 */
+	void SetQuality(float quality);
+
+	/**
+	 * Returns current quality
+	 */
+	float GetQuality() const;
+
+	/**
+	 * Sets how often quality is adjusted
+	 *
+	 * @param interval interval in seconds; default is 1 second
+	 */
+	void SetInterval(float interval);
+
+	/**
+	 * Sets number of queued and loading tiles of all layers
+	 * over which quality is not raised
+	 *
+	 * @param tiles number of tiles; default is 64
+	 */
+	void SetMaxBacklog(size_t tiles);
+};
+
+#endif
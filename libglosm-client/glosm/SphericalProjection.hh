@@ -22,6 +22,9 @@
 #define SPHERICALPROJECTION_HH
 
 #include <glosm/Projection.hh>
+#include <glosm/geomath.h>
+
+#include <cmath>
 
 /**
  * Spherical projection
@@ -29,12 +32,87 @@
  * This represents Spherical projection.
  */
 class SphericalProjection : public Projection {
+	friend class Projection;
+
+public:
+	/**
+	 * Inlineable projector bound to a reference point
+	 *
+	 * This is used for code specialized for this projection at
+	 * compile time, see Projection::Is(). Per-axis trigonometry
+	 * is cached, as consecutive points often share longitude
+	 * or latitude.
+	 */
+	class Projector {
+	protected:
+		Vector3i ref_;
+		double ref_height_;
+		double sinay_, cosay_;
+
+		bool cached_;
+		osmint_t last_x_, last_y_;
+		double sinx_, cosx_, siny_, cosy_;
+
+	public:
+		Projector(const Vector3i& ref);
+
+		Vector3f operator()(const Vector3i& point);
+	};
+
 protected:
 	static Vector3f ProjectImpl(const Vector3i& point, const Vector3i& ref);
 	static Vector3i UnProjectImpl(const Vector3f& point, const Vector3i& ref);
+	static void ProjectManyImpl(const Vector3i* in, size_t n, const Vector3i& ref, Vector3f* out);
 
 public:
 	SphericalProjection();
 };
 
+inline SphericalProjection::Projector::Projector(const Vector3i& ref): ref_(ref), ref_height_((double)ref.z / GEOM_UNITSINMETER), cached_(false), last_x_(0), last_y_(0), sinx_(0.0), cosx_(0.0), siny_(0.0), cosy_(0.0) {
+	double ref_angle_y = (double)ref.y * GEOM_DEG_TO_RAD;
+#ifdef HAVE_SINCOS
+	sincos(ref_angle_y, &sinay_, &cosay_);
+#else
+	sinay_ = sin(ref_angle_y);
+	cosay_ = cos(ref_angle_y);
+#endif
+}
+
+inline Vector3f SphericalProjection::Projector::operator()(const Vector3i& point) {
+	if (!cached_ || point.x != last_x_) {
+		double point_angle_x = ((double)point.x - (double)ref_.x) * GEOM_DEG_TO_RAD;
+#ifdef HAVE_SINCOS
+		sincos(point_angle_x, &sinx_, &cosx_);
+#else
+		sinx_ = sin(point_angle_x);
+		cosx_ = cos(point_angle_x);
+#endif
+		last_x_ = point.x;
+	}
+
+	if (!cached_ || point.y != last_y_) {
+		double point_angle_y = (double)point.y * GEOM_DEG_TO_RAD;
+#ifdef HAVE_SINCOS
+		sincos(point_angle_y, &siny_, &cosy_);
+#else
+		siny_ = sin(point_angle_y);
+		cosy_ = cos(point_angle_y);
+#endif
+		last_y_ = point.y;
+	}
+
+	cached_ = true;
+
+	double radius = WGS84_EARTH_EQ_RADIUS + (double)point.z / GEOM_UNITSINMETER;
+	double vx = radius * sinx_ * cosy_;
+	double vy = radius * siny_;
+	double vz = radius * cosx_ * cosy_;
+
+	return Vector3f(
+		vx,
+		vy * cosay_ - vz * sinay_,
+		vy * sinay_ + vz * cosay_ - WGS84_EARTH_EQ_RADIUS - ref_height_
+	);
+}
+
 #endif
@@ -36,6 +36,7 @@ class TerrainLayer : public Layer, public TileManager, private NonCopyable {
 protected:
 	const Projection projection_;
 	HeightmapDatasource& datasource_;
+	volatile int tile_flags_;
 
 public:
 	TerrainLayer(const Projection projection, HeightmapDatasource& datasource);
@@ -43,6 +44,16 @@ public:
 
 	void Render(const Viewer& viewer);
 	virtual Tile* SpawnTile(const BBoxi& bbox, int flags) const;
+
+	/**
+	 * Sets flags for constructing tiles
+	 *
+	 * TerrainTile::HEIGHT_TEXTURE is only supported with mercator
+	 * projection, and requires TileShader::TERRAIN shader.
+	 *
+	 * @param flags combination of TerrainTile::Flags
+	 */
+	void SetTileFlags(int flags);
 };
 
 #endif
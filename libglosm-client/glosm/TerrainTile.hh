@@ -24,6 +24,9 @@
 #include <glosm/Tile.hh>
 #include <glosm/NonCopyable.hh>
 #include <glosm/BBox.hh>
+#include <glosm/VertexQuantizer.hh>
+#include <glosm/VertexArray.hh>
+#include <glosm/TileBatch.hh>
 
 #include <glosm/util/gl.h>
 
@@ -37,6 +40,7 @@ class Projection;
 
 template<class T>
 class VertexBuffer;
+class IndexBuffer;
 
 /**
  * A terrain tile
@@ -44,20 +48,90 @@ class VertexBuffer;
  * This tile type is used by TerrainLayer
  */
 class TerrainTile : public Tile, private NonCopyable {
+public:
+	enum Flags {
+		/* store vertices in compact 16 bit format, see
+		 * VertexQuantizer */
+		QUANTIZE_VERTICES = 0x01,
+
+		/* store only heights as a texture, to be displaced
+		 * over shared flat grid by TileShader::TERRAIN
+		 * variant, which is the only way to render such
+		 * tiles; Mercator projection only */
+		HEIGHT_TEXTURE = 0x02,
+	};
+
+protected:
+	/**
+	 * Maximal number of grid vertices along tile side; tiles
+	 * larger than that use sparser grid
+	 */
+	static const int MAX_GRID_SIZE = 128;
+
 protected:
 	struct TerrainVertex {
 		Vector3f pos;
 		Vector3f norm;
 	};
 
+	/* quantized format; padded for alignment */
+	struct PackedTerrainVertex {
+		GLshort pos[4];
+		GLbyte norm[4];
+	};
+
 protected:
 	std::auto_ptr<VertexBuffer<TerrainVertex> > vbo_;
-	std::auto_ptr<VertexBuffer<GLushort> > ibo_;
+	std::auto_ptr<VertexBuffer<PackedTerrainVertex> > packed_vbo_;
+	/* shared between all tiles with the same grid size; with
+	 * TileBatch, indices are only copied from its RAM data */
+	IndexBuffer* ibo_;
+	int width_;
+	int height_;
+
+	/* HEIGHT_TEXTURE data: shared flat grid, heights in meters
+	 * plus 32768 (including margin), projected x of each grid
+	 * column and projected y and height scale of each row, grid
+	 * coordinates of tile bounds and skirt depth */
+	VertexBuffer<Vector3f>* grid_vbo_;
+	std::vector<GLushort> heights_;
+	GLuint heights_texture_;
+	std::vector<GLfloat> lines_;
+	GLfloat bounds_[4];
+	GLfloat skirt_depth_;
+	VertexQuantizer quantizer_;
+	bool quantized_;
+
+	/* attribute setup of the above for TileShader */
+	VertexArray array_;
+
+	/* geometry in TileBatch, which replaces all the buffers */
+	TileBatch* batch_;
+	TileBatch::Handle handle_;
 
 	size_t size_;
 
+protected:
+	/**
+	 * Converts vertices into quantized format
+	 */
+	void Quantize();
+
+	/**
+	 * Creates texture from heights
+	 */
+	void UploadHeights();
+
 public:
-	TerrainTile(const Projection& projection, HeightmapDatasource& datasource, const Vector2i& ref, const BBoxi& bbox);
+	/**
+	 * Constructs tile for a given bbox
+	 *
+	 * Heightmap grid is sampled sparser for larger tiles, so
+	 * coarse tile levels may be used for distant terrain, and
+	 * edges are covered with skirts to hide cracks between
+	 * tiles of different levels.
+	 */
+	TerrainTile(const Projection& projection, HeightmapDatasource& datasource, const Vector2i& ref, const BBoxi& bbox, int flags = 0);
 
 	/**
 	 * Destructor
@@ -69,10 +143,35 @@ public:
 	 */
 	virtual void Render();
 
+	/**
+	 * Render this tile with shader
+	 */
+	virtual void Render(TileShader& shader);
+
+	/**
+	 * Queue this tile for drawing with batch
+	 */
+	virtual void Render(TileBatch& batch, const float modelview[16]);
+
 	/**
 	 * Returns tile size in bytes
 	 */
 	virtual size_t GetSize() const;
+
+	/**
+	 * Returns size of data not yet uploaded to GPU, in bytes
+	 */
+	virtual size_t GetUploadSize() const;
+
+	/**
+	 * Uploads tile data to GPU
+	 */
+	virtual void Upload();
+
+	/**
+	 * Moves tile data into batch
+	 */
+	virtual void Upload(TileBatch& batch);
 };
 
 #endif
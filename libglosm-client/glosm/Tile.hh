@@ -25,6 +25,11 @@
 
 #include <sys/types.h> /* for size_t */
 
+#include <limits>
+
+class TileShader;
+class TileBatch;
+
 /**
  * Abstract class for all geodata tiles.
  *
@@ -41,11 +46,18 @@ protected:
 	 */
 	const Vector2i reference_;
 
+	/**
+	 * Range of heights of tile data, in geometry units; should
+	 * be set by subclasses, otherwise any height is assumed.
+	 */
+	osmint_t min_height_;
+	osmint_t max_height_;
+
 public:
 	/**
 	 * Constructs tile
 	 */
-	Tile(const Vector2i& ref) : reference_(ref) {}
+	Tile(const Vector2i& ref) : reference_(ref), min_height_(std::numeric_limits<osmint_t>::min()), max_height_(std::numeric_limits<osmint_t>::max()) {}
 
 	/**
 	 * Destructor
@@ -57,17 +69,75 @@ public:
 	 */
 	virtual void Render() = 0;
 
+	/**
+	 * Renders tile with shader
+	 *
+	 * Shader and GL state are set up by the layer, and
+	 * modelview matrix by TileManager, so tile only sets
+	 * per-draw uniforms, binds its vertex arrays and draws.
+	 */
+	virtual void Render(TileShader& shader) = 0;
+
+	/**
+	 * Queues tile for drawing with batch
+	 *
+	 * Tile geometry is moved into shared buffers of the batch
+	 * on first call if it wasn't uploaded there yet, after
+	 * which other Render() variants draw nothing.
+	 *
+	 * @param modelview modelview matrix of the tile
+	 */
+	virtual void Render(TileBatch& batch, const float modelview[16]) = 0;
+
 	/**
 	 * Returns tile size in bytes
 	 */
 	virtual size_t GetSize() const = 0;
 
+	/**
+	 * Returns size of data not yet uploaded to GPU, in bytes
+	 */
+	virtual size_t GetUploadSize() const {
+		return 0;
+	}
+
+	/**
+	 * Uploads tile data to GPU
+	 *
+	 * Must be called from the thread which owns GL context.
+	 * If not called, data is uploaded on first Render().
+	 */
+	virtual void Upload() {
+	}
+
+	/**
+	 * Moves tile data into shared buffers of a batch
+	 *
+	 * Must be called from the thread which owns GL context.
+	 * Tile must not outlive the batch.
+	 */
+	virtual void Upload(TileBatch& batch) = 0;
+
 	/**
 	 * Returns tile reference point
 	 */
 	const Vector2i& GetReference() const {
 		return reference_;
 	}
+
+	/**
+	 * Returns minimal height of tile data
+	 */
+	osmint_t GetMinHeight() const {
+		return min_height_;
+	}
+
+	/**
+	 * Returns maximal height of tile data
+	 */
+	osmint_t GetMaxHeight() const {
+		return max_height_;
+	}
 };
 
 #endif
@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEBATCH_HH
+#define TILEBATCH_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <glosm/util/gl.h>
+
+#include <sys/types.h>
+
+#include <map>
+#include <vector>
+
+class TileShader;
+class VertexQuantizer;
+
+/**
+ * Shared storage and multi-draw rendering of tile geometry
+ *
+ * Instead of each tile having its own buffers and draw calls,
+ * tiles of a layer put their vertices and indices into a few
+ * large buffers shared by all geometry of the same format and
+ * primitive type (a group). Each frame, visible tiles queue
+ * their ranges with their transforms, and each group is drawn
+ * with a single indirect multi-draw call. Transforms are passed
+ * as per-instance attributes selected by base instance of each
+ * draw, so this needs TileShader with BATCHED flag.
+ *
+ * Must only be used in the thread which owns GL context.
+ */
+class TileBatch : private NonCopyable {
+public:
+	/**
+	 * Vertex layouts; these match tile vertex structures
+	 */
+	enum VertexFormat {
+		/* 3 floats */
+		POSITION_FLOAT,
+		/* 4 shorts, last is padding */
+		POSITION_SHORT,
+		/* 3 floats of position, 3 floats of normal */
+		POSITION_NORMAL_FLOAT,
+		/* 4 shorts of position, 4 bytes of normal */
+		POSITION_NORMAL_SHORT,
+	};
+
+	/**
+	 * Location of tile geometry in shared buffers
+	 */
+	struct Handle {
+		int group;
+		size_t first_vertex;
+		size_t nvertices;
+		size_t first_index;
+		size_t nindices;
+
+		Handle() : group(-1), first_vertex(0), nvertices(0), first_index(0), nindices(0) {
+		}
+
+		bool IsValid() const {
+			return group >= 0;
+		}
+	};
+
+protected:
+	/**
+	 * Growable GL buffer with first-fit suballocation
+	 */
+	class BufferArena {
+	protected:
+		typedef std::map<size_t, size_t> FreeMap;
+
+	protected:
+		GLuint buffer_;
+		size_t item_size_;
+		size_t capacity_;
+
+		/* free ranges, offset to size, in items */
+		FreeMap free_;
+
+	public:
+		BufferArena(size_t item_size);
+		~BufferArena();
+
+		/**
+		 * Allocates and fills a range of items
+		 *
+		 * @return true if buffer was reallocated, so its users
+		 *         need to rebind it
+		 */
+		bool Add(const void* data, size_t count, size_t& offset);
+
+		/**
+		 * Frees range of items
+		 */
+		void Remove(size_t offset, size_t count);
+
+		GLuint GetBuffer() const {
+			return buffer_;
+		}
+
+		size_t GetFootprint() const {
+			return capacity_ * item_size_;
+		}
+
+	protected:
+		void Grow(size_t min_capacity);
+		void Free(size_t offset, size_t count);
+	};
+
+	/**
+	 * Draw command for glMultiDrawElementsIndirect
+	 */
+	struct DrawCommand {
+		GLuint count;
+		GLuint instance_count;
+		GLuint first_index;
+		GLint base_vertex;
+		GLuint base_instance;
+	};
+
+	/**
+	 * Per-draw data, see TileShader::BATCHED
+	 */
+	struct Instance {
+		GLfloat modelview[16];
+		GLfloat dequantize[4];
+	};
+
+	/**
+	 * Geometry of single format and style sharing buffers
+	 */
+	struct Group {
+		VertexFormat format;
+		GLenum mode;
+		GLenum index_type;
+		bool lighting;
+		GLfloat color[4];
+
+		BufferArena* vertices;
+		BufferArena* indices;
+
+		/* vertex array is rebuilt when arenas are reallocated */
+		GLuint array;
+		bool array_valid;
+
+		/* commands queued for current frame */
+		std::vector<DrawCommand> commands;
+	};
+
+	typedef std::vector<Group> GroupVector;
+	typedef std::vector<Instance> InstanceVector;
+	typedef std::vector<DrawCommand> DrawCommandVector;
+
+protected:
+	GroupVector groups_;
+	InstanceVector instances_;
+	DrawCommandVector commands_;
+
+	GLuint instance_buffer_;
+	GLuint command_buffer_;
+
+protected:
+	void SetupArray(Group& group);
+
+public:
+	/**
+	 * Constructs empty batch
+	 *
+	 * Throws GLUnsupportedException if multi-draw is not supported
+	 */
+	TileBatch();
+
+	/**
+	 * Destructor; all geometry should be removed before this
+	 */
+	~TileBatch();
+
+	/**
+	 * Checks whether current GL context supports batching
+	 */
+	static bool IsSupported();
+
+	/**
+	 * Returns group for given geometry format and style
+	 *
+	 * Groups are drawn in order of creation.
+	 *
+	 * @param format vertex format
+	 * @param mode primitive type
+	 * @param index_type GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	 * @param lighting whether geometry is lit; it must then have normals
+	 * @param color color of geometry which is not lit
+	 */
+	int GetGroup(VertexFormat format, GLenum mode, GLenum index_type, bool lighting, const GLfloat color[4]);
+
+	/**
+	 * Copies geometry into shared buffers of a group
+	 *
+	 * Indices are relative to given vertices.
+	 */
+	Handle Add(int group, const void* vertices, size_t nvertices, const void* indices, size_t nindices);
+
+	/**
+	 * Frees geometry added with Add()
+	 */
+	void Remove(Handle& handle);
+
+	/**
+	 * Adds per-draw data for current frame
+	 *
+	 * @param modelview modelview matrix
+	 * @param quantizer dequantization of vertices, or NULL
+	 * @return index of instance for Draw()
+	 */
+	int AddInstance(const GLfloat modelview[16], const VertexQuantizer* quantizer);
+
+	/**
+	 * Queues geometry for drawing in current frame
+	 *
+	 * @param handle geometry to draw
+	 * @param instance index of first instance
+	 * @param ninstances number of consecutive instances to
+	 *        draw geometry with
+	 */
+	void Draw(const Handle& handle, int instance, int ninstances = 1);
+
+	/**
+	 * Draws all queued geometry, clearing the queue
+	 *
+	 * @param shader shader with BATCHED flag, which is in use
+	 */
+	void Flush(TileShader& shader);
+
+	/**
+	 * Returns size of shared buffers in bytes
+	 */
+	size_t GetFootprint() const;
+};
+
+#endif
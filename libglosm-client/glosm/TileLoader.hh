@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILELOADER_HH
+#define TILELOADER_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+#include <vector>
+
+class TileManager;
+
+/**
+ * Pool of threads loading tiles for several layers
+ *
+ * By default each layer has its own loading thread, so layers
+ * compete for CPU and a layer with more threads always wins.
+ * Layers attached to a loader with TileManager::SetLoader()
+ * instead share its threads, and each free thread takes the
+ * most important queued tile of all layers, so tiles near the
+ * viewer are built first regardless of which layer needs them.
+ *
+ * Loader must outlive all layers attached to it.
+ */
+class TileLoader : private NonCopyable {
+protected:
+	struct Client {
+		TileManager* manager;
+		/* number of threads loading tiles of this manager */
+		int running;
+		bool detaching;
+
+		Client(TileManager* m) : manager(m), running(0), detaching(false) {
+		}
+	};
+
+	typedef std::vector<Client> ClientVector;
+	typedef std::vector<pthread_t> ThreadVector;
+
+protected:
+	pthread_mutex_t mutex_;
+	/* signalled when tasks may have been queued */
+	pthread_cond_t cond_;
+	/* signalled when a thread finishes a tile */
+	pthread_cond_t idle_cond_;
+
+	/* protected by mutex_ */
+	ClientVector clients_;
+	bool die_flag_;
+
+	ThreadVector threads_;
+
+protected:
+	/**
+	 * Thread function
+	 */
+	void LoadingThreadFunc();
+
+	/**
+	 * Static wrapper for thread function
+	 */
+	static void* LoadingThreadFuncWrapper(void* arg);
+
+	/**
+	 * Returns client of given manager, or NULL
+	 */
+	Client* FindClient(TileManager* manager);
+
+public:
+	/**
+	 * Constructs loader and starts its threads
+	 *
+	 * @param nthreads number of threads; 0 means number of CPUs
+	 */
+	TileLoader(int nthreads = 0);
+
+	/**
+	 * Destructor; stops threads, letting them finish current tiles
+	 */
+	virtual ~TileLoader();
+
+	/**
+	 * Starts loading tiles of given manager
+	 */
+	void Attach(TileManager* manager);
+
+	/**
+	 * Stops loading tiles of given manager
+	 *
+	 * Waits until threads finish tiles of this manager which
+	 * are being loaded.
+	 */
+	void Detach(TileManager* manager);
+
+	/**
+	 * Wakes up idle threads after tiles were queued
+	 */
+	void Wakeup();
+};
+
+#endif
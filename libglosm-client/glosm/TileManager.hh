@@ -22,18 +22,26 @@
 #define TILEMANAGER_HH
 
 #include <glosm/BBox.hh>
+#include <glosm/ImpostorCache.hh>
 #include <glosm/Projection.hh>
 
 #include <pthread.h>
 
-#include <list>
+#include <exception>
+#include <limits>
 #include <map>
+#include <memory>
 #include <set>
+#include <vector>
 
 class Geometry;
 class GeometryDatasource;
 class Viewer;
 class Tile;
+class TileShader;
+class TileBatch;
+class TileLoader;
+class FrameScheduler;
 
 /**
  * Generic quadtree tile manager
@@ -41,16 +49,155 @@ class Tile;
  * This class is serves as a base class for layers and manages tile
  * loading, displaying and disposal.
  *
- * @todo this class is planned to handle multilayer tile hierarchies,
- * however for now level is fixed
+ * Tiles are either loaded at a single fixed level, or, if a range
+ * of levels is set with SetLevelRange(), level is chosen for each
+ * quadtree node by its distance to the viewer, so farther areas
+ * are covered with coarser tiles. Coarse tiles are rendered until
+ * all finer tiles which replace them are loaded.
+ *
+ * Tiles are kept in LRU order; when their cumulative size grows
+ * over the limit, GarbageCollect() incrementally drops unneeded
+ * tiles which are cheapest to lose, until size falls below a low
+ * watermark.
+ *
+ * Tiles are built by loading threads, but their GPU upload is
+ * spread over frames within a byte budget, see SetUploadBudget().
+ *
+ * When source data changes, tiles of changed area are marked
+ * outdated with InvalidateArea(); these are still rendered until
+ * reloaded ones replace them.
+ *
+ * With SetOcclusionCulling(), tiles hidden behind geometry drawn
+ * before are skipped, based on occlusion queries of their bounding
+ * boxes issued in previous frames.
+ *
+ * With SetImpostors(), distant tiles are rendered once into small
+ * textures which are then drawn instead of their geometry, until
+ * viewer looks at them from a noticeably different direction.
+ *
+ * Several viewports may share a layer: tiles for all of them
+ * are loaded by a single pass, see LoadLocality(const
+ * ViewerVector&), and each viewport is then rendered on its own.
  */
 class TileManager {
+	friend class TileLoader;
+
 public:
 	enum RequestFlags {
 		SYNC = 0x01,
 		BLOB = 0x02,
 	};
 
+	typedef std::vector<const Viewer*> ViewerVector;
+
+	/* number of buckets in Statistics::spawn_times */
+	static const int NUM_SPAWN_TIME_BUCKETS = 12;
+
+	/* number of buckets in Statistics::popin_times */
+	static const int NUM_POPIN_TIME_BUCKETS = 16;
+
+	/**
+	 * Runtime statistics of a layer, see GetStatistics()
+	 *
+	 * Counters are cumulative since construction, so rates
+	 * are obtained by comparing two snapshots.
+	 */
+	struct Statistics {
+		/* current state */
+		size_t queued;
+		size_t loading;
+		size_t tiles;
+		size_t bytes;
+		size_t speculative_bytes;
+		size_t size_limit;
+
+		/* split of memory used by tiles: bytes of placed tiles
+		 * uploaded to GPU, and bytes in system memory, which
+		 * include loaded tiles waiting for upload */
+		size_t gpu_bytes;
+		size_t ram_bytes;
+		size_t gpu_size_limit;
+
+		/* tiles dropped from quadtree, waiting for destruction */
+		size_t reclaiming;
+
+		/* asynchronous tile requests waiting for data, part
+		 * of loading */
+		size_t requests;
+
+		/* tiles placed into quadtree, tiles which were no longer
+		 * needed when loaded, and tiles garbage collected */
+		unsigned int loaded;
+		unsigned int dropped;
+		unsigned int evicted;
+
+		/* asynchronous requests dropped as no longer needed
+		 * before completion */
+		unsigned int cancelled;
+
+		/* tile loads which failed with an error; such tiles
+		 * are requested again after a delay */
+		unsigned int failed;
+
+		/* number of quadtree traversals by asynchronous loads */
+		unsigned int load_passes;
+
+		/* seconds spent spawning placed tiles and collecting */
+		double spawn_time;
+		double gc_time;
+
+		/* i-th bucket counts placed tiles which took under 2^i
+		 * milliseconds to spawn, last one counts the rest */
+		unsigned int spawn_times[NUM_SPAWN_TIME_BUCKETS];
+
+		/* tiles drawn after being needed and not yet loaded, with
+		 * total and maximal seconds from request to first draw;
+		 * prefetched tiles loaded before needed are not counted */
+		unsigned int popins;
+		double popin_time;
+		float popin_max;
+
+		/* i-th bucket counts pop-ins which took under 2^i
+		 * milliseconds, last one counts the rest */
+		unsigned int popin_times[NUM_POPIN_TIME_BUCKETS];
+
+		/* impostors currently held with their texture bytes,
+		 * and number of times impostors were rendered */
+		size_t impostors;
+		size_t impostor_bytes;
+		unsigned int impostor_updates;
+
+		/* seconds of main thread maintenance accounted to frame
+		 * scheduler, frames in which it exceeded layer's share,
+		 * and load passes postponed to following frames */
+		double maintenance_time;
+		unsigned int maintenance_overruns;
+		unsigned int deferred_passes;
+
+		Statistics();
+	};
+
+	/**
+	 * Tile prepared asynchronously, see RequestTile()
+	 */
+	class TileRequest {
+	public:
+		/**
+		 * Destructor; cancels request if it wasn't finished
+		 */
+		virtual ~TileRequest() {}
+
+		/**
+		 * Checks whether Finish() won't block waiting for data
+		 */
+		virtual bool IsReady() const = 0;
+
+		/**
+		 * Builds tile from received data
+		 */
+		virtual Tile* Finish() = 0;
+	};
+
 protected:
 	/**
 	 * Tile identifier
@@ -70,6 +217,14 @@ protected:
 		inline bool operator!=(const TileId& other) const {
 			return x != other.x || y != other.y || level != other.level;
 		}
+
+		inline bool operator<(const TileId& other) const {
+			if (level != other.level)
+				return level < other.level;
+			if (x != other.x)
+				return x < other.x;
+			return y < other.y;
+		}
 	};
 
 	/**
@@ -78,11 +233,63 @@ protected:
 	struct QuadNode {
 		Tile* tile;
 		int generation;
+
+		/* generation in which tile was needed at this node */
+		int leaf_generation;
+
+		/* generation in which finer tiles were needed in place
+		 * of this node by some view; see LoadLeafTile() */
+		int refine_generation;
 		BBoxi bbox;
 
+		/* seconds it took to spawn the tile */
+		float cost;
+
+		/* when tile was needed, until it's first drawn; negative
+		 * if not tracked, see Statistics::popins */
+		double requested;
+
+		/* data version tile was spawned from, and minimal
+		 * version current tile for this node needs */
+		int tile_version;
+		int valid_version;
+
+		/* range of heights of tiles ever attached in the subtree,
+		 * for frustum culling; only grows, empty if min > max */
+		osmint_t min_height;
+		osmint_t max_height;
+
+		/* model matrix of tile relative to render origin, valid
+		 * if transform_origin matches render_origin_version_ */
+		float transform[16];
+		int transform_origin;
+
+		/* occlusion query of tile bounding box (GLuint, 0 if
+		 * not created yet), frame it was issued in, and whether
+		 * tile was occluded by the last known result */
+		unsigned int occlusion_query;
+		int query_frame;
+		bool query_pending;
+		bool occluded;
+
+		/* see SetImpostors(); NULL if tile has no impostor */
+		ImpostorCache::Impostor* impostor;
+
+		/* tile was prefetched and wasn't needed yet */
+		bool speculative;
+
+		/* part of tile size accounted as system memory in
+		 * ram_size_, rest of it is on GPU */
+		size_t ram_size;
+
+		QuadNode* parent;
 		QuadNode* childs[4];
 
-		QuadNode() : tile(NULL), generation(0), bbox(BBoxi::ForGeoTile(0, 0, 0)) {
+		/* LRU list of nodes with tiles, see TouchTile() */
+		QuadNode* lru_prev;
+		QuadNode* lru_next;
+
+		QuadNode(QuadNode* p = NULL) : tile(NULL), generation(0), leaf_generation(-1), refine_generation(-1), bbox(BBoxi::ForGeoTile(0, 0, 0)), cost(0.0f), requested(-1.0), tile_version(0), valid_version(0), min_height(std::numeric_limits<osmint_t>::max()), max_height(std::numeric_limits<osmint_t>::min()), transform_origin(-1), occlusion_query(0), query_frame(0), query_pending(false), occluded(false), impostor(NULL), speculative(false), ram_size(0), parent(p), lru_prev(NULL), lru_next(NULL) {
 			childs[0] = childs[1] = childs[2] = childs[3] = NULL;
 		}
 	};
@@ -91,10 +298,95 @@ protected:
 	 * Single tile loading request
 	 */
 	struct TileTask {
-		TileId id;
 		BBoxi bbox;
 
-		TileTask(const TileId& i, const BBoxi& b) : id(i), bbox(b) {
+		/* lower is loaded earlier */
+		float priority;
+
+		/* load pass which last requested this tile */
+		int pass;
+
+		/* flags for SpawnTile() */
+		int flags;
+
+		/* requested by prefetch only */
+		bool speculative;
+
+		/* when tile was first needed, negative if it wasn't yet */
+		double requested;
+
+		TileTask(const BBoxi& b, float pri, int p, int f, bool s, double r) : bbox(b), priority(pri), pass(p), flags(f), speculative(s), requested(r) {
+		}
+	};
+
+	/**
+	 * Tile loaded by a loading thread, waiting to be placed
+	 * into quadtree by the main thread
+	 */
+	struct FinishedTile {
+		TileId id;
+		Tile* tile;
+		float cost;
+		int version;
+		bool speculative;
+		double requested;
+		FinishedTile* next;
+
+		FinishedTile(const TileId& i, Tile* t, float c, int v, bool s, double r) : id(i), tile(t), cost(c), version(v), speculative(s), requested(r), next(NULL) {
+		}
+	};
+
+	/**
+	 * Asynchronous tile request waiting for data
+	 */
+	struct InflightTile {
+		TileRequest* request;
+		float priority;
+		int version;
+
+		/* load pass which last requested this tile */
+		int pass;
+
+		bool speculative;
+		double requested;
+
+		InflightTile(TileRequest* r, float pri, int v, int p, bool s, double req) : request(r), priority(pri), version(v), pass(p), speculative(s), requested(req) {
+		}
+	};
+
+	/**
+	 * View frustum of current frame, in coordinates tiles are
+	 * rendered in
+	 */
+	struct ViewFrustum {
+		/* left, right, bottom, top, near, far; point is inside
+		 * if a*x + b*y + c*z + d >= 0 for all planes */
+		float planes[6][4];
+
+		Vector3i viewer_pos;
+
+		/* offset of viewer's ground point, see RenderTile() */
+		Vector3f ground_offset;
+	};
+
+	/**
+	 * Axis-aligned box around node contents, in the same
+	 * coordinates as ViewFrustum
+	 */
+	struct NodeBox {
+		Vector3f min;
+		Vector3f max;
+	};
+
+	/**
+	 * Tile rendered in current frame, to be tested for
+	 * occlusion after all tiles are drawn
+	 */
+	struct OcclusionCandidate {
+		QuadNode* node;
+		NodeBox box;
+
+		OcclusionCandidate(QuadNode* n, const NodeBox& b) : node(n), box(b) {
 		}
 	};
 
@@ -115,46 +407,218 @@ protected:
 		int mode;
 		int flags;
 		Vector3i viewer_pos;
-		float closest_distance;
-		int queue_size;
 
-		RecLoadTilesInfo() : queue_size(0) {
+		/* viewer position for choosing level; always includes height */
+		Vector3i lod_pos;
+
+		/* horizontal look direction and half of view angle */
+		bool has_view;
+		Vector2f view_dir;
+		float view_halfangle;
+
+		/* horizontal movement direction since previous pass */
+		bool has_movement;
+		Vector2f movement_dir;
+
+		/* tiles around extrapolated viewer position are loaded,
+		 * and nodes are not marked as needed */
+		bool prefetch;
+
+		/* range check factors for viewer_pos, see InitRangeCheck();
+		 * squared distances are in latitude units, with longitude
+		 * offsets scaled by cosine of latitude in fixed point */
+		float coslat;
+		osmlong_t lon_scale;
+		uint64_t height2;
+		uint64_t lod_height2;
+		uint64_t range2;
+		/* square meters per squared unit */
+		float unit2;
+
+		RecLoadTilesInfo() : has_view(false), view_halfangle(0.0f), has_movement(false), prefetch(false), coslat(1.0f), lon_scale(0), height2(0), lod_height2(0), range2(0), unit2(0.0f) {
 		}
 	};
 
 protected:
-	typedef std::list<TileTask> TilesQueue;
-	typedef std::vector<QuadNode**> GCQueue;
+	typedef std::map<TileId, TileTask> TileTaskMap;
+	typedef std::map<TileId, InflightTile> InflightMap;
+	typedef std::vector<TileRequest*> TileRequestVector;
+	typedef std::set<std::pair<float, TileId> > TilesQueue;
+	typedef std::set<TileId> TileIdSet;
+	typedef std::map<TileId, double> TileRetryMap;
+	typedef std::vector<pthread_t> ThreadVector;
+	typedef std::vector<TileId> TileIdVector;
+	typedef std::map<int, int> LevelFlagsMap;
+	typedef std::vector<OcclusionCandidate> OcclusionCandidateVector;
+	typedef std::vector<RecLoadTilesInfo> RecLoadTilesInfoVector;
+	typedef std::vector<Vector3i> PositionVector;
+
+	/**
+	 * Viewer position and look direction of last locality pass
+	 */
+	struct ViewerState {
+		Vector3i pos;
+		Vector2f view_dir;
+	};
+
+	typedef std::vector<ViewerState> ViewerStateVector;
 
 protected:
 	/* @todo it would be optimal to delegate these to layer via either
 	 * virtual methods or templates */
 	int level_;
+	int min_level_;
+	float lod_factor_;
 	float range_;
 	volatile int flags_;
+	LevelFlagsMap level_flags_;
 	bool height_effect_;
 	size_t size_limit_;
+	size_t gpu_size_limit_;
+	size_t upload_budget_;
 
 	const Projection projection_;
 
+	/* shader to render tiles with, NULL for fixed function */
+	TileShader* shader_;
+
+	/* shared storage of tile geometry, for batched shader */
+	std::auto_ptr<TileBatch> batch_;
+
 	mutable pthread_mutex_t tiles_mutex_;
 	/* protected by tiles_mutex_ */
 	QuadNode root_;
 	int generation_;
 	size_t total_size_;
 	int tile_count_;
+
+	/* part of total_size_ in system memory, and size of tiles
+	 * in upload queue, which is not part of total_size_ */
+	size_t ram_size_;
+	size_t upload_size_;
+	TileIdVector placed_ids_;
+
+	/* incremented by InvalidateArea(); also protected by
+	 * queue_mutex_, so loading threads may read it */
+	int data_version_;
+
+	/* nodes with tiles, most recently used first */
+	QuadNode* lru_head_;
+	QuadNode* lru_tail_;
+
+	/* cumulative counters of stats_ */
+	Statistics stats_;
+
+	/* nodes are allocated in slabs; free ones are linked
+	 * through parent, see CreateNode() */
+	std::vector<QuadNode*> node_slabs_;
+	QuadNode* free_nodes_;
+
+	/* ground point tile transforms are cached relative to,
+	 * moved to the viewer when it goes too far from it */
+	bool has_render_origin_;
+	Vector3i render_origin_;
+	int render_origin_version_;
+
+	/* modelview matrix for render origin of current frame,
+	 * for shader path */
+	float origin_modelview_[16];
+
+	/* model matrix of render origin relative to viewer, and
+	 * viewer's modelview matrix, for current frame */
+	float origin_transform_[16];
+	float viewer_modelview_[16];
+
+	/* see SetOcclusionCulling() */
+	bool occlusion_culling_;
+	int render_frame_;
+	OcclusionCandidateVector occlusion_candidates_;
+
+	/* see SetImpostors() */
+	ImpostorCache impostors_;
+
+	/* whether collection is in progress, see GarbageCollect() */
+	bool collecting_;
+
+	/* viewer positions of last locality load, for GC */
+	PositionVector gc_viewer_pos_;
+
+	/* see SetPrefetch() */
+	float prefetch_time_;
+	size_t prefetch_limit_;
+
+	/* total size of speculative tiles */
+	size_t speculative_size_;
+
+	/* loaded tiles waiting for GPU upload, in loading order */
+	FinishedTile* upload_head_;
+	FinishedTile* upload_tail_;
+
+	/* tiles dropped from quadtree, destroyed in batches by
+	 * ReclaimTiles(), so Clear() doesn't stall a frame */
+	std::vector<Tile*> reclaim_;
 	/* /protected by tiles_mutex_ */
 
+	/* lock-free stack of loaded tiles, pushed by loading threads
+	 * and taken as a whole by PlaceFinishedTiles() */
+	FinishedTile* volatile finished_;
+
 	mutable pthread_mutex_t queue_mutex_;
 	pthread_cond_t queue_cond_;
 	/* protected by queue_mutex_ */
+	TileTaskMap tasks_;
 	TilesQueue queue_;
-	TileId loading_;
+	TileIdSet loading_;
+	int load_pass_;
+
+	/* asynchronous requests, also in loading_ until placed */
+	InflightMap inflight_;
+
+	/* requests no longer needed; destroyed by Load() after
+	 * releasing queue_mutex_, as cancelling may wait for
+	 * datasource callbacks, which take it */
+	TileRequestVector cancelled_;
+	unsigned int cancelled_count_;
+
+	/* tiles which failed to load, with time they may be
+	 * requested again */
+	TileRetryMap failed_;
+	unsigned int failed_count_;
+	bool failure_reported_;
+
+	/* state of each viewer as of last locality pass; empty
+	 * if there was none */
+	ViewerStateVector last_viewers_;
+
+	/* last pass didn't fit into queue */
+	bool queue_truncated_;
+
+	/* next locality load must do a pass even if viewer hasn't
+	 * moved, as settings or data have changed */
+	bool force_load_pass_;
 	/* /protected by queue_mutex_ */
 
-	pthread_t loading_thread_;
+	ThreadVector loading_threads_;
 	volatile bool thread_die_flag_;
 
+	/* shared loader used instead of own threads, see SetLoader() */
+	TileLoader* loader_;
+
+	/* frame time budget of maintenance, see SetScheduler();
+	 * these are only used by the main thread */
+	FrameScheduler* scheduler_;
+	unsigned int maintenance_frame_;
+	double maintenance_spent_;
+	double maintenance_start_;
+	double maintenance_time_;
+	unsigned int maintenance_overruns_;
+	unsigned int deferred_passes_;
+	/* consecutive load passes postponed */
+	int deferred_pass_run_;
+	/* scheduler frame tiles were last placed by Render() in */
+	bool has_placed_frame_;
+	unsigned int placed_frame_;
+
 protected:
 	/**
 	 * Constructs Tile
@@ -171,31 +635,309 @@ protected:
 	 */
 	virtual Tile* SpawnTile(const BBoxi& bbox, int flags) const = 0;
 
+	/**
+	 * Starts asynchronous preparation of a tile
+	 *
+	 * Lets layers with remote or disk backed sources keep many
+	 * tiles in flight without a thread blocked on each. When
+	 * the request is ready, NotifyRequestReady() must be called,
+	 * after which it's finished by a loading thread; requests
+	 * for tiles which are no longer needed are destroyed.
+	 *
+	 * @return request owned by caller, or NULL if tile should
+	 *         be spawned with SpawnTile()
+	 */
+	virtual TileRequest* RequestTile(const BBoxi& bbox, int flags) const;
+
 	/**
 	 * Recursive tile loading function for viewer's locality
 	 *
+	 * Node must be checked to be in range by the caller; node
+	 * creates only those of its children which are in range.
+	 *
+	 * @param thisdist squared distance from viewer to node in
+	 *        square meters
 	 * @todo remove code duplication with RecLoadTilesBBox
 	 */
-	void RecLoadTilesLocality(RecLoadTilesInfo& info, QuadNode** pnode, int level = 0, int x = 0, int y = 0);
+	void RecLoadTilesLocality(RecLoadTilesInfo& info, QuadNode** pnode, float thisdist, QuadNode* parent = NULL, int level = 0, int x = 0, int y = 0);
+
+	/**
+	 * Marks node as needed leaf of locality load and requests
+	 * its tile
+	 *
+	 * With several views, one may need a node as a leaf while
+	 * another needs finer tiles there. Refinement wins, so the
+	 * result doesn't depend on order of views: node already
+	 * refined in this generation is split instead.
+	 */
+	void LoadLeafTile(RecLoadTilesInfo& info, QuadNode* node, float thisdist, int level, int x, int y);
+
+	/**
+	 * Replaces leaf mark of a node with leaf marks on all its
+	 * childs, for node refined by another view
+	 */
+	void SplitLeafTile(RecLoadTilesInfo& info, QuadNode* node, int level, int x, int y);
+
+	/**
+	 * Precomputes range check factors of locality load for
+	 * its viewer position and current range
+	 */
+	void InitRangeCheck(RecLoadTilesInfo& info) const;
+
+	/**
+	 * Returns squared horizontal distance from viewer to bbox
+	 * in latitude units, see InitRangeCheck()
+	 */
+	uint64_t GetHorizontalDistanceSquare(const RecLoadTilesInfo& info, const BBoxi& bbox) const;
+
+	/**
+	 * Checks which of four quadrants of bbox are in range
+	 *
+	 * Quadrants are ordered like childs of QuadNode. They share
+	 * two column and two row offsets, so only these are computed.
+	 *
+	 * @param dists (output) squared distances to quadrants in
+	 *        range, in square meters
+	 * @return bitmask of quadrants in range
+	 */
+	int GetQuadrantsInRange(const RecLoadTilesInfo& info, const BBoxi& bbox, float dists[4]) const;
 
 	/**
 	 * Recursive tile loading function for given bbox
 	 *
 	 * @todo remove code duplication with RecLoadTilesLocality
 	 */
-	void RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, int level = 0, int x = 0, int y = 0);
+	void RecLoadTilesBBox(RecLoadTilesInfo& info, QuadNode** pnode, QuadNode* parent = NULL, int level = 0, int x = 0, int y = 0);
+
+	/**
+	 * Spawns tile for a node in the calling thread
+	 */
+	void SpawnTileSync(QuadNode* node, int level);
+
+	/**
+	 * Attaches loaded tile to a node
+	 */
+	void AttachTile(QuadNode* node, Tile* tile, float cost, int version, bool speculative, double requested);
+
+	/**
+	 * Checks whether tile of a node was spawned before its area
+	 * was invalidated
+	 */
+	bool IsOutdated(const QuadNode* node) const;
+
+	/**
+	 * Recursive function that marks tiles in area as outdated
+	 */
+	void RecInvalidateArea(QuadNode* node, const BBoxi& bbox);
+
+	/**
+	 * Destroys tile of a node, leaving node itself
+	 */
+	void DestroyTile(QuadNode* node);
+
+	/**
+	 * Destroys up to given number of dropped tiles
+	 *
+	 * Stops early when out of maintenance time, after at least
+	 * one tile. Tiles own GL objects, so this must be called
+	 * from GL thread.
+	 */
+	void ReclaimTiles(size_t count);
+
+	/**
+	 * Starts measuring maintenance time charged to scheduler
+	 */
+	void BeginMaintenance();
+
+	/**
+	 * Stops measuring maintenance time and charges it
+	 */
+	void EndMaintenance();
+
+	/**
+	 * Checks whether layer's maintenance share of current frame
+	 * is not used up; always true without scheduler
+	 */
+	bool HasMaintenanceTime() const;
+
+	/**
+	 * Updates system memory accounting of node's tile after
+	 * it might have been uploaded
+	 */
+	void UpdateRamSize(QuadNode* node);
+
+	/**
+	 * Marks tile as just used by moving it to the head of LRU list
+	 *
+	 * Used tile is no longer speculative.
+	 */
+	void TouchTile(QuadNode* node);
+
+	/**
+	 * Removes node from LRU list
+	 */
+	void UnlinkTile(QuadNode* node);
+
+	/**
+	 * Adds tile to loading queue or updates its priority
+	 */
+	void EnqueueTile(const TileId& id, const BBoxi& bbox, float priority, int flags, bool speculative = false);
+
+	/**
+	 * Calculates loading priority of a tile for viewer's locality
+	 *
+	 * Priority is distance to tile, decreased for tiles in view
+	 * and in the direction of viewer movement.
+	 */
+	float GetTilePriority(const RecLoadTilesInfo& info, const BBoxi& bbox, float distsq) const;
+
+	/**
+	 * Checks whether node should be covered with finer tiles
+	 * instead of its own one
+	 */
+	bool NeedsRefinement(const RecLoadTilesInfo& info, const QuadNode* node) const;
+
+	/**
+	 * Checks whether locality load needs to traverse quadtree
+	 *
+	 * Set of needed tiles only changes when viewer moves, so
+	 * while it stays in place, tiles queued by last pass are
+	 * still correct and traversal is skipped. With several
+	 * viewers, pass is needed when any of them has moved.
+	 */
+	bool NeedsLoadPass(const RecLoadTilesInfoVector& views) const;
+
+	/**
+	 * Returns flags for spawning tiles of a given level
+	 */
+	int GetLevelFlags(int level) const;
+
+	/**
+	 * Drops queued tiles not requested by last pass and trims
+	 * queue to its maximal size
+	 */
+	void PruneQueue();
+
+	/**
+	 * Passes loaded tile to the main thread, without locking
+	 */
+	void PushFinishedTile(FinishedTile* finished);
+
+	/**
+	 * Places tiles loaded so far into quadtree
+	 *
+	 * Tiles are queued for GPU upload first, and only placed
+	 * after upload, so they never upload synchronously while
+	 * rendering; until then, tiles they replace are shown.
+	 *
+	 * Must be called with tiles_mutex_ held. Ids of placed tiles
+	 * are collected in placed_ids_ to be removed from loading_
+	 * by next Load(), so tiles are not requested again while
+	 * they wait here.
+	 *
+	 * @param upload whether to upload queued tiles within per
+	 *        call budget; must only be true in the GL thread.
+	 *        Otherwise, only tiles with no data to upload are
+	 *        placed
+	 */
+	void PlaceFinishedTiles(bool upload);
 
 	/**
 	 * Recursive function that places tile into specified quadtree point
 	 */
-	void RecPlaceTile(QuadNode* node, Tile* tile, int level = 0, int x = 0, int y = 0);
+	void RecPlaceTile(QuadNode* node, Tile* tile, float cost, int version, bool speculative, double requested, int level = 0, int x = 0, int y = 0);
 
 	/**
 	 * Recursive function for tile rendering
 	 *
-	 * @return 1 if whole tile was rendered, 0 otherwise
+	 * Subtrees outside of view frustum are skipped.
+	 *
+	 * @return 1 if whole tile was rendered or is not visible, 0 otherwise
+	 */
+	int RecRenderTiles(QuadNode* node, const Viewer& viewer, const ViewFrustum& frustum);
+
+	/**
+	 * Renders tiles left in a subtree from previous generations
+	 *
+	 * Used to fill area of a tile which is not loaded yet.
 	 */
-	int RecRenderTiles(QuadNode* node, const Viewer& viewer);
+	void RecRenderStaleTiles(QuadNode* node, const Viewer& viewer, const ViewFrustum& frustum);
+
+	/**
+	 * Extracts view frustum from current OpenGL matrices
+	 *
+	 * Must be called after viewer has set up its matrices.
+	 */
+	void GetViewFrustum(const Viewer& viewer, ViewFrustum& frustum) const;
+
+	/**
+	 * Checks whether subtree of a node may be visible
+	 *
+	 * Node's area is checked with its range of tile heights,
+	 * conservatively: false is only returned if it's surely
+	 * outside of the frustum.
+	 *
+	 * @param box receives box around node contents, valid if
+	 *        true is returned
+	 */
+	bool IsInFrustum(const QuadNode* node, const ViewFrustum& frustum, NodeBox& box) const;
+
+	/**
+	 * Checks whether all tiles needed in a subtree are loaded
+	 */
+	bool RecIsComplete(const QuadNode* node) const;
+
+	/**
+	 * Renders a single tile
+	 *
+	 * Modelview matrix must be set up for render origin, see
+	 * Render().
+	 *
+	 * @param box box around tile contents, see IsInFrustum()
+	 */
+	void RenderTile(QuadNode* node, const Viewer& viewer, const NodeBox& box);
+
+	/**
+	 * Checks whether tile of a node was occluded by the last
+	 * available query result, and queues it for next query
+	 *
+	 * Never waits for query results; results older than a few
+	 * frames are ignored, so tiles coming back into view are
+	 * drawn until queried again.
+	 */
+	bool IsOccluded(QuadNode* node, const NodeBox& box);
+
+	/**
+	 * Issues occlusion queries for boxes of tiles rendered in
+	 * current frame
+	 *
+	 * Must be called after all tiles are drawn, with modelview
+	 * matrix of the viewer.
+	 */
+	void RenderOcclusionQueries(const ViewFrustum& frustum);
+
+	/**
+	 * Draws impostor of a tile, rendering it first if there's
+	 * none or it doesn't match current view
+	 *
+	 * Must be called with modelview matrix for render origin,
+	 * in fixed function mode.
+	 *
+	 * @param box box around tile contents, see IsInFrustum()
+	 * @return false if tile should be rendered as is, e.g. if
+	 *         it's too close or too large on screen
+	 */
+	bool RenderImpostor(QuadNode* node, const NodeBox& box);
+
+	/**
+	 * Calculates model matrix which places geometry projected
+	 * relative to one point into coordinates relative to another
+	 *
+	 * @param ref point geometry is relative to
+	 * @param pos point to place it relative to
+	 * @param matrix receives column-major matrix
+	 */
+	void GetTransform(const Vector3i& ref, const Vector3i& pos, float matrix[16]) const;
 
 	/**
 	 * Recursive function for destroying tiles and quadtree nodes
@@ -203,34 +945,163 @@ protected:
 	void RecDestroyTiles(QuadNode* node);
 
 	/**
-	 * Recursive function for garbage collecting unneeded tiles
+	 * Checks whether tile of a node is not needed for rendering
+	 */
+	bool IsCollectable(const QuadNode* node) const;
+
+	/**
+	 * Returns memory held by tiles and their impostors, which
+	 * is what SetSizeLimit() limits
+	 */
+	size_t GetHeldSize() const;
+
+	/**
+	 * Returns GPU memory held by tiles and their impostors,
+	 * which is what SetGpuSizeLimit() limits
+	 */
+	size_t GetHeldGpuSize() const;
+
+	/**
+	 * Checks whether one more impostor fits into size limits
+	 */
+	bool HasRoomForImpostor() const;
+
+	/**
+	 * Returns how desirable it is to drop tile of a node
+	 *
+	 * Larger, distant and cheap to regenerate tiles go first.
+	 *
+	 * @param gpu count only GPU part of tile size
+	 */
+	float GetCollectScore(const QuadNode* node, bool gpu) const;
+
+	/**
+	 * Deletes empty unneeded nodes from given one up to the root
+	 */
+	void PruneNodes(QuadNode* node);
+
+	/**
+	 * Takes quadtree node from the pool
+	 *
+	 * Nodes are created and freed all the time as viewer moves,
+	 * so these are reused instead of going through allocator,
+	 * and nodes of a slab are close in memory.
+	 */
+	QuadNode* CreateNode(QuadNode* parent, const BBoxi& bbox);
+
+	/**
+	 * Returns quadtree node to the pool
 	 */
-	void RecGarbageCollectTiles(QuadNode* node, GCQueue& gcqueue);
+	void FreeNode(QuadNode* node);
 
 	/**
 	 * Thread function for tile loading
 	 */
 	void LoadingThreadFunc();
 
+	/**
+	 * Takes the most important task from the queue and either
+	 * loads it or starts its asynchronous request
+	 *
+	 * Must be called with queue_mutex_ held and non-empty
+	 * queue; the mutex is released while tile is loaded.
+	 */
+	void SpawnQueuedTile();
+
+	/**
+	 * Returns the most important ready asynchronous request,
+	 * or inflight_.end(); called with queue_mutex_ held
+	 */
+	InflightMap::iterator FindReadyRequest();
+
+	/**
+	 * Builds tile of a ready request
+	 *
+	 * Must be called with queue_mutex_ held; the mutex is
+	 * released while tile is built.
+	 */
+	void FinishRequest(InflightMap::iterator inflight);
+
+	/**
+	 * Forgets tile which failed to load and postpones its
+	 * next request; only first failure is reported
+	 *
+	 * Must be called with queue_mutex_ held.
+	 */
+	void FailTile(const TileId& id, const std::exception& e);
+
+	/**
+	 * Does the most important piece of loading work: finishes
+	 * ready request or takes a task from the queue
+	 *
+	 * Must be called with queue_mutex_ held.
+	 *
+	 * @return false if there was nothing to do
+	 */
+	bool RunLoadingTask();
+
+	/**
+	 * Returns priority of the most important loading work
+	 *
+	 * Used by TileLoader to choose between layers.
+	 *
+	 * @return false if there's nothing to do
+	 */
+	bool GetNextTaskPriority(float& priority);
+
+	/**
+	 * Does the most important piece of loading work, if any
+	 *
+	 * Used by TileLoader threads.
+	 *
+	 * @return false if there was nothing to do
+	 */
+	bool LoadNextTile();
+
+	/**
+	 * Starts given number of loading threads
+	 *
+	 * If some of threads could not be created, works with
+	 * what was created; throws if none were.
+	 */
+	void StartLoadingThreads(int nthreads);
+
+	/**
+	 * Stops all loading threads, letting them finish current tiles
+	 */
+	void StopLoadingThreads();
+
 	/**
 	 * Static wrapper for thread function
 	 */
 	static void* LoadingThreadFuncWrapper(void* arg);
 
+	/**
+	 * Stops loading and drops asynchronous requests
+	 *
+	 * Layers whose requests refer to their own members must
+	 * call this in their destructor, before these are gone.
+	 */
+	void StopLoading();
+
 	/**
 	 * Loads tiles
+	 *
+	 * All infos are of the same mode and flags; tiles needed
+	 * by any of them are loaded by a single pass.
 	 */
-	void Load(RecLoadTilesInfo& info);
+	void Load(RecLoadTilesInfoVector& views);
 
 protected:
 	/**
 	 * Renders visible tiles
+	 *
+	 * May be called for several viewports in a frame; with
+	 * scheduler, tiles are placed and reclaimed only once per
+	 * frame, before first of them.
 	 */
 	void Render(const Viewer& viewer);
 
-protected:
-	static bool GenerationCompare(QuadNode** x, QuadNode** y);
-
 public:
 	/**
 	 * Loads square area of tiles
@@ -239,11 +1110,34 @@ public:
 
 	/**
 	 * Loads tiles in locality of Viewer
+	 *
+	 * Expected to be called on each frame; quadtree is only
+	 * traversed when viewer has moved noticeably since last
+	 * traversal, so this is cheap for a still viewer.
 	 */
 	void LoadLocality(const Viewer& viewer, int flags = 0);
 
+	/**
+	 * Loads tiles in union of localities of several viewers
+	 *
+	 * For several viewports rendered by one process, e.g.
+	 * screens of a panorama or eyes of a stereo pair. Single
+	 * pass over the quadtree serves all viewers: tile needed
+	 * by any of them is kept, and is queued once, with best
+	 * priority any viewer gives it. Other than that, this is
+	 * the same as LoadLocality(const Viewer&).
+	 */
+	void LoadLocality(const ViewerVector& viewers, int flags = 0);
+
 	/**
 	 * Destroys unneeded tiles
+	 *
+	 * Collection starts when tiles size exceeds the limit and
+	 * continues until it falls below low watermark. Number of
+	 * tiles dropped per call is limited, so a single call never
+	 * takes long; it's expected to be called once per frame.
+	 * With scheduler, collection also stops when layer's share
+	 * of frame time is used up.
 	 */
 	void GarbageCollect();
 
@@ -252,6 +1146,16 @@ public:
 	 */
 	void Clear();
 
+	/**
+	 * Marks tiles intersecting given area as outdated
+	 *
+	 * Outdated tiles are reloaded by next load, including tiles
+	 * which were being loaded at the time of the call. Until
+	 * then, they are still rendered. Caches in front of tile
+	 * source, if any, should be invalidated as well.
+	 */
+	void InvalidateArea(const BBoxi& bbox);
+
 	/**
 	 * Sets designated tile level
 	 *
@@ -259,6 +1163,37 @@ public:
 	 */
 	void SetLevel(int level);
 
+	/**
+	 * Enables level of detail: tiles are loaded at levels from
+	 * minlevel for distant areas to maxlevel near the viewer
+	 *
+	 * @param minlevel coarsest tile level
+	 * @param maxlevel finest tile level
+	 * @see SetLodFactor
+	 */
+	void SetLevelRange(int minlevel, int maxlevel);
+
+	/**
+	 * Sets how fast tile level decreases with distance
+	 *
+	 * Tile is replaced with finer ones if it's closer to viewer
+	 * than its size multiplied by this factor, so larger values
+	 * give more detail. Default is 1.0.
+	 *
+	 * @param factor distance to tile size ratio
+	 */
+	void SetLodFactor(float factor);
+
+	/**
+	 * Sets flags for spawning tiles of a specific level
+	 *
+	 * Levels without flags set use ones from SetFlags().
+	 *
+	 * @param level tile level
+	 * @param flags flags
+	 */
+	void SetLevelFlags(int level, int flags);
+
 	/**
 	 * Sets range in which tiles are visible
 	 *
@@ -285,9 +1220,157 @@ public:
 	/**
 	 * Sets limit on cumulative tiles size
 	 *
+	 * Impostor textures of tiles count against the limit too.
+	 *
 	 * @param limit size limit in bytes
 	 */
 	void SetSizeLimit(size_t limit);
+
+	/**
+	 * Sets limit on size of tile data uploaded to GPU
+	 *
+	 * Checked in addition to SetSizeLimit(), which covers both
+	 * system and GPU memory. Tiles free their system memory
+	 * copy on upload, so GPU data can't be dropped while
+	 * keeping tile geometry; tiles over this limit are evicted
+	 * as a whole, preferring ones with most GPU data.
+	 *
+	 * @param limit size limit in bytes; 0 means no separate limit
+	 */
+	void SetGpuSizeLimit(size_t limit);
+
+	/**
+	 * Sets amount of tile data uploaded to GPU per frame
+	 *
+	 * Bursts of new tiles are spread over several frames, so
+	 * frame times stay flat. At least one tile is uploaded per
+	 * frame regardless of its size.
+	 *
+	 * @param budget budget in bytes; 0 means unlimited
+	 */
+	void SetUploadBudget(size_t budget);
+
+	/**
+	 * Sets number of threads which load tiles in parallel
+	 *
+	 * Tile generation is CPU bound, so using more threads makes
+	 * newly visible areas appear faster. Default is one thread.
+	 *
+	 * @param nthreads number of threads; 0 means number of CPUs
+	 */
+	void SetLoadingThreads(int nthreads);
+
+	/**
+	 * Makes tiles loaded by shared loader instead of own threads
+	 *
+	 * Loader threads are shared between all attached layers and
+	 * load tiles of all of them in order of priority. Loader is
+	 * not owned and must outlive the layer.
+	 *
+	 * @param loader loader to use; NULL returns layer to a
+	 *        single own thread
+	 */
+	void SetLoader(TileLoader* loader);
+
+	/**
+	 * Makes per frame maintenance fit into share of scheduler's
+	 * frame budget
+	 *
+	 * Garbage collection, tile uploads and destruction stop
+	 * when layer's share is used up, after minimal progress,
+	 * and locality load passes are postponed for a few frames.
+	 * Scheduler is not owned and must outlive the layer.
+	 *
+	 * @param scheduler scheduler to use; NULL removes limit
+	 */
+	void SetScheduler(FrameScheduler* scheduler);
+
+	/**
+	 * Sets shader to render tiles with
+	 *
+	 * Shader is not owned and may be shared between layers.
+	 * With batched shader, tiles of the layer are drawn through
+	 * TileBatch; this must then be called before any tiles are
+	 * loaded.
+	 *
+	 * @param shader shader, or NULL for fixed function render
+	 */
+	void SetShader(TileShader* shader);
+
+	/**
+	 * Enables skipping of tiles hidden behind other geometry
+	 *
+	 * Bounding box of each rendered tile is tested against depth
+	 * buffer after the layer is drawn, and result is used in
+	 * following frames, so rendering never waits for the GPU.
+	 * A tile which comes into view from behind an obstacle thus
+	 * appears a frame or two late. Only useful with perspective
+	 * views in which tiles occlude each other; not supported on
+	 * OpenGL ES. Query results are kept for a single viewport,
+	 * so this is not useful with several.
+	 *
+	 * @param enabled whether to enable occlusion culling
+	 */
+	void SetOcclusionCulling(bool enabled);
+
+	/**
+	 * Enables drawing of distant tiles as impostors
+	 *
+	 * Tile farther than given distance is rendered into a texture
+	 * of given resolution, which is then drawn on a single quad
+	 * instead of tile geometry. Impostor is rendered again when
+	 * direction from tile to viewer changes by more than given
+	 * angle, or distance to it changes noticeably. Image takes
+	 * as many texels as tile takes on screen, and tiles which
+	 * don't fit into texture are drawn as is. Textures count
+	 * against SetSizeLimit() and SetGpuSizeLimit(), and tiles
+	 * get no new impostors while those are reached. Impostors
+	 * are kept for a single viewport; several viewports looking
+	 * in different directions would rerender them all the time.
+	 * Only fixed function render is supported; tiles drawn with
+	 * a shader ignore this. Must be called with GL context, and
+	 * throws GLUnsupportedException if framebuffer objects are
+	 * not available.
+	 *
+	 * @param distance distance in meters; 0 disables impostors
+	 * @param resolution side of impostor texture in pixels
+	 * @param max_angle angle in radians
+	 */
+	void SetImpostors(float distance, int resolution = 256, float max_angle = 0.05f);
+
+	/**
+	 * Enables prefetching of tiles ahead of moving viewer
+	 *
+	 * On each locality load, viewer position is extrapolated
+	 * by its velocity (see Viewer::GetVelocity()) given time
+	 * ahead, and tiles around that position are queued after
+	 * all tiles needed now. Such speculative tiles are not
+	 * protected from garbage collection until they're needed,
+	 * and no more are requested while their total size is
+	 * over the limit.
+	 *
+	 * @param time seconds to look ahead; 0 disables prefetching
+	 * @param limit limit on size of speculative tiles, in bytes
+	 */
+	void SetPrefetch(float time, size_t limit);
+
+	/**
+	 * Returns runtime statistics of the layer
+	 *
+	 * Useful for tuning size limit, range and levels; e.g. high
+	 * eviction rate with full queue means size limit is too
+	 * small for the range.
+	 */
+	void GetStatistics(Statistics& stats) const;
+
+	/**
+	 * Wakes loading threads after asynchronous request became
+	 * ready, see RequestTile()
+	 *
+	 * May be called from any thread holding no locks of this
+	 * layer.
+	 */
+	void NotifyRequestReady();
 };
 
 #endif
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILESHADER_HH
+#define TILESHADER_HH
+
+#include <glosm/NonCopyable.hh>
+#include <glosm/Math.hh>
+
+#include <glosm/util/gl.h>
+
+class VertexQuantizer;
+
+/**
+ * Shader program for rendering tiles
+ *
+ * This is an alternative to fixed function render path. Layer
+ * sets up its state and lighting uniforms once with Begin() and
+ * SetLight(), TileManager sets modelview matrix for each tile,
+ * and tiles only set few per-draw uniforms, bind their vertex
+ * arrays and draw.
+ *
+ * Shaders are written in a subset of GLSL common to GLSL 1.10
+ * and GLSL ES 1.00. Viewer matrices are still set up with
+ * fixed function calls and are read back from GL.
+ */
+class TileShader : private NonCopyable {
+public:
+	/**
+	 * Vertex attribute indices
+	 */
+	enum Attributes {
+		POSITION = 0,
+		NORMAL = 1,
+		/* columns of modelview matrix take 4 locations */
+		MODELVIEW = 2,
+		DEQUANTIZE = 6,
+	};
+
+	enum Flags {
+		/**
+		 * Take modelview matrix and dequantization from
+		 * per-instance attributes instead of uniforms, for
+		 * drawing tiles through TileBatch
+		 */
+		BATCHED = 0x01,
+
+		/**
+		 * Displace flat grid with heights from texture and
+		 * calculate normals from these, for drawing
+		 * TerrainTile::HEIGHT_TEXTURE tiles; can't be
+		 * combined with BATCHED
+		 */
+		TERRAIN = 0x02,
+	};
+
+	/**
+	 * Maximal number of grid columns or rows of terrain tile,
+	 * including margins, see SetTerrainGrid()
+	 */
+	static const int MAX_TERRAIN_LINES = 130;
+
+protected:
+	GLuint program_;
+	int flags_;
+
+	/* last matrix given to SetModelview() */
+	GLfloat modelview_[16];
+
+	GLint modelview_location_;
+	GLint projection_location_;
+	GLint dequantize_location_;
+	GLint lighting_location_;
+	GLint color_location_;
+	GLint point_size_location_;
+	GLint light_direction_location_;
+	GLint light_ambient_location_;
+	GLint light_diffuse_location_;
+	GLint heights_location_;
+	GLint terrain_grid_location_;
+	GLint terrain_bounds_location_;
+	GLint terrain_lines_location_;
+	GLint skirt_depth_location_;
+
+protected:
+	GLuint CompileShader(GLenum type, const char* prefix, const char* source);
+
+public:
+	/**
+	 * Compiles and links shader program
+	 *
+	 * Must be called with GL context current. Throws
+	 * GLUnsupportedException if shaders or vertex array
+	 * objects are not supported
+	 *
+	 * @param flags combination of Flags
+	 */
+	TileShader(int flags = 0);
+
+	/**
+	 * Destructor
+	 */
+	~TileShader();
+
+	/**
+	 * Checks whether current GL context supports shader path
+	 */
+	static bool IsSupported();
+
+	/**
+	 * Checks whether this is a variant for TileBatch
+	 */
+	bool IsBatched() const {
+		return flags_ & BATCHED;
+	}
+
+	/**
+	 * Makes program current and takes projection matrix from GL
+	 *
+	 * Lighting is disabled and other per-draw uniforms are
+	 * reset to defaults.
+	 */
+	void Begin();
+
+	/**
+	 * Restores fixed function pipeline
+	 */
+	void End();
+
+	/**
+	 * Sets directional light
+	 *
+	 * Arguments are the same as given to glLight and glMaterial
+	 * for fixed function path; direction is transformed by
+	 * current modelview matrix, like glLight does. Material is
+	 * used as both ambient and diffuse reflectance.
+	 */
+	void SetLight(const GLfloat position[4], const GLfloat light_ambient[4], const GLfloat light_diffuse[4], const GLfloat material[4]);
+
+	/**
+	 * Sets modelview matrix for following draws
+	 *
+	 * This and SetQuantizer() have no effect on batched variant
+	 */
+	void SetModelview(const GLfloat matrix[16]);
+
+	/**
+	 * Returns matrix last given to SetModelview()
+	 */
+	const GLfloat* GetModelview() const {
+		return modelview_;
+	}
+
+	/**
+	 * Sets dequantization of following draws; NULL for none
+	 */
+	void SetQuantizer(const VertexQuantizer* quantizer);
+
+	/**
+	 * Enables or disables lighting of following draws
+	 */
+	void SetLighting(bool enabled);
+
+	/**
+	 * Sets color of unlit draws
+	 */
+	void SetColor(float r, float g, float b, float a);
+
+	/**
+	 * Sets size of points
+	 */
+	void SetPointSize(float size);
+
+	/**
+	 * Sets grid of following terrain draws
+	 *
+	 * Only used by TERRAIN variant. Heights are taken from
+	 * texture bound to unit 0, and flat grid vertices are grid
+	 * coordinates, with z = 1 for skirt vertices.
+	 *
+	 * @param width number of grid columns
+	 * @param height number of grid rows
+	 * @param bounds grid coordinates of tile edges, vertices are
+	 *        clamped to: left, bottom, right, top
+	 * @param lines for each grid line, 4 values: projected x of
+	 *        column, projected y of row, scale of height in meters
+	 *        for row and unused; up to max(width, height) lines
+	 * @param skirt depth of skirt in projected units
+	 */
+	void SetTerrainGrid(int width, int height, const GLfloat bounds[4], const GLfloat* lines, GLfloat skirt);
+};
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VERTEXARRAY_HH
+#define VERTEXARRAY_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <glosm/util/gl.h>
+
+/**
+ * Vertex Array Object
+ *
+ * Holds vertex attribute setup of a tile's buffers for TileShader,
+ * so it's done once instead of on every render. OpenGL object is
+ * created on first Bind().
+ */
+class VertexArray : private NonCopyable {
+protected:
+	GLuint array_id_;
+
+public:
+	VertexArray(): array_id_(0) {
+	}
+
+	~VertexArray() {
+#if defined(WITH_SHADERS)
+		if (array_id_)
+			glDeleteVertexArrays(1, &array_id_);
+#endif
+	}
+
+	/**
+	 * Binds vertex array, creating it if necessary
+	 *
+	 * @return true if array was just created, so its attributes
+	 *         are to be set up with SetAttribute() while buffers
+	 *         they come from are bound
+	 */
+	bool Bind() {
+#if defined(WITH_SHADERS)
+		if (array_id_) {
+			glBindVertexArray(array_id_);
+			return false;
+		}
+
+		glGenVertexArrays(1, &array_id_);
+		glBindVertexArray(array_id_);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * Sets up attribute of bound array from bound GL_ARRAY_BUFFER
+	 */
+	static void SetAttribute(GLuint index, GLint size, GLenum type, bool normalized, GLsizei stride, size_t offset) {
+#if defined(WITH_SHADERS)
+		glVertexAttribPointer(index, size, type, normalized ? GL_TRUE : GL_FALSE, stride, (const char*)NULL + offset);
+		glEnableVertexAttribArray(index);
+#endif
+	}
+};
+
+#endif
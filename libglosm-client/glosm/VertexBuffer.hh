@@ -30,6 +30,8 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <limits>
 #include <stdexcept>
 #include <cassert>
 
@@ -151,6 +153,15 @@ public:
 		return size_;
 	}
 
+	/**
+	 * Returns size of data not yet converted into VBO, in bytes
+	 */
+	size_t GetPendingFootprint() const {
+		if (ram_data_.get())
+			return sizeof(T) * ram_data_->size();
+		return 0;
+	}
+
 	/**
 	 * Returns size of VBO in bytes
 	 */
@@ -161,4 +172,167 @@ public:
 	}
 };
 
+/**
+ * Element buffer with 16 or 32 bit indices
+ *
+ * Indices are collected as 32 bit ones via Data(); Pack() then
+ * converts them to 16 bit if these are enough, which halves the
+ * size of most tile index buffers. Like VertexBuffer, this turns
+ * into OpenGL buffer on first Bind() or Freeze() call, after
+ * which RAM copy is freed.
+ */
+class IndexBuffer : private NonCopyable {
+public:
+	typedef std::vector<GLuint> DataVector;
+	typedef std::vector<GLushort> ShortDataVector;
+
+protected:
+	GLuint buffer_id_;
+	size_t size_;
+	GLenum index_type_;
+	GLenum mode_;
+	std::auto_ptr<DataVector> ram_data_;
+	std::auto_ptr<ShortDataVector> ram_short_data_;
+
+protected:
+	void CreateBufferObject(const void* data, size_t size) {
+		glGenBuffers(1, &buffer_id_);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer_id_);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, mode_);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	size_t GetIndexSize() const {
+		return index_type_ == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	}
+
+public:
+	/**
+	 * Constructs empty index buffer
+	 */
+	IndexBuffer(GLenum mode = GL_STATIC_DRAW): buffer_id_(0), size_(0), index_type_(GL_UNSIGNED_INT), mode_(mode), ram_data_(new DataVector) {
+	}
+
+	/**
+	 * Destructor
+	 */
+	~IndexBuffer() {
+		if (buffer_id_)
+			glDeleteBuffers(1, &buffer_id_);
+	}
+
+	/**
+	 * Gives access to vector of 32 bit indices
+	 *
+	 * Only valid before Pack() or Freeze()
+	 */
+	DataVector& Data() {
+		assert(ram_data_.get());
+		return *ram_data_;
+	}
+
+	/**
+	 * Converts indices to 16 bit if all of them fit
+	 *
+	 * Doesn't need GL context, so may be called from
+	 * loading threads.
+	 */
+	void Pack() {
+		if (!ram_data_.get())
+			return;
+
+		size_ = ram_data_->size();
+
+		if (!ram_data_->empty() && *std::max_element(ram_data_->begin(), ram_data_->end()) > std::numeric_limits<GLushort>::max())
+			return;
+
+		ram_short_data_.reset(new ShortDataVector(ram_data_->begin(), ram_data_->end()));
+		ram_data_.reset(NULL);
+		index_type_ = GL_UNSIGNED_SHORT;
+	}
+
+	/**
+	 * Forcibly converts data into OpenGL buffer
+	 *
+	 * @return true if buffer was created
+	 */
+	bool Freeze() {
+		if (ram_data_.get()) {
+			size_ = ram_data_->size();
+			CreateBufferObject(ram_data_->data(), size_ * sizeof(GLuint));
+			ram_data_.reset(NULL);
+			return true;
+		}
+		if (ram_short_data_.get()) {
+			CreateBufferObject(ram_short_data_->data(), size_ * sizeof(GLushort));
+			ram_short_data_.reset(NULL);
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Binds OpenGL buffer
+	 *
+	 * Creates it from index data if necessary
+	 */
+	void Bind() {
+		Freeze();
+
+		assert(buffer_id_);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer_id_);
+	}
+
+	/**
+	 * Unbinds OpenGL buffer
+	 */
+	void UnBind() {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	/**
+	 * Returns indices not yet converted into OpenGL buffer,
+	 * of GetType() type, or NULL
+	 */
+	const void* GetRamData() const {
+		if (ram_short_data_.get())
+			return ram_short_data_->data();
+		if (ram_data_.get())
+			return ram_data_->data();
+		return NULL;
+	}
+
+	/**
+	 * Returns type of indices, to be passed to glDrawElements
+	 */
+	GLenum GetType() const {
+		return index_type_;
+	}
+
+	/**
+	 * Returns number of indices
+	 */
+	size_t GetSize() const {
+		if (ram_data_.get())
+			return ram_data_->size();
+		return size_;
+	}
+
+	/**
+	 * Returns size of data not yet converted into OpenGL buffer, in bytes
+	 */
+	size_t GetPendingFootprint() const {
+		if (ram_data_.get() || ram_short_data_.get())
+			return GetFootprint();
+		return 0;
+	}
+
+	/**
+	 * Returns size of buffer in bytes
+	 */
+	size_t GetFootprint() const {
+		return GetIndexSize() * GetSize();
+	}
+};
+
 #endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VERTEXQUANTIZER_HH
+#define VERTEXQUANTIZER_HH
+
+#include <glosm/Math.hh>
+
+#include <glosm/util/gl.h>
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+/**
+ * Quantizer of tile vertices into compact format
+ *
+ * Positions are stored as 16 bit offsets from the center of their
+ * bounding box, with a single scale for all axes, and are
+ * dequantized by modelview matrix set up with Apply(). As scale is
+ * uniform, normals are not distorted by it; these are stored as
+ * 8 bit components and need GL_NORMALIZE to be restored to unit
+ * length.
+ */
+class VertexQuantizer {
+protected:
+	Vector3f min_;
+	Vector3f max_;
+	Vector3f center_;
+	float scale_;
+	bool empty_;
+
+public:
+	VertexQuantizer(): scale_(1.0f), empty_(true) {
+	}
+
+	/**
+	 * Extends quantized range to include given position
+	 *
+	 * All positions must be included before Prepare()
+	 */
+	void Include(const Vector3f& pos) {
+		if (empty_) {
+			min_ = max_ = pos;
+			empty_ = false;
+			return;
+		}
+
+		min_.x = std::min(min_.x, pos.x);
+		min_.y = std::min(min_.y, pos.y);
+		min_.z = std::min(min_.z, pos.z);
+		max_.x = std::max(max_.x, pos.x);
+		max_.y = std::max(max_.y, pos.y);
+		max_.z = std::max(max_.z, pos.z);
+	}
+
+	/**
+	 * Calculates quantization parameters from included range
+	 */
+	void Prepare() {
+		center_ = (min_ + max_) / 2.0f;
+
+		float halfspan = std::max(max_.x - min_.x, std::max(max_.y - min_.y, max_.z - min_.z)) / 2.0f;
+		scale_ = halfspan > 0.0f ? halfspan / (float)std::numeric_limits<GLshort>::max() : 1.0f;
+	}
+
+	/**
+	 * Quantizes position
+	 */
+	void QuantizePosition(const Vector3f& pos, GLshort* out) const {
+		out[0] = QuantizeComponent((pos.x - center_.x) / scale_);
+		out[1] = QuantizeComponent((pos.y - center_.y) / scale_);
+		out[2] = QuantizeComponent((pos.z - center_.z) / scale_);
+	}
+
+	/**
+	 * Restores position; same as what Apply() does on GPU
+	 */
+	Vector3f DequantizePosition(const GLshort* in) const {
+		return Vector3f(in[0], in[1], in[2]) * scale_ + center_;
+	}
+
+	/**
+	 * Returns maximal error of quantized position
+	 */
+	float GetPrecision() const {
+		return scale_ / 2.0f;
+	}
+
+	/**
+	 * Quantizes unit normal
+	 */
+	static void QuantizeNormal(const Vector3f& norm, GLbyte* out) {
+		out[0] = (GLbyte)lrintf(std::max(-1.0f, std::min(1.0f, norm.x)) * 127.0f);
+		out[1] = (GLbyte)lrintf(std::max(-1.0f, std::min(1.0f, norm.y)) * 127.0f);
+		out[2] = (GLbyte)lrintf(std::max(-1.0f, std::min(1.0f, norm.z)) * 127.0f);
+	}
+
+	/**
+	 * Returns offset of dequantized positions
+	 */
+	const Vector3f& GetCenter() const {
+		return center_;
+	}
+
+	/**
+	 * Returns scale of dequantized positions
+	 */
+	float GetScale() const {
+		return scale_;
+	}
+
+	/**
+	 * Multiplies current matrix by dequantization transform
+	 */
+	void Apply() const {
+		glTranslatef(center_.x, center_.y, center_.z);
+		glScalef(scale_, scale_, scale_);
+	}
+
+protected:
+	static GLshort QuantizeComponent(float value) {
+		const float limit = (float)std::numeric_limits<GLshort>::max();
+		return (GLshort)lrintf(std::max(-limit, std::min(limit, value)));
+	}
+};
+
+#endif
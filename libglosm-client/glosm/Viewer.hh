@@ -50,6 +50,32 @@ public:
 	 * @return pseudo-position of a viewer
 	 */
 	virtual Vector3i GetPos(const Projection& projection) const = 0;
+
+	/**
+	 * Returns horizontal look direction and field of view
+	 *
+	 * Used to load tiles in view before others.
+	 *
+	 * @param direction unit look direction; x is east, y is north
+	 * @param halfangle half of horizontal field of view in radians
+	 * @return false if viewer has no specific direction
+	 */
+	virtual bool GetViewCone(Vector2f& /* direction */, float& /* halfangle */) const {
+		return false;
+	}
+
+	/**
+	 * Returns current movement velocity
+	 *
+	 * Used to prefetch tiles viewer is going to.
+	 *
+	 * @param velocity velocity in meters per second; x is east,
+	 *        y is north, z is up
+	 * @return false if viewer doesn't know its velocity
+	 */
+	virtual bool GetVelocity(Vector3f& /* velocity */) const {
+		return false;
+	}
 };
 
 #endif
@@ -41,6 +41,42 @@
 #	include <GL/glext.h>
 #endif
 
+/* TileShader needs GLSL and vertex array objects, which are not
+ * available in OpenGL ES 1.1 and are an extension in 2.0 */
+#if !defined(WITH_GLES)
+#	define WITH_SHADERS
+#endif
+
+/* TileBatch needs indirect multi-draw with base instance, which is
+ * only available in desktop OpenGL */
+#if !defined(WITH_GLES) && !defined(WITH_GLES2)
+#	define WITH_MULTIDRAW
+#endif
+
+/* TileManager occlusion culling needs occlusion queries, and draws
+ * proxy boxes in immediate mode, which are only in desktop OpenGL */
+#if !defined(WITH_GLES) && !defined(WITH_GLES2)
+#	define WITH_OCCLUSION_QUERIES
+#endif
+
+/* TileManager impostors need framebuffer objects and are drawn
+ * with fixed function, which are only in desktop OpenGL */
+#if !defined(WITH_GLES) && !defined(WITH_GLES2)
+#	define WITH_IMPOSTORS
+#endif
+
+/* TerrainTile height textures need 16 bit textures and vertex
+ * texture fetch, which are not guaranteed in OpenGL ES 2.0 */
+#if !defined(WITH_GLES) && !defined(WITH_GLES2)
+#	define WITH_HEIGHT_TEXTURES
+#endif
+
+#if defined(WITH_GLES2)
+#	define glGenVertexArrays glGenVertexArraysOES
+#	define glBindVertexArray glBindVertexArrayOES
+#	define glDeleteVertexArrays glDeleteVertexArraysOES
+#endif
+
 /*class OpenGLError : public Exception() {
 	static void Check() {
 		GLenum e;
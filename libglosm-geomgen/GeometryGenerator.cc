@@ -24,15 +24,44 @@
 #include <glosm/HeightmapDatasource.hh>
 #include <glosm/Geometry.hh>
 #include <glosm/GeometryOperations.hh>
-#include <glosm/MetricBasis.hh>
+#include <glosm/Model.hh>
+#include <glosm/Triangulator.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+#include <glosm/ParallelTasks.hh>
+#include <glosm/Timer.hh>
+#include <glosm/Trace.hh>
 #include <glosm/geomath.h>
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
 #include <list>
 #include <cstdlib>
 #include <cstdio>
 
-typedef std::list<Vector2i> VertexList;
 typedef std::vector<Vector2i> VertexVector;
+typedef std::vector<VertexVector> VertexRings;
+
+/* buffers reused between ways by WayDispatcher() and helpers,
+ * so steady state generation doesn't allocate per way */
+struct WayScratch {
+	VertexVector vertices;
+	VertexRings holes;
+
+	/* CreateArea() */
+	VertexVector points;
+	std::vector<unsigned int> lengths;
+	Triangulator::IndexVector triangles;
+
+	/* CreateRoof() */
+	std::vector<Vector3i> roof;
+
+	/* CreateBuilding() */
+	std::vector<osmint_t> heights;
+};
 
 static void CreateLines(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::Way& /*unused*/) {
 	geom.StartLine();
@@ -84,89 +113,121 @@ static void CreateWall(Geometry& geom, const VertexVector& vertices, int minz, i
 	}
 }
 
-static void CreateArea(Geometry& geom, const VertexVector& vertices, bool revorder, int z, const OsmDatasource::Way& way) {
+/* holes are closed rings, so these work as for closed ways */
+static void CreateHolesLines(Geometry& geom, const VertexRings& holes, int z, const OsmDatasource::Way& way) {
+	for (VertexRings::const_iterator hole = holes.begin(); hole != holes.end(); ++hole)
+		CreateLines(geom, *hole, z, way);
+}
+
+static void CreateHolesWalls(Geometry& geom, const VertexRings& holes, int minz, int maxz, const OsmDatasource::Way& way) {
+	for (VertexRings::const_iterator hole = holes.begin(); hole != holes.end(); ++hole) {
+		CreateWalls(geom, *hole, minz, maxz, way);
+		CreateSmartVerticalLines(geom, *hole, minz, maxz, 5.0, way);
+	}
+}
+
+/* doubled signed area of triangle, positive if it's counter-clockwise */
+static osmlong_t GetTriangleArea(const Vector2i& a, const Vector2i& b, const Vector2i& c) {
+	return ((osmlong_t)b.x - a.x) * ((osmlong_t)c.y - a.y) - ((osmlong_t)b.y - a.y) * ((osmlong_t)c.x - a.x);
+}
+
+static void CreateArea(Geometry& geom, WayScratch& scratch, const VertexVector& vertices, const VertexRings& holes, bool revorder, int z, const OsmDatasource::Way& way) {
 	if (vertices.size() < 3 || !way.Closed)
 		return;
 
-	VertexList vert;
-	for (VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i)
-		vert.push_back(*i);
-	vert.pop_back();
-
-	VertexList::iterator i0, i1, i2, o;
-	i0 = vert.begin();
-
-	/* quick & dirty triangulation for roofs
-	 * this should be rewritten to support sprips and/or fans,
-	 * and there should be no possibility of infinite loop,
-	 * as well as this iteration counter
-	 */
-	int iters = 1000;
-	while (vert.size() >= 3) {
-		if (++(i1 = i0) == vert.end())
-			i1 = vert.begin();
-		if (++(i2 = i1) == vert.end())
-			i2 = vert.begin();
+	/* closing vertices are not needed by triangulator */
+	VertexVector& points = scratch.points;
+	points.assign(vertices.begin(), vertices.end() - 1);
+	std::vector<unsigned int>& lengths = scratch.lengths;
+	lengths.assign(1, points.size());
+	for (VertexRings::const_iterator hole = holes.begin(); hole != holes.end(); ++hole) {
+		if (hole->size() < 4)
+			continue;
+		points.insert(points.end(), hole->begin(), hole->end() - 1);
+		lengths.push_back(hole->size() - 1);
+	}
 
-		osmlong_t area = 0;
-		area += (osmlong_t)i0->x*(osmlong_t)i1->y - (osmlong_t)i0->y*(osmlong_t)i1->x;
-		area += (osmlong_t)i1->x*(osmlong_t)i2->y - (osmlong_t)i1->y*(osmlong_t)i2->x;
-		area += (osmlong_t)i2->x*(osmlong_t)i0->y - (osmlong_t)i2->y*(osmlong_t)i0->x;
-
-		bool ok = true;
-		o = i2;
-		while (1) {
-			if (++o == vert.end())
-				o = vert.begin();
-
-			if (o == i0)
-				break;
-
-			if (Vector2l(*o).IsInTriangle(*i0, *i1, *i2)) {
-				ok = false;
-				break;
-			}
-		}
+	Triangulator::IndexVector& triangles = scratch.triangles;
+	triangles.clear();
+	triangles.reserve((points.size() + 2 * holes.size()) * 3);
+	Triangulator::Triangulate(&points[0], &lengths[0], lengths.size(), triangles);
 
-		if ((area < 0) && ok) {
-			if (revorder)
-				geom.AddTriangle(Vector3i(*i0, z), Vector3i(*i1, z), Vector3i(*i2, z));
-			else
-				geom.AddTriangle(Vector3i(*i0, z), Vector3i(*i2, z), Vector3i(*i1, z));
+	for (unsigned int i = 0; i + 2 < triangles.size(); i += 3) {
+		const Vector2i& a = points[triangles[i]];
+		const Vector2i& b = points[triangles[i+1]];
+		const Vector2i& c = points[triangles[i+2]];
 
-			vert.erase(i1);
-		}
+		/* triangulator output may be in any winding */
+		osmlong_t area = GetTriangleArea(a, b, c);
+		if (area == 0)
+			continue;
 
-		if (++i0 == vert.end())
-			i0 = vert.begin();
+		if ((area > 0) != revorder)
+			geom.AddTriangle(Vector3i(a, z), Vector3i(b, z), Vector3i(c, z));
+		else
+			geom.AddTriangle(Vector3i(a, z), Vector3i(c, z), Vector3i(b, z));
+	}
+}
 
-		if (--iters == 0) {
-			/* FIXME: add way ID here, lacks interface to datasource */
-			fprintf(stderr, "warning: triangulation failed: giving up on %u/%u points\n", (unsigned int)vert.size(), (unsigned int)vertices.size());
-			return;
-		}
+/**
+ * Checks whether closed ring is a strictly convex quad
+ *
+ * @param ccw set to whether quad is counter-clockwise
+ */
+static bool IsConvexQuad(const VertexVector& vertices, bool& ccw) {
+	if (vertices.size() != 5 || vertices.front() != vertices.back())
+		return false;
+
+	int positive = 0, negative = 0;
+	for (int i = 0; i < 4; ++i) {
+		osmlong_t area = GetTriangleArea(vertices[(i + 3) % 4], vertices[i], vertices[i + 1]);
+		if (area > 0)
+			positive++;
+		else if (area < 0)
+			negative++;
 	}
+
+	ccw = positive == 4;
+	return positive == 4 || negative == 4;
+}
+
+/**
+ * Creates flat area of convex quad as a single primitive
+ *
+ * Same as CreateArea(), but without triangulation.
+ */
+static void CreateQuadArea(Geometry& geom, const VertexVector& vertices, bool ccw, bool revorder, int z) {
+	if (ccw != revorder)
+		geom.AddQuad(Vector3i(vertices[0], z), Vector3i(vertices[1], z), Vector3i(vertices[2], z), Vector3i(vertices[3], z));
+	else
+		geom.AddQuad(Vector3i(vertices[0], z), Vector3i(vertices[3], z), Vector3i(vertices[2], z), Vector3i(vertices[1], z));
+}
+
+/* checks whether CreateRoof() falls back to flat roof for any shape of the way */
+static bool HasFlatRoof(const OsmDatasource::Way& way) {
+	strid_t shape = way.Tags.Get(STR_ROOF_SHAPE);
+	return shape != STR_PYRAMIDAL && shape != STR_CONICAL && shape != STR_GABLED && shape != STR_HIPPED && shape != STR_CROSSPITCHED && shape != STR_SKILLION;
 }
 
-static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, const OsmDatasource::Way& way) {
+static void CreateRoof(Geometry& geom, WayScratch& scratch, const VertexVector& vertices, const VertexRings& holes, int z, const OsmDatasource::Way& way) {
 	float slope = 30.0;
 	bool along = true;
 
-	OsmDatasource::TagsMap::const_iterator shape, tag;
+	const char* angle;
+	strid_t shape = way.Tags.Get(STR_ROOF_SHAPE);
 
-	if ((tag = way.Tags.find("roof:angle")) != way.Tags.end())
-		slope = strtof(tag->second.c_str(), NULL);
-	if ((tag = way.Tags.find("roof:orientation")) != way.Tags.end() && tag->second == "across")
+	if ((angle = way.Tags.GetString(STR_ROOF_ANGLE)) != NULL)
+		slope = strtof(angle, NULL);
+	if (way.Tags.Get(STR_ROOF_ORIENTATION) == STR_ACROSS)
 		along = false;
 
-	std::vector<Vector3i> vert;
-	vert.reserve(vertices.size());
+	std::vector<Vector3i>& vert = scratch.roof;
+	vert.clear();
 	for (VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i)
 		vert.push_back(Vector3i(*i, z));
 
-	if (vert.size() > 3 && way.Closed &&
-				(shape = way.Tags.find("roof:shape")) != way.Tags.end() &&
-				(shape->second == "pyramidal" || shape->second == "conical")
+	if (vert.size() > 3 && way.Closed && holes.empty() &&
+				(shape == STR_PYRAMIDAL || shape == STR_CONICAL)
 			) {
 		/* calculate center */
 		Vector3l center;
@@ -190,11 +251,11 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 	}
 
 	/* only 4-vert buildings are supported for other types, yet */
-	if (vert.size() == 5 && way.Closed && (shape = way.Tags.find("roof:shape")) != way.Tags.end()) {
+	if (vert.size() == 5 && way.Closed && holes.empty() && shape != STR_NONE) {
 		float length1 = ToLocalMetric(vert[0], vert[1]).Length();
 		float length2 = ToLocalMetric(vert[1], vert[2]).Length();
 
-		if (shape->second == "pyramidal") {
+		if (shape == STR_PYRAMIDAL) {
 			Vector3i center = ((Vector3l)vert[0] + (Vector3l)vert[1] + (Vector3l)vert[2] + (Vector3l)vert[3]) / 4;
 			center.z += (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
 
@@ -203,7 +264,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(vert[i], center);
 			}
 			return;
-		} else if (shape->second == "gabled") {
+		} else if (shape == STR_GABLED) {
 			if (!!(length1 < length2) ^ !along) {
 				osmint_t height = (tan(slope/180.0*M_PI) * length1 * 0.5) * GEOM_UNITSINMETER;
 
@@ -240,7 +301,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(center1, center2);
 			}
 			return;
-		} else if (shape->second == "hipped") {
+		} else if (shape == STR_HIPPED) {
 			if (length1 < length2) {
 				osmint_t height = (tan(slope/180.0*M_PI) * length1 * 0.5) * GEOM_UNITSINMETER;
 
@@ -287,7 +348,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(center1, center2);
 			}
 			return;
-		} else if (shape->second == "crosspitched") {
+		} else if (shape == STR_CROSSPITCHED) {
 			int height = (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
 
 			Vector3i center = ((Vector3l)vert[0] + (Vector3l)vert[1] + (Vector3l)vert[2] + (Vector3l)vert[3]) / 4;
@@ -307,7 +368,7 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 				geom.AddLine(vert[i], center);
 			}
 			return;
-		} else if (shape->second == "skillion") {
+		} else if (shape == STR_SKILLION) {
 			if (!!(length1 < length2) ^ !along) {
 				Vector3i extension1 = vert[1];
 				extension1.z += (tan(slope/180.0*M_PI) * std::min(length1, length2) * 0.5) * GEOM_UNITSINMETER;
@@ -347,38 +408,71 @@ static void CreateRoof(Geometry& geom, const VertexVector& vertices, int z, cons
 	}
 
 	/* fallback - flat roof */
-	return CreateArea(geom, vertices, false, z, way);
+	return CreateArea(geom, scratch, vertices, holes, false, z, way);
 }
 
-static void CreateBuilding(Geometry& geom, HeightmapDatasource& hmds, const VertexVector& vertices, int minz, int maxz, const OsmDatasource::Way& way) {
-	int minele = std::numeric_limits<int>::max();
-	int maxele = 0;
-	for (VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i) {
-		int h = hmds.GetHeight(*i);
-		if (h < minele)
-			minele = h;
-		if (h > maxele)
-			maxele = h;
+/* min and max of sampled terrain heights; max is never below
+ * sea level, so buildings in depressions are not sunk */
+static std::pair<osmint_t, osmint_t> GetElevationRange(const std::vector<osmint_t>& heights) {
+	osmint_t minele = std::numeric_limits<osmint_t>::max();
+	osmint_t maxele = 0;
+
+	for (std::vector<osmint_t>::const_iterator i = heights.begin(); i != heights.end(); ++i) {
+		if (*i < minele)
+			minele = *i;
+		if (*i > maxele)
+			maxele = *i;
 	}
 
+	return std::make_pair(minele, maxele);
+}
+
+static std::pair<osmint_t, osmint_t> SampleElevationRange(const HeightmapDatasource& hmds, const VertexVector& vertices, std::vector<osmint_t>& heights) {
+	heights.resize(vertices.size());
+	if (!vertices.empty())
+		hmds.GetHeights(&vertices[0], vertices.size(), &heights[0]);
+
+	return GetElevationRange(heights);
+}
+
+static void CreateBuilding(Geometry& geom, WayScratch& scratch, const std::pair<osmint_t, osmint_t>& elevation, const VertexVector& vertices, const VertexRings& holes, int minz, int maxz, const OsmDatasource::Way& way) {
+	int minele = elevation.first;
+	int maxele = elevation.second;
+
+	/* most buildings are convex quads with flat roofs, for which
+	 * roof and ceiling need no triangulation */
+	bool ccw;
+	bool simple = way.Closed && holes.empty() && IsConvexQuad(vertices, ccw) && HasFlatRoof(way);
+
 	/* roof */
-	CreateRoof(geom, vertices, maxele + maxz, way);
+	if (simple)
+		CreateQuadArea(geom, vertices, ccw, false, maxele + maxz);
+	else
+		CreateRoof(geom, scratch, vertices, holes, maxele + maxz, way);
 	CreateLines(geom, vertices, maxele + maxz, way);
+	CreateHolesLines(geom, holes, maxele + maxz, way);
 
 	if (minz > 0) { /* floating */
 		/* ceiling */
-		CreateArea(geom, vertices, true, maxele + minz, way);
+		if (simple)
+			CreateQuadArea(geom, vertices, ccw, true, maxele + minz);
+		else
+			CreateArea(geom, scratch, vertices, holes, true, maxele + minz, way);
 		CreateLines(geom, vertices, maxele + minz, way);
+		CreateHolesLines(geom, holes, maxele + minz, way);
 
 		/* walls */
 		CreateWalls(geom, vertices, maxele + minz, maxele + maxz, way);
 		CreateSmartVerticalLines(geom, vertices, maxele + minz, maxele + maxz, 5.0, way);
+		CreateHolesWalls(geom, holes, maxele + minz, maxele + maxz, way);
 	} else { /* on the ground */
 		/* walls */
 		CreateWalls(geom, vertices, minele, maxele + maxz, way);
 		CreateSmartVerticalLines(geom, vertices, minele, maxele + maxz, 5.0, way);
+		CreateHolesWalls(geom, holes, minele, maxele + maxz, way);
 
 		CreateLines(geom, vertices, maxele, way);
+		CreateHolesLines(geom, holes, maxele, way);
 	}
 }
 
@@ -446,90 +540,35 @@ static void CreateRoad(Geometry& geom, const VertexVector& vertices, float width
 }
 
 static void CreatePowerTower(Geometry& geom, const Vector3i& pos, const Vector3d& side) {
-	MetricBasis b(pos, side);
-
-	float w1 = 1.05;
-	float w2 = 0.5;
-	float h1 = 11.0;
-	float h2 = 21.0;
-	float h3 = 23.0;
-
-	/* lower section */
-	geom.AddQuad(b.Get(w1, w1, 0.0), b.Get(-w1, w1, 0.0), b.Get(-w2, w2, h1), b.Get(w2, w2, h1));
-	geom.AddQuad(b.Get(-w1, w1, 0.0), b.Get(-w1, -w1, 0.0), b.Get(-w2, -w2, h1), b.Get(-w2, w2, h1));
-	geom.AddQuad(b.Get(-w1, -w1, 0.0), b.Get(w1, -w1, 0.0), b.Get(w2, -w2, h1), b.Get(-w2, -w2, h1));
-	geom.AddQuad(b.Get(w1, -w1, 0.0), b.Get(w1, w1, 0.0), b.Get(w2, w2, h1), b.Get(w2, -w2, h1));
-
-	geom.AddLine(b.Get(w1, w1, 0.0), b.Get(-w1, w1, 0.0));
-	geom.AddLine(b.Get(-w1, w1, 0.0), b.Get(-w1, -w1, 0.0));
-	geom.AddLine(b.Get(-w1, -w1, 0.0), b.Get(w1, -w1, 0.0));
-	geom.AddLine(b.Get(w1, -w1, 0.0), b.Get(w1, w1, 0.0));
-
-	geom.AddLine(b.Get(-w1, w1, 0.0), b.Get(-w2, w2, h1));
-	geom.AddLine(b.Get(-w1, -w1, 0.0), b.Get(-w2, -w2, h1));
-	geom.AddLine(b.Get(w1, -w1, 0.0), b.Get(w2, -w2, h1));
-	geom.AddLine(b.Get(w1, w1, 0.0), b.Get(w2, w2, h1));
-
-	/* middle section */
-	geom.AddQuad(b.Get(w2, w2, h1), b.Get(-w2, w2, h1), b.Get(-w2, w2, h2), b.Get(w2, w2, h2));
-	geom.AddQuad(b.Get(-w2, w2, h1), b.Get(-w2, -w2, h1), b.Get(-w2, -w2, h2), b.Get(-w2, w2, h2));
-	geom.AddQuad(b.Get(-w2, -w2, h1), b.Get(w2, -w2, h1), b.Get(w2, -w2, h2), b.Get(-w2, -w2, h2));
-	geom.AddQuad(b.Get(w2, -w2, h1), b.Get(w2, w2, h1), b.Get(w2, w2, h2), b.Get(w2, -w2, h2));
-
-	geom.AddLine(b.Get(w2, w2, h1), b.Get(-w2, w2, h1));
-	geom.AddLine(b.Get(-w2, w2, h1), b.Get(-w2, -w2, h1));
-	geom.AddLine(b.Get(-w2, -w2, h1), b.Get(w2, -w2, h1));
-	geom.AddLine(b.Get(w2, -w2, h1), b.Get(w2, w2, h1));
-
-	geom.AddLine(b.Get(-w2, w2, h1), b.Get(-w2, w2, h2));
-	geom.AddLine(b.Get(-w2, -w2, h1), b.Get(-w2, -w2, h2));
-	geom.AddLine(b.Get(w2, -w2, h1), b.Get(w2, -w2, h2));
-	geom.AddLine(b.Get(w2, w2, h1), b.Get(w2, w2, h2));
-
-	/* top section */
-	geom.AddTriangle(b.Get(w2, w2, h2), b.Get(-w2, w2, h2), b.Get(0, 0, h3));
-	geom.AddTriangle(b.Get(-w2, w2, h2), b.Get(-w2, -w2, h2), b.Get(0, 0, h3));
-	geom.AddTriangle(b.Get(-w2, -w2, h2), b.Get(w2, -w2, h2), b.Get(0, 0, h3));
-	geom.AddTriangle(b.Get(w2, -w2, h2), b.Get(w2, w2, h2), b.Get(0, 0, h3));
-
-	geom.AddLine(b.Get(w2, w2, h2), b.Get(-w2, w2, h2));
-//	geom.AddLine(b.Get(-w2, w2, h2), b.Get(-w2, -w2, h2));
-	geom.AddLine(b.Get(-w2, -w2, h2), b.Get(w2, -w2, h2));
-//	geom.AddLine(b.Get(w2, -w2, h2), b.Get(w2, w2, h2));
-
-	geom.AddLine(b.Get(w2, w2, h2), b.Get(0, 0, h3));
-	geom.AddLine(b.Get(-w2, w2, h2), b.Get(0, 0, h3));
-	geom.AddLine(b.Get(-w2, -w2, h2), b.Get(0, 0, h3));
-	geom.AddLine(b.Get(w2, -w2, h2), b.Get(0, 0, h3));
-
-	/* arms */
-	for (int h = 14; h <= 21; h += 3) {
-		float l = (h == 17) ? 3.3 : 2.0;
-		geom.AddTriangle(b.Get(w2, -w2, h), b.Get(w2, w2, h), b.Get(l, 0.0, h));
-		geom.AddTriangle(b.Get(w2, -w2, h+1), b.Get(w2, -w2, h), b.Get(l, 0.0, h));
-		geom.AddTriangle(b.Get(w2, w2, h+1), b.Get(w2, -w2, h+1), b.Get(l, 0.0, h));
-		geom.AddTriangle(b.Get(w2, w2, h), b.Get(w2, w2, h+1), b.Get(l, 0.0, h));
-
-		geom.AddLine(b.Get(w2, -w2, h), b.Get(w2, w2, h));
-		geom.AddLine(b.Get(w2, -w2, h+1), b.Get(w2, w2, h+1));
-
-		geom.AddLine(b.Get(w2, w2, h), b.Get(l, 0.0, h));
-		geom.AddLine(b.Get(w2, -w2, h), b.Get(l, 0.0, h));
-		geom.AddLine(b.Get(w2, w2, h+1), b.Get(l, 0.0, h));
-		geom.AddLine(b.Get(w2, -w2, h+1), b.Get(l, 0.0, h));
-
-		geom.AddTriangle(b.Get(-w2, w2, h), b.Get(-w2, -w2, h), b.Get(-l, 0.0, h));
-		geom.AddTriangle(b.Get(-w2, -w2, h), b.Get(-w2, -w2, h+1), b.Get(-l, 0.0, h));
-		geom.AddTriangle(b.Get(-w2, -w2, h+1), b.Get(-w2, w2, h+1), b.Get(-l, 0.0, h));
-		geom.AddTriangle(b.Get(-w2, w2, h+1), b.Get(-w2, w2, h), b.Get(-l, 0.0, h));
-
-		geom.AddLine(b.Get(-w2, w2, h), b.Get(-l, 0.0, h));
-		geom.AddLine(b.Get(-w2, -w2, h), b.Get(-l, 0.0, h));
-		geom.AddLine(b.Get(-w2, w2, h+1), b.Get(-l, 0.0, h));
-		geom.AddLine(b.Get(-w2, -w2, h+1), b.Get(-l, 0.0, h));
-
-		geom.AddLine(b.Get(-w2, -w2, h), b.Get(-w2, w2, h));
-		geom.AddLine(b.Get(-w2, -w2, h+1), b.Get(-w2, w2, h+1));
+	/* towers are all the same, so only their placement is stored */
+	geom.AddInstance(Model::POWER_TOWER, pos, Vector2f(side.x, side.y));
+}
+
+/* model for a point of interest, or -1 if it's not drawn */
+static int GetNodeModel(const OsmDatasource::TaggedNode& node) {
+	strid_t value;
+
+	if (node.Get(STR_NATURAL) == STR_TREE)
+		return Model::TREE;
+	if (node.Get(STR_HIGHWAY) == STR_STREET_LAMP)
+		return Model::STREET_LAMP;
+	if ((value = node.Get(STR_MAN_MADE)) == STR_MAST || value == STR_TOWER)
+		return Model::MAST;
+
+	/* power=tower nodes are drawn by CreatePowerLine() */
+	return -1;
+}
+
+static void CreatePointsOfInterest(Geometry& geom, const std::vector<OsmDatasource::TaggedNode>& nodes, const BBoxi& bbox, const HeightmapDatasource& hmds) {
+	for (std::vector<OsmDatasource::TaggedNode>::const_iterator n = nodes.begin(); n != nodes.end(); ++n) {
+		/* same half-open tile bounds as Geometry::AppendCropped(),
+		 * so nodes on tile edges are only placed once */
+		if (n->Pos.x < bbox.left || n->Pos.x >= bbox.right || n->Pos.y < bbox.bottom || n->Pos.y >= bbox.top)
+			continue;
+
+		int model = GetNodeModel(*n);
+		if (model >= 0)
+			geom.AddInstance(model, Vector3i(n->Pos.x, n->Pos.y, hmds.GetHeight(n->Pos)), Vector2f(1.0f, 0.0f));
 	}
 }
 
@@ -599,139 +638,111 @@ static void CreatePowerLine(Geometry& geom, const VertexVector& vertices, const
 			CreateWire(geom, FromLocalMetric(Vector3d(0.0, 0.0, 23.0), vertices[i-1]), FromLocalMetric(Vector3d(0.0, 0.0, 23.0), vertices[i]));
 		}
 
-		/* Placeholder "tower" until models are added */
+		/* tower at each node, turned along the line */
 		CreatePowerTower(geom, vertices[i], side);
 
 		prev_side = side;
 	}
 }
 
-static float GetMaxHeight(const OsmDatasource::Way& way) {
-	OsmDatasource::TagsMap::const_iterator building, tag;
-
-	if ((tag = way.Tags.find("building:part:height")) != way.Tags.end()) {
-		/* building:part:height is topmost precedence (hack for Ostankino tower) */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("height")) != way.Tags.end()) {
-		/* explicit height - topmost precedence in all other cases */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("building:levels")) != way.Tags.end()) {
-		/* count level heights as 3 meters */
-		int levels = strtol(tag->second.c_str(), NULL, 10);
-		float h = 3.0 * levels;
-
-		/* also add 1 meter for basement for short buildings
-		 * (except for garages which doesn't have one) - should work
-		 * well in rural areas */
-		if (levels == 1 && (building = way.Tags.find("building")) != way.Tags.end() && building->second != "garages" && building->second != "garage")
-			h += 1.0;
+/* moves inner rings of an area out of outer ring vertices; holes
+ * are made counter-clockwise, so their walls face the courtyard */
+static void ExtractHoles(VertexVector& vertices, VertexRings& holes, const OsmDatasource::Way& way) {
+	size_t offset = way.Rings.front();
+	for (unsigned int r = 1; r < way.Rings.size() && offset + way.Rings[r] <= vertices.size(); offset += way.Rings[r++]) {
+		holes.push_back(VertexVector(vertices.begin() + offset, vertices.begin() + offset + way.Rings[r]));
 
-		return h;
+		VertexVector& hole = holes.back();
+		osmlong_t area = 0;
+		for (unsigned int i = 1; i < hole.size(); ++i)
+			area += ((osmlong_t)hole[i-1].x - hole[0].x) * ((osmlong_t)hole[i].y - hole[0].y) - ((osmlong_t)hole[i].x - hole[0].x) * ((osmlong_t)hole[i-1].y - hole[0].y);
+		if (area < 0)
+			std::reverse(hole.begin(), hole.end());
 	}
 
-	return 0.0;
+	vertices.resize(std::min((size_t)way.Rings.front(), vertices.size()));
 }
 
-static float GetMinHeight(const OsmDatasource::Way& way) {
-	OsmDatasource::TagsMap::const_iterator building, tag, tag1;
-
-	if ((tag = way.Tags.find("min_height")) != way.Tags.end()) {
-		/* explicit height - topmost precedence in all other cases */
-		return strtof(tag->second.c_str(), NULL);
-	} else if ((tag = way.Tags.find("building:min_level")) != way.Tags.end() || (tag = way.Tags.find("building:skipped_levels")) != way.Tags.end()) {
-		/* count level heights as 3 meters */
-		float h = 3.0 * strtol(tag->second.c_str(), NULL, 10);
-
-		/* in building:min_level scheme, levels are counted from zero, which may be fixed by building:ground_level... */
-		if (tag->first == "building:min_level" && (tag1 = way.Tags.find("building:ground_level")) != way.Tags.end())
-			h -= 3.0 * strtol(tag1->second.c_str(), NULL, 10);
-		/* ...while in my proposal (building:skipped_levels) everythng just works */
+/* outer ring of a way as stored, for sampling terrain under it */
+static void GetOuterRing(VertexVector& vertices, const OsmDatasource& datasource, const OsmDatasource::Way& way) {
+	vertices.clear();
+	if (way.GetCoordsCount() != 0) {
+		vertices.assign(way.GetCoordsBegin(), way.GetCoordsEnd());
+	} else {
+		vertices.reserve(way.GetNodesCount());
 
-		return h;
+		OsmDatasource::Way::NodeIterator iterator(way);
+		osmid_t id;
+		while (iterator.Next(id))
+			vertices.push_back(datasource.GetNode(id).Pos);
 	}
 
-	return 0.0;
+	if (!way.Rings.empty())
+		vertices.resize(std::min((size_t)way.Rings.front(), vertices.size()));
 }
 
-static int GetHighwayLanes(const std::string& highway, const OsmDatasource::Way& way) {
-	OsmDatasource::TagsMap::const_iterator tag;
-
-	/* explicitely tagged lanes have top */
-	if ((tag = way.Tags.find("lanes")) != way.Tags.end())
-		return strtol(tag->second.c_str(), NULL, 10);
-
-	bool oneway = false;
-	if ((tag = way.Tags.find("oneway")) != way.Tags.end() && tag->second != "no")
-		oneway = true;
-
-	/* motorway assumes one-way */
-	if (highway == "motorway" || highway == "motorway_link")
-		oneway = true;
-
-	if (highway == "service" || highway == "track") {
-		return 1;
-	} else if (highway == "residential") {
-		return 2;
+/* elevation is precomputed one for buildings, if any, otherwise
+ * terrain is sampled under generated vertices */
+static void WayDispatcher(Geometry& geom, WayScratch& scratch, const OsmDatasource& datasource, HeightmapDatasource& hmds, const std::pair<osmint_t, osmint_t>* elevation, int flags, osmint_t tolerance, const OsmDatasource::Way& way) {
+	osmint_t minz = way.MinHeight;
+	osmint_t maxz = way.MaxHeight;
+
+	VertexVector& vertices = scratch.vertices;
+	VertexRings& holes = scratch.holes;
+	vertices.clear();
+	holes.clear();
+
+	if (way.GetCoordsCount() != 0 && way.Rings.empty()) {
+		if (way.Clockwise)
+			vertices.assign(way.GetCoordsBegin(), way.GetCoordsEnd());
+		else
+			vertices.assign(std::reverse_iterator<const Vector2i*>(way.GetCoordsEnd()), std::reverse_iterator<const Vector2i*>(way.GetCoordsBegin()));
 	} else {
-		return oneway ? 2 : 4;
-	}
-}
+		if (way.GetCoordsCount() != 0) {
+			vertices.assign(way.GetCoordsBegin(), way.GetCoordsEnd());
+		} else {
+			vertices.reserve(way.GetNodesCount());
 
-static float GetHighwayWidth(const std::string& highway, const OsmDatasource::Way& way) {
-	OsmDatasource::TagsMap::const_iterator tag;
+			OsmDatasource::Way::NodeIterator iterator(way);
+			osmid_t id;
+			while (iterator.Next(id))
+				vertices.push_back(datasource.GetNode(id).Pos);
+		}
 
-	/* explicitely tagged lanes have top */
-	if ((tag = way.Tags.find("width")) != way.Tags.end())
-		return strtof(tag->second.c_str(), NULL);
+		if (!way.Rings.empty())
+			ExtractHoles(vertices, holes, way);
 
-	if (highway == "path") {
-		return 0.5f;
-	} else if (highway == "footway" || highway == "steps") {
-		return 2.0f;
-	} else if (highway == "pedestrian") {
-		return 3.0f;
-	} else {
-		return GetHighwayLanes(highway, way) * 3.5f; /* likely 4 is closer to truth */
+		/* packed refs can only be read forward */
+		if (!way.Clockwise)
+			std::reverse(vertices.begin(), vertices.end());
 	}
-}
-
-static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, HeightmapDatasource& hmds, int flags, const OsmDatasource::Way& way) {
-	osmint_t minz = GetMinHeight(way) * GEOM_UNITSINMETER;
-	osmint_t maxz = GetMaxHeight(way) * GEOM_UNITSINMETER;
 
-	if (minz < 0)
-		minz = 0;
-	if (maxz < minz) {
-		fprintf(stderr, "warning: max height < min height for object\n");
-		maxz = minz = 0;
+	if (tolerance > 0) {
+		SimplifyPolyline(vertices, tolerance);
+		for (VertexRings::iterator hole = holes.begin(); hole != holes.end(); ++hole)
+			SimplifyPolyline(*hole, tolerance);
 	}
 
-	OsmDatasource::TagsMap::const_iterator t;
-
-	VertexVector vertices;
-	vertices.reserve(way.Nodes.size());
-
-	if (way.Clockwise)
-		for (OsmDatasource::Way::NodesList::const_iterator n = way.Nodes.begin(); n != way.Nodes.end(); ++n)
-			vertices.push_back(datasource.GetNode(*n).Pos);
-	else
-		for (OsmDatasource::Way::NodesList::const_reverse_iterator n = way.Nodes.rbegin(); n != way.Nodes.rend(); ++n)
-			vertices.push_back(datasource.GetNode(*n).Pos);
-
-	/* dispatch */
-	if ((way.Tags.find("building") != way.Tags.end() || way.Tags.find("building:part") != way.Tags.end()) && minz != maxz) {
+	/* dispatch; see ClassifyWay() for how classes are assigned */
+	switch (way.Class) {
+	case OsmDatasource::Way::BUILDING:
 		if (flags & GeometryDatasource::DETAIL)
-			CreateBuilding(geom, hmds, vertices, minz, maxz, way);
-	} else if ((t = way.Tags.find("man_made")) != way.Tags.end() && (t->second == "tower" || t->second == "chimney") && minz != maxz) {
+			CreateBuilding(geom, scratch, elevation ? *elevation : SampleElevationRange(hmds, vertices, scratch.heights), vertices, holes, minz, maxz, way);
+		break;
+	case OsmDatasource::Way::TOWER:
 		if (flags & GeometryDatasource::DETAIL) {
 			CreateWalls(geom, vertices, minz, maxz, way);
-			CreateArea(geom, vertices, false, maxz, way);
+			CreateHolesWalls(geom, holes, minz, maxz, way);
+			CreateArea(geom, scratch, vertices, holes, false, maxz, way);
 
 			CreateLines(geom, vertices, minz, way);
 			CreateLines(geom, vertices, maxz, way);
+			CreateHolesLines(geom, holes, minz, way);
+			CreateHolesLines(geom, holes, maxz, way);
 			CreateSmartVerticalLines(geom, vertices, minz, maxz, 5.0, way);
 		}
-	} else if (way.Tags.find("barrier") != way.Tags.end()) {
+		break;
+	case OsmDatasource::Way::BARRIER:
 		if (flags & GeometryDatasource::DETAIL) {
 			if (maxz == minz)
 				maxz += 2 * GEOM_UNITSINMETER;
@@ -741,57 +752,126 @@ static void WayDispatcher(Geometry& geom, const OsmDatasource& datasource, Heigh
 			CreateLines(geom, vertices, maxz, way);
 			CreateVerticalLines(geom, vertices, minz, maxz, way);
 		}
-	} else if ((t = way.Tags.find("highway")) != way.Tags.end()) {
-		if (flags & GeometryDatasource::DETAIL) {
-			OsmDatasource::TagsMap::const_iterator t1;
-
-			if ((t1 = way.Tags.find("area")) != way.Tags.end() && t1->second != "no") {
-				/* area */
-				CreateArea(geom, vertices, false, 0, way);
-			} else {
-				CreateRoad(geom, vertices, GetHighwayWidth(t->second, way), way);
-			}
-		} else if ((flags & GeometryDatasource::GROUND) && (
-				t->second == "motorway" || t->second == "motorway_link" ||
-				t->second == "trunk" || t->second == "trunk_link" ||
-				t->second == "primary" || t->second == "primary_link" ||
-				t->second == "secondary" || t->second == "secondary_link" ||
-				t->second == "tertiary")) {
-			CreateLines(geom, vertices, minz, way);
-		}
-	} else if ((t = way.Tags.find("railway")) != way.Tags.end() && (t->second == "rail")) {
+		break;
+	case OsmDatasource::Way::HIGHWAY:
+	case OsmDatasource::Way::MAJOR_HIGHWAY:
+	case OsmDatasource::Way::HIGHWAY_AREA:
+	case OsmDatasource::Way::MAJOR_HIGHWAY_AREA:
 		if (flags & GeometryDatasource::DETAIL) {
+			if (way.Class == OsmDatasource::Way::HIGHWAY_AREA || way.Class == OsmDatasource::Way::MAJOR_HIGHWAY_AREA)
+				CreateArea(geom, scratch, vertices, holes, false, 0, way);
+			else
+				CreateRoad(geom, vertices, way.Width, way);
+		} else if ((flags & GeometryDatasource::GROUND) && (way.Class == OsmDatasource::Way::MAJOR_HIGHWAY || way.Class == OsmDatasource::Way::MAJOR_HIGHWAY_AREA)) {
 			CreateLines(geom, vertices, minz, way);
-		} else if (flags & GeometryDatasource::GROUND) {
-			if (t->second == "rail")
-				CreateLines(geom, vertices, minz, way);
+			CreateHolesLines(geom, holes, minz, way);
 		}
-	} else if ((t = way.Tags.find("boundary")) != way.Tags.end() && (t->second == "administrative")) {
-		if (flags & GeometryDatasource::GROUND)
+		break;
+	case OsmDatasource::Way::RAILWAY:
+		if (flags & (GeometryDatasource::DETAIL | GeometryDatasource::GROUND))
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("waterway")) != way.Tags.end()) {
-		if (flags & GeometryDatasource::GROUND)
+		break;
+	case OsmDatasource::Way::BOUNDARY:
+	case OsmDatasource::Way::WATERWAY:
+	case OsmDatasource::Way::NATURAL:
+	case OsmDatasource::Way::LANDUSE:
+		if (flags & GeometryDatasource::GROUND) {
 			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("natural")) != way.Tags.end()) {
-		if (flags & GeometryDatasource::GROUND)
-			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("landuse")) != way.Tags.end()) {
-		if (flags & GeometryDatasource::GROUND)
-			CreateLines(geom, vertices, minz, way);
-	} else if ((t = way.Tags.find("power")) != way.Tags.end() && (t->second == "line")) {
+			CreateHolesLines(geom, holes, minz, way);
+		}
+		break;
+	case OsmDatasource::Way::POWER_LINE:
 		if (flags & GeometryDatasource::DETAIL)
 			CreatePowerLine(geom, vertices, way);
-	} else {
+		break;
+	default:
 		if (flags & GeometryDatasource::DETAIL)
 			CreateLines(geom, vertices, minz, way);
+		break;
 	}
 }
 
-GeometryGenerator::GeometryGenerator(const OsmDatasource& datasource, HeightmapDatasource& heightmapds) : datasource_(datasource), heightmap_ds_(heightmapds) {
+/* enough for ways shared by tiles loaded around the viewer */
+static const size_t DEFAULT_WAY_CACHE_LIMIT = 16 * 1024 * 1024;
+
+static size_t GetGeometrySize(const Geometry& geometry) {
+	return (geometry.GetLinesVertices().size() + geometry.GetConvexVertices().size()) * sizeof(Vector3i) +
+		(geometry.GetLinesLengths().size() + geometry.GetConvexLengths().size()) * sizeof(int) +
+		geometry.GetInstances().size() * sizeof(Geometry::Instance);
+}
+
+/* range of ways processed by a GenerateWays() thread */
+struct GeometryGenerator::GenerateTask {
+	const GeometryGenerator* owner;
+	const OsmDatasource* datasource;
+	HeightmapDatasource* heightmap_ds;
+	int flags;
+	osmint_t tolerance;
+
+	/* ways generated into common per-task geometry */
+	const OsmDatasource::Way* const* local_begin;
+	const OsmDatasource::Way* const* local_end;
+
+	/* ways generated into separate geometries for caching */
+	const OsmDatasource::Way* const* shared_begin;
+	const OsmDatasource::Way* const* shared_end;
+	Geometry* shared_out;
+
+	Geometry geometry;
+	WayScratch scratch;
+};
+
+/* buffers of a thread requesting geometry, reused between requests */
+struct GeometryGenerator::Scratch {
+	const GeometryGenerator* owner;
+
+	WayVector ways;
+	WayVector local;
+	WayVector shared;
+	std::vector<OsmDatasource::TaggedNode> nodes;
+	Geometry temp;
+	std::vector<Geometry> generated;
+	std::vector<GenerateTask> tasks;
+
+	/* size of previous output, as reserve hint for next one */
+	size_t lines_vertices;
+	size_t lines;
+	size_t convex_vertices;
+	size_t convexes;
+
+	Scratch(const GeometryGenerator* o) : owner(o), lines_vertices(0), lines(0), convex_vertices(0), convexes(0) {
+	}
+};
+
+GeometryGenerator::GeometryGenerator(const OsmDatasource& datasource, HeightmapDatasource& heightmapds) : datasource_(datasource), heightmap_ds_(heightmapds), way_cache_size_(0), way_cache_limit_(DEFAULT_WAY_CACHE_LIMIT), nthreads_(1) {
+	int errn;
+
+	if ((errn = pthread_mutex_init(&way_cache_mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_key_create(&scratch_key_, DestroyScratch)) != 0) {
+		pthread_mutex_destroy(&way_cache_mutex_);
+		throw SystemError(errn) << "pthread_key_create failed";
+	}
+}
+
+GeometryGenerator::~GeometryGenerator() {
+	/* no destructors are called after this, so remaining
+	 * scratches are freed here */
+	pthread_key_delete(scratch_key_);
+	for (ScratchVector::iterator i = scratches_.begin(); i != scratches_.end(); ++i)
+		delete *i;
+
+	pthread_mutex_destroy(&way_cache_mutex_);
 }
 
 void GeometryGenerator::GetGeometry(Geometry& geom, const BBoxi& bbox, int flags) const {
-	std::vector<OsmDatasource::Way> ways;
+	TRACE_SCOPE("GeometryGenerator::GetGeometry");
+
+	Scratch& scratch = GetScratch();
+	WayVector& ways = scratch.ways;
+	ways.clear();
+	Timer timer;
 
 	/* safe bbox is a bit wider than requested one to be sure
 	 * all ways are included, even those which have width */
@@ -800,14 +880,350 @@ void GeometryGenerator::GetGeometry(Geometry& geom, const BBoxi& bbox, int flags
 			FromLocalMetric(-Vector2d(extra_width, extra_width), bbox.GetBottomLeft()),
 			FromLocalMetric(Vector2d(extra_width, extra_width), bbox.GetTopRight())
 		);
-	datasource_.GetWays(ways, safe_bbox);
 
-	Geometry temp;
+	/* low detail tiles only need ground ways, so these may come
+	 * from generalized overview layer of tile level */
+	if ((flags & SIMPLIFY) && !(flags & DETAIL)) {
+		int level = (int)floor(log((double)GEOM_LONSPAN / std::max((osmlong_t)1, (osmlong_t)bbox.right - bbox.left)) / log(2.0) + 0.5);
+		datasource_.GetOverviewWays(ways, safe_bbox, level);
+	} else {
+		datasource_.GetWays(ways, safe_bbox);
+	}
+
+	float get_ways_time = timer.Count();
+
+	/* ways within inner bbox are not reached by safe bboxes of
+	 * neighbouring tiles, so there's no point in caching these */
+	BBoxi inner_bbox = BBoxi(
+			FromLocalMetric(Vector2d(extra_width, extra_width), bbox.GetBottomLeft()),
+			FromLocalMetric(-Vector2d(extra_width, extra_width), bbox.GetTopRight())
+		);
+
+	/* same for all tiles of a level, so cache entries are shared */
+	osmint_t tolerance = (flags & SIMPLIFY) ? GetSimplifyTolerance((osmlong_t)bbox.right - bbox.left) : 0;
+
+	Geometry& temp = scratch.temp;
+	WayVector& local = scratch.local;
+	WayVector& shared = scratch.shared;
+	temp.Clear();
+	local.clear();
+	shared.clear();
 
-	for (std::vector<OsmDatasource::Way>::const_iterator w = ways.begin(); w != ways.end(); ++w)
-		WayDispatcher(temp, datasource_, heightmap_ds_, flags, *w);
+	{
+		Guard guard(way_cache_mutex_);
+
+		for (WayVector::const_iterator w = ways.begin(); w != ways.end(); ++w) {
+			const BBoxi& way_bbox = (*w)->BBox;
+			if (way_cache_limit_ == 0 || (way_bbox.left > inner_bbox.left && way_bbox.right < inner_bbox.right && way_bbox.bottom > inner_bbox.bottom && way_bbox.top < inner_bbox.top)) {
+				local.push_back(*w);
+				continue;
+			}
+
+			WayEntryMap::iterator entry = way_cache_.find(WayKey(*w, WayVariant(flags, tolerance)));
+			if (entry != way_cache_.end()) {
+				way_lru_.splice(way_lru_.begin(), way_lru_, entry->second.lru);
+				temp.Append(entry->second.geometry);
+			} else {
+				shared.push_back(*w);
+			}
+		}
+	}
+
+	/* generate without lock, so other threads are not blocked */
+	std::vector<Geometry>& generated = scratch.generated;
+	generated.resize(shared.size());
+	for (std::vector<Geometry>::iterator i = generated.begin(); i != generated.end(); ++i)
+		i->Clear();
+	GenerateWays(scratch, flags, tolerance);
+
+	float generate_time = timer.Count();
+
+	/* neighbouring tiles are usually of similar size */
+	size_t lines_vertices = geom.GetLinesVertices().size();
+	size_t lines = geom.GetLinesLengths().size();
+	size_t convex_vertices = geom.GetConvexVertices().size();
+	size_t convexes = geom.GetConvexLengths().size();
+
+	/* if output is empty, first part is cropped in place and
+	 * handed over instead of being copied; that's local ways
+	 * which make most of a tile, unless there were cached ones.
+	 * Moved-from part gets storage reserved for the next tile */
+	Geometry& first = (temp.GetLinesLengths().empty() && temp.GetConvexLengths().empty() && temp.GetInstances().empty()) ? scratch.tasks[0].geometry : temp;
+	if (lines == 0 && convexes == 0 && geom.GetInstances().empty()) {
+		geom.MoveCropped(first, bbox);
+		first.Reserve(scratch.lines_vertices, scratch.lines, scratch.convex_vertices, scratch.convexes);
+	} else {
+		geom.Reserve(lines_vertices + scratch.lines_vertices, lines + scratch.lines, convex_vertices + scratch.convex_vertices, convexes + scratch.convexes);
+	}
 
 	geom.AppendCropped(temp, bbox);
+	for (size_t i = 0; i < scratch.tasks.size(); ++i)
+		geom.AppendCropped(scratch.tasks[i].geometry, bbox);
+	for (size_t i = 0; i < generated.size(); ++i)
+		geom.AppendCropped(generated[i], bbox);
+
+	/* points of interest are single instances, so these are
+	 * neither cached nor cropped */
+	if (flags & DETAIL) {
+		scratch.nodes.clear();
+		datasource_.GetTaggedNodes(scratch.nodes, bbox);
+		CreatePointsOfInterest(geom, scratch.nodes, bbox, heightmap_ds_);
+	}
+
+	scratch.lines_vertices = geom.GetLinesVertices().size() - lines_vertices;
+	scratch.lines = geom.GetLinesLengths().size() - lines;
+	scratch.convex_vertices = geom.GetConvexVertices().size() - convex_vertices;
+	scratch.convexes = geom.GetConvexLengths().size() - convexes;
+
+	float crop_time = timer.Count();
+
+	{
+		Guard guard(way_cache_mutex_);
+
+		stats_.requests++;
+		stats_.ways += ways.size();
+		stats_.cached_ways += ways.size() - local.size() - shared.size();
+		stats_.get_ways_time += get_ways_time;
+		stats_.generate_time += generate_time;
+		stats_.crop_time += crop_time;
+
+		for (size_t i = 0; i < shared.size(); ++i) {
+			size_t size = GetGeometrySize(generated[i]);
+			if (size == 0 || size > way_cache_limit_)
+				continue;
+
+			/* may've been inserted by concurrent request */
+			std::pair<WayEntryMap::iterator, bool> inserted = way_cache_.insert(std::make_pair(WayKey(shared[i], WayVariant(flags, tolerance)), WayEntry()));
+			if (!inserted.second)
+				continue;
+
+			WayEntry& entry = inserted.first->second;
+			entry.geometry = generated[i];
+			entry.size = size;
+			entry.bbox = shared[i]->BBox;
+			entry.lru = way_lru_.insert(way_lru_.begin(), inserted.first->first);
+			way_cache_size_ += size;
+		}
+
+		EvictWays();
+	}
+}
+
+
+void GeometryGenerator::RunGenerateTask(GenerateTask& task) {
+	for (const OsmDatasource::Way* const* w = task.local_begin; w != task.local_end; ++w)
+		WayDispatcher(task.geometry, task.scratch, *task.datasource, *task.heightmap_ds, task.owner->FindElevation(**w), task.flags, task.tolerance, **w);
+
+	Geometry* out = task.shared_out;
+	for (const OsmDatasource::Way* const* w = task.shared_begin; w != task.shared_end; ++w)
+		WayDispatcher(*out++, task.scratch, *task.datasource, *task.heightmap_ds, task.owner->FindElevation(**w), task.flags, task.tolerance, **w);
+}
+
+void GeometryGenerator::GenerateWays(Scratch& scratch, int flags, osmint_t tolerance) const {
+	const WayVector& local = scratch.local;
+	const WayVector& shared = scratch.shared;
+	std::vector<Geometry>& generated = scratch.generated;
+
+	size_t nways = local.size() + shared.size();
+	size_t nthreads = std::max((size_t)1, std::min((size_t)nthreads_, nways / MIN_WAYS_PER_THREAD));
+
+	/* tasks keep their buffers between calls */
+	std::vector<GenerateTask>& tasks = scratch.tasks;
+	if (tasks.size() < nthreads)
+		tasks.resize(nthreads);
+	for (size_t i = nthreads; i < tasks.size(); ++i)
+		tasks[i].geometry.Clear();
+	for (size_t i = 0; i < nthreads; ++i) {
+		tasks[i].geometry.Clear();
+		tasks[i].owner = this;
+		tasks[i].datasource = &datasource_;
+		tasks[i].heightmap_ds = &heightmap_ds_;
+		tasks[i].flags = flags;
+		tasks[i].tolerance = tolerance;
+
+		size_t local_begin = local.size() * i / nthreads, local_end = local.size() * (i + 1) / nthreads;
+		tasks[i].local_begin = local.empty() ? NULL : &local[0] + local_begin;
+		tasks[i].local_end = local.empty() ? NULL : &local[0] + local_end;
+
+		size_t shared_begin = shared.size() * i / nthreads, shared_end = shared.size() * (i + 1) / nthreads;
+		tasks[i].shared_begin = shared.empty() ? NULL : &shared[0] + shared_begin;
+		tasks[i].shared_end = shared.empty() ? NULL : &shared[0] + shared_end;
+		tasks[i].shared_out = shared.empty() ? NULL : &generated[0] + shared_begin;
+	}
+
+	RunParallel(&tasks[0], nthreads, RunGenerateTask);
+}
+
+struct GeometryGenerator::ElevationTask {
+	const OsmDatasource* datasource;
+	const HeightmapDatasource* heightmap_ds;
+
+	WayElevation* begin;
+	WayElevation* end;
+};
+
+void GeometryGenerator::RunElevationTask(ElevationTask& task) {
+	VertexVector vertices;
+	std::vector<osmint_t> heights;
+	for (WayElevation* e = task.begin; e != task.end; ++e) {
+		GetOuterRing(vertices, *task.datasource, *e->first);
+		e->second = SampleElevationRange(*task.heightmap_ds, vertices, heights);
+	}
+}
+
+const GeometryGenerator::ElevationRange* GeometryGenerator::FindElevation(const OsmDatasource::Way& way) const {
+	if (elevations_.empty() || way.Class != OsmDatasource::Way::BUILDING)
+		return NULL;
+
+	WayElevationVector::const_iterator e = std::lower_bound(elevations_.begin(), elevations_.end(), WayElevation(&way, ElevationRange(std::numeric_limits<osmint_t>::min(), std::numeric_limits<osmint_t>::min())));
+	if (e == elevations_.end() || e->first != &way)
+		return NULL;
+
+	return &e->second;
+}
+
+GeometryGenerator::Scratch& GeometryGenerator::GetScratch() const {
+	Scratch* scratch = static_cast<Scratch*>(pthread_getspecific(scratch_key_));
+	if (scratch != NULL)
+		return *scratch;
+
+	scratch = new Scratch(this);
+	{
+		Guard guard(way_cache_mutex_);
+		scratches_.push_back(scratch);
+	}
+
+	int errn;
+	if ((errn = pthread_setspecific(scratch_key_, scratch)) != 0)
+		throw SystemError(errn) << "pthread_setspecific failed";
+
+	return *scratch;
+}
+
+void GeometryGenerator::DestroyScratch(void* arg) {
+	Scratch* scratch = static_cast<Scratch*>(arg);
+
+	{
+		Guard guard(scratch->owner->way_cache_mutex_);
+		ScratchVector& scratches = scratch->owner->scratches_;
+		scratches.erase(std::find(scratches.begin(), scratches.end(), scratch));
+	}
+
+	delete scratch;
+}
+
+void GeometryGenerator::EvictWays() const {
+	while (way_cache_size_ > way_cache_limit_ && !way_lru_.empty()) {
+		WayEntryMap::iterator entry = way_cache_.find(way_lru_.back());
+		way_cache_size_ -= entry->second.size;
+		way_cache_.erase(entry);
+		way_lru_.pop_back();
+	}
+}
+
+void GeometryGenerator::SetWayCacheLimit(size_t limit) {
+	Guard guard(way_cache_mutex_);
+	way_cache_limit_ = limit;
+	EvictWays();
+}
+
+void GeometryGenerator::SetThreads(int nthreads) {
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	nthreads_ = nthreads;
+}
+
+void GeometryGenerator::PrecomputeElevations(int nthreads) {
+	TRACE_SCOPE("GeometryGenerator::PrecomputeElevations");
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	WayVector ways;
+	datasource_.GetWays(ways, BBoxi::ForEarth());
+
+	WayElevationVector elevations;
+	for (WayVector::const_iterator w = ways.begin(); w != ways.end(); ++w)
+		if ((*w)->Class == OsmDatasource::Way::BUILDING)
+			elevations.push_back(WayElevation(*w, ElevationRange(0, 0)));
+
+	/* ways may be returned more than once by some datasources */
+	std::sort(elevations.begin(), elevations.end());
+	elevations.erase(std::unique(elevations.begin(), elevations.end()), elevations.end());
+
+	size_t nbuildings = elevations.size();
+	size_t ntasks = std::max((size_t)1, std::min((size_t)nthreads, nbuildings / MIN_WAYS_PER_THREAD));
+
+	std::vector<ElevationTask> tasks(ntasks);
+	for (size_t i = 0; i < ntasks; ++i) {
+		tasks[i].datasource = &datasource_;
+		tasks[i].heightmap_ds = &heightmap_ds_;
+		tasks[i].begin = elevations.empty() ? NULL : &elevations[0] + nbuildings * i / ntasks;
+		tasks[i].end = elevations.empty() ? NULL : &elevations[0] + nbuildings * (i + 1) / ntasks;
+	}
+
+	RunParallel(tasks, RunElevationTask);
+
+	elevations_.swap(elevations);
+}
+
+void GeometryGenerator::InvalidateWays(const BBoxi& bbox) {
+	{
+		Guard guard(way_cache_mutex_);
+
+		for (WayLruList::iterator i = way_lru_.begin(); i != way_lru_.end(); ) {
+			WayEntryMap::iterator entry = way_cache_.find(*i);
+			if (entry->second.bbox.Intersects(bbox)) {
+				way_cache_size_ -= entry->second.size;
+				way_cache_.erase(entry);
+				i = way_lru_.erase(i);
+			} else {
+				++i;
+			}
+		}
+	}
+
+	if (elevations_.empty())
+		return;
+
+	/* changed ways have new bbox already, and deleted ones are
+	 * no longer buildings */
+	WayElevationVector elevations;
+	for (WayElevationVector::const_iterator e = elevations_.begin(); e != elevations_.end(); ++e)
+		if (e->first->Class == OsmDatasource::Way::BUILDING && !e->first->BBox.Intersects(bbox))
+			elevations.push_back(*e);
+
+	WayVector ways;
+	datasource_.GetWays(ways, bbox);
+
+	VertexVector vertices;
+	std::vector<osmint_t> heights;
+	for (WayVector::const_iterator w = ways.begin(); w != ways.end(); ++w) {
+		if ((*w)->Class != OsmDatasource::Way::BUILDING)
+			continue;
+		GetOuterRing(vertices, datasource_, **w);
+		elevations.push_back(WayElevation(*w, SampleElevationRange(heightmap_ds_, vertices, heights)));
+	}
+
+	std::sort(elevations.begin(), elevations.end());
+	elevations.erase(std::unique(elevations.begin(), elevations.end()), elevations.end());
+
+	elevations_.swap(elevations);
+}
+
+size_t GeometryGenerator::GetWayCacheSize() const {
+	Guard guard(way_cache_mutex_);
+	return way_cache_size_;
+}
+
+void GeometryGenerator::GetStatistics(Statistics& stats) const {
+	Guard guard(way_cache_mutex_);
+	stats = stats_;
 }
 
 Vector2i GeometryGenerator::GetCenter() const {
@@ -0,0 +1,656 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/Triangulator.hh>
+
+#include <glosm/BBox.hh>
+
+#include <algorithm>
+#include <deque>
+#include <cmath>
+
+/* polygons with more vertices use z-order hashing */
+static const size_t HASH_THRESHOLD = 80;
+
+struct EarcutNode {
+	unsigned int i; /* index in input array */
+	double x, y; /* relative to outer ring bbox corner */
+
+	/* polygon ring */
+	EarcutNode* prev;
+	EarcutNode* next;
+
+	/* z-order curve, sorted by z */
+	unsigned int z;
+	EarcutNode* prevz;
+	EarcutNode* nextz;
+
+	/* hole which was reduced to a single point */
+	bool steiner;
+
+	EarcutNode(unsigned int idx, double px, double py) : i(idx), x(px), y(py), prev(NULL), next(NULL), z(0), prevz(NULL), nextz(NULL), steiner(false) {
+	}
+};
+
+/* doubled signed area of triangle, negative for counter-clockwise */
+static inline double Area(const EarcutNode* p, const EarcutNode* q, const EarcutNode* r) {
+	return (q->y - p->y) * (r->x - q->x) - (q->x - p->x) * (r->y - q->y);
+}
+
+static inline bool Equals(const EarcutNode* a, const EarcutNode* b) {
+	return a->x == b->x && a->y == b->y;
+}
+
+static inline int Sign(double value) {
+	return (value > 0.0) - (value < 0.0);
+}
+
+/* for collinear p, q, r: checks whether q lies on segment pr */
+static inline bool OnSegment(const EarcutNode* p, const EarcutNode* q, const EarcutNode* r) {
+	return q->x <= std::max(p->x, r->x) && q->x >= std::min(p->x, r->x) && q->y <= std::max(p->y, r->y) && q->y >= std::min(p->y, r->y);
+}
+
+static bool Intersects(const EarcutNode* p1, const EarcutNode* q1, const EarcutNode* p2, const EarcutNode* q2) {
+	int o1 = Sign(Area(p1, q1, p2));
+	int o2 = Sign(Area(p1, q1, q2));
+	int o3 = Sign(Area(p2, q2, p1));
+	int o4 = Sign(Area(p2, q2, q1));
+
+	if (o1 != o2 && o3 != o4)
+		return true;
+
+	return (o1 == 0 && OnSegment(p1, p2, q1)) || (o2 == 0 && OnSegment(p1, q2, q1)) ||
+		(o3 == 0 && OnSegment(p2, p1, q2)) || (o4 == 0 && OnSegment(p2, q1, q2));
+}
+
+static inline bool PointInTriangle(double ax, double ay, double bx, double by, double cx, double cy, double px, double py) {
+	return (cx - px) * (ay - py) >= (ax - px) * (cy - py) &&
+		(ax - px) * (by - py) >= (bx - px) * (ay - py) &&
+		(bx - px) * (cy - py) >= (cx - px) * (by - py);
+}
+
+/* checks whether diagonal ab is inside polygon near a */
+static bool LocallyInside(const EarcutNode* a, const EarcutNode* b) {
+	if (Area(a->prev, a, a->next) < 0.0)
+		return Area(a, b, a->next) >= 0.0 && Area(a, a->prev, b) >= 0.0;
+	else
+		return Area(a, b, a->prev) < 0.0 || Area(a, a->next, b) < 0.0;
+}
+
+/* checks whether middle of diagonal ab is inside polygon */
+static bool MiddleInside(const EarcutNode* a, const EarcutNode* b) {
+	const EarcutNode* p = a;
+	bool inside = false;
+	double px = (a->x + b->x) / 2.0;
+	double py = (a->y + b->y) / 2.0;
+	do {
+		if (((p->y > py) != (p->next->y > py)) && p->next->y != p->y && (px < (p->next->x - p->x) * (py - p->y) / (p->next->y - p->y) + p->x))
+			inside = !inside;
+		p = p->next;
+	} while (p != a);
+	return inside;
+}
+
+/* checks whether diagonal ab intersects any polygon edge */
+static bool IntersectsPolygon(const EarcutNode* a, const EarcutNode* b) {
+	const EarcutNode* p = a;
+	do {
+		if (p->i != a->i && p->next->i != a->i && p->i != b->i && p->next->i != b->i && Intersects(p, p->next, a, b))
+			return true;
+		p = p->next;
+	} while (p != a);
+	return false;
+}
+
+/* checks whether diagonal ab may split polygon */
+static bool IsValidDiagonal(const EarcutNode* a, const EarcutNode* b) {
+	if (a->next->i == b->i || a->prev->i == b->i || IntersectsPolygon(a, b))
+		return false;
+
+	/* locally visible, and not collinear with neighbours */
+	if (LocallyInside(a, b) && LocallyInside(b, a) && MiddleInside(a, b) && (Area(a->prev, a, b->prev) != 0.0 || Area(a, b->prev, b) != 0.0))
+		return true;
+
+	/* special zero-length case */
+	return Equals(a, b) && Area(a->prev, a, a->next) > 0.0 && Area(b->prev, b, b->next) > 0.0;
+}
+
+/* checks whether sector of m contains sector of p */
+static inline bool SectorContainsSector(const EarcutNode* m, const EarcutNode* p) {
+	return Area(m->prev, m, p->prev) < 0.0 && Area(p->next, m, m->next) < 0.0;
+}
+
+static void RemoveNode(EarcutNode* p) {
+	p->next->prev = p->prev;
+	p->prev->next = p->next;
+
+	if (p->prevz)
+		p->prevz->nextz = p->nextz;
+	if (p->nextz)
+		p->nextz->prevz = p->prevz;
+}
+
+static EarcutNode* GetLeftmost(EarcutNode* start) {
+	EarcutNode* p = start;
+	EarcutNode* leftmost = start;
+	do {
+		if (p->x < leftmost->x || (p->x == leftmost->x && p->y < leftmost->y))
+			leftmost = p;
+		p = p->next;
+	} while (p != start);
+	return leftmost;
+}
+
+struct EarcutNodeXLess {
+	bool operator()(const EarcutNode* a, const EarcutNode* b) const {
+		return a->x < b->x;
+	}
+};
+
+/* interleaves bits of coordinates scaled to 15 bits */
+static inline unsigned int ZOrder(double x, double y, double inv_size) {
+	unsigned int ix = (unsigned int)(x * inv_size);
+	unsigned int iy = (unsigned int)(y * inv_size);
+
+	ix = (ix | (ix << 8)) & 0x00FF00FF;
+	ix = (ix | (ix << 4)) & 0x0F0F0F0F;
+	ix = (ix | (ix << 2)) & 0x33333333;
+	ix = (ix | (ix << 1)) & 0x55555555;
+
+	iy = (iy | (iy << 8)) & 0x00FF00FF;
+	iy = (iy | (iy << 4)) & 0x0F0F0F0F;
+	iy = (iy | (iy << 2)) & 0x33333333;
+	iy = (iy | (iy << 1)) & 0x55555555;
+
+	return ix | (iy << 1);
+}
+
+/* merge sort of z-order list by z (Simon Tatham's algorithm) */
+static void SortLinked(EarcutNode* list) {
+	int insize = 1;
+	int nmerges;
+	do {
+		EarcutNode* p = list;
+		EarcutNode* tail = NULL;
+		list = NULL;
+		nmerges = 0;
+
+		while (p) {
+			nmerges++;
+			EarcutNode* q = p;
+			int psize = 0;
+			for (int i = 0; i < insize; i++) {
+				psize++;
+				q = q->nextz;
+				if (!q)
+					break;
+			}
+			int qsize = insize;
+
+			while (psize > 0 || (qsize > 0 && q)) {
+				EarcutNode* e;
+				if (psize != 0 && (qsize == 0 || !q || p->z <= q->z)) {
+					e = p;
+					p = p->nextz;
+					psize--;
+				} else {
+					e = q;
+					q = q->nextz;
+					qsize--;
+				}
+
+				if (tail)
+					tail->nextz = e;
+				else
+					list = e;
+
+				e->prevz = tail;
+				tail = e;
+			}
+
+			p = q;
+		}
+
+		tail->nextz = NULL;
+		insize *= 2;
+	} while (nmerges > 1);
+}
+
+class Earcut {
+protected:
+	std::deque<EarcutNode> nodes_;
+	Triangulator::IndexVector& triangles_;
+	double inv_size_; /* 0 if z-order hashing is not used */
+
+public:
+	Earcut(Triangulator::IndexVector& triangles) : triangles_(triangles), inv_size_(0.0) {
+	}
+
+	void Run(const Vector2i* points, const unsigned int* lengths, size_t nrings) {
+		if (nrings == 0 || lengths[0] < 3)
+			return;
+
+		/* work in coordinates relative to bbox corner, so doubles
+		 * are exact and z-order is easy to compute */
+		BBoxi bbox(BBoxi::Empty());
+		for (unsigned int i = 0; i < lengths[0]; ++i)
+			bbox.Include(points[i]);
+
+		EarcutNode* outer = LinkedList(points, bbox.GetBottomLeft(), 0, lengths[0], true);
+		if (!outer || outer->next == outer->prev)
+			return;
+
+		size_t total = lengths[0];
+		if (nrings > 1) {
+			std::vector<EarcutNode*> queue;
+			unsigned int start = lengths[0];
+			for (size_t r = 1; r < nrings; start += lengths[r++]) {
+				EarcutNode* list = LinkedList(points, bbox.GetBottomLeft(), start, start + lengths[r], false);
+				if (!list)
+					continue;
+				if (list == list->next)
+					list->steiner = true;
+				queue.push_back(GetLeftmost(list));
+				total += lengths[r];
+			}
+
+			/* process holes from left to right */
+			std::sort(queue.begin(), queue.end(), EarcutNodeXLess());
+			for (std::vector<EarcutNode*>::const_iterator hole = queue.begin(); hole != queue.end(); ++hole)
+				outer = EliminateHole(*hole, outer);
+		}
+
+		if (total > HASH_THRESHOLD) {
+			double size = std::max((double)bbox.right - bbox.left, (double)bbox.top - bbox.bottom);
+			inv_size_ = size > 0.0 ? 32767.0 / size : 0.0;
+		}
+
+		EarcutLinked(outer, 0);
+	}
+
+protected:
+	EarcutNode* InsertNode(unsigned int i, const Vector2i& point, const Vector2i& origin, EarcutNode* last) {
+		nodes_.push_back(EarcutNode(i, (double)point.x - origin.x, (double)point.y - origin.y));
+		EarcutNode* p = &nodes_.back();
+
+		if (!last) {
+			p->prev = p;
+			p->next = p;
+		} else {
+			p->next = last->next;
+			p->prev = last;
+			last->next->prev = p;
+			last->next = p;
+		}
+		return p;
+	}
+
+	/* creates circular list from ring in given winding */
+	EarcutNode* LinkedList(const Vector2i* points, const Vector2i& origin, unsigned int start, unsigned int end, bool clockwise) {
+		double area = 0.0;
+		for (unsigned int i = start, j = end - 1; i < end; j = i++)
+			area += ((double)points[j].x - points[i].x) * ((double)points[i].y + points[j].y - 2.0 * origin.y);
+
+		EarcutNode* last = NULL;
+		if (clockwise == (area > 0.0)) {
+			for (unsigned int i = start; i < end; ++i)
+				last = InsertNode(i, points[i], origin, last);
+		} else {
+			for (unsigned int i = end; i > start; --i)
+				last = InsertNode(i - 1, points[i - 1], origin, last);
+		}
+
+		if (last && Equals(last, last->next)) {
+			RemoveNode(last);
+			last = last->next;
+		}
+
+		return last;
+	}
+
+	/* removes duplicate and collinear points */
+	EarcutNode* FilterPoints(EarcutNode* start, EarcutNode* end = NULL) {
+		if (!start)
+			return start;
+		if (!end)
+			end = start;
+
+		EarcutNode* p = start;
+		bool again;
+		do {
+			again = false;
+			if (!p->steiner && (Equals(p, p->next) || Area(p->prev, p, p->next) == 0.0)) {
+				RemoveNode(p);
+				p = end = p->prev;
+				if (p == p->next)
+					break;
+				again = true;
+			} else {
+				p = p->next;
+			}
+		} while (again || p != end);
+
+		return end;
+	}
+
+	void EmitTriangle(const EarcutNode* a, const EarcutNode* b, const EarcutNode* c) {
+		triangles_.push_back(a->i);
+		triangles_.push_back(b->i);
+		triangles_.push_back(c->i);
+	}
+
+	/* main ear slicing loop */
+	void EarcutLinked(EarcutNode* ear, int pass) {
+		if (!ear)
+			return;
+
+		if (pass == 0 && inv_size_ != 0.0)
+			IndexCurve(ear);
+
+		EarcutNode* stop = ear;
+		while (ear->prev != ear->next) {
+			EarcutNode* prev = ear->prev;
+			EarcutNode* next = ear->next;
+
+			if (inv_size_ != 0.0 ? IsEarHashed(ear) : IsEar(ear)) {
+				EmitTriangle(prev, ear, next);
+				RemoveNode(ear);
+
+				/* skipping the next vertex leads to less sliver triangles */
+				ear = next->next;
+				stop = next->next;
+				continue;
+			}
+
+			ear = next;
+
+			/* looped through the whole remaining polygon without
+			 * finding an ear: try to fix defects and go on */
+			if (ear == stop) {
+				if (pass == 0) {
+					EarcutLinked(FilterPoints(ear), 1);
+				} else if (pass == 1) {
+					ear = CureLocalIntersections(FilterPoints(ear));
+					EarcutLinked(ear, 2);
+				} else if (pass == 2) {
+					SplitEarcut(ear);
+				}
+				break;
+			}
+		}
+	}
+
+	bool IsEar(const EarcutNode* ear) const {
+		const EarcutNode* a = ear->prev;
+		const EarcutNode* b = ear;
+		const EarcutNode* c = ear->next;
+
+		if (Area(a, b, c) >= 0.0)
+			return false; /* reflex */
+
+		double x0 = std::min(a->x, std::min(b->x, c->x));
+		double y0 = std::min(a->y, std::min(b->y, c->y));
+		double x1 = std::max(a->x, std::max(b->x, c->x));
+		double y1 = std::max(a->y, std::max(b->y, c->y));
+
+		/* no other points inside */
+		for (const EarcutNode* p = c->next; p != a; p = p->next)
+			if (p->x >= x0 && p->x <= x1 && p->y >= y0 && p->y <= y1 &&
+					PointInTriangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y) && Area(p->prev, p, p->next) >= 0.0)
+				return false;
+
+		return true;
+	}
+
+	bool IsEarHashed(const EarcutNode* ear) const {
+		const EarcutNode* a = ear->prev;
+		const EarcutNode* b = ear;
+		const EarcutNode* c = ear->next;
+
+		if (Area(a, b, c) >= 0.0)
+			return false; /* reflex */
+
+		double x0 = std::min(a->x, std::min(b->x, c->x));
+		double y0 = std::min(a->y, std::min(b->y, c->y));
+		double x1 = std::max(a->x, std::max(b->x, c->x));
+		double y1 = std::max(a->y, std::max(b->y, c->y));
+
+		/* only points within z range of triangle bbox may be inside */
+		unsigned int minz = ZOrder(x0, y0, inv_size_);
+		unsigned int maxz = ZOrder(x1, y1, inv_size_);
+
+		const EarcutNode* p = ear->prevz;
+		const EarcutNode* n = ear->nextz;
+
+		/* look in both directions at once */
+		while (p && p->z >= minz && n && n->z <= maxz) {
+			if (IsInEar(p, a, c, x0, y0, x1, y1))
+				return false;
+			p = p->prevz;
+
+			if (IsInEar(n, a, c, x0, y0, x1, y1))
+				return false;
+			n = n->nextz;
+		}
+
+		for (; p && p->z >= minz; p = p->prevz)
+			if (IsInEar(p, a, c, x0, y0, x1, y1))
+				return false;
+
+		for (; n && n->z <= maxz; n = n->nextz)
+			if (IsInEar(n, a, c, x0, y0, x1, y1))
+				return false;
+
+		return true;
+	}
+
+	static bool IsInEar(const EarcutNode* p, const EarcutNode* a, const EarcutNode* c, double x0, double y0, double x1, double y1) {
+		const EarcutNode* b = a->next;
+		return p->x >= x0 && p->x <= x1 && p->y >= y0 && p->y <= y1 && p != a && p != c &&
+			PointInTriangle(a->x, a->y, b->x, b->y, c->x, c->y, p->x, p->y) && Area(p->prev, p, p->next) >= 0.0;
+	}
+
+	/* goes through all polygon nodes and cures small local self-intersections */
+	EarcutNode* CureLocalIntersections(EarcutNode* start) {
+		EarcutNode* p = start;
+		do {
+			EarcutNode* a = p->prev;
+			EarcutNode* b = p->next->next;
+
+			if (!Equals(a, b) && Intersects(a, p, p->next, b) && LocallyInside(a, b) && LocallyInside(b, a)) {
+				EmitTriangle(a, p, b);
+
+				RemoveNode(p);
+				RemoveNode(p->next);
+
+				p = start = b;
+			}
+			p = p->next;
+		} while (p != start);
+
+		return FilterPoints(p);
+	}
+
+	/* tries splitting polygon into two and triangulate them independently */
+	void SplitEarcut(EarcutNode* start) {
+		EarcutNode* a = start;
+		do {
+			for (EarcutNode* b = a->next->next; b != a->prev; b = b->next) {
+				if (a->i != b->i && IsValidDiagonal(a, b)) {
+					EarcutNode* c = SplitPolygon(a, b);
+
+					a = FilterPoints(a, a->next);
+					c = FilterPoints(c, c->next);
+
+					EarcutLinked(a, 0);
+					EarcutLinked(c, 0);
+					return;
+				}
+			}
+			a = a->next;
+		} while (a != start);
+	}
+
+	/* links two vertices with a bridge; if vertices belong to the
+	 * same ring, it splits polygon into two, if they're in
+	 * different rings, it merges them into one */
+	EarcutNode* SplitPolygon(EarcutNode* a, EarcutNode* b) {
+		nodes_.push_back(EarcutNode(a->i, a->x, a->y));
+		EarcutNode* a2 = &nodes_.back();
+		nodes_.push_back(EarcutNode(b->i, b->x, b->y));
+		EarcutNode* b2 = &nodes_.back();
+
+		EarcutNode* an = a->next;
+		EarcutNode* bp = b->prev;
+
+		a->next = b;
+		b->prev = a;
+
+		a2->next = an;
+		an->prev = a2;
+
+		b2->next = a2;
+		a2->prev = b2;
+
+		bp->next = b2;
+		b2->prev = bp;
+
+		return b2;
+	}
+
+	/* finds a bridge between hole and outer polygon and links them */
+	EarcutNode* EliminateHole(EarcutNode* hole, EarcutNode* outer) {
+		EarcutNode* bridge = FindHoleBridge(hole, outer);
+		if (!bridge)
+			return outer;
+
+		EarcutNode* bridge_reverse = SplitPolygon(bridge, hole);
+
+		FilterPoints(bridge_reverse, bridge_reverse->next);
+		return FilterPoints(bridge, bridge->next);
+	}
+
+	/* David Eberly's algorithm for finding a bridge between hole and outer polygon */
+	EarcutNode* FindHoleBridge(EarcutNode* hole, EarcutNode* outer) const {
+		EarcutNode* p = outer;
+		double hx = hole->x;
+		double hy = hole->y;
+		double qx = -HUGE_VAL;
+		EarcutNode* m = NULL;
+
+		/* find a segment intersected by a ray from the hole's
+		 * leftmost point to the left; segment's endpoint with
+		 * lesser x will be potential connection point */
+		do {
+			if (hy <= p->y && hy >= p->next->y && p->next->y != p->y) {
+				double x = p->x + (hy - p->y) * (p->next->x - p->x) / (p->next->y - p->y);
+				if (x <= hx && x > qx) {
+					qx = x;
+					m = p->x < p->next->x ? p : p->next;
+					if (x == hx)
+						return m; /* hole touches outer segment */
+				}
+			}
+			p = p->next;
+		} while (p != outer);
+
+		if (!m)
+			return NULL;
+
+		/* look for points inside the triangle of hole point,
+		 * segment intersection and endpoint; if there are none,
+		 * the endpoint is visible; otherwise pick the point with
+		 * minimal angle with the ray */
+		EarcutNode* stop = m;
+		double mx = m->x;
+		double my = m->y;
+		double tan_min = HUGE_VAL;
+
+		p = m;
+		do {
+			if (hx >= p->x && p->x >= mx && hx != p->x &&
+					PointInTriangle(hy < my ? hx : qx, hy, mx, my, hy < my ? qx : hx, hy, p->x, p->y)) {
+				double tan = fabs(hy - p->y) / (hx - p->x);
+
+				if (LocallyInside(p, hole) && (tan < tan_min || (tan == tan_min && (p->x > m->x || (p->x == m->x && SectorContainsSector(m, p)))))) {
+					m = p;
+					tan_min = tan;
+				}
+			}
+			p = p->next;
+		} while (p != stop);
+
+		return m;
+	}
+
+	/* interlinks polygon nodes in z-order */
+	void IndexCurve(EarcutNode* start) {
+		EarcutNode* p = start;
+		do {
+			if (p->z == 0)
+				p->z = ZOrder(p->x, p->y, inv_size_);
+			p->prevz = p->prev;
+			p->nextz = p->next;
+			p = p->next;
+		} while (p != start);
+
+		p->prevz->nextz = NULL;
+		p->prevz = NULL;
+
+		SortLinked(p);
+	}
+};
+
+/* checks whether all turns of a ring are in the same direction;
+ * for up to 4 vertices this means that the ring is convex */
+static bool IsConvexRing(const Vector2i* points, unsigned int length) {
+	int sign = 0;
+	for (unsigned int i = 0; i < length; ++i) {
+		const Vector2i& a = points[i];
+		const Vector2i& b = points[(i + 1) % length];
+		const Vector2i& c = points[(i + 2) % length];
+		osmlong_t cross = ((osmlong_t)b.x - a.x) * ((osmlong_t)c.y - b.y) - ((osmlong_t)b.y - a.y) * ((osmlong_t)c.x - b.x);
+		int cur = cross > 0 ? 1 : (cross < 0 ? -1 : 0);
+		if (cur == 0 || (sign != 0 && cur != sign))
+			return false;
+		sign = cur;
+	}
+	return true;
+}
+
+size_t Triangulator::Triangulate(const Vector2i* points, const unsigned int* lengths, size_t nrings, IndexVector& triangles) {
+	size_t initial = triangles.size();
+
+	/* most areas are simple quads, which are not worth building
+	 * linked lists for */
+	if (nrings == 1 && lengths[0] >= 3 && lengths[0] <= 4 && IsConvexRing(points, lengths[0])) {
+		for (unsigned int i = 2; i < lengths[0]; ++i) {
+			triangles.push_back(0);
+			triangles.push_back(i - 1);
+			triangles.push_back(i);
+		}
+		return lengths[0] - 2;
+	}
+
+	Earcut earcut(triangles);
+	earcut.Run(points, lengths, nrings);
+
+	return (triangles.size() - initial) / 3;
+}
@@ -22,22 +22,224 @@
 #define GEOMETRYGENERATOR_HH
 
 #include <glosm/GeometryDatasource.hh>
+#include <glosm/OsmDatasource.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/NonCopyable.hh>
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
 
-class OsmDatasource;
+#include <pthread.h>
+
+#include <list>
+#include <map>
+#include <vector>
+
 class HeightmapDatasource;
-class Geometry;
 
-class GeometryGenerator : public GeometryDatasource {
+/**
+ * Generates 3D geometry from OpenStreetMap data.
+ *
+ * Ways which cross requested bbox are also requested by
+ * neighbouring tiles, so their uncropped geometry is kept in a
+ * bounded LRU cache keyed by way and flags; this way costly
+ * triangulation and roof construction is done once per way, and
+ * each tile only crops it.
+ *
+ * Safe to use from multiple threads. Each requesting thread
+ * gets its own set of buffers reused between requests, so in
+ * steady state tiles are generated with few allocations.
+ */
+class GeometryGenerator : public GeometryDatasource, private NonCopyable {
+public:
+	/**
+	 * Runtime statistics, see GetStatistics()
+	 *
+	 * All values are cumulative since construction; times are
+	 * summed over all threads requesting geometry.
+	 */
+	struct Statistics {
+		unsigned int requests;
+
+		/* ways got from datasource, of which geometry of these
+		 * was taken from way cache */
+		unsigned int ways;
+		unsigned int cached_ways;
+
+		/* seconds spent getting ways from datasource, generating
+		 * their geometry and cropping it to requested bbox */
+		double get_ways_time;
+		double generate_time;
+		double crop_time;
+
+		Statistics() : requests(0), ways(0), cached_ways(0), get_ways_time(0.0), generate_time(0.0), crop_time(0.0) {
+		}
+	};
+
+protected:
+	/* flags and simplification tolerance */
+	typedef std::pair<int, osmint_t> WayVariant;
+
+	/* way pointers are stable during datasource lifetime, so
+	 * these are used as ids */
+	typedef std::pair<const OsmDatasource::Way*, WayVariant> WayKey;
+	typedef std::list<WayKey> WayLruList;
+
+	/* bbox is the one way had when geometry was generated, so
+	 * entries of ways moved or deleted since are still found by
+	 * InvalidateWays() */
+	struct WayEntry {
+		Geometry geometry;
+		size_t size;
+		BBoxi bbox;
+		WayLruList::iterator lru;
+	};
+
+	typedef std::map<WayKey, WayEntry> WayEntryMap;
+
+	typedef std::vector<const OsmDatasource::Way*> WayVector;
+
+	/* ways per GenerateWays() thread, to not spawn threads for small tiles */
+	static const size_t MIN_WAYS_PER_THREAD = 512;
+
+	/* range of ways processed by a GenerateWays() thread */
+	struct GenerateTask;
+
+	/* per-thread buffers of GetGeometry(), see GetScratch() */
+	struct Scratch;
+	typedef std::vector<Scratch*> ScratchVector;
+
+	/* min and max terrain elevation under outer ring of a
+	 * building; sorted by way, so lookups need no locking */
+	typedef std::pair<osmint_t, osmint_t> ElevationRange;
+	typedef std::pair<const OsmDatasource::Way*, ElevationRange> WayElevation;
+	typedef std::vector<WayElevation> WayElevationVector;
+
+	/* range of buildings processed by a PrecomputeElevations() thread */
+	struct ElevationTask;
+
 protected:
 	const OsmDatasource& datasource_;
 	HeightmapDatasource& heightmap_ds_;
 
+	mutable pthread_mutex_t way_cache_mutex_;
+	/* protected by way_cache_mutex_ */
+	mutable WayEntryMap way_cache_;
+	mutable WayLruList way_lru_; /* most recently used first */
+	mutable size_t way_cache_size_;
+	size_t way_cache_limit_;
+	mutable Statistics stats_;
+	/* scratches of all threads, to free them with generator */
+	mutable ScratchVector scratches_;
+	/* /protected by way_cache_mutex_ */
+
+	pthread_key_t scratch_key_;
+
+	volatile int nthreads_;
+
+	/* filled by PrecomputeElevations() */
+	WayElevationVector elevations_;
+
+protected:
+	/**
+	 * Drops least recently used ways until cache fits the limit
+	 */
+	void EvictWays() const;
+
+	/**
+	 * Generates geometry for ways, in parallel if enabled
+	 *
+	 * Geometry for local ways of scratch is left in geometry of
+	 * its tasks (unused tasks are cleared), and for each of its
+	 * shared ways in separate elements of its generated vector,
+	 * for caching.
+	 */
+	void GenerateWays(Scratch& scratch, int flags, osmint_t tolerance) const;
+
+	static void RunGenerateTask(GenerateTask& task);
+
+	static void RunElevationTask(ElevationTask& task);
+
+	/**
+	 * Returns precomputed elevation of a way, or NULL if there's none
+	 */
+	const ElevationRange* FindElevation(const OsmDatasource::Way& way) const;
+
+	/**
+	 * Returns buffers of calling thread, creating them on
+	 * first use
+	 */
+	Scratch& GetScratch() const;
+
+	/**
+	 * Frees buffers of a thread which exits
+	 */
+	static void DestroyScratch(void* arg);
+
 public:
 	GeometryGenerator(const OsmDatasource& datasource, HeightmapDatasource& heightmapds);
+	virtual ~GeometryGenerator();
+
 	void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags = 0) const;
 
+	/**
+	 * Sets max size of cached per-way geometry in bytes
+	 *
+	 * @param limit size limit; 0 disables caching
+	 */
+	void SetWayCacheLimit(size_t limit);
+
+	/**
+	 * Sets number of threads used to generate single tile
+	 *
+	 * Ways of large tiles are split between threads, so it's
+	 * useful when tiles are loaded one by one (e.g. in tiler). By
+	 * default, geometry is generated in calling thread only.
+	 *
+	 * @param nthreads number of threads; 0 means number of CPUs
+	 */
+	void SetThreads(int nthreads);
+
+	/**
+	 * Samples terrain elevation under all buildings in advance
+	 *
+	 * Buildings are placed on terrain by min and max elevation
+	 * under their outer ring, which otherwise is sampled from
+	 * heightmap each time a building is generated. This samples
+	 * all buildings at once, in parallel, so generation no longer
+	 * touches heightmap. Elevation is sampled on unsimplified
+	 * rings, so it's the same for all levels of detail.
+	 *
+	 * Must not be called concurrently with GetGeometry().
+	 *
+	 * @param nthreads number of threads; 0 means number of CPUs
+	 */
+	void PrecomputeElevations(int nthreads = 0);
+
+	/**
+	 * Drops cached geometry and precomputed elevations of ways
+	 * in given area
+	 *
+	 * Ways are cached by pointer, which stays the same when
+	 * datasource changes a way in place, so this must be called
+	 * with each dirty bbox of the change, see
+	 * PreloadedXmlDatasource::ApplyChange(). Elevations are
+	 * sampled again for buildings in the area if they were
+	 * precomputed.
+	 *
+	 * Must not be called concurrently with GetGeometry().
+	 */
+	void InvalidateWays(const BBoxi& bbox);
+
+	/**
+	 * Returns size of cached per-way geometry in bytes
+	 */
+	size_t GetWayCacheSize() const;
+
+	/**
+	 * Returns runtime statistics of geometry generation
+	 */
+	void GetStatistics(Statistics& stats) const;
+
 	virtual Vector2i GetCenter() const;
 	virtual BBoxi GetBBox() const;
 };
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRIANGULATOR_HH
+#define TRIANGULATOR_HH
+
+#include <glosm/Math.hh>
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Triangulator for simple polygons with holes
+ *
+ * Uses ear clipping: holes are first joined to the outer ring
+ * with bridges, then ears are cut off one by one. For large
+ * polygons, vertices are sorted along z-order curve, so checking
+ * an ear only touches vertices near it, which makes typical
+ * polygons O(n log n) instead of O(n^2). Self-intersections and
+ * other defects of input are handled gracefully, so some output
+ * is always produced.
+ *
+ * Rings may be in any winding, and repeating the first vertex in
+ * the end is not required.
+ */
+class Triangulator {
+public:
+	typedef std::vector<unsigned int> IndexVector;
+
+	/**
+	 * Triangulates polygon
+	 *
+	 * @param points vertices of all rings, outer ring first
+	 * @param lengths number of vertices in each ring
+	 * @param nrings number of rings
+	 * @param triangles output, indices into points array, three
+	 *                  per triangle
+	 * @return number of triangles appended
+	 */
+	static size_t Triangulate(const Vector2i* points, const unsigned int* lengths, size_t nrings, IndexVector& triangles);
+};
+
+#endif
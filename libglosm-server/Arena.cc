@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/Arena.hh>
+
+/* enough for any type stored in arenas: pointers, 64 bit ints, doubles */
+static const size_t ARENA_ALIGNMENT = 8;
+
+const size_t Arena::CHUNK_SIZE;
+
+Arena::Arena() : current_(NULL), left_(0), used_(0), allocated_(0) {
+}
+
+Arena::~Arena() {
+	Clear();
+}
+
+void* Arena::Allocate(size_t size) {
+	size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+	if (size > left_) {
+		/* oversized blocks get chunks of their own */
+		size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+		current_ = new char[chunk_size];
+		chunks_.push_back(current_);
+		left_ = chunk_size;
+		allocated_ += chunk_size;
+	}
+
+	void* ret = current_;
+	current_ += size;
+	left_ -= size;
+	used_ += size;
+	return ret;
+}
+
+size_t Arena::GetUsedBytes() const {
+	return used_;
+}
+
+size_t Arena::GetAllocatedBytes() const {
+	return allocated_;
+}
+
+void Arena::Clear() {
+	for (std::vector<char*>::iterator i = chunks_.begin(); i != chunks_.end(); ++i)
+		delete[] *i;
+	std::vector<char*>().swap(chunks_);
+	current_ = NULL;
+	left_ = 0;
+	used_ = 0;
+	allocated_ = 0;
+}
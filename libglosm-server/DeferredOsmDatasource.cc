@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/DeferredOsmDatasource.hh>
+
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+DeferredOsmDatasource::DeferredOsmDatasource() : target_(NULL) {
+	int errn;
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+}
+
+DeferredOsmDatasource::~DeferredOsmDatasource() {
+	pthread_mutex_destroy(&mutex_);
+}
+
+const OsmDatasource* DeferredOsmDatasource::GetTarget() const {
+	Guard guard(mutex_);
+	return target_;
+}
+
+void DeferredOsmDatasource::Publish(const OsmDatasource& target) {
+	Guard guard(mutex_);
+	if (target_ != NULL)
+		throw Exception() << "datasource is already published";
+	target_ = &target;
+}
+
+bool DeferredOsmDatasource::IsPublished() const {
+	return GetTarget() != NULL;
+}
+
+const OsmDatasource::Node& DeferredOsmDatasource::GetNode(osmid_t id) const {
+	const OsmDatasource* target = GetTarget();
+	if (target == NULL)
+		throw DataException() << "node " << id << " is not loaded yet";
+	return target->GetNode(id);
+}
+
+const OsmDatasource::Way& DeferredOsmDatasource::GetWay(osmid_t id) const {
+	const OsmDatasource* target = GetTarget();
+	if (target == NULL)
+		throw DataException() << "way " << id << " is not loaded yet";
+	return target->GetWay(id);
+}
+
+const OsmDatasource::Relation& DeferredOsmDatasource::GetRelation(osmid_t id) const {
+	const OsmDatasource* target = GetTarget();
+	if (target == NULL)
+		throw DataException() << "relation " << id << " is not loaded yet";
+	return target->GetRelation(id);
+}
+
+void DeferredOsmDatasource::GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const {
+	const OsmDatasource* target = GetTarget();
+	if (target != NULL)
+		target->GetWays(out, bbox);
+}
+
+void DeferredOsmDatasource::GetOverviewWays(std::vector<const Way*>& out, const BBoxi& bbox, int level) const {
+	const OsmDatasource* target = GetTarget();
+	if (target != NULL)
+		target->GetOverviewWays(out, bbox, level);
+}
+
+Vector2i DeferredOsmDatasource::GetCenter() const {
+	const OsmDatasource* target = GetTarget();
+	return target != NULL ? target->GetCenter() : OsmDatasource::GetCenter();
+}
+
+BBoxi DeferredOsmDatasource::GetBBox() const {
+	const OsmDatasource* target = GetTarget();
+	return target != NULL ? target->GetBBox() : BBoxi::Empty();
+}
+
+osmint_t DeferredOsmDatasource::GetMaxHeight() const {
+	const OsmDatasource* target = GetTarget();
+	return target != NULL ? target->GetMaxHeight() : OsmDatasource::GetMaxHeight();
+}
@@ -20,6 +20,8 @@
 
 #include <glosm/DummyHeightmap.hh>
 
+#include <algorithm>
+
 DummyHeightmap::DummyHeightmap(osmint_t height) : height_(height) {
 }
 
@@ -46,3 +48,7 @@ void DummyHeightmap::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap&
 osmint_t DummyHeightmap::GetHeight(const Vector2i& /*unused*/) const {
 	return height_;
 }
+
+void DummyHeightmap::GetHeights(const Vector2i* /*unused*/, size_t count, osmint_t* out) const {
+	std::fill(out, out + count, height_);
+}
@@ -21,8 +21,14 @@
 #include <glosm/Geometry.hh>
 
 #include <glosm/GeometryOperations.hh>
+#include <glosm/Model.hh>
+#include <glosm/Exception.hh>
 
+#include <stdint.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 
 Geometry::Geometry() {
@@ -77,6 +83,25 @@ void Geometry::AppendConvex(const Vector3i& v) {
 	convex_lengths_.back()++;
 }
 
+void Geometry::AddInstance(int model, const Vector3i& pos, const Vector2f& direction) {
+	instances_.push_back(Instance(model, pos, direction));
+}
+
+void Geometry::Clear() {
+	lines_vertices_.clear();
+	lines_lengths_.clear();
+	convex_vertices_.clear();
+	convex_lengths_.clear();
+	instances_.clear();
+}
+
+void Geometry::Reserve(size_t lines_vertices, size_t lines, size_t convex_vertices, size_t convexes) {
+	lines_vertices_.reserve(lines_vertices);
+	lines_lengths_.reserve(lines);
+	convex_vertices_.reserve(convex_vertices);
+	convex_lengths_.reserve(convexes);
+}
+
 const Geometry::VertexVector& Geometry::GetLinesVertices() const {
 	return lines_vertices_;
 }
@@ -93,152 +118,204 @@ const Geometry::LengthVector& Geometry::GetConvexLengths() const {
 	return convex_lengths_;
 }
 
+const Geometry::InstanceVector& Geometry::GetInstances() const {
+	return instances_;
+}
+
+size_t Geometry::GetConvexTriangles(IndexVector& indices, size_t max_vertices) const {
+	unsigned int curpos = 0;
+	for (LengthVector::const_iterator length = convex_lengths_.begin(); length != convex_lengths_.end(); ++length) {
+		if (curpos + *length > max_vertices)
+			break;
+
+		for (int j = 2; j < *length; ++j) {
+			indices.push_back(curpos);
+			indices.push_back(curpos + j - 1);
+			indices.push_back(curpos + j);
+		}
+
+		curpos += *length;
+	}
+
+	return curpos;
+}
+
+size_t Geometry::GetConvexStrip(IndexVector& indices, size_t max_vertices) const {
+	size_t start = indices.size();
+	unsigned int curpos = 0;
+	for (LengthVector::const_iterator length = convex_lengths_.begin(); length != convex_lengths_.end(); ++length) {
+		if (curpos + *length > max_vertices)
+			break;
+
+		/* degenerate triangles between polygons; each polygon
+		 * must start at even position to keep its winding */
+		if (indices.size() > start) {
+			indices.push_back(indices.back());
+			if ((indices.size() - start) % 2 == 0)
+				indices.push_back(indices.back());
+			indices.push_back(curpos);
+		}
+
+		/* zigzag: 0, 1, n-1, 2, n-2, ... */
+		int low = 1, high = *length - 1;
+		indices.push_back(curpos);
+		while (low <= high) {
+			indices.push_back(curpos + low++);
+			if (low <= high)
+				indices.push_back(curpos + high--);
+		}
+
+		curpos += *length;
+	}
+
+	return curpos;
+}
+
 void Geometry::Append(const Geometry& other) {
-	convex_vertices_.reserve(convex_vertices_.size() + other.convex_vertices_.size());
+	/* range insert grows storage geometrically, while exact
+	 * reserve would reallocate on each of many small appends */
 	convex_vertices_.insert(convex_vertices_.end(), other.convex_vertices_.begin(), other.convex_vertices_.end());
-
-	convex_lengths_.reserve(convex_lengths_.size() + other.convex_lengths_.size());
 	convex_lengths_.insert(convex_lengths_.end(), other.convex_lengths_.begin(), other.convex_lengths_.end());
-
-	lines_vertices_.reserve(lines_vertices_.size() + other.lines_vertices_.size());
 	lines_vertices_.insert(lines_vertices_.end(), other.lines_vertices_.begin(), other.lines_vertices_.end());
-
-	lines_lengths_.reserve(lines_lengths_.size() + other.lines_lengths_.size());
 	lines_lengths_.insert(lines_lengths_.end(), other.lines_lengths_.begin(), other.lines_lengths_.end());
+
+	instances_.insert(instances_.end(), other.instances_.begin(), other.instances_.end());
 }
 
-void Geometry::AppendCropped(const Geometry& other, const BBoxi& bbox) {
-	for (unsigned int i = 0, curpos = 0; i < other.lines_lengths_.size(); ++i) {
-		AddCroppedLine(&other.lines_vertices_[curpos], other.lines_lengths_[i], bbox);
-		curpos += other.lines_lengths_[i];
-	}
+/* polygons up to this size are cropped without heap allocation */
+static const unsigned int CROP_STACK_VERTICES = 32;
 
-	for (unsigned int i = 0, curpos = 0; i < other.convex_lengths_.size(); ++i) {
-		AddCroppedConvex(&other.convex_vertices_[curpos], other.convex_lengths_[i], bbox);
-		curpos += other.convex_lengths_[i];
+/**
+ * Crops convex polygon by one side of bbox
+ *
+ * Single pass of Sutherland-Hodgman algorithm; vertices on the
+ * bbox side are kept, so output has at most size + 1 vertices.
+ *
+ * @return number of output vertices, or 0 if polygon is not
+ *         convex and output does not fit into capacity
+ */
+static unsigned int CropConvexBySide(const Vector3i* in, unsigned int size, Vector3i* out, unsigned int capacity, const BBoxi& bbox, BBoxi::Side side) {
+	unsigned int n = 0;
+	const Vector3i* prev = &in[size - 1];
+	bool prev_out = bbox.IsPointOutAtSide(*prev, side);
+	for (const Vector3i* cur = in; cur != in + size; prev = cur++) {
+		if (n + 2 > capacity)
+			return 0;
+
+		bool cur_out = bbox.IsPointOutAtSide(*cur, side);
+		if (cur_out != prev_out) {
+			/* intersection is always calculated from the outer
+			 * vertex, so both edges sharing it give the same point;
+			 * it's skipped if inner vertex lies on the side */
+			const Vector3i& outer = cur_out ? *cur : *prev;
+			const Vector3i& inner = cur_out ? *prev : *cur;
+			Vector3i intersection;
+			if (IntersectSegmentWithBBoxSide(outer, inner, bbox, side, intersection) && intersection != inner)
+				out[n++] = intersection;
+		}
+		if (!cur_out)
+			out[n++] = *cur;
+		prev_out = cur_out;
 	}
+	return n;
 }
 
-void Geometry::AddCroppedConvex(const Vector3i* v, unsigned int size, const BBoxi& bbox) {
-	struct VList {
-		Vector3i vertex;
-		VList* prev;
-		VList* next;
-
-		VList(): prev(NULL), next(NULL) {}
-		VList(const Vector3i& v, VList* p, VList* n): vertex(v), prev(p), next(n) {}
-	};
-
-	/* construct circular linked list of vertices */
-	bool all_vertices_in_bbox = true;
-
-	/* ugly way of allocating a simple array; don't want to use
-	 * new here to not care of freeing, and automatic array of
-	 * VList is not allowed since VList is not POD */
-	char buffer[sizeof(VList) * (size + 4)];
-	VList* vertices = reinterpret_cast<VList*>(buffer);
-	for (unsigned int i = 0; i < size; ++i) {
-		vertices[i] = VList(v[i], &vertices[i-1], &vertices[i+1]);
-		if (!bbox.Contains(v[i]))
-			all_vertices_in_bbox = false;
+/**
+ * Appends convex polygon cropped by bbox to given vectors
+ */
+static void CropConvexInto(const Vector3i* v, unsigned int size, const BBoxi& bbox, Geometry::VertexVector& vertices, Geometry::LengthVector& lengths) {
+	if (size < 3)
+		return;
+
+	BBoxi polygon_bbox(BBoxi::Empty());
+	for (unsigned int i = 0; i < size; ++i)
+		polygon_bbox.Include(v[i]);
+
+	/* trivial accept: don't run cropping if not required */
+	if (polygon_bbox.left >= bbox.left && polygon_bbox.right <= bbox.right && polygon_bbox.bottom >= bbox.bottom && polygon_bbox.top <= bbox.top) {
+		vertices.insert(vertices.end(), v, v + size);
+		lengths.push_back(size);
+		return;
 	}
 
-	/* don't run expensive algorithm if cropping is not required */
-	if (all_vertices_in_bbox) {
-		convex_vertices_.reserve(convex_vertices_.size() + size);
-		for (unsigned int i = 0; i < size; ++i)
-			convex_vertices_.push_back(v[i]);
-		convex_lengths_.push_back(size);
+	/* trivial reject */
+	if (!polygon_bbox.Intersects(bbox))
 		return;
+
+	/* each pass may add a vertex, so two ping-pong buffers of
+	 * size + 4 are enough */
+	Vector3i stack_buffer[2][CROP_STACK_VERTICES];
+	std::vector<Vector3i> heap_buffer;
+	Vector3i* buffers[2] = { stack_buffer[0], stack_buffer[1] };
+	unsigned int capacity = CROP_STACK_VERTICES;
+	if (size + 4 > CROP_STACK_VERTICES) {
+		capacity = size + 4;
+		heap_buffer.resize(capacity * 2);
+		buffers[0] = &heap_buffer[0];
+		buffers[1] = &heap_buffer[capacity];
 	}
 
+	/* crop only by sides polygon actually crosses */
+	const Vector3i* current = v;
 	unsigned int nvertices = size;
-	vertices[0].prev = &vertices[nvertices - 1];
-	vertices[nvertices - 1].next = &vertices[0];
-
-	/* crop by each side of bbox */
-	Vector3i prevint, nextint;
-	VList* p = &vertices[0];
-	VList* first;
-	for (int i = 1; i <= 4; ++i) {
-		first = NULL; /* will be set to the first non-outbound vertex */
-		do {
-			/* check all vertices and crop them by bound */
-			if (bbox.IsPointOutAtSide(p->vertex, (BBoxi::Side)i)) {
-				if (IntersectSegmentWithBBoxSideNI(p->vertex, p->prev->vertex, bbox, (BBoxi::Side)i, prevint)) {
-					if (IntersectSegmentWithBBoxSideNI(p->vertex, p->next->vertex, bbox, (BBoxi::Side)i, nextint)) {
-						/* both edges have intersection -> add extra vertex (trapezoid case) */
-						assert(nvertices < 6);
-						vertices[nvertices] = VList(prevint, p->prev, p);
-						p->vertex = nextint;
-						p->prev->next = &vertices[nvertices];
-						p->prev = &vertices[nvertices];
-						nvertices++;
-						assert(nvertices < size + 4);
-						if (!first)
-							first = p->prev;
-					} else {
-						/* only prev edge has intersection - just move vertex */
-						p->vertex = prevint;
-						if (!first)
-							first = p;
-					}
-				} else {
-					if (IntersectSegmentWithBBoxSideNI(p->vertex, p->next->vertex, bbox, (BBoxi::Side)i, nextint)) {
-						/* only next edge has intersection - just move vertex */
-						p->vertex = nextint;
-						if (!first)
-							first = p;
-					} else {
-						/* no intersections - vertex may just be dropped */
-						if (p->prev == p->next)
-							return; /* triangle is completely outside of bbox */
-
-						p->prev->next = p->next;
-						p->next->prev = p->prev;
-						p = p->prev;
-					}
-				}
-			} else if (!first)
-				first = p;
-		} while ((p = p->next) != first);
+	int target = 0;
+	for (int side = BBoxi::LEFT; side <= BBoxi::TOP; ++side) {
+		bool crosses;
+		switch (side) {
+		case BBoxi::LEFT: crosses = polygon_bbox.left < bbox.left; break;
+		case BBoxi::BOTTOM: crosses = polygon_bbox.bottom < bbox.bottom; break;
+		case BBoxi::RIGHT: crosses = polygon_bbox.right > bbox.right; break;
+		default: crosses = polygon_bbox.top > bbox.top; break;
+		}
+
+		if (!crosses)
+			continue;
+
+		nvertices = CropConvexBySide(current, nvertices, buffers[target], capacity, bbox, (BBoxi::Side)side);
+
+		/* polygon is completely outside of bbox */
+		if (nvertices < 3)
+			return;
+
+		current = buffers[target];
+		target = 1 - target;
 	}
 
-	int n = 1;
-	convex_vertices_.push_back(p->vertex);
-	for (first = p, p = p->next; p != first; p = p->next, ++n)
-		convex_vertices_.push_back(p->vertex);
-	convex_lengths_.push_back(n);
+	vertices.insert(vertices.end(), current, current + nvertices);
+	lengths.push_back(nvertices);
 }
 
-void Geometry::AddCroppedLine(const Vector3i* v, unsigned int size, const BBoxi& bbox) {
+/**
+ * Appends parts of polyline within bbox to given vectors
+ */
+static void CropLineInto(const Vector3i* v, unsigned int size, const BBoxi& bbox, Geometry::VertexVector& vertices, Geometry::LengthVector& lengths) {
 	bool contained_prev = false;
 	for (unsigned int i = 0; i < size; ++i) {
 		if (bbox.Contains(v[i])) {
 			if (i == 0) {
-				lines_lengths_.push_back(1);
+				lengths.push_back(1);
 			} else if (contained_prev) {
-				lines_lengths_.back()++;
+				lengths.back()++;
 			} else {
 				Vector3i intersection;
 				IntersectSegmentWithBBox(v[i-1], v[i], bbox, intersection);
-				lines_lengths_.push_back(2);
-				lines_vertices_.push_back(intersection);
+				lengths.push_back(2);
+				vertices.push_back(intersection);
 			}
-			lines_vertices_.push_back(v[i]);
+			vertices.push_back(v[i]);
 			contained_prev = true;
 		} else {
 			if (contained_prev) {
 				Vector3i intersection;
 				IntersectSegmentWithBBox(v[i-1], v[i], bbox, intersection);
-				lines_vertices_.push_back(intersection);
-				lines_lengths_.back()++;
+				vertices.push_back(intersection);
+				lengths.back()++;
 			} else if (i != 0) {
 				Vector3i intersection1, intersection2;
 				if (CropSegmentByBBox(v[i-1], v[i], bbox, intersection1, intersection2)) {
-					lines_vertices_.push_back(intersection1);
-					lines_vertices_.push_back(intersection2);
-					lines_lengths_.push_back(2);
+					vertices.push_back(intersection1);
+					vertices.push_back(intersection2);
+					lengths.push_back(2);
 				}
 			}
 			contained_prev = false;
@@ -246,10 +323,332 @@ void Geometry::AddCroppedLine(const Vector3i* v, unsigned int size, const BBoxi&
 	}
 }
 
-void Geometry::Serialize() const {
-	/* @todo implement serialization to stream/file/buffer/whatever */
+void Geometry::AddCroppedConvex(const Vector3i* v, unsigned int size, const BBoxi& bbox) {
+	CropConvexInto(v, size, bbox, convex_vertices_, convex_lengths_);
+}
+
+void Geometry::AddCroppedLine(const Vector3i* v, unsigned int size, const BBoxi& bbox) {
+	CropLineInto(v, size, bbox, lines_vertices_, lines_lengths_);
+}
+
+/**
+ * Places cropped primitive at write position of in-place crop
+ *
+ * Output may be longer than input consumed so far (cropped lines
+ * get extra vertices on bbox edges, and may split), in which case
+ * room is made before read position.
+ */
+template <class T>
+static void PlaceCropped(std::vector<T>& data, size_t& write, size_t& read, const std::vector<T>& cropped) {
+	if (write + cropped.size() > read) {
+		size_t extra = write + cropped.size() - read;
+		data.insert(data.begin() + read, extra, T());
+		read += extra;
+	}
+	std::copy(cropped.begin(), cropped.end(), data.begin() + write);
+	write += cropped.size();
 }
 
-void Geometry::DeSerialize() {
-	/* @todo implement deserialization from stream/file/buffer/whatever */
+/**
+ * Crops primitives of given kind in place
+ *
+ * Primitives entirely within bbox are left where they are, or
+ * shifted over dropped ones, so geometry which is mostly inside
+ * bbox is barely touched.
+ */
+template <class CONTAINED, class CROP>
+static void CropPrimitivesInPlace(Geometry::VertexVector& vertices, Geometry::LengthVector& lengths, const BBoxi& bbox, CONTAINED contained, CROP crop) {
+	Geometry::VertexVector cropped_vertices;
+	Geometry::LengthVector cropped_lengths;
+
+	size_t read = 0, write = 0;
+	size_t length_read = 0, length_write = 0;
+	while (length_read < lengths.size()) {
+		int length = lengths[length_read++];
+		const Vector3i* primitive = vertices.empty() ? NULL : &vertices[0] + read;
+
+		if (contained(primitive, length, bbox)) {
+			if (write != read)
+				std::copy(vertices.begin() + read, vertices.begin() + read + length, vertices.begin() + write);
+			lengths[length_write++] = length;
+			write += length;
+			read += length;
+			continue;
+		}
+
+		cropped_vertices.clear();
+		cropped_lengths.clear();
+		crop(primitive, length, bbox, cropped_vertices, cropped_lengths);
+		read += length;
+
+		PlaceCropped(vertices, write, read, cropped_vertices);
+		PlaceCropped(lengths, length_write, length_read, cropped_lengths);
+	}
+
+	vertices.resize(write);
+	lengths.resize(length_write);
+}
+
+/* these match trivial accept cases of CropLineInto() and CropConvexInto() */
+static bool IsLineWithinBBox(const Vector3i* v, int size, const BBoxi& bbox) {
+	if (size == 0)
+		return false;
+	for (int i = 0; i < size; ++i)
+		if (!bbox.Contains(v[i]))
+			return false;
+	return true;
+}
+
+static bool IsConvexWithinBBox(const Vector3i* v, int size, const BBoxi& bbox) {
+	return size >= 3 && IsLineWithinBBox(v, size, bbox);
+}
+
+/**
+ * Appends primitives of given kind cropped by bbox
+ *
+ * Consecutive primitives within bbox are collected into a run
+ * which is copied at once, so only primitives crossing bbox
+ * edges are handled one by one.
+ */
+template <class CONTAINED, class CROP>
+static void AppendCroppedPrimitives(const Geometry::VertexVector& in_vertices, const Geometry::LengthVector& in_lengths, const BBoxi& bbox, CONTAINED contained, CROP crop, Geometry::VertexVector& vertices, Geometry::LengthVector& lengths) {
+	const Vector3i* data = in_vertices.empty() ? NULL : &in_vertices[0];
+
+	size_t pos = 0, run_start = 0, run_lengths_start = 0;
+	for (size_t i = 0; i < in_lengths.size(); ++i) {
+		int length = in_lengths[i];
+		if (contained(data + pos, length, bbox)) {
+			pos += length;
+			continue;
+		}
+
+		/* flush run before the cropped primitive */
+		vertices.insert(vertices.end(), data + run_start, data + pos);
+		lengths.insert(lengths.end(), in_lengths.begin() + run_lengths_start, in_lengths.begin() + i);
+
+		crop(data + pos, length, bbox, vertices, lengths);
+
+		pos += length;
+		run_start = pos;
+		run_lengths_start = i + 1;
+	}
+
+	vertices.insert(vertices.end(), data + run_start, data + pos);
+	lengths.insert(lengths.end(), in_lengths.begin() + run_lengths_start, in_lengths.end());
+}
+
+void Geometry::AppendCropped(const Geometry& other, const BBoxi& bbox) {
+	AppendCroppedPrimitives(other.lines_vertices_, other.lines_lengths_, bbox, IsLineWithinBBox, CropLineInto, lines_vertices_, lines_lengths_);
+	AppendCroppedPrimitives(other.convex_vertices_, other.convex_lengths_, bbox, IsConvexWithinBBox, CropConvexInto, convex_vertices_, convex_lengths_);
+
+	for (InstanceVector::const_iterator i = other.instances_.begin(); i != other.instances_.end(); ++i)
+		if (i->pos.x >= bbox.left && i->pos.x < bbox.right && i->pos.y >= bbox.bottom && i->pos.y < bbox.top)
+			instances_.push_back(*i);
+}
+
+void Geometry::Crop(const BBoxi& bbox) {
+	CropPrimitivesInPlace(lines_vertices_, lines_lengths_, bbox, IsLineWithinBBox, CropLineInto);
+	CropPrimitivesInPlace(convex_vertices_, convex_lengths_, bbox, IsConvexWithinBBox, CropConvexInto);
+
+	InstanceVector::iterator out = instances_.begin();
+	for (InstanceVector::const_iterator i = instances_.begin(); i != instances_.end(); ++i)
+		if (i->pos.x >= bbox.left && i->pos.x < bbox.right && i->pos.y >= bbox.bottom && i->pos.y < bbox.top)
+			*out++ = *i;
+	instances_.erase(out, instances_.end());
+}
+
+void Geometry::MoveCropped(Geometry& other, const BBoxi& bbox) {
+	if (lines_lengths_.empty() && convex_lengths_.empty() && instances_.empty()) {
+		other.Crop(bbox);
+		Swap(other);
+	} else {
+		AppendCropped(other, bbox);
+	}
+	other.Clear();
+}
+
+void Geometry::Swap(Geometry& other) {
+	lines_vertices_.swap(other.lines_vertices_);
+	lines_lengths_.swap(other.lines_lengths_);
+	convex_vertices_.swap(other.convex_vertices_);
+	convex_lengths_.swap(other.convex_lengths_);
+	instances_.swap(other.instances_);
+}
+
+/* serialized format: magic, version, then for lines and convex
+ * primitives: varint count of primitives, varint lengths, and
+ * zigzag varint deltas of vertex coordinates; then varint count
+ * of instances, and for each of them varint model, zigzag varint
+ * deltas of position and raw little endian floats of direction.
+ * Version 1 had no instances */
+static const unsigned char SERIALIZE_MAGIC[4] = { 'G', 'L', 'G', 'M' };
+static const unsigned char SERIALIZE_VERSION = 2;
+
+static void PutVarint(std::vector<unsigned char>& out, unsigned long long value) {
+	while (value >= 0x80) {
+		out.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char)value);
+}
+
+static void PutDelta(std::vector<unsigned char>& out, osmint_t value, osmint_t prev) {
+	osmlong_t delta = (osmlong_t)value - prev;
+	PutVarint(out, ((unsigned long long)delta << 1) ^ (unsigned long long)(delta >> 63));
+}
+
+static unsigned long long GetVarint(const unsigned char*& data, const unsigned char* end) {
+	unsigned long long value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (data == end)
+			throw Exception() << "truncated geometry data";
+		unsigned char byte = *data++;
+		value |= (unsigned long long)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+	throw Exception() << "bad varint in geometry data";
+}
+
+static osmint_t GetDelta(const unsigned char*& data, const unsigned char* end, osmint_t prev) {
+	unsigned long long zigzag = GetVarint(data, end);
+	osmlong_t delta = (osmlong_t)(zigzag >> 1) ^ -(osmlong_t)(zigzag & 1);
+	return (osmint_t)(prev + delta);
+}
+
+static void PutFloat(std::vector<unsigned char>& out, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	for (int i = 0; i < 4; ++i)
+		out.push_back((unsigned char)(bits >> (i * 8)));
+}
+
+static float GetFloat(const unsigned char*& data, const unsigned char* end) {
+	if (end - data < 4)
+		throw Exception() << "truncated geometry data";
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 4; ++i)
+		bits |= (uint32_t)*data++ << (i * 8);
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static void SerializePrimitives(std::vector<unsigned char>& out, const Geometry::VertexVector& vertices, const Geometry::LengthVector& lengths) {
+	PutVarint(out, lengths.size());
+	for (Geometry::LengthVector::const_iterator i = lengths.begin(); i != lengths.end(); ++i)
+		PutVarint(out, *i);
+
+	Vector3i prev(0, 0, 0);
+	for (Geometry::VertexVector::const_iterator i = vertices.begin(); i != vertices.end(); ++i) {
+		PutDelta(out, i->x, prev.x);
+		PutDelta(out, i->y, prev.y);
+		PutDelta(out, i->z, prev.z);
+		prev = *i;
+	}
+}
+
+static void DeSerializePrimitives(const unsigned char*& data, const unsigned char* end, Geometry::VertexVector& vertices, Geometry::LengthVector& lengths) {
+	unsigned long long nlengths = GetVarint(data, end);
+	/* every length takes at least a byte */
+	if (nlengths > (unsigned long long)(end - data))
+		throw Exception() << "bad primitive count in geometry data";
+
+	size_t nvertices = 0;
+	lengths.reserve(nlengths);
+	for (unsigned long long i = 0; i < nlengths; ++i) {
+		unsigned long long length = GetVarint(data, end);
+		/* every vertex takes at least three bytes */
+		if (length > (unsigned long long)(end - data) / 3)
+			throw Exception() << "bad primitive length in geometry data";
+		lengths.push_back(length);
+		nvertices += length;
+	}
+
+	if (nvertices > (size_t)(end - data) / 3)
+		throw Exception() << "truncated geometry data";
+
+	Vector3i prev(0, 0, 0);
+	vertices.reserve(nvertices);
+	for (size_t i = 0; i < nvertices; ++i) {
+		prev.x = GetDelta(data, end, prev.x);
+		prev.y = GetDelta(data, end, prev.y);
+		prev.z = GetDelta(data, end, prev.z);
+		vertices.push_back(prev);
+	}
+}
+
+static void SerializeInstances(std::vector<unsigned char>& out, const Geometry::InstanceVector& instances) {
+	PutVarint(out, instances.size());
+
+	Vector3i prev(0, 0, 0);
+	for (Geometry::InstanceVector::const_iterator i = instances.begin(); i != instances.end(); ++i) {
+		PutVarint(out, i->model);
+		PutDelta(out, i->pos.x, prev.x);
+		PutDelta(out, i->pos.y, prev.y);
+		PutDelta(out, i->pos.z, prev.z);
+		PutFloat(out, i->direction.x);
+		PutFloat(out, i->direction.y);
+		prev = i->pos;
+	}
+}
+
+static void DeSerializeInstances(const unsigned char*& data, const unsigned char* end, Geometry::InstanceVector& instances) {
+	unsigned long long ninstances = GetVarint(data, end);
+	/* every instance takes at least 12 bytes */
+	if (ninstances > (unsigned long long)(end - data) / 12)
+		throw Exception() << "bad instance count in geometry data";
+
+	Vector3i prev(0, 0, 0);
+	instances.reserve(ninstances);
+	for (unsigned long long i = 0; i < ninstances; ++i) {
+		unsigned long long model = GetVarint(data, end);
+		if (!Model::IsValid(model))
+			throw Exception() << "bad model in geometry data";
+
+		prev.x = GetDelta(data, end, prev.x);
+		prev.y = GetDelta(data, end, prev.y);
+		prev.z = GetDelta(data, end, prev.z);
+		float x = GetFloat(data, end);
+		float y = GetFloat(data, end);
+		instances.push_back(Geometry::Instance(model, prev, Vector2f(x, y)));
+	}
+}
+
+void Geometry::Serialize(std::vector<unsigned char>& out) const {
+	out.insert(out.end(), SERIALIZE_MAGIC, SERIALIZE_MAGIC + sizeof(SERIALIZE_MAGIC));
+	out.push_back(SERIALIZE_VERSION);
+
+	SerializePrimitives(out, lines_vertices_, lines_lengths_);
+	SerializePrimitives(out, convex_vertices_, convex_lengths_);
+	SerializeInstances(out, instances_);
+}
+
+void Geometry::DeSerialize(const unsigned char* data, size_t size) {
+	const unsigned char* end = data + size;
+
+	if (size < sizeof(SERIALIZE_MAGIC) + 1 || memcmp(data, SERIALIZE_MAGIC, sizeof(SERIALIZE_MAGIC)) != 0)
+		throw Exception() << "bad geometry data magic";
+	data += sizeof(SERIALIZE_MAGIC);
+
+	unsigned char version = *data++;
+	if (version < 1 || version > SERIALIZE_VERSION)
+		throw Exception() << "unsupported geometry data version";
+
+	Geometry result;
+	DeSerializePrimitives(data, end, result.lines_vertices_, result.lines_lengths_);
+	DeSerializePrimitives(data, end, result.convex_vertices_, result.convex_lengths_);
+	if (version >= 2)
+		DeSerializeInstances(data, end, result.instances_);
+
+	if (data != end)
+		throw Exception() << "trailing garbage in geometry data";
+
+	lines_vertices_.swap(result.lines_vertices_);
+	lines_lengths_.swap(result.lines_lengths_);
+	convex_vertices_.swap(result.convex_vertices_);
+	convex_lengths_.swap(result.convex_lengths_);
+	instances_.swap(result.instances_);
 }
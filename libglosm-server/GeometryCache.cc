@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/GeometryCache.hh>
+
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+static size_t GetGeometrySize(const Geometry& geometry) {
+	return (geometry.GetLinesVertices().size() + geometry.GetConvexVertices().size()) * sizeof(Vector3i) +
+		(geometry.GetLinesLengths().size() + geometry.GetConvexLengths().size()) * sizeof(int) +
+		geometry.GetInstances().size() * sizeof(Geometry::Instance);
+}
+
+GeometryCache::GeometryCache(const GeometryDatasource& source, size_t size_limit) : source_(source), size_(0), hits_(0), misses_(0), size_limit_(size_limit), generation_(0) {
+	int errn;
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+}
+
+GeometryCache::~GeometryCache() {
+	pthread_mutex_destroy(&mutex_);
+}
+
+void GeometryCache::GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+	Key key(bbox, flags);
+	unsigned int generation;
+
+	{
+		Guard guard(mutex_);
+
+		EntryMap::iterator entry = entries_.find(key);
+		if (entry != entries_.end()) {
+			lru_.splice(lru_.begin(), lru_, entry->second.lru);
+			hits_++;
+			geometry.Append(entry->second.geometry);
+			return;
+		}
+
+		misses_++;
+		generation = generation_;
+	}
+
+	/* generate without lock, so other threads are not blocked;
+	 * concurrent requests for the same key may both get here,
+	 * in which case only the first result is kept */
+	Geometry generated;
+	source_.GetGeometry(generated, bbox, flags);
+
+	geometry.Append(generated);
+
+	size_t size = GetGeometrySize(generated);
+
+	Guard guard(mutex_);
+
+	if (size > size_limit_ || generation != generation_)
+		return;
+
+	std::pair<EntryMap::iterator, bool> inserted = entries_.insert(std::make_pair(key, Entry()));
+	if (!inserted.second)
+		return;
+
+	Entry& entry = inserted.first->second;
+	entry.geometry = generated;
+	entry.size = size;
+	entry.lru = lru_.insert(lru_.begin(), key);
+	size_ += size;
+
+	Evict();
+}
+
+void GeometryCache::Evict() const {
+	while (size_ > size_limit_ && !lru_.empty()) {
+		EntryMap::iterator entry = entries_.find(lru_.back());
+		size_ -= entry->second.size;
+		entries_.erase(entry);
+		lru_.pop_back();
+	}
+}
+
+Vector2i GeometryCache::GetCenter() const {
+	return source_.GetCenter();
+}
+
+BBoxi GeometryCache::GetBBox() const {
+	return source_.GetBBox();
+}
+
+void GeometryCache::SetSizeLimit(size_t limit) {
+	Guard guard(mutex_);
+	size_limit_ = limit;
+	Evict();
+}
+
+void GeometryCache::Clear() {
+	Guard guard(mutex_);
+	entries_.clear();
+	lru_.clear();
+	size_ = 0;
+	generation_++;
+}
+
+void GeometryCache::Invalidate(const BBoxi& bbox) {
+	Guard guard(mutex_);
+	generation_++;
+	for (EntryMap::iterator entry = entries_.begin(); entry != entries_.end(); ) {
+		if (entry->first.bbox.Intersects(bbox)) {
+			size_ -= entry->second.size;
+			lru_.erase(entry->second.lru);
+			entries_.erase(entry++);
+		} else {
+			++entry;
+		}
+	}
+}
+
+size_t GeometryCache::GetSize() const {
+	Guard guard(mutex_);
+	return size_;
+}
+
+size_t GeometryCache::GetHits() const {
+	Guard guard(mutex_);
+	return hits_;
+}
+
+size_t GeometryCache::GetMisses() const {
+	Guard guard(mutex_);
+	return misses_;
+}
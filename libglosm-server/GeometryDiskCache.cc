@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/GeometryDiskCache.hh>
+
+#include <glosm/Geometry.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+const char GeometryDiskCache::MAGIC[8] = { 'G', 'L', 'O', 'S', 'M', 'G', 'C', '\0' };
+
+/* FNV-1a */
+static uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+GeometryDiskCache::GeometryDiskCache(const GeometryDatasource& source, const char* directory, const std::string& dataset_id) : source_(source), directory_(directory), hits_(0), misses_(0) {
+	int errn;
+
+	dataset_hash_ = HashBytes(dataset_id.data(), dataset_id.size());
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+}
+
+GeometryDiskCache::~GeometryDiskCache() {
+	pthread_mutex_destroy(&mutex_);
+}
+
+void GeometryDiskCache::MakeHeader(Header& header, const BBoxi& bbox, int flags) const {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(header.magic));
+	header.version = VERSION;
+	header.flags = flags;
+	header.dataset_hash = dataset_hash_;
+	header.bbox[0] = bbox.left;
+	header.bbox[1] = bbox.bottom;
+	header.bbox[2] = bbox.right;
+	header.bbox[3] = bbox.top;
+}
+
+std::string GeometryDiskCache::GetPath(const Header& header) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.geom", (unsigned long long)HashBytes(&header, sizeof(header)));
+	return directory_ + "/" + name;
+}
+
+bool GeometryDiskCache::Load(Geometry& geometry, const std::string& path, const Header& header) const {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	bool loaded = false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+		void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED) {
+			/* full header is compared, so hash collisions and
+			 * files from other datasets are just misses */
+			if (memcmp(data, &header, sizeof(Header)) == 0) {
+				try {
+					geometry.DeSerialize(static_cast<const unsigned char*>(data) + sizeof(Header), st.st_size - sizeof(Header));
+					loaded = true;
+				} catch (Exception& e) {
+					fprintf(stderr, "Ignoring corrupt geometry cache file %s: %s\n", path.c_str(), e.what());
+				}
+			}
+			munmap(data, st.st_size);
+		}
+	}
+
+	close(fd);
+	return loaded;
+}
+
+void GeometryDiskCache::Store(const Geometry& geometry, const std::string& path, const Header& header) const {
+	std::vector<unsigned char> buffer(reinterpret_cast<const unsigned char*>(&header), reinterpret_cast<const unsigned char*>(&header) + sizeof(header));
+	geometry.Serialize(buffer);
+
+	/* write to temporary file and rename, so readers never see
+	 * partially written file */
+	std::string temp = path + ".XXXXXX";
+	std::vector<char> temp_path(temp.begin(), temp.end());
+	temp_path.push_back('\0');
+
+	int fd = mkstemp(&temp_path[0]);
+	if (fd == -1)
+		return;
+
+	bool ok = true;
+	for (size_t written = 0; written < buffer.size(); ) {
+		ssize_t ret = write(fd, &buffer[written], buffer.size() - written);
+		if (ret <= 0) {
+			ok = false;
+			break;
+		}
+		written += ret;
+	}
+
+	if (close(fd) != 0)
+		ok = false;
+
+	if (!ok || rename(&temp_path[0], path.c_str()) != 0)
+		unlink(&temp_path[0]);
+}
+
+void GeometryDiskCache::GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+	Header header;
+	MakeHeader(header, bbox, flags);
+	std::string path = GetPath(header);
+
+	Geometry loaded;
+	if (Load(loaded, path, header)) {
+		geometry.Append(loaded);
+
+		Guard guard(mutex_);
+		hits_++;
+		return;
+	}
+
+	{
+		Guard guard(mutex_);
+		misses_++;
+	}
+
+	Geometry generated;
+	source_.GetGeometry(generated, bbox, flags);
+
+	Store(generated, path, header);
+
+	geometry.Append(generated);
+}
+
+Vector2i GeometryDiskCache::GetCenter() const {
+	return source_.GetCenter();
+}
+
+BBoxi GeometryDiskCache::GetBBox() const {
+	return source_.GetBBox();
+}
+
+size_t GeometryDiskCache::GetHits() const {
+	Guard guard(mutex_);
+	return hits_;
+}
+
+size_t GeometryDiskCache::GetMisses() const {
+	Guard guard(mutex_);
+	return misses_;
+}
+
+std::string GeometryDiskCache::GetFileId(const char* path) {
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return std::string();
+
+	char id[64];
+	snprintf(id, sizeof(id), ":%llu:%llu", (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+	return std::string(path) + id;
+}
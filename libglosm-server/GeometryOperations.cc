@@ -22,6 +22,8 @@
 
 #include <glosm/geomath.h>
 
+#include <algorithm>
+
 #include <math.h>
 
 bool IntersectSegmentWithHorizontal(const Vector3i& one, const Vector3i& two, osmint_t y, Vector3i& out) {
@@ -200,3 +202,81 @@ float ApproxDistanceSquare(const BBoxi& bbox, const Vector3i& vec) {
 
 	return dx*dx + dy*dy + dz*dz;
 }
+
+/* area width in simplification tolerances; that is half a pixel
+ * of 256 pixel tile */
+static const osmlong_t SIMPLIFY_RESOLUTION = 512;
+
+osmint_t GetSimplifyTolerance(osmlong_t width) {
+	osmlong_t limit = width / SIMPLIFY_RESOLUTION;
+	if (limit <= 0)
+		return 0;
+
+	osmint_t tolerance = 1;
+	while (tolerance * 2 <= limit)
+		tolerance *= 2;
+	return tolerance;
+}
+
+/* vertices may be 2D or 3D, only x and y are taken into account */
+template <class V>
+static void SimplifyPolylineVertices(std::vector<V>& vertices, osmint_t tolerance) {
+	if (vertices.size() < 3)
+		return;
+
+	double lonscale = cos((double)vertices.front().y * GEOM_DEG_TO_RAD);
+	double maxdist2 = (double)tolerance * tolerance * lonscale * lonscale;
+
+	std::vector<char> keep(vertices.size(), 0);
+	keep.front() = keep.back() = 1;
+
+	/* explicit stack, as coastlines may have lots of nodes */
+	std::vector<std::pair<unsigned int, unsigned int> > ranges;
+	ranges.push_back(std::make_pair(0, vertices.size() - 1));
+	while (!ranges.empty()) {
+		unsigned int first = ranges.back().first;
+		unsigned int last = ranges.back().second;
+		ranges.pop_back();
+
+		double dx = ((double)vertices[last].x - vertices[first].x) * lonscale;
+		double dy = (double)vertices[last].y - vertices[first].y;
+		double length2 = dx * dx + dy * dy;
+
+		double farthest_dist2 = 0.0;
+		unsigned int farthest = first;
+		for (unsigned int i = first + 1; i < last; ++i) {
+			double px = ((double)vertices[i].x - vertices[first].x) * lonscale;
+			double py = (double)vertices[i].y - vertices[first].y;
+
+			/* distance to segment, not to line, so closed ways work */
+			double t = length2 > 0.0 ? std::max(0.0, std::min(1.0, (px * dx + py * dy) / length2)) : 0.0;
+			double ex = px - t * dx;
+			double ey = py - t * dy;
+
+			if (ex * ex + ey * ey > farthest_dist2) {
+				farthest_dist2 = ex * ex + ey * ey;
+				farthest = i;
+			}
+		}
+
+		if (farthest_dist2 > maxdist2) {
+			keep[farthest] = 1;
+			ranges.push_back(std::make_pair(first, farthest));
+			ranges.push_back(std::make_pair(farthest, last));
+		}
+	}
+
+	unsigned int out = 0;
+	for (unsigned int i = 0; i < vertices.size(); ++i)
+		if (keep[i])
+			vertices[out++] = vertices[i];
+	vertices.resize(out);
+}
+
+void SimplifyPolyline(std::vector<Vector2i>& vertices, osmint_t tolerance) {
+	SimplifyPolylineVertices(vertices, tolerance);
+}
+
+void SimplifyPolyline(std::vector<Vector3i>& vertices, osmint_t tolerance) {
+	SimplifyPolylineVertices(vertices, tolerance);
+}
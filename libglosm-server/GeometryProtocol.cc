@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <glosm/GeometryProtocol.hh>
+
+#include <glosm/Exception.hh>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifndef MSG_NOSIGNAL
+#	define MSG_NOSIGNAL 0
+#endif
+
+static void WriteProtocolBytes(int fd, const unsigned char* data, size_t size) {
+	while (size > 0) {
+		ssize_t ret = send(fd, data, size, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw SystemError() << "cannot send to geometry server connection";
+		data += ret;
+		size -= ret;
+	}
+}
+
+/* returns number of bytes read, less than size only on end of stream */
+static size_t ReadProtocolBytes(int fd, unsigned char* data, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t ret = recv(fd, data + done, size - done, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw SystemError() << "cannot receive from geometry server connection";
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static uint32_t DecodeProtocolInt(const unsigned char* data) {
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/* splits [host:]port; returns false if address is a unix socket path */
+static bool ParseProtocolAddress(const char* address, std::string& host, std::string& port) {
+	if (strchr(address, '/') != NULL)
+		return false;
+
+	const char* colon = strrchr(address, ':');
+	if (colon == NULL) {
+		host.clear();
+		port = address;
+	} else {
+		host.assign(address, colon);
+		port = colon + 1;
+	}
+
+	if (port.empty()) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d", GeometryProtocol::DEFAULT_PORT);
+		port = buf;
+	}
+
+	return true;
+}
+
+static int MakeUnixSocket(const char* path, struct sockaddr_un& addr) {
+	if (strlen(path) >= sizeof(addr.sun_path))
+		throw Exception() << "unix socket path too long: " << path;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		throw SystemError() << "cannot create socket";
+	return fd;
+}
+
+GeometryProtocol::PayloadReader::PayloadReader(const Message& message) : message_(message), offset_(0) {
+}
+
+uint32_t GeometryProtocol::PayloadReader::GetUInt() {
+	if (offset_ + 4 > message_.payload.size())
+		throw Exception() << "truncated geometry server message";
+	uint32_t value = DecodeProtocolInt(&message_.payload[offset_]);
+	offset_ += 4;
+	return value;
+}
+
+int32_t GeometryProtocol::PayloadReader::GetInt() {
+	return (int32_t)GetUInt();
+}
+
+void GeometryProtocol::PutInt(std::vector<unsigned char>& payload, uint32_t value) {
+	payload.push_back(value & 0xff);
+	payload.push_back((value >> 8) & 0xff);
+	payload.push_back((value >> 16) & 0xff);
+	payload.push_back((value >> 24) & 0xff);
+}
+
+void GeometryProtocol::PutBBox(std::vector<unsigned char>& payload, const BBoxi& bbox) {
+	PutInt(payload, bbox.left);
+	PutInt(payload, bbox.bottom);
+	PutInt(payload, bbox.right);
+	PutInt(payload, bbox.top);
+}
+
+void GeometryProtocol::Write(int fd, int type, uint32_t id, const std::vector<unsigned char>& payload) {
+	if (payload.size() > MAX_PAYLOAD)
+		throw Exception() << "geometry server message too large: " << payload.size() << " bytes";
+
+	std::vector<unsigned char> header;
+	header.reserve(HEADER_SIZE);
+	PutInt(header, payload.size());
+	header.push_back(type);
+	PutInt(header, id);
+
+	WriteProtocolBytes(fd, &header[0], header.size());
+	if (!payload.empty())
+		WriteProtocolBytes(fd, &payload[0], payload.size());
+}
+
+bool GeometryProtocol::Read(int fd, Message& message) {
+	unsigned char header[HEADER_SIZE];
+	size_t got = ReadProtocolBytes(fd, header, sizeof(header));
+	if (got == 0)
+		return false;
+	if (got != sizeof(header))
+		throw Exception() << "geometry server connection closed in the middle of message";
+
+	uint32_t size = DecodeProtocolInt(header);
+	if (size > MAX_PAYLOAD)
+		throw Exception() << "geometry server message too large: " << size << " bytes";
+
+	message.type = header[4];
+	message.id = DecodeProtocolInt(header + 5);
+	message.payload.resize(size);
+
+	if (size > 0 && ReadProtocolBytes(fd, &message.payload[0], size) != size)
+		throw Exception() << "geometry server connection closed in the middle of message";
+
+	return true;
+}
+
+int GeometryProtocol::Connect(const char* address) {
+	std::string host, port;
+	if (!ParseProtocolAddress(address, host, port)) {
+		struct sockaddr_un addr;
+		int fd = MakeUnixSocket(address, addr);
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+			int errn = errno;
+			close(fd);
+			throw SystemError(errn) << "cannot connect to " << address;
+		}
+		return fd;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* res;
+	int ret = getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &res);
+	if (ret != 0)
+		throw Exception() << "cannot resolve " << address << ": " << gai_strerror(ret);
+
+	int fd = -1, errn = 0;
+	for (struct addrinfo* ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+			errn = errno;
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			errn = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1)
+		throw SystemError(errn) << "cannot connect to " << address;
+
+	/* requests are small and latency bound */
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	return fd;
+}
+
+int GeometryProtocol::Listen(const char* address) {
+	std::string host, port;
+	if (!ParseProtocolAddress(address, host, port)) {
+		struct sockaddr_un addr;
+		int fd = MakeUnixSocket(address, addr);
+		/* stale socket of previous run */
+		unlink(address);
+		if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+			int errn = errno;
+			close(fd);
+			throw SystemError(errn) << "cannot listen on " << address;
+		}
+		return fd;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	/* server is unauthenticated, so it's only reachable from other
+	 * hosts when asked for */
+	const char* node = "localhost";
+	if (host == "*")
+		node = NULL;
+	else if (!host.empty())
+		node = host.c_str();
+
+	struct addrinfo* res;
+	int ret = getaddrinfo(node, port.c_str(), &hints, &res);
+	if (ret != 0)
+		throw Exception() << "cannot resolve " << address << ": " << gai_strerror(ret);
+
+	int fd = -1, errn = 0;
+	for (struct addrinfo* ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+			errn = errno;
+			continue;
+		}
+
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+			errn = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1)
+		throw SystemError(errn) << "cannot listen on " << address;
+
+	return fd;
+}
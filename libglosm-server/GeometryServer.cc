@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <glosm/GeometryServer.hh>
+
+#include <glosm/Geometry.hh>
+#include <glosm/GeometryDatasource.hh>
+#include <glosm/GeometryProtocol.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+
+const int GeometryServer::MAX_QUEUED_REQUESTS;
+
+struct GeometryServer::Connection {
+	int fd;
+
+	pthread_mutex_t write_mutex;
+	/* protected by write_mutex */
+	bool broken;
+
+	/* protected by server mutex_ */
+	std::set<uint32_t> running;
+	std::set<uint32_t> cancelled;
+	int queued;
+	int active;
+	pthread_cond_t idle_cond;
+	/* /protected by server mutex_ */
+
+	Connection(int f) : fd(f), broken(false), queued(0), active(0) {
+		int errn;
+		if ((errn = pthread_mutex_init(&write_mutex, 0)) != 0)
+			throw SystemError(errn) << "pthread_mutex_init failed";
+		if ((errn = pthread_cond_init(&idle_cond, 0)) != 0) {
+			pthread_mutex_destroy(&write_mutex);
+			throw SystemError(errn) << "pthread_cond_init failed";
+		}
+	}
+
+	~Connection() {
+		pthread_cond_destroy(&idle_cond);
+		pthread_mutex_destroy(&write_mutex);
+	}
+
+	/**
+	 * Sends message unless connection is already known broken
+	 *
+	 * @return number of bytes sent
+	 */
+	size_t Send(int type, uint32_t id, const std::vector<unsigned char>& payload) {
+		Guard guard(write_mutex);
+		if (broken)
+			return 0;
+
+		try {
+			GeometryProtocol::Write(fd, type, id, payload);
+		} catch (std::exception&) {
+			/* client is gone; wake reader so connection finishes */
+			broken = true;
+			shutdown(fd, SHUT_RDWR);
+			return 0;
+		}
+
+		return GeometryProtocol::HEADER_SIZE + payload.size();
+	}
+};
+
+struct GeometryServerConnectionArg {
+	GeometryServer* server;
+	int fd;
+};
+
+GeometryServer::GeometryServer(const GeometryDatasource& source, osmint_t max_height, int nthreads) : source_(source), max_height_(max_height), stopping_(false) {
+	memset(&stats_, 0, sizeof(stats_));
+
+	if (nthreads <= 0)
+		nthreads = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+
+	int errn;
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_cond_init(&cond_, 0)) != 0) {
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_t thread;
+		if ((errn = pthread_create(&thread, NULL, WorkerThread, this)) != 0) {
+			StopThreads();
+			pthread_cond_destroy(&cond_);
+			pthread_mutex_destroy(&mutex_);
+			throw SystemError(errn) << "pthread_create failed";
+		}
+		threads_.push_back(thread);
+	}
+}
+
+GeometryServer::~GeometryServer() {
+	StopThreads();
+
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+void GeometryServer::StopThreads() {
+	pthread_mutex_lock(&mutex_);
+	stopping_ = true;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	for (std::vector<pthread_t>::iterator thread = threads_.begin(); thread != threads_.end(); ++thread)
+		pthread_join(*thread, NULL);
+	threads_.clear();
+}
+
+void GeometryServer::ProcessTasks() {
+	pthread_mutex_lock(&mutex_);
+	while (true) {
+		while (queue_.empty() && !stopping_)
+			pthread_cond_wait(&cond_, &mutex_);
+
+		if (stopping_)
+			break;
+
+		Task task = queue_.front();
+		queue_.pop_front();
+
+		Connection& connection = *task.connection;
+		connection.queued--;
+		connection.running.insert(task.id);
+		connection.active++;
+		pthread_mutex_unlock(&mutex_);
+
+		std::vector<unsigned char> payload;
+		int type = GeometryProtocol::GEOMETRY;
+		try {
+			Geometry geometry;
+			source_.GetGeometry(geometry, task.bbox, task.flags);
+			geometry.Serialize(payload);
+		} catch (std::exception& e) {
+			type = GeometryProtocol::FAILURE;
+			payload.assign(e.what(), e.what() + strlen(e.what()));
+		}
+
+		pthread_mutex_lock(&mutex_);
+		connection.running.erase(task.id);
+		bool cancelled = connection.cancelled.erase(task.id) > 0;
+		if (cancelled)
+			stats_.discarded++;
+		else if (type == GeometryProtocol::FAILURE)
+			stats_.failed++;
+		pthread_mutex_unlock(&mutex_);
+
+		size_t sent = 0;
+		if (!cancelled)
+			sent = connection.Send(type, task.id, payload);
+
+		pthread_mutex_lock(&mutex_);
+		stats_.bytes_sent += sent;
+		if (--connection.active == 0)
+			pthread_cond_broadcast(&connection.idle_cond);
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void* GeometryServer::WorkerThread(void* arg) {
+	static_cast<GeometryServer*>(arg)->ProcessTasks();
+	return NULL;
+}
+
+void GeometryServer::CancelTask(Connection& connection, uint32_t id) {
+	Guard guard(mutex_);
+
+	for (TaskQueue::iterator task = queue_.begin(); task != queue_.end(); ++task) {
+		if (task->connection == &connection && task->id == id) {
+			queue_.erase(task);
+			connection.queued--;
+			stats_.cancelled++;
+			return;
+		}
+	}
+
+	if (connection.running.find(id) != connection.running.end())
+		connection.cancelled.insert(id);
+}
+
+void GeometryServer::Serve(int fd) {
+	Connection connection(fd);
+
+	std::vector<unsigned char> hello;
+	GeometryProtocol::PutInt(hello, GeometryProtocol::MAGIC);
+	GeometryProtocol::PutInt(hello, GeometryProtocol::VERSION);
+	GeometryProtocol::PutBBox(hello, source_.GetBBox());
+	GeometryProtocol::PutInt(hello, source_.GetCenter().x);
+	GeometryProtocol::PutInt(hello, source_.GetCenter().y);
+	GeometryProtocol::PutInt(hello, max_height_);
+	connection.Send(GeometryProtocol::HELLO, 0, hello);
+
+	{
+		Guard guard(mutex_);
+		stats_.connections++;
+	}
+
+	std::string error;
+	try {
+		GeometryProtocol::Message message;
+		while (GeometryProtocol::Read(fd, message)) {
+			if (message.type == GeometryProtocol::REQUEST) {
+				GeometryProtocol::PayloadReader reader(message);
+				Task task;
+				task.connection = &connection;
+				task.id = message.id;
+				task.bbox.left = reader.GetInt();
+				task.bbox.bottom = reader.GetInt();
+				task.bbox.right = reader.GetInt();
+				task.bbox.top = reader.GetInt();
+				task.flags = reader.GetInt();
+
+				Guard guard(mutex_);
+				/* otherwise single client could grow the queue
+				 * without bound */
+				if (connection.queued >= MAX_QUEUED_REQUESTS)
+					throw Exception() << "client has more than " << MAX_QUEUED_REQUESTS << " requests queued";
+				queue_.push_back(task);
+				connection.queued++;
+				stats_.requests++;
+				pthread_cond_signal(&cond_);
+			} else if (message.type == GeometryProtocol::CANCEL) {
+				CancelTask(connection, message.id);
+			} else {
+				throw Exception() << "unexpected message type " << message.type << " from client";
+			}
+		}
+	} catch (std::exception& e) {
+		error = e.what();
+	}
+
+	/* drop requests of this client and wait for ones in progress,
+	 * which reference connection */
+	pthread_mutex_lock(&mutex_);
+	for (TaskQueue::iterator task = queue_.begin(); task != queue_.end(); )
+		if (task->connection == &connection)
+			task = queue_.erase(task);
+		else
+			++task;
+	while (connection.active > 0)
+		pthread_cond_wait(&connection.idle_cond, &mutex_);
+	pthread_mutex_unlock(&mutex_);
+
+	if (!error.empty() && !connection.broken)
+		throw Exception() << error;
+}
+
+void* GeometryServer::ConnectionThread(void* arg) {
+	GeometryServerConnectionArg* connection = static_cast<GeometryServerConnectionArg*>(arg);
+
+	try {
+		connection->server->Serve(connection->fd);
+	} catch (std::exception& e) {
+		fprintf(stderr, "Geometry server connection failed: %s\n", e.what());
+	}
+
+	close(connection->fd);
+	delete connection;
+	return NULL;
+}
+
+void GeometryServer::Run(int listen_fd) {
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			throw SystemError() << "accept failed";
+		}
+
+		/* fails harmlessly on unix sockets */
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		GeometryServerConnectionArg* arg = new GeometryServerConnectionArg;
+		arg->server = this;
+		arg->fd = fd;
+
+		pthread_t thread;
+		int errn;
+		if ((errn = pthread_create(&thread, NULL, ConnectionThread, arg)) != 0) {
+			fprintf(stderr, "Cannot serve connection: pthread_create failed: %s\n", strerror(errn));
+			close(fd);
+			delete arg;
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+int GeometryServer::GetThreads() const {
+	return threads_.size();
+}
+
+void GeometryServer::GetStatistics(Statistics& stats) const {
+	Guard guard(mutex_);
+	stats = stats_;
+}
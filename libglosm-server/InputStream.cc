@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/InputStream.hh>
+#include <glosm/Exception.hh>
+
+#include <zlib.h>
+#if defined(WITH_BZIP2)
+#	include <bzlib.h>
+#endif
+#if defined(WITH_ZSTD)
+#	include <zstd.h>
+#endif
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+InputStream::~InputStream() {
+}
+
+/**
+ * Plain input from file descriptor with support for peeking
+ */
+class RawInputStream : public InputStream {
+protected:
+	int fd_;
+	std::vector<char> peeked_;
+	size_t peeked_pos_;
+
+protected:
+	size_t ReadFd(char* buf, size_t size) {
+		ssize_t len;
+		while ((len = read(fd_, buf, size)) < 0 && errno == EINTR) {
+		}
+
+		if (len < 0)
+			throw SystemError() << "input read error";
+
+		return len;
+	}
+
+public:
+	RawInputStream(int fd) : fd_(fd), peeked_pos_(0) {
+	}
+
+	/**
+	 * Returns first bytes of input without consuming them
+	 *
+	 * Must be called before any Read().
+	 */
+	const std::vector<char>& Peek(size_t size) {
+		peeked_.resize(size);
+		size_t got = 0;
+		size_t len;
+		while (got < size && (len = ReadFd(&peeked_[got], size - got)) > 0)
+			got += len;
+		peeked_.resize(got);
+		return peeked_;
+	}
+
+	virtual size_t Read(char* buf, size_t size) {
+		if (peeked_pos_ < peeked_.size()) {
+			size_t len = std::min(size, peeked_.size() - peeked_pos_);
+			memcpy(buf, &peeked_[peeked_pos_], len);
+			peeked_pos_ += len;
+			return len;
+		}
+
+		return ReadFd(buf, size);
+	}
+};
+
+/**
+ * Base for decompressing streams: keeps compressed input buffer
+ */
+class DecompressingInputStream : public InputStream {
+protected:
+	static const size_t INPUT_BUFFER_SIZE = 256 * 1024;
+
+	std::auto_ptr<InputStream> source_;
+	std::vector<char> input_;
+	bool eof_;
+
+protected:
+	DecompressingInputStream(InputStream* source) : source_(source), input_(INPUT_BUFFER_SIZE), eof_(false) {
+	}
+
+	/**
+	 * Reads next portion of compressed data into input buffer
+	 *
+	 * @return number of bytes read, 0 on end of input
+	 */
+	size_t Refill() {
+		size_t len = source_->Read(&input_[0], input_.size());
+		if (len == 0)
+			eof_ = true;
+		return len;
+	}
+};
+
+/**
+ * Gzip (and zlib) decompression
+ *
+ * Concatenated gzip members, as produced by pigz or by
+ * appending files, are decompressed one after another.
+ */
+class GzipInputStream : public DecompressingInputStream {
+protected:
+	z_stream stream_;
+	bool stream_end_;
+
+public:
+	GzipInputStream(InputStream* source) : DecompressingInputStream(source), stream_end_(false) {
+		memset(&stream_, 0, sizeof(stream_));
+
+		/* 32 enables automatic gzip/zlib header detection */
+		if (inflateInit2(&stream_, 15 + 32) != Z_OK)
+			throw Exception() << "cannot initialize gzip decompressor";
+	}
+
+	virtual ~GzipInputStream() {
+		inflateEnd(&stream_);
+	}
+
+	virtual size_t Read(char* buf, size_t size) {
+		stream_.next_out = reinterpret_cast<Bytef*>(buf);
+		stream_.avail_out = size;
+
+		while (stream_.avail_out > 0) {
+			if (stream_.avail_in == 0 && !eof_) {
+				stream_.avail_in = Refill();
+				stream_.next_in = reinterpret_cast<Bytef*>(&input_[0]);
+			}
+
+			if (stream_.avail_in == 0) {
+				if (!stream_end_)
+					throw Exception() << "gzip input is truncated";
+				break;
+			}
+
+			int ret = inflate(&stream_, Z_NO_FLUSH);
+			if (ret == Z_STREAM_END) {
+				stream_end_ = true;
+				inflateReset(&stream_);
+			} else if (ret == Z_OK) {
+				stream_end_ = false;
+			} else if (ret != Z_BUF_ERROR) {
+				throw Exception() << "gzip decompression error: " << (stream_.msg ? stream_.msg : "unknown error");
+			}
+		}
+
+		return size - stream_.avail_out;
+	}
+};
+
+#if defined(WITH_BZIP2)
+/**
+ * Bzip2 decompression
+ *
+ * Concatenated streams, as produced by pbzip2, are supported.
+ */
+class Bzip2InputStream : public DecompressingInputStream {
+protected:
+	bz_stream stream_;
+	bool stream_end_;
+
+public:
+	Bzip2InputStream(InputStream* source) : DecompressingInputStream(source), stream_end_(false) {
+		memset(&stream_, 0, sizeof(stream_));
+
+		if (BZ2_bzDecompressInit(&stream_, 0, 0) != BZ_OK)
+			throw Exception() << "cannot initialize bzip2 decompressor";
+	}
+
+	virtual ~Bzip2InputStream() {
+		BZ2_bzDecompressEnd(&stream_);
+	}
+
+	virtual size_t Read(char* buf, size_t size) {
+		stream_.next_out = buf;
+		stream_.avail_out = size;
+
+		while (stream_.avail_out > 0) {
+			if (stream_.avail_in == 0 && !eof_) {
+				stream_.avail_in = Refill();
+				stream_.next_in = &input_[0];
+			}
+
+			if (stream_.avail_in == 0) {
+				if (!stream_end_)
+					throw Exception() << "bzip2 input is truncated";
+				break;
+			}
+
+			int ret = BZ2_bzDecompress(&stream_);
+			if (ret == BZ_STREAM_END) {
+				/* restart decompressor for the next stream, keeping buffers */
+				char* next_in = stream_.next_in;
+				unsigned int avail_in = stream_.avail_in;
+				char* next_out = stream_.next_out;
+				unsigned int avail_out = stream_.avail_out;
+
+				BZ2_bzDecompressEnd(&stream_);
+				memset(&stream_, 0, sizeof(stream_));
+				if (BZ2_bzDecompressInit(&stream_, 0, 0) != BZ_OK)
+					throw Exception() << "cannot initialize bzip2 decompressor";
+
+				stream_.next_in = next_in;
+				stream_.avail_in = avail_in;
+				stream_.next_out = next_out;
+				stream_.avail_out = avail_out;
+				stream_end_ = true;
+			} else if (ret == BZ_OK) {
+				stream_end_ = false;
+			} else {
+				throw Exception() << "bzip2 decompression error " << ret;
+			}
+		}
+
+		return size - stream_.avail_out;
+	}
+};
+#endif
+
+#if defined(WITH_ZSTD)
+/**
+ * Zstandard decompression
+ */
+class ZstdInputStream : public DecompressingInputStream {
+protected:
+	ZSTD_DStream* stream_;
+	ZSTD_inBuffer in_;
+	bool frame_end_;
+
+public:
+	ZstdInputStream(InputStream* source) : DecompressingInputStream(source), frame_end_(false) {
+		if ((stream_ = ZSTD_createDStream()) == NULL)
+			throw Exception() << "cannot initialize zstd decompressor";
+
+		in_.src = &input_[0];
+		in_.size = 0;
+		in_.pos = 0;
+	}
+
+	virtual ~ZstdInputStream() {
+		ZSTD_freeDStream(stream_);
+	}
+
+	virtual size_t Read(char* buf, size_t size) {
+		ZSTD_outBuffer out = { buf, size, 0 };
+
+		while (out.pos < out.size) {
+			if (in_.pos == in_.size && !eof_) {
+				in_.size = Refill();
+				in_.pos = 0;
+			}
+
+			if (in_.pos == in_.size) {
+				if (!frame_end_)
+					throw Exception() << "zstd input is truncated";
+				break;
+			}
+
+			/* multiple frames are handled by the decompressor itself */
+			size_t ret = ZSTD_decompressStream(stream_, &out, &in_);
+			if (ZSTD_isError(ret))
+				throw Exception() << "zstd decompression error: " << ZSTD_getErrorName(ret);
+
+			frame_end_ = (ret == 0);
+		}
+
+		return out.pos;
+	}
+};
+#endif
+
+InputStream* InputStream::Create(int fd) {
+	std::auto_ptr<RawInputStream> raw(new RawInputStream(fd));
+
+	const std::vector<char>& magic = raw->Peek(4);
+
+	if (magic.size() >= 2 && (unsigned char)magic[0] == 0x1f && (unsigned char)magic[1] == 0x8b)
+		return new GzipInputStream(raw.release());
+
+	if (magic.size() >= 3 && memcmp(&magic[0], "BZh", 3) == 0) {
+#if defined(WITH_BZIP2)
+		return new Bzip2InputStream(raw.release());
+#else
+		throw Exception() << "input is bzip2 compressed, but glosm was built without bzip2 support";
+#endif
+	}
+
+	if (magic.size() >= 4 && memcmp(&magic[0], "\x28\xb5\x2f\xfd", 4) == 0) {
+#if defined(WITH_ZSTD)
+		return new ZstdInputStream(raw.release());
+#else
+		throw Exception() << "input is zstd compressed, but glosm was built without zstd support";
+#endif
+	}
+
+	return raw.release();
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/MmapOsmDatasource.hh>
+
+#include <glosm/WayClassifier.hh>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+struct SnapshotWayIdLess {
+	bool operator()(const OsmSnapshot::Way& a, osmid_t b) const {
+		return a.id < b;
+	}
+};
+
+struct SnapshotIndexCollector {
+	std::vector<uint32_t>& out;
+
+	SnapshotIndexCollector(std::vector<uint32_t>& o) : out(o) {
+	}
+
+	void operator()(uint32_t index) {
+		out.push_back(index);
+	}
+};
+
+MmapOsmDatasource::MmapOsmDatasource() : fd_(-1), data_(NULL), size_(0), header_(NULL), bbox_(BBoxi::Empty()), max_height_(0) {
+}
+
+MmapOsmDatasource::~MmapOsmDatasource() {
+	Clear();
+}
+
+void MmapOsmDatasource::CheckSection(uint64_t offset, uint64_t count, size_t size) const {
+	if (count == 0)
+		return;
+	if (offset > size_ || count > (size_ - offset) / size)
+		throw DataException() << "snapshot is truncated or corrupt";
+}
+
+void MmapOsmDatasource::Load(const char* filename) {
+	Clear();
+
+	if ((fd_ = open(filename, O_RDONLY)) == -1)
+		throw SystemError() << "cannot open snapshot file";
+
+	try {
+		struct stat st;
+		if (fstat(fd_, &st) == -1)
+			throw SystemError() << "cannot stat snapshot file";
+
+		size_ = st.st_size;
+		if (size_ < sizeof(OsmSnapshot::Header))
+			throw DataException() << "snapshot is too short";
+
+		if ((data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd_, 0)) == MAP_FAILED) {
+			data_ = NULL;
+			throw SystemError() << "cannot mmap snapshot file";
+		}
+
+		header_ = reinterpret_cast<const OsmSnapshot::Header*>(data_);
+		if (memcmp(header_->magic, OsmSnapshot::MAGIC, sizeof(header_->magic)) != 0)
+			throw DataException() << "not a glosm snapshot";
+		if (header_->version != OsmSnapshot::VERSION)
+			throw DataException() << "unsupported snapshot version " << header_->version;
+
+		CheckSection(header_->ways_offset, header_->nways, sizeof(OsmSnapshot::Way));
+		CheckSection(header_->coords_offset, header_->ncoords, sizeof(Vector2i));
+		CheckSection(header_->tags_offset, header_->ntags, sizeof(OsmSnapshot::Tag));
+		CheckSection(header_->rings_offset, header_->nrings, sizeof(uint32_t));
+		CheckSection(header_->string_offsets_offset, header_->nstrings, sizeof(uint64_t));
+		CheckSection(header_->strings_offset, header_->strings_size, 1);
+		CheckSection(header_->index_items_offset, header_->nindex_items, sizeof(OsmSnapshot::Index::Item));
+		CheckSection(header_->index_nodes_offset, header_->nindex_nodes, sizeof(OsmSnapshot::Index::Node));
+		if (header_->nindex_nodes > UINT_MAX)
+			throw DataException() << "snapshot index is corrupt";
+
+		const char* base = reinterpret_cast<const char*>(data_);
+		ways_ = reinterpret_cast<const OsmSnapshot::Way*>(base + header_->ways_offset);
+		coords_ = reinterpret_cast<const Vector2i*>(base + header_->coords_offset);
+		tags_ = reinterpret_cast<const OsmSnapshot::Tag*>(base + header_->tags_offset);
+		rings_ = reinterpret_cast<const uint32_t*>(base + header_->rings_offset);
+		index_items_ = reinterpret_cast<const OsmSnapshot::Index::Item*>(base + header_->index_items_offset);
+		index_nodes_ = reinterpret_cast<const OsmSnapshot::Index::Node*>(base + header_->index_nodes_offset);
+
+		/* index is traversed in place, so it's checked once here
+		 * instead of on each query */
+		if (!OsmSnapshot::Index::ValidateTree(index_nodes_, header_->nindex_items, header_->nindex_nodes, header_->nindex_leaves))
+			throw DataException() << "snapshot index is corrupt";
+
+		/* string table is small compared to the rest of data,
+		 * so it's interned right away */
+		const uint64_t* string_offsets = reinterpret_cast<const uint64_t*>(base + header_->string_offsets_offset);
+		const char* strings = base + header_->strings_offset;
+
+		if (header_->strings_size > 0 && strings[header_->strings_size - 1] != '\0')
+			throw DataException() << "snapshot string table is corrupt";
+
+		StringTable& table = StringTable::Instance();
+		string_map_.reserve(header_->nstrings);
+		for (uint64_t i = 0; i < header_->nstrings; ++i) {
+			if (string_offsets[i] >= header_->strings_size)
+				throw DataException() << "snapshot string table is corrupt";
+			string_map_.push_back(table.Intern(strings + string_offsets[i]));
+		}
+
+		bbox_ = BBoxi(header_->bbox[0], header_->bbox[1], header_->bbox[2], header_->bbox[3]);
+		max_height_ = header_->max_height;
+
+		ways_cache_.resize(header_->nways, NULL);
+	} catch (...) {
+		Clear();
+		throw;
+	}
+}
+
+void MmapOsmDatasource::Clear() {
+	for (std::vector<Way*>::iterator i = ways_cache_.begin(); i != ways_cache_.end(); ++i)
+		delete *i;
+	std::vector<Way*>().swap(ways_cache_);
+	std::vector<strid_t>().swap(string_map_);
+
+	if (data_ != NULL)
+		munmap(data_, size_);
+	if (fd_ != -1)
+		close(fd_);
+
+	fd_ = -1;
+	data_ = NULL;
+	size_ = 0;
+	header_ = NULL;
+	bbox_ = BBoxi::Empty();
+	max_height_ = 0;
+}
+
+const OsmDatasource::Way* MmapOsmDatasource::GetWayByIndex(uint32_t index) const {
+	Way** slot = &ways_cache_[index];
+	Way* cached = *slot;
+	if (cached != NULL) {
+		/* pairs with barrier of compare-and-swap below, so way
+		 * contents are seen complete */
+		__sync_synchronize();
+		return cached;
+	}
+
+	const OsmSnapshot::Way& rec = ways_[index];
+
+	if (rec.first_coord + rec.ncoords > header_->ncoords || rec.first_tag + rec.ntags > header_->ntags || rec.first_ring + rec.nrings > header_->nrings)
+		throw DataException() << "snapshot way " << rec.id << " is corrupt";
+
+	/* rings must cover coords exactly, as geometry generator
+	 * walks coords by them */
+	uint64_t ringcoords = 0;
+	for (const uint32_t* r = rings_ + rec.first_ring; r != rings_ + rec.first_ring + rec.nrings; ++r)
+		ringcoords += *r;
+	if (rec.nrings != 0 && ringcoords != rec.ncoords)
+		throw DataException() << "snapshot way " << rec.id << " is corrupt";
+
+	Way* way = new Way;
+
+	way->StoredCoords = coords_ + rec.first_coord;
+	way->StoredCoordsCount = rec.ncoords;
+	way->Rings.assign(rings_ + rec.first_ring, rings_ + rec.first_ring + rec.nrings);
+	for (const OsmSnapshot::Tag* t = tags_ + rec.first_tag; t != tags_ + rec.first_tag + rec.ntags; ++t)
+		way->Tags.insert(string_map_[t->key], string_map_[t->value]);
+
+	way->Closed = rec.closed;
+	way->Clockwise = rec.clockwise;
+	way->BBox = BBoxi(rec.bbox[0], rec.bbox[1], rec.bbox[2], rec.bbox[3]);
+
+	ClassifyWay(*way);
+
+	cached = __sync_val_compare_and_swap(slot, (Way*)NULL, way);
+	if (cached != NULL) {
+		delete way;
+		return cached;
+	}
+
+	return way;
+}
+
+Vector2i MmapOsmDatasource::GetCenter() const {
+	return bbox_.GetCenter();
+}
+
+BBoxi MmapOsmDatasource::GetBBox() const {
+	return bbox_;
+}
+
+osmint_t MmapOsmDatasource::GetMaxHeight() const {
+	return max_height_;
+}
+
+const OsmDatasource::Node& MmapOsmDatasource::GetNode(osmid_t /*unused*/) const {
+	throw DataException() << "nodes are not stored in snapshots";
+}
+
+const OsmDatasource::Way& MmapOsmDatasource::GetWay(osmid_t id) const {
+	if (header_ == NULL)
+		throw DataException() << "way not found";
+
+	const OsmSnapshot::Way* end = ways_ + header_->nways;
+	const OsmSnapshot::Way* rec = std::lower_bound(ways_, end, id, SnapshotWayIdLess());
+	if (rec == end || rec->id != id)
+		throw DataException() << "way not found";
+
+	return *GetWayByIndex(rec - ways_);
+}
+
+const OsmDatasource::Relation& MmapOsmDatasource::GetRelation(osmid_t /*unused*/) const {
+	throw DataException() << "relations are not stored in snapshots";
+}
+
+void MmapOsmDatasource::GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const {
+	if (header_ == NULL || !bbox.Intersects(bbox_))
+		return;
+
+	std::vector<uint32_t> found;
+	SnapshotIndexCollector collector(found);
+	OsmSnapshot::Index::VisitTree(index_items_, index_nodes_, header_->nindex_nodes, header_->nindex_leaves, bbox, collector);
+
+	out.reserve(out.size() + found.size());
+	for (std::vector<uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i) {
+		if (*i >= header_->nways)
+			throw DataException() << "snapshot index is corrupt";
+		out.push_back(GetWayByIndex(*i));
+	}
+}
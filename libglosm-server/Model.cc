@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/Model.hh>
+
+#include <glosm/Exception.hh>
+
+#include <algorithm>
+
+/* built when library is loaded, so may be used from any thread */
+static const Model BUILTIN_MODELS[Model::NUM_MODELS] = {
+	Model(Model::POWER_TOWER),
+	Model(Model::TREE),
+	Model(Model::STREET_LAMP),
+	Model(Model::MAST),
+};
+
+Model::Model(Id id) : min_height_(0.0f), max_height_(0.0f) {
+	switch (id) {
+	case POWER_TOWER:
+		BuildPowerTower();
+		break;
+	case TREE:
+		BuildTree();
+		break;
+	case STREET_LAMP:
+		BuildStreetLamp();
+		break;
+	case MAST:
+		BuildMast();
+		break;
+	default:
+		throw Exception() << "unknown model " << (int)id;
+	}
+
+	for (VertexVector::const_iterator i = lines_vertices_.begin(); i != lines_vertices_.end(); ++i) {
+		min_height_ = std::min(min_height_, i->z);
+		max_height_ = std::max(max_height_, i->z);
+	}
+	for (VertexVector::const_iterator i = convex_vertices_.begin(); i != convex_vertices_.end(); ++i) {
+		min_height_ = std::min(min_height_, i->z);
+		max_height_ = std::max(max_height_, i->z);
+	}
+}
+
+const Model& Model::Get(int id) {
+	if (!IsValid(id))
+		throw Exception() << "unknown model " << id;
+
+	return BUILTIN_MODELS[id];
+}
+
+void Model::AddLine(const Vector3f& a, const Vector3f& b) {
+	lines_vertices_.push_back(a);
+	lines_vertices_.push_back(b);
+	lines_lengths_.push_back(2);
+}
+
+void Model::AddTriangle(const Vector3f& a, const Vector3f& b, const Vector3f& c) {
+	convex_vertices_.push_back(a);
+	convex_vertices_.push_back(b);
+	convex_vertices_.push_back(c);
+	convex_lengths_.push_back(3);
+}
+
+void Model::AddQuad(const Vector3f& a, const Vector3f& b, const Vector3f& c, const Vector3f& d) {
+	convex_vertices_.push_back(a);
+	convex_vertices_.push_back(b);
+	convex_vertices_.push_back(c);
+	convex_vertices_.push_back(d);
+	convex_lengths_.push_back(4);
+}
+
+/* base corners, counterclockwise when seen from above */
+static const float SQUARE_CORNERS[4][2] = { { 1, 1 }, { -1, 1 }, { -1, -1 }, { 1, -1 } };
+
+void Model::AddFrustum(float bottom_width, float top_width, float bottom, float top) {
+	for (int i = 0; i < 4; ++i) {
+		const float* a = SQUARE_CORNERS[i];
+		const float* b = SQUARE_CORNERS[(i + 1) % 4];
+		AddQuad(
+				Vector3f(a[0] * bottom_width, a[1] * bottom_width, bottom),
+				Vector3f(b[0] * bottom_width, b[1] * bottom_width, bottom),
+				Vector3f(b[0] * top_width, b[1] * top_width, top),
+				Vector3f(a[0] * top_width, a[1] * top_width, top)
+			);
+	}
+}
+
+void Model::AddPyramid(float width, float base, float apex) {
+	for (int i = 0; i < 4; ++i) {
+		Vector3f a(SQUARE_CORNERS[i][0] * width, SQUARE_CORNERS[i][1] * width, base);
+		Vector3f b(SQUARE_CORNERS[(i + 1) % 4][0] * width, SQUARE_CORNERS[(i + 1) % 4][1] * width, base);
+
+		/* keep faces counterclockwise when seen from outside */
+		if (apex > base)
+			AddTriangle(a, b, Vector3f(0, 0, apex));
+		else
+			AddTriangle(b, a, Vector3f(0, 0, apex));
+	}
+}
+
+const Model::VertexVector& Model::GetLinesVertices() const {
+	return lines_vertices_;
+}
+
+const Model::LengthVector& Model::GetLinesLengths() const {
+	return lines_lengths_;
+}
+
+const Model::VertexVector& Model::GetConvexVertices() const {
+	return convex_vertices_;
+}
+
+const Model::LengthVector& Model::GetConvexLengths() const {
+	return convex_lengths_;
+}
+
+float Model::GetMinHeight() const {
+	return min_height_;
+}
+
+float Model::GetMaxHeight() const {
+	return max_height_;
+}
+
+/* placeholder lattice tower until real models are added */
+void Model::BuildPowerTower() {
+	float w1 = 1.05;
+	float w2 = 0.5;
+	float h1 = 11.0;
+	float h2 = 21.0;
+	float h3 = 23.0;
+
+	/* lower section */
+	AddQuad(Vector3f(w1, w1, 0.0), Vector3f(-w1, w1, 0.0), Vector3f(-w2, w2, h1), Vector3f(w2, w2, h1));
+	AddQuad(Vector3f(-w1, w1, 0.0), Vector3f(-w1, -w1, 0.0), Vector3f(-w2, -w2, h1), Vector3f(-w2, w2, h1));
+	AddQuad(Vector3f(-w1, -w1, 0.0), Vector3f(w1, -w1, 0.0), Vector3f(w2, -w2, h1), Vector3f(-w2, -w2, h1));
+	AddQuad(Vector3f(w1, -w1, 0.0), Vector3f(w1, w1, 0.0), Vector3f(w2, w2, h1), Vector3f(w2, -w2, h1));
+
+	AddLine(Vector3f(w1, w1, 0.0), Vector3f(-w1, w1, 0.0));
+	AddLine(Vector3f(-w1, w1, 0.0), Vector3f(-w1, -w1, 0.0));
+	AddLine(Vector3f(-w1, -w1, 0.0), Vector3f(w1, -w1, 0.0));
+	AddLine(Vector3f(w1, -w1, 0.0), Vector3f(w1, w1, 0.0));
+
+	AddLine(Vector3f(-w1, w1, 0.0), Vector3f(-w2, w2, h1));
+	AddLine(Vector3f(-w1, -w1, 0.0), Vector3f(-w2, -w2, h1));
+	AddLine(Vector3f(w1, -w1, 0.0), Vector3f(w2, -w2, h1));
+	AddLine(Vector3f(w1, w1, 0.0), Vector3f(w2, w2, h1));
+
+	/* middle section */
+	AddQuad(Vector3f(w2, w2, h1), Vector3f(-w2, w2, h1), Vector3f(-w2, w2, h2), Vector3f(w2, w2, h2));
+	AddQuad(Vector3f(-w2, w2, h1), Vector3f(-w2, -w2, h1), Vector3f(-w2, -w2, h2), Vector3f(-w2, w2, h2));
+	AddQuad(Vector3f(-w2, -w2, h1), Vector3f(w2, -w2, h1), Vector3f(w2, -w2, h2), Vector3f(-w2, -w2, h2));
+	AddQuad(Vector3f(w2, -w2, h1), Vector3f(w2, w2, h1), Vector3f(w2, w2, h2), Vector3f(w2, -w2, h2));
+
+	AddLine(Vector3f(w2, w2, h1), Vector3f(-w2, w2, h1));
+	AddLine(Vector3f(-w2, w2, h1), Vector3f(-w2, -w2, h1));
+	AddLine(Vector3f(-w2, -w2, h1), Vector3f(w2, -w2, h1));
+	AddLine(Vector3f(w2, -w2, h1), Vector3f(w2, w2, h1));
+
+	AddLine(Vector3f(-w2, w2, h1), Vector3f(-w2, w2, h2));
+	AddLine(Vector3f(-w2, -w2, h1), Vector3f(-w2, -w2, h2));
+	AddLine(Vector3f(w2, -w2, h1), Vector3f(w2, -w2, h2));
+	AddLine(Vector3f(w2, w2, h1), Vector3f(w2, w2, h2));
+
+	/* top section */
+	AddTriangle(Vector3f(w2, w2, h2), Vector3f(-w2, w2, h2), Vector3f(0, 0, h3));
+	AddTriangle(Vector3f(-w2, w2, h2), Vector3f(-w2, -w2, h2), Vector3f(0, 0, h3));
+	AddTriangle(Vector3f(-w2, -w2, h2), Vector3f(w2, -w2, h2), Vector3f(0, 0, h3));
+	AddTriangle(Vector3f(w2, -w2, h2), Vector3f(w2, w2, h2), Vector3f(0, 0, h3));
+
+	AddLine(Vector3f(w2, w2, h2), Vector3f(-w2, w2, h2));
+//	AddLine(Vector3f(-w2, w2, h2), Vector3f(-w2, -w2, h2));
+	AddLine(Vector3f(-w2, -w2, h2), Vector3f(w2, -w2, h2));
+//	AddLine(Vector3f(w2, -w2, h2), Vector3f(w2, w2, h2));
+
+	AddLine(Vector3f(w2, w2, h2), Vector3f(0, 0, h3));
+	AddLine(Vector3f(-w2, w2, h2), Vector3f(0, 0, h3));
+	AddLine(Vector3f(-w2, -w2, h2), Vector3f(0, 0, h3));
+	AddLine(Vector3f(w2, -w2, h2), Vector3f(0, 0, h3));
+
+	/* arms */
+	for (int h = 14; h <= 21; h += 3) {
+		float l = (h == 17) ? 3.3 : 2.0;
+		AddTriangle(Vector3f(w2, -w2, h), Vector3f(w2, w2, h), Vector3f(l, 0.0, h));
+		AddTriangle(Vector3f(w2, -w2, h+1), Vector3f(w2, -w2, h), Vector3f(l, 0.0, h));
+		AddTriangle(Vector3f(w2, w2, h+1), Vector3f(w2, -w2, h+1), Vector3f(l, 0.0, h));
+		AddTriangle(Vector3f(w2, w2, h), Vector3f(w2, w2, h+1), Vector3f(l, 0.0, h));
+
+		AddLine(Vector3f(w2, -w2, h), Vector3f(w2, w2, h));
+		AddLine(Vector3f(w2, -w2, h+1), Vector3f(w2, w2, h+1));
+
+		AddLine(Vector3f(w2, w2, h), Vector3f(l, 0.0, h));
+		AddLine(Vector3f(w2, -w2, h), Vector3f(l, 0.0, h));
+		AddLine(Vector3f(w2, w2, h+1), Vector3f(l, 0.0, h));
+		AddLine(Vector3f(w2, -w2, h+1), Vector3f(l, 0.0, h));
+
+		AddTriangle(Vector3f(-w2, w2, h), Vector3f(-w2, -w2, h), Vector3f(-l, 0.0, h));
+		AddTriangle(Vector3f(-w2, -w2, h), Vector3f(-w2, -w2, h+1), Vector3f(-l, 0.0, h));
+		AddTriangle(Vector3f(-w2, -w2, h+1), Vector3f(-w2, w2, h+1), Vector3f(-l, 0.0, h));
+		AddTriangle(Vector3f(-w2, w2, h+1), Vector3f(-w2, w2, h), Vector3f(-l, 0.0, h));
+
+		AddLine(Vector3f(-w2, w2, h), Vector3f(-l, 0.0, h));
+		AddLine(Vector3f(-w2, -w2, h), Vector3f(-l, 0.0, h));
+		AddLine(Vector3f(-w2, w2, h+1), Vector3f(-l, 0.0, h));
+		AddLine(Vector3f(-w2, -w2, h+1), Vector3f(-l, 0.0, h));
+
+		AddLine(Vector3f(-w2, -w2, h), Vector3f(-w2, w2, h));
+		AddLine(Vector3f(-w2, -w2, h+1), Vector3f(-w2, w2, h+1));
+	}
+}
+
+
+/* generic deciduous tree: trunk and a double pyramid crown */
+void Model::BuildTree() {
+	AddFrustum(0.2, 0.15, 0.0, 2.5);
+
+	AddPyramid(2.0, 5.0, 9.0);
+	AddPyramid(2.0, 5.0, 2.0);
+}
+
+/* pole with an arm and a lamp head at its end */
+void Model::BuildStreetLamp() {
+	float h = 7.0;
+	float arm = 1.2;
+
+	AddFrustum(0.1, 0.06, 0.0, h);
+
+	AddLine(Vector3f(0.0, 0.0, 0.0), Vector3f(0.0, 0.0, h));
+	AddLine(Vector3f(0.0, 0.0, h), Vector3f(arm, 0.0, h));
+
+	AddQuad(Vector3f(arm - 0.3, 0.15, h), Vector3f(arm - 0.3, -0.15, h), Vector3f(arm + 0.3, -0.15, h), Vector3f(arm + 0.3, 0.15, h));
+	AddQuad(Vector3f(arm + 0.3, 0.15, h - 0.1), Vector3f(arm + 0.3, -0.15, h - 0.1), Vector3f(arm - 0.3, -0.15, h - 0.1), Vector3f(arm - 0.3, 0.15, h - 0.1));
+}
+
+/* antenna mast or communication tower of unknown shape */
+void Model::BuildMast() {
+	float w1 = 1.5;
+	float w2 = 0.4;
+	float h1 = 40.0;
+	float h2 = 45.0;
+
+	AddFrustum(w1, w2, 0.0, h1);
+	AddPyramid(w2, h1, h2);
+
+	for (int i = 0; i < 4; ++i) {
+		const float* a = SQUARE_CORNERS[i];
+		AddLine(Vector3f(a[0] * w1, a[1] * w1, 0.0), Vector3f(a[0] * w2, a[1] * w2, h1));
+	}
+	AddLine(Vector3f(0.0, 0.0, h1), Vector3f(0.0, 0.0, h2));
+}
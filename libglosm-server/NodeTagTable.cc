@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/NodeTagTable.hh>
+
+#include <algorithm>
+
+NodeTagTable::NodeTagTable() {
+}
+
+void NodeTagTable::Fill(const Entry& entry, TaggedNode& out) const {
+	out.Id = entry.id;
+	out.Pos = entry.pos;
+	out.Tags = entry.ntags ? &tags_[entry.first_tag] : NULL;
+	out.TagsCount = entry.ntags;
+}
+
+void NodeTagTable::Add(osmid_t id, const Vector2i& pos, const TagList& tags) {
+	Entry entry;
+	entry.id = id;
+	entry.pos = pos;
+	entry.first_tag = 0;
+	entry.ntags = tags.size();
+
+	if (!tags.empty()) {
+		TagVector set(tags.begin(), tags.end());
+		std::pair<TagSetMap::iterator, bool> p = tag_sets_.insert(std::make_pair(set, (unsigned int)tags_.size()));
+		if (p.second)
+			tags_.insert(tags_.end(), set.begin(), set.end());
+		entry.first_tag = p.first->second;
+	}
+
+	entries_.push_back(entry);
+}
+
+void NodeTagTable::Build() {
+	/* stable, so the last of same id entries is the latest one */
+	std::stable_sort(entries_.begin(), entries_.end(), EntryIdLess());
+
+	EntryVector::iterator out = entries_.begin();
+	for (EntryVector::iterator i = entries_.begin(); i != entries_.end(); ++i) {
+		if (i + 1 != entries_.end() && (i + 1)->id == i->id)
+			continue;
+		if (i->ntags != 0)
+			*out++ = *i;
+	}
+	entries_.erase(out, entries_.end());
+	EntryVector(entries_).swap(entries_);
+
+	/* sets are only deduplicated while loading, as map of them
+	 * takes more memory than the sets themselves */
+	TagSetMap().swap(tag_sets_);
+	TagVector(tags_).swap(tags_);
+
+	index_.clear();
+	index_.Reserve(entries_.size());
+	for (size_t i = 0; i < entries_.size(); ++i)
+		index_.Insert(BBoxi(entries_[i].pos, entries_[i].pos), i);
+	index_.Build();
+}
+
+bool NodeTagTable::Find(osmid_t id, TaggedNode& out) const {
+	EntryVector::const_iterator i = std::lower_bound(entries_.begin(), entries_.end(), id, EntryIdLess());
+	if (i == entries_.end() || i->id != id)
+		return false;
+
+	Fill(*i, out);
+	return true;
+}
+
+void NodeTagTable::Query(std::vector<TaggedNode>& out, const BBoxi& bbox) const {
+	std::vector<unsigned int> found;
+	index_.Query(bbox, found);
+
+	size_t first = out.size();
+	out.resize(first + found.size());
+	for (size_t i = 0; i < found.size(); ++i)
+		Fill(entries_[found[i]], out[first + i]);
+}
+
+size_t NodeTagTable::size() const {
+	return entries_.size();
+}
+
+size_t NodeTagTable::GetTagsCount() const {
+	return tags_.size();
+}
+
+size_t NodeTagTable::GetMemoryUsage() const {
+	return entries_.capacity() * sizeof(Entry) + tags_.capacity() * sizeof(Tag) + index_.GetItems().capacity() * sizeof(EntriesIndex::Item) + index_.GetNodes().capacity() * sizeof(EntriesIndex::Node);
+}
+
+void NodeTagTable::Clear() {
+	EntryVector().swap(entries_);
+	TagVector().swap(tags_);
+	TagSetMap().swap(tag_sets_);
+	index_.clear();
+}
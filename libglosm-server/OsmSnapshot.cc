@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/OsmSnapshot.hh>
+
+#include <glosm/Exception.hh>
+#include <glosm/WayClassifier.hh>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+const char OsmSnapshot::MAGIC[8] = { 'G', 'L', 'O', 'S', 'M', 'S', 'N', 'P' };
+
+struct WayIdLess {
+	bool operator()(const OsmSnapshot::Way& a, const OsmSnapshot::Way& b) const {
+		return a.id < b.id;
+	}
+};
+
+static uint64_t Align(uint64_t offset) {
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+static void WriteAt(FILE* f, uint64_t offset, const void* data, size_t size) {
+	if (size == 0)
+		return;
+	if (fseeko(f, offset, SEEK_SET) != 0)
+		throw SystemError() << "cannot seek in snapshot file";
+	if (fwrite(data, size, 1, f) != 1)
+		throw SystemError() << "cannot write snapshot file";
+}
+
+OsmSnapshotWriter::OsmSnapshotWriter() : bbox_(BBoxi::Empty()), max_height_(0) {
+}
+
+uint32_t OsmSnapshotWriter::MapString(strid_t id) {
+	if (id >= string_map_.size())
+		string_map_.resize(id + 1, (uint32_t)-1);
+
+	if (string_map_[id] == (uint32_t)-1) {
+		string_map_[id] = strings_.size();
+		strings_.push_back(id);
+	}
+
+	return string_map_[id];
+}
+
+void OsmSnapshotWriter::SetBBox(const BBoxi& bbox) {
+	bbox_ = bbox;
+}
+
+void OsmSnapshotWriter::AddWay(osmid_t id, const OsmDatasource::Way& way, const OsmDatasource::Way::CoordsList& coords) {
+	OsmSnapshot::Way rec;
+	memset(&rec, 0, sizeof(rec));
+
+	rec.id = id;
+	rec.first_coord = coords_.size();
+	rec.ncoords = coords.size();
+	rec.first_tag = tags_.size();
+	rec.ntags = way.Tags.size();
+	rec.first_ring = rings_.size();
+	rec.nrings = way.Rings.size();
+	rec.bbox[0] = way.BBox.left;
+	rec.bbox[1] = way.BBox.bottom;
+	rec.bbox[2] = way.BBox.right;
+	rec.bbox[3] = way.BBox.top;
+	rec.closed = way.Closed;
+	rec.clockwise = way.Clockwise;
+
+	coords_.insert(coords_.end(), coords.begin(), coords.end());
+	rings_.insert(rings_.end(), way.Rings.begin(), way.Rings.end());
+
+	for (OsmDatasource::TagsMap::const_iterator t = way.Tags.begin(); t != way.Tags.end(); ++t) {
+		OsmSnapshot::Tag tag;
+		tag.key = MapString(t->first);
+		tag.value = MapString(t->second);
+		tags_.push_back(tag);
+	}
+
+	ways_.push_back(rec);
+
+	max_height_ = std::max(max_height_, GetWayTopHeight(way));
+}
+
+void OsmSnapshotWriter::Write(const char* filename) {
+	std::sort(ways_.begin(), ways_.end(), WayIdLess());
+
+	OsmSnapshot::Index index;
+	index.Reserve(ways_.size());
+	for (size_t i = 0; i < ways_.size(); ++i)
+		index.Insert(BBoxi(ways_[i].bbox[0], ways_[i].bbox[1], ways_[i].bbox[2], ways_[i].bbox[3]), i);
+	index.Build();
+
+	/* string table */
+	StringTable& table = StringTable::Instance();
+	std::vector<uint64_t> string_offsets;
+	std::vector<char> strings;
+	string_offsets.reserve(strings_.size());
+	for (std::vector<strid_t>::const_iterator i = strings_.begin(); i != strings_.end(); ++i) {
+		const std::string& str = table.Get(*i);
+		string_offsets.push_back(strings.size());
+		strings.insert(strings.end(), str.c_str(), str.c_str() + str.length() + 1);
+	}
+
+	/* layout */
+	OsmSnapshot::Header header;
+	memset(&header, 0, sizeof(header));
+
+	memcpy(header.magic, OsmSnapshot::MAGIC, sizeof(header.magic));
+	header.version = OsmSnapshot::VERSION;
+	header.max_height = max_height_;
+
+	header.bbox[0] = bbox_.left;
+	header.bbox[1] = bbox_.bottom;
+	header.bbox[2] = bbox_.right;
+	header.bbox[3] = bbox_.top;
+
+	header.nways = ways_.size();
+	header.ncoords = coords_.size();
+	header.ntags = tags_.size();
+	header.nrings = rings_.size();
+	header.nstrings = string_offsets.size();
+	header.strings_size = strings.size();
+	header.nindex_items = index.GetItems().size();
+	header.nindex_nodes = index.GetNodes().size();
+	header.nindex_leaves = index.GetLeafCount();
+
+	header.ways_offset = Align(sizeof(header));
+	header.coords_offset = Align(header.ways_offset + header.nways * sizeof(OsmSnapshot::Way));
+	header.tags_offset = Align(header.coords_offset + header.ncoords * sizeof(Vector2i));
+	header.rings_offset = Align(header.tags_offset + header.ntags * sizeof(OsmSnapshot::Tag));
+	header.string_offsets_offset = Align(header.rings_offset + header.nrings * sizeof(uint32_t));
+	header.strings_offset = Align(header.string_offsets_offset + header.nstrings * sizeof(uint64_t));
+	header.index_items_offset = Align(header.strings_offset + header.strings_size);
+	header.index_nodes_offset = Align(header.index_items_offset + header.nindex_items * sizeof(OsmSnapshot::Index::Item));
+
+	/* write */
+	FILE* f = fopen(filename, "wb");
+	if (f == NULL)
+		throw SystemError() << "cannot create snapshot file";
+
+	try {
+		WriteAt(f, 0, &header, sizeof(header));
+		if (!ways_.empty())
+			WriteAt(f, header.ways_offset, &ways_[0], ways_.size() * sizeof(OsmSnapshot::Way));
+		if (!coords_.empty())
+			WriteAt(f, header.coords_offset, &coords_[0], coords_.size() * sizeof(Vector2i));
+		if (!tags_.empty())
+			WriteAt(f, header.tags_offset, &tags_[0], tags_.size() * sizeof(OsmSnapshot::Tag));
+		if (!rings_.empty())
+			WriteAt(f, header.rings_offset, &rings_[0], rings_.size() * sizeof(uint32_t));
+		if (!string_offsets.empty())
+			WriteAt(f, header.string_offsets_offset, &string_offsets[0], string_offsets.size() * sizeof(uint64_t));
+		if (!strings.empty())
+			WriteAt(f, header.strings_offset, &strings[0], strings.size());
+		if (!index.GetItems().empty())
+			WriteAt(f, header.index_items_offset, &index.GetItems()[0], index.GetItems().size() * sizeof(OsmSnapshot::Index::Item));
+		if (!index.GetNodes().empty())
+			WriteAt(f, header.index_nodes_offset, &index.GetNodes()[0], index.GetNodes().size() * sizeof(OsmSnapshot::Index::Node));
+	} catch (...) {
+		fclose(f);
+		throw;
+	}
+
+	if (fclose(f) != 0)
+		throw SystemError() << "cannot write snapshot file";
+}
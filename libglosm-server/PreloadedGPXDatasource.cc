@@ -20,6 +20,16 @@
 
 #include <glosm/PreloadedGPXDatasource.hh>
 #include <glosm/ParsingHelpers.hh>
+#include <glosm/GeometryOperations.hh>
+#include <glosm/geomath.h>
+
+#include <algorithm>
+#include <cassert>
+
+const size_t PreloadedGPXDatasource::POINTS_PER_PIECE;
+
+/* highest tile level for each overview layer */
+static const int GPX_OVERVIEW_MAX_LEVELS[] = { 8, 10, 12 };
 
 PreloadedGPXDatasource::PreloadedGPXDatasource() : XMLParser(XMLParser::HANDLE_ELEMENTS | XMLParser::HANDLE_CHARDATA) {
 }
@@ -44,9 +54,10 @@ void PreloadedGPXDatasource::StartElement(const char* name, const char** atts) {
 				++att;
 		}
 
-		points_.push_back(Vector3i(lon, lat, 0));
+		tracks_.points.push_back(Vector3i(lon, lat, 0));
 	} else if (tag_level_ == 2 && current_tag_ == TRK && StrEq<-1>(name, "trkseg")) {
 		current_tag_ = TRKSEG;
+		tracks_.segments.push_back(tracks_.points.size());
 	} else if (tag_level_ == 1 && current_tag_ == GPX && StrEq<-1>(name, "trk")) {
 		current_tag_ = TRK;
 	} else if (tag_level_ == 0 && current_tag_ == NONE && StrEq<-1>(name, "gpx")) {
@@ -76,18 +87,151 @@ void PreloadedGPXDatasource::EndElement(const char* /*name*/) {
 void PreloadedGPXDatasource::CharacterData(const char* data, int len) {
 	std::string buf(data, len);
 	if (tag_level_ == 5 && current_tag_ == ELE)
-		points_.back().z = ParseEle(buf.c_str());
+		tracks_.points.back().z = ParseEle(buf.c_str());
+}
+
+struct PreloadedGPXDatasource::PieceScanner {
+	const TrackLayer& layer;
+	const BBoxi& bbox;
+	std::vector<Vector3i>& out;
+
+	PieceScanner(const TrackLayer& l, const BBoxi& b, std::vector<Vector3i>& o) : layer(l), bbox(b), out(o) {
+	}
+
+	void operator()(unsigned int piece) {
+		const TrackPiece& current = layer.pieces[piece];
+		for (size_t i = current.first; i < current.first + current.count; ++i)
+			if (bbox.Contains(layer.points[i]))
+				out.push_back(layer.points[i]);
+	}
+};
+
+void PreloadedGPXDatasource::IndexSegments(TrackLayer& layer, size_t first_segment) {
+	if (first_segment == layer.segments.size())
+		return;
+
+	for (size_t segment = first_segment; segment < layer.segments.size(); ++segment) {
+		size_t begin = layer.segments[segment];
+		size_t end = (segment + 1 < layer.segments.size()) ? layer.segments[segment + 1] : layer.points.size();
+
+		/* consecutive track points are close to each other,
+		 * so pieces are compact without any reordering */
+		for (size_t i = begin; i < end; i += POINTS_PER_PIECE) {
+			TrackPiece piece(i, std::min(POINTS_PER_PIECE, end - i), i + POINTS_PER_PIECE < end);
+
+			BBoxi bbox = BBoxi::Empty();
+			for (size_t j = piece.first; j < piece.first + piece.count; ++j)
+				bbox.Include(layer.points[j]);
+
+			layer.index.Insert(bbox, layer.pieces.size());
+			layer.pieces.push_back(piece);
+		}
+	}
+
+	layer.index.Build();
+}
+
+void PreloadedGPXDatasource::FinishSegments(size_t first_segment) {
+	assert(sizeof(GPX_OVERVIEW_MAX_LEVELS) / sizeof(GPX_OVERVIEW_MAX_LEVELS[0]) == NUM_OVERVIEW_LAYERS);
+
+	/* each layer is simplified from the next, more detailed
+	 * one; all layers have the same segments, so these may
+	 * be told by index */
+	const TrackLayer* source = &tracks_;
+	PointsVector simplified;
+	for (int i = NUM_OVERVIEW_LAYERS - 1; i >= 0; --i) {
+		TrackLayer& layer = overviews_[i];
+		layer.max_level = GPX_OVERVIEW_MAX_LEVELS[i];
+
+		osmint_t tolerance = GetSimplifyTolerance((osmlong_t)GEOM_LONSPAN >> layer.max_level);
+
+		for (size_t segment = first_segment; segment < source->segments.size(); ++segment) {
+			size_t begin = source->segments[segment];
+			size_t end = (segment + 1 < source->segments.size()) ? source->segments[segment + 1] : source->points.size();
+
+			simplified.assign(source->points.begin() + begin, source->points.begin() + end);
+			SimplifyPolyline(simplified, tolerance);
+
+			layer.segments.push_back(layer.points.size());
+			layer.points.insert(layer.points.end(), simplified.begin(), simplified.end());
+		}
+
+		IndexSegments(layer, first_segment);
+
+		source = &layer;
+	}
+
+	IndexSegments(tracks_, first_segment);
 }
 
 void PreloadedGPXDatasource::Load(const char* filename) {
 	current_tag_ = NONE;
 	tag_level_ = 0;
 
-	XMLParser::Load(filename);
+	size_t first_segment = tracks_.segments.size();
+
+	try {
+		XMLParser::Load(filename);
+	} catch (...) {
+		/* keep whatever was parsed, as before */
+		FinishSegments(first_segment);
+		throw;
+	}
+
+	FinishSegments(first_segment);
 }
 
 void PreloadedGPXDatasource::GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const {
-	for (PointsVector::const_iterator i = points_.begin(); i != points_.end(); ++i)
-		if (bbox.Contains(*i))
-			out.push_back(*i);
+	PieceScanner scanner(tracks_, bbox, out);
+	tracks_.index.Visit(bbox, scanner);
+}
+
+void PreloadedGPXDatasource::GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int level) const {
+	const TrackLayer* layer = &tracks_;
+	for (int i = 0; i < NUM_OVERVIEW_LAYERS; ++i) {
+		if (level <= overviews_[i].max_level) {
+			layer = &overviews_[i];
+			break;
+		}
+	}
+
+	/* in order of pieces, so runs may go on from one piece
+	 * to the next one */
+	std::vector<unsigned int> pieces;
+	layer->index.Query(bbox, pieces);
+	std::sort(pieces.begin(), pieces.end());
+
+	bool run = false;
+	for (size_t n = 0; n < pieces.size(); ++n) {
+		const TrackPiece& piece = layer->pieces[pieces[n]];
+
+		for (size_t i = piece.first; i < piece.first + piece.count; ++i) {
+			if (bbox.Contains(layer->points[i])) {
+				if (!run)
+					lengths.push_back(0);
+				run = true;
+			} else if (!run) {
+				continue;
+			} else {
+				/* end of segment which starts inside */
+				run = false;
+			}
+
+			points.push_back(layer->points[i]);
+			lengths.back()++;
+		}
+
+		if (!run)
+			continue;
+
+		/* if next piece is not visited, its first point is
+		 * outside bbox, so the run ends there */
+		if (piece.continued && (n + 1 == pieces.size() || pieces[n + 1] != pieces[n] + 1)) {
+			points.push_back(layer->points[piece.first + piece.count]);
+			lengths.back()++;
+			run = false;
+		} else if (!piece.continued) {
+			run = false;
+		}
+	}
 }
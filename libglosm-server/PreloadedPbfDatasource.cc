@@ -0,0 +1,720 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * OSM PBF format loader
+ *
+ * See http://wiki.openstreetmap.org/wiki/PBF_Format for format
+ * description. We don't use protobuf library here, as the format
+ * is simple enough to be decoded by hand, which is also faster
+ * since we don't need intermediate message objects.
+ */
+
+#include <glosm/PreloadedPbfDatasource.hh>
+
+#include <glosm/Exception.hh>
+#include <glosm/ParallelTasks.hh>
+#include <glosm/geomath.h>
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+/* limits from format specification */
+static const size_t MAX_BLOB_HEADER_SIZE = 64 * 1024;
+static const size_t MAX_BLOB_SIZE = 32 * 1024 * 1024;
+
+/* number of blobs read at once per decoding thread */
+static const int BLOBS_PER_THREAD = 4;
+
+/**
+ * Minimal reader of protocol buffers wire format
+ */
+class ProtobufReader {
+public:
+	enum WireType {
+		VARINT = 0,
+		FIXED64 = 1,
+		LENGTH_DELIMITED = 2,
+		FIXED32 = 5,
+	};
+
+protected:
+	const unsigned char* cur_;
+	const unsigned char* end_;
+	uint64_t key_;
+
+public:
+	ProtobufReader(const char* data, size_t len) : cur_((const unsigned char*)data), end_((const unsigned char*)data + len), key_(0) {
+	}
+
+	/** Reads next field key, returns false at the end of message */
+	bool Next() {
+		if (cur_ >= end_)
+			return false;
+		key_ = Varint();
+		return true;
+	}
+
+	int Field() const {
+		return key_ >> 3;
+	}
+
+	int Type() const {
+		return key_ & 7;
+	}
+
+	uint64_t Varint() {
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			if (cur_ >= end_)
+				throw ParsingException() << "truncated varint";
+			unsigned char byte = *cur_++;
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return value;
+		}
+		throw ParsingException() << "varint is too long";
+	}
+
+	int64_t SVarint() {
+		uint64_t value = Varint();
+		return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+	}
+
+	void Bytes(const char*& data, size_t& len) {
+		uint64_t size = Varint();
+		if (size > (uint64_t)(end_ - cur_))
+			throw ParsingException() << "truncated field";
+		data = (const char*)cur_;
+		len = size;
+		cur_ += size;
+	}
+
+	/** Returns reader for embedded message or packed field */
+	ProtobufReader Message() {
+		const char* data;
+		size_t len;
+		Bytes(data, len);
+		return ProtobufReader(data, len);
+	}
+
+	void Skip() {
+		const char* data;
+		size_t len;
+		switch (Type()) {
+		case VARINT: Varint(); break;
+		case LENGTH_DELIMITED: Bytes(data, len); break;
+		case FIXED64: SkipBytes(8); break;
+		case FIXED32: SkipBytes(4); break;
+		default:
+			throw ParsingException() << "unsupported protobuf wire type " << Type();
+		}
+	}
+
+	void SkipBytes(size_t count) {
+		if (count > (size_t)(end_ - cur_))
+			throw ParsingException() << "truncated field";
+		cur_ += count;
+	}
+
+	bool AtEnd() const {
+		return cur_ >= end_;
+	}
+};
+
+/**
+ * Data of a single PBF blob, raw and decoded
+ */
+struct PbfBlock {
+	struct Node {
+		osmid_t id;
+		osmint_t lon;
+		osmint_t lat;
+		size_t first_tag;
+		size_t ntags;
+	};
+
+	struct Way {
+		osmid_t id;
+		size_t first_ref;
+		size_t first_tag;
+		size_t nrefs;
+		size_t ntags;
+	};
+
+	struct Member {
+		OsmDatasource::Relation::Member::Type_t type;
+		osmid_t ref;
+		uint32_t role;
+	};
+
+	struct Relation {
+		osmid_t id;
+		size_t first_member;
+		size_t first_tag;
+		size_t nmembers;
+		size_t ntags;
+	};
+
+	typedef std::pair<uint32_t, uint32_t> Tag;
+
+	/* input */
+	std::string type;
+	std::vector<char> blob;
+	bool node_tags; /* decode node tags, which are skipped otherwise */
+
+	/* output */
+	bool has_bbox;
+	BBoxi bbox;
+
+	std::vector<std::string> strings;
+	std::vector<Node> nodes;
+	std::vector<Way> ways;
+	std::vector<osmid_t> refs;
+	std::vector<Relation> relations;
+	std::vector<Member> members;
+	std::vector<Tag> tags;
+
+	std::string error;
+
+	PbfBlock() : node_tags(false), has_bbox(false), bbox(BBoxi::Empty()) {
+	}
+};
+
+/* converts nanodegrees into fixed point coords */
+static osmint_t FromNanodegrees(int64_t value) {
+	const int64_t divisor = 1000000000LL / GEOM_UNITSINDEGREE;
+	return (osmint_t)(value >= 0 ? (value + divisor / 2) / divisor : (value - divisor / 2) / divisor);
+}
+
+template <class T, class F>
+static void ReadPacked(ProtobufReader& reader, std::vector<T>& out, F read) {
+	if (reader.Type() == ProtobufReader::LENGTH_DELIMITED) {
+		ProtobufReader packed = reader.Message();
+		while (!packed.AtEnd())
+			out.push_back((packed.*read)());
+	} else {
+		out.push_back((reader.*read)());
+	}
+}
+
+static void DecompressBlob(const std::vector<char>& blob, std::vector<char>& out) {
+	ProtobufReader reader(&blob[0], blob.size());
+
+	const char* raw = NULL;
+	const char* zdata = NULL;
+	size_t raw_len = 0, zdata_len = 0;
+	uint64_t raw_size = 0;
+
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: reader.Bytes(raw, raw_len); break;
+		case 2: raw_size = reader.Varint(); break;
+		case 3: reader.Bytes(zdata, zdata_len); break;
+		case 4: throw ParsingException() << "lzma compressed blobs are not supported";
+		case 6: throw ParsingException() << "lz4 compressed blobs are not supported";
+		case 7: throw ParsingException() << "zstd compressed blobs are not supported";
+		default: reader.Skip(); break;
+		}
+	}
+
+	if (raw != NULL) {
+		out.assign(raw, raw + raw_len);
+	} else if (zdata != NULL) {
+		if (raw_size == 0 || raw_size > MAX_BLOB_SIZE)
+			throw ParsingException() << "bad blob raw size";
+
+		out.resize(raw_size);
+		uLongf len = raw_size;
+		if (uncompress((Bytef*)&out[0], &len, (const Bytef*)zdata, zdata_len) != Z_OK || len != raw_size)
+			throw ParsingException() << "cannot decompress blob";
+	} else {
+		throw ParsingException() << "blob contains no data";
+	}
+}
+
+static void DecodeHeaderBlock(PbfBlock& block, const std::vector<char>& data) {
+	ProtobufReader reader(&data[0], data.size());
+
+	while (reader.Next()) {
+		if (reader.Field() == 1) {
+			ProtobufReader bbox = reader.Message();
+			int64_t left = 0, right = 0, top = 0, bottom = 0;
+			while (bbox.Next()) {
+				switch (bbox.Field()) {
+				case 1: left = bbox.SVarint(); break;
+				case 2: right = bbox.SVarint(); break;
+				case 3: top = bbox.SVarint(); break;
+				case 4: bottom = bbox.SVarint(); break;
+				default: bbox.Skip(); break;
+				}
+			}
+			block.has_bbox = true;
+			block.bbox = BBoxi(FromNanodegrees(left), FromNanodegrees(bottom), FromNanodegrees(right), FromNanodegrees(top));
+		} else if (reader.Field() == 4) {
+			const char* feature;
+			size_t len;
+			reader.Bytes(feature, len);
+
+			std::string name(feature, len);
+			if (name != "OsmSchema-V0.6" && name != "DenseNodes")
+				throw ParsingException() << "unsupported required feature " << name;
+		} else {
+			reader.Skip();
+		}
+	}
+}
+
+struct PbfCoordTransform {
+	int64_t granularity;
+	int64_t lat_offset;
+	int64_t lon_offset;
+
+	osmint_t Lat(int64_t lat) const {
+		return FromNanodegrees(lat_offset + granularity * lat);
+	}
+
+	osmint_t Lon(int64_t lon) const {
+		return FromNanodegrees(lon_offset + granularity * lon);
+	}
+};
+
+static void DecodeTags(PbfBlock& block, const std::vector<uint64_t>& keys, const std::vector<uint64_t>& vals, size_t& first, size_t& count) {
+	if (keys.size() != vals.size())
+		throw ParsingException() << "keys and values count mismatch";
+
+	first = block.tags.size();
+	count = keys.size();
+	for (size_t i = 0; i < keys.size(); ++i)
+		block.tags.push_back(PbfBlock::Tag(keys[i], vals[i]));
+}
+
+static void DecodeDenseNodes(PbfBlock& block, ProtobufReader reader, const PbfCoordTransform& transform) {
+	std::vector<int64_t> ids, lats, lons;
+	std::vector<uint64_t> keys_vals;
+
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: ReadPacked(reader, ids, &ProtobufReader::SVarint); break;
+		case 8: ReadPacked(reader, lats, &ProtobufReader::SVarint); break;
+		case 9: ReadPacked(reader, lons, &ProtobufReader::SVarint); break;
+		case 10:
+			if (block.node_tags)
+				ReadPacked(reader, keys_vals, &ProtobufReader::Varint);
+			else
+				reader.Skip();
+			break;
+		default: reader.Skip(); break; /* node info is not stored */
+		}
+	}
+
+	if (ids.size() != lats.size() || ids.size() != lons.size())
+		throw ParsingException() << "dense nodes field count mismatch";
+
+	/* keys_vals is either empty, or has key, value pairs of
+	 * each node terminated by 0 */
+	size_t kv = 0;
+
+	int64_t id = 0, lat = 0, lon = 0;
+	block.nodes.reserve(block.nodes.size() + ids.size());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		id += ids[i];
+		lat += lats[i];
+		lon += lons[i];
+
+		PbfBlock::Node node = { id, transform.Lon(lon), transform.Lat(lat), block.tags.size(), 0 };
+		if (!keys_vals.empty()) {
+			for (; kv < keys_vals.size() && keys_vals[kv] != 0; kv += 2) {
+				if (kv + 1 >= keys_vals.size())
+					throw ParsingException() << "dense nodes keys and values count mismatch";
+				block.tags.push_back(PbfBlock::Tag(keys_vals[kv], keys_vals[kv + 1]));
+				node.ntags++;
+			}
+			if (kv >= keys_vals.size())
+				throw ParsingException() << "dense nodes tags truncated";
+			kv++;
+		}
+		block.nodes.push_back(node);
+	}
+}
+
+static void DecodeNode(PbfBlock& block, ProtobufReader reader, const PbfCoordTransform& transform) {
+	PbfBlock::Node node = { 0, 0, 0, 0, 0 };
+	std::vector<uint64_t> keys, vals;
+
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: node.id = reader.SVarint(); break;
+		case 2: ReadPacked(reader, keys, &ProtobufReader::Varint); break;
+		case 3: ReadPacked(reader, vals, &ProtobufReader::Varint); break;
+		case 8: node.lat = transform.Lat(reader.SVarint()); break;
+		case 9: node.lon = transform.Lon(reader.SVarint()); break;
+		default: reader.Skip(); break;
+		}
+	}
+
+	if (block.node_tags)
+		DecodeTags(block, keys, vals, node.first_tag, node.ntags);
+
+	block.nodes.push_back(node);
+}
+
+static void DecodeWay(PbfBlock& block, ProtobufReader reader) {
+	PbfBlock::Way way;
+	std::vector<uint64_t> keys, vals;
+	std::vector<int64_t> refs;
+
+	way.id = 0;
+
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: way.id = reader.Varint(); break;
+		case 2: ReadPacked(reader, keys, &ProtobufReader::Varint); break;
+		case 3: ReadPacked(reader, vals, &ProtobufReader::Varint); break;
+		case 8: ReadPacked(reader, refs, &ProtobufReader::SVarint); break;
+		default: reader.Skip(); break;
+		}
+	}
+
+	DecodeTags(block, keys, vals, way.first_tag, way.ntags);
+
+	way.first_ref = block.refs.size();
+	way.nrefs = refs.size();
+
+	int64_t ref = 0;
+	for (std::vector<int64_t>::const_iterator i = refs.begin(); i != refs.end(); ++i)
+		block.refs.push_back(ref += *i);
+
+	block.ways.push_back(way);
+}
+
+static void DecodeRelation(PbfBlock& block, ProtobufReader reader) {
+	PbfBlock::Relation relation;
+	std::vector<uint64_t> keys, vals, roles, types;
+	std::vector<int64_t> memids;
+
+	relation.id = 0;
+
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: relation.id = reader.Varint(); break;
+		case 2: ReadPacked(reader, keys, &ProtobufReader::Varint); break;
+		case 3: ReadPacked(reader, vals, &ProtobufReader::Varint); break;
+		case 8: ReadPacked(reader, roles, &ProtobufReader::Varint); break;
+		case 9: ReadPacked(reader, memids, &ProtobufReader::SVarint); break;
+		case 10: ReadPacked(reader, types, &ProtobufReader::Varint); break;
+		default: reader.Skip(); break;
+		}
+	}
+
+	if (roles.size() != memids.size() || roles.size() != types.size())
+		throw ParsingException() << "relation members field count mismatch";
+
+	DecodeTags(block, keys, vals, relation.first_tag, relation.ntags);
+
+	relation.first_member = block.members.size();
+	relation.nmembers = memids.size();
+
+	int64_t ref = 0;
+	for (size_t i = 0; i < memids.size(); ++i) {
+		PbfBlock::Member member;
+		switch (types[i]) {
+		case 0: member.type = OsmDatasource::Relation::Member::NODE; break;
+		case 1: member.type = OsmDatasource::Relation::Member::WAY; break;
+		case 2: member.type = OsmDatasource::Relation::Member::RELATION; break;
+		default: throw ParsingException() << "bad relation member type";
+		}
+		member.ref = ref += memids[i];
+		member.role = roles[i];
+		block.members.push_back(member);
+	}
+
+	block.relations.push_back(relation);
+}
+
+static void DecodePrimitiveBlock(PbfBlock& block, const std::vector<char>& data) {
+	ProtobufReader reader(&data[0], data.size());
+
+	PbfCoordTransform transform = { 100, 0, 0 };
+	std::vector<ProtobufReader> groups;
+
+	/* coordinate transform fields follow groups, so collect
+	 * them first and decode after the whole block is scanned */
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: {
+				ProtobufReader table = reader.Message();
+				while (table.Next()) {
+					if (table.Field() == 1) {
+						const char* str;
+						size_t len;
+						table.Bytes(str, len);
+						block.strings.push_back(std::string(str, len));
+					} else {
+						table.Skip();
+					}
+				}
+			} break;
+		case 2: groups.push_back(reader.Message()); break;
+		case 17: transform.granularity = reader.Varint(); break;
+		case 19: transform.lat_offset = reader.Varint(); break;
+		case 20: transform.lon_offset = reader.Varint(); break;
+		default: reader.Skip(); break;
+		}
+	}
+
+	for (std::vector<ProtobufReader>::iterator group = groups.begin(); group != groups.end(); ++group) {
+		while (group->Next()) {
+			switch (group->Field()) {
+			case 1: DecodeNode(block, group->Message(), transform); break;
+			case 2: DecodeDenseNodes(block, group->Message(), transform); break;
+			case 3: DecodeWay(block, group->Message()); break;
+			case 4: DecodeRelation(block, group->Message()); break;
+			default: group->Skip(); break;
+			}
+		}
+	}
+}
+
+static void DecodeBlock(PbfBlock& block) {
+	try {
+		std::vector<char> data;
+		DecompressBlob(block.blob, data);
+		std::vector<char>().swap(block.blob);
+
+		if (data.empty())
+			return;
+
+		if (block.type == "OSMHeader")
+			DecodeHeaderBlock(block, data);
+		else if (block.type == "OSMData")
+			DecodePrimitiveBlock(block, data);
+	} catch (std::exception& e) {
+		block.error = e.what();
+	}
+}
+
+/* every step'th block starting with start */
+struct PbfTask {
+	std::vector<PbfBlock*>* blocks;
+	size_t start;
+	size_t step;
+};
+
+static void RunPbfTask(PbfTask& task) {
+	for (size_t i = task.start; i < task.blocks->size(); i += task.step)
+		DecodeBlock(*(*task.blocks)[i]);
+}
+
+static void DecodeBlocks(std::vector<PbfBlock*>& blocks, int nthreads) {
+	if (nthreads <= 1 || blocks.size() <= 1) {
+		for (std::vector<PbfBlock*>::iterator i = blocks.begin(); i != blocks.end(); ++i)
+			DecodeBlock(**i);
+		return;
+	}
+
+	std::vector<PbfTask> tasks(nthreads);
+	for (int i = 0; i < nthreads; ++i) {
+		tasks[i].blocks = &blocks;
+		tasks[i].start = i;
+		tasks[i].step = nthreads;
+	}
+
+	/* errors are recorded per block, see DecodeBlock() */
+	RunParallel(tasks, RunPbfTask);
+}
+
+/* returns number of bytes read, which is less than len only at EOF */
+static size_t ReadFull(int fd, char* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = read(fd, buf + done, len - done);
+		if (ret < 0)
+			throw SystemError() << "input read error";
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/* reads next blob from file, returns NULL at EOF */
+static PbfBlock* ReadBlock(int fd) {
+	unsigned char lenbuf[4];
+	size_t got = ReadFull(fd, (char*)lenbuf, sizeof(lenbuf));
+	if (got == 0)
+		return NULL;
+	if (got != sizeof(lenbuf))
+		throw ParsingException() << "truncated blob header length";
+
+	uint32_t header_len = ((uint32_t)lenbuf[0] << 24) | ((uint32_t)lenbuf[1] << 16) | ((uint32_t)lenbuf[2] << 8) | (uint32_t)lenbuf[3];
+	if (header_len == 0 || header_len > MAX_BLOB_HEADER_SIZE)
+		throw ParsingException() << "bad blob header length";
+
+	std::vector<char> header(header_len);
+	if (ReadFull(fd, &header[0], header_len) != header_len)
+		throw ParsingException() << "truncated blob header";
+
+	std::auto_ptr<PbfBlock> block(new PbfBlock);
+	uint64_t datasize = 0;
+
+	ProtobufReader reader(&header[0], header.size());
+	while (reader.Next()) {
+		switch (reader.Field()) {
+		case 1: {
+				const char* type;
+				size_t len;
+				reader.Bytes(type, len);
+				block->type.assign(type, len);
+			} break;
+		case 3: datasize = reader.Varint(); break;
+		default: reader.Skip(); break;
+		}
+	}
+
+	if (datasize == 0 || datasize > MAX_BLOB_SIZE)
+		throw ParsingException() << "bad blob size";
+
+	block->blob.resize(datasize);
+	if (ReadFull(fd, &block->blob[0], datasize) != datasize)
+		throw ParsingException() << "truncated blob";
+
+	return block.release();
+}
+
+static strid_t InternBlockString(const PbfBlock& block, std::vector<strid_t>& ids, uint32_t index) {
+	if (index >= block.strings.size())
+		throw ParsingException() << "bad string table index";
+
+	/* STR_NONE is never a result of interning, so it marks uninterned strings */
+	if (ids[index] == STR_NONE)
+		ids[index] = StringTable::Instance().Intern(block.strings[index].c_str());
+
+	return ids[index];
+}
+
+PreloadedPbfDatasource::PreloadedPbfDatasource(int load_flags, int nthreads) : PreloadedXmlDatasource(load_flags, nthreads) {
+}
+
+PreloadedPbfDatasource::~PreloadedPbfDatasource() {
+}
+
+void PreloadedPbfDatasource::StoreBlock(PbfBlock& block) {
+	if (block.has_bbox)
+		bbox_.Include(block.bbox);
+
+	std::vector<strid_t> ids(block.strings.size(), STR_NONE);
+
+	TagsMap node_tags;
+	for (std::vector<PbfBlock::Node>::const_iterator n = block.nodes.begin(); n != block.nodes.end(); ++n) {
+		nodes_.insert(std::make_pair(n->id, Node(n->lon, n->lat)));
+
+		if (n->ntags == 0 || !IsWithinClipRegion(Vector2i(n->lon, n->lat)))
+			continue;
+
+		node_tags = TagsMap();
+		for (size_t t = n->first_tag; t < n->first_tag + n->ntags; ++t)
+			node_tags.insert(InternBlockString(block, ids, block.tags[t].first), InternBlockString(block, ids, block.tags[t].second));
+		node_tags_.Add(n->id, Vector2i(n->lon, n->lat), node_tags);
+	}
+
+	for (std::vector<PbfBlock::Way>::const_iterator w = block.ways.begin(); w != block.ways.end(); ++w) {
+		std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(w->id, Way()));
+		Way& way = p.first->second;
+
+		way.Nodes.assign(block.refs.begin() + w->first_ref, block.refs.begin() + w->first_ref + w->nrefs);
+		for (size_t t = w->first_tag; t < w->first_tag + w->ntags; ++t)
+			way.Tags.insert(InternBlockString(block, ids, block.tags[t].first), InternBlockString(block, ids, block.tags[t].second));
+
+		last_way_ = p.first;
+		FinalizeWay();
+	}
+	last_way_ = ways_.end();
+
+	for (std::vector<PbfBlock::Relation>::const_iterator r = block.relations.begin(); r != block.relations.end(); ++r) {
+		std::pair<RelationsMap::iterator, bool> p = relations_.insert(std::make_pair(r->id, Relation()));
+		Relation& relation = p.first->second;
+
+		for (size_t m = r->first_member; m < r->first_member + r->nmembers; ++m) {
+			const PbfBlock::Member& member = block.members[m];
+			if (member.role >= block.strings.size())
+				throw ParsingException() << "bad string table index";
+			relation.Members.push_back(Relation::Member(member.type, member.ref, block.strings[member.role].c_str()));
+		}
+		for (size_t t = r->first_tag; t < r->first_tag + r->ntags; ++t)
+			relation.Tags.insert(InternBlockString(block, ids, block.tags[t].first), InternBlockString(block, ids, block.tags[t].second));
+
+		last_relation_ = p.first;
+		FinalizeRelation();
+	}
+	last_relation_ = relations_.end();
+}
+
+void PreloadedPbfDatasource::Load(const char* filename) {
+	StartLoad();
+
+	int f = 0;
+	if (strcmp(filename, "-") != 0 && (f = open(filename, O_RDONLY)) == -1)
+		throw SystemError() << "cannot open input file";
+
+	std::vector<PbfBlock*> batch;
+	try {
+		bool eof = false;
+		while (!eof) {
+			while (batch.size() < (size_t)nthreads_ * BLOBS_PER_THREAD) {
+				PbfBlock* block = ReadBlock(f);
+				if (block == NULL) {
+					eof = true;
+					break;
+				}
+				block->node_tags = (load_flags_ & NODE_TAGS) != 0;
+				batch.push_back(block);
+			}
+
+			DecodeBlocks(batch, nthreads_);
+
+			for (std::vector<PbfBlock*>::iterator i = batch.begin(); i != batch.end(); ++i) {
+				if (!(*i)->error.empty())
+					throw ParsingException() << "input parsing error: " << (*i)->error;
+				StoreBlock(**i);
+				delete *i;
+				*i = NULL;
+			}
+			batch.clear();
+		}
+	} catch (...) {
+		for (std::vector<PbfBlock*>::iterator i = batch.begin(); i != batch.end(); ++i)
+			delete *i;
+		if (f != 0)
+			close(f);
+		throw;
+	}
+
+	if (f != 0)
+		close(f);
+
+	FinishLoad();
+}
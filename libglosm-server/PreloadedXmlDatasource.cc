@@ -23,18 +23,12 @@
  *
  * Possible generic improvements:
  * - use hash maps instead of tree maps
- * - store tag names separately and operate with tag id
- *   - use (hash)map for forward lookup (tag -> id)
- *   - use vector for reverse lookup (id -> tag)
  * - use fastosm library
  * - use custom allocators for most data
  *
  * Space iprovements with complexity/speed cost
  * - prefix encoding for node coords and refs
  * - store nodes without tags in a separate or additional map
- * - store node coords directly in ways
- * Last two should save tons of memory and improve speed severely
- * by killing an indirection
  *
  * Improvements for non-generic use:
  * (tons)
@@ -43,24 +37,62 @@
  * - may store relation id(s) for ways - at least for multipolygons
  */
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstdlib>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
 
 #include <glosm/PreloadedXmlDatasource.hh>
 #include <glosm/ParsingHelpers.hh>
 #include <glosm/WayMerger.hh>
+#include <glosm/WayClassifier.hh>
+#include <glosm/GeometryOperations.hh>
+#include <glosm/OsmSnapshot.hh>
+#include <glosm/Guard.hh>
+#include <glosm/ParallelTasks.hh>
+#include <glosm/geomath.h>
 
 osmid_t PreloadedXmlDatasource::next_synthetic_id_ = std::numeric_limits<osmid_t>::max();
 
-PreloadedXmlDatasource::PreloadedXmlDatasource() : XMLParser(XMLParser::HANDLE_ELEMENTS), bbox_(BBoxi::Empty()) {
+/* highest tile level for each overview layer */
+static const int OVERVIEW_MAX_LEVELS[] = { 4, 7, 10 };
+
+PreloadedXmlDatasource::PreloadedXmlDatasource(int load_flags, int nthreads)
+	: XMLParser(XMLParser::HANDLE_ELEMENTS | ((load_flags & PIPELINED_LOAD) ? XMLParser::READ_AHEAD : 0) | ((load_flags & FAST_XML_SCAN) ? XMLParser::FAST_SCAN : 0)),
+	  batch_(NULL),
+	  bbox_(BBoxi::Empty()),
+	  max_height_(0),
+	  load_flags_(load_flags),
+	  nthreads_(nthreads),
+	  clip_polygon_bbox_(BBoxi::Empty()),
+	  short_ways_(0),
+	  incomplete_ways_(0),
+	  missing_node_refs_(0),
+	  missing_way_members_(0) {
+	if (nthreads_ <= 0)
+		nthreads_ = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads_ <= 0)
+		nthreads_ = 1;
+
+	pthread_mutex_init(&store_mutex_, NULL);
+	pthread_cond_init(&store_cond_, NULL);
 }
 
 PreloadedXmlDatasource::~PreloadedXmlDatasource() {
+	delete batch_;
+	pthread_cond_destroy(&store_cond_);
+	pthread_mutex_destroy(&store_mutex_);
 }
 
 static void ParseTag(OsmDatasource::TagsMap& map, const char** atts) {
-	std::string key;
-	std::string value;
+	const char* key = "";
+	const char* value = "";
 	for (const char** att = atts; *att; ++att) {
 		if (StrEq<1>(*att, "k"))
 			key = *(++att);
@@ -70,108 +102,216 @@ static void ParseTag(OsmDatasource::TagsMap& map, const char** atts) {
 			++att;
 	}
 
-	map.insert(std::make_pair(key, value));
+	map.insert(key, value);
 }
 
-void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
-	if (tag_level_ == 1 && current_tag_ == OSM) {
-		osmid_t id = 0;
-		osmint_t lat = 0;
-		osmint_t lon = 0;
-		for (const char** att = atts; *att; ++att) {
-			if (StrEq<1>(*att, "id"))
-				id = strtoll(*(++att), NULL, 10);
-			else if (StrEq<2>(*att, "lat"))
-				lat = ParseCoord(*(++att));
-			else if (StrEq<2>(*att, "lon"))
-				lon = ParseCoord(*(++att));
+static void ParseObject(const char** atts, osmid_t& id, osmint_t& lat, osmint_t& lon) {
+	id = 0;
+	lat = lon = 0;
+	for (const char** att = atts; *att; ++att) {
+		if (StrEq<1>(*att, "id"))
+			id = strtoll(*(++att), NULL, 10);
+		else if (StrEq<2>(*att, "lat"))
+			lat = ParseCoord(*(++att));
+		else if (StrEq<2>(*att, "lon"))
+			lon = ParseCoord(*(++att));
+		else
+			++att;
+	}
+}
+
+static OsmDatasource::Relation::Member ParseMember(const char** atts) {
+	osmid_t ref = 0;
+	const char* role = 0;
+	OsmDatasource::Relation::Member::Type_t type = OsmDatasource::Relation::Member::UNKNOWN;
+
+	for (const char** att = atts; *att; ++att) {
+		if (StrEq<2>(*att, "ref"))
+			ref = strtoll(*(++att), NULL, 10);
+		else if (StrEq<1>(*att, "type")) {
+			++att;
+			if (StrEq<1>(*att, "node"))
+				type = OsmDatasource::Relation::Member::NODE;
+			else if (StrEq<1>(*att, "way"))
+				type = OsmDatasource::Relation::Member::WAY;
+			else if (StrEq<1>(*att, "relation"))
+				type = OsmDatasource::Relation::Member::RELATION;
+			else
+				throw ParsingException() << "bad relation member role";
+		} else if (StrEq<2>(*att, "role")) {
+			role = *(++att);
+		} else {
+			throw ParsingException() << "unexpected attribute in relation member";
+		}
+	}
+
+	if (ref == 0 || role == NULL || type == OsmDatasource::Relation::Member::UNKNOWN)
+		throw ParsingException() << "bad relation member";
+
+	return OsmDatasource::Relation::Member(type, ref, role);
+}
+
+/**
+ * Object from OsmChange file
+ */
+template <class T>
+struct OsmChangeObject {
+	osmid_t id;
+	bool deleted;
+	T object;
+
+	OsmChangeObject(osmid_t i, bool d, const T& o = T()) : id(i), deleted(d), object(o) {
+	}
+};
+
+/**
+ * Parser of OsmChange (.osc) files
+ *
+ * Collects created, modified and deleted objects of each type
+ * in document order; create and modify are not distinguished.
+ */
+class OsmChangeParser : public XMLParser {
+public:
+	/* deques, so pointers to objects being parsed stay valid */
+	std::deque<OsmChangeObject<OsmDatasource::Node> > nodes;
+	std::deque<OsmChangeObject<OsmDatasource::Way> > ways;
+	std::deque<OsmChangeObject<OsmDatasource::Relation> > relations;
+
+	/* tags of nodes, in the same order as nodes */
+	std::deque<OsmDatasource::TagsMap> node_tags;
+
+protected:
+	int tag_level_;
+	bool deleting_;
+	OsmDatasource::TagsMap* parsed_node_tags_;
+	OsmDatasource::Way* parsed_way_;
+	OsmDatasource::Relation* parsed_relation_;
+
+protected:
+	virtual void StartElement(const char* name, const char** atts) {
+		if (tag_level_ == 0) {
+			if (!StrEq<-1>(name, "osmChange"))
+				throw ParsingException() << "unexpected root element (" << name << " instead of osmChange)";
+		} else if (tag_level_ == 1) {
+			if (StrEq<-1>(name, "delete"))
+				deleting_ = true;
+			else if (StrEq<-1>(name, "create") || StrEq<-1>(name, "modify"))
+				deleting_ = false;
+			else
+				throw ParsingException() << "unexpected element in osmChange (" << name << ")";
+		} else if (tag_level_ == 2) {
+			osmid_t id;
+			osmint_t lat, lon;
+			ParseObject(atts, id, lat, lon);
+
+			if (StrEq<1>(name, "node")) {
+				nodes.push_back(OsmChangeObject<OsmDatasource::Node>(id, deleting_, OsmDatasource::Node(lon, lat)));
+				node_tags.push_back(OsmDatasource::TagsMap());
+				parsed_node_tags_ = &node_tags.back();
+			} else if (StrEq<1>(name, "way")) {
+				ways.push_back(OsmChangeObject<OsmDatasource::Way>(id, deleting_));
+				parsed_way_ = &ways.back().object;
+			} else if (StrEq<1>(name, "relation")) {
+				relations.push_back(OsmChangeObject<OsmDatasource::Relation>(id, deleting_));
+				parsed_relation_ = &relations.back().object;
+			}
+		} else if (tag_level_ == 3 && parsed_node_tags_ != NULL) {
+			if (!StrEq<0>(name, "tag"))
+				throw ParsingException() << "unexpected tag in node";
+			ParseTag(*parsed_node_tags_, atts);
+		} else if (tag_level_ == 3 && parsed_way_ != NULL) {
+			if (StrEq<1>(name, "tag")) {
+				ParseTag(parsed_way_->Tags, atts);
+			} else if (StrEq<1>(name, "nd")) {
+				if (!**atts || !StrEq<0>(*atts, "ref"))
+					throw ParsingException() << "no ref attribute for nd tag";
+				parsed_way_->Nodes.push_back(strtoll(*(atts+1), NULL, 10));
+			} else {
+				throw ParsingException() << "unexpected tag in way";
+			}
+		} else if (tag_level_ == 3 && parsed_relation_ != NULL) {
+			if (StrEq<1>(name, "tag"))
+				ParseTag(parsed_relation_->Tags, atts);
+			else if (StrEq<1>(name, "member"))
+				parsed_relation_->Members.push_back(ParseMember(atts));
 			else
-				++att;
+				throw ParsingException() << "unexpected tag in relation";
 		}
 
+		++tag_level_;
+	}
+
+	virtual void EndElement(const char* /*name*/) {
+		if (--tag_level_ == 2) {
+			parsed_node_tags_ = NULL;
+			parsed_way_ = NULL;
+			parsed_relation_ = NULL;
+		}
+	}
+
+public:
+	OsmChangeParser() : XMLParser(XMLParser::HANDLE_ELEMENTS), tag_level_(0), deleting_(false), parsed_node_tags_(NULL), parsed_way_(NULL), parsed_relation_(NULL) {
+	}
+};
+
+void PreloadedXmlDatasource::StartElement(const char* name, const char** atts) {
+	if (tag_level_ == 1 && current_tag_ == OSM) {
+		osmid_t id;
+		osmint_t lat, lon;
+		ParseObject(atts, id, lat, lon);
+
 		if (StrEq<1>(name, "node")) {
 			current_tag_ = NODE;
-			std::pair<NodesMap::iterator, bool> p = nodes_.insert(std::make_pair(id, Node(lon, lat)));
-			last_node_ = p.first;
-			//last_node_tags_ = node_tags_.end();
+			StartObject(NODE);
+			batch_->nodes.push_back(std::make_pair(id, Node(lon, lat)));
 		} else if (StrEq<1>(name, "way")) {
 			current_tag_ = WAY;
-			std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(id, Way()));
-			last_way_ = p.first;
+			StartObject(WAY);
+			batch_->ways.push_back(std::make_pair(id, Way()));
+			parsed_way_ = &batch_->ways.back().second;
 		} else if (StrEq<1>(name, "relation")) {
 			current_tag_ = RELATION;
-			std::pair<RelationsMap::iterator, bool> p = relations_.insert(std::make_pair(id, Relation()));
-			last_relation_ = p.first;
+			StartObject(RELATION);
+			batch_->relations.push_back(std::make_pair(id, Relation()));
+			parsed_relation_ = &batch_->relations.back().second;
 		} else if (StrEq<-1>(name, "bounds")) {
 			bbox_.Include(ParseBounds(atts));
 		} else if (StrEq<-1>(name, "bound")) {
 			bbox_.Include(ParseBound(atts));
 		}
 	} else if (tag_level_ == 2 && current_tag_ == NODE) {
-		if (last_node_ != nodes_.end()) {
-			if (StrEq<0>(name, "tag")) {
-//				if (last_node_tags_ == node_tags_.end()) {
-//					std::pair<NodeTagsMap::iterator, bool> p = node_tags_.insert(std::make_pair(last_node_->first, TagsMap()));
-//					last_node_tags_ = p.first;
-//				}
-//				ParseTag(last_node_tags_->second, atts);
-			} else {
-				throw ParsingException() << "unexpected tag in node";
-			}
+		if (!StrEq<0>(name, "tag"))
+			throw ParsingException() << "unexpected tag in node";
+
+		/* node tags are only stored if requested */
+		if (load_flags_ & NODE_TAGS) {
+			size_t node = batch_->nodes.size() - 1;
+			if (batch_->node_tags.empty() || batch_->node_tags.back().first != node)
+				batch_->node_tags.push_back(std::make_pair(node, TagsMap()));
+			ParseTag(batch_->node_tags.back().second, atts);
 		}
 	} else if (tag_level_ == 2 && current_tag_ == WAY) {
-		if (last_way_ != ways_.end()) {
-			if (StrEq<1>(name, "tag")) {
-				ParseTag(last_way_->second.Tags, atts);
-			} else if (StrEq<1>(name, "nd")) {
-				osmid_t id;
+		if (StrEq<1>(name, "tag")) {
+			ParseTag(parsed_way_->Tags, atts);
+		} else if (StrEq<1>(name, "nd")) {
+			osmid_t id;
 
-				if (**atts && StrEq<0>(*atts, "ref"))
-					id = strtoll(*(atts+1), NULL, 10);
-				else
-					throw ParsingException() << "no ref attribute for nd tag";
+			if (**atts && StrEq<0>(*atts, "ref"))
+				id = strtoll(*(atts+1), NULL, 10);
+			else
+				throw ParsingException() << "no ref attribute for nd tag";
 
-				last_way_->second.Nodes.push_back(id);
-			} else {
-				throw ParsingException() << "unexpected tag in way";
-			}
+			parsed_way_->Nodes.push_back(id);
+		} else {
+			throw ParsingException() << "unexpected tag in way";
 		}
 	} else if (tag_level_ == 2 && current_tag_ == RELATION) {
-		if (last_relation_ != relations_.end()) {
-			if (StrEq<1>(name, "tag")) {
-				ParseTag(last_relation_->second.Tags, atts);
-			} else if (StrEq<1>(name, "member")) {
-				osmid_t ref = 0;
-				const char* role = 0;
-				Relation::Member::Type_t type = Relation::Member::UNKNOWN;
-
-				for (const char** att = atts; *att; ++att) {
-					if (StrEq<2>(*att, "ref"))
-						ref = strtoll(*(++att), NULL, 10);
-					else if (StrEq<1>(*att, "type")) {
-						++att;
-						if (StrEq<1>(*att, "node"))
-							type = Relation::Member::NODE;
-						else if (StrEq<1>(*att, "way"))
-							type = Relation::Member::WAY;
-						else if (StrEq<1>(*att, "relation"))
-							type = Relation::Member::RELATION;
-						else
-							throw ParsingException() << "bad relation member role";
-					} else if (StrEq<2>(*att, "role")) {
-						role = *(++att);
-					} else {
-						throw ParsingException() << "unexpected attribute in relation member";
-					}
-				}
-
-				if (ref == 0 || role == NULL || type == Relation::Member::UNKNOWN)
-					throw ParsingException() << "bad relation member";
-
-				last_relation_->second.Members.push_back(Relation::Member(type, ref, role));
-			} else {
-				throw ParsingException() << "unexpected tag in relation";
-			}
+		if (StrEq<1>(name, "tag")) {
+			ParseTag(parsed_relation_->Tags, atts);
+		} else if (StrEq<1>(name, "member")) {
+			parsed_relation_->Members.push_back(ParseMember(atts));
+		} else {
+			throw ParsingException() << "unexpected tag in relation";
 		}
 	} else if (tag_level_ == 0 && current_tag_ == NONE && StrEq<-1>(name, "osm")) {
 		current_tag_ = OSM;
@@ -186,17 +326,14 @@ void PreloadedXmlDatasource::EndElement(const char* /*name*/) {
 	if (tag_level_ == 2) {
 		switch (current_tag_) {
 		case NODE:
-			last_node_ = nodes_.end();
 			current_tag_ = OSM;
 			break;
 		case WAY:
-			FinalizeWay();
-			last_way_ = ways_.end();
+			parsed_way_ = NULL;
 			current_tag_ = OSM;
 			break;
 		case RELATION:
-			FinalizeRelation();
-			last_relation_ = relations_.end();
+			parsed_relation_ = NULL;
 			current_tag_ = OSM;
 			break;
 		default:
@@ -209,92 +346,274 @@ void PreloadedXmlDatasource::EndElement(const char* /*name*/) {
 	--tag_level_;
 }
 
+void PreloadedXmlDatasource::StartObject(CurrentTag type) {
+	if (batch_ != NULL && (batch_->type != type || batch_->nodes.size() + batch_->ways.size() + batch_->relations.size() >= BATCH_SIZE))
+		FlushBatch();
+
+	if (batch_ == NULL) {
+		batch_ = new ParsedBatch;
+		batch_->type = type;
+
+		/* pointers to parsed objects must stay valid */
+		switch (type) {
+		case NODE: batch_->nodes.reserve(BATCH_SIZE); break;
+		case WAY: batch_->ways.reserve(BATCH_SIZE); break;
+		case RELATION: batch_->relations.reserve(BATCH_SIZE); break;
+		default: break;
+		}
+	}
+}
+
+void PreloadedXmlDatasource::FlushBatch() {
+	if (batch_ == NULL)
+		return;
+
+	if (load_flags_ & PIPELINED_LOAD) {
+		Guard guard(store_mutex_);
+		while (store_queue_.size() >= MAX_QUEUED_BATCHES && store_error_.empty())
+			pthread_cond_wait(&store_cond_, &store_mutex_);
+
+		if (!store_error_.empty())
+			throw Exception() << "cannot store parsed data: " << store_error_;
+
+		store_queue_.push_back(batch_);
+		batch_ = NULL;
+		pthread_cond_broadcast(&store_cond_);
+	} else {
+		std::auto_ptr<ParsedBatch> batch(batch_);
+		batch_ = NULL;
+		StoreBatch(*batch);
+	}
+}
+
+void PreloadedXmlDatasource::StoreBatch(ParsedBatch& batch) {
+	switch (batch.type) {
+	case NODE:
+		for (std::vector<std::pair<osmid_t, Node> >::const_iterator n = batch.nodes.begin(); n != batch.nodes.end(); ++n)
+			nodes_.insert(*n);
+		for (std::vector<std::pair<size_t, TagsMap> >::const_iterator t = batch.node_tags.begin(); t != batch.node_tags.end(); ++t) {
+			const std::pair<osmid_t, Node>& node = batch.nodes[t->first];
+			if (IsWithinClipRegion(node.second.Pos))
+				node_tags_.Add(node.first, node.second.Pos, t->second);
+		}
+		break;
+	case WAY:
+		for (std::vector<std::pair<osmid_t, Way> >::iterator w = batch.ways.begin(); w != batch.ways.end(); ++w) {
+			std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(w->first, Way()));
+			p.first->second.Nodes.swap(w->second.Nodes);
+			p.first->second.Tags.swap(w->second.Tags);
+
+			last_way_ = p.first;
+			FinalizeWay();
+		}
+		last_way_ = ways_.end();
+		break;
+	case RELATION:
+		for (std::vector<std::pair<osmid_t, Relation> >::iterator r = batch.relations.begin(); r != batch.relations.end(); ++r) {
+			std::pair<RelationsMap::iterator, bool> p = relations_.insert(std::make_pair(r->first, Relation()));
+			p.first->second.Members.swap(r->second.Members);
+			p.first->second.Tags.swap(r->second.Tags);
+
+			last_relation_ = p.first;
+			FinalizeRelation();
+		}
+		last_relation_ = relations_.end();
+		break;
+	default:
+		break;
+	}
+}
+
+void* PreloadedXmlDatasource::StoreThread(void* arg) {
+	PreloadedXmlDatasource* self = static_cast<PreloadedXmlDatasource*>(arg);
+
+	while (true) {
+		ParsedBatch* batch;
+		{
+			Guard guard(self->store_mutex_);
+			while (self->store_queue_.empty() && !self->store_done_)
+				pthread_cond_wait(&self->store_cond_, &self->store_mutex_);
+
+			if (self->store_queue_.empty())
+				break;
+
+			batch = self->store_queue_.front();
+			self->store_queue_.pop_front();
+			pthread_cond_broadcast(&self->store_cond_);
+		}
+
+		try {
+			self->StoreBatch(*batch);
+		} catch (std::exception& e) {
+			delete batch;
+			Guard guard(self->store_mutex_);
+			self->store_error_ = e.what();
+			pthread_cond_broadcast(&self->store_cond_);
+			break;
+		}
+
+		delete batch;
+	}
+
+	return NULL;
+}
+
+void PreloadedXmlDatasource::JoinStoreThread(pthread_t thread) {
+	{
+		Guard guard(store_mutex_);
+		store_done_ = true;
+		pthread_cond_broadcast(&store_cond_);
+	}
+
+	pthread_join(thread, NULL);
+
+	/* left over if storing has failed */
+	for (std::deque<ParsedBatch*>::iterator i = store_queue_.begin(); i != store_queue_.end(); ++i)
+		delete *i;
+	store_queue_.clear();
+}
+
 void PreloadedXmlDatasource::FinalizeWay() {
 	if (last_way_ == ways_.end())
 		return;
 
 	if (last_way_->second.Nodes.size() < 2) {
-		std::cerr << "WARNING: way " << last_way_->first << " has < 2 nodes, dropping" << std::endl;
+		++short_ways_;
 		ways_.erase_last();
 		last_way_ = ways_.end();
 		return;
 	}
 
-	/* check if a way is closed */
-	if (last_way_->second.Nodes.front() == last_way_->second.Nodes.back()) {
-		last_way_->second.Closed = true;
+	if (!filter_tags_.empty() && !MatchesFilterTags(last_way_->second)) {
+		/* tags and node refs are not moved into arena, so
+		 * memory is freed when the way is dropped */
+		unmatched_ways_.push_back(&last_way_->second);
+		return;
+	}
 
-		/* check if a way is clockwise */
-		NodesMap::const_iterator prev, cur;
-		osmlong_t area = 0;
-		for (Way::NodesList::const_iterator i = last_way_->second.Nodes.begin(); i != last_way_->second.Nodes.end(); ++i) {
-			cur = nodes_.find(*i);
-			if (cur == nodes_.end()) {
-				std::cerr << "WARNING: node " << *i << " referenced by way " << last_way_->first << " was not found in this dump, dropping way" << std::endl;
-				ways_.erase_last();
-				last_way_ = ways_.end();
-				return;
-			}
-			if (i != last_way_->second.Nodes.begin())
-				area += (osmlong_t)prev->second.Pos.x * cur->second.Pos.y - (osmlong_t)cur->second.Pos.x * prev->second.Pos.y;
-			prev = cur;
-			last_way_->second.BBox.Include(cur->second.Pos);
-		}
+	PrepareWay(last_way_->second);
+}
 
-		last_way_->second.Clockwise = area < 0;
-	} else {
-		for (Way::NodesList::const_iterator i = last_way_->second.Nodes.begin(); i != last_way_->second.Nodes.end(); ++i) {
-			NodesMap::const_iterator cur = nodes_.find(*i);
-			if (cur == nodes_.end()) {
-				std::cerr << "WARNING: node " << *i << " referenced by way " << last_way_->first << " was not found in this dump, dropping way" << std::endl;
-				ways_.erase_last();
-				last_way_ = ways_.end();
-				return;
-			}
-			last_way_->second.BBox.Include(cur->second.Pos);
+void PreloadedXmlDatasource::PrepareWay(Way& way) {
+	way.Tags.MoveTo(arena_);
+	ClassifyWay(way);
+
+	way.Closed = !way.Rings.empty() || way.Nodes.front() == way.Nodes.back();
+
+	if (load_flags_ & PACK_NODE_REFS)
+		PackNodeRefs(way);
+}
+
+void PreloadedXmlDatasource::PackNodeRefs(Way& way) {
+	pack_buffer_.clear();
+
+	osmid_t prev = 0;
+	for (Way::NodesList::const_iterator i = way.Nodes.begin(); i != way.Nodes.end(); ++i) {
+		int64_t delta = *i - prev;
+		uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+		prev = *i;
+
+		while (zigzag >= 0x80) {
+			pack_buffer_.push_back((unsigned char)(zigzag | 0x80));
+			zigzag >>= 7;
 		}
+		pack_buffer_.push_back((unsigned char)zigzag);
 	}
+
+	way.PackedNodes = arena_.Copy(&pack_buffer_[0], pack_buffer_.size());
+	way.PackedNodesCount = way.Nodes.size();
+	Way::NodesList().swap(way.Nodes);
 }
 
 void PreloadedXmlDatasource::FinalizeRelation() {
 	if (last_relation_ == relations_.end())
 		return;
 
-	TagsMap::const_iterator type = last_relation_->second.Tags.find("type");
-	if (type == last_relation_->second.Tags.end() || type->second != "multipolygon")
+	if (last_relation_->second.Tags.Get(STR_TYPE) != STR_MULTIPOLYGON) {
+		if (filter_.drop_relations) {
+			relations_.erase_last();
+			last_relation_ = relations_.end();
+		} else {
+			last_relation_->second.Tags.MoveTo(arena_);
+		}
 		return;
+	}
+
+	/* synthetic ways made below share these */
+	last_relation_->second.Tags.MoveTo(arena_);
+
+	size_t first_synthetic = multipolygon_ways_.size();
 
 	WayMerger merger;
+	WayMerger inner_merger;
 
-	/* first, fill the merger with "outer" parts */
+	/* first, fill the mergers with "outer" and "inner" parts */
 	for (Relation::MemberList::const_iterator member = last_relation_->second.Members.begin(); member != last_relation_->second.Members.end(); ++member) {
-		if (member->Type != Relation::Member::WAY || member->Role != "outer")
+		if (member->Type != Relation::Member::WAY || (member->Role != STR_OUTER && member->Role != STR_INNER))
 			continue;
 
 		WaysMap::const_iterator way = ways_.find(member->Ref);
 		if (way == ways_.end()) {
-			std::cerr << "WARNING: way " << member->Ref << " referenced by relation " << last_relation_->first << " was not found in this dump, ignoring it" << std::endl;
+			++missing_way_members_;
 			continue;
 		}
 
-		merger.AddWay(way->second.Nodes);
+		if (member->Role == STR_OUTER)
+			merger.AddWay(way->second);
+		else
+			inner_merger.AddWay(way->second);
 	}
 
 	/* next, extract all complete merged ways */
+	std::vector<OsmDatasource::Way::NodesList> outers;
 	OsmDatasource::Way::NodesList tempnodes;
 	while (merger.GetNextWay(tempnodes)) {
+		outers.push_back(OsmDatasource::Way::NodesList());
+		outers.back().swap(tempnodes);
+	}
+
+	/* holes are only attached to a single outer ring; matching
+	 * them to one of several outers needs node coordinates,
+	 * which are not known yet */
+	std::vector<unsigned int> rings;
+	if (outers.size() == 1) {
+		rings.push_back(outers.front().size());
+		while (inner_merger.GetNextWay(tempnodes)) {
+			rings.push_back(tempnodes.size());
+			outers.front().insert(outers.front().end(), tempnodes.begin(), tempnodes.end());
+		}
+		if (rings.size() == 1)
+			rings.clear();
+	}
+
+	for (std::vector<OsmDatasource::Way::NodesList>::iterator outer = outers.begin(); outer != outers.end(); ++outer) {
 		std::pair<WaysMap::iterator, bool> p = ways_.insert(std::make_pair(next_synthetic_id_, Way()));
 		assert(p.second);
 
-		p.first->second.Nodes.swap(tempnodes);
+		p.first->second.Nodes.swap(*outer);
+		p.first->second.Rings.swap(rings);
 		p.first->second.Tags = last_relation_->second.Tags;
 
 		last_way_ = p.first;
 
 		FinalizeWay();
 
+		if (last_way_ != ways_.end())
+			multipolygon_ways_.push_back(std::make_pair(last_relation_->first, &last_way_->second));
+
 		--next_synthetic_id_;
 	}
+
+	/* remembered even if no ways were made, as changes of
+	 * member ways may fix it */
+	if (multipolygon_ways_.size() == first_synthetic)
+		multipolygon_ways_.push_back(std::make_pair(last_relation_->first, (Way*)NULL));
+
+	/* synthetic ways keep their tags in arena */
+	if (filter_.drop_relations) {
+		relations_.erase_last();
+		last_relation_ = relations_.end();
+	}
 }
 
 Vector2i PreloadedXmlDatasource::GetCenter() const {
@@ -305,36 +624,841 @@ BBoxi PreloadedXmlDatasource::GetBBox() const {
 	return bbox_;
 }
 
+osmint_t PreloadedXmlDatasource::GetMaxHeight() const {
+	return max_height_;
+}
+
+size_t PreloadedXmlDatasource::GetArenaBytes() const {
+	return arena_.GetUsedBytes();
+}
+
+void PreloadedXmlDatasource::SetLoadFilter(const LoadFilter& filter) {
+	filter_ = filter;
+
+	StringTable& table = StringTable::Instance();
+	filter_tags_.clear();
+	for (std::vector<std::string>::const_iterator tag = filter_.tags.begin(); tag != filter_.tags.end(); ++tag) {
+		size_t eq = tag->find('=');
+		if (eq == std::string::npos)
+			filter_tags_.push_back(std::make_pair(table.Intern(tag->c_str()), (strid_t)STR_NONE));
+		else
+			filter_tags_.push_back(std::make_pair(table.Intern(tag->substr(0, eq).c_str()), table.Intern(tag->substr(eq + 1).c_str())));
+	}
+
+	clip_polygon_bbox_ = BBoxi::Empty();
+	for (std::vector<Vector2i>::const_iterator v = filter_.clip_polygon.begin(); v != filter_.clip_polygon.end(); ++v)
+		clip_polygon_bbox_.Include(*v);
+}
+
 void PreloadedXmlDatasource::Load(const char* filename) {
-	bbox_ = BBoxi::Empty();
+	StartLoad();
+
 	current_tag_ = NONE;
 	tag_level_ = 0;
+	parsed_way_ = NULL;
+	parsed_relation_ = NULL;
+
+	if (load_flags_ & PIPELINED_LOAD) {
+		store_done_ = false;
+		store_error_.clear();
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, StoreThread, this) != 0)
+			throw SystemError() << "cannot create storing thread";
+
+		try {
+			XMLParser::Load(filename);
+			FlushBatch();
+		} catch (...) {
+			delete batch_;
+			batch_ = NULL;
+			JoinStoreThread(thread);
+			throw;
+		}
+
+		JoinStoreThread(thread);
 
-	XMLParser::Load(filename);
+		if (!store_error_.empty())
+			throw Exception() << "cannot store parsed data: " << store_error_;
+	} else {
+		try {
+			XMLParser::Load(filename);
+			FlushBatch();
+		} catch (...) {
+			delete batch_;
+			batch_ = NULL;
+			throw;
+		}
+	}
+
+	FinishLoad();
+}
+
+void PreloadedXmlDatasource::StartLoad() {
+	bbox_ = BBoxi::Empty();
+	last_way_ = ways_.end();
+	last_relation_ = relations_.end();
+
+	unmatched_ways_.clear();
+
+	short_ways_ = 0;
+	incomplete_ways_ = 0;
+	missing_node_refs_ = 0;
+	missing_way_members_ = 0;
+}
+
+struct NodeBBoxCollector {
+	BBoxi& bbox;
+
+	NodeBBoxCollector(BBoxi& b) : bbox(b) {
+	}
 
+	void operator()(osmid_t, const OsmDatasource::Node& node) {
+		bbox.Include(node.Pos);
+	}
+};
+
+void PreloadedXmlDatasource::FinishLoad() {
 	/* if file lacked bounding box, generate one ourselves */
 	if (bbox_.IsEmpty()) {
-		for (NodesMap::iterator node = nodes_.begin(); node != nodes_.end(); ++node)
-			bbox_.Include(node->second.Pos);
+		NodeBBoxCollector collector(bbox_);
+		nodes_.for_each(collector);
+	}
+
+	nodes_.compact();
+
+	std::sort(multipolygon_ways_.begin(), multipolygon_ways_.end());
+
+	DropUnmatchedWays();
+
+	FinalizeGeometry();
+
+	ClipWays();
+
+	node_tags_.Build();
+
+	if (load_flags_ & INLINE_NODES)
+		InlineNodes();
+
+	if (load_flags_ & SPATIAL_LAYOUT)
+		RelayoutWays();
+
+	BuildIndex();
+
+	if (load_flags_ & OVERVIEW_LAYERS)
+		BuildOverviews();
+
+	ReportProblems();
+}
+
+/* empties way, which is then ignored, as id_map can't erase it */
+static void ClearWay(OsmDatasource::Way& way) {
+	way.BBox = BBoxi::Empty();
+	OsmDatasource::Way::NodesList().swap(way.Nodes);
+	way.PackedNodes = NULL;
+	way.PackedNodesCount = 0;
+	std::vector<unsigned int>().swap(way.Rings);
+	OsmDatasource::TagsMap().swap(way.Tags);
+}
+
+struct PreloadedXmlDatasource::GeometryTask {
+	const NodesMap* nodes;
+	std::vector<Way*>::iterator begin;
+	std::vector<Way*>::iterator end;
+
+	size_t incomplete_ways;
+	size_t missing_node_refs;
+};
+
+struct WayFirstNodeLess {
+	bool operator()(const OsmDatasource::Way* a, const OsmDatasource::Way* b) const {
+		osmid_t first_a, first_b;
+		OsmDatasource::Way::NodeIterator(*a).Next(first_a);
+		OsmDatasource::Way::NodeIterator(*b).Next(first_b);
+		return first_a < first_b;
+	}
+};
+
+void PreloadedXmlDatasource::RunGeometryTask(GeometryTask& task) {
+	for (std::vector<Way*>::iterator w = task.begin; w != task.end; ++w) {
+		Way& way = **w;
+
+		const Node* prev = NULL;
+		osmlong_t area = 0;
+		size_t missing = 0;
+		/* orientation is defined by the outer ring only */
+		size_t outer_size = way.Rings.empty() ? way.GetNodesCount() : way.Rings.front();
+		size_t index = 0;
+		Way::NodeIterator iterator(way);
+		osmid_t id;
+		while (iterator.Next(id)) {
+			const Node* cur = task.nodes->get(id);
+			if (cur == NULL) {
+				++missing;
+				continue;
+			}
+			if (prev != NULL && missing == 0 && ++index < outer_size)
+				area += (osmlong_t)prev->Pos.x * cur->Pos.y - (osmlong_t)cur->Pos.x * prev->Pos.y;
+			prev = cur;
+			way.BBox.Include(cur->Pos);
+		}
+
+		if (missing > 0) {
+			/* way stays in the map, but is ignored from now on */
+			task.incomplete_ways++;
+			task.missing_node_refs += missing;
+			ClearWay(way);
+			continue;
+		}
+
+		if (way.Closed)
+			way.Clockwise = area < 0;
+	}
+}
+
+void PreloadedXmlDatasource::FinalizeGeometry() {
+	std::vector<Way*> ways;
+	ways.reserve(ways_.size());
+	for (WaysMap::iterator i = ways_.begin(); i != ways_.end(); ++i)
+		if (i->second.GetNodesCount() > 0)
+			ways.push_back(&i->second);
+
+	FinalizeGeometry(ways);
+}
+
+void PreloadedXmlDatasource::FinalizeGeometry(std::vector<Way*>& ways) {
+	/* ways in a dump usually reference nodes with close ids, and
+	 * nodes are stored in id order, so this makes lookups local */
+	std::sort(ways.begin(), ways.end(), WayFirstNodeLess());
+
+	size_t nthreads = std::max((size_t)1, std::min((size_t)nthreads_, ways.size() / MIN_WAYS_PER_THREAD));
+
+	std::vector<GeometryTask> tasks(nthreads);
+	for (size_t i = 0; i < nthreads; ++i) {
+		tasks[i].nodes = &nodes_;
+		tasks[i].begin = ways.begin() + ways.size() * i / nthreads;
+		tasks[i].end = ways.begin() + ways.size() * (i + 1) / nthreads;
+		tasks[i].incomplete_ways = 0;
+		tasks[i].missing_node_refs = 0;
+	}
+
+	RunParallel(tasks, RunGeometryTask);
+
+	for (size_t i = 0; i < nthreads; ++i) {
+		incomplete_ways_ += tasks[i].incomplete_ways;
+		missing_node_refs_ += tasks[i].missing_node_refs;
+	}
+}
+
+bool PreloadedXmlDatasource::MatchesFilterTags(const Way& way) const {
+	for (FilterTagsVector::const_iterator tag = filter_tags_.begin(); tag != filter_tags_.end(); ++tag) {
+		strid_t value = way.Tags.Get(tag->first);
+		if (value != STR_NONE && (tag->second == STR_NONE || value == tag->second))
+			return true;
+	}
+	return false;
+}
+
+/* even-odd rule */
+static bool IsPointInClipPolygon(const Vector2i& point, const std::vector<Vector2i>& polygon) {
+	bool inside = false;
+	for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+		const Vector2i& a = polygon[i];
+		const Vector2i& b = polygon[j];
+		if ((a.y > point.y) != (b.y > point.y) && point.x < a.x + ((double)b.x - a.x) * ((double)point.y - a.y) / ((double)b.y - a.y))
+			inside = !inside;
+	}
+	return inside;
+}
+
+static double ClipCross(const Vector2i& origin, const Vector2i& a, const Vector2i& b) {
+	return ((double)a.x - origin.x) * ((double)b.y - origin.y) - ((double)a.y - origin.y) * ((double)b.x - origin.x);
+}
+
+/* touching segments count as intersecting, so such ways are kept */
+static bool ClipSegmentsIntersect(const Vector2i& a, const Vector2i& b, const Vector2i& c, const Vector2i& d) {
+	double d1 = ClipCross(c, d, a), d2 = ClipCross(c, d, b);
+	double d3 = ClipCross(a, b, c), d4 = ClipCross(a, b, d);
+	return ((d1 <= 0 && d2 >= 0) || (d1 >= 0 && d2 <= 0)) && ((d3 <= 0 && d4 >= 0) || (d3 >= 0 && d4 <= 0));
+}
+
+bool PreloadedXmlDatasource::IsWithinClipRegion(const Vector2i& pos) const {
+	if (!filter_.clip_bbox.IsEmpty() && !filter_.clip_bbox.Contains(pos))
+		return false;
+	if (!filter_.clip_polygon.empty() && (!clip_polygon_bbox_.Contains(pos) || !IsPointInClipPolygon(pos, filter_.clip_polygon)))
+		return false;
+	return true;
+}
+
+bool PreloadedXmlDatasource::IntersectsClipPolygon(const Way& way) const {
+	const std::vector<Vector2i>& polygon = filter_.clip_polygon;
+
+	if (!way.BBox.Intersects(clip_polygon_bbox_))
+		return false;
+
+	/* polygon may be within the way; this is not checked
+	 * exactly, as keeping some extra ways doesn't hurt */
+	if (way.BBox.Contains(polygon.front()))
+		return true;
+
+	std::vector<Vector2i> coords;
+	coords.reserve(way.GetNodesCount());
+	Way::NodeIterator iterator(way);
+	osmid_t id;
+	while (iterator.Next(id))
+		coords.push_back(nodes_.get(id)->Pos);
+
+	if (IsPointInClipPolygon(coords.front(), polygon))
+		return true;
+
+	for (size_t i = 1; i < coords.size(); ++i) {
+		if (!BBoxi(coords[i - 1], coords[i]).Intersects(clip_polygon_bbox_))
+			continue;
+		for (size_t j = 0, k = polygon.size() - 1; j < polygon.size(); k = j++)
+			if (ClipSegmentsIntersect(coords[i - 1], coords[i], polygon[k], polygon[j]))
+				return true;
+	}
+
+	return false;
+}
+
+void PreloadedXmlDatasource::DropUnmatchedWays() {
+	for (std::vector<Way*>::iterator way = unmatched_ways_.begin(); way != unmatched_ways_.end(); ++way)
+		ClearWay(**way);
+	std::vector<Way*>().swap(unmatched_ways_);
+}
+
+void PreloadedXmlDatasource::ClipWays() {
+	if (filter_.clip_bbox.IsEmpty() && filter_.clip_polygon.empty())
+		return;
+
+	for (WaysMap::iterator i = ways_.begin(); i != ways_.end(); ++i) {
+		Way& way = i->second;
+		if (way.BBox.IsEmpty())
+			continue;
+
+		if ((!filter_.clip_bbox.IsEmpty() && !way.BBox.Intersects(filter_.clip_bbox)) || (!filter_.clip_polygon.empty() && !IntersectsClipPolygon(way)))
+			ClearWay(way);
+	}
+}
+
+void PreloadedXmlDatasource::ReportProblems() const {
+	if (short_ways_ > 0)
+		std::cerr << "WARNING: " << short_ways_ << " way(s) with < 2 nodes dropped" << std::endl;
+	if (incomplete_ways_ > 0)
+		std::cerr << "WARNING: " << incomplete_ways_ << " way(s) dropped because of " << missing_node_refs_ << " reference(s) to nodes not found in this dump" << std::endl;
+	if (missing_way_members_ > 0)
+		std::cerr << "WARNING: " << missing_way_members_ << " multipolygon member way(s) not found in this dump, ignored" << std::endl;
+}
+
+void PreloadedXmlDatasource::InlineNodes() {
+	/* FinalizeGeometry() has already emptied ways with missing nodes */
+	for (WaysMap::iterator i = ways_.begin(); i != ways_.end(); ++i) {
+		Way& way = i->second;
+
+		way.Coords.reserve(way.GetNodesCount());
+		Way::NodeIterator iterator(way);
+		osmid_t id;
+		while (iterator.Next(id))
+			way.Coords.push_back(nodes_.get(id)->Pos);
+
+		Way::NodesList().swap(way.Nodes);
+		way.PackedNodes = NULL;
+		way.PackedNodesCount = 0;
+	}
+
+	NodesMap().swap(nodes_);
+}
+
+/* spreads lower 32 bits of value to even bits */
+static uint64_t SpreadBits(uint64_t v) {
+	v &= 0xFFFFFFFFULL;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v;
+}
+
+/* position of bbox center on Z-order curve; empty bboxes go last */
+static uint64_t GetZOrderKey(const BBoxi& bbox) {
+	if (bbox.IsEmpty())
+		return std::numeric_limits<uint64_t>::max();
+
+	/* sign bit flipped, so unsigned order matches signed one */
+	uint32_t x = (uint32_t)(osmint_t)(((osmlong_t)bbox.left + bbox.right) / 2) ^ 0x80000000U;
+	uint32_t y = (uint32_t)(osmint_t)(((osmlong_t)bbox.bottom + bbox.top) / 2) ^ 0x80000000U;
+
+	return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+struct ZOrderedWay {
+	uint64_t key;
+	osmid_t id;
+	OsmDatasource::Way* way;
+
+	bool operator<(const ZOrderedWay& other) const {
+		if (key != other.key)
+			return key < other.key;
+		return id < other.id;
+	}
+};
+
+void PreloadedXmlDatasource::RelayoutWays() {
+	std::vector<ZOrderedWay> order;
+	order.reserve(ways_.size());
+	for (WaysMap::iterator i = ways_.begin(); i != ways_.end(); ++i) {
+		ZOrderedWay entry = { GetZOrderKey(i->second.BBox), i->first, &i->second };
+		order.push_back(entry);
+	}
+	std::sort(order.begin(), order.end());
+
+	/* multipolygon ways are referenced by pointer, so these are
+	 * looked up by old address as ways are moved */
+	std::vector<Way*> old_multipolygons;
+	for (MultipolygonWaysVector::const_iterator m = multipolygon_ways_.begin(); m != multipolygon_ways_.end(); ++m)
+		if (m->second != NULL)
+			old_multipolygons.push_back(m->second);
+	std::sort(old_multipolygons.begin(), old_multipolygons.end());
+	std::vector<Way*> new_multipolygons(old_multipolygons.size(), NULL);
+
+	WaysMap ways;
+	for (std::vector<ZOrderedWay>::const_iterator i = order.begin(); i != order.end(); ++i) {
+		/* copying allocates inline coords anew, in curve order */
+		Way& way = ways.insert(std::make_pair(i->id, *i->way)).first->second;
+
+		Way::CoordsList().swap(i->way->Coords);
+		Way::NodesList().swap(i->way->Nodes);
+
+		std::vector<Way*>::iterator old = std::lower_bound(old_multipolygons.begin(), old_multipolygons.end(), i->way);
+		if (old != old_multipolygons.end() && *old == i->way)
+			new_multipolygons[old - old_multipolygons.begin()] = &way;
+	}
+
+	for (MultipolygonWaysVector::iterator m = multipolygon_ways_.begin(); m != multipolygon_ways_.end(); ++m)
+		if (m->second != NULL)
+			m->second = new_multipolygons[std::lower_bound(old_multipolygons.begin(), old_multipolygons.end(), m->second) - old_multipolygons.begin()];
+
+	ways_.swap(ways);
+	last_way_ = ways_.end();
+}
+
+void PreloadedXmlDatasource::BuildIndex() {
+	ways_index_.clear();
+	new_ways_index_.clear();
+	ways_index_.Reserve(ways_.size());
+	max_height_ = 0;
+
+	/* id_map never relocates its elements, so pointers are safe */
+	for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i) {
+		if (!i->second.BBox.IsEmpty()) {
+			ways_index_.Insert(i->second.BBox, &i->second);
+			max_height_ = std::max(max_height_, GetWayTopHeight(i->second));
+		}
+	}
+
+	ways_index_.Build();
+}
+
+/* checks whether way gets into the most detailed overview layer */
+static bool IsOverviewWay(const OsmDatasource::Way& way, osmint_t tolerance) {
+	if (way.BBox.IsEmpty() || !IsGroundClass(way.Class))
+		return false;
+	return std::max((osmlong_t)way.BBox.right - way.BBox.left, (osmlong_t)way.BBox.top - way.BBox.bottom) >= tolerance;
+}
+
+/* simplifies each ring of a way with inline coords */
+static void SimplifyOverviewWay(OsmDatasource::Way& way, osmint_t tolerance) {
+	if (way.Rings.empty()) {
+		SimplifyPolyline(way.Coords, tolerance);
+		return;
+	}
+
+	OsmDatasource::Way::CoordsList coords;
+	std::vector<Vector2i> ring;
+	unsigned int start = 0;
+	for (std::vector<unsigned int>::iterator r = way.Rings.begin(); r != way.Rings.end(); start += *r++) {
+		ring.assign(way.Coords.begin() + start, way.Coords.begin() + start + *r);
+		SimplifyPolyline(ring, tolerance);
+		coords.insert(coords.end(), ring.begin(), ring.end());
+		*r = ring.size();
+	}
+	way.Coords.swap(coords);
+}
+
+void PreloadedXmlDatasource::BuildOverviews() {
+	assert(sizeof(OVERVIEW_MAX_LEVELS) / sizeof(OVERVIEW_MAX_LEVELS[0]) == NUM_OVERVIEW_LAYERS);
+
+	/* each layer is generalized from the next, more detailed one,
+	 * which is much faster than starting over from full ways */
+	const OverviewLayer* source = NULL;
+	for (int i = NUM_OVERVIEW_LAYERS - 1; i >= 0; --i) {
+		OverviewLayer& layer = overviews_[i];
+		layer.max_level = OVERVIEW_MAX_LEVELS[i];
+		layer.ways.clear();
+		layer.index.clear();
+
+		osmint_t tolerance = GetSimplifyTolerance((osmlong_t)GEOM_LONSPAN >> layer.max_level);
+
+		if (source) {
+			for (std::vector<Way>::const_iterator w = source->ways.begin(); w != source->ways.end(); ++w) {
+				if (std::max((osmlong_t)w->BBox.right - w->BBox.left, (osmlong_t)w->BBox.top - w->BBox.bottom) < tolerance)
+					continue;
+
+				layer.ways.push_back(*w);
+				SimplifyOverviewWay(layer.ways.back(), tolerance);
+			}
+		} else {
+			for (WaysMap::const_iterator w = ways_.begin(); w != ways_.end(); ++w) {
+				const Way& way = w->second;
+				if (!IsOverviewWay(way, tolerance))
+					continue;
+
+				/* only attributes used for ground geometry, and
+				 * inline coords, so nodes are not needed */
+				layer.ways.push_back(Way());
+				Way& overview = layer.ways.back();
+				overview.Tags = way.Tags;
+				overview.Rings = way.Rings;
+				overview.Closed = way.Closed;
+				overview.Clockwise = way.Clockwise;
+				overview.BBox = way.BBox;
+				overview.Class = way.Class;
+				overview.MinHeight = way.MinHeight;
+				overview.MaxHeight = way.MaxHeight;
+				overview.Width = way.Width;
+
+				if (!way.Coords.empty()) {
+					overview.Coords = way.Coords;
+				} else {
+					overview.Coords.reserve(way.GetNodesCount());
+					Way::NodeIterator iterator(way);
+					osmid_t id;
+					while (iterator.Next(id))
+						overview.Coords.push_back(nodes_.get(id)->Pos);
+				}
+
+				SimplifyOverviewWay(overview, tolerance);
+			}
+		}
+
+		/* ways vector is complete, so pointers are stable now */
+		layer.index.Reserve(layer.ways.size());
+		for (std::vector<Way>::const_iterator w = layer.ways.begin(); w != layer.ways.end(); ++w)
+			layer.index.Insert(w->BBox, &*w);
+		layer.index.Build();
+
+		source = &layer;
 	}
 }
 
+void PreloadedXmlDatasource::WriteSnapshot(const char* filename) const {
+	OsmSnapshotWriter writer;
+	writer.SetBBox(bbox_);
+
+	Way::CoordsList coords;
+	for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i) {
+		const Way& way = i->second;
+
+		if (way.BBox.IsEmpty())
+			continue;
+
+		if (way.Coords.empty()) {
+			coords.clear();
+			Way::NodeIterator iterator(way);
+			osmid_t id;
+			while (iterator.Next(id))
+				coords.push_back(GetNode(id).Pos);
+			writer.AddWay(i->first, way, coords);
+		} else {
+			writer.AddWay(i->first, way, way.Coords);
+		}
+	}
+
+	writer.Write(filename);
+}
+
+/**
+ * Way touched by ApplyChange(), with its state before the change
+ */
+struct OsmChangedWay {
+	BBoxi old_bbox;
+	bool was_overview;
+};
+
+typedef std::map<OsmDatasource::Way*, OsmChangedWay> OsmChangedWaysMap;
+
+static void MarkWayChanged(OsmChangedWaysMap& changed, OsmDatasource::Way* way, osmint_t overview_tolerance) {
+	if (changed.find(way) != changed.end())
+		return;
+
+	OsmChangedWay& entry = changed[way];
+	entry.old_bbox = way->BBox;
+	entry.was_overview = IsOverviewWay(*way, overview_tolerance);
+}
+
+static bool ReferencesNode(const OsmDatasource::Way& way, osmid_t node) {
+	OsmDatasource::Way::NodeIterator iterator(way);
+	osmid_t id;
+	while (iterator.Next(id))
+		if (id == node)
+			return true;
+	return false;
+}
+
+void PreloadedXmlDatasource::ApplyChange(const char* filename, std::vector<BBoxi>& dirty) {
+	if (load_flags_ & INLINE_NODES)
+		throw Exception() << "cannot apply changes: nodes were dropped after loading";
+	if (!filter_.IsEmpty())
+		throw Exception() << "cannot apply changes: data was filtered on loading";
+
+	OsmChangeParser change;
+	change.Load(filename);
+
+	short_ways_ = 0;
+	incomplete_ways_ = 0;
+	missing_node_refs_ = 0;
+	missing_way_members_ = 0;
+
+	osmint_t overview_tolerance = GetSimplifyTolerance((osmlong_t)GEOM_LONSPAN >> OVERVIEW_MAX_LEVELS[NUM_OVERVIEW_LAYERS - 1]);
+
+	OsmChangedWaysMap changed;
+
+	/* ways which use a moved node contain its old position,
+	 * so they are found through index instead of reverse map;
+	 * deleted nodes are kept, as nothing may reference them */
+	std::vector<const Way*> candidates;
+	std::deque<TagsMap>::const_iterator tags = change.node_tags.begin();
+	for (std::deque<OsmChangeObject<Node> >::const_iterator n = change.nodes.begin(); n != change.nodes.end(); ++n, ++tags) {
+		const Node* old = nodes_.get(n->id);
+		if (old != NULL && (n->deleted || old->Pos != n->object.Pos)) {
+			BBoxi point(old->Pos, old->Pos);
+			candidates.clear();
+			ways_index_.Query(point, candidates);
+			new_ways_index_.Query(point, candidates);
+			for (std::vector<const Way*>::const_iterator w = candidates.begin(); w != candidates.end(); ++w)
+				if (ReferencesNode(**w, n->id))
+					MarkWayChanged(changed, const_cast<Way*>(*w), overview_tolerance);
+		}
+
+		/* points of interest are not part of any way, so their
+		 * own positions are dirty */
+		if (load_flags_ & NODE_TAGS) {
+			TaggedNode tagged;
+			if (node_tags_.Find(n->id, tagged))
+				dirty.push_back(BBoxi(tagged.Pos, tagged.Pos));
+			if (!n->deleted && !tags->empty())
+				dirty.push_back(BBoxi(n->object.Pos, n->object.Pos));
+			node_tags_.Add(n->id, n->object.Pos, n->deleted ? TagsMap() : *tags);
+		}
+
+		if (!n->deleted)
+			nodes_.insert(n->id, n->object);
+	}
+
+	if ((load_flags_ & NODE_TAGS) && !change.nodes.empty())
+		node_tags_.Build();
+
+	/* ways are replaced in place, so pointers to them held by
+	 * indexes stay valid */
+	for (std::deque<OsmChangeObject<Way> >::iterator w = change.ways.begin(); w != change.ways.end(); ++w) {
+		WaysMap::iterator way = ways_.find(w->id);
+		if (way == ways_.end()) {
+			if (w->deleted)
+				continue;
+			way = ways_.insert(std::make_pair(w->id, Way())).first;
+		}
+
+		MarkWayChanged(changed, &way->second, overview_tolerance);
+
+		way->second = Way();
+		if (w->deleted)
+			continue;
+
+		if (w->object.Nodes.size() < 2) {
+			++short_ways_;
+			continue;
+		}
+
+		way->second.Nodes.swap(w->object.Nodes);
+		way->second.Tags.swap(w->object.Tags);
+		PrepareWay(way->second);
+	}
+
+	std::set<osmid_t> multipolygons;
+	for (std::deque<OsmChangeObject<Relation> >::iterator r = change.relations.begin(); r != change.relations.end(); ++r) {
+		RelationsMap::iterator relation = relations_.find(r->id);
+		if (relation == relations_.end()) {
+			if (r->deleted)
+				continue;
+			relation = relations_.insert(std::make_pair(r->id, Relation())).first;
+		}
+
+		/* deleted relations are left empty */
+		relation->second = Relation();
+		if (!r->deleted) {
+			relation->second.Members.swap(r->object.Members);
+			relation->second.Tags.swap(r->object.Tags);
+		}
+
+		multipolygons.insert(r->id);
+	}
+
+	/* multipolygons are also rebuilt if their member ways have
+	 * changed; only ones in the area of changes are checked */
+	SpatialIndex<int> changed_areas;
+	for (OsmChangedWaysMap::const_iterator c = changed.begin(); c != changed.end(); ++c)
+		if (!c->second.old_bbox.IsEmpty())
+			changed_areas.Insert(c->second.old_bbox, 0);
+	changed_areas.Build();
+
+	std::vector<int> found;
+	for (MultipolygonWaysVector::const_iterator m = multipolygon_ways_.begin(); m != multipolygon_ways_.end(); ) {
+		osmid_t id = m->first;
+		bool candidate = false;
+		for (; m != multipolygon_ways_.end() && m->first == id; ++m) {
+			found.clear();
+			if (m->second == NULL || m->second->BBox.IsEmpty())
+				candidate = true;
+			else
+				changed_areas.Query(m->second->BBox, found);
+			candidate = candidate || !found.empty();
+		}
+
+		if (!candidate || multipolygons.find(id) != multipolygons.end())
+			continue;
+
+		const Relation& relation = relations_.find(id)->second;
+		for (Relation::MemberList::const_iterator member = relation.Members.begin(); member != relation.Members.end(); ++member) {
+			if (member->Type != Relation::Member::WAY)
+				continue;
+
+			WaysMap::iterator way = ways_.find(member->Ref);
+			if (way != ways_.end() && changed.find(&way->second) != changed.end()) {
+				multipolygons.insert(id);
+				break;
+			}
+		}
+	}
+
+	if (!multipolygons.empty()) {
+		MultipolygonWaysVector kept;
+		kept.reserve(multipolygon_ways_.size());
+		for (MultipolygonWaysVector::const_iterator m = multipolygon_ways_.begin(); m != multipolygon_ways_.end(); ++m) {
+			if (multipolygons.find(m->first) == multipolygons.end()) {
+				kept.push_back(*m);
+			} else if (m->second != NULL) {
+				MarkWayChanged(changed, m->second, overview_tolerance);
+				ClearWay(*m->second);
+			}
+		}
+		multipolygon_ways_.swap(kept);
+
+		/* new synthetic ways are made for current versions */
+		size_t first_synthetic = multipolygon_ways_.size();
+		for (std::set<osmid_t>::const_iterator id = multipolygons.begin(); id != multipolygons.end(); ++id) {
+			last_relation_ = relations_.find(*id);
+			if (last_relation_ != relations_.end())
+				FinalizeRelation();
+		}
+		last_relation_ = relations_.end();
+		last_way_ = ways_.end();
+
+		for (size_t i = first_synthetic; i < multipolygon_ways_.size(); ++i)
+			if (multipolygon_ways_[i].second != NULL)
+				MarkWayChanged(changed, multipolygon_ways_[i].second, overview_tolerance);
+
+		std::sort(multipolygon_ways_.begin(), multipolygon_ways_.end());
+	}
+
+	std::vector<Way*> geometry;
+	for (OsmChangedWaysMap::iterator c = changed.begin(); c != changed.end(); ++c) {
+		Way& way = *c->first;
+		if (way.GetNodesCount() == 0)
+			continue;
+
+		way.BBox = BBoxi::Empty();
+		way.Clockwise = false;
+		geometry.push_back(&way);
+	}
+
+	FinalizeGeometry(geometry);
+
+	/* moved ways are updated in place; ways which weren't
+	 * indexed before go to a separate small index, which is
+	 * merged into main one when it grows too large */
+	std::vector<Way*> added;
+	for (OsmChangedWaysMap::const_iterator c = changed.begin(); c != changed.end(); ++c) {
+		const BBoxi& old_bbox = c->second.old_bbox;
+		const BBoxi& new_bbox = c->first->BBox;
+
+		bool indexed = false;
+		if (!old_bbox.IsEmpty()) {
+			dirty.push_back(old_bbox);
+			indexed = ways_index_.Update(old_bbox, c->first, new_bbox) || new_ways_index_.Update(old_bbox, c->first, new_bbox);
+		}
+
+		if (!new_bbox.IsEmpty()) {
+			max_height_ = std::max(max_height_, GetWayTopHeight(*c->first));
+			if (old_bbox.left != new_bbox.left || old_bbox.bottom != new_bbox.bottom || old_bbox.right != new_bbox.right || old_bbox.top != new_bbox.top)
+				dirty.push_back(new_bbox);
+			if (!indexed)
+				added.push_back(c->first);
+		}
+	}
+
+	if (!added.empty()) {
+		if ((new_ways_index_.size() + added.size()) * NEW_WAYS_INDEX_RATIO > ways_index_.size()) {
+			BuildIndex();
+		} else {
+			for (std::vector<Way*>::const_iterator w = added.begin(); w != added.end(); ++w)
+				new_ways_index_.Insert((*w)->BBox, *w);
+			new_ways_index_.Build();
+		}
+	}
+
+	/* it's cheaper than building them from scratch, but still
+	 * involves all ways, so only done when they are affected */
+	if (load_flags_ & OVERVIEW_LAYERS) {
+		for (OsmChangedWaysMap::const_iterator c = changed.begin(); c != changed.end(); ++c) {
+			if (c->second.was_overview || IsOverviewWay(*c->first, overview_tolerance)) {
+				BuildOverviews();
+				break;
+			}
+		}
+	}
+
+	ReportProblems();
+}
+
 void PreloadedXmlDatasource::Clear() {
 	nodes_.clear();
+	node_tags_.Clear();
 	ways_.clear();
 	relations_.clear();
+	ways_index_.clear();
+	new_ways_index_.clear();
+	std::vector<std::pair<osmid_t, Way*> >().swap(multipolygon_ways_);
+	for (int i = 0; i < NUM_OVERVIEW_LAYERS; ++i) {
+		std::vector<Way>().swap(overviews_[i].ways);
+		overviews_[i].index.clear();
+	}
+	std::vector<unsigned char>().swap(pack_buffer_);
+	arena_.Clear();
+	max_height_ = 0;
 }
 
 const OsmDatasource::Node& PreloadedXmlDatasource::GetNode(osmid_t id) const {
-	NodesMap::const_iterator i = nodes_.find(id);
-	if (i == nodes_.end())
+	const Node* node = nodes_.get(id);
+	if (node == NULL)
 		throw DataException() << "node not found";
-	return i->second;
+	return *node;
 }
 
 const OsmDatasource::Way& PreloadedXmlDatasource::GetWay(osmid_t id) const {
 	WaysMap::const_iterator i = ways_.find(id);
-	if (i == ways_.end())
+	if (i == ways_.end() || i->second.BBox.IsEmpty())
 		throw DataException() << "way not found";
 	return i->second;
 }
@@ -346,11 +1470,31 @@ const OsmDatasource::Relation& PreloadedXmlDatasource::GetRelation(osmid_t id) c
 	return i->second;
 }
 
-void PreloadedXmlDatasource::GetWays(std::vector<OsmDatasource::Way>& out, const BBoxi& bbox) const {
+void PreloadedXmlDatasource::GetWays(std::vector<const OsmDatasource::Way*>& out, const BBoxi& bbox) const {
 	if (!bbox.Intersects(bbox_))
 		return;
 
-	for (WaysMap::const_iterator i = ways_.begin(); i != ways_.end(); ++i)
-		if (i->second.BBox.Intersects(bbox))
-			out.push_back(i->second);
+	ways_index_.Query(bbox, out);
+	new_ways_index_.Query(bbox, out);
+}
+
+void PreloadedXmlDatasource::GetTaggedNodes(std::vector<TaggedNode>& out, const BBoxi& bbox) const {
+	node_tags_.Query(out, bbox);
+}
+
+void PreloadedXmlDatasource::GetOverviewWays(std::vector<const OsmDatasource::Way*>& out, const BBoxi& bbox, int level) const {
+	if (!bbox.Intersects(bbox_))
+		return;
+
+	if (load_flags_ & OVERVIEW_LAYERS) {
+		for (int i = 0; i < NUM_OVERVIEW_LAYERS; ++i) {
+			if (level <= overviews_[i].max_level) {
+				overviews_[i].index.Query(bbox, out);
+				return;
+			}
+		}
+	}
+
+	ways_index_.Query(bbox, out);
+	new_ways_index_.Query(bbox, out);
 }
@@ -0,0 +1,350 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <glosm/RemoteGeometryDatasource.hh>
+
+#include <glosm/Geometry.hh>
+#include <glosm/GeometryProtocol.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Handle of request submitted with Submit()
+ */
+class RemoteGeometryRequest : public GeometryRequest {
+protected:
+	const RemoteGeometryDatasource& datasource_;
+	RemoteGeometryDatasource::RequestId id_;
+	bool waited_;
+
+public:
+	RemoteGeometryRequest(const RemoteGeometryDatasource& datasource, RemoteGeometryDatasource::RequestId id) : datasource_(datasource), id_(id), waited_(false) {
+	}
+
+	virtual ~RemoteGeometryRequest() {
+		if (!waited_)
+			datasource_.Cancel(id_);
+
+		/* receiver may still be notifying about this one */
+		datasource_.WaitCallbacks();
+	}
+
+	virtual bool IsReady() const {
+		return waited_ || datasource_.IsDone(id_);
+	}
+
+	virtual void Wait(Geometry& geometry) {
+		waited_ = true;
+		datasource_.Wait(id_, geometry);
+	}
+};
+
+RemoteGeometryDatasource::RemoteGeometryDatasource(const char* address) : fd_(GeometryProtocol::Connect(address)) {
+	try {
+		Init();
+	} catch (...) {
+		close(fd_);
+		throw;
+	}
+}
+
+RemoteGeometryDatasource::RemoteGeometryDatasource(int fd) : fd_(fd) {
+	try {
+		Init();
+	} catch (...) {
+		close(fd_);
+		throw;
+	}
+}
+
+RemoteGeometryDatasource::~RemoteGeometryDatasource() {
+	/* wakes receiver thread */
+	shutdown(fd_, SHUT_RDWR);
+	pthread_join(receiver_, NULL);
+	close(fd_);
+
+	for (PendingMap::iterator i = pending_.begin(); i != pending_.end(); ++i)
+		delete i->second;
+
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&callback_mutex_);
+	pthread_mutex_destroy(&mutex_);
+	pthread_mutex_destroy(&write_mutex_);
+}
+
+void RemoteGeometryDatasource::Init() {
+	GeometryProtocol::Message hello;
+	if (!GeometryProtocol::Read(fd_, hello) || hello.type != GeometryProtocol::HELLO)
+		throw Exception() << "geometry server did not greet";
+
+	GeometryProtocol::PayloadReader reader(hello);
+	if (reader.GetUInt() != GeometryProtocol::MAGIC)
+		throw Exception() << "peer is not a glosm geometry server";
+	uint32_t version = reader.GetUInt();
+	if (version != GeometryProtocol::VERSION)
+		throw Exception() << "unsupported geometry server protocol version " << version;
+
+	bbox_.left = reader.GetInt();
+	bbox_.bottom = reader.GetInt();
+	bbox_.right = reader.GetInt();
+	bbox_.top = reader.GetInt();
+	center_.x = reader.GetInt();
+	center_.y = reader.GetInt();
+	max_height_ = reader.GetInt();
+
+	next_id_ = 1;
+	closed_ = false;
+
+	int errn;
+
+	if ((errn = pthread_mutex_init(&write_mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0) {
+		pthread_mutex_destroy(&write_mutex_);
+		throw SystemError(errn) << "pthread_mutex_init failed";
+	}
+
+	if ((errn = pthread_mutex_init(&callback_mutex_, 0)) != 0) {
+		pthread_mutex_destroy(&mutex_);
+		pthread_mutex_destroy(&write_mutex_);
+		throw SystemError(errn) << "pthread_mutex_init failed";
+	}
+
+	if ((errn = pthread_cond_init(&cond_, 0)) != 0) {
+		pthread_mutex_destroy(&callback_mutex_);
+		pthread_mutex_destroy(&mutex_);
+		pthread_mutex_destroy(&write_mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if ((errn = pthread_create(&receiver_, NULL, ReceiverThread, this)) != 0) {
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&callback_mutex_);
+		pthread_mutex_destroy(&mutex_);
+		pthread_mutex_destroy(&write_mutex_);
+		throw SystemError(errn) << "pthread_create failed";
+	}
+}
+
+void RemoteGeometryDatasource::ReceiveReplies() {
+	std::string error;
+	try {
+		GeometryProtocol::Message reply;
+		while (GeometryProtocol::Read(fd_, reply)) {
+			if (reply.type != GeometryProtocol::GEOMETRY && reply.type != GeometryProtocol::FAILURE)
+				throw Exception() << "unexpected message type " << reply.type << " from geometry server";
+
+			CallbackVector callbacks;
+			{
+				Guard guard(mutex_);
+				PendingMap::iterator pending = pending_.find(reply.id);
+
+				/* cancelled request */
+				if (pending == pending_.end())
+					continue;
+
+				pending->second->done = true;
+				pending->second->failed = reply.type == GeometryProtocol::FAILURE;
+				pending->second->data.swap(reply.payload);
+				pthread_cond_broadcast(&cond_);
+
+				if (pending->second->callback) {
+					callbacks.push_back(pending->second->callback);
+					pthread_mutex_lock(&callback_mutex_);
+				}
+			}
+			RunCallbacks(callbacks);
+		}
+		error = "connection closed by server";
+	} catch (std::exception& e) {
+		error = e.what();
+	}
+
+	CallbackVector callbacks;
+	{
+		Guard guard(mutex_);
+		Close(error, callbacks);
+	}
+	RunCallbacks(callbacks);
+}
+
+void RemoteGeometryDatasource::Close(const std::string& error, CallbackVector& callbacks) const {
+	if (!closed_) {
+		closed_ = true;
+		error_ = error;
+
+		for (PendingMap::const_iterator i = pending_.begin(); i != pending_.end(); ++i)
+			if (!i->second->done && i->second->callback)
+				callbacks.push_back(i->second->callback);
+	}
+	pthread_cond_broadcast(&cond_);
+
+	/* taken before mutex_ is released, so request handles
+	 * destroyed meanwhile wait for callbacks to return */
+	if (!callbacks.empty())
+		pthread_mutex_lock(&callback_mutex_);
+}
+
+void RemoteGeometryDatasource::RunCallbacks(const CallbackVector& callbacks) const {
+	if (callbacks.empty())
+		return;
+
+	for (CallbackVector::const_iterator i = callbacks.begin(); i != callbacks.end(); ++i)
+		(*i)->OnRequestReady();
+	pthread_mutex_unlock(&callback_mutex_);
+}
+
+void* RemoteGeometryDatasource::ReceiverThread(void* arg) {
+	static_cast<RemoteGeometryDatasource*>(arg)->ReceiveReplies();
+	return NULL;
+}
+
+void RemoteGeometryDatasource::Send(int type, RequestId id, const std::vector<unsigned char>& payload) const {
+	try {
+		Guard guard(write_mutex_);
+		GeometryProtocol::Write(fd_, type, id, payload);
+	} catch (std::exception& e) {
+		CallbackVector callbacks;
+		{
+			Guard guard(mutex_);
+			Close(e.what(), callbacks);
+		}
+		RunCallbacks(callbacks);
+		throw;
+	}
+}
+
+RemoteGeometryDatasource::RequestId RemoteGeometryDatasource::Request(const BBoxi& bbox, int flags, GeometryRequest::Callback* callback) const {
+	RequestId id;
+	{
+		Guard guard(mutex_);
+		if (closed_)
+			throw Exception() << "connection to geometry server lost: " << error_;
+
+		id = next_id_++;
+		pending_.insert(std::make_pair(id, new PendingRequest(callback)));
+	}
+
+	std::vector<unsigned char> payload;
+	GeometryProtocol::PutBBox(payload, bbox);
+	GeometryProtocol::PutInt(payload, flags);
+
+	try {
+		Send(GeometryProtocol::REQUEST, id, payload);
+	} catch (...) {
+		Cancel(id);
+		throw;
+	}
+
+	return id;
+}
+
+void RemoteGeometryDatasource::Wait(RequestId id, Geometry& geometry) const {
+	PendingRequest reply(NULL);
+	{
+		Guard guard(mutex_);
+		PendingMap::iterator pending = pending_.find(id);
+		if (pending == pending_.end())
+			throw Exception() << "waiting for unknown geometry request " << id;
+
+		while (!pending->second->done && !closed_)
+			pthread_cond_wait(&cond_, &mutex_);
+
+		reply.done = pending->second->done;
+		reply.failed = pending->second->failed;
+		reply.data.swap(pending->second->data);
+
+		delete pending->second;
+		pending_.erase(pending);
+
+		if (!reply.done)
+			throw Exception() << "connection to geometry server lost: " << error_;
+	}
+
+	if (reply.failed)
+		throw Exception() << "geometry server failed: " << std::string(reply.data.begin(), reply.data.end());
+
+	Geometry received;
+	received.DeSerialize(reply.data.empty() ? NULL : &reply.data[0], reply.data.size());
+	geometry.Append(received);
+}
+
+void RemoteGeometryDatasource::Cancel(RequestId id) const {
+	{
+		Guard guard(mutex_);
+		PendingMap::iterator pending = pending_.find(id);
+		if (pending == pending_.end())
+			return;
+
+		bool done = pending->second->done;
+
+		delete pending->second;
+		pending_.erase(pending);
+
+		/* nothing to tell server */
+		if (done || closed_)
+			return;
+	}
+
+	try {
+		Send(GeometryProtocol::CANCEL, id, std::vector<unsigned char>());
+	} catch (std::exception&) {
+		/* request is abandoned anyway */
+	}
+}
+
+bool RemoteGeometryDatasource::IsDone(RequestId id) const {
+	Guard guard(mutex_);
+	PendingMap::const_iterator pending = pending_.find(id);
+	return closed_ || pending == pending_.end() || pending->second->done;
+}
+
+void RemoteGeometryDatasource::WaitCallbacks() const {
+	pthread_mutex_lock(&callback_mutex_);
+	pthread_mutex_unlock(&callback_mutex_);
+}
+
+GeometryRequest* RemoteGeometryDatasource::Submit(const BBoxi& bbox, int flags, GeometryRequest::Callback* callback) const {
+	return new RemoteGeometryRequest(*this, Request(bbox, flags, callback));
+}
+
+void RemoteGeometryDatasource::GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+	Wait(Request(bbox, flags), geometry);
+}
+
+Vector2i RemoteGeometryDatasource::GetCenter() const {
+	return center_;
+}
+
+BBoxi RemoteGeometryDatasource::GetBBox() const {
+	return bbox_;
+}
+
+osmint_t RemoteGeometryDatasource::GetMaxHeight() const {
+	return max_height_;
+}
+
+size_t RemoteGeometryDatasource::GetPendingCount() const {
+	Guard guard(mutex_);
+	return pending_.size();
+}
@@ -21,127 +21,510 @@
 #include <glosm/SRTMDatasource.hh>
 #include <glosm/Exception.hh>
 #include <glosm/Guard.hh>
+#include <glosm/InputStream.hh>
 #include <glosm/Misc.hh>
+#include <glosm/Trace.hh>
 
 #include <glosm/geomath.h>
 
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <strings.h>
+#include <zlib.h>
 
-#include <cassert>
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
 #include <cerrno>
+#include <cstring>
+#include <memory>
 
 enum {
-	FILE_HEIGHT = 1201,
-	FILE_WIDTH = 1201,
+	/* SRTM3 and SRTM1 files; both have one extra row and column
+	 * which overlap with neighbour files */
+	SRTM3_FILE_WIDTH = 1201,
+	SRTM1_FILE_WIDTH = 3601,
 
+	/* chunks are always sampled at SRTM3 resolution */
 	DATA_HEIGHT = 1200,
 	DATA_WIDTH = 1200,
 };
 
-SRTMDatasource::SRTMDatasource(const char* storage_path) : storage_path_(storage_path) {
-	generation_ = 0;
+/* default number of chunks kept in memory */
+static const size_t DEFAULT_RESIDENT_CHUNKS = 32;
+
+static const size_t CHUNK_SIZE = DATA_HEIGHT * DATA_WIDTH * sizeof(int16_t);
+
+static inline uint16_t SwapBytes(uint16_t value) {
+	return (value >> 8) | (value << 8);
+}
+
+/* loops are kept trivial so compiler may vectorize them */
+static void CopyHeights(const uint16_t* src, int count, int step, bool swap, osmint_t* dst) {
+	if (step == 1 && swap) {
+		for (int i = 0; i < count; ++i)
+			dst[i] = (int16_t)SwapBytes(src[i]) * GEOM_UNITSINMETER;
+	} else if (step == 1) {
+		for (int i = 0; i < count; ++i)
+			dst[i] = (int16_t)src[i] * GEOM_UNITSINMETER;
+	} else {
+		for (int i = 0; i < count; ++i)
+			dst[i] = (int16_t)(swap ? SwapBytes(src[i * step]) : src[i * step]) * GEOM_UNITSINMETER;
+	}
+}
+
+/* returns width of .hgt file by its size, or 0 if unknown */
+static int GetFileWidth(size_t size) {
+	if (size == 2 * SRTM3_FILE_WIDTH * SRTM3_FILE_WIDTH)
+		return SRTM3_FILE_WIDTH;
+	if (size == 2 * SRTM1_FILE_WIDTH * SRTM1_FILE_WIDTH)
+		return SRTM1_FILE_WIDTH;
+	return 0;
+}
+
+static inline uint16_t GetLE16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t GetLE32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* reads whole file, decompressing gzip, bzip2 and zstd; returns
+ * false if file doesn't exist */
+static bool ReadWholeFile(const std::string& filename, std::vector<unsigned char>& out) {
+	int f;
+	if ((f = open(filename.c_str(), O_RDONLY)) == -1) {
+		if (errno == ENOENT)
+			return false;
+		throw SystemError() << "cannot open SRTM file " << filename;
+	}
+
+	try {
+		std::auto_ptr<InputStream> stream(InputStream::Create(f));
+
+		out.resize(1024 * 1024);
+		size_t size = 0, nread;
+		while ((nread = stream->Read(reinterpret_cast<char*>(&out[size]), out.size() - size)) != 0)
+			if ((size += nread) == out.size())
+				out.resize(out.size() * 2);
+		out.resize(size);
+	} catch (...) {
+		close(f);
+		throw;
+	}
+
+	close(f);
+	return true;
+}
+
+/* extracts first .hgt file from zip archive */
+static void ExtractFromZip(const std::string& filename, const std::vector<unsigned char>& zip, std::vector<unsigned char>& out) {
+	static const size_t EOCD_SIZE = 22;
+	static const size_t CENTRAL_HEADER_SIZE = 46;
+	static const size_t LOCAL_HEADER_SIZE = 30;
+
+	const unsigned char* data = zip.empty() ? NULL : &zip[0];
+	size_t size = zip.size();
+
+	/* end of central directory record, possibly followed by comment */
+	size_t eocd = size;
+	for (size_t i = size >= EOCD_SIZE ? size - EOCD_SIZE + 1 : 0; i > 0 && size - i < EOCD_SIZE + 65536; --i) {
+		if (GetLE32(data + i - 1) == 0x06054b50) {
+			eocd = i - 1;
+			break;
+		}
+	}
+	if (eocd == size)
+		throw Exception() << "not a zip archive: " << filename;
+
+	unsigned int nentries = GetLE16(data + eocd + 10);
+	size_t offset = GetLE32(data + eocd + 16);
+
+	for (unsigned int entry = 0; entry < nentries; ++entry) {
+		if (offset + CENTRAL_HEADER_SIZE > eocd || GetLE32(data + offset) != 0x02014b50)
+			throw Exception() << "bad zip central directory in " << filename;
+
+		const unsigned char* header = data + offset;
+		unsigned int method = GetLE16(header + 10);
+		size_t compressed_size = GetLE32(header + 20);
+		size_t uncompressed_size = GetLE32(header + 24);
+		size_t name_length = GetLE16(header + 28);
+		size_t local_offset = GetLE32(header + 42);
+
+		if (offset + CENTRAL_HEADER_SIZE + name_length > eocd)
+			throw Exception() << "bad zip central directory in " << filename;
+
+		std::string name(reinterpret_cast<const char*>(header + CENTRAL_HEADER_SIZE), name_length);
+		offset += CENTRAL_HEADER_SIZE + name_length + GetLE16(header + 30) + GetLE16(header + 32);
+
+		if (name.length() < 4 || strcasecmp(name.c_str() + name.length() - 4, ".hgt") != 0)
+			continue;
+
+		if (local_offset + LOCAL_HEADER_SIZE > size || GetLE32(data + local_offset) != 0x04034b50)
+			throw Exception() << "bad zip local header in " << filename;
+
+		size_t data_offset = local_offset + LOCAL_HEADER_SIZE + GetLE16(data + local_offset + 26) + GetLE16(data + local_offset + 28);
+		if (data_offset > size || compressed_size > size - data_offset)
+			throw Exception() << "truncated zip archive " << filename;
+
+		if (method == 0) {
+			out.assign(data + data_offset, data + data_offset + compressed_size);
+			return;
+		}
+
+		if (method != 8)
+			throw Exception() << "unsupported zip compression method " << method << " in " << filename;
+
+		out.resize(uncompressed_size);
+
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+
+		/* negative window bits mean raw deflate without headers */
+		if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+			throw Exception() << "inflateInit2 failed";
+
+		stream.next_in = const_cast<Bytef*>(data + data_offset);
+		stream.avail_in = compressed_size;
+		stream.next_out = out.empty() ? NULL : &out[0];
+		stream.avail_out = out.size();
+
+		int ret = inflate(&stream, Z_FINISH);
+		inflateEnd(&stream);
+
+		if (ret != Z_STREAM_END || stream.total_out != uncompressed_size)
+			throw Exception() << "cannot decompress " << name << " in " << filename;
+
+		return;
+	}
+
+	throw Exception() << "no .hgt file in zip archive " << filename;
+}
+
+inline int16_t SRTMDatasource::ChunkData::Get(int line, int pos) const {
+	uint16_t value = rows[(DATA_HEIGHT - 1 - line) * stride + pos * step];
+	return (int16_t)(swap ? SwapBytes(value) : value);
+}
+
+inline const uint16_t* SRTMDatasource::ChunkData::GetRow(int line) const {
+	return rows + (DATA_HEIGHT - 1 - line) * stride;
+}
+
+void SRTMDatasource::ChunkData::Swap(ChunkData& other) {
+	/* vector swap keeps storage, so rows stay valid */
+	buffer.swap(other.buffer);
+	std::swap(mapping, other.mapping);
+	std::swap(mapping_size, other.mapping_size);
+	std::swap(rows, other.rows);
+	std::swap(stride, other.stride);
+	std::swap(step, other.step);
+	std::swap(swap, other.swap);
+}
+
+void SRTMDatasource::ChunkData::Release() {
+	if (mapping != NULL)
+		munmap(mapping, mapping_size);
+	std::vector<int16_t>().swap(buffer);
+
+	mapping = NULL;
+	mapping_size = 0;
+	rows = NULL;
+	stride = 0;
+	step = 0;
+	swap = false;
+}
+
+SRTMDatasource::SRTMDatasource(const char* storage_path, int flags) : storage_path_(storage_path), flags_(flags), use_clock_(0), resident_size_(0), size_limit_(DEFAULT_RESIDENT_CHUNKS * CHUNK_SIZE), loads_(0), evictions_(0), prefetch_started_(false), prefetch_stop_(false) {
 	int errn;
-	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+
+	if ((errn = pthread_mutex_init(&prefetch_mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_cond_init(&prefetch_cond_, 0)) != 0) {
+		pthread_mutex_destroy(&prefetch_mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if ((errn = pthread_mutex_init(&resident_mutex_, 0)) != 0) {
+		pthread_cond_destroy(&prefetch_cond_);
+		pthread_mutex_destroy(&prefetch_mutex_);
 		throw SystemError(errn) << "pthread_mutex_init failed";
+	}
+
+	for (int i = 0; i < NUM_STRIPES; ++i) {
+		if ((errn = pthread_mutex_init(&stripes_[i].mutex, 0)) != 0) {
+			for (int j = 0; j < i; ++j) {
+				pthread_mutex_destroy(&stripes_[j].mutex);
+				pthread_cond_destroy(&stripes_[j].cond);
+			}
+			pthread_mutex_destroy(&resident_mutex_);
+			pthread_cond_destroy(&prefetch_cond_);
+			pthread_mutex_destroy(&prefetch_mutex_);
+			throw SystemError(errn) << "pthread_mutex_init failed";
+		}
+		if ((errn = pthread_cond_init(&stripes_[i].cond, 0)) != 0) {
+			pthread_mutex_destroy(&stripes_[i].mutex);
+			for (int j = 0; j < i; ++j) {
+				pthread_mutex_destroy(&stripes_[j].mutex);
+				pthread_cond_destroy(&stripes_[j].cond);
+			}
+			pthread_mutex_destroy(&resident_mutex_);
+			pthread_cond_destroy(&prefetch_cond_);
+			pthread_mutex_destroy(&prefetch_mutex_);
+			throw SystemError(errn) << "pthread_cond_init failed";
+		}
+	}
+
+	chunks_ = new Chunk* volatile[CHUNKS_LON * CHUNKS_LAT];
+	for (int i = 0; i < CHUNKS_LON * CHUNKS_LAT; ++i)
+		chunks_[i] = NULL;
+
+	resident_.reserve(DEFAULT_RESIDENT_CHUNKS + 1);
 }
 
 SRTMDatasource::~SRTMDatasource() {
-	pthread_mutex_destroy(&mutex_);
+	/* prefetcher may be loading a chunk, so let it finish first */
+	pthread_mutex_lock(&prefetch_mutex_);
+	bool started = prefetch_started_;
+	prefetch_stop_ = true;
+	pthread_cond_signal(&prefetch_cond_);
+	pthread_mutex_unlock(&prefetch_mutex_);
+
+	if (started)
+		pthread_join(prefetch_thread_, NULL);
+
+	for (int i = 0; i < CHUNKS_LON * CHUNKS_LAT; ++i) {
+		if (chunks_[i] != NULL)
+			chunks_[i]->data.Release();
+		delete chunks_[i];
+	}
+	delete[] chunks_;
+
+	for (int i = 0; i < NUM_STRIPES; ++i) {
+		pthread_mutex_destroy(&stripes_[i].mutex);
+		pthread_cond_destroy(&stripes_[i].cond);
+	}
+	pthread_mutex_destroy(&resident_mutex_);
+	pthread_cond_destroy(&prefetch_cond_);
+	pthread_mutex_destroy(&prefetch_mutex_);
 }
 
-SRTMDatasource::Chunk& SRTMDatasource::RequireChunk(int lon, int lat) const {
-	lon -= 180;
-	lat -= 90;
+const SRTMDatasource::Chunk* SRTMDatasource::AcquireChunk(int lon, int lat) const {
+	/* heightmap margins may step over the edges of the world */
+	lon = (lon % CHUNKS_LON + CHUNKS_LON) % CHUNKS_LON;
+	lat = std::max(0, std::min(CHUNKS_LAT - 1, lat));
+
+	int index = lat * CHUNKS_LON + lon;
+
+	/* fast path: pin resident chunk without locking */
+	Chunk* chunk = chunks_[index];
+	if (chunk != NULL) {
+		int refs;
+		while ((refs = chunk->refs) >= 0) {
+			if (__sync_bool_compare_and_swap(&chunk->refs, refs, refs + 1)) {
+				if (chunk->state == READY) {
+					chunk->last_use = __sync_add_and_fetch(&use_clock_, 1);
+					return chunk;
+				}
 
-	ChunksMap::iterator chunk = chunks_.find(ChunkId(lon, lat));
-	if (chunk == chunks_.end()) {
-		std::pair<ChunksMap::iterator, bool> p = chunks_.insert(std::make_pair(ChunkId(lon, lat), Chunk()));
-		assert(p.second);
-		chunk = p.first;
+				/* not loaded yet or evicted just before pinning */
+				__sync_sub_and_fetch(&chunk->refs, 1);
+				break;
+			}
+		}
 	}
 
-	chunk->second.generation = ++generation_;
+	return LoadChunk(index);
+}
 
-	/* hardcoded cleanup routine; make this customizable like in TileManager */
-	if (chunks_.size() > 32) {
-		std::multimap<int, ChunksMap::iterator> gensorted;
-		for (ChunksMap::iterator i = chunks_.begin(); i != chunks_.end(); ++i)
-			gensorted.insert(std::make_pair(i->second.generation, i));
+void SRTMDatasource::ReleaseChunk(const Chunk* chunk) const {
+	__sync_sub_and_fetch(&const_cast<Chunk*>(chunk)->refs, 1);
+}
+
+const SRTMDatasource::Chunk* SRTMDatasource::LoadChunk(int index) const {
+	Stripe& stripe = stripes_[index % NUM_STRIPES];
+	bool loaded = false;
+
+	pthread_mutex_lock(&stripe.mutex);
+
+	Chunk* chunk = chunks_[index];
+	if (chunk == NULL) {
+		try {
+			chunk = new Chunk(index);
+		} catch (...) {
+			pthread_mutex_unlock(&stripe.mutex);
+			throw;
+		}
 
-		for (unsigned int i = 24; i < chunks_.size(); ++i)
-			gensorted.erase(gensorted.begin());
+		/* make chunk visible to fast path only when constructed */
+		__sync_synchronize();
+		chunks_[index] = chunk;
 	}
 
-	try {
-		if (chunk->second.data.empty()) {
-			chunk->second.data.resize(DATA_HEIGHT * DATA_WIDTH);
+	/* someone else is reading this chunk; wait for it */
+	while (chunk->state == LOADING)
+		pthread_cond_wait(&stripe.cond, &stripe.mutex);
+
+	if (chunk->state == EMPTY) {
+		chunk->state = LOADING;
+		pthread_mutex_unlock(&stripe.mutex);
+
+		ChunkData data;
+		try {
+			ReadChunk(index % CHUNKS_LON - 180, index / CHUNKS_LON - 90, data);
+		} catch (...) {
+			pthread_mutex_lock(&stripe.mutex);
+			chunk->state = EMPTY;
+			pthread_cond_broadcast(&stripe.cond);
+			pthread_mutex_unlock(&stripe.mutex);
+			throw;
+		}
+
+		pthread_mutex_lock(&stripe.mutex);
+		chunk->data.Swap(data);
+		chunk->state = READY;
+		pthread_cond_broadcast(&stripe.cond);
+		loaded = true;
+	}
+
+	/* eviction only happens under stripe lock, so chunk can't
+	 * be in the middle of it here */
+	__sync_add_and_fetch(&chunk->refs, 1);
+	chunk->last_use = __sync_add_and_fetch(&use_clock_, 1);
 
-			std::stringstream filename;
-			filename << storage_path_ << "/" << std::setfill('0')
-				<< (lat < 0 ? 'E' : 'N') << std::setw(2) << abs(lat)
-				<< (lon < 0 ? 'W' : 'E') << std::setw(3) << abs(lon) << ".hgt";
+	pthread_mutex_unlock(&stripe.mutex);
 
-			int f;
-			if ((f = open(filename.str().c_str(), O_RDONLY)) == -1)
-				throw SystemError() << "cannot open SRTM file " << filename.str();
+	if (loaded) {
+		Guard guard(resident_mutex_);
+		resident_.push_back(chunk);
+		resident_size_ += CHUNK_SIZE;
+		loads_++;
+		EvictChunks();
+	}
 
-			try {
-				int16_t* current = chunk->second.data.data();
+	return chunk;
+}
 
-				for (int line = 0; line < DATA_HEIGHT; line++) {
-					size_t toread = 2 * DATA_WIDTH;
-					char* readptr = reinterpret_cast<char*>(current);
+bool SRTMDatasource::MapChunk(const std::string& filename, ChunkData& data) const {
+	int f;
+	if ((f = open(filename.c_str(), O_RDONLY)) == -1)
+		return false;
 
-					while (toread > 0) {
-						ssize_t nread = read(f, readptr, toread);
+	struct stat st;
+	int width = 0;
+	void* mapping = MAP_FAILED;
+	if (fstat(f, &st) == 0 && (width = GetFileWidth(st.st_size)) != 0)
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f, 0);
 
-						if (nread == -1 && errno == EINTR)
-							continue;
-						else if (nread == -1)
-							throw SystemError() << "read error on SRTM file " << filename.str();
-						else if (nread == 0)
-							throw Exception() << "unexpected EOF in SRTM file " << filename.str();
+	/* mapping stays valid after close */
+	close(f);
 
-						toread -= nread;
-						readptr += nread;
-					}
+	if (mapping == MAP_FAILED)
+		return false;
 
-					/* SRTM data is in big-endian format, convert it if needed */
-					if (!IsBigEndian()) {
-						for (uint16_t* val = (uint16_t*)current; val < (uint16_t*)current + DATA_WIDTH; ++val)
-							*val = (*val >> 8) | (*val << 8);
-					}
+	int step = (width - 1) / DATA_WIDTH;
 
-					if (lseek(f, 2 * (FILE_WIDTH - DATA_WIDTH), SEEK_CUR) == -1)
-						throw SystemError() << "cannot seek SRTM file " << filename.str();
+	data.mapping = mapping;
+	data.mapping_size = st.st_size;
+	data.rows = static_cast<const uint16_t*>(mapping);
+	data.stride = width * step;
+	data.step = step;
+	data.swap = !IsBigEndian();
 
-					current += DATA_WIDTH;
-				}
-			} catch (...) {
-				close(f);
-				throw;
-			}
+	return true;
+}
+
+void SRTMDatasource::ReadChunk(int lon, int lat, ChunkData& data) const {
+	TRACE_SCOPE("SRTMDatasource::ReadChunk");
+
+	std::stringstream filename;
+	filename << storage_path_ << "/" << std::setfill('0')
+		<< (lat < 0 ? 'S' : 'N') << std::setw(2) << abs(lat)
+		<< (lon < 0 ? 'W' : 'E') << std::setw(3) << abs(lon) << ".hgt";
+
+	/* unusual or unmappable files go through reading, which will
+	 * report the problem */
+	if ((flags_ & MMAP_CHUNKS) && MapChunk(filename.str(), data))
+		return;
+
+	data.buffer.resize(DATA_HEIGHT * DATA_WIDTH);
+	data.rows = reinterpret_cast<const uint16_t*>(data.buffer.data());
+	data.stride = DATA_WIDTH;
+	data.step = 1;
+	data.swap = false;
+
+	try {
+		/* plain or compressed file, then zip archive */
+		std::vector<unsigned char> raw;
+		if (!ReadWholeFile(filename.str(), raw) && !ReadWholeFile(filename.str() + ".gz", raw)) {
+			std::vector<unsigned char> zip;
+			if (!ReadWholeFile(filename.str() + ".zip", zip))
+				throw Exception() << "cannot find SRTM file " << filename.str() << "[.gz|.zip]";
+			ExtractFromZip(filename.str() + ".zip", zip, raw);
+		}
 
-			close(f);
+		int width = GetFileWidth(raw.size());
+		if (width == 0)
+			throw Exception() << "unexpected size of SRTM file " << filename.str();
+
+		/* SRTM1 is downsampled by taking every third point, which
+		 * coincides with SRTM3 grid; data is big-endian */
+		int step = (width - 1) / DATA_WIDTH;
+		const uint16_t* src = reinterpret_cast<const uint16_t*>(&raw[0]);
+		int16_t* dst = data.buffer.data();
+		for (int line = 0; line < DATA_HEIGHT; ++line) {
+			const uint16_t* row = src + line * step * width;
+			for (int pos = 0; pos < DATA_WIDTH; ++pos)
+				dst[pos] = (int16_t)(IsBigEndian() ? row[pos * step] : SwapBytes(row[pos * step]));
+			dst += DATA_WIDTH;
 		}
 	} catch (Exception& e) {
 		/* if the problem is in our code, just display warning.
 		 * returned chunk will be legal, but it will have zeroed
-		 * or partial data, which is better than just dying */
+		 * data, which is better than just dying */
 		fprintf(stderr, "warning: %s\n", e.what());
-	} catch (...) {
-		chunks_.erase(chunk);
-		throw;
 	}
+}
+
+void SRTMDatasource::EvictChunks() const {
+	while (resident_size_ > size_limit_) {
+		ChunkVector::iterator victim = resident_.end();
+		for (ChunkVector::iterator i = resident_.begin(); i != resident_.end(); ++i)
+			if ((*i)->refs == 0 && (victim == resident_.end() || (*i)->last_use < (*victim)->last_use))
+				victim = i;
+
+		/* all chunks are in use */
+		if (victim == resident_.end())
+			return;
+
+		Chunk* chunk = *victim;
+		Stripe& stripe = stripes_[chunk->index % NUM_STRIPES];
+		bool evicted = false;
+
+		pthread_mutex_lock(&stripe.mutex);
+		/* fails if chunk was pinned after the check above */
+		if (__sync_bool_compare_and_swap(&chunk->refs, 0, -1)) {
+			chunk->state = EMPTY;
+			chunk->data.Release();
+			__sync_bool_compare_and_swap(&chunk->refs, -1, 0);
+			evicted = true;
+		}
+		pthread_mutex_unlock(&stripe.mutex);
 
-	return chunk->second;
+		if (!evicted)
+			return;
+
+		resident_.erase(victim);
+		resident_size_ -= CHUNK_SIZE;
+		evictions_++;
+	}
 }
 
 osmint_t SRTMDatasource::GetPointHeight(int x, int y) const {
@@ -151,14 +534,14 @@ osmint_t SRTMDatasource::GetPointHeight(int x, int y) const {
 	int pos = x - xchunk * DATA_WIDTH;
 	int line = y - ychunk * DATA_HEIGHT;
 
-	Chunk& chunk = RequireChunk(xchunk, ychunk);
+	const Chunk* chunk = AcquireChunk(xchunk, ychunk);
+	osmint_t height = chunk->data.Get(line, pos) * GEOM_UNITSINMETER;
+	ReleaseChunk(chunk);
 
-	return chunk.data[(DATA_HEIGHT - 1 - line) * DATA_WIDTH + pos] * GEOM_UNITSINMETER;
+	return height;
 }
 
 void SRTMDatasource::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const {
-	Guard guard(mutex_);
-
 	BBox<int> srtm_bbox; /* bbox in srtm point numbers, zero-based at bottom left corner */
 	BBox<int> srtm_chunks; /* bbox in srtm chunk numbers, zero-based at bottom left corner */
 
@@ -192,57 +575,227 @@ void SRTMDatasource::GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap&
 
 			chunk_bbox -= Vector2<int>(xchunk * DATA_WIDTH, ychunk * DATA_HEIGHT);
 
-			Chunk& chunk = RequireChunk(xchunk, ychunk);
-			for (int line = chunk_bbox.bottom; line <= chunk_bbox.top; ++line) {
-				for (int pos = chunk_bbox.left; pos <= chunk_bbox.right; ++pos) {
-					osmint_t current = chunk.data[(DATA_HEIGHT - 1 - line) * DATA_WIDTH + pos] * GEOM_UNITSINMETER;
-					out.points[(ychunk * DATA_HEIGHT - srtm_bbox.bottom + line) * width + (xchunk * DATA_WIDTH - srtm_bbox.left + pos)] = current;
-				}
-			}
+			const Chunk* chunk = AcquireChunk(xchunk, ychunk);
+			for (int line = chunk_bbox.bottom; line <= chunk_bbox.top; ++line)
+				CopyHeights(chunk->data.GetRow(line) + chunk_bbox.left * chunk->data.step,
+						chunk_bbox.right - chunk_bbox.left + 1,
+						chunk->data.step,
+						chunk->data.swap,
+						&out.points[(ychunk * DATA_HEIGHT - srtm_bbox.bottom + line) * width + (xchunk * DATA_WIDTH - srtm_bbox.left + chunk_bbox.left)]);
+			ReleaseChunk(chunk);
 		}
 	}
 }
 
-osmint_t SRTMDatasource::GetHeight(const Vector2i& where) const {
-	Guard guard(mutex_);
+/* finds srtm cell containing a point: its bottom left point
+ * number, zero-based at bottom left corner, and position of the
+ * point inside the cell */
+static void GetCell(const Vector2i& where, int& x, int& y, double& kx, double& ky) {
+	x = (int)floor(((double)where.x / (double)GEOM_UNITSINDEGREE + 180.0) * (double)DATA_WIDTH);
+	y = (int)floor(((double)where.y / (double)GEOM_UNITSINDEGREE + 90.0) * (double)DATA_HEIGHT);
 
-	BBox<int> srtm_bbox; /* bbox in srtm point numbers, zero-based at bottom left corner */
-	BBox<int> srtm_chunks; /* bbox in srtm chunk numbers, zero-based at bottom left corner */
 	BBoxi real_bbox;
+	real_bbox.left = (osmint_t)round(((double)x / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
+	real_bbox.bottom = (osmint_t)round(((double)y / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
+	real_bbox.right = (osmint_t)round(((double)(x + 1) / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
+	real_bbox.top = (osmint_t)round(((double)(y + 1) / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
 
-	srtm_bbox.left = (int)floor(((double)where.x / (double)GEOM_UNITSINDEGREE + 180.0) * (double)DATA_WIDTH);
-	srtm_bbox.bottom = (int)floor(((double)where.y / (double)GEOM_UNITSINDEGREE + 90.0) * (double)DATA_HEIGHT);
-	srtm_bbox.right = srtm_bbox.left + 1;
-	srtm_bbox.top = srtm_bbox.bottom + 1;
-
-	real_bbox.left = (osmint_t)round(((double)srtm_bbox.left / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.bottom = (osmint_t)round(((double)srtm_bbox.bottom / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.right = (osmint_t)round(((double)srtm_bbox.right / (double)DATA_WIDTH - 180.0) * (double)GEOM_UNITSINDEGREE);
-	real_bbox.top = (osmint_t)round(((double)srtm_bbox.top / (double)DATA_HEIGHT - 90.0) * (double)GEOM_UNITSINDEGREE);
-
-	double kx = (double)(where.x - real_bbox.left)/(double)(real_bbox.right - real_bbox.left);
-	double ky = (double)(where.y - real_bbox.bottom)/(double)(real_bbox.top - real_bbox.bottom);
-
-	/*
-	 * here we take into account that our heightmap is split
-	 * into triangles like this:
-	 * +--+
-	 * | /|
-	 * |/ |
-	 * +--+
-	 * but "true" height would be 4-point interpolation
-	 */
+	kx = (double)(where.x - real_bbox.left)/(double)(real_bbox.right - real_bbox.left);
+	ky = (double)(where.y - real_bbox.bottom)/(double)(real_bbox.top - real_bbox.bottom);
+}
 
+/*
+ * here we take into account that our heightmap is split
+ * into triangles like this:
+ * +--+
+ * | /|
+ * |/ |
+ * +--+
+ * but "true" height would be 4-point interpolation
+ */
+static osmint_t Interpolate(double kx, double ky, osmint_t lb, osmint_t rb, osmint_t lt, osmint_t rt) {
 	double height;
-	if (kx < ky) {
-		height = (double)GetPointHeight(srtm_bbox.left, srtm_bbox.bottom) * (1 - ky) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.top) * (kx) +
-		         (double)GetPointHeight(srtm_bbox.left, srtm_bbox.top) * (ky - kx);
-	} else {
-		height = (double)GetPointHeight(srtm_bbox.left, srtm_bbox.bottom) * (1 - kx) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.top) * (ky) +
-		         (double)GetPointHeight(srtm_bbox.right, srtm_bbox.bottom) * (kx - ky);
-	}
+	if (kx < ky)
+		height = (double)lb * (1 - ky) + (double)rt * (kx) + (double)lt * (ky - kx);
+	else
+		height = (double)lb * (1 - kx) + (double)rt * (ky) + (double)rb * (kx - ky);
 
 	return (osmint_t)round(height);
 }
+
+osmint_t SRTMDatasource::GetHeight(const Vector2i& where) const {
+	int x, y;
+	double kx, ky;
+	GetCell(where, x, y, kx, ky);
+
+	return Interpolate(kx, ky,
+			GetPointHeight(x, y), GetPointHeight(x + 1, y),
+			GetPointHeight(x, y + 1), GetPointHeight(x + 1, y + 1));
+}
+
+void SRTMDatasource::GetHeights(const Vector2i* points, size_t count, osmint_t* out) const {
+	const Chunk* chunk = NULL;
+	int xchunk = 0, ychunk = 0;
+
+	try {
+		for (size_t i = 0; i < count; ++i) {
+			int x, y;
+			double kx, ky;
+			GetCell(points[i], x, y, kx, ky);
+
+			int pos = x % DATA_WIDTH;
+			int line = y % DATA_HEIGHT;
+
+			/* cell spans several chunks; rare, so take slow path */
+			if (pos == DATA_WIDTH - 1 || line == DATA_HEIGHT - 1) {
+				out[i] = GetHeight(points[i]);
+				continue;
+			}
+
+			if (chunk == NULL || x / DATA_WIDTH != xchunk || y / DATA_HEIGHT != ychunk) {
+				if (chunk != NULL)
+					ReleaseChunk(chunk);
+				chunk = NULL;
+
+				xchunk = x / DATA_WIDTH;
+				ychunk = y / DATA_HEIGHT;
+				chunk = AcquireChunk(xchunk, ychunk);
+			}
+
+			out[i] = Interpolate(kx, ky,
+					chunk->data.Get(line, pos) * GEOM_UNITSINMETER, chunk->data.Get(line, pos + 1) * GEOM_UNITSINMETER,
+					chunk->data.Get(line + 1, pos) * GEOM_UNITSINMETER, chunk->data.Get(line + 1, pos + 1) * GEOM_UNITSINMETER);
+		}
+	} catch (...) {
+		if (chunk != NULL)
+			ReleaseChunk(chunk);
+		throw;
+	}
+
+	if (chunk != NULL)
+		ReleaseChunk(chunk);
+}
+
+/* orders chunks by distance to a point, farthest first */
+struct SRTMChunkDistanceGreater {
+	double lon, lat;
+
+	SRTMChunkDistanceGreater(double x, double y) : lon(x), lat(y) {
+	}
+
+	double Distance(const std::pair<int, int>& chunk) const {
+		double dx = chunk.first + 0.5 - lon, dy = chunk.second + 0.5 - lat;
+		return dx * dx + dy * dy;
+	}
+
+	bool operator()(const std::pair<int, int>& a, const std::pair<int, int>& b) const {
+		return Distance(a) > Distance(b);
+	}
+};
+
+void* SRTMDatasource::PrefetchThread(void* arg) {
+	static_cast<const SRTMDatasource*>(arg)->PrefetchChunks();
+	return NULL;
+}
+
+void SRTMDatasource::PrefetchChunks() const {
+	pthread_mutex_lock(&prefetch_mutex_);
+	while (!prefetch_stop_) {
+		if (prefetch_queue_.empty()) {
+			pthread_cond_wait(&prefetch_cond_, &prefetch_mutex_);
+			continue;
+		}
+
+		std::pair<int, int> pos = prefetch_queue_.back();
+		prefetch_queue_.pop_back();
+		pthread_mutex_unlock(&prefetch_mutex_);
+
+		try {
+			TRACE_SCOPE("SRTMDatasource::PrefetchChunk");
+
+			const Chunk* chunk = AcquireChunk(pos.first, pos.second);
+
+			/* mapping only reserves address space; make kernel
+			 * read the file before it's faulted in by samplers */
+			if (chunk->data.mapping != NULL)
+				madvise(chunk->data.mapping, chunk->data.mapping_size, MADV_WILLNEED);
+
+			ReleaseChunk(chunk);
+		} catch (std::exception& e) {
+			/* chunk will be loaded, or fail, on demand again */
+			fprintf(stderr, "warning: cannot prefetch SRTM chunk: %s\n", e.what());
+		}
+
+		pthread_mutex_lock(&prefetch_mutex_);
+	}
+	pthread_mutex_unlock(&prefetch_mutex_);
+}
+
+void SRTMDatasource::Prefetch(const BBoxi& bbox) const {
+	double left = (double)bbox.left / (double)GEOM_UNITSINDEGREE + 180.0;
+	double bottom = (double)bbox.bottom / (double)GEOM_UNITSINDEGREE + 90.0;
+	double right = (double)bbox.right / (double)GEOM_UNITSINDEGREE + 180.0;
+	double top = (double)bbox.top / (double)GEOM_UNITSINDEGREE + 90.0;
+
+	/* out of range longitudes are wrapped by AcquireChunk() */
+	BBox<int> range(
+			(int)floor(left),
+			std::max(0, (int)floor(bottom)),
+			std::min((int)floor(left) + CHUNKS_LON - 1, (int)floor(right)),
+			std::min(CHUNKS_LAT - 1, (int)floor(top))
+		);
+
+	size_t limit;
+	{
+		Guard guard(resident_mutex_);
+		limit = std::max((size_t)1, size_limit_ / CHUNK_SIZE / 2);
+	}
+
+	Guard guard(prefetch_mutex_);
+
+	if (range.left == prefetch_range_.left && range.bottom == prefetch_range_.bottom && range.right == prefetch_range_.right && range.top == prefetch_range_.top)
+		return;
+
+	if (!prefetch_started_) {
+		/* chunks are still loaded on demand if thread can't be run */
+		if (pthread_create(&prefetch_thread_, NULL, PrefetchThread, const_cast<SRTMDatasource*>(this)) != 0)
+			return;
+		prefetch_started_ = true;
+	}
+
+	prefetch_range_ = range;
+	prefetch_queue_.clear();
+	for (int lat = range.bottom; lat <= range.top; ++lat)
+		for (int lon = range.left; lon <= range.right; ++lon)
+			prefetch_queue_.push_back(std::make_pair(lon, lat));
+
+	/* farthest first, so nearest are popped from the back first;
+	 * those over the limit are dropped */
+	std::sort(prefetch_queue_.begin(), prefetch_queue_.end(), SRTMChunkDistanceGreater((left + right) / 2.0, (bottom + top) / 2.0));
+	if (prefetch_queue_.size() > limit)
+		prefetch_queue_.erase(prefetch_queue_.begin(), prefetch_queue_.end() - limit);
+
+	pthread_cond_signal(&prefetch_cond_);
+}
+
+void SRTMDatasource::SetSizeLimit(size_t limit) {
+	Guard guard(resident_mutex_);
+	size_limit_ = limit;
+	EvictChunks();
+}
+
+size_t SRTMDatasource::GetSize() const {
+	Guard guard(resident_mutex_);
+	return resident_size_;
+}
+
+void SRTMDatasource::GetStatistics(Statistics& stats) const {
+	Guard guard(resident_mutex_);
+
+	/* each lookup takes a tick of use clock */
+	stats.lookups = use_clock_;
+	stats.loads = loads_;
+	stats.evictions = evictions_;
+	stats.size = resident_size_;
+	stats.size_limit = size_limit_;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/StringTable.hh>
+
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
+
+#include <cassert>
+
+/* must match WellKnownString enum */
+static const char* well_known_strings[] = {
+	"",
+
+	"area",
+	"barrier",
+	"boundary",
+	"building",
+	"building:ground_level",
+	"building:levels",
+	"building:min_level",
+	"building:part",
+	"building:part:height",
+	"building:skipped_levels",
+	"height",
+	"highway",
+	"landuse",
+	"lanes",
+	"man_made",
+	"min_height",
+	"natural",
+	"oneway",
+	"power",
+	"railway",
+	"roof:angle",
+	"roof:orientation",
+	"roof:shape",
+	"type",
+	"waterway",
+	"width",
+
+	"across",
+	"administrative",
+	"chimney",
+	"conical",
+	"crosspitched",
+	"footway",
+	"gabled",
+	"garage",
+	"garages",
+	"hipped",
+	"inner",
+	"line",
+	"mast",
+	"motorway",
+	"motorway_link",
+	"multipolygon",
+	"no",
+	"outer",
+	"path",
+	"pedestrian",
+	"primary",
+	"primary_link",
+	"pyramidal",
+	"rail",
+	"residential",
+	"secondary",
+	"secondary_link",
+	"service",
+	"skillion",
+	"steps",
+	"street_lamp",
+	"tertiary",
+	"tower",
+	"track",
+	"tree",
+	"trunk",
+	"trunk_link",
+	"yes",
+};
+
+StringTable::StringTable() : count_(0) {
+	assert(sizeof(well_known_strings) / sizeof(well_known_strings[0]) == STR_WELL_KNOWN_COUNT);
+
+	for (unsigned int i = 0; i < MAX_PAGES; ++i)
+		pages_[i] = NULL;
+
+	pthread_mutex_init(&mutex_, 0);
+
+	/* slot 0 is STR_NONE; it's only stored to keep ids aligned
+	 * and is not accessible via Find() */
+	pages_[0] = new std::string[PAGE_SIZE];
+	count_ = 1;
+
+	for (unsigned int i = 1; i < STR_WELL_KNOWN_COUNT; ++i)
+		Intern(well_known_strings[i]);
+}
+
+StringTable::~StringTable() {
+	for (unsigned int i = 0; i < MAX_PAGES; ++i)
+		delete[] pages_[i];
+
+	pthread_mutex_destroy(&mutex_);
+}
+
+StringTable& StringTable::Instance() {
+	static StringTable instance;
+	return instance;
+}
+
+strid_t StringTable::Intern(const char* str) {
+	Guard guard(mutex_);
+
+	IdsMap::const_iterator i = ids_.find(str);
+	if (i != ids_.end())
+		return i->second;
+
+	strid_t id = count_;
+	if ((id >> PAGE_BITS) >= MAX_PAGES)
+		throw Exception() << "string table overflow";
+
+	std::string*& page = pages_[id >> PAGE_BITS];
+	if (page == NULL)
+		page = new std::string[PAGE_SIZE];
+
+	std::string& stored = page[id & (PAGE_SIZE - 1)];
+	stored = str;
+	ids_.insert(std::make_pair(stored.c_str(), id));
+
+	count_ = id + 1;
+
+	return id;
+}
+
+strid_t StringTable::Find(const char* str) const {
+	Guard guard(mutex_);
+
+	IdsMap::const_iterator i = ids_.find(str);
+	if (i == ids_.end())
+		return STR_NONE;
+
+	return i->second;
+}
+
+strid_t StringTable::GetCount() const {
+	Guard guard(mutex_);
+
+	return count_;
+}
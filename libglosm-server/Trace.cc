@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/Trace.hh>
+
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/* events kept per thread; older ones are overwritten */
+static const size_t TRACE_BUFFER_EVENTS = 16384;
+
+/**
+ * Ring buffer of events of a single thread
+ *
+ * Buffers are never freed, so events of finished threads are
+ * written too.
+ */
+struct TraceBuffer {
+	Trace::Event events[TRACE_BUFFER_EVENTS];
+
+	/* number of events ever recorded */
+	volatile size_t count;
+
+	int tid;
+	TraceBuffer* next;
+};
+
+/* all buffers, newest first */
+static TraceBuffer* volatile trace_buffers = NULL;
+static volatile int trace_last_tid = 0;
+
+static __thread TraceBuffer* trace_thread_buffer = NULL;
+
+/* set by Trace::Start() */
+static std::string trace_filename;
+static pid_t trace_pid = 0;
+static uint64_t trace_base = 0;
+
+volatile bool Trace::enabled_ = false;
+
+static TraceBuffer* GetTraceBuffer() {
+	if (trace_thread_buffer == NULL) {
+		TraceBuffer* buffer = new TraceBuffer;
+		buffer->count = 0;
+		buffer->tid = __sync_add_and_fetch(&trace_last_tid, 1);
+
+		do {
+			buffer->next = trace_buffers;
+		} while (!__sync_bool_compare_and_swap(&trace_buffers, buffer->next, buffer));
+
+		trace_thread_buffer = buffer;
+	}
+
+	return trace_thread_buffer;
+}
+
+static void WriteTraceAtExit() {
+	Trace::Flush();
+}
+
+void Trace::Init() {
+	const char* filename = getenv("GLOSM_TRACE");
+	if (filename != NULL && *filename != '\0')
+		Start(filename);
+}
+
+void Trace::Start(const char* filename) {
+	if (trace_filename.empty())
+		atexit(WriteTraceAtExit);
+
+	trace_filename = filename;
+	trace_pid = getpid();
+	trace_base = Now();
+	enabled_ = true;
+}
+
+uint64_t Trace::Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Trace::Record(const char* name, uint64_t start, uint64_t end) {
+	TraceBuffer* buffer = GetTraceBuffer();
+
+	Event& event = buffer->events[buffer->count % TRACE_BUFFER_EVENTS];
+	event.name = name;
+	event.start = start;
+	event.duration = (uint32_t)std::min(end - start, (uint64_t)0xffffffff);
+
+	buffer->count++;
+}
+
+void Trace::Write(const char* filename) {
+	/* forked processes would overwrite parent's trace */
+	std::string path = filename;
+	if (trace_pid != 0 && getpid() != trace_pid) {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+		path += suffix;
+	}
+
+	FILE* f = fopen(path.c_str(), "w");
+	if (f == NULL) {
+		fprintf(stderr, "Cannot write trace to %s\n", path.c_str());
+		return;
+	}
+
+	int pid = (int)getpid();
+	bool first = true;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (TraceBuffer* buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+				first ? "" : ",\n", pid, buffer->tid, buffer->tid);
+		first = false;
+
+		size_t count = buffer->count;
+		for (size_t i = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0; i < count; ++i) {
+			const Event& event = buffer->events[i % TRACE_BUFFER_EVENTS];
+			if (event.start < trace_base)
+				continue;
+
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%u}",
+					event.name, pid, buffer->tid, (unsigned long long)(event.start - trace_base), (unsigned int)event.duration);
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	fclose(f);
+}
+
+void Trace::Flush() {
+	if (enabled_)
+		Write(trace_filename.c_str());
+}
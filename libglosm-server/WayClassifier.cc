@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include <glosm/WayClassifier.hh>
+
+#include <glosm/GeometryOperations.hh>
+#include <glosm/geomath.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+static float GetMaxHeight(const OsmDatasource::Way& way) {
+	const char* tag;
+	strid_t building;
+
+	if ((tag = way.Tags.GetString(STR_BUILDING_PART_HEIGHT)) != NULL) {
+		/* building:part:height is topmost precedence (hack for Ostankino tower) */
+		return strtof(tag, NULL);
+	} else if ((tag = way.Tags.GetString(STR_HEIGHT)) != NULL) {
+		/* explicit height - topmost precedence in all other cases */
+		return strtof(tag, NULL);
+	} else if ((tag = way.Tags.GetString(STR_BUILDING_LEVELS)) != NULL) {
+		/* count level heights as 3 meters */
+		int levels = strtol(tag, NULL, 10);
+		float h = 3.0 * levels;
+
+		/* also add 1 meter for basement for short buildings
+		 * (except for garages which doesn't have one) - should work
+		 * well in rural areas */
+		if (levels == 1 && (building = way.Tags.Get(STR_BUILDING)) != STR_NONE && building != STR_GARAGES && building != STR_GARAGE)
+			h += 1.0;
+
+		return h;
+	}
+
+	return 0.0;
+}
+
+static float GetMinHeight(const OsmDatasource::Way& way) {
+	const char* tag;
+	const char* tag1;
+
+	if ((tag = way.Tags.GetString(STR_MIN_HEIGHT)) != NULL) {
+		/* explicit height - topmost precedence in all other cases */
+		return strtof(tag, NULL);
+	} else if ((tag = way.Tags.GetString(STR_BUILDING_MIN_LEVEL)) != NULL) {
+		/* count level heights as 3 meters */
+		float h = 3.0 * strtol(tag, NULL, 10);
+
+		/* in building:min_level scheme, levels are counted from zero, which may be fixed by building:ground_level... */
+		if ((tag1 = way.Tags.GetString(STR_BUILDING_GROUND_LEVEL)) != NULL)
+			h -= 3.0 * strtol(tag1, NULL, 10);
+
+		return h;
+	} else if ((tag = way.Tags.GetString(STR_BUILDING_SKIPPED_LEVELS)) != NULL) {
+		/* count level heights as 3 meters */
+		float h = 3.0 * strtol(tag, NULL, 10);
+
+		/* ...while in my proposal (building:skipped_levels) everythng just works */
+
+		return h;
+	}
+
+	return 0.0;
+}
+
+static int GetHighwayLanes(strid_t highway, const OsmDatasource::Way& way) {
+	const char* tag;
+	strid_t oneway_tag;
+
+	/* explicitely tagged lanes have top */
+	if ((tag = way.Tags.GetString(STR_LANES)) != NULL)
+		return strtol(tag, NULL, 10);
+
+	bool oneway = false;
+	if ((oneway_tag = way.Tags.Get(STR_ONEWAY)) != STR_NONE && oneway_tag != STR_NO)
+		oneway = true;
+
+	/* motorway assumes one-way */
+	if (highway == STR_MOTORWAY || highway == STR_MOTORWAY_LINK)
+		oneway = true;
+
+	if (highway == STR_SERVICE || highway == STR_TRACK) {
+		return 1;
+	} else if (highway == STR_RESIDENTIAL) {
+		return 2;
+	} else {
+		return oneway ? 2 : 4;
+	}
+}
+
+static float GetHighwayWidth(strid_t highway, const OsmDatasource::Way& way) {
+	const char* tag;
+
+	/* explicitely tagged lanes have top */
+	if ((tag = way.Tags.GetString(STR_WIDTH)) != NULL)
+		return strtof(tag, NULL);
+
+	if (highway == STR_PATH) {
+		return 0.5f;
+	} else if (highway == STR_FOOTWAY || highway == STR_STEPS) {
+		return 2.0f;
+	} else if (highway == STR_PEDESTRIAN) {
+		return 3.0f;
+	} else {
+		return GetHighwayLanes(highway, way) * 3.5f; /* likely 4 is closer to truth */
+	}
+}
+
+static bool IsMajorHighway(strid_t highway) {
+	return highway == STR_MOTORWAY || highway == STR_MOTORWAY_LINK ||
+		highway == STR_TRUNK || highway == STR_TRUNK_LINK ||
+		highway == STR_PRIMARY || highway == STR_PRIMARY_LINK ||
+		highway == STR_SECONDARY || highway == STR_SECONDARY_LINK ||
+		highway == STR_TERTIARY;
+}
+
+void ClassifyWay(OsmDatasource::Way& way) {
+	osmint_t minz = GetMinHeight(way) * GEOM_UNITSINMETER;
+	osmint_t maxz = GetMaxHeight(way) * GEOM_UNITSINMETER;
+
+	if (minz < 0)
+		minz = 0;
+	if (maxz < minz) {
+		fprintf(stderr, "warning: max height < min height for object\n");
+		maxz = minz = 0;
+	}
+
+	way.MinHeight = minz;
+	way.MaxHeight = maxz;
+	way.Width = 0.0f;
+
+	strid_t t, t1;
+
+	if ((way.Tags.Has(STR_BUILDING) || way.Tags.Has(STR_BUILDING_PART)) && minz != maxz) {
+		way.Class = OsmDatasource::Way::BUILDING;
+	} else if (((t = way.Tags.Get(STR_MAN_MADE)) == STR_TOWER || t == STR_CHIMNEY) && minz != maxz) {
+		way.Class = OsmDatasource::Way::TOWER;
+	} else if (way.Tags.Has(STR_BARRIER)) {
+		way.Class = OsmDatasource::Way::BARRIER;
+	} else if ((t = way.Tags.Get(STR_HIGHWAY)) != STR_NONE) {
+		bool major = IsMajorHighway(t);
+		if ((t1 = way.Tags.Get(STR_AREA)) != STR_NONE && t1 != STR_NO) {
+			way.Class = major ? OsmDatasource::Way::MAJOR_HIGHWAY_AREA : OsmDatasource::Way::HIGHWAY_AREA;
+		} else {
+			way.Class = major ? OsmDatasource::Way::MAJOR_HIGHWAY : OsmDatasource::Way::HIGHWAY;
+			way.Width = GetHighwayWidth(t, way);
+		}
+	} else if (way.Tags.Get(STR_RAILWAY) == STR_RAIL) {
+		way.Class = OsmDatasource::Way::RAILWAY;
+	} else if (way.Tags.Get(STR_BOUNDARY) == STR_ADMINISTRATIVE) {
+		way.Class = OsmDatasource::Way::BOUNDARY;
+	} else if (way.Tags.Has(STR_WATERWAY)) {
+		way.Class = OsmDatasource::Way::WATERWAY;
+	} else if (way.Tags.Has(STR_NATURAL)) {
+		way.Class = OsmDatasource::Way::NATURAL;
+	} else if (way.Tags.Has(STR_LANDUSE)) {
+		way.Class = OsmDatasource::Way::LANDUSE;
+	} else if (way.Tags.Get(STR_POWER) == STR_LINE) {
+		way.Class = OsmDatasource::Way::POWER_LINE;
+	} else {
+		way.Class = OsmDatasource::Way::OTHER;
+	}
+}
+
+bool IsGroundClass(OsmDatasource::Way::Class_t cls) {
+	return cls == OsmDatasource::Way::MAJOR_HIGHWAY || cls == OsmDatasource::Way::MAJOR_HIGHWAY_AREA ||
+		cls == OsmDatasource::Way::RAILWAY || cls == OsmDatasource::Way::BOUNDARY ||
+		cls == OsmDatasource::Way::WATERWAY || cls == OsmDatasource::Way::NATURAL ||
+		cls == OsmDatasource::Way::LANDUSE;
+}
+
+osmint_t GetWayTopHeight(const OsmDatasource::Way& way) {
+	double top = std::max(way.MinHeight, way.MaxHeight);
+
+	/* barriers without height are drawn 2 meters high */
+	if (way.Class == OsmDatasource::Way::BARRIER && way.MinHeight == way.MaxHeight)
+		top += 2 * GEOM_UNITSINMETER;
+
+	/* sloped roofs are drawn above building height; whatever
+	 * the shape, they don't rise more than slope times footprint
+	 * diagonal */
+	const char* tag;
+	if (way.Class == OsmDatasource::Way::BUILDING && way.Tags.Has(STR_ROOF_SHAPE) && !way.BBox.IsEmpty()) {
+		float slope = 30.0;
+		if ((tag = way.Tags.GetString(STR_ROOF_ANGLE)) != NULL)
+			slope = strtof(tag, NULL);
+		slope = std::max(0.0f, std::min(slope, 89.0f));
+
+		double diagonal = ToLocalMetric(Vector3i(way.BBox.GetTopRight(), 0), Vector3i(way.BBox.GetBottomLeft(), 0)).Length();
+		top += tan(slope / 180.0 * M_PI) * diagonal * GEOM_UNITSINMETER;
+	}
+
+	return std::min(top, (double)std::numeric_limits<osmint_t>::max());
+}
@@ -24,77 +24,154 @@
 #include <glosm/OsmDatasource.hh>
 #include <glosm/WayMerger.hh>
 
-WayMerger::WayMerger() {
+/* endpoint table is kept at most this full */
+static const size_t MAX_ENDPOINT_LOAD_PERCENT = 50;
+
+static inline size_t HashNodeId(osmid_t id, size_t mask) {
+	return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+WayMerger::WayMerger(int flags) : flags_(flags), indexed_chains_(0), next_start_(0) {
 }
 
 void WayMerger::AddWay(const OsmDatasource::Way::NodesList& nodes) {
-	way_by_node.insert(std::make_pair(nodes.front(), &nodes));
-	way_by_node_rev.insert(std::make_pair(nodes.back(), &nodes));
+	if (nodes.empty())
+		return;
+
+	Chain chain;
+	chain.nodes = &nodes;
+	chain.used = false;
+	chains_.push_back(chain);
 }
 
-bool WayMerger::GetNextWay(OsmDatasource::Way::NodesList& outnodes) {
-	OsmDatasource::Way::NodesList tempnodes;
-
-	std::back_insert_iterator<OsmDatasource::Way::NodesList> inserter(tempnodes);
-
-	const OsmDatasource::Way::NodesList* next_chain;
-	while (!way_by_node.empty()) {
-		if (tempnodes.empty()) {
-			/* no current nodes, add just any chain */
-			next_chain = PickChain();
-			assert(next_chain);
-			std::copy(next_chain->begin(), next_chain->end(), inserter);
-		} else {
-			/* find next chain, first try front map, then reverse */
-			if ((next_chain = PickChain(tempnodes.back())) != NULL) {
-				std::copy(++next_chain->begin(), next_chain->end(), inserter);
-			} else if ((next_chain = PickChain(tempnodes.back(), true)) != NULL) {
-				std::copy(++next_chain->rbegin(), next_chain->rend(), inserter);
-			} else {
-				/* no suitable next chain, drop partial way */
-				/* XXX: (or, we can return it if we need unclosed ways too */
-				tempnodes.clear();
-			}
-		}
+void WayMerger::AddWay(const OsmDatasource::Way& way) {
+	if (way.PackedNodes == NULL) {
+		AddWay(way.Nodes);
+		return;
+	}
+
+	unpacked_.push_back(OsmDatasource::Way::NodesList());
+	OsmDatasource::Way::NodesList& nodes = unpacked_.back();
+	nodes.reserve(way.PackedNodesCount);
+
+	OsmDatasource::Way::NodeIterator iterator(way);
+	osmid_t id;
+	while (iterator.Next(id))
+		nodes.push_back(id);
+
+	AddWay(nodes);
+}
 
-		/* check if we have complete cycle */
-		if (!tempnodes.empty() && tempnodes.front() == tempnodes.back()) {
-			outnodes.swap(tempnodes);
-			return true;
+void WayMerger::BuildIndex() {
+	size_t size = 16;
+	while (size * MAX_ENDPOINT_LOAD_PERCENT / 100 < chains_.size() * 2)
+		size *= 2;
+
+	Endpoint empty;
+	empty.id = 0;
+	empty.chain = 0;
+	empty.back = false;
+	endpoints_.assign(size, empty);
+
+	start_order_.clear();
+	for (unsigned int i = 0; i < chains_.size(); ++i) {
+		if (chains_[i].used)
+			continue;
+
+		for (int back = 0; back < 2; ++back) {
+			osmid_t id = back ? chains_[i].nodes->back() : chains_[i].nodes->front();
+			size_t slot = HashNodeId(id, size - 1);
+			while (endpoints_[slot].chain != 0)
+				slot = (slot + 1) & (size - 1);
+
+			endpoints_[slot].id = id;
+			endpoints_[slot].chain = i + 1;
+			endpoints_[slot].back = back;
 		}
+
+		start_order_.push_back(std::make_pair(chains_[i].nodes->front(), i));
 	}
 
-	return false;
+	std::sort(start_order_.begin(), start_order_.end());
+	next_start_ = 0;
+	indexed_chains_ = chains_.size();
 }
 
-const OsmDatasource::Way::NodesList* WayMerger::PickChain(osmid_t id, bool reverse) {
-	WayByTipMap& primary = reverse ? way_by_node_rev : way_by_node;
-	WayByTipMap& secondary = reverse ? way_by_node : way_by_node_rev;
+unsigned int WayMerger::FindChain(osmid_t id, bool back) const {
+	size_t mask = endpoints_.size() - 1;
+	unsigned int found = 0;
 
-	/* find chain starting with given id in primary map */
-	WayByTipMap::iterator primary_iterator = ((id == 0) ? primary.begin() : primary.find(id));
-	if (primary_iterator == primary.end())
-		return NULL;
+	/* used chains stay in the table, so they are just skipped */
+	for (size_t slot = HashNodeId(id, mask); endpoints_[slot].chain != 0; slot = (slot + 1) & mask) {
+		const Endpoint& endpoint = endpoints_[slot];
+		if (endpoint.id == id && endpoint.back == back && !chains_[endpoint.chain - 1].used && (found == 0 || endpoint.chain < found))
+			found = endpoint.chain;
+	}
 
-	/* save chain poiter which we will return */
-	const OsmDatasource::Way::NodesList* ret = primary_iterator->second;
+	return found;
+}
 
-	/* find the same chain in the other map */
-	std::pair<WayByTipMap::iterator, WayByTipMap::iterator> range =
-		secondary.equal_range(reverse ? ret->front() : ret->back());
+bool WayMerger::GetNextWay(OsmDatasource::Way::NodesList& outnodes) {
+	if (indexed_chains_ != chains_.size())
+		BuildIndex();
+
+	while (true) {
+		/* start with unused chain with lowest first node */
+		while (next_start_ < start_order_.size() && chains_[start_order_[next_start_].second].used)
+			++next_start_;
+		if (next_start_ == start_order_.size())
+			return false;
+
+		unsigned int start = start_order_[next_start_].second;
+		chains_[start].used = true;
+
+		sequence_.clear();
+		ChainRef ref;
+		ref.chain = start;
+		ref.reverse = false;
+		sequence_.push_back(ref);
+
+		osmid_t first = chains_[start].nodes->front();
+		osmid_t last = chains_[start].nodes->back();
+		size_t total = chains_[start].nodes->size();
+
+		/* follow chains, first trying ones starting at current
+		 * end, then reversed ones ending at it */
+		while (first != last) {
+			unsigned int next = FindChain(last, false);
+			ref.reverse = false;
+			if (next == 0) {
+				next = FindChain(last, true);
+				ref.reverse = true;
+			}
+			if (next == 0)
+				break;
 
-	WayByTipMap::iterator secondary_iterator;
-	for (secondary_iterator = range.first; secondary_iterator != range.second; ++secondary_iterator) {
-		if (secondary_iterator->second == ret) {
-			break;
-		}
-	}
+			ref.chain = next - 1;
+			chains_[ref.chain].used = true;
+			sequence_.push_back(ref);
 
-	assert(secondary_iterator != range.second);
+			const OsmDatasource::Way::NodesList& nodes = *chains_[ref.chain].nodes;
+			last = ref.reverse ? nodes.front() : nodes.back();
+			total += nodes.size() - 1;
+		}
 
-	/* delete chain references from both maps */
-	secondary.erase(secondary_iterator);
-	primary.erase(primary_iterator);
+		/* partial ways are dropped unless requested */
+		if (first != last && !(flags_ & UNCLOSED_WAYS))
+			continue;
+
+		outnodes.clear();
+		outnodes.reserve(total);
+		for (ChainRefVector::const_iterator i = sequence_.begin(); i != sequence_.end(); ++i) {
+			const OsmDatasource::Way::NodesList& nodes = *chains_[i->chain].nodes;
+			/* first node of each next chain repeats last one */
+			size_t skip = (i == sequence_.begin()) ? 0 : 1;
+			if (i->reverse)
+				outnodes.insert(outnodes.end(), nodes.rbegin() + skip, nodes.rend());
+			else
+				outnodes.insert(outnodes.end(), nodes.begin() + skip, nodes.end());
+		}
 
-	return ret;
+		return true;
+	}
 }
@@ -19,12 +19,298 @@
  */
 
 #include <glosm/XMLParser.hh>
+#include <glosm/InputStream.hh>
+#include <glosm/Trace.hh>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <expat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <strings.h>
 
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Ring of input buffers filled by a separate reader thread
+ *
+ * Decompression, if any, happens on the reader thread too.
+ */
+class XMLReadAhead {
+protected:
+	static const int NUM_BUFFERS = 4;
+	static const size_t BUFFER_SIZE = 1024 * 1024;
+
+	InputStream& input_;
+
+	std::vector<char> buffers_[NUM_BUFFERS];
+	ssize_t lengths_[NUM_BUFFERS];
+	std::string error_;
+	int head_;
+	int count_;
+	bool stop_;
+
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+	pthread_t thread_;
+	bool running_;
+
+protected:
+	static void* ReaderThread(void* arg) {
+		static_cast<XMLReadAhead*>(arg)->Run();
+		return NULL;
+	}
+
+	void Run() {
+		pthread_mutex_lock(&mutex_);
+		while (!stop_) {
+			if (count_ == NUM_BUFFERS) {
+				pthread_cond_wait(&cond_, &mutex_);
+				continue;
+			}
+
+			int slot = (head_ + count_) % NUM_BUFFERS;
+			pthread_mutex_unlock(&mutex_);
+
+			/* buffer is not touched by consumer until count_ is increased */
+			ssize_t len;
+			std::string error;
+			try {
+				len = input_.Read(&buffers_[slot][0], BUFFER_SIZE);
+			} catch (std::exception& e) {
+				len = -1;
+				error = e.what();
+			}
+
+			pthread_mutex_lock(&mutex_);
+			lengths_[slot] = len;
+			if (len < 0)
+				error_ = error;
+			count_++;
+			pthread_cond_broadcast(&cond_);
+
+			if (len <= 0)
+				break;
+		}
+		pthread_mutex_unlock(&mutex_);
+	}
+
+public:
+	XMLReadAhead(InputStream& input) : input_(input), head_(0), count_(0), stop_(false), running_(false) {
+		for (int i = 0; i < NUM_BUFFERS; ++i)
+			buffers_[i].resize(BUFFER_SIZE);
+
+		pthread_mutex_init(&mutex_, NULL);
+		pthread_cond_init(&cond_, NULL);
+
+		if (pthread_create(&thread_, NULL, ReaderThread, this) != 0) {
+			pthread_cond_destroy(&cond_);
+			pthread_mutex_destroy(&mutex_);
+			throw SystemError() << "cannot create reader thread";
+		}
+		running_ = true;
+	}
+
+	~XMLReadAhead() {
+		pthread_mutex_lock(&mutex_);
+		stop_ = true;
+		pthread_cond_broadcast(&cond_);
+		pthread_mutex_unlock(&mutex_);
+
+		if (running_)
+			pthread_join(thread_, NULL);
+
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	/**
+	 * Waits for next filled buffer
+	 *
+	 * The buffer stays valid until Release() is called.
+	 *
+	 * @return number of bytes in buffer, 0 on end of file
+	 */
+	ssize_t Acquire(const char*& data) {
+		pthread_mutex_lock(&mutex_);
+		while (count_ == 0)
+			pthread_cond_wait(&cond_, &mutex_);
+		ssize_t len = lengths_[head_];
+		std::string error = error_;
+		data = &buffers_[head_][0];
+		pthread_mutex_unlock(&mutex_);
+
+		if (len < 0)
+			throw Exception() << error;
+
+		return len;
+	}
+
+	/**
+	 * Returns buffer obtained with Acquire() to the reader
+	 */
+	void Release() {
+		pthread_mutex_lock(&mutex_);
+		head_ = (head_ + 1) % NUM_BUFFERS;
+		count_--;
+		pthread_cond_broadcast(&cond_);
+		pthread_mutex_unlock(&mutex_);
+	}
+};
+
+/**
+ * Read-only mapping of a whole file, unmapped on destruction
+ */
+struct XMLMappedFile {
+	int fd;
+	void* data;
+	size_t size;
+
+	XMLMappedFile() : fd(-1), data(MAP_FAILED), size(0) {
+	}
+
+	~XMLMappedFile() {
+		if (data != MAP_FAILED)
+			munmap(data, size);
+		if (fd != -1)
+			close(fd);
+	}
+};
+
+static inline bool IsXMLSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline bool IsXMLNameEnd(char c) {
+	return IsXMLSpace(c) || c == '/' || c == '>' || c == '=';
+}
+
+/**
+ * Finds first occurence of a string in a buffer
+ */
+static const char* XMLFind(const char* begin, const char* end, const char* str) {
+	size_t len = strlen(str);
+	for (const char* cur = begin; end - cur >= (ptrdiff_t)len; ++cur) {
+		if ((cur = (const char*)memchr(cur, str[0], end - cur - len + 1)) == NULL)
+			return NULL;
+		if (memcmp(cur, str, len) == 0)
+			return cur;
+	}
+	return NULL;
+}
+
+/**
+ * Checks that encoding given in XML declaration is UTF-8 or its subset
+ */
+static bool IsXMLEncodingSupported(const char* begin, const char* end) {
+	static const char encoding[] = "encoding";
+	const char* pos = XMLFind(begin, end, encoding);
+	if (pos == NULL)
+		return true;
+
+	for (pos += sizeof(encoding) - 1; pos < end && (IsXMLSpace(*pos) || *pos == '='); ++pos) {
+	}
+	if (pos == end)
+		return false;
+
+	const char* value = pos + 1;
+	const char* quote = (const char*)memchr(value, *pos, end - value);
+	if (quote == NULL)
+		return false;
+
+	return (quote - value == 5 && strncasecmp(value, "utf-8", 5) == 0) || (quote - value == 8 && strncasecmp(value, "us-ascii", 8) == 0);
+}
+
+static void AppendUTF8(std::vector<char>& out, unsigned long code) {
+	if (code < 0x80) {
+		out.push_back(code);
+	} else if (code < 0x800) {
+		out.push_back(0xc0 | (code >> 6));
+		out.push_back(0x80 | (code & 0x3f));
+	} else if (code < 0x10000) {
+		out.push_back(0xe0 | (code >> 12));
+		out.push_back(0x80 | ((code >> 6) & 0x3f));
+		out.push_back(0x80 | (code & 0x3f));
+	} else {
+		out.push_back(0xf0 | (code >> 18));
+		out.push_back(0x80 | ((code >> 12) & 0x3f));
+		out.push_back(0x80 | ((code >> 6) & 0x3f));
+		out.push_back(0x80 | (code & 0x3f));
+	}
+}
+
+/**
+ * Appends attribute value, resolving character and predefined
+ * entity references and normalizing whitespace like XML does
+ *
+ * @return false on bad reference
+ */
+static bool XMLDecodeValue(const char* begin, const char* end, std::vector<char>& out) {
+	const char* run = begin;
+	for (const char* cur = begin; cur < end; ++cur) {
+		char c = *cur;
+		if (c != '&' && c != '\t' && c != '\n' && c != '\r')
+			continue;
+
+		out.insert(out.end(), run, cur);
+
+		if (c == '&') {
+			const char* ref = cur + 1;
+			const char* semicolon = (const char*)memchr(ref, ';', end - ref);
+			if (semicolon == NULL)
+				return false;
+
+			size_t len = semicolon - ref;
+			if (len == 2 && memcmp(ref, "lt", 2) == 0) {
+				out.push_back('<');
+			} else if (len == 2 && memcmp(ref, "gt", 2) == 0) {
+				out.push_back('>');
+			} else if (len == 3 && memcmp(ref, "amp", 3) == 0) {
+				out.push_back('&');
+			} else if (len == 4 && memcmp(ref, "quot", 4) == 0) {
+				out.push_back('"');
+			} else if (len == 4 && memcmp(ref, "apos", 4) == 0) {
+				out.push_back('\'');
+			} else if (len >= 2 && ref[0] == '#') {
+				char* endptr;
+				unsigned long code = (ref[1] == 'x') ? strtoul(ref + 2, &endptr, 16) : strtoul(ref + 1, &endptr, 10);
+				if (endptr != semicolon || code == 0 || code > 0x10ffff)
+					return false;
+				AppendUTF8(out, code);
+			} else {
+				return false;
+			}
+
+			cur = semicolon;
+		} else {
+			/* \r\n is a single line break */
+			if (c == '\r' && cur + 1 < end && cur[1] == '\n')
+				++cur;
+			out.push_back(' ');
+		}
+
+		run = cur + 1;
+	}
+
+	out.insert(out.end(), run, end);
+	return true;
+}
+
+/**
+ * Calculates line and column of a position, for error messages
+ */
+static void XMLScanPosition(const char* data, const char* pos, int& line, int& column) {
+	const char* linestart = data;
+	line = 1;
+	for (const char* nl; (nl = (const char*)memchr(linestart, '\n', pos - linestart)) != NULL; linestart = nl + 1)
+		line++;
+	column = pos - linestart;
+}
 
 XMLParser::XMLParser(int flags) : flags_(flags) {
 }
@@ -53,7 +339,209 @@ void XMLParser::EndElement(const char* /*unused*/) {
 void XMLParser::CharacterData(const char* /*unused*/, int /*unused*/) {
 }
 
+bool XMLParser::Scan(const char* data, size_t size) {
+	const char* cur = data;
+	const char* end = data + size;
+
+	/* name and attributes of current tag, decoded and
+	 * nul-terminated, and their offsets in buffer */
+	std::vector<char> buffer;
+	std::vector<size_t> offsets;
+	std::vector<const char*> atts;
+
+	/* names of open elements */
+	std::vector<char> open;
+	std::vector<size_t> open_offsets;
+
+	bool started = false;
+
+	try {
+		while (cur < end) {
+			/* text between tags is not needed, so just skip to next tag */
+			const char* lt = (const char*)memchr(cur, '<', end - cur);
+			if (lt == NULL)
+				break;
+
+			if ((cur = lt + 1) == end)
+				throw ParsingException() << "unclosed token";
+
+			if (*cur == '?') {
+				const char* close = XMLFind(cur, end, "?>");
+				if (close == NULL)
+					throw ParsingException() << "unclosed token";
+				if (!started && !IsXMLEncodingSupported(cur, close))
+					return false;
+				cur = close + 2;
+			} else if (*cur == '!') {
+				if (end - cur >= 3 && cur[1] == '-' && cur[2] == '-') {
+					const char* close = XMLFind(cur + 3, end, "-->");
+					if (close == NULL)
+						throw ParsingException() << "unclosed token";
+					cur = close + 3;
+				} else if (!started) {
+					/* DTD, let expat handle it */
+					return false;
+				} else {
+					throw ParsingException() << "unsupported markup";
+				}
+			} else if (*cur == '/') {
+				const char* name = ++cur;
+				while (cur < end && !IsXMLNameEnd(*cur))
+					++cur;
+				size_t len = cur - name;
+				while (cur < end && IsXMLSpace(*cur))
+					++cur;
+				if (cur == end || *cur != '>')
+					throw ParsingException() << "not well-formed";
+				++cur;
+
+				if (open_offsets.empty())
+					throw ParsingException() << "junk after document element";
+				size_t top = open_offsets.back();
+				if (open.size() - top - 1 != len || memcmp(&open[top], name, len) != 0)
+					throw ParsingException() << "mismatched tag";
+
+				if (flags_ & HANDLE_ELEMENTS)
+					EndElement(&open[top]);
+
+				open.resize(top);
+				open_offsets.pop_back();
+			} else {
+				buffer.clear();
+				offsets.clear();
+
+				const char* name = cur;
+				while (cur < end && !IsXMLNameEnd(*cur))
+					++cur;
+				if (cur == name)
+					throw ParsingException() << "not well-formed";
+				buffer.insert(buffer.end(), name, cur);
+				buffer.push_back('\0');
+				size_t name_size = buffer.size();
+
+				bool empty = false;
+				while (true) {
+					while (cur < end && IsXMLSpace(*cur))
+						++cur;
+					if (cur == end)
+						throw ParsingException() << "unclosed token";
+
+					if (*cur == '>') {
+						++cur;
+						break;
+					} else if (*cur == '/') {
+						if (++cur == end || *cur != '>')
+							throw ParsingException() << "not well-formed";
+						++cur;
+						empty = true;
+						break;
+					}
+
+					const char* att = cur;
+					while (cur < end && !IsXMLNameEnd(*cur))
+						++cur;
+					if (cur == att)
+						throw ParsingException() << "not well-formed";
+					offsets.push_back(buffer.size());
+					buffer.insert(buffer.end(), att, cur);
+					buffer.push_back('\0');
+
+					while (cur < end && IsXMLSpace(*cur))
+						++cur;
+					if (cur == end || *cur != '=')
+						throw ParsingException() << "not well-formed";
+					++cur;
+					while (cur < end && IsXMLSpace(*cur))
+						++cur;
+					if (cur == end || (*cur != '"' && *cur != '\''))
+						throw ParsingException() << "not well-formed";
+
+					const char* value = cur + 1;
+					const char* quote = (const char*)memchr(value, *cur, end - value);
+					if (quote == NULL)
+						throw ParsingException() << "unclosed token";
+
+					offsets.push_back(buffer.size());
+					if (!XMLDecodeValue(value, quote, buffer))
+						throw ParsingException() << "undefined entity";
+					buffer.push_back('\0');
+
+					cur = quote + 1;
+				}
+
+				/* buffer is not touched anymore, so pointers are stable */
+				atts.clear();
+				for (std::vector<size_t>::const_iterator i = offsets.begin(); i != offsets.end(); ++i)
+					atts.push_back(&buffer[*i]);
+				atts.push_back(NULL);
+
+				started = true;
+
+				if (flags_ & HANDLE_ELEMENTS)
+					StartElement(&buffer[0], &atts[0]);
+
+				if (empty) {
+					if (flags_ & HANDLE_ELEMENTS)
+						EndElement(&buffer[0]);
+				} else {
+					open_offsets.push_back(open.size());
+					open.insert(open.end(), buffer.begin(), buffer.begin() + name_size);
+				}
+			}
+		}
+
+		if (!started)
+			throw ParsingException() << "no element found";
+		if (!open_offsets.empty())
+			throw ParsingException() << "unclosed token";
+	} catch (ParsingException &e) {
+		int line, column;
+		XMLScanPosition(data, cur, line, column);
+
+		ParsingException verbose;
+		verbose << "input parsing error: " << e.what() << " at line " << line << " pos " << column;
+		throw verbose;
+	}
+
+	return true;
+}
+
+bool XMLParser::LoadScanned(const char* filename) {
+	XMLMappedFile file;
+	if ((file.fd = open(filename, O_RDONLY)) == -1)
+		throw SystemError() << "cannot open input file";
+
+	struct stat st;
+	if (fstat(file.fd, &st) != 0)
+		throw SystemError() << "cannot stat input file";
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return false;
+
+	file.size = st.st_size;
+	if ((file.data = mmap(NULL, file.size, PROT_READ, MAP_SHARED, file.fd, 0)) == MAP_FAILED)
+		return false;
+
+	madvise(file.data, file.size, MADV_SEQUENTIAL);
+
+	/* compressed files don't start with markup (after optional
+	 * BOM and whitespace), and are left for InputStream */
+	const char* data = static_cast<const char*>(file.data);
+	size_t start = (file.size >= 3 && memcmp(data, "\xef\xbb\xbf", 3) == 0) ? 3 : 0;
+	while (start < file.size && IsXMLSpace(data[start]))
+		++start;
+	if (start == file.size || data[start] != '<')
+		return false;
+
+	return Scan(data, file.size);
+}
+
 void XMLParser::Load(const char* filename) {
+	TRACE_SCOPE("XMLParser::Load");
+
+	if ((flags_ & FAST_SCAN) && !(flags_ & HANDLE_CHARDATA) && strcmp(filename, "-") != 0 && LoadScanned(filename))
+		return;
+
 	int f = 0;
 	XML_Parser parser = NULL;
 
@@ -76,14 +564,27 @@ void XMLParser::Load(const char* filename) {
 
 	/* Parse file */
 	try {
-		char buf[65536];
-		ssize_t len;
-		do {
-			if ((len = read(f, buf, sizeof(buf))) < 0)
-				throw SystemError() << "input read error";
-			if (XML_Parse(parser, buf, len, len == 0) == XML_STATUS_ERROR)
-				throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
-		} while (len != 0);
+		std::auto_ptr<InputStream> input(InputStream::Create(f));
+
+		if (flags_ & READ_AHEAD) {
+			XMLReadAhead reader(*input);
+			const char* buf;
+			ssize_t len;
+			do {
+				len = reader.Acquire(buf);
+				if (XML_Parse(parser, buf, len, len == 0) == XML_STATUS_ERROR)
+					throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
+				reader.Release();
+			} while (len != 0);
+		} else {
+			char buf[65536];
+			size_t len;
+			do {
+				len = input->Read(buf, sizeof(buf));
+				if (XML_Parse(parser, buf, len, len == 0) == XML_STATUS_ERROR)
+					throw ParsingException() << XML_ErrorString(XML_GetErrorCode(parser));
+			} while (len != 0);
+		}
 	} catch (ParsingException &e) {
 		ParsingException verbose;
 		verbose << "input parsing error: " << e.what() << " at line " << XML_GetCurrentLineNumber(parser) << " pos " << XML_GetCurrentColumnNumber(parser);
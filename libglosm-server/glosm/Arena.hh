@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_HH
+#define ARENA_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Bump allocator for long-lived data of a datasource.
+ *
+ * Memory is handed out sequentially from large chunks which are
+ * never relocated, and is only released all at once by Clear(),
+ * so there's no per-object malloc overhead, no fragmentation and
+ * freeing millions of objects is a matter of few free() calls.
+ *
+ * Only suitable for plain data which needs no destructor.
+ */
+class Arena : private NonCopyable {
+protected:
+	static const size_t CHUNK_SIZE = 1024 * 1024;
+
+protected:
+	std::vector<char*> chunks_;
+	char* current_;
+	size_t left_;
+	size_t used_;
+	size_t allocated_;
+
+public:
+	Arena();
+	~Arena();
+
+	/**
+	 * Allocates a block of memory aligned for any plain type
+	 */
+	void* Allocate(size_t size);
+
+	/**
+	 * Allocates a copy of array of plain objects
+	 */
+	template <class T>
+	T* Copy(const T* data, size_t count) {
+		T* ret = static_cast<T*>(Allocate(sizeof(T) * count));
+		for (size_t i = 0; i < count; ++i)
+			ret[i] = data[i];
+		return ret;
+	}
+
+	/**
+	 * Returns number of bytes handed out
+	 */
+	size_t GetUsedBytes() const;
+
+	/**
+	 * Returns number of bytes allocated from the system
+	 */
+	size_t GetAllocatedBytes() const;
+
+	/**
+	 * Frees all memory at once
+	 *
+	 * All pointers previously returned by the arena become invalid.
+	 */
+	void Clear();
+};
+
+#endif
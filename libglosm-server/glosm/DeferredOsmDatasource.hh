@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEFERREDOSMDATASOURCE_HH
+#define DEFERREDOSMDATASOURCE_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+/**
+ * OpenStreetMap datasource which is published after it's created
+ *
+ * This stands for a datasource which is still being loaded in
+ * another thread, so its users may be set up and used right away.
+ * Until Publish() is called, there are no ways, and requests for
+ * objects by id throw DataException. After that, all requests are
+ * forwarded to published datasource.
+ *
+ * Geometry generated before publishing is empty, so caches of it
+ * are to be invalidated once IsPublished() becomes true.
+ */
+class DeferredOsmDatasource : public OsmDatasource, private NonCopyable {
+protected:
+	mutable pthread_mutex_t mutex_;
+
+	/* protected by mutex_ */
+	const OsmDatasource* target_;
+
+protected:
+	/**
+	 * Returns published datasource, or NULL if there's none yet
+	 */
+	const OsmDatasource* GetTarget() const;
+
+public:
+	DeferredOsmDatasource();
+	virtual ~DeferredOsmDatasource();
+
+	/**
+	 * Makes loaded datasource available to users
+	 *
+	 * May be called from any thread, once. Datasource must stay
+	 * alive as long as this object is used, and must not be
+	 * modified after publishing.
+	 */
+	void Publish(const OsmDatasource& target);
+
+	/**
+	 * Checks whether datasource was published
+	 */
+	bool IsPublished() const;
+
+public:
+	virtual const Node& GetNode(osmid_t id) const;
+	virtual const Way& GetWay(osmid_t id) const;
+	virtual const Relation& GetRelation(osmid_t id) const;
+
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+	virtual void GetOverviewWays(std::vector<const Way*>& out, const BBoxi& bbox, int level) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+	virtual osmint_t GetMaxHeight() const;
+};
+
+#endif
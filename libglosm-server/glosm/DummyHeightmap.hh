@@ -33,6 +33,7 @@ public:
 
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const;
 	virtual osmint_t GetHeight(const Vector2i& where) const;
+	virtual void GetHeights(const Vector2i* points, size_t count, osmint_t* out) const;
 };
 
 #endif
@@ -32,6 +32,21 @@
 class GPXDatasource {
 public:
 	virtual void GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Returns track polylines simplified for a given tile level
+	 *
+	 * Each track segment belongs to the bbox its first point is
+	 * in, and runs of consecutive segments are returned as single
+	 * polylines. Last point of a polyline may thus be outside
+	 * bbox; all other points are inside.
+	 *
+	 * @param points receives points of all polylines
+	 * @param lengths receives number of points in each polyline
+	 * @param bbox bounding box
+	 * @param level tile level
+	 */
+	virtual void GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int level) const = 0;
 };
 
 #endif
@@ -45,11 +45,36 @@
  * area currently are quads (~10x more quads than triangles). Changing
  * quads to triangle pairs is 12% more geometry generation time, 20%
  * less fps and more memory, so for now they're quite useful.
+ *
+ * Apart from primitives, geometry may contain instances, which
+ * place copies of shared models (see Model) instead of storing
+ * all their vertices.
  */
 class Geometry {
 public:
 	typedef std::vector<Vector3i> VertexVector;
 	typedef std::vector<int> LengthVector;
+	typedef std::vector<unsigned int> IndexVector;
+
+	/**
+	 * Placement of a shared model
+	 */
+	struct Instance {
+		/* see Model::Id */
+		int model;
+		Vector3i pos;
+		/* horizontal unit vector of model X axis, east and north */
+		Vector2f direction;
+
+		Instance(int m, const Vector3i& p, const Vector2f& d) : model(m), pos(p), direction(d) {
+		}
+
+		bool operator==(const Instance& other) const {
+			return model == other.model && pos == other.pos && direction == other.direction;
+		}
+	};
+
+	typedef std::vector<Instance> InstanceVector;
 
 protected:
 	VertexVector lines_vertices_;
@@ -58,6 +83,8 @@ protected:
 	VertexVector convex_vertices_;
 	LengthVector convex_lengths_;
 
+	InstanceVector instances_;
+
 public:
 	Geometry();
 
@@ -73,20 +100,107 @@ public:
 	void StartConvex();
 	void AppendConvex(const Vector3i& v);
 
+	/**
+	 * Places a shared model
+	 *
+	 * @param model see Model::Id
+	 * @param pos position of model origin
+	 * @param direction horizontal unit vector of model X axis
+	 */
+	void AddInstance(int model, const Vector3i& pos, const Vector2f& direction);
+
+	/**
+	 * Removes all primitives and instances
+	 *
+	 * Allocated storage is kept, so geometry may be reused
+	 * without reallocations.
+	 */
+	void Clear();
+
+	/**
+	 * Preallocates storage for given number of vertices and
+	 * primitives in total
+	 */
+	void Reserve(size_t lines_vertices, size_t lines, size_t convex_vertices, size_t convexes);
+
 	const VertexVector& GetLinesVertices() const;
 	const LengthVector& GetLinesLengths() const;
 
 	const VertexVector& GetConvexVertices() const;
 	const LengthVector& GetConvexLengths() const;
 
+	const InstanceVector& GetInstances() const;
+
+	/**
+	 * Builds single indexed triangle list for convex polygons
+	 *
+	 * Indices refer to GetConvexVertices(). Polygons are added
+	 * while their vertices fit into a given limit.
+	 *
+	 * @param indices vector to append indices to
+	 * @param max_vertices limit on number of vertices used
+	 * @return number of vertices used
+	 */
+	size_t GetConvexTriangles(IndexVector& indices, size_t max_vertices = (size_t)-1) const;
+
+	/**
+	 * Builds single indexed triangle strip for convex polygons
+	 *
+	 * Each polygon is triangulated in zigzag order, and polygons
+	 * are joined with degenerate triangles; winding is kept.
+	 * This needs fewer indices than triangle list for polygons
+	 * with 5 or more vertices, but more for triangles.
+	 *
+	 * @see GetConvexTriangles
+	 */
+	size_t GetConvexStrip(IndexVector& indices, size_t max_vertices = (size_t)-1) const;
+
 	void Append(const Geometry& other);
+	/**
+	 * Appends primitives cropped by bbox
+	 *
+	 * Instances are not cropped, they're appended if their
+	 * position is within bbox; right and top edges are not
+	 * included, so an instance is not shared by adjacent tiles.
+	 */
 	void AppendCropped(const Geometry& other, const BBoxi& bbox);
 
+	/**
+	 * Crops primitives by bbox in place
+	 *
+	 * Same as AppendCropped() into empty geometry, but storage
+	 * is reused and primitives within bbox are not copied.
+	 */
+	void Crop(const BBoxi& bbox);
+
+	/**
+	 * Appends primitives cropped by bbox, consuming other geometry
+	 *
+	 * If this geometry is empty, other is cropped in place and
+	 * its storage is taken over, so nothing is copied. Other
+	 * geometry is left empty.
+	 */
+	void MoveCropped(Geometry& other, const BBoxi& bbox);
+
+	/**
+	 * Exchanges contents with other geometry in constant time
+	 */
+	void Swap(Geometry& other);
+
 	void AddCroppedConvex(const Vector3i* v, unsigned int size, const BBoxi& bbox);
 	void AddCroppedLine(const Vector3i* v, unsigned int size, const BBoxi& bbox);
 
-	void Serialize() const;
-	void DeSerialize();
+	/**
+	 * Appends compact binary representation of geometry to a buffer
+	 */
+	void Serialize(std::vector<unsigned char>& out) const;
+
+	/**
+	 * Replaces geometry with one stored by Serialize()
+	 *
+	 * @throw Exception if data is malformed
+	 */
+	void DeSerialize(const unsigned char* data, size_t size);
 };
 
 #endif
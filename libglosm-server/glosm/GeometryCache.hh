@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GEOMETRYCACHE_HH
+#define GEOMETRYCACHE_HH
+
+#include <glosm/GeometryDatasource.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+#include <list>
+#include <map>
+
+/**
+ * Caching proxy for another GeometryDatasource.
+ *
+ * Keeps recently generated geometry keyed by requested bbox and
+ * flags (which for tiles is the same as (level, x, y, flags)), so
+ * tiles dropped by TileManager may be recreated without running
+ * GeometryGenerator again. Least recently used geometry is evicted
+ * when cache grows over its size limit.
+ *
+ * Safe to use from multiple threads.
+ */
+class GeometryCache : public GeometryDatasource, private NonCopyable {
+protected:
+	struct Key {
+		BBoxi bbox;
+		int flags;
+
+		Key(const BBoxi& b, int f) : bbox(b), flags(f) {
+		}
+
+		bool operator<(const Key& other) const {
+			if (flags != other.flags)
+				return flags < other.flags;
+			if (bbox.left != other.bbox.left)
+				return bbox.left < other.bbox.left;
+			if (bbox.bottom != other.bbox.bottom)
+				return bbox.bottom < other.bbox.bottom;
+			if (bbox.right != other.bbox.right)
+				return bbox.right < other.bbox.right;
+			return bbox.top < other.bbox.top;
+		}
+	};
+
+	typedef std::list<Key> LruList;
+
+	struct Entry {
+		Geometry geometry;
+		size_t size;
+		LruList::iterator lru;
+	};
+
+	typedef std::map<Key, Entry> EntryMap;
+
+protected:
+	const GeometryDatasource& source_;
+
+	mutable pthread_mutex_t mutex_;
+	/* protected by mutex_ */
+	mutable EntryMap entries_;
+	mutable LruList lru_; /* most recently used first */
+	mutable size_t size_;
+	mutable size_t hits_;
+	mutable size_t misses_;
+	size_t size_limit_;
+	/* incremented by Clear() and Invalidate(), so geometry
+	 * generated before them is not cached */
+	unsigned int generation_;
+	/* /protected by mutex_ */
+
+protected:
+	/**
+	 * Drops least recently used entries until cache fits the limit
+	 */
+	void Evict() const;
+
+public:
+	/**
+	 * Constructs cache
+	 *
+	 * @param source datasource to take geometry from
+	 * @param size_limit max size of cached geometry in bytes
+	 */
+	GeometryCache(const GeometryDatasource& source, size_t size_limit);
+
+	virtual ~GeometryCache();
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags = 0) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+
+	/**
+	 * Sets max size of cached geometry in bytes
+	 */
+	void SetSizeLimit(size_t limit);
+
+	/**
+	 * Drops all cached geometry
+	 */
+	void Clear();
+
+	/**
+	 * Drops cached geometry for bboxes intersecting given one
+	 *
+	 * Used when source data in that area has changed. Geometry
+	 * being generated at the time of the call is not cached.
+	 */
+	void Invalidate(const BBoxi& bbox);
+
+	/**
+	 * Returns size of cached geometry in bytes
+	 */
+	size_t GetSize() const;
+
+	/**
+	 * Returns number of requests served from cache
+	 */
+	size_t GetHits() const;
+
+	/**
+	 * Returns number of requests passed to the source
+	 */
+	size_t GetMisses() const;
+};
+
+#endif
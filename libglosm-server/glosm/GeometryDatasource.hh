@@ -24,8 +24,54 @@
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
 
+#include <cstddef>
+
 class Geometry;
 
+/**
+ * Handle of asynchronous geometry request
+ *
+ * Destroying handle before Wait() cancels the request.
+ *
+ * @see GeometryDatasource::Submit()
+ */
+class GeometryRequest {
+public:
+	/**
+	 * Receiver of request completion notices
+	 */
+	class Callback {
+	public:
+		virtual ~Callback() {}
+
+		/**
+		 * Called when request becomes ready
+		 *
+		 * Called from arbitrary thread with no datasource locks
+		 * held; requests of the datasource must not be destroyed
+		 * from here.
+		 */
+		virtual void OnRequestReady() = 0;
+	};
+
+public:
+	virtual ~GeometryRequest() {}
+
+	/**
+	 * Checks whether Wait() won't block waiting for data
+	 */
+	virtual bool IsReady() const = 0;
+
+	/**
+	 * Waits for request and appends its geometry
+	 *
+	 * May only be called once.
+	 *
+	 * @throw Exception if geometry could not be produced
+	 */
+	virtual void Wait(Geometry& geometry) = 0;
+};
+
 /**
  * Abstract base class for all Geometry sources including Geometry
  * generators.
@@ -37,11 +83,29 @@ public:
 		DETAIL = 0x2,
 
 		EVERYTHING = 0x3,
+
+		/* drop vertices which are not distinguishable at
+		 * requested bbox scale; meant for low zoom tiles */
+		SIMPLIFY = 0x4,
 	};
 
 public:
 	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags = 0) const = 0;
 
+	/**
+	 * Starts asynchronous geometry request
+	 *
+	 * Default implementation suits sources which do all work
+	 * in calling thread: request is ready from the start and
+	 * Wait() just calls GetGeometry(). Sources waiting for I/O
+	 * override this, so many requests may be kept in flight.
+	 *
+	 * @param callback notified when request becomes ready, may
+	 *        be NULL; not called for requests ready from start
+	 * @return request handle, owned by caller
+	 */
+	virtual GeometryRequest* Submit(const BBoxi& bbox, int flags = 0, GeometryRequest::Callback* callback = NULL) const;
+
 	/** Returns the center of available area */
 	virtual Vector2i GetCenter() const {
 		return Vector2i(0, 0);
@@ -53,4 +117,30 @@ public:
 	}
 };
 
+/**
+ * Request which builds geometry in Wait(), see GeometryDatasource::Submit()
+ */
+class DeferredGeometryRequest : public GeometryRequest {
+protected:
+	const GeometryDatasource& datasource_;
+	BBoxi bbox_;
+	int flags_;
+
+public:
+	DeferredGeometryRequest(const GeometryDatasource& datasource, const BBoxi& bbox, int flags) : datasource_(datasource), bbox_(bbox), flags_(flags) {
+	}
+
+	virtual bool IsReady() const {
+		return true;
+	}
+
+	virtual void Wait(Geometry& geometry) {
+		datasource_.GetGeometry(geometry, bbox_, flags_);
+	}
+};
+
+inline GeometryRequest* GeometryDatasource::Submit(const BBoxi& bbox, int flags, GeometryRequest::Callback* /*unused*/) const {
+	return new DeferredGeometryRequest(*this, bbox, flags);
+}
+
 #endif
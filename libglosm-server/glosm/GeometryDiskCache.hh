@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GEOMETRYDISKCACHE_HH
+#define GEOMETRYDISKCACHE_HH
+
+#include <glosm/GeometryDatasource.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+/**
+ * Persistent caching proxy for another GeometryDatasource.
+ *
+ * Stores geometry produced by the source in a directory, one
+ * file per requested (bbox, flags) pair, in Geometry::Serialize()
+ * format. Files are also keyed by dataset id, so cache directory
+ * may be shared between different datasets, and cache from
+ * previous run of viewer or tiler is reused only if it was built
+ * from the same data.
+ *
+ * Cache is best effort: unreadable or corrupt files are treated
+ * as misses and failures to write cache are ignored. Files are
+ * written under temporary name and atomically renamed, so
+ * concurrent processes may share a directory.
+ *
+ * Safe to use from multiple threads.
+ */
+class GeometryDiskCache : public GeometryDatasource, private NonCopyable {
+protected:
+	static const char MAGIC[8];
+	static const uint32_t VERSION = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		int32_t flags;
+		uint64_t dataset_hash;
+		int32_t bbox[4]; /* left, bottom, right, top */
+	};
+
+protected:
+	const GeometryDatasource& source_;
+	std::string directory_;
+	uint64_t dataset_hash_;
+
+	mutable pthread_mutex_t mutex_;
+	/* protected by mutex_ */
+	mutable size_t hits_;
+	mutable size_t misses_;
+	/* /protected by mutex_ */
+
+protected:
+	void MakeHeader(Header& header, const BBoxi& bbox, int flags) const;
+	std::string GetPath(const Header& header) const;
+
+	bool Load(Geometry& geometry, const std::string& path, const Header& header) const;
+	void Store(const Geometry& geometry, const std::string& path, const Header& header) const;
+
+public:
+	/**
+	 * Constructs cache
+	 *
+	 * @param source datasource to take geometry from
+	 * @param directory directory to store cache files in, must exist
+	 * @param dataset_id string identifying source data, see GetFileId()
+	 */
+	GeometryDiskCache(const GeometryDatasource& source, const char* directory, const std::string& dataset_id);
+
+	virtual ~GeometryDiskCache();
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags = 0) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+
+	/**
+	 * Returns number of requests served from disk
+	 */
+	size_t GetHits() const;
+
+	/**
+	 * Returns number of requests passed to the source
+	 */
+	size_t GetMisses() const;
+
+	/**
+	 * Returns dataset id for a file made of its path, size and
+	 * modification time, or empty string if file can't be stat'ed
+	 */
+	static std::string GetFileId(const char* path);
+};
+
+#endif
@@ -24,6 +24,8 @@
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
 
+#include <vector>
+
 /**
  * Intersect segment with horizontal line
  *
@@ -111,4 +113,35 @@ Vector3i FromLocalMetric(const Vector3d& what, const Vector3i& ref);
 
 float ApproxDistanceSquare(const BBoxi& bbox, const Vector3i& vec);
 
+/**
+ * Returns tolerance for simplifying geometry of area of given width
+ *
+ * That is about half a pixel if area is rendered as 256 pixel
+ * tile, rounded down to power of two so all tiles of a level
+ * share it.
+ *
+ * @param width area width in geometry units
+ * @return tolerance, or 0 if no simplification is needed
+ */
+osmint_t GetSimplifyTolerance(osmlong_t width);
+
+/**
+ * Simplifies polyline with Douglas-Peucker algorithm
+ *
+ * Longitude is scaled by cosine of latitude, so tolerance is the
+ * same in all directions when viewed in mercator projection. First
+ * and last vertices are always kept, so closed ways stay closed.
+ *
+ * @param vertices polyline, simplified in place
+ * @param tolerance max allowed deviation, in longitude units
+ */
+void SimplifyPolyline(std::vector<Vector2i>& vertices, osmint_t tolerance);
+
+/**
+ * Simplifies 3D polyline with Douglas-Peucker algorithm
+ *
+ * Same as above, deviation is only measured in horizontal plane.
+ */
+void SimplifyPolyline(std::vector<Vector3i>& vertices, osmint_t tolerance);
+
 #endif
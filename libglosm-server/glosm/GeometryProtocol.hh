@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef GEOMETRYPROTOCOL_HH
+#define GEOMETRYPROTOCOL_HH
+
+#include <glosm/BBox.hh>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Wire protocol of glosm geometry server.
+ *
+ * Both directions of a connection are streams of messages, each
+ * being a 9 byte header (payload length, type, request id) followed
+ * by payload. All integers are little endian.
+ *
+ * Server greets client with HELLO describing served data. Client
+ * may then send any number of REQUESTs without waiting for
+ * replies; server processes them concurrently and answers each
+ * with GEOMETRY or FAILURE carrying the same id, in no particular
+ * order. CANCEL tells server that reply to a request is no longer
+ * needed; cancelled requests not yet processed are dropped, and
+ * no reply is sent for them.
+ */
+class GeometryProtocol {
+public:
+	static const uint32_t MAGIC = 0x53474c47; /* "GLGS" */
+	static const uint32_t VERSION = 1;
+
+	/* sanity limit for incoming messages */
+	static const uint32_t MAX_PAYLOAD = 256*1024*1024;
+
+	/* size of message header on the wire */
+	static const size_t HEADER_SIZE = 9;
+
+	/* port used if address doesn't specify one */
+	static const int DEFAULT_PORT = 8231;
+
+	enum MessageType {
+		/* server: magic, version, bbox[4], center[2], max height */
+		HELLO = 1,
+
+		/* client: bbox[4], flags */
+		REQUEST = 2,
+
+		/* client: no payload */
+		CANCEL = 3,
+
+		/* server: Geometry::Serialize() data */
+		GEOMETRY = 4,
+
+		/* server: error message text */
+		FAILURE = 5,
+	};
+
+	struct Message {
+		int type;
+		uint32_t id;
+		std::vector<unsigned char> payload;
+
+		Message() : type(0), id(0) {
+		}
+	};
+
+	/**
+	 * Sequential reader of message payload
+	 */
+	class PayloadReader {
+	protected:
+		const Message& message_;
+		size_t offset_;
+
+	public:
+		PayloadReader(const Message& message);
+
+		/**
+		 * Reads next integer
+		 *
+		 * @throw Exception if payload is too short
+		 */
+		uint32_t GetUInt();
+		int32_t GetInt();
+	};
+
+public:
+	/**
+	 * Appends little endian integer to payload
+	 */
+	static void PutInt(std::vector<unsigned char>& payload, uint32_t value);
+
+	/**
+	 * Appends bbox to payload
+	 */
+	static void PutBBox(std::vector<unsigned char>& payload, const BBoxi& bbox);
+
+	/**
+	 * Writes a complete message to socket
+	 *
+	 * Concurrent writers must be serialized by caller.
+	 *
+	 * @throw SystemError on write failure
+	 */
+	static void Write(int fd, int type, uint32_t id, const std::vector<unsigned char>& payload);
+
+	/**
+	 * Reads a complete message from socket
+	 *
+	 * @return false on clean end of stream before message start
+	 * @throw Exception on failure, truncated or oversized message
+	 */
+	static bool Read(int fd, Message& message);
+
+	/**
+	 * Connects to server
+	 *
+	 * @param address either [host:]port, or path to unix socket
+	 *        (anything containing a slash)
+	 * @return connected socket
+	 */
+	static int Connect(const char* address);
+
+	/**
+	 * Creates listening socket
+	 *
+	 * @param address same as for Connect(); without host, listens
+	 *        on loopback only, and host * means all addresses
+	 * @return listening socket
+	 */
+	static int Listen(const char* address);
+};
+
+#endif
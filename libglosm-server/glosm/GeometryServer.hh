@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef GEOMETRYSERVER_HH
+#define GEOMETRYSERVER_HH
+
+#include <glosm/BBox.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+class GeometryDatasource;
+
+/**
+ * Serves geometry of a GeometryDatasource over GeometryProtocol.
+ *
+ * Requests of all connections are put into single queue and
+ * processed by a shared pool of threads, so many clients don't
+ * multiply thread count, and one client with many pipelined
+ * requests still loads all threads. Replies are sent as soon as
+ * they are ready.
+ *
+ * @see RemoteGeometryDatasource
+ */
+class GeometryServer : private NonCopyable {
+public:
+	/**
+	 * Requests a connection may have queued; client which sends
+	 * more is disconnected
+	 */
+	static const int MAX_QUEUED_REQUESTS = 1024;
+
+	/**
+	 * Runtime statistics, see GetStatistics()
+	 */
+	struct Statistics {
+		unsigned int connections;
+		unsigned int requests;
+
+		/* cancelled before processing, and after it */
+		unsigned int cancelled;
+		unsigned int discarded;
+
+		unsigned int failed;
+		uint64_t bytes_sent;
+	};
+
+protected:
+	struct Connection;
+
+	/**
+	 * Queued request of a connection
+	 */
+	struct Task {
+		Connection* connection;
+		uint32_t id;
+		BBoxi bbox;
+		int flags;
+	};
+
+	typedef std::deque<Task> TaskQueue;
+
+protected:
+	const GeometryDatasource& source_;
+	osmint_t max_height_;
+
+	std::vector<pthread_t> threads_;
+
+	mutable pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+	/* protected by mutex_ */
+	TaskQueue queue_;
+	bool stopping_;
+	Statistics stats_;
+	/* /protected by mutex_ */
+
+protected:
+	/**
+	 * Stops and joins worker threads
+	 */
+	void StopThreads();
+
+	/**
+	 * Processes queued tasks until server is destroyed
+	 */
+	void ProcessTasks();
+
+	static void* WorkerThread(void* arg);
+	static void* ConnectionThread(void* arg);
+
+	/**
+	 * Drops request from the queue or marks it as cancelled if
+	 * it's already being processed
+	 */
+	void CancelTask(Connection& connection, uint32_t id);
+
+public:
+	/**
+	 * Constructs server and starts worker threads
+	 *
+	 * @param source datasource to take geometry from
+	 * @param max_height maximal height of objects, passed to clients
+	 * @param nthreads number of worker threads; 0 means number of CPUs
+	 */
+	GeometryServer(const GeometryDatasource& source, osmint_t max_height, int nthreads = 0);
+
+	/**
+	 * Destructor; must not be called while connections are served
+	 */
+	~GeometryServer();
+
+	/**
+	 * Serves single client until it disconnects
+	 *
+	 * Socket is not closed.
+	 *
+	 * @throw Exception if client violates protocol or connection fails
+	 */
+	void Serve(int fd);
+
+	/**
+	 * Accepts connections and serves each in its own thread
+	 *
+	 * Returns only on failure.
+	 *
+	 * @param listen_fd socket from GeometryProtocol::Listen()
+	 */
+	void Run(int listen_fd);
+
+	/**
+	 * Returns number of worker threads
+	 */
+	int GetThreads() const;
+
+	void GetStatistics(Statistics& stats) const;
+};
+
+#endif
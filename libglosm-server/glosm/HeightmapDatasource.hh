@@ -46,6 +46,21 @@ public:
 
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const = 0;
 	virtual osmint_t GetHeight(const Vector2i& where) const = 0;
+
+	/**
+	 * Returns heights for a number of points at once
+	 *
+	 * Default implementation just calls GetHeight() for each
+	 * point; datasources may do it more efficiently.
+	 *
+	 * @param points points to get heights for
+	 * @param count number of points
+	 * @param out array to store count heights into
+	 */
+	virtual void GetHeights(const Vector2i* points, size_t count, osmint_t* out) const {
+		for (size_t i = 0; i < count; ++i)
+			out[i] = GetHeight(points[i]);
+	}
 };
 
 #endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INPUTSTREAM_HH
+#define INPUTSTREAM_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <cstddef>
+
+/**
+ * Sequential input from a file descriptor
+ *
+ * Compressed input (gzip, bzip2, zstd) is detected by magic
+ * bytes and transparently decompressed.
+ */
+class InputStream : private NonCopyable {
+public:
+	virtual ~InputStream();
+
+	/**
+	 * Reads up to size bytes of (decompressed) data
+	 *
+	 * @return number of bytes read, 0 on end of input
+	 */
+	virtual size_t Read(char* buf, size_t size) = 0;
+
+	/**
+	 * Creates stream for a given file descriptor
+	 *
+	 * Descriptor is not closed by the stream.
+	 */
+	static InputStream* Create(int fd);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MMAPOSMDATASOURCE_HH
+#define MMAPOSMDATASOURCE_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/OsmSnapshot.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <vector>
+
+/**
+ * Source of OpenStreetMap data backed by mmap'ed binary snapshot
+ *
+ * Snapshot is produced by PreloadedXmlDatasource::WriteSnapshot().
+ * Opening it takes almost no time, as data is not parsed but used
+ * in place: only pages touched by requests are read from disk,
+ * and they're shared between processes through page cache.
+ *
+ * Way objects are created on first request and kept until
+ * datasource is destroyed; their coordinates are not copied but
+ * point into mapped file, see OsmDatasource::Way::StoredCoords.
+ * Ways are created without locking, so concurrent requests don't
+ * wait for each other. Snapshots store inline coordinates only,
+ * so GetNode() and GetRelation() are not available.
+ */
+class MmapOsmDatasource : public OsmDatasource, private NonCopyable {
+protected:
+	int fd_;
+	void* data_;
+	size_t size_;
+
+	const OsmSnapshot::Header* header_;
+	const OsmSnapshot::Way* ways_;
+	const Vector2i* coords_;
+	const OsmSnapshot::Tag* tags_;
+	const uint32_t* rings_;
+	const OsmSnapshot::Index::Item* index_items_;
+	const OsmSnapshot::Index::Node* index_nodes_;
+
+	/* snapshot string index -> global strid_t */
+	std::vector<strid_t> string_map_;
+
+	BBoxi bbox_;
+	osmint_t max_height_;
+
+	/* ways created so far, by index in snapshot; slots are
+	 * filled once with compare-and-swap, and never change
+	 * until Clear() */
+	mutable std::vector<Way*> ways_cache_;
+
+protected:
+	/**
+	 * Returns way by index in snapshot, creating it if needed
+	 *
+	 * Thread which loses the race to fill the slot drops its
+	 * way and uses the one already there.
+	 */
+	const Way* GetWayByIndex(uint32_t index) const;
+
+	/**
+	 * Checks that section lies within mapped file
+	 */
+	void CheckSection(uint64_t offset, uint64_t count, size_t size) const;
+
+public:
+	/**
+	 * Constructs empty datasource
+	 */
+	MmapOsmDatasource();
+
+	/**
+	 * Destructor
+	 */
+	virtual ~MmapOsmDatasource();
+
+	/**
+	 * Maps snapshot file into memory
+	 *
+	 * @param filename path to snapshot file
+	 */
+	void Load(const char* filename);
+
+	/**
+	 * Unmaps snapshot and drops all ways created from it
+	 */
+	void Clear();
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+	virtual osmint_t GetMaxHeight() const;
+
+public:
+	virtual const Node& GetNode(osmid_t id) const;
+	virtual const Way& GetWay(osmid_t id) const;
+	virtual const Relation& GetRelation(osmid_t id) const;
+
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MODEL_HH
+#define MODEL_HH
+
+#include <glosm/Math.hh>
+
+#include <vector>
+
+/**
+ * Shared 3D model placed by Geometry instances
+ *
+ * Repeated objects like power towers are described once as a
+ * model, and geometry only stores their placements, see
+ * Geometry::AddInstance(). Models are built in local metric
+ * coordinates: X axis goes along instance direction, Y axis
+ * to the left of it, Z axis up, and origin is at instance
+ * position.
+ */
+class Model {
+public:
+	/**
+	 * Builtin models
+	 */
+	enum Id {
+		POWER_TOWER = 0,
+		TREE,
+		STREET_LAMP,
+		MAST,
+		NUM_MODELS,
+	};
+
+	typedef std::vector<Vector3f> VertexVector;
+	typedef std::vector<int> LengthVector;
+
+protected:
+	VertexVector lines_vertices_;
+	LengthVector lines_lengths_;
+
+	VertexVector convex_vertices_;
+	LengthVector convex_lengths_;
+
+	float min_height_;
+	float max_height_;
+
+protected:
+	void AddLine(const Vector3f& a, const Vector3f& b);
+	void AddTriangle(const Vector3f& a, const Vector3f& b, const Vector3f& c);
+	void AddQuad(const Vector3f& a, const Vector3f& b, const Vector3f& c, const Vector3f& d);
+
+	/* sides of square frustum centered on Z axis, given half-widths of its bases */
+	void AddFrustum(float bottom_width, float top_width, float bottom, float top);
+
+	/* sides of square pyramid with base at given height; apex may be below it */
+	void AddPyramid(float width, float base, float apex);
+
+	void BuildPowerTower();
+	void BuildTree();
+	void BuildStreetLamp();
+	void BuildMast();
+
+public:
+	/**
+	 * Builds builtin model
+	 */
+	Model(Id id);
+
+	/**
+	 * Returns builtin model
+	 *
+	 * @throw Exception if there's no such model
+	 */
+	static const Model& Get(int id);
+
+	/**
+	 * Checks whether there's builtin model with given id
+	 */
+	static bool IsValid(int id) {
+		return id >= 0 && id < NUM_MODELS;
+	}
+
+	const VertexVector& GetLinesVertices() const;
+	const LengthVector& GetLinesLengths() const;
+
+	const VertexVector& GetConvexVertices() const;
+	const LengthVector& GetConvexLengths() const;
+
+	/**
+	 * Returns lowest point of model, in meters
+	 */
+	float GetMinHeight() const;
+
+	/**
+	 * Returns highest point of model, in meters
+	 */
+	float GetMaxHeight() const;
+};
+
+#endif
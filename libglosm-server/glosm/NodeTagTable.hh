@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NODETAGTABLE_HH
+#define NODETAGTABLE_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/SpatialIndex.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <map>
+#include <vector>
+
+/**
+ * Compact side table of tags of OSM nodes.
+ *
+ * Most nodes only carry way geometry and have no tags, so instead
+ * of keeping tags for every node, only tagged ones are stored in
+ * a flat array sorted by id, which is searched with binary search.
+ * Identical tag sets (e.g. natural=tree) are stored once and
+ * shared, so memory is proportional to the number of tagged nodes
+ * rather than to the size of the dump.
+ *
+ * Node positions are kept as well, as nodes themselves may be
+ * dropped after loading, and a spatial index over them is built
+ * for bbox queries.
+ *
+ * Nodes are collected with Add(), and lookups are only valid
+ * after Build(), which may be repeated after more nodes are added.
+ */
+class NodeTagTable : private NonCopyable {
+public:
+	typedef OsmDatasource::TaggedNode TaggedNode;
+
+protected:
+	typedef TagList::Tag Tag;
+	typedef std::vector<Tag> TagVector;
+
+	struct Entry {
+		osmid_t id;
+		Vector2i pos;
+		unsigned int first_tag;
+		unsigned int ntags;
+	};
+
+	struct EntryIdLess {
+		bool operator()(const Entry& a, const Entry& b) const {
+			return a.id < b.id;
+		}
+		bool operator()(const Entry& a, osmid_t b) const {
+			return a.id < b;
+		}
+	};
+
+	typedef std::vector<Entry> EntryVector;
+
+	/* offsets of distinct tag sets in tags_, used while adding */
+	typedef std::map<TagVector, unsigned int> TagSetMap;
+
+	typedef SpatialIndex<unsigned int> EntriesIndex;
+
+protected:
+	EntryVector entries_;
+	TagVector tags_;
+	TagSetMap tag_sets_;
+	EntriesIndex index_;
+
+protected:
+	void Fill(const Entry& entry, TaggedNode& out) const;
+
+public:
+	NodeTagTable();
+
+	/**
+	 * Adds or replaces tags of a node
+	 *
+	 * Node with empty tags is removed from the table on Build().
+	 * If a node is added more than once, last one wins.
+	 */
+	void Add(osmid_t id, const Vector2i& pos, const TagList& tags);
+
+	/**
+	 * Sorts added nodes and builds spatial index
+	 */
+	void Build();
+
+	/**
+	 * Finds tags of a node
+	 *
+	 * @return false if node has no tags
+	 */
+	bool Find(osmid_t id, TaggedNode& out) const;
+
+	/**
+	 * Appends tagged nodes within given bbox
+	 *
+	 * Tag pointers stay valid until the table is modified.
+	 */
+	void Query(std::vector<TaggedNode>& out, const BBoxi& bbox) const;
+
+	/**
+	 * Returns number of tagged nodes
+	 */
+	size_t size() const;
+
+	/**
+	 * Returns number of tags in shared pool
+	 */
+	size_t GetTagsCount() const;
+
+	/**
+	 * Returns approximate memory taken by the table, in bytes
+	 */
+	size_t GetMemoryUsage() const;
+
+	/**
+	 * Drops all nodes
+	 */
+	void Clear();
+};
+
+#endif
@@ -21,12 +21,20 @@
 #ifndef OSMDATASOURCE_HH
 #define OSMDATASOURCE_HH
 
+#include <glosm/Exception.hh>
 #include <glosm/Math.hh>
 #include <glosm/BBox.hh>
+#include <glosm/TagList.hh>
 
+#include <limits>
 #include <string>
 #include <vector>
-#include <map>
+
+/**
+ * Excepion that denotes inconsistent OSM data
+ */
+class DataException : public Exception {
+};
 
 /**
  * Abstract base class for sources of OpenStreetMap data.
@@ -36,7 +44,7 @@
  */
 class OsmDatasource {
 public:
-	typedef std::map<std::string, std::string> TagsMap;
+	typedef TagList TagsMap;
 
 public:
 	struct Node {
@@ -48,17 +56,133 @@ public:
 
 	struct Way {
 		typedef std::vector<osmid_t> NodesList;
+		typedef std::vector<Vector2i> CoordsList;
+
+		/** Render class, precomputed from tags by ClassifyWay() */
+		enum Class_t {
+			OTHER,
+			BUILDING,
+			TOWER,
+			BARRIER,
+			HIGHWAY,
+			HIGHWAY_AREA,
+			MAJOR_HIGHWAY,
+			MAJOR_HIGHWAY_AREA,
+			RAILWAY,
+			BOUNDARY,
+			WATERWAY,
+			NATURAL,
+			LANDUSE,
+			POWER_LINE,
+		};
 
 		NodesList Nodes;
 
+		/* node refs packed as zigzag varint deltas; only filled by
+		 * datasources which store them compactly, in which case
+		 * Nodes is empty. Use NodeIterator to read either form */
+		const unsigned char* PackedNodes;
+		unsigned int PackedNodesCount;
+
+		/* node coordinates; only filled by datasources which
+		 * store them inline, in which case Nodes may be empty */
+		CoordsList Coords;
+
+		/* node coordinates kept in datasource storage, such as
+		 * mapped snapshot; only filled by datasources which
+		 * store them so, in which case Coords is empty. Use
+		 * GetCoordsBegin() and GetCoordsEnd() to read either form */
+		const Vector2i* StoredCoords;
+		unsigned int StoredCoordsCount;
+
+		/* ring sizes for areas with holes: node refs (and coords)
+		 * of outer ring are followed by inner rings, each closed;
+		 * empty for ordinary ways */
+		std::vector<unsigned int> Rings;
+
 		TagsMap Tags;
 		bool Closed;
 		bool Clockwise;
 
 		BBoxi BBox;
 
-		Way() : Closed(false), Clockwise(false), BBox(BBoxi::Empty()) {
+		/* render attributes; heights are in geometry units */
+		Class_t Class;
+		osmint_t MinHeight;
+		osmint_t MaxHeight;
+		float Width;
+
+		Way() : PackedNodes(NULL), PackedNodesCount(0), StoredCoords(NULL), StoredCoordsCount(0), Closed(false), Clockwise(false), BBox(BBoxi::Empty()), Class(OTHER), MinHeight(0), MaxHeight(0), Width(0.0f) {
 		}
+
+		/**
+		 * Returns number of node refs, in either form
+		 */
+		size_t GetNodesCount() const {
+			return PackedNodes ? PackedNodesCount : Nodes.size();
+		}
+
+		/**
+		 * Returns number of inline coordinates, in either form
+		 */
+		size_t GetCoordsCount() const {
+			return StoredCoords ? StoredCoordsCount : Coords.size();
+		}
+
+		/**
+		 * Returns range of inline coordinates, in either form
+		 */
+		const Vector2i* GetCoordsBegin() const {
+			if (StoredCoords)
+				return StoredCoords;
+			return Coords.empty() ? NULL : &Coords[0];
+		}
+
+		const Vector2i* GetCoordsEnd() const {
+			return GetCoordsBegin() + GetCoordsCount();
+		}
+
+		/**
+		 * Forward iterator over node refs of a way, plain or packed
+		 */
+		class NodeIterator {
+		protected:
+			const osmid_t* plain_;
+			const unsigned char* packed_;
+			size_t left_;
+			osmid_t last_;
+
+		public:
+			NodeIterator(const Way& way) : plain_(way.Nodes.empty() ? NULL : &way.Nodes[0]), packed_(way.PackedNodes), left_(way.GetNodesCount()), last_(0) {
+			}
+
+			/**
+			 * Fetches next node ref
+			 *
+			 * @return false if there are no more refs
+			 */
+			bool Next(osmid_t& id) {
+				if (left_ == 0)
+					return false;
+				--left_;
+
+				if (packed_ == NULL) {
+					id = *plain_++;
+					return true;
+				}
+
+				uint64_t zigzag = 0;
+				int shift = 0;
+				do {
+					zigzag |= (uint64_t)(*packed_ & 0x7f) << shift;
+					shift += 7;
+				} while (*packed_++ & 0x80);
+
+				last_ += (osmid_t)(zigzag >> 1) ^ -(osmid_t)(zigzag & 1);
+				id = last_;
+				return true;
+			}
+		};
 	};
 
 	struct Relation {
@@ -72,9 +196,9 @@ public:
 			} Type;
 
 			osmid_t Ref;
-			std::string Role;
+			strid_t Role;
 
-			Member(Type_t type, osmid_t ref, const char* role): Type(type), Ref(ref), Role(role) {}
+			Member(Type_t type, osmid_t ref, const char* role): Type(type), Ref(ref), Role(StringTable::Instance().Intern(role)) {}
 		};
 
 		typedef std::vector<Member> MemberList;
@@ -83,7 +207,34 @@ public:
 		TagsMap Tags;
 	};
 
+	/**
+	 * Node which has tags, e.g. a tree or a street lamp
+	 *
+	 * Tags point into datasource storage, which may be shared
+	 * by many nodes with identical tags.
+	 */
+	struct TaggedNode {
+		osmid_t Id;
+		Vector2i Pos;
+		const TagList::Tag* Tags;
+		unsigned int TagsCount;
+
+		TaggedNode() : Id(0), Tags(NULL), TagsCount(0) {}
+
+		/**
+		 * Returns value id for a given key, or STR_NONE if tag is absent
+		 */
+		strid_t Get(strid_t key) const {
+			for (unsigned int i = 0; i < TagsCount && Tags[i].first <= key; ++i)
+				if (Tags[i].first == key)
+					return Tags[i].second;
+			return STR_NONE;
+		}
+	};
+
 public:
+	virtual ~OsmDatasource() {}
+
 	/** Returns node by its id */
 	virtual const Node& GetNode(osmid_t id) const = 0;
 
@@ -94,7 +245,51 @@ public:
 	virtual const Relation& GetRelation(osmid_t id) const = 0;
 
 	/* multiple - object accessors subject to change */
-	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Appends pointers to all ways intersecting given bbox
+	 *
+	 * Pointers stay valid as long as datasource is alive
+	 * and its data is not reloaded.
+	 */
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const = 0;
+
+	/**
+	 * Appends pointers to ways intersecting given bbox which are
+	 * worth drawing as ground geometry at given tile level
+	 *
+	 * Datasources may keep generalized overview layers for low
+	 * levels, with only ways of ground classes (see IsGroundClass())
+	 * large enough to be visible, and with simplified geometry.
+	 * By default, all ways are returned.
+	 */
+	virtual void GetOverviewWays(std::vector<const Way*>& out, const BBoxi& bbox, int /*level*/) const {
+		GetWays(out, bbox);
+	}
+
+	/**
+	 * Appends copies of all ways intersecting given bbox
+	 *
+	 * @deprecated copies every way with its nodes and tags;
+	 *             use pointer version instead
+	 */
+	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const {
+		std::vector<const Way*> found;
+		GetWays(found, bbox);
+
+		out.reserve(out.size() + found.size());
+		for (std::vector<const Way*>::const_iterator i = found.begin(); i != found.end(); ++i)
+			out.push_back(**i);
+	}
+
+	/**
+	 * Appends tagged nodes within given bbox
+	 *
+	 * Untagged nodes are never returned. Datasources which don't
+	 * keep node tags return nothing, which is the default.
+	 */
+	virtual void GetTaggedNodes(std::vector<TaggedNode>& /*out*/, const BBoxi& /*bbox*/) const {
+	}
 
 	/** Returns center of available area */
 	virtual Vector2i GetCenter() const {
@@ -105,6 +300,20 @@ public:
 	virtual BBoxi GetBBox() const {
 		return BBoxi::ForEarth();
 	}
+
+	/**
+	 * Returns upper bound of heights of objects, including
+	 * roofs, in geometry units
+	 *
+	 * Viewers may use it to find out how far outside of the
+	 * view objects may be and still be visible in it. By
+	 * default, heights are not known and are not bounded.
+	 *
+	 * @see GetWayTopHeight()
+	 */
+	virtual osmint_t GetMaxHeight() const {
+		return std::numeric_limits<osmint_t>::max();
+	}
 };
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OSMSNAPSHOT_HH
+#define OSMSNAPSHOT_HH
+
+#include <glosm/OsmDatasource.hh>
+#include <glosm/SpatialIndex.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <stdint.h>
+
+#include <vector>
+
+/**
+ * On-disk layout of binary OSM snapshot
+ *
+ * Snapshot is a header followed by flat arrays of fixed-size
+ * records, each aligned to 8 bytes, so it may be used in place
+ * after mmap(). Data is stored in native byte order, so snapshots
+ * are not portable between architectures.
+ *
+ * Ways are sorted by id and refer to ranges of coords, tags and
+ * rings arrays; tags refer to strings by index in string table.
+ * Rings are sizes of outer and inner rings of areas with holes,
+ * see OsmDatasource::Way::Rings. Spatial index is a SpatialIndex
+ * dump with way indexes as values.
+ */
+struct OsmSnapshot {
+	static const char MAGIC[8];
+	static const uint32_t VERSION = 3;
+
+	typedef SpatialIndex<uint32_t> Index;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		int32_t max_height; /* see OsmDatasource::GetMaxHeight() */
+
+		int32_t bbox[4]; /* left, bottom, right, top */
+
+		uint64_t nways;
+		uint64_t ncoords;
+		uint64_t ntags;
+		uint64_t nrings;
+		uint64_t nstrings;
+		uint64_t strings_size;
+		uint64_t nindex_items;
+		uint64_t nindex_nodes;
+		uint64_t nindex_leaves;
+
+		uint64_t ways_offset;
+		uint64_t coords_offset;
+		uint64_t tags_offset;
+		uint64_t rings_offset;
+		uint64_t string_offsets_offset;
+		uint64_t strings_offset;
+		uint64_t index_items_offset;
+		uint64_t index_nodes_offset;
+	};
+
+	struct Way {
+		int64_t id;
+		uint64_t first_coord;
+		uint64_t first_tag;
+		uint64_t first_ring;
+		uint32_t ncoords;
+		uint32_t ntags;
+		uint32_t nrings;
+		int32_t bbox[4];
+		uint8_t closed;
+		uint8_t clockwise;
+		uint8_t reserved[2];
+	};
+
+	struct Tag {
+		uint32_t key;
+		uint32_t value;
+	};
+};
+
+/**
+ * Collects ways and writes them into OSM snapshot file
+ */
+class OsmSnapshotWriter : private NonCopyable {
+protected:
+	std::vector<OsmSnapshot::Way> ways_;
+	std::vector<Vector2i> coords_;
+	std::vector<OsmSnapshot::Tag> tags_;
+	std::vector<uint32_t> rings_;
+
+	/* local string table; global strid_t -> local index */
+	std::vector<uint32_t> string_map_;
+	std::vector<strid_t> strings_;
+
+	BBoxi bbox_;
+	osmint_t max_height_;
+
+protected:
+	uint32_t MapString(strid_t id);
+
+public:
+	OsmSnapshotWriter();
+
+	/**
+	 * Sets bounding box stored in snapshot
+	 */
+	void SetBBox(const BBoxi& bbox);
+
+	/**
+	 * Adds a way
+	 *
+	 * @param id way id
+	 * @param way way data
+	 * @param coords coordinates of way nodes
+	 */
+	void AddWay(osmid_t id, const OsmDatasource::Way& way, const OsmDatasource::Way::CoordsList& coords);
+
+	/**
+	 * Writes all added data into a file
+	 */
+	void Write(const char* filename);
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLELTASKS_HH
+#define PARALLELTASKS_HH
+
+#include <glosm/Exception.hh>
+
+#include <pthread.h>
+
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace Private {
+	template <class T>
+	struct ParallelTask {
+		void (*func)(T&);
+		T* task;
+		bool failed;
+		std::string error;
+	};
+
+	template <class T>
+	void* RunParallelTask(void* arg) {
+		ParallelTask<T>& slot = *static_cast<ParallelTask<T>*>(arg);
+		try {
+			slot.func(*slot.task);
+		} catch (std::exception& e) {
+			slot.failed = true;
+			slot.error = e.what();
+		} catch (...) {
+			slot.failed = true;
+			slot.error = "unknown exception";
+		}
+		return NULL;
+	}
+};
+
+/**
+ * Calls func for each of ntasks tasks, each on its own thread
+ *
+ * First task is run on calling thread; if thread creation
+ * fails, remaining tasks are run there as well. Returns after
+ * all tasks are done. Exceptions thrown by func are caught on
+ * the thread they're thrown on, and message of the first one
+ * in task order is rethrown as Exception.
+ */
+template <class T>
+void RunParallel(T* tasks, size_t ntasks, void (*func)(T&)) {
+	if (ntasks == 0)
+		return;
+
+	std::vector<Private::ParallelTask<T> > slots(ntasks);
+	for (size_t i = 0; i < ntasks; ++i) {
+		slots[i].func = func;
+		slots[i].task = &tasks[i];
+		slots[i].failed = false;
+	}
+
+	std::vector<pthread_t> threads(ntasks);
+	size_t started = 1;
+	for (; started < ntasks; ++started)
+		if (pthread_create(&threads[started], NULL, Private::RunParallelTask<T>, &slots[started]) != 0)
+			break;
+
+	Private::RunParallelTask<T>(&slots[0]);
+	for (size_t i = started; i < ntasks; ++i)
+		Private::RunParallelTask<T>(&slots[i]);
+
+	for (size_t i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < ntasks; ++i)
+		if (slots[i].failed)
+			throw Exception() << slots[i].error;
+}
+
+/**
+ * Calls func for each task of a vector, see above
+ */
+template <class T>
+void RunParallel(std::vector<T>& tasks, void (*func)(T&)) {
+	if (!tasks.empty())
+		RunParallel(&tasks[0], tasks.size(), func);
+}
+
+#endif
@@ -24,21 +24,73 @@
 #include <glosm/GPXDatasource.hh>
 #include <glosm/XMLParser.hh>
 #include <glosm/NonCopyable.hh>
+#include <glosm/SpatialIndex.hh>
 
 #include <vector>
 
 /**
  * Source of GPX data which preloads tracks into memory.
  *
- * @todo this needs quadtree or some other clever interface
- * to scale for large amounts of data.
+ * Track points are kept in track order, split into short pieces,
+ * which are put into spatial index, so GetPoints() only scans
+ * pieces intersecting requested bbox. Besides full tracks, there
+ * are simplified copies of them for low tile levels, which are
+ * made on Load() and returned by GetTracks().
  */
 class PreloadedGPXDatasource : public XMLParser, public GPXDatasource, private NonCopyable {
 protected:
 	typedef std::vector<Vector3i> PointsVector;
 
+	/**
+	 * Run of consecutive points of a track segment
+	 */
+	struct TrackPiece {
+		size_t first;
+		size_t count;
+
+		/* track segment goes on with the next piece */
+		bool continued;
+
+		TrackPiece(size_t f, size_t c, bool cont) : first(f), count(c), continued(cont) {
+		}
+	};
+
+	typedef std::vector<TrackPiece> PiecesVector;
+
+	/**
+	 * Tracks with geometry for a band of tile levels
+	 */
+	struct TrackLayer {
+		int max_level;
+
+		/* track segments, one after another */
+		PointsVector points;
+		std::vector<size_t> segments;
+
+		/* pieces of segments and their spatial index */
+		PiecesVector pieces;
+		SpatialIndex<unsigned int> index;
+
+		TrackLayer() : max_level(0) {
+		}
+	};
+
+	/* points per piece; small enough for piece to be scanned
+	 * quickly, large enough to keep index small */
+	static const size_t POINTS_PER_PIECE = 256;
+
+	/* number of simplified layers for low tile levels */
+	static const int NUM_OVERVIEW_LAYERS = 3;
+
+	/* visitor for index of TrackLayer, which appends points of pieces */
+	struct PieceScanner;
+
 protected:
-	PointsVector points_;
+	/* full tracks */
+	TrackLayer tracks_;
+
+	/* from lowest to highest levels */
+	TrackLayer overviews_[NUM_OVERVIEW_LAYERS];
 
 	/* parser state */
 	enum {
@@ -68,6 +120,18 @@ protected:
 	 */
 	virtual void CharacterData(const char* data, int len);
 
+	/**
+	 * Splits segments from given one on into pieces and adds
+	 * these to the index of layer
+	 */
+	static void IndexSegments(TrackLayer& layer, size_t first_segment);
+
+	/**
+	 * Adds simplified copies of segments from given one on
+	 * to overview layers and indexes all layers
+	 */
+	void FinishSegments(size_t first_segment);
+
 public:
 	/**
 	 * Constructs empty datasource
@@ -87,6 +151,7 @@ public:
 	virtual void Load(const char* filename);
 
 	virtual void GetPoints(std::vector<Vector3i>& out, const BBoxi& bbox) const;
+	virtual void GetTracks(std::vector<Vector3i>& points, std::vector<size_t>& lengths, const BBoxi& bbox, int level) const;
 };
 
 #endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRELOADEDPBFDATASOURCE_HH
+#define PRELOADEDPBFDATASOURCE_HH
+
+#include <glosm/PreloadedXmlDatasource.hh>
+
+#include <vector>
+
+struct PbfBlock;
+
+/**
+ * Source of OpenStreetMap data which preloads .osm.pbf dump into memory.
+ *
+ * Fills the same structures as PreloadedXmlDatasource, which does
+ * all the rest of processing. Blobs are read sequentially, but
+ * decompressed and decoded in parallel by a number of threads;
+ * decoded data is then stored in file order.
+ *
+ * Only zlib-compressed and raw blobs are supported. File must be
+ * sorted (nodes, then ways, then relations), as is the case for
+ * all dumps produced by common tools.
+ */
+class PreloadedPbfDatasource : public PreloadedXmlDatasource {
+protected:
+	/**
+	 * Stores decoded block data into maps
+	 */
+	void StoreBlock(PbfBlock& block);
+
+public:
+	/**
+	 * Constructs empty datasource
+	 *
+	 * @param load_flags combination of LoadFlags
+	 * @param nthreads number of decoding threads; 0 means number of CPUs
+	 */
+	PreloadedPbfDatasource(int load_flags = 0, int nthreads = 0);
+
+	/**
+	 * Destructor
+	 */
+	virtual ~PreloadedPbfDatasource();
+
+	/**
+	 * Parses OSM PBF dump file and loads map data into memory
+	 *
+	 * @param filename path to dump file or "-" for stdin
+	 */
+	virtual void Load(const char* filename);
+};
+
+#endif
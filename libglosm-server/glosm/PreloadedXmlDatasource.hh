@@ -26,21 +26,116 @@
 #include <glosm/XMLParser.hh>
 #include <glosm/NonCopyable.hh>
 #include <glosm/id_map.hh>
+#include <glosm/id_array.hh>
+#include <glosm/Arena.hh>
+#include <glosm/SpatialIndex.hh>
+#include <glosm/NodeTagTable.hh>
 
-/**
- * Excepion that denotes inconsistent OSM data
- */
-class DataException : public Exception {
-};
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <vector>
 
 /**
  * Source of OpenStreetMap data which preloads .osm dump into memory.
  *
  * This is a simple OsmDatasource that first parses OSM XML dump
  * with XML parser and stores node/way/relation information in
- * memory.
+ * memory. Loaded data may then be updated with OsmChange files,
+ * see ApplyChange().
  */
 class PreloadedXmlDatasource : public XMLParser, public OsmDatasource, private NonCopyable {
+public:
+	enum LoadFlags {
+		/**
+		 * Store node coordinates directly in ways and drop nodes
+		 * after loading. Saves lots of memory and indirections,
+		 * but GetNode() is not available and Way::Nodes are empty.
+		 */
+		INLINE_NODES = 0x01,
+
+		/**
+		 * Load XML in a pipeline of threads: reading input,
+		 * parsing it and storing parsed objects run concurrently.
+		 * Result is the same as with sequential loading.
+		 */
+		PIPELINED_LOAD = 0x02,
+
+		/**
+		 * Keep way node refs packed as varint deltas, which
+		 * takes several times less memory. Way::Nodes are then
+		 * empty and refs are available via Way::NodeIterator.
+		 */
+		PACK_NODE_REFS = 0x04,
+
+		/**
+		 * Build overview layers for low tile levels, with only
+		 * ground ways visible there and simplified geometry;
+		 * these are returned by GetOverviewWays().
+		 */
+		OVERVIEW_LAYERS = 0x08,
+
+		/**
+		 * Parse uncompressed dumps with built-in OSM XML scanner
+		 * instead of Expat, which is several times faster. Other
+		 * input is still parsed by Expat.
+		 *
+		 * @see XMLParser::FAST_SCAN
+		 */
+		FAST_XML_SCAN = 0x10,
+
+		/**
+		 * Reorder ways in memory along Z-order curve of their
+		 * bbox centers after loading, so ways which are close
+		 * on the map are close in memory as well, and ways of
+		 * a tile are read from few pages instead of scattered
+		 * all over the dump. Inline coords are reallocated in
+		 * the same order. Temporarily takes extra memory for
+		 * second copy of way table.
+		 */
+		SPATIAL_LAYOUT = 0x20,
+
+		/**
+		 * Keep tags of tagged nodes in a compact side table,
+		 * so points of interest are available with
+		 * GetTaggedNodes(). Without it, node tags are
+		 * skipped while parsing.
+		 */
+		NODE_TAGS = 0x40,
+	};
+
+	/**
+	 * Restrictions on loaded data, see SetLoadFilter()
+	 */
+	struct LoadFilter {
+		/**
+		 * Tags of ways to keep, either "key" for any value or
+		 * "key=value". Multipolygons are matched by relation
+		 * tags. Empty list keeps all ways
+		 */
+		std::vector<std::string> tags;
+
+		/** Ways outside this bbox are dropped; empty bbox keeps all */
+		BBoxi clip_bbox;
+
+		/** Ways not intersecting this polygon are dropped; empty keeps all */
+		std::vector<Vector2i> clip_polygon;
+
+		/** Drop relations once multipolygons are made of them */
+		bool drop_relations;
+
+		LoadFilter() : clip_bbox(BBoxi::Empty()), drop_relations(false) {
+		}
+
+		/**
+		 * Checks whether filter keeps everything
+		 */
+		bool IsEmpty() const {
+			return tags.empty() && clip_bbox.IsEmpty() && clip_polygon.empty() && !drop_relations;
+		}
+	};
+
 protected:
 	enum CurrentTag {
 		NONE,
@@ -51,29 +146,129 @@ protected:
 	};
 
 protected:
-	typedef id_map<osmid_t, Node> NodesMap;
-	//typedef id_map<osmid_t, TagsMap> NodeTagsMap;
+	typedef id_array<Node> NodesMap;
 	typedef id_map<osmid_t, Way> WaysMap;
 	typedef id_map<osmid_t, Relation> RelationsMap;
 
+	typedef SpatialIndex<const Way*> WaysIndex;
+
+	/* key and value (or STR_NONE for any) of LoadFilter::tags */
+	typedef std::vector<std::pair<strid_t, strid_t> > FilterTagsVector;
+
+	/* multipolygon relation ids and synthetic ways made of them */
+	typedef std::vector<std::pair<osmid_t, Way*> > MultipolygonWaysVector;
+
+	/* objects per batch of parsed data */
+	static const size_t BATCH_SIZE = 4096;
+
+	/* batches queued for storing thread before parser waits */
+	static const size_t MAX_QUEUED_BATCHES = 8;
+
+	/* ways per FinalizeGeometry() thread, to not spawn threads for tiny dumps */
+	static const size_t MIN_WAYS_PER_THREAD = 16384;
+
+	/* new_ways_index_ is merged into ways_index_ when it's larger than this part of it */
+	static const size_t NEW_WAYS_INDEX_RATIO = 16;
+
+	/* range of ways processed by a FinalizeGeometry() thread */
+	struct GeometryTask;
+
+	/* number of overview layers, see OVERVIEW_LAYERS */
+	static const int NUM_OVERVIEW_LAYERS = 3;
+
+	/**
+	 * Generalized copies of ways for a band of tile levels
+	 */
+	struct OverviewLayer {
+		int max_level;
+		std::vector<Way> ways;
+		WaysIndex index;
+	};
+
+	/**
+	 * Run of parsed objects of a single type, in document order
+	 */
+	struct ParsedBatch {
+		CurrentTag type;
+		std::vector<std::pair<osmid_t, Node> > nodes;
+		std::vector<std::pair<size_t, TagsMap> > node_tags; /* by index in nodes */
+		std::vector<std::pair<osmid_t, Way> > ways;
+		std::vector<std::pair<osmid_t, Relation> > relations;
+
+		ParsedBatch() : type(NONE) {
+		}
+	};
+
 protected:
 	/* data */
 	NodesMap nodes_;
-	//NodeTagsMap node_tags_;
+	NodeTagTable node_tags_;
 	WaysMap ways_;
 	RelationsMap relations_;
 
+	/* storage for tags and packed node refs of ways_ and relations_ */
+	Arena arena_;
+
+	/* encoding buffer for PackNodeRefs() */
+	std::vector<unsigned char> pack_buffer_;
+
+	/* spatial index of ways_, built after loading */
+	WaysIndex ways_index_;
+
+	/* index of ways added by ApplyChange() since ways_index_ was built */
+	WaysIndex new_ways_index_;
+
+	/* sorted by relation id; way is NULL for multipolygons
+	 * no ways could be made of */
+	MultipolygonWaysVector multipolygon_ways_;
+
+	/* from lowest to highest levels */
+	OverviewLayer overviews_[NUM_OVERVIEW_LAYERS];
+
 	/* parser state */
 	CurrentTag current_tag_;
 	int tag_level_;
 
-	NodesMap::iterator last_node_;
-	//NodeTagsMap::iterator last_node_tags_;
+	/* objects being parsed, pointing into batch_ */
+	Way* parsed_way_;
+	Relation* parsed_relation_;
+
+	/* last object stored, for FinalizeWay()/FinalizeRelation() */
 	WaysMap::iterator last_way_;
 	RelationsMap::iterator last_relation_;
 
+	/* batches of parsed objects waiting to be stored */
+	ParsedBatch* batch_;
+	std::deque<ParsedBatch*> store_queue_;
+	bool store_done_;
+	std::string store_error_;
+	pthread_mutex_t store_mutex_;
+	pthread_cond_t store_cond_;
+
 	BBoxi bbox_;
 
+	/* see GetMaxHeight(); only grows on ApplyChange() until
+	 * index is rebuilt */
+	osmint_t max_height_;
+
+	int load_flags_;
+	int nthreads_;
+
+	/* see SetLoadFilter() */
+	LoadFilter filter_;
+	FilterTagsVector filter_tags_;
+	BBoxi clip_polygon_bbox_;
+
+	/* ways not matching filter tags; kept until all relations
+	 * are read, as these may be multipolygon members */
+	std::vector<Way*> unmatched_ways_;
+
+	/* problems found in dump, reported after loading */
+	size_t short_ways_;
+	size_t incomplete_ways_;
+	size_t missing_node_refs_;
+	size_t missing_way_members_;
+
 	/* id counter for syntheric objects; goes down from max possible ID */
 	static osmid_t next_synthetic_id_;
 
@@ -89,27 +284,169 @@ protected:
 	virtual void EndElement(const char* name);
 
 protected:
+	/**
+	 * Starts new parsed object, flushing batch if needed
+	 */
+	void StartObject(CurrentTag type);
+
+	/**
+	 * Passes current batch to storing
+	 */
+	void FlushBatch();
+
+	/**
+	 * Moves parsed objects into maps
+	 */
+	void StoreBatch(ParsedBatch& batch);
+
+	/**
+	 * Storing thread for PIPELINED_LOAD
+	 */
+	static void* StoreThread(void* arg);
+
+	/**
+	 * Waits for storing thread to process all queued batches
+	 */
+	void JoinStoreThread(pthread_t thread);
+
 	/**
 	 * Extra processing for ways
+	 *
+	 * Only checks which don't need nodes are done here; node
+	 * lookups are deferred to FinalizeGeometry().
 	 */
 	void FinalizeWay();
 
+	/**
+	 * Classifies way and stores its tags and node refs compactly
+	 */
+	void PrepareWay(Way& way);
+
+	/**
+	 * Checks whether way has any of filter tags
+	 */
+	bool MatchesFilterTags(const Way& way) const;
+
+	/**
+	 * Checks whether way intersects filter clip polygon
+	 */
+	bool IntersectsClipPolygon(const Way& way) const;
+
+	/**
+	 * Drops ways rejected by load filter
+	 *
+	 * Ways not matching filter tags are dropped before geometry
+	 * is calculated, and ways outside clip region after that.
+	 */
+	void DropUnmatchedWays();
+	void ClipWays();
+
+	/**
+	 * Checks whether point is kept by filter clip region
+	 */
+	bool IsWithinClipRegion(const Vector2i& pos) const;
+
+	/**
+	 * Replaces way node list with zigzag varint deltas in arena
+	 *
+	 * @see PACK_NODE_REFS
+	 */
+	void PackNodeRefs(Way& way);
+
+	/**
+	 * Calculates bboxes and orientation of all ways
+	 *
+	 * Ways referencing missing nodes are emptied and skipped
+	 * from then on, as id_map can't erase arbitrary elements.
+	 */
+	void FinalizeGeometry();
+
+	/**
+	 * Calculates bboxes and orientation of given ways
+	 */
+	void FinalizeGeometry(std::vector<Way*>& ways);
+
+	/**
+	 * Geometry calculation for a range of ways, run on a thread
+	 */
+	static void RunGeometryTask(GeometryTask& task);
+
+	/**
+	 * Prints summary of problems found in the dump
+	 */
+	void ReportProblems() const;
+
 	/**
 	 * Extra processing for relations
 	 */
 	void FinalizeRelation();
 
+	/**
+	 * Resets state before loading
+	 */
+	void StartLoad();
+
+	/**
+	 * Post-processing after all data was parsed
+	 *
+	 * Calculates missing bbox, finalizes way geometry, inlines
+	 * nodes if requested and builds spatial index.
+	 */
+	void FinishLoad();
+
+	/**
+	 * Rebuilds way table in Z-order of way bboxes
+	 *
+	 * @see SPATIAL_LAYOUT
+	 */
+	void RelayoutWays();
+
+	/**
+	 * Builds spatial index of all loaded ways and finds their
+	 * maximal height
+	 */
+	void BuildIndex();
+
+	/**
+	 * Builds overview layers from loaded ways
+	 *
+	 * @see OVERVIEW_LAYERS
+	 */
+	void BuildOverviews();
+
+	/**
+	 * Copies node coordinates into ways and drops nodes
+	 *
+	 * @see INLINE_NODES
+	 */
+	void InlineNodes();
+
 public:
 	/**
 	 * Constructs empty datasource
+	 *
+	 * @param load_flags combination of LoadFlags
+	 * @param nthreads number of threads for post-processing; 0 means number of CPUs
 	 */
-	PreloadedXmlDatasource();
+	PreloadedXmlDatasource(int load_flags = 0, int nthreads = 0);
 
 	/**
 	 * Destructor
 	 */
 	virtual ~PreloadedXmlDatasource();
 
+	/**
+	 * Sets restrictions on data loaded by subsequent Load() calls
+	 *
+	 * Filtered objects are dropped as early as possible: relations
+	 * right after they are read, ways outside clip region as soon
+	 * as their geometry is known. Ways not matching filter tags
+	 * are dropped after all relations are read, as they may still
+	 * be needed for multipolygons. Filtered data can't be updated
+	 * with ApplyChange().
+	 */
+	void SetLoadFilter(const LoadFilter& filter);
+
 	/**
 	 * Parses OSM dump file and loads map data into memory
 	 *
@@ -117,6 +454,36 @@ public:
 	 */
 	virtual void Load(const char* filename);
 
+	/**
+	 * Writes loaded data into binary snapshot file
+	 *
+	 * Snapshot may later be opened with MmapOsmDatasource. Only
+	 * ways are stored; multipolygons are stored as synthetic ways.
+	 *
+	 * @param filename path to snapshot file
+	 */
+	void WriteSnapshot(const char* filename) const;
+
+	/**
+	 * Applies OsmChange (.osc) file to loaded data
+	 *
+	 * Objects are created, modified and deleted in place, and
+	 * spatial index is updated incrementally, so this takes time
+	 * proportional to size of the change rather than of loaded
+	 * data. Multipolygons and overview layers affected by the
+	 * change are rebuilt. Loaded bbox is not changed.
+	 *
+	 * Not available with INLINE_NODES. Must not be called while
+	 * datasource is used by other threads; ways got from it
+	 * before may have changed or become empty.
+	 *
+	 * @param filename path to change file
+	 * @param dirty receives bboxes of changed ways, both before
+	 *        and after the change; tiles intersecting these
+	 *        are to be refreshed
+	 */
+	void ApplyChange(const char* filename, std::vector<BBoxi>& dirty);
+
 	/**
 	 * Drops all loaded data
 	 *
@@ -143,12 +510,25 @@ public:
 	 */
 	virtual BBoxi GetBBox() const;
 
+	virtual osmint_t GetMaxHeight() const;
+
+	/**
+	 * Returns number of bytes taken by tags and packed node
+	 * refs of loaded objects
+	 *
+	 * This does not include maps themselves and plain node lists.
+	 */
+	size_t GetArenaBytes() const;
+
 public:
 	virtual const Node& GetNode(osmid_t id) const;
 	virtual const Way& GetWay(osmid_t id) const;
 	virtual const Relation& GetRelation(osmid_t id) const;
 
-	virtual void GetWays(std::vector<Way>& out, const BBoxi& bbox) const;
+	using OsmDatasource::GetWays;
+	virtual void GetWays(std::vector<const Way*>& out, const BBoxi& bbox) const;
+	virtual void GetOverviewWays(std::vector<const Way*>& out, const BBoxi& bbox, int level) const;
+	virtual void GetTaggedNodes(std::vector<TaggedNode>& out, const BBoxi& bbox) const;
 };
 
 #endif
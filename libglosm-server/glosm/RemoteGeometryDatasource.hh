@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef REMOTEGEOMETRYDATASOURCE_HH
+#define REMOTEGEOMETRYDATASOURCE_HH
+
+#include <glosm/GeometryDatasource.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Geometry source which takes geometry from glosm-geomserver.
+ *
+ * This lets many processes share single server with data loaded
+ * and geometry generated once. Requests are pipelined over single
+ * connection: any number of them may be in flight, and replies are
+ * dispatched to waiting callers by a receiver thread, in order
+ * they arrive. Besides blocking GetGeometry(), there's Request()/
+ * Wait() pair to issue requests ahead of time, and Cancel() to drop
+ * ones no longer needed, as well as generic Submit() interface.
+ *
+ * Safe to use from multiple threads.
+ *
+ * @see GeometryProtocol, GeometryServer
+ */
+class RemoteGeometryDatasource : public GeometryDatasource, private NonCopyable {
+public:
+	typedef uint32_t RequestId;
+
+protected:
+	/**
+	 * Reply slot of a request in flight
+	 */
+	struct PendingRequest {
+		bool done;
+		bool failed;
+		std::vector<unsigned char> data;
+		GeometryRequest::Callback* callback;
+
+		PendingRequest(GeometryRequest::Callback* c) : done(false), failed(false), callback(c) {
+		}
+	};
+
+	typedef std::vector<GeometryRequest::Callback*> CallbackVector;
+
+	typedef std::map<RequestId, PendingRequest*> PendingMap;
+
+protected:
+	int fd_;
+
+	/* from server greeting */
+	BBoxi bbox_;
+	Vector2i center_;
+	osmint_t max_height_;
+
+	pthread_t receiver_;
+
+	mutable pthread_mutex_t write_mutex_;
+
+	/* held by receiver thread while it runs callbacks, so
+	 * request handles may wait for their callback to return */
+	mutable pthread_mutex_t callback_mutex_;
+
+	mutable pthread_mutex_t mutex_;
+	mutable pthread_cond_t cond_;
+	/* protected by mutex_ */
+	mutable RequestId next_id_;
+	mutable PendingMap pending_;
+	mutable bool closed_;
+	mutable std::string error_;
+	/* /protected by mutex_ */
+
+protected:
+	/**
+	 * Reads server greeting and starts receiver thread
+	 */
+	void Init();
+
+	/**
+	 * Dispatches replies until connection is closed
+	 */
+	void ReceiveReplies();
+
+	static void* ReceiverThread(void* arg);
+
+	/**
+	 * Sends a message, marking connection closed on failure
+	 */
+	void Send(int type, RequestId id, const std::vector<unsigned char>& payload) const;
+
+	/**
+	 * Marks connection closed, collecting callbacks of requests
+	 * which become ready by that for RunCallbacks()
+	 *
+	 * Called with mutex_ held; takes callback_mutex_ if there
+	 * are callbacks to run.
+	 */
+	void Close(const std::string& error, CallbackVector& callbacks) const;
+
+	/**
+	 * Runs callbacks collected under mutex_, after it's released,
+	 * and releases callback_mutex_ taken along with them
+	 */
+	void RunCallbacks(const CallbackVector& callbacks) const;
+
+public:
+	/**
+	 * Connects to server
+	 *
+	 * @param address see GeometryProtocol::Connect()
+	 */
+	RemoteGeometryDatasource(const char* address);
+
+	/**
+	 * Takes over already connected socket
+	 */
+	RemoteGeometryDatasource(int fd);
+
+	/**
+	 * Destructor; requests still in flight are abandoned
+	 */
+	virtual ~RemoteGeometryDatasource();
+
+	/**
+	 * Sends request without waiting for reply
+	 *
+	 * Each request must be either waited or cancelled.
+	 *
+	 * @param callback notified when reply arrives, may be NULL
+	 */
+	RequestId Request(const BBoxi& bbox, int flags = 0, GeometryRequest::Callback* callback = NULL) const;
+
+	/**
+	 * Checks whether reply to a request has arrived, or it
+	 * won't ever arrive as connection is lost
+	 */
+	bool IsDone(RequestId id) const;
+
+	/**
+	 * Waits for reply to a request and appends geometry from it
+	 *
+	 * @throw Exception if server failed to produce geometry or
+	 *        connection was lost
+	 */
+	void Wait(RequestId id, Geometry& geometry) const;
+
+	/**
+	 * Abandons request; its reply is discarded if it arrives
+	 */
+	void Cancel(RequestId id) const;
+
+	/**
+	 * Waits until callbacks being run by receiver thread return
+	 */
+	void WaitCallbacks() const;
+
+	virtual GeometryRequest* Submit(const BBoxi& bbox, int flags = 0, GeometryRequest::Callback* callback = NULL) const;
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags = 0) const;
+
+	virtual Vector2i GetCenter() const;
+	virtual BBoxi GetBBox() const;
+
+	/**
+	 * Returns maximal height of objects served
+	 *
+	 * @see OsmDatasource::GetMaxHeight()
+	 */
+	osmint_t GetMaxHeight() const;
+
+	/**
+	 * Returns number of requests still in flight
+	 */
+	size_t GetPendingCount() const;
+};
+
+#endif
@@ -22,53 +22,286 @@
 #define SRTMDATASOURCE_HH
 
 #include <glosm/HeightmapDatasource.hh>
+#include <glosm/BBox.hh>
 
 #include <stdint.h>
 #include <pthread.h>
 
+#include <string>
 #include <vector>
-#include <map>
 
+/**
+ * Heightmap datasource reading SRTM3 .hgt files
+ *
+ * Chunks (1x1 degree files) are loaded on demand and cached.
+ * Resident chunks are looked up without locking, each chunk is
+ * read from disk only once even if requested by several threads
+ * at the same time, and reading happens outside of any lock, so
+ * threads using other chunks are not blocked by it.
+ *
+ * Least recently used chunks are freed when their cumulative size
+ * exceeds the limit, see SetSizeLimit().
+ *
+ * Both SRTM3 (1201x1201) and SRTM1 (3601x3601) files are
+ * supported, the latter are sampled at SRTM3 resolution. Besides
+ * plain .hgt, .hgt.gz and .hgt.zip files are read; decompressed
+ * chunks are kept in the same cache.
+ *
+ * With MMAP_CHUNKS flag, files are memory-mapped and sampled in
+ * place instead of being read and converted as a whole, so only
+ * pages actually used are loaded, and they're shared via page
+ * cache with other processes using the same files.
+ *
+ * Chunks around the place which is about to be viewed may be
+ * loaded in advance by a background thread, see Prefetch().
+ */
 class SRTMDatasource : public HeightmapDatasource {
-protected:
-	struct ChunkId {
-		short lon;
-		short lat;
+public:
+	enum Flags {
+		MMAP_CHUNKS = 0x01,
+	};
+
+public:
+	/**
+	 * Chunk cache statistics, see GetStatistics()
+	 */
+	struct Statistics {
+		/* chunk lookups (cumulative), of which these had to
+		 * read chunk files; lookups - loads are cache hits */
+		unsigned int lookups;
+		unsigned int loads;
+		unsigned int evictions;
+
+		/* current and max size of loaded chunks in bytes */
+		size_t size;
+		size_t size_limit;
 
-		ChunkId(short lo, short la): lon(lo), lat(la) {
+		Statistics() : lookups(0), loads(0), evictions(0), size(0), size_limit(0) {
 		}
+	};
+
+protected:
+	enum {
+		CHUNKS_LON = 360,
+		CHUNKS_LAT = 180,
+		NUM_STRIPES = 16,
+	};
+
+	enum ChunkStates {
+		EMPTY,
+		LOADING,
+		READY
+	};
 
-		bool operator< (const ChunkId& other) const {
-			return lon < other.lon || (lon == other.lon && lat < other.lat);
+	/**
+	 * Heights of a single chunk, either read into memory or mapped
+	 */
+	struct ChunkData {
+		std::vector<int16_t> buffer;
+
+		void* mapping;
+		size_t mapping_size;
+
+		/* first row of data, distance between used rows and
+		 * columns, and whether values are to be byte-swapped on
+		 * access */
+		const uint16_t* rows;
+		int stride;
+		int step;
+		bool swap;
+
+		ChunkData() : mapping(NULL), mapping_size(0), rows(NULL), stride(0), step(0), swap(false) {
 		}
+
+		/**
+		 * Returns height in meters
+		 *
+		 * @param line row number, counted from bottom
+		 * @param pos column number
+		 */
+		int16_t Get(int line, int pos) const;
+
+		/**
+		 * Returns raw data of a row, see swap
+		 */
+		const uint16_t* GetRow(int line) const;
+
+		void Swap(ChunkData& other);
+		void Release();
 	};
 
+	/**
+	 * Cache slot for a single chunk
+	 *
+	 * Slots are created on demand and live until datasource is
+	 * destroyed; only their data is freed on eviction.
+	 */
 	struct Chunk {
-		int generation;
-		std::vector<int16_t> data;
+		/* position in chunks_ table */
+		int index;
+
+		/* protected by stripe mutex */
+		volatile int state;
+		ChunkData data;
+
+		/* number of users, or -1 while chunk is being evicted */
+		volatile int refs;
+
+		/* last use time, for eviction */
+		volatile int last_use;
+
+		Chunk(int i) : index(i), state(EMPTY), refs(0), last_use(0) {
+		}
+	};
+
+	/**
+	 * Lock and condition for a subset of chunks
+	 */
+	struct Stripe {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
 	};
 
 protected:
-	typedef std::map<ChunkId, Chunk> ChunksMap;
+	typedef std::vector<Chunk*> ChunkVector;
+
+	/* chunk numbers, same as AcquireChunk() arguments */
+	typedef std::vector<std::pair<int, int> > ChunkPosVector;
 
 protected:
 	const char* storage_path_;
-	mutable int generation_;
+	int flags_;
+
+	/* chunk slots indexed by lat * CHUNKS_LON + lon; pointers
+	 * are published once and never change afterwards */
+	Chunk* volatile* chunks_;
 
-	mutable pthread_mutex_t mutex_;
+	mutable Stripe stripes_[NUM_STRIPES];
 
-	mutable ChunksMap chunks_;
+	mutable volatile int use_clock_;
+
+	mutable pthread_mutex_t resident_mutex_;
+	/* protected by resident_mutex_ */
+	mutable ChunkVector resident_;
+	mutable size_t resident_size_;
+	size_t size_limit_;
+	mutable unsigned int loads_;
+	mutable unsigned int evictions_;
+	/* /protected by resident_mutex_ */
+
+	mutable pthread_mutex_t prefetch_mutex_;
+	mutable pthread_cond_t prefetch_cond_;
+	/* protected by prefetch_mutex_ */
+	mutable ChunkPosVector prefetch_queue_; /* nearest last */
+	mutable BBox<int> prefetch_range_;
+	mutable bool prefetch_started_;
+	mutable bool prefetch_stop_;
+	/* /protected by prefetch_mutex_ */
+	mutable pthread_t prefetch_thread_;
 
 protected:
-	Chunk& RequireChunk(int lon, int lat) const;
+	/**
+	 * Returns chunk with loaded data, pinning it in memory
+	 *
+	 * @param lon chunk number, zero-based at 180W
+	 * @param lat chunk number, zero-based at 90S
+	 */
+	const Chunk* AcquireChunk(int lon, int lat) const;
+
+	/**
+	 * Unpins chunk returned by AcquireChunk()
+	 */
+	void ReleaseChunk(const Chunk* chunk) const;
+
+	/**
+	 * Slow path of AcquireChunk(): waits for or performs loading
+	 */
+	const Chunk* LoadChunk(int index) const;
+
+	/**
+	 * Reads or maps chunk file; fills data with zeroes on error
+	 */
+	void ReadChunk(int lon, int lat, ChunkData& data) const;
+
+	/**
+	 * Maps chunk file if possible
+	 *
+	 * @return false if file could not be mapped
+	 */
+	bool MapChunk(const std::string& filename, ChunkData& data) const;
+
+	/**
+	 * Drops unused chunks over the limit, least recently used first
+	 *
+	 * Must be called with resident_mutex_ held.
+	 */
+	void EvictChunks() const;
+
 	osmint_t GetPointHeight(int x, int y) const;
 
+	static void* PrefetchThread(void* arg);
+
+	/**
+	 * Loads queued chunks until datasource is destroyed
+	 */
+	void PrefetchChunks() const;
+
 public:
-	SRTMDatasource(const char* storage_path);
+	/**
+	 * Constructs datasource
+	 *
+	 * @param storage_path directory with .hgt files
+	 * @param flags combination of Flags
+	 */
+	SRTMDatasource(const char* storage_path, int flags = 0);
 	virtual ~SRTMDatasource();
 
 	virtual void GetHeightmap(const BBoxi& bbox, int extramargin, Heightmap& out) const;
 	virtual osmint_t GetHeight(const Vector2i& where) const;
+
+	/**
+	 * Returns heights for a number of points at once
+	 *
+	 * Gives the same results as GetHeight(), but consecutive
+	 * points in the same chunk share a single chunk lookup.
+	 */
+	virtual void GetHeights(const Vector2i* points, size_t count, osmint_t* out) const;
+
+	/**
+	 * Starts loading chunks covering given area in background
+	 *
+	 * Chunks are loaded by a separate thread into the same
+	 * cache, nearest to the center of the area first, so tile
+	 * loaders rarely wait for disk when they get there; pages of
+	 * mapped chunks are advised to be read ahead. At most half
+	 * of cache size limit is prefetched, so chunks in use are
+	 * not pushed out.
+	 *
+	 * Each call replaces chunks still pending from previous one,
+	 * and repeated calls for the same chunks are cheap, so this
+	 * may be called for viewer position every frame.
+	 */
+	void Prefetch(const BBoxi& bbox) const;
+
+	/**
+	 * Sets limit on cumulative size of loaded chunks
+	 *
+	 * Chunks in use are never freed, so the limit may be
+	 * exceeded temporarily. Default is 32 chunks, around 90MB.
+	 *
+	 * @param limit size limit in bytes
+	 */
+	void SetSizeLimit(size_t limit);
+
+	/**
+	 * Returns cumulative size of loaded chunks in bytes
+	 */
+	size_t GetSize() const;
+
+	/**
+	 * Returns chunk cache statistics
+	 */
+	void GetStatistics(Statistics& stats) const;
 };
 
 #endif
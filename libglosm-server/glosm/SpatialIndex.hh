@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPATIALINDEX_HH
+#define SPATIALINDEX_HH
+
+#include <glosm/BBox.hh>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <cstddef>
+
+/**
+ * Static packed R-tree of bounding boxes.
+ *
+ * Items are first collected with Insert(), then Build() packs
+ * them into a tree using Sort-Tile-Recursive algorithm. After
+ * that, Query() returns all items intersecting given bbox in
+ * O(log n + k). Items may be moved with Update(), but inserting
+ * more items requires another Build().
+ *
+ * Tree nodes are stored in a single flat array, level by level,
+ * with leaves first and the root last, so there are no per-node
+ * allocations.
+ */
+template <typename T, int NODE_SIZE = 16>
+class SpatialIndex {
+public:
+	typedef T value_type;
+
+	/* items and nodes are plain data, so the tree may be dumped
+	 * to disk and traversed in place with VisitTree() */
+	struct Item {
+		BBoxi bbox;
+		T value;
+
+		Item(const BBoxi& b, const T& v) : bbox(b), value(v) {
+		}
+	};
+
+	struct Node {
+		BBoxi bbox;
+		unsigned int first;
+		unsigned int count;
+
+		Node(unsigned int f, unsigned int c) : bbox(BBoxi::Empty()), first(f), count(c) {
+		}
+	};
+
+	/* deepest tree traversal stack has room for; log(n) depth of
+	 * built trees is far below it */
+	static const unsigned int MAX_DEPTH = 64;
+
+protected:
+	static const unsigned int STACK_SIZE = MAX_DEPTH * NODE_SIZE;
+
+	typedef std::vector<Item> ItemVector;
+	typedef std::vector<Node> NodeVector;
+
+	struct CompareX {
+		bool operator()(const Item& a, const Item& b) const {
+			return (osmlong_t)a.bbox.left + a.bbox.right < (osmlong_t)b.bbox.left + b.bbox.right;
+		}
+	};
+
+	struct CompareY {
+		bool operator()(const Item& a, const Item& b) const {
+			return (osmlong_t)a.bbox.bottom + a.bbox.top < (osmlong_t)b.bbox.bottom + b.bbox.top;
+		}
+	};
+
+protected:
+	ItemVector items_;
+	NodeVector nodes_;
+	unsigned int nleaves_;
+	bool built_;
+
+public:
+	SpatialIndex() : nleaves_(0), built_(false) {
+	}
+
+	/**
+	 * Adds an item to the index
+	 *
+	 * Added items are not visible to Query() until Build()
+	 */
+	void Insert(const BBoxi& bbox, const T& value) {
+		items_.push_back(Item(bbox, value));
+		built_ = false;
+	}
+
+	/**
+	 * Reserves space for a given number of items
+	 */
+	void Reserve(size_t count) {
+		items_.reserve(count);
+	}
+
+	/**
+	 * Packs inserted items into the tree
+	 */
+	void Build() {
+		nodes_.clear();
+		nleaves_ = 0;
+		built_ = true;
+
+		if (items_.empty())
+			return;
+
+		/* sort-tile-recursive: split into vertical slices by x,
+		 * then sort each slice by y, so each run of NODE_SIZE
+		 * items forms a compact leaf */
+		size_t nleaves = (items_.size() + NODE_SIZE - 1) / NODE_SIZE;
+		size_t nslices = (size_t)ceil(sqrt((double)nleaves));
+		size_t slice_size = nslices * NODE_SIZE;
+
+		std::sort(items_.begin(), items_.end(), CompareX());
+		for (size_t i = 0; i < items_.size(); i += slice_size)
+			std::sort(items_.begin() + i, items_.begin() + std::min(i + slice_size, items_.size()), CompareY());
+
+		/* leaves */
+		for (size_t i = 0; i < items_.size(); i += NODE_SIZE) {
+			Node node(i, std::min((size_t)NODE_SIZE, items_.size() - i));
+			for (unsigned int j = node.first; j < node.first + node.count; ++j)
+				node.bbox.Include(items_[j].bbox);
+			nodes_.push_back(node);
+		}
+		nleaves_ = nodes_.size();
+
+		/* upper levels; children of consecutive nodes are already
+		 * spatially coherent after STR sort, so just group them */
+		size_t level_start = 0;
+		size_t level_end = nodes_.size();
+		while (level_end - level_start > 1) {
+			for (size_t i = level_start; i < level_end; i += NODE_SIZE) {
+				Node node(i, std::min((size_t)NODE_SIZE, level_end - i));
+				for (unsigned int j = node.first; j < node.first + node.count; ++j)
+					node.bbox.Include(nodes_[j].bbox);
+				nodes_.push_back(node);
+			}
+			level_start = level_end;
+			level_end = nodes_.size();
+		}
+	}
+
+	/**
+	 * Calls visitor for each item which bbox intersects given one
+	 *
+	 * Visitor is any object with operator()(const T&)
+	 */
+	template <class V>
+	void Visit(const BBoxi& bbox, V& visitor) const {
+		assert(built_ || items_.empty());
+
+		if (nodes_.empty())
+			return;
+
+		VisitTree(&items_[0], &nodes_[0], nodes_.size(), nleaves_, bbox, visitor);
+	}
+
+	/**
+	 * Traverses tree stored in external arrays
+	 *
+	 * Arrays must have the same layout as produced by Build(),
+	 * see GetItems() and GetNodes(). Arrays which don't come
+	 * from Build() must pass ValidateTree() first.
+	 */
+	template <class V>
+	static void VisitTree(const Item* items, const Node* nodes, unsigned int nnodes, unsigned int nleaves, const BBoxi& bbox, V& visitor) {
+		if (nnodes == 0)
+			return;
+
+		unsigned int stack[STACK_SIZE];
+		int top = 0;
+
+		stack[top++] = nnodes - 1;
+		while (top > 0) {
+			unsigned int current = stack[--top];
+			const Node& node = nodes[current];
+
+			if (!node.bbox.Intersects(bbox))
+				continue;
+
+			if (current < nleaves) {
+				for (unsigned int i = node.first; i < node.first + node.count; ++i)
+					if (items[i].bbox.Intersects(bbox))
+						visitor(items[i].value);
+			} else if (node.count <= STACK_SIZE - (unsigned int)top) {
+				/* never false for valid trees */
+				for (unsigned int i = node.first; i < node.first + node.count; ++i)
+					stack[top++] = i;
+			}
+		}
+	}
+
+	/**
+	 * Checks tree stored in external arrays for consistency
+	 *
+	 * VisitTree() trusts its arrays, so trees read from files
+	 * are checked with this once: every node has at most
+	 * NODE_SIZE children within item or node array, inner
+	 * nodes only refer to nodes before them, so there are no
+	 * cycles, and tree is not deeper than MAX_DEPTH.
+	 */
+	static bool ValidateTree(const Node* nodes, size_t nitems, size_t nnodes, size_t nleaves) {
+		if (nleaves > nnodes)
+			return false;
+
+		/* height of each node above leaves */
+		std::vector<unsigned char> heights(nnodes, 0);
+		for (size_t i = 0; i < nnodes; ++i) {
+			const Node& node = nodes[i];
+			if (node.count > (unsigned int)NODE_SIZE)
+				return false;
+
+			if (i < nleaves) {
+				if (node.first > nitems || node.count > nitems - node.first)
+					return false;
+				continue;
+			}
+
+			if (node.first > i || node.count > i - node.first)
+				return false;
+
+			for (unsigned int j = node.first; j < node.first + node.count; ++j)
+				if (heights[j] + 1 > heights[i])
+					heights[i] = heights[j] + 1;
+
+			if (heights[i] >= MAX_DEPTH)
+				return false;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Changes bbox of an item in built tree
+	 *
+	 * Item is looked up by its current bbox, so this takes
+	 * O(log n). Bboxes of tree nodes are only grown, never
+	 * shrunk, so after many updates queries may visit more
+	 * nodes than needed, until next Build(). Empty bbox
+	 * effectively removes the item.
+	 *
+	 * @return false if there's no such item
+	 */
+	bool Update(const BBoxi& old_bbox, const T& value, const BBoxi& new_bbox) {
+		assert(built_ || items_.empty());
+
+		if (nodes_.empty())
+			return false;
+
+		unsigned int stack[STACK_SIZE];
+		int top = 0;
+
+		stack[top++] = nodes_.size() - 1;
+		while (top > 0) {
+			unsigned int current = stack[--top];
+			const Node& node = nodes_[current];
+
+			if (!node.bbox.Intersects(old_bbox))
+				continue;
+
+			if (current >= nleaves_) {
+				for (unsigned int i = node.first; i < node.first + node.count; ++i)
+					stack[top++] = i;
+				continue;
+			}
+
+			for (unsigned int i = node.first; i < node.first + node.count; ++i) {
+				if (items_[i].value == value && items_[i].bbox.Intersects(old_bbox)) {
+					items_[i].bbox = new_bbox;
+					GrowAncestors(current, new_bbox);
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	/**
+	 * Appends all items intersecting given bbox to a vector
+	 */
+	void Query(const BBoxi& bbox, std::vector<T>& out) const {
+		Appender appender(out);
+		Visit(bbox, appender);
+	}
+
+	/**
+	 * Returns items in tree order; valid after Build()
+	 */
+	const std::vector<Item>& GetItems() const {
+		return items_;
+	}
+
+	/**
+	 * Returns tree nodes, leaves first, root last
+	 */
+	const std::vector<Node>& GetNodes() const {
+		return nodes_;
+	}
+
+	/**
+	 * Returns number of leaf nodes
+	 */
+	unsigned int GetLeafCount() const {
+		return nleaves_;
+	}
+
+	/**
+	 * Returns number of items in the index
+	 */
+	size_t size() const {
+		return items_.size();
+	}
+
+	/**
+	 * Checks whether index is empty
+	 */
+	bool empty() const {
+		return items_.empty();
+	}
+
+	/**
+	 * Drops all items and tree nodes
+	 */
+	void clear() {
+		ItemVector().swap(items_);
+		NodeVector().swap(nodes_);
+		nleaves_ = 0;
+		built_ = false;
+	}
+
+protected:
+	/**
+	 * Includes bbox into a leaf and all nodes above it
+	 *
+	 * Parent is found from the layout Build() produces: each
+	 * level is laid out right after previous one, with every
+	 * NODE_SIZE consecutive nodes grouped under one parent.
+	 */
+	void GrowAncestors(unsigned int leaf, const BBoxi& bbox) {
+		size_t level_start = 0;
+		size_t level_size = nleaves_;
+		size_t current = leaf;
+		while (true) {
+			nodes_[current].bbox.Include(bbox);
+			if (level_size <= 1)
+				break;
+
+			size_t next_start = level_start + level_size;
+			current = next_start + (current - level_start) / NODE_SIZE;
+			level_start = next_start;
+			level_size = (level_size + NODE_SIZE - 1) / NODE_SIZE;
+		}
+	}
+
+	struct Appender {
+		std::vector<T>& out;
+
+		Appender(std::vector<T>& o) : out(o) {
+		}
+
+		void operator()(const T& value) {
+			out.push_back(value);
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STRINGTABLE_HH
+#define STRINGTABLE_HH
+
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+#include <string>
+#include <map>
+#include <cstring>
+
+/** Id of interned string */
+typedef unsigned int strid_t;
+
+/**
+ * Ids of strings known in advance
+ *
+ * These are preloaded into StringTable in this exact order, so
+ * code which checks for specific tags may compare ids with
+ * these constants instead of doing string lookups.
+ */
+enum WellKnownString {
+	STR_NONE = 0, /* not a string; marks absence of a value */
+
+	/* keys */
+	STR_AREA,
+	STR_BARRIER,
+	STR_BOUNDARY,
+	STR_BUILDING,
+	STR_BUILDING_GROUND_LEVEL,
+	STR_BUILDING_LEVELS,
+	STR_BUILDING_MIN_LEVEL,
+	STR_BUILDING_PART,
+	STR_BUILDING_PART_HEIGHT,
+	STR_BUILDING_SKIPPED_LEVELS,
+	STR_HEIGHT,
+	STR_HIGHWAY,
+	STR_LANDUSE,
+	STR_LANES,
+	STR_MAN_MADE,
+	STR_MIN_HEIGHT,
+	STR_NATURAL,
+	STR_ONEWAY,
+	STR_POWER,
+	STR_RAILWAY,
+	STR_ROOF_ANGLE,
+	STR_ROOF_ORIENTATION,
+	STR_ROOF_SHAPE,
+	STR_TYPE,
+	STR_WATERWAY,
+	STR_WIDTH,
+
+	/* values */
+	STR_ACROSS,
+	STR_ADMINISTRATIVE,
+	STR_CHIMNEY,
+	STR_CONICAL,
+	STR_CROSSPITCHED,
+	STR_FOOTWAY,
+	STR_GABLED,
+	STR_GARAGE,
+	STR_GARAGES,
+	STR_HIPPED,
+	STR_INNER,
+	STR_LINE,
+	STR_MAST,
+	STR_MOTORWAY,
+	STR_MOTORWAY_LINK,
+	STR_MULTIPOLYGON,
+	STR_NO,
+	STR_OUTER,
+	STR_PATH,
+	STR_PEDESTRIAN,
+	STR_PRIMARY,
+	STR_PRIMARY_LINK,
+	STR_PYRAMIDAL,
+	STR_RAIL,
+	STR_RESIDENTIAL,
+	STR_SECONDARY,
+	STR_SECONDARY_LINK,
+	STR_SERVICE,
+	STR_SKILLION,
+	STR_STEPS,
+	STR_STREET_LAMP,
+	STR_TERTIARY,
+	STR_TOWER,
+	STR_TRACK,
+	STR_TREE,
+	STR_TRUNK,
+	STR_TRUNK_LINK,
+	STR_YES,
+
+	STR_WELL_KNOWN_COUNT,
+};
+
+/**
+ * Global table of interned strings
+ *
+ * Maps each distinct string to small integer id, so tags may be
+ * stored and compared as integers. Strings are never removed.
+ *
+ * Intern(), Find() and GetCount() are serialized with a mutex
+ * and may be called from any thread. Get() takes no lock: strings
+ * are stored in pages which are never relocated, and table of
+ * pages is a fixed array which is never reallocated, but page
+ * pointer and string are written by the interning thread. So
+ * Get() may only be given ids the calling thread got from Intern()
+ * or Find() itself, or received from another thread through a
+ * lock or thread join (e.g. with data loaded by that thread); ids
+ * read without synchronization while strings are being added
+ * must not be passed to it.
+ */
+class StringTable : private NonCopyable {
+protected:
+	static const unsigned int PAGE_BITS = 16;
+	static const unsigned int PAGE_SIZE = 1 << PAGE_BITS;
+	static const unsigned int MAX_PAGES = 4096;
+
+	struct StrLess {
+		bool operator()(const char* a, const char* b) const {
+			return strcmp(a, b) < 0;
+		}
+	};
+
+	/* keys point into pages_, so strings are not duplicated */
+	typedef std::map<const char*, strid_t, StrLess> IdsMap;
+
+protected:
+	IdsMap ids_;
+	std::string* pages_[MAX_PAGES];
+	strid_t count_;
+
+	mutable pthread_mutex_t mutex_;
+
+protected:
+	StringTable();
+	~StringTable();
+
+public:
+	/**
+	 * Returns the table shared by all datasources
+	 */
+	static StringTable& Instance();
+
+	/**
+	 * Returns id of a string, adding it to the table if needed
+	 */
+	strid_t Intern(const char* str);
+
+	/**
+	 * Returns id of a string or STR_NONE if it was never interned
+	 */
+	strid_t Find(const char* str) const;
+
+	/**
+	 * Returns string by its id; see class description for
+	 * use from several threads
+	 */
+	const std::string& Get(strid_t id) const {
+		return pages_[id >> PAGE_BITS][id & (PAGE_SIZE - 1)];
+	}
+
+	/**
+	 * Returns number of strings in the table
+	 */
+	strid_t GetCount() const;
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TAGLIST_HH
+#define TAGLIST_HH
+
+#include <glosm/StringTable.hh>
+#include <glosm/Arena.hh>
+
+#include <vector>
+#include <algorithm>
+
+/**
+ * Compact set of OSM tags
+ *
+ * Stores tags as (key id, value id) pairs of interned strings,
+ * sorted by key id. Interface loosely follows std::map, but
+ * keys and values are strid_t's; use StringTable to get the
+ * actual strings.
+ *
+ * Once complete, tags may be moved into an Arena with MoveTo(),
+ * after which the list only holds a pointer to them; copies of
+ * such list share tags, and modifying one makes it private again.
+ */
+class TagList {
+public:
+	typedef std::pair<strid_t, strid_t> Tag;
+	typedef std::vector<Tag> TagVector;
+	typedef const Tag* const_iterator;
+
+protected:
+	struct KeyLess {
+		bool operator()(const Tag& a, strid_t b) const {
+			return a.first < b;
+		}
+	};
+
+protected:
+	TagVector tags_;
+
+	/* tags stored in an arena by MoveTo(); tags_ is empty then */
+	const Tag* stored_;
+	size_t stored_size_;
+
+protected:
+	void Unstore() {
+		if (stored_ != NULL) {
+			tags_.assign(stored_, stored_ + stored_size_);
+			stored_ = NULL;
+			stored_size_ = 0;
+		}
+	}
+
+public:
+	TagList() : stored_(NULL), stored_size_(0) {
+	}
+
+	const_iterator begin() const {
+		if (stored_ != NULL)
+			return stored_;
+		return tags_.empty() ? NULL : &tags_[0];
+	}
+
+	const_iterator end() const {
+		return begin() + size();
+	}
+
+	size_t size() const {
+		return stored_ != NULL ? stored_size_ : tags_.size();
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	/**
+	 * Adds a tag; like std::map::insert, does nothing if the
+	 * key is already present
+	 */
+	void insert(strid_t key, strid_t value) {
+		Unstore();
+		TagVector::iterator i = std::lower_bound(tags_.begin(), tags_.end(), key, KeyLess());
+		if (i == tags_.end() || i->first != key)
+			tags_.insert(i, Tag(key, value));
+	}
+
+	/**
+	 * Adds a tag, interning both strings
+	 */
+	void insert(const char* key, const char* value) {
+		StringTable& table = StringTable::Instance();
+		insert(table.Intern(key), table.Intern(value));
+	}
+
+	const_iterator find(strid_t key) const {
+		const_iterator i = std::lower_bound(begin(), end(), key, KeyLess());
+		if (i == end() || i->first != key)
+			return end();
+		return i;
+	}
+
+	const_iterator find(const char* key) const {
+		strid_t id = StringTable::Instance().Find(key);
+		if (id == STR_NONE)
+			return end();
+		return find(id);
+	}
+
+	/**
+	 * Returns value id for a given key, or STR_NONE if tag is absent
+	 */
+	strid_t Get(strid_t key) const {
+		const_iterator i = find(key);
+		return i == end() ? (strid_t)STR_NONE : i->second;
+	}
+
+	/**
+	 * Checks whether tag with given key is present
+	 */
+	bool Has(strid_t key) const {
+		return find(key) != end();
+	}
+
+	/**
+	 * Returns string value for a given key, or NULL if tag is absent
+	 */
+	const char* GetString(strid_t key) const {
+		const_iterator i = find(key);
+		return i == end() ? NULL : StringTable::Instance().Get(i->second).c_str();
+	}
+
+	/**
+	 * Frees unused capacity
+	 */
+	void Compact() {
+		TagVector(tags_).swap(tags_);
+	}
+
+	/**
+	 * Moves tags into an arena, freeing own storage
+	 *
+	 * Arena must outlive this list and all its copies.
+	 */
+	void MoveTo(Arena& arena) {
+		if (tags_.empty())
+			return;
+
+		stored_ = arena.Copy(&tags_[0], tags_.size());
+		stored_size_ = tags_.size();
+		TagVector().swap(tags_);
+	}
+
+	/**
+	 * Exchanges contents with another tag list
+	 */
+	void swap(TagList& other) {
+		tags_.swap(other.tags_);
+		std::swap(stored_, other.stored_);
+		std::swap(stored_size_, other.stored_size_);
+	}
+};
+
+#endif
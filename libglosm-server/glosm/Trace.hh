@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_HH
+#define TRACE_HH
+
+#include <stdint.h>
+
+/**
+ * Lightweight scoped tracing
+ *
+ * Code sections marked with TRACE_SCOPE() record their start
+ * time and duration into a ring buffer of the current thread,
+ * so recording takes no locks and old events are overwritten
+ * when buffer is full. Recorded events are written in Chrome
+ * trace JSON format, viewable with chrome://tracing or Perfetto,
+ * which shows how loading and rendering threads interleave.
+ *
+ * Scopes are compiled in only with -DWITH_TRACING=YES, and even
+ * then events are only recorded after Init() found GLOSM_TRACE
+ * environment variable.
+ */
+class Trace {
+public:
+	/**
+	 * Single finished scope
+	 */
+	struct Event {
+		/* static string */
+		const char* name;
+		/* microseconds, see Now() */
+		uint64_t start;
+		uint32_t duration;
+	};
+
+	/**
+	 * Starts recording if GLOSM_TRACE environment variable is set
+	 *
+	 * Variable names file events are written to at exit; in
+	 * child processes, their pid is appended to the name.
+	 */
+	static void Init();
+
+	/**
+	 * Starts recording events, to be written to a file at exit
+	 */
+	static void Start(const char* filename);
+
+	/**
+	 * Writes events recorded so far to a file
+	 *
+	 * Events being recorded concurrently may be missed. In
+	 * child processes, their pid is appended to the name.
+	 */
+	static void Write(const char* filename);
+
+	/**
+	 * Writes events to file given to Start(), if recording
+	 *
+	 * This is done at exit; processes which skip atexit
+	 * handlers, such as forked workers, call this explicitly.
+	 */
+	static void Flush();
+
+	/**
+	 * Returns whether events are recorded
+	 */
+	static bool IsEnabled() {
+		return enabled_;
+	}
+
+	/**
+	 * Returns microseconds of monotonic clock
+	 */
+	static uint64_t Now();
+
+	/**
+	 * Records finished scope into buffer of current thread
+	 *
+	 * Name must be a static string which needs no escaping
+	 * in JSON.
+	 */
+	static void Record(const char* name, uint64_t start, uint64_t end);
+
+protected:
+	static volatile bool enabled_;
+};
+
+/**
+ * Records lifetime of the object as a trace event
+ */
+class TraceScope {
+protected:
+	const char* name_;
+	uint64_t start_;
+
+public:
+	TraceScope(const char* name) : name_(name), start_(Trace::IsEnabled() ? Trace::Now() : 0) {
+	}
+
+	~TraceScope() {
+		if (start_ != 0)
+			Trace::Record(name_, start_, Trace::Now());
+	}
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/**
+ * Traces the rest of enclosing scope under given static name
+ */
+#if defined(WITH_TRACING)
+#	define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#	define TRACE_SCOPE(name) do {} while (0)
+#endif
+
+#endif
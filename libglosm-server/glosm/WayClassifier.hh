@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WAYCLASSIFIER_HH
+#define WAYCLASSIFIER_HH
+
+#include <glosm/OsmDatasource.hh>
+
+/**
+ * Fills render class and numeric render attributes of a way
+ *
+ * Parses tags once so geometry generator doesn't need to look
+ * at them for each requested tile. Should be called by OSM
+ * datasources for each complete way.
+ */
+void ClassifyWay(OsmDatasource::Way& way);
+
+/**
+ * Checks whether ways of given class are drawn as ground geometry
+ *
+ * Only these are drawn by geometry generator in absense of
+ * GeometryDatasource::DETAIL flag, so datasources keep only them
+ * in overview layers.
+ */
+bool IsGroundClass(OsmDatasource::Way::Class_t cls);
+
+/**
+ * Returns upper bound of height of geometry generated for a way
+ *
+ * Unlike Way::MaxHeight, this includes sloped roofs and default
+ * heights geometry generator uses. Way bbox must be calculated.
+ *
+ * @return height above ground in geometry units
+ */
+osmint_t GetWayTopHeight(const OsmDatasource::Way& way);
+
+#endif
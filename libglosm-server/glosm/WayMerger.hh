@@ -21,37 +21,97 @@
 #ifndef WAYMERGER_HH
 #define WAYMERGER_HH
 
-#include <map>
+#include <list>
 #include <vector>
 
-#include <glosm/osmtypes.h>
+#include <glosm/OsmDatasource.hh>
 
 /**
  * Class that merges complete ways from parts
  *
- * @note this currently only works with closed ways, but a
- *       flag(s) may be added to support e.g routes
+ * Chain endpoints are kept in an open addressing hash table, and
+ * chains are marked as used instead of being removed from it, so
+ * both lookup and removal are O(1). Merged way is first collected
+ * as a sequence of chains, and then copied into preallocated node
+ * list.
  */
 class WayMerger {
+public:
+	enum Flags {
+		/** Also return ways which couldn't be closed */
+		UNCLOSED_WAYS = 0x01,
+	};
+
 protected:
-	typedef std::multimap<osmid_t, const OsmDatasource::Way::NodesList*> WayByTipMap;
+	struct Chain {
+		const OsmDatasource::Way::NodesList* nodes;
+		bool used;
+	};
+
+	struct Endpoint {
+		osmid_t id;
+		unsigned int chain; /* index + 1; 0 for empty slot */
+		bool back;
+	};
 
-	typedef std::vector<osmid_t> NodeChain;
-	typedef std::vector<NodeChain> NodeChainVector;
+	/* chain taken into merged way, possibly reversed */
+	struct ChainRef {
+		unsigned int chain;
+		bool reverse;
+	};
+
+	typedef std::vector<Chain> ChainVector;
+	typedef std::vector<Endpoint> EndpointVector;
+	typedef std::vector<ChainRef> ChainRefVector;
 
 protected:
-	WayByTipMap way_by_node;
-	WayByTipMap way_by_node_rev;
+	int flags_;
+
+	ChainVector chains_;
+	EndpointVector endpoints_;
+	size_t indexed_chains_;
+
+	/* first nodes and indexes of chains, sorted, for picking start */
+	std::vector<std::pair<osmid_t, unsigned int> > start_order_;
+	size_t next_start_;
+
+	/* unpacked copies of ways added in packed form */
+	std::list<OsmDatasource::Way::NodesList> unpacked_;
+
+	ChainRefVector sequence_;
 
 public:
-	WayMerger();
+	WayMerger(int flags = 0);
 
 	void AddWay(const OsmDatasource::Way::NodesList& nodes);
 
+	/**
+	 * Adds a way with node refs in either form
+	 *
+	 * Plain node list is referenced, so it must outlive the merger
+	 */
+	void AddWay(const OsmDatasource::Way& way);
+
+	/**
+	 * Extracts next merged way
+	 *
+	 * @param outnodes node list to fill
+	 * @return false if there are no more ways
+	 */
 	bool GetNextWay(OsmDatasource::Way::NodesList& outnodes);
 
 protected:
-	const OsmDatasource::Way::NodesList* PickChain(osmid_t id = 0, bool reverse = false);
+	/**
+	 * Rebuilds endpoint table after ways were added
+	 */
+	void BuildIndex();
+
+	/**
+	 * Finds earliest added unused chain with given endpoint
+	 *
+	 * @return chain index + 1, or 0 if not found
+	 */
+	unsigned int FindChain(osmid_t id, bool back) const;
 };
 
 #endif
@@ -23,6 +23,8 @@
 
 #include <glosm/Exception.hh>
 
+#include <cstddef>
+
 /**
  * Excepion that denotes XML parsing error
  */
@@ -39,6 +41,25 @@ protected:
 		HANDLE_CHARDATA = 0x02,
 
 		HANDLE_ALL = 0xFF,
+
+		/**
+		 * Read input on a separate thread, so file I/O overlaps
+		 * with parsing
+		 */
+		READ_AHEAD = 0x100,
+
+		/**
+		 * Parse plain input files with built-in scanner instead
+		 * of Expat
+		 *
+		 * Scanner works on mmap'ed file and only supports subset
+		 * of XML used in OSM dumps (no DTD, CDATA or encodings
+		 * other than UTF-8), and does not validate input beyond
+		 * what's needed to extract elements. Compressed input,
+		 * stdin and unsupported documents are parsed with Expat.
+		 * Not used with HANDLE_CHARDATA.
+		 */
+		FAST_SCAN = 0x200,
 	};
 
 	int flags_;
@@ -74,6 +95,23 @@ protected:
 	 */
 	virtual void CharacterData(const char* data, int len);
 
+	/**
+	 * Parses file with built-in scanner
+	 *
+	 * @see FAST_SCAN
+	 * @return false if file can't be handled by the scanner and
+	 *         nothing was parsed yet
+	 */
+	bool LoadScanned(const char* filename);
+
+	/**
+	 * Parses in-memory document with built-in scanner
+	 *
+	 * @return false if document uses unsupported markup before
+	 *         first element
+	 */
+	bool Scan(const char* data, size_t size);
+
 protected:
 	/**
 	 * Constructs empty datasource
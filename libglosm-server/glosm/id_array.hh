@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ID_ARRAY_HH
+#define ID_ARRAY_HH
+
+#include <glosm/id_map.hh>
+#include <glosm/osmtypes.h>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * Container for objects with dense ids, indexed by id directly.
+ *
+ * Id space is split into pages of 2^PAGE_BITS ids, allocated
+ * on demand. A page starts sparse, as a sorted run of (low id
+ * bits, value) pairs, which is appended to in O(1) if ids come
+ * in ascending order, as they do in OSM dumps. Once sparse page
+ * gets larger than a flat array would be, it's converted to one,
+ * and lookup becomes a shift and an index. So a planet dump takes
+ * sizeof(T) per object plus a bit, while small extracts with ids
+ * scattered over the whole id space don't waste memory on mostly
+ * empty pages.
+ *
+ * Negative and very large ids are kept in a fallback id_map.
+ *
+ * Inserting an existing id replaces the value. Pointers returned
+ * by get() are invalidated by subsequent inserts.
+ */
+template <typename T, int PAGE_BITS = 16>
+class id_array {
+public:
+	typedef osmid_t key_type;
+	typedef T mapped_type;
+
+protected:
+	typedef uint16_t low_id_t;
+
+	static const size_t PAGE_SIZE = (size_t)1 << PAGE_BITS;
+	static const osmid_t PAGE_MASK = ((osmid_t)1 << PAGE_BITS) - 1;
+
+	/* ids above this go to fallback map, to limit the page table */
+	static const osmid_t MAX_ID = (osmid_t)1 << 36;
+
+	/* sparse page is converted to flat when it's no longer smaller */
+	static const size_t DENSE_THRESHOLD = PAGE_SIZE * sizeof(T) / (sizeof(T) + sizeof(low_id_t));
+
+	struct page {
+		/* sparse representation */
+		std::vector<low_id_t> ids;
+		std::vector<T> values;
+
+		/* flat representation */
+		std::vector<T> flat;
+		std::vector<uint32_t> present;
+
+		size_t count;
+
+		page() : count(0) {
+		}
+
+		bool is_flat() const {
+			return !flat.empty();
+		}
+
+		void make_flat() {
+			flat.resize(PAGE_SIZE);
+			present.resize(PAGE_SIZE / 32, 0);
+
+			for (size_t i = 0; i < ids.size(); ++i) {
+				flat[ids[i]] = values[i];
+				present[ids[i] / 32] |= 1U << (ids[i] % 32);
+			}
+
+			std::vector<low_id_t>().swap(ids);
+			std::vector<T>().swap(values);
+		}
+	};
+
+	typedef std::vector<page*> page_table;
+	typedef id_map<osmid_t, T> fallback_map;
+
+protected:
+	page_table pages_;
+	fallback_map fallback_;
+	size_t count_;
+
+private:
+	id_array(const id_array&);
+	id_array& operator=(const id_array&);
+
+public:
+	id_array() : count_(0) {
+		assert(PAGE_BITS <= 16);
+	}
+
+	~id_array() {
+		for (typename page_table::iterator p = pages_.begin(); p != pages_.end(); ++p)
+			delete *p;
+	}
+
+	/**
+	 * Adds or replaces value for given id
+	 *
+	 * @return true if id was not present before
+	 */
+	bool insert(osmid_t id, const T& value) {
+		if (id < 0 || id >= MAX_ID) {
+			typename fallback_map::iterator i = fallback_.find(id);
+			if (i != fallback_.end()) {
+				i->second = value;
+				return false;
+			}
+			fallback_.insert(std::make_pair(id, value));
+			++count_;
+			return true;
+		}
+
+		size_t pageno = (size_t)(id >> PAGE_BITS);
+		low_id_t low = (low_id_t)(id & PAGE_MASK);
+
+		if (pageno >= pages_.size())
+			pages_.resize(pageno + 1, NULL);
+		if (pages_[pageno] == NULL)
+			pages_[pageno] = new page;
+
+		page& p = *pages_[pageno];
+
+		if (p.is_flat()) {
+			uint32_t& word = p.present[low / 32];
+			uint32_t bit = 1U << (low % 32);
+			p.flat[low] = value;
+			if (word & bit)
+				return false;
+			word |= bit;
+		} else if (p.ids.empty() || p.ids.back() < low) {
+			/* fast path for sorted input */
+			p.ids.push_back(low);
+			p.values.push_back(value);
+		} else {
+			typename std::vector<low_id_t>::iterator pos = std::lower_bound(p.ids.begin(), p.ids.end(), low);
+			if (*pos == low) {
+				p.values[pos - p.ids.begin()] = value;
+				return false;
+			}
+			p.values.insert(p.values.begin() + (pos - p.ids.begin()), value);
+			p.ids.insert(pos, low);
+		}
+
+		++p.count;
+		++count_;
+
+		if (!p.is_flat() && p.count > DENSE_THRESHOLD)
+			p.make_flat();
+
+		return true;
+	}
+
+	/**
+	 * Adds or replaces value, std::map style
+	 */
+	bool insert(const std::pair<osmid_t, T>& v) {
+		return insert(v.first, v.second);
+	}
+
+	/**
+	 * Returns value for given id, or NULL if it's not present
+	 */
+	const T* get(osmid_t id) const {
+		if (id < 0 || id >= MAX_ID) {
+			typename fallback_map::const_iterator i = fallback_.find(id);
+			return i == fallback_.end() ? NULL : &i->second;
+		}
+
+		size_t pageno = (size_t)(id >> PAGE_BITS);
+		if (pageno >= pages_.size() || pages_[pageno] == NULL)
+			return NULL;
+
+		const page& p = *pages_[pageno];
+		low_id_t low = (low_id_t)(id & PAGE_MASK);
+
+		if (p.is_flat())
+			return (p.present[low / 32] & (1U << (low % 32))) ? &p.flat[low] : NULL;
+
+		typename std::vector<low_id_t>::const_iterator pos = std::lower_bound(p.ids.begin(), p.ids.end(), low);
+		if (pos == p.ids.end() || *pos != low)
+			return NULL;
+
+		return &p.values[pos - p.ids.begin()];
+	}
+
+	/**
+	 * Calls visitor for each stored value
+	 *
+	 * Visitor is any object with operator()(osmid_t, const T&)
+	 */
+	template <class V>
+	void for_each(V& visitor) const {
+		for (size_t pageno = 0; pageno < pages_.size(); ++pageno) {
+			const page* p = pages_[pageno];
+			if (p == NULL)
+				continue;
+
+			osmid_t base = (osmid_t)pageno << PAGE_BITS;
+			if (p->is_flat()) {
+				for (size_t i = 0; i < PAGE_SIZE; ++i)
+					if (p->present[i / 32] & (1U << (i % 32)))
+						visitor(base + i, p->flat[i]);
+			} else {
+				for (size_t i = 0; i < p->ids.size(); ++i)
+					visitor(base + p->ids[i], p->values[i]);
+			}
+		}
+
+		for (typename fallback_map::const_iterator i = fallback_.begin(); i != fallback_.end(); ++i)
+			visitor(i->first, i->second);
+	}
+
+	/**
+	 * Frees unused capacity of sparse pages
+	 */
+	void compact() {
+		for (typename page_table::iterator p = pages_.begin(); p != pages_.end(); ++p) {
+			if (*p != NULL && !(*p)->is_flat()) {
+				std::vector<low_id_t>((*p)->ids).swap((*p)->ids);
+				std::vector<T>((*p)->values).swap((*p)->values);
+			}
+		}
+	}
+
+	inline size_t size() const {
+		return count_;
+	}
+
+	inline bool empty() const {
+		return count_ == 0;
+	}
+
+	void clear() {
+		id_array().swap(*this);
+	}
+
+	void swap(id_array& other) {
+		pages_.swap(other.pages_);
+		fallback_.swap(other.fallback_);
+		std::swap(count_, other.count_);
+	}
+};
+
+#endif
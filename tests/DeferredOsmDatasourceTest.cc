@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that DeferredOsmDatasource has no data until
+ * datasource loaded in another thread is published, and then
+ * returns the same data as it.
+ */
+
+#include <glosm/DeferredOsmDatasource.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+
+#include "testing.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#ifndef TESTDATA_DIR
+#	define TESTDATA_DIR "../testdata"
+#endif
+
+struct LoadTask {
+	PreloadedXmlDatasource* datasource;
+	DeferredOsmDatasource* deferred;
+};
+
+static void* LoadThread(void* arg) {
+	LoadTask* task = static_cast<LoadTask*>(arg);
+	task->datasource->Load((std::string(TESTDATA_DIR) + "/glosm.osm").c_str());
+	task->deferred->Publish(*task->datasource);
+	return NULL;
+}
+
+static int CountWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+	return ways.size();
+}
+
+static bool SameBBox(const BBoxi& a, const BBoxi& b) {
+	return a.left == b.left && a.bottom == b.bottom && a.right == b.right && a.top == b.top;
+}
+
+BEGIN_TEST()
+	PreloadedXmlDatasource datasource;
+	DeferredOsmDatasource deferred;
+
+	/* nothing is available before publishing */
+	EXPECT_TRUE(!deferred.IsPublished());
+	EXPECT_INT(CountWays(deferred), 0);
+	EXPECT_TRUE(deferred.GetBBox().IsEmpty());
+	EXPECT_EXCEPTION(deferred.GetWay(1), DataException);
+	EXPECT_EXCEPTION(deferred.GetNode(1), DataException);
+	EXPECT_EXCEPTION(deferred.GetRelation(1), DataException);
+
+	LoadTask task = { &datasource, &deferred };
+	pthread_t thread;
+	EXPECT_INT(pthread_create(&thread, NULL, LoadThread, &task), 0);
+
+	/* users poll while data is being loaded */
+	while (!deferred.IsPublished())
+		usleep(1000);
+
+	pthread_join(thread, NULL);
+
+	/* then everything is forwarded */
+	EXPECT_TRUE(CountWays(datasource) > 0);
+	EXPECT_INT(CountWays(deferred), CountWays(datasource));
+	EXPECT_TRUE(SameBBox(deferred.GetBBox(), datasource.GetBBox()));
+	EXPECT_TRUE(deferred.GetCenter() == datasource.GetCenter());
+	EXPECT_INT(deferred.GetMaxHeight(), datasource.GetMaxHeight());
+
+	EXPECT_EXCEPTION(deferred.Publish(datasource), Exception);
+END_TEST()
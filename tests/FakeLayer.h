@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAKELAYER_H
+#define FAKELAYER_H
+
+/*
+ * GL-free tile and layer shared by TileManager tests
+ */
+
+#include <glosm/TileManager.hh>
+#include <glosm/Tile.hh>
+#include <glosm/MercatorProjection.hh>
+
+#include <unistd.h>
+
+/**
+ * Tile of given size which is uploaded when drawn or uploaded
+ */
+class FakeTile : public Tile {
+protected:
+	size_t size_;
+	bool uploaded_;
+
+public:
+	FakeTile(const Vector2i& ref, size_t size = 1) : Tile(ref), size_(size), uploaded_(false) {
+	}
+
+	virtual void Render() {
+		uploaded_ = true;
+	}
+
+	virtual void Render(TileShader& /*unused*/) {
+		uploaded_ = true;
+	}
+
+	virtual void Render(TileBatch& /*unused*/, const float /*unused*/[16]) {
+		uploaded_ = true;
+	}
+
+	virtual size_t GetSize() const {
+		return size_;
+	}
+
+	virtual size_t GetUploadSize() const {
+		return uploaded_ ? 0 : size_;
+	}
+
+	virtual void Upload() {
+		uploaded_ = true;
+	}
+
+	virtual void Upload(TileBatch& /*unused*/) {
+		uploaded_ = true;
+	}
+};
+
+/**
+ * Layer of level 2 FakeTiles
+ *
+ * Gives tests access to placing and destroying tiles, which
+ * Render() otherwise does with GL context.
+ */
+class FakeLayer : public TileManager {
+protected:
+	size_t tile_size_;
+
+public:
+	FakeLayer(size_t tile_size = 1) : TileManager(MercatorProjection()), tile_size_(tile_size) {
+		SetLevel(2);
+	}
+
+	virtual ~FakeLayer() {
+		/* loading threads call back into derived layers */
+		StopLoading();
+	}
+
+	virtual Tile* SpawnTile(const BBoxi& bbox, int /*unused*/) const {
+		return new FakeTile(bbox.GetCenter(), tile_size_);
+	}
+
+	/* places loaded tiles like Render() does; returns tile count */
+	size_t PlaceTiles() {
+		pthread_mutex_lock(&tiles_mutex_);
+		PlaceFinishedTiles(true);
+		size_t placed = tile_count_;
+		pthread_mutex_unlock(&tiles_mutex_);
+		return placed;
+	}
+
+	/* places tiles until there are given number of them; gives
+	 * up after 5 seconds */
+	bool WaitForTiles(size_t count) {
+		for (int i = 0; i < 500; ++i) {
+			if (PlaceTiles() >= count)
+				return true;
+			usleep(10000);
+		}
+		return false;
+	}
+
+	/* gives each tile an impostor without image, like
+	 * RenderImpostor() does for distant ones; returns bytes of
+	 * a single impostor */
+	size_t AddImpostors() {
+		pthread_mutex_lock(&tiles_mutex_);
+		for (QuadNode* node = lru_head_; node != NULL; node = node->lru_next)
+			if (!node->impostor)
+				node->impostor = impostors_.Create();
+		pthread_mutex_unlock(&tiles_mutex_);
+		return impostors_.GetImpostorSize();
+	}
+
+	/* destroys dropped tiles like Render() does */
+	void Reclaim() {
+		pthread_mutex_lock(&tiles_mutex_);
+		BeginMaintenance();
+		ReclaimTiles(reclaim_.size());
+		EndMaintenance();
+		pthread_mutex_unlock(&tiles_mutex_);
+	}
+};
+
+static inline TileManager::Statistics GetStats(const TileManager& layer) {
+	TileManager::Statistics stats;
+	layer.GetStatistics(stats);
+	return stats;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that layers attached to a frame scheduler stop
+ * garbage collection and tile destruction when their share of the
+ * frame budget is used up, still doing one step per call, and that
+ * overruns are counted.
+ */
+
+#include <glosm/FrameScheduler.hh>
+
+#include "FakeLayer.h"
+#include "testing.h"
+
+static FrameScheduler::Statistics GetStats(const FrameScheduler& scheduler) {
+	FrameScheduler::Statistics stats;
+	scheduler.GetStatistics(stats);
+	return stats;
+}
+
+/* loads five tiles of which only the last is needed */
+static void LoadUnneeded(FakeLayer& layer) {
+	for (int i = 0; i < 5; ++i)
+		layer.LoadArea(BBoxi::ForGeoTile(4, 1 + i % 4 * 4, 1 + i / 4 * 4), TileManager::SYNC);
+	layer.SetSizeLimit(1);
+}
+
+BEGIN_TEST()
+	{
+		// budget is split between attached layers
+		FrameScheduler scheduler(0.01f);
+		EXPECT_TRUE(scheduler.GetShare() == 0.01f);
+
+		FakeLayer a, b;
+		a.SetScheduler(&scheduler);
+		b.SetScheduler(&scheduler);
+		EXPECT_TRUE(scheduler.GetShare() == 0.005f);
+		b.SetScheduler(NULL);
+		EXPECT_TRUE(scheduler.GetShare() == 0.01f);
+
+		// frame over the budget is counted when next one begins
+		scheduler.BeginFrame();
+		scheduler.Charge(0.004);
+		scheduler.BeginFrame();
+		scheduler.Charge(0.02);
+		EXPECT_INT(GetStats(scheduler).overruns, 0);
+		scheduler.BeginFrame();
+		EXPECT_INT(GetStats(scheduler).frames, 3);
+		EXPECT_INT(GetStats(scheduler).overruns, 1);
+		EXPECT_TRUE(GetStats(scheduler).max_time == 0.02f);
+	}
+
+	{
+		// without scheduler, all unneeded tiles are evicted at once
+		FakeLayer layer;
+		LoadUnneeded(layer);
+		layer.GarbageCollect();
+		EXPECT_INT(GetStats(layer).tiles, 1);
+		EXPECT_INT(GetStats(layer).maintenance_overruns, 0);
+	}
+
+	{
+		// with no time to spare, one tile is dropped per frame
+		FrameScheduler scheduler(0.0f);
+		FakeLayer layer;
+		layer.SetScheduler(&scheduler);
+		LoadUnneeded(layer);
+
+		scheduler.BeginFrame();
+		layer.GarbageCollect();
+		EXPECT_INT(GetStats(layer).tiles, 4);
+		layer.GarbageCollect();
+		EXPECT_INT(GetStats(layer).tiles, 3);
+
+		scheduler.BeginFrame();
+		layer.GarbageCollect();
+		EXPECT_INT(GetStats(layer).tiles, 2);
+		EXPECT_INT(GetStats(layer).maintenance_overruns, 1);
+
+		// and so is destroyed
+		EXPECT_INT(GetStats(layer).reclaiming, 3);
+		layer.Reclaim();
+		EXPECT_INT(GetStats(layer).reclaiming, 2);
+
+		EXPECT_TRUE(GetStats(layer).maintenance_time > 0.0);
+		EXPECT_TRUE(GetStats(scheduler).time == GetStats(layer).maintenance_time);
+	}
+END_TEST()
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that PreloadedGPXDatasource returns exactly
+ * the same points as a linear scan does, including points from
+ * several loaded files, and that tracks returned for a set of
+ * adjacent bboxes contain each track segment exactly once.
+ */
+
+#include <glosm/PreloadedGPXDatasource.hh>
+#include <glosm/Exception.hh>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct ComparePoints {
+	bool operator()(const Vector3i& a, const Vector3i& b) const {
+		if (a.x != b.x)
+			return a.x < b.x;
+		if (a.y != b.y)
+			return a.y < b.y;
+		return a.z < b.z;
+	}
+};
+
+/* writes track segments of random walk points, which are also appended to points */
+static std::string WriteTrack(const std::string& dir, const char* name, int nsegments, int npoints, std::vector<Vector3i>& points) {
+	std::string path = dir + "/" + name;
+	FILE* f = fopen(path.c_str(), "w");
+	if (f == NULL)
+		throw SystemError() << "cannot create " << path;
+
+	fprintf(f, "<gpx>\n <trk>\n");
+
+	int lon = 100000000 + rand() % 10000000, lat = 500000000 + rand() % 10000000;
+	for (int s = 0; s < nsegments; ++s) {
+		fprintf(f, "  <trkseg>\n");
+		for (int i = 0; i < npoints; ++i) {
+			lon += rand() % 2001 - 1000;
+			lat += rand() % 2001 - 1000;
+			int ele = rand() % 1000;
+			fprintf(f, "   <trkpt lat='%d.%07d' lon='%d.%07d'><ele>%d</ele></trkpt>\n", lat / 10000000, lat % 10000000, lon / 10000000, lon % 10000000, ele);
+			points.push_back(Vector3i(lon, lat, ele * 100));
+		}
+		fprintf(f, "  </trkseg>\n");
+	}
+
+	fprintf(f, " </trk>\n</gpx>\n");
+	fclose(f);
+	return path;
+}
+
+BEGIN_TEST()
+	srand(1);
+
+	TempDir dir("gpx");
+
+	std::vector<Vector3i> points;
+	std::string first = WriteTrack(dir.GetPath(), "first.gpx", 2, 10000, points);
+	std::string second = WriteTrack(dir.GetPath(), "second.gpx", 1, 1000, points);
+	size_t nsegments = 3;
+
+	PreloadedGPXDatasource datasource;
+	datasource.Load(first.c_str());
+	datasource.Load(second.c_str());
+
+	std::vector<Vector3i> all;
+	datasource.GetPoints(all, BBoxi::ForEarth());
+	EXPECT_INT((int)all.size(), (int)points.size());
+
+	int mismatches = 0;
+	int nonempty = 0;
+	for (int q = 0; q < 200; ++q) {
+		const Vector3i& center = points[rand() % points.size()];
+		int size = rand() % 100000;
+		BBoxi query(center.x - size, center.y - size, center.x + size, center.y + size);
+
+		std::vector<Vector3i> found;
+		datasource.GetPoints(found, query);
+		std::sort(found.begin(), found.end(), ComparePoints());
+
+		std::vector<Vector3i> expected;
+		for (std::vector<Vector3i>::const_iterator i = points.begin(); i != points.end(); ++i)
+			if (query.Contains(*i))
+				expected.push_back(*i);
+		std::sort(expected.begin(), expected.end(), ComparePoints());
+
+		if (!expected.empty())
+			nonempty++;
+		if (found != expected)
+			mismatches++;
+	}
+
+	EXPECT_INT(mismatches, 0);
+	EXPECT_TRUE(nonempty > 100);
+
+	/* tracks of non-overlapping bboxes covering all points */
+	BBoxi bounds = BBoxi::Empty();
+	for (std::vector<Vector3i>::const_iterator i = points.begin(); i != points.end(); ++i)
+		bounds.Include(*i);
+
+	static const int cell = 100000;
+	size_t full_segments = 0, full_points = 0, overview_points = 0;
+	int outside = 0;
+	for (osmint_t x = bounds.left; x <= bounds.right; x += cell) {
+		for (osmint_t y = bounds.bottom; y <= bounds.top; y += cell) {
+			BBoxi query(x, y, x + cell - 1, y + cell - 1);
+
+			std::vector<Vector3i> track;
+			std::vector<size_t> lengths;
+			datasource.GetTracks(track, lengths, query, 20);
+
+			size_t first = 0;
+			for (std::vector<size_t>::const_iterator i = lengths.begin(); i != lengths.end(); ++i) {
+				for (size_t j = first; j < first + *i - 1; ++j)
+					if (!query.Contains(track[j]))
+						outside++;
+				if (query.Contains(track[first + *i - 1]))
+					full_points++;
+				full_points += *i - 1;
+				full_segments += *i - 1;
+				first += *i;
+			}
+
+			track.clear();
+			lengths.clear();
+			datasource.GetTracks(track, lengths, query, 8);
+			for (std::vector<Vector3i>::const_iterator i = track.begin(); i != track.end(); ++i)
+				if (query.Contains(*i))
+					overview_points++;
+		}
+	}
+
+	EXPECT_INT(outside, 0);
+	EXPECT_INT(full_segments, (int)(points.size() - nsegments));
+	EXPECT_INT(full_points, (int)points.size());
+	EXPECT_TRUE(overview_points < points.size() / 10);
+	EXPECT_TRUE(overview_points >= 2 * nsegments);
+END_TEST()
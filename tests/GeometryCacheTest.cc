@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that GeometryCache returns the same geometry
+ * as its source, serves repeated requests from cache, keeps
+ * within its size limit and doesn't keep geometry which was
+ * being generated while cache was invalidated.
+ */
+
+#include <glosm/GeometryCache.hh>
+
+#include "testing.h"
+
+class CountingDatasource : public GeometryDatasource {
+public:
+	mutable int requests;
+
+	CountingDatasource() : requests(0) {
+	}
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+		requests++;
+		for (int i = 0; i < 10; ++i)
+			geometry.AddLine(Vector3i(bbox.left, bbox.bottom, i), Vector3i(bbox.right, bbox.top, flags));
+	}
+};
+
+/* clears cache while generating geometry, like another thread would */
+class ClearingDatasource : public CountingDatasource {
+public:
+	GeometryCache* cache;
+
+	ClearingDatasource() : cache(NULL) {
+	}
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+		CountingDatasource::GetGeometry(geometry, bbox, flags);
+		if (cache != NULL)
+			cache->Clear();
+	}
+};
+
+BEGIN_TEST()
+	CountingDatasource source;
+	GeometryCache cache(source, 1024 * 1024);
+
+	BBoxi bbox1 = BBoxi::ForGeoTile(12, 100, 200);
+	BBoxi bbox2 = BBoxi::ForGeoTile(12, 101, 200);
+
+	// miss, then hit
+	{
+		Geometry expected, first, second;
+		source.GetGeometry(expected, bbox1, 1);
+		source.requests = 0;
+
+		cache.GetGeometry(first, bbox1, 1);
+		cache.GetGeometry(second, bbox1, 1);
+
+		EXPECT_INT(source.requests, 1);
+		EXPECT_INT(cache.GetHits(), 1);
+		EXPECT_INT(cache.GetMisses(), 1);
+		EXPECT_TRUE(first.GetLinesVertices() == expected.GetLinesVertices());
+		EXPECT_TRUE(second.GetLinesVertices() == expected.GetLinesVertices());
+	}
+
+	// flags and bbox are both part of the key
+	{
+		Geometry geom;
+		cache.GetGeometry(geom, bbox1, 2);
+		cache.GetGeometry(geom, bbox2, 1);
+
+		EXPECT_INT(source.requests, 3);
+	}
+
+	// size limit; all entries are of the same size
+	{
+		size_t entry_size = cache.GetSize() / 3;
+		cache.SetSizeLimit(entry_size);
+
+		EXPECT_INT(cache.GetSize(), (int)entry_size);
+
+		/* only most recently used entry is left */
+		Geometry geom;
+		cache.GetGeometry(geom, bbox2, 1);
+		EXPECT_INT(source.requests, 3);
+
+		cache.GetGeometry(geom, bbox1, 1);
+		EXPECT_INT(source.requests, 4);
+		EXPECT_INT(cache.GetSize(), (int)entry_size);
+	}
+
+	// invalidate drops only entries intersecting given area
+	{
+		cache.SetSizeLimit(1024 * 1024);
+
+		/* bbox1 is cached, bbox2 is not */
+		Geometry geom;
+		cache.GetGeometry(geom, bbox2, 1);
+		EXPECT_INT(source.requests, 5);
+
+		BBoxi inner(bbox1.left + 10, bbox1.bottom + 10, bbox1.left + 20, bbox1.bottom + 20);
+		cache.Invalidate(inner);
+
+		cache.GetGeometry(geom, bbox2, 1);
+		EXPECT_INT(source.requests, 5);
+		cache.GetGeometry(geom, bbox1, 1);
+		EXPECT_INT(source.requests, 6);
+	}
+
+	// clear
+	{
+		cache.Clear();
+		EXPECT_INT(cache.GetSize(), 0);
+
+		Geometry geom;
+		cache.GetGeometry(geom, bbox2, 1);
+		EXPECT_INT(source.requests, 7);
+	}
+
+	// geometry generated before invalidation is not cached
+	{
+		ClearingDatasource clearing;
+		GeometryCache racy(clearing, 1024 * 1024);
+		clearing.cache = &racy;
+
+		Geometry geom;
+		racy.GetGeometry(geom, bbox1, 1);
+		EXPECT_INT(racy.GetSize(), 0);
+		EXPECT_INT(geom.GetLinesLengths().size(), 10);
+
+		clearing.cache = NULL;
+		racy.GetGeometry(geom, bbox1, 1);
+		racy.GetGeometry(geom, bbox1, 1);
+		EXPECT_INT(clearing.requests, 2);
+	}
+END_TEST()
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that convex polygons are cropped by bbox
+ * correctly: output lies within bbox, keeps winding and has
+ * expected area. Also checks that instances are kept by their
+ * position only.
+ */
+
+#include <glosm/Geometry.hh>
+#include <glosm/Model.hh>
+
+#include "testing.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+/* doubled signed area of all convex polygons */
+static double TotalArea(const Geometry& geometry) {
+	const Geometry::VertexVector& v = geometry.GetConvexVertices();
+	double area = 0.0;
+	for (unsigned int i = 0, cur = 0; i < geometry.GetConvexLengths().size(); cur += geometry.GetConvexLengths()[i++]) {
+		int size = geometry.GetConvexLengths()[i];
+		for (int j = 0; j < size; ++j) {
+			const Vector3i& a = v[cur + j];
+			const Vector3i& b = v[cur + (j + 1) % size];
+			area += (double)a.x * b.y - (double)b.x * a.y;
+		}
+	}
+	return area;
+}
+
+static bool SameGeometry(const Geometry& a, const Geometry& b) {
+	return a.GetLinesVertices() == b.GetLinesVertices() && a.GetLinesLengths() == b.GetLinesLengths() &&
+		a.GetConvexVertices() == b.GetConvexVertices() && a.GetConvexLengths() == b.GetConvexLengths() &&
+		a.GetInstances().size() == b.GetInstances().size();
+}
+
+static bool AllInside(const Geometry& geometry, const BBoxi& bbox) {
+	for (Geometry::VertexVector::const_iterator i = geometry.GetConvexVertices().begin(); i != geometry.GetConvexVertices().end(); ++i)
+		if (!bbox.Contains(*i))
+			return false;
+	return true;
+}
+
+BEGIN_TEST()
+	BBoxi bbox(0, 0, 1000, 1000);
+
+	/* square crossing each side and corner in turn */
+	for (int dx = -1; dx <= 1; ++dx) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			Geometry geometry;
+			Vector3i v[4] = {
+				Vector3i(250 + dx * 500, 250 + dy * 500, 0),
+				Vector3i(750 + dx * 500, 250 + dy * 500, 0),
+				Vector3i(750 + dx * 500, 750 + dy * 500, 0),
+				Vector3i(250 + dx * 500, 750 + dy * 500, 0),
+			};
+			geometry.AddCroppedConvex(v, 4, bbox);
+
+			EXPECT_INT(geometry.GetConvexLengths().size(), 1);
+			EXPECT_TRUE(AllInside(geometry, bbox));
+			EXPECT_TRUE(TotalArea(geometry) == 2.0 * 500.0 * 500.0 / ((dx ? 2 : 1) * (dy ? 2 : 1)));
+		}
+	}
+
+	/* fully outside and touching polygons are dropped */
+	{
+		Geometry geometry;
+		Vector3i outside[3] = { Vector3i(2000, 0, 0), Vector3i(3000, 0, 0), Vector3i(2000, 1000, 0) };
+		Vector3i touching[3] = { Vector3i(1000, 0, 0), Vector3i(2000, 0, 0), Vector3i(2000, 1000, 0) };
+		geometry.AddCroppedConvex(outside, 3, bbox);
+		geometry.AddCroppedConvex(touching, 3, bbox);
+		EXPECT_INT(geometry.GetConvexLengths().size(), 0);
+	}
+
+	/* triangle covering whole bbox becomes the bbox */
+	{
+		Geometry geometry;
+		Vector3i v[3] = { Vector3i(-1000, -1000, 0), Vector3i(4000, -1000, 0), Vector3i(-1000, 4000, 0) };
+		geometry.AddCroppedConvex(v, 3, bbox);
+		EXPECT_INT(geometry.GetConvexVertices().size(), 4);
+		EXPECT_TRUE(TotalArea(geometry) == 2.0 * 1000.0 * 1000.0);
+	}
+
+	/* large polygon which doesn't fit on-stack buffers */
+	{
+		Geometry geometry;
+		std::vector<Vector3i> v;
+		for (int i = 0; i < 100; ++i)
+			v.push_back(Vector3i(500 + (int)(1000.0 * cos(2.0 * M_PI * i / 100)), 500 + (int)(1000.0 * sin(2.0 * M_PI * i / 100)), 0));
+		geometry.AddCroppedConvex(&v[0], v.size(), bbox);
+		EXPECT_INT(geometry.GetConvexLengths().size(), 1);
+		EXPECT_TRUE(AllInside(geometry, bbox));
+		EXPECT_TRUE(TotalArea(geometry) > 0.0 && TotalArea(geometry) <= 2.0 * 1000.0 * 1000.0);
+	}
+
+	/* instances on left and bottom edges belong to bbox, on
+	 * right and top ones to neighbour tiles */
+	{
+		Geometry source, cropped;
+		source.AddInstance(Model::POWER_TOWER, Vector3i(500, 500, 0), Vector2f(1.0f, 0.0f));
+		source.AddInstance(Model::POWER_TOWER, Vector3i(0, 0, 0), Vector2f(1.0f, 0.0f));
+		source.AddInstance(Model::POWER_TOWER, Vector3i(1000, 500, 0), Vector2f(1.0f, 0.0f));
+		source.AddInstance(Model::POWER_TOWER, Vector3i(500, 1000, 0), Vector2f(1.0f, 0.0f));
+		source.AddInstance(Model::POWER_TOWER, Vector3i(-1, 500, 0), Vector2f(1.0f, 0.0f));
+		cropped.AppendCropped(source, bbox);
+
+		EXPECT_INT(cropped.GetInstances().size(), 2);
+		EXPECT_TRUE(cropped.GetInstances()[0] == source.GetInstances()[0]);
+		EXPECT_TRUE(cropped.GetInstances()[1] == source.GetInstances()[1]);
+	}
+
+	/* in-place crop gives the same result as cropping copy */
+	{
+		srand(1);
+		Geometry source;
+		for (int i = 0; i < 1000; ++i) {
+			int cx = rand() % 3000 - 1000, cy = rand() % 3000 - 1000, r = rand() % 500 + 1;
+			source.AddQuad(Vector3i(cx - r, cy - r, i), Vector3i(cx + r, cy - r, i), Vector3i(cx + r, cy + r, i), Vector3i(cx - r, cy + r, i));
+
+			std::vector<Vector3i> line;
+			for (int j = rand() % 6; j >= 0; --j)
+				line.push_back(Vector3i(rand() % 3000 - 1000, rand() % 3000 - 1000, i));
+			source.AddLine(line);
+		}
+
+		Geometry copied, cropped = source, moved;
+		copied.AppendCropped(source, bbox);
+		cropped.Crop(bbox);
+		EXPECT_TRUE(SameGeometry(copied, cropped));
+
+		/* runs of contained primitives give the same result as
+		 * cropping primitives one by one */
+		Geometry one_by_one;
+		for (size_t i = 0, pos = 0; i < source.GetLinesLengths().size(); pos += source.GetLinesLengths()[i++])
+			one_by_one.AddCroppedLine(&source.GetLinesVertices()[pos], source.GetLinesLengths()[i], bbox);
+		for (size_t i = 0, pos = 0; i < source.GetConvexLengths().size(); pos += source.GetConvexLengths()[i++])
+			one_by_one.AddCroppedConvex(&source.GetConvexVertices()[pos], source.GetConvexLengths()[i], bbox);
+		EXPECT_TRUE(SameGeometry(copied, one_by_one));
+
+		Geometry consumed = source;
+		moved.MoveCropped(consumed, bbox);
+		EXPECT_TRUE(SameGeometry(copied, moved));
+		EXPECT_TRUE(consumed.GetConvexLengths().empty() && consumed.GetLinesLengths().empty());
+	}
+END_TEST()
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that Geometry survives serialization roundtrip,
+ * that malformed data is rejected, and that GeometryDiskCache
+ * reuses geometry stored by another instance.
+ */
+
+#include <glosm/GeometryDiskCache.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Model.hh>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+class CountingDatasource : public GeometryDatasource {
+public:
+	mutable int requests;
+
+	CountingDatasource() : requests(0) {
+	}
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+		requests++;
+		for (int i = 0; i < 10; ++i)
+			geometry.AddLine(Vector3i(bbox.left, bbox.bottom, i), Vector3i(bbox.right, bbox.top, flags));
+		geometry.AddQuad(Vector3i(bbox.left, bbox.bottom), Vector3i(bbox.right, bbox.bottom), Vector3i(bbox.right, bbox.top), Vector3i(bbox.left, bbox.top, -1000));
+		geometry.AddInstance(Model::POWER_TOWER, Vector3i(bbox.left, bbox.top, 50), Vector2f(0.6f, -0.8f));
+	}
+};
+
+static bool SameGeometry(const Geometry& a, const Geometry& b) {
+	return a.GetLinesVertices() == b.GetLinesVertices() && a.GetLinesLengths() == b.GetLinesLengths() &&
+		a.GetConvexVertices() == b.GetConvexVertices() && a.GetConvexLengths() == b.GetConvexLengths() &&
+		a.GetInstances() == b.GetInstances();
+}
+
+BEGIN_TEST()
+	CountingDatasource source;
+	BBoxi bbox1 = BBoxi::ForGeoTile(12, 100, 200);
+	BBoxi bbox2 = BBoxi::ForGeoTile(12, 101, 200);
+
+	// roundtrip
+	{
+		Geometry original, restored;
+		source.GetGeometry(original, BBoxi::ForEarth(), 3);
+		restored.AddLine(Vector3i(1, 2, 3), Vector3i(4, 5, 6));
+
+		std::vector<unsigned char> data;
+		original.Serialize(data);
+		restored.DeSerialize(&data[0], data.size());
+
+		EXPECT_TRUE(SameGeometry(original, restored));
+	}
+
+	// empty geometry
+	{
+		Geometry original, restored;
+		std::vector<unsigned char> data;
+		original.Serialize(data);
+		restored.DeSerialize(&data[0], data.size());
+
+		EXPECT_TRUE(restored.GetLinesVertices().empty());
+		EXPECT_TRUE(restored.GetConvexVertices().empty());
+		EXPECT_TRUE(restored.GetInstances().empty());
+	}
+
+	// malformed data is rejected at any truncation point
+	{
+		Geometry original;
+		source.GetGeometry(original, bbox1, 0);
+
+		std::vector<unsigned char> data;
+		original.Serialize(data);
+
+		int rejected = 0;
+		for (size_t size = 0; size < data.size(); ++size) {
+			Geometry restored;
+			try {
+				restored.DeSerialize(&data[0], size);
+			} catch (Exception&) {
+				rejected++;
+			}
+		}
+		EXPECT_INT(rejected, (int)data.size());
+	}
+
+	// disk cache
+	{
+		TempDir dir("diskcache");
+
+		source.requests = 0;
+
+		{
+			GeometryDiskCache cache(source, dir.GetPath().c_str(), "dataset1");
+			Geometry geom;
+			cache.GetGeometry(geom, bbox1, 1);
+			cache.GetGeometry(geom, bbox2, 1);
+			EXPECT_INT(cache.GetMisses(), 2);
+		}
+		EXPECT_INT(source.requests, 2);
+
+		/* same dataset in another instance: served from disk */
+		{
+			GeometryDiskCache cache(source, dir.GetPath().c_str(), "dataset1");
+			Geometry expected, geom;
+			source.GetGeometry(expected, bbox1, 1);
+			cache.GetGeometry(geom, bbox1, 1);
+
+			EXPECT_INT(cache.GetHits(), 1);
+			EXPECT_TRUE(SameGeometry(expected, geom));
+		}
+		EXPECT_INT(source.requests, 3);
+
+		/* flags and dataset are part of the key */
+		{
+			GeometryDiskCache cache(source, dir.GetPath().c_str(), "dataset1");
+			Geometry geom;
+			cache.GetGeometry(geom, bbox1, 2);
+
+			GeometryDiskCache other(source, dir.GetPath().c_str(), "dataset2");
+			other.GetGeometry(geom, bbox1, 1);
+
+			EXPECT_INT(cache.GetHits() + other.GetHits(), 0);
+		}
+		EXPECT_INT(source.requests, 5);
+	}
+END_TEST()
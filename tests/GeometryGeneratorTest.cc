@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that GeometryGenerator which reuses its
+ * buffers between requests produces the same geometry as a
+ * fresh one for each request, and that precomputed building
+ * elevations give the same geometry as sampling terrain during
+ * generation, and that flat roofs of convex quad buildings are
+ * emitted as single upward facing quads.
+ */
+
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/DummyHeightmap.hh>
+#include <glosm/HeightmapDatasource.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/Exception.hh>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#ifndef TESTDATA_DIR
+#	define TESTDATA_DIR "../testdata"
+#endif
+
+static bool SameGeometry(const Geometry& a, const Geometry& b) {
+	return a.GetLinesVertices() == b.GetLinesVertices() && a.GetLinesLengths() == b.GetLinesLengths() &&
+		a.GetConvexVertices() == b.GetConvexVertices() && a.GetConvexLengths() == b.GetConvexLengths() &&
+		a.GetInstances() == b.GetInstances();
+}
+
+/* clockwise and counter-clockwise flat roofs, and a gabled one */
+static const char* QUADS_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.000' lon='20.000'/>\n"
+	" <node id='2' lat='10.001' lon='20.000'/>\n"
+	" <node id='3' lat='10.001' lon='20.002'/>\n"
+	" <node id='4' lat='10.000' lon='20.002'/>\n"
+	" <node id='5' lat='10.010' lon='20.010'/>\n"
+	" <node id='6' lat='10.010' lon='20.012'/>\n"
+	" <node id='7' lat='10.011' lon='20.012'/>\n"
+	" <node id='8' lat='10.011' lon='20.010'/>\n"
+	" <node id='9' lat='10.020' lon='20.020'/>\n"
+	" <node id='10' lat='10.020' lon='20.022'/>\n"
+	" <node id='11' lat='10.021' lon='20.022'/>\n"
+	" <node id='12' lat='10.021' lon='20.020'/>\n"
+	" <way id='1'><nd ref='1'/><nd ref='2'/><nd ref='3'/><nd ref='4'/><nd ref='1'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	" <way id='2'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='5'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	" <way id='3'><nd ref='9'/><nd ref='10'/><nd ref='11'/><nd ref='12'/><nd ref='9'/><tag k='building' v='yes'/><tag k='height' v='10'/><tag k='roof:shape' v='gabled'/></way>\n"
+	"</osm>\n";
+
+/* uneven terrain which counts points it was asked for */
+class SlopeHeightmap : public HeightmapDatasource {
+public:
+	mutable int samples;
+
+public:
+	SlopeHeightmap() : samples(0) {
+	}
+
+	virtual void GetHeightmap(const BBoxi& /*unused*/, int /*unused*/, Heightmap& /*unused*/) const {
+	}
+
+	virtual osmint_t GetHeight(const Vector2i& where) const {
+		samples++;
+		return (where.x / 100) % 1000 + (where.y / 300) % 1000;
+	}
+};
+
+/* terrain which is not available */
+class FailingHeightmap : public HeightmapDatasource {
+public:
+	virtual void GetHeightmap(const BBoxi& /*unused*/, int /*unused*/, Heightmap& /*unused*/) const {
+		throw Exception() << "no terrain";
+	}
+
+	virtual osmint_t GetHeight(const Vector2i& /*unused*/) const {
+		throw Exception() << "no terrain";
+	}
+};
+
+/* row of square buildings, enough to be split between threads */
+static std::string MakeBuildings(int count) {
+	std::string osm = "<osm>\n";
+	char buf[256];
+	for (int i = 0; i < count; ++i) {
+		for (int n = 0; n < 4; ++n) {
+			snprintf(buf, sizeof(buf), " <node id='%d' lat='%.4f' lon='%.4f'/>\n", i * 4 + n + 1, 10.0 + (n / 2) * 0.0001, 20.0 + i * 0.0002 + ((n + 1) / 2 % 2) * 0.0001);
+			osm += buf;
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		snprintf(buf, sizeof(buf), " <way id='%d'><nd ref='%d'/><nd ref='%d'/><nd ref='%d'/><nd ref='%d'/><nd ref='%d'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n", i + 1, i * 4 + 1, i * 4 + 2, i * 4 + 3, i * 4 + 4, i * 4 + 1);
+		osm += buf;
+	}
+	return osm + "</osm>\n";
+}
+
+BEGIN_TEST()
+	PreloadedXmlDatasource datasource;
+	datasource.Load((std::string(TESTDATA_DIR) + "/glosm.osm").c_str());
+	DummyHeightmap heightmap;
+
+	/* tiles around the dump, so some are empty */
+	std::vector<BBoxi> tiles;
+	BBoxi bbox = datasource.GetBBox();
+	for (int x = 0; x < (1 << 16); ++x) {
+		BBoxi tile = BBoxi::ForGeoTile(16, x, 0);
+		if (tile.right < bbox.left || tile.left > bbox.right)
+			continue;
+		for (int y = 0; y < (1 << 16); ++y) {
+			tile = BBoxi::ForGeoTile(16, x, y);
+			if (tile.Intersects(bbox))
+				tiles.push_back(tile);
+		}
+	}
+
+	EXPECT_TRUE(tiles.size() > 4);
+
+	int flags[] = { GeometryDatasource::DETAIL, GeometryDatasource::GROUND, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY };
+
+	for (int threads = 1; threads <= 4; threads += 3) {
+		GeometryGenerator reused(datasource, heightmap);
+		reused.SetWayCacheLimit(0);
+		reused.SetThreads(threads);
+
+		int mismatches = 0;
+		for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); ++f) {
+			for (size_t i = 0; i < tiles.size(); ++i) {
+				GeometryGenerator fresh(datasource, heightmap);
+				fresh.SetWayCacheLimit(0);
+
+				Geometry expected, got;
+				fresh.GetGeometry(expected, tiles[i], flags[f]);
+				reused.GetGeometry(got, tiles[i], flags[f]);
+
+				if (!SameGeometry(expected, got))
+					mismatches++;
+			}
+		}
+
+		EXPECT_INT(mismatches, 0);
+	}
+
+	/* precomputed elevations */
+	{
+		SlopeHeightmap slope;
+
+		GeometryGenerator sampling(datasource, slope);
+		sampling.SetWayCacheLimit(0);
+
+		GeometryGenerator precomputed(datasource, slope);
+		precomputed.SetWayCacheLimit(0);
+		precomputed.PrecomputeElevations(4);
+
+		int mismatches = 0, samples = 0;
+		for (size_t i = 0; i < tiles.size(); ++i) {
+			Geometry expected, got;
+			sampling.GetGeometry(expected, tiles[i], GeometryDatasource::DETAIL);
+
+			slope.samples = 0;
+			precomputed.GetGeometry(got, tiles[i], GeometryDatasource::DETAIL);
+			samples += slope.samples;
+
+			if (!SameGeometry(expected, got))
+				mismatches++;
+		}
+
+		EXPECT_INT(mismatches, 0);
+		EXPECT_INT(samples, 0);
+	}
+
+	/* errors on worker threads reach the caller */
+	{
+		TempDir dir("geomgen");
+		PreloadedXmlDatasource buildings;
+		buildings.Load(dir.WriteFile("buildings.osm", MakeBuildings(2048)).c_str());
+
+		FailingHeightmap failing;
+		GeometryGenerator generator(buildings, failing);
+		generator.SetWayCacheLimit(0);
+		generator.SetThreads(4);
+
+		Geometry geometry;
+		EXPECT_EXCEPTION(generator.GetGeometry(geometry, BBoxi::ForEarth(), GeometryDatasource::DETAIL), Exception);
+		EXPECT_EXCEPTION(generator.PrecomputeElevations(4), Exception);
+
+		/* generator is still usable */
+		GeometryGenerator flat(buildings, heightmap);
+		flat.SetThreads(4);
+		flat.GetGeometry(geometry, BBoxi::ForEarth(), GeometryDatasource::DETAIL);
+		EXPECT_TRUE(!geometry.GetConvexLengths().empty());
+	}
+
+	/* flat roofs of quads */
+	{
+		TempDir dir("geomgen");
+
+		std::string path = dir.WriteFile("quads.osm", QUADS_OSM);
+
+		PreloadedXmlDatasource quads;
+		quads.Load(path.c_str());
+
+		GeometryGenerator generator(quads, heightmap);
+		Geometry geometry;
+		generator.GetGeometry(geometry, BBoxi::ForEarth(), GeometryDatasource::DETAIL);
+
+		const std::vector<Vector3i>& vertices = geometry.GetConvexVertices();
+		const std::vector<int>& lengths = geometry.GetConvexLengths();
+
+		/* quads lying entirely at roof level, which is 10 meters */
+		int top = 1000;
+
+		int roofs = 0, upward = 0;
+		size_t first = 0;
+		for (size_t i = 0; i < lengths.size(); first += lengths[i++]) {
+			if (lengths[i] != 4)
+				continue;
+
+			bool flat = true;
+			for (size_t j = first; j < first + 4; ++j)
+				flat = flat && vertices[j].z == top;
+			if (!flat)
+				continue;
+
+			roofs++;
+
+			const Vector3i& a = vertices[first];
+			const Vector3i& b = vertices[first + 1];
+			const Vector3i& c = vertices[first + 2];
+			if (((osmlong_t)b.x - a.x) * ((osmlong_t)c.y - a.y) - ((osmlong_t)b.y - a.y) * ((osmlong_t)c.x - a.x) > 0)
+				upward++;
+		}
+
+		EXPECT_INT(roofs, 2);
+		EXPECT_INT(upward, 2);
+	}
+
+	/* cleared geometry is reusable */
+	{
+		Geometry geometry;
+		geometry.AddLine(Vector3i(1, 2, 3), Vector3i(4, 5, 6));
+		geometry.AddTriangle(Vector3i(0, 0, 0), Vector3i(1, 0, 0), Vector3i(0, 1, 0));
+		geometry.Clear();
+
+		EXPECT_TRUE(SameGeometry(geometry, Geometry()));
+
+		geometry.AddLine(Vector3i(1, 2, 3), Vector3i(4, 5, 6));
+		EXPECT_INT(geometry.GetLinesVertices().size(), 2);
+		EXPECT_INT(geometry.GetLinesLengths().size(), 1);
+	}
+END_TEST()
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a microbenchmark for building polygon indices: single
+ * triangle list vs. single triangle strip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <glosm/Geometry.hh>
+
+#include <vector>
+
+static const int NPOLYGONS = 1000000;
+
+/* polygon sizes in proportions common for urban areas, where
+ * quads are ~10x more common than triangles */
+static int GetPolygonSize(int n) {
+	switch (n % 16) {
+	case 0: return 3;
+	case 1: return 5;
+	case 2: return 8;
+	default: return 4;
+	}
+}
+
+template <class F>
+void IndexBench(const char* name, const Geometry& geometry, F func) {
+	Geometry::IndexVector indices;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	(geometry.*func)(indices, (size_t)-1);
+	gettimeofday(&end, NULL);
+
+	float sec = (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
+
+	fprintf(stderr, "  %s: %u indices (%.2f per polygon), %f seconds\n", name, (unsigned int)indices.size(), (float)indices.size() / NPOLYGONS, sec);
+}
+
+int main() {
+	Geometry geometry;
+	std::vector<Vector3i> polygon;
+	for (int i = 0; i < NPOLYGONS; ++i) {
+		polygon.clear();
+		for (int j = 0; j < GetPolygonSize(i); ++j)
+			polygon.push_back(Vector3i(i, j, 0));
+		geometry.AddConvex(polygon);
+	}
+
+	fprintf(stderr, "%d polygons, %u vertices:\n", NPOLYGONS, (unsigned int)geometry.GetConvexVertices().size());
+	IndexBench("triangle list ", geometry, &Geometry::GetConvexTriangles);
+	IndexBench("triangle strip", geometry, &Geometry::GetConvexStrip);
+
+	return 0;
+}
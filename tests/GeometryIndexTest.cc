@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that triangle list and triangle strip built
+ * for convex polygons are both valid triangulations: they have
+ * the same number of non-degenerate triangles, all of the same
+ * winding as polygons, and of the same total area.
+ */
+
+#include <glosm/Geometry.hh>
+
+#include "testing.h"
+
+#include <cmath>
+#include <vector>
+
+/* doubled signed area */
+static double TriangleArea(const Geometry::VertexVector& v, unsigned int a, unsigned int b, unsigned int c) {
+	return ((double)v[b].x - v[a].x) * ((double)v[c].y - v[a].y) - ((double)v[c].x - v[a].x) * ((double)v[b].y - v[a].y);
+}
+
+BEGIN_TEST()
+	/* regular counter-clockwise polygons of various sizes */
+	Geometry geometry;
+	std::vector<Vector3i> polygon;
+	for (int i = 0; i < 100; ++i) {
+		int size = 3 + i % 7;
+		polygon.clear();
+		for (int j = 0; j < size; ++j)
+			polygon.push_back(Vector3i(i * 1000 + (int)(100.0 * cos(2.0 * M_PI * j / size)), (int)(100.0 * sin(2.0 * M_PI * j / size)), 0));
+		geometry.AddConvex(polygon);
+	}
+
+	const Geometry::VertexVector& vertices = geometry.GetConvexVertices();
+
+	Geometry::IndexVector list, strip;
+	EXPECT_INT(geometry.GetConvexTriangles(list), (int)vertices.size());
+	EXPECT_INT(geometry.GetConvexStrip(strip), (int)vertices.size());
+
+	int list_count = 0, list_clockwise = 0;
+	double list_area = 0.0;
+	for (size_t i = 0; i + 2 < list.size(); i += 3) {
+		double area = TriangleArea(vertices, list[i], list[i + 1], list[i + 2]);
+		list_count++;
+		list_clockwise += area <= 0.0;
+		list_area += area;
+	}
+
+	int strip_count = 0, strip_clockwise = 0;
+	double strip_area = 0.0;
+	for (size_t i = 0; i + 2 < strip.size(); ++i) {
+		unsigned int a = strip[i], b = strip[i + 1], c = strip[i + 2];
+		if (a == b || b == c || a == c)
+			continue;
+
+		/* odd triangles of a strip have reversed order */
+		double area = (i % 2 == 0) ? TriangleArea(vertices, a, b, c) : TriangleArea(vertices, b, a, c);
+		strip_count++;
+		strip_clockwise += area <= 0.0;
+		strip_area += area;
+	}
+
+	EXPECT_INT(list_count, 395);
+	EXPECT_INT(strip_count, list_count);
+	EXPECT_INT(list_clockwise, 0);
+	EXPECT_INT(strip_clockwise, 0);
+	EXPECT_TRUE(fabs(strip_area - list_area) < 1e-6 * list_area);
+
+	/* vertex limit */
+	Geometry::IndexVector limited;
+	EXPECT_INT(geometry.GetConvexStrip(limited, 10), 7);
+END_TEST()
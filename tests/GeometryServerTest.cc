@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+/*
+ * This test checks that geometry received from GeometryServer
+ * through RemoteGeometryDatasource is the same as the local one,
+ * with pipelined, failing and cancelled requests, including ones
+ * made through asynchronous Submit() interface, and that layer
+ * loading from the server survives losing it.
+ */
+
+#include <glosm/GeometryServer.hh>
+#include <glosm/GeometryProtocol.hh>
+#include <glosm/RemoteGeometryDatasource.hh>
+#include <glosm/GeometryLayer.hh>
+#include <glosm/MercatorProjection.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Model.hh>
+
+#include "testing.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+static const int FAILING_FLAGS = 99;
+
+/* requests with these flags block until gate is opened */
+static const int GATED_FLAGS = 98;
+
+class TestDatasource : public GeometryDatasource {
+public:
+	mutable pthread_mutex_t mutex;
+	mutable pthread_cond_t cond;
+	bool gate_open;
+
+	TestDatasource() : gate_open(true) {
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+
+	~TestDatasource() {
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	void SetGate(bool open) {
+		pthread_mutex_lock(&mutex);
+		gate_open = open;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	virtual void GetGeometry(Geometry& geometry, const BBoxi& bbox, int flags) const {
+		if (flags == FAILING_FLAGS)
+			throw Exception() << "test failure";
+
+		if (flags == GATED_FLAGS) {
+			pthread_mutex_lock(&mutex);
+			while (!gate_open)
+				pthread_cond_wait(&cond, &mutex);
+			pthread_mutex_unlock(&mutex);
+		}
+
+		for (int i = 0; i < 10; ++i)
+			geometry.AddLine(Vector3i(bbox.left, bbox.bottom, i), Vector3i(bbox.right, bbox.top, flags));
+		geometry.AddQuad(Vector3i(bbox.left, bbox.bottom), Vector3i(bbox.right, bbox.bottom), Vector3i(bbox.right, bbox.top), Vector3i(bbox.left, bbox.top, -1000));
+		geometry.AddInstance(Model::POWER_TOWER, Vector3i(bbox.left, bbox.top, 50), Vector2f(0.6f, -0.8f));
+	}
+
+	virtual Vector2i GetCenter() const {
+		return Vector2i(123, 456);
+	}
+
+	virtual BBoxi GetBBox() const {
+		return BBoxi(-1000, -2000, 3000, 4000);
+	}
+};
+
+class CountingCallback : public GeometryRequest::Callback {
+public:
+	volatile int count;
+
+	CountingCallback() : count(0) {
+	}
+
+	virtual void OnRequestReady() {
+		__sync_fetch_and_add(&count, 1);
+	}
+};
+
+struct ServeArg {
+	GeometryServer* server;
+	int fd;
+	volatile bool done;
+};
+
+static void* ServeThread(void* arg) {
+	ServeArg* serve = static_cast<ServeArg*>(arg);
+	try {
+		serve->server->Serve(serve->fd);
+	} catch (std::exception&) {
+	}
+	serve->done = true;
+	return NULL;
+}
+
+/* layer which loads tiles synchronously */
+class SyncGeometryLayer : public GeometryLayer {
+public:
+	SyncGeometryLayer(const GeometryDatasource& datasource) : GeometryLayer(MercatorProjection(), datasource) {
+	}
+
+	virtual TileRequest* RequestTile(const BBoxi& /*unused*/, int /*unused*/) const {
+		return NULL;
+	}
+};
+
+/* tells whether listening socket is bound to loopback address */
+static bool IsLoopback(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &len) != 0)
+		return false;
+	if (addr.ss_family == AF_INET)
+		return ntohl(((struct sockaddr_in*)&addr)->sin_addr.s_addr) == INADDR_LOOPBACK;
+	if (addr.ss_family == AF_INET6)
+		return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*)&addr)->sin6_addr);
+	return false;
+}
+
+static bool SameGeometry(const Geometry& a, const Geometry& b) {
+	return a.GetLinesVertices() == b.GetLinesVertices() && a.GetLinesLengths() == b.GetLinesLengths() &&
+		a.GetConvexVertices() == b.GetConvexVertices() && a.GetConvexLengths() == b.GetConvexLengths() &&
+		a.GetInstances() == b.GetInstances();
+}
+
+BEGIN_TEST()
+	TestDatasource source;
+	GeometryServer server(source, 777, 1);
+
+	int fds[2];
+	EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+	ServeArg arg = { &server, fds[0], false };
+	pthread_t thread;
+	EXPECT_TRUE(pthread_create(&thread, NULL, ServeThread, &arg) == 0);
+
+	{
+		RemoteGeometryDatasource remote(fds[1]);
+
+		// greeting
+		EXPECT_TRUE(remote.GetBBox().left == -1000 && remote.GetBBox().top == 4000);
+		EXPECT_TRUE(remote.GetCenter() == Vector2i(123, 456));
+		EXPECT_INT(remote.GetMaxHeight(), 777);
+
+		// single request
+		{
+			Geometry local, received;
+			BBoxi bbox = BBoxi::ForGeoTile(12, 100, 200);
+			source.GetGeometry(local, bbox, 1);
+			remote.GetGeometry(received, bbox, 1);
+			EXPECT_TRUE(SameGeometry(local, received));
+		}
+
+		// pipelined requests waited in reverse order
+		{
+			std::vector<RemoteGeometryDatasource::RequestId> ids;
+			for (int i = 0; i < 50; ++i)
+				ids.push_back(remote.Request(BBoxi::ForGeoTile(14, 1000 + i, 2000), i % 3));
+
+			int mismatches = 0;
+			for (int i = 49; i >= 0; --i) {
+				Geometry local, received;
+				source.GetGeometry(local, BBoxi::ForGeoTile(14, 1000 + i, 2000), i % 3);
+				remote.Wait(ids[i], received);
+				if (!SameGeometry(local, received))
+					mismatches++;
+			}
+			EXPECT_INT(mismatches, 0);
+			EXPECT_INT(remote.GetPendingCount(), 0);
+		}
+
+		// failure is reported and connection stays usable
+		{
+			bool failed = false;
+			Geometry received;
+			try {
+				remote.GetGeometry(received, BBoxi::ForGeoTile(12, 1, 1), FAILING_FLAGS);
+			} catch (Exception&) {
+				failed = true;
+			}
+			EXPECT_TRUE(failed);
+
+			remote.GetGeometry(received, BBoxi::ForGeoTile(12, 1, 1), 0);
+			EXPECT_TRUE(!received.GetLinesVertices().empty());
+		}
+
+		// request queued behind a blocked one is dropped by server
+		{
+			source.SetGate(false);
+			RemoteGeometryDatasource::RequestId blocked = remote.Request(BBoxi::ForGeoTile(12, 2, 2), GATED_FLAGS);
+			RemoteGeometryDatasource::RequestId cancelled = remote.Request(BBoxi::ForGeoTile(12, 3, 3), 0);
+			RemoteGeometryDatasource::RequestId kept = remote.Request(BBoxi::ForGeoTile(12, 4, 4), 0);
+			remote.Cancel(cancelled);
+
+			GeometryServer::Statistics stats;
+			for (int i = 0; i < 1000; ++i) {
+				server.GetStatistics(stats);
+				if (stats.cancelled > 0)
+					break;
+				usleep(1000);
+			}
+			EXPECT_INT(stats.cancelled, 1);
+
+			source.SetGate(true);
+
+			Geometry received;
+			remote.Wait(blocked, received);
+			remote.Wait(kept, received);
+			EXPECT_INT(received.GetInstances().size(), 2);
+			EXPECT_INT(remote.GetPendingCount(), 0);
+		}
+
+		// default asynchronous interface of local source
+		{
+			Geometry local, received;
+			BBoxi bbox = BBoxi::ForGeoTile(12, 6, 6);
+			source.GetGeometry(local, bbox, 2);
+
+			std::auto_ptr<GeometryRequest> request(source.Submit(bbox, 2));
+			EXPECT_TRUE(request->IsReady());
+			request->Wait(received);
+			EXPECT_TRUE(SameGeometry(local, received));
+		}
+
+		// remote asynchronous request notifies when ready
+		{
+			CountingCallback callback;
+			BBoxi bbox = BBoxi::ForGeoTile(12, 7, 7);
+
+			source.SetGate(false);
+			std::auto_ptr<GeometryRequest> request(remote.Submit(bbox, GATED_FLAGS, &callback));
+			std::auto_ptr<GeometryRequest> dropped(remote.Submit(bbox, 0, &callback));
+			EXPECT_TRUE(!request->IsReady());
+			EXPECT_INT(callback.count, 0);
+
+			// destroying handle cancels request
+			dropped.reset(NULL);
+			EXPECT_INT(remote.GetPendingCount(), 1);
+
+			source.SetGate(true);
+			for (int i = 0; i < 1000 && callback.count == 0; ++i)
+				usleep(1000);
+			EXPECT_INT(callback.count, 1);
+			EXPECT_TRUE(request->IsReady());
+
+			Geometry local, received;
+			source.GetGeometry(local, bbox, GATED_FLAGS);
+			request->Wait(received);
+			EXPECT_TRUE(SameGeometry(local, received));
+			EXPECT_INT(remote.GetPendingCount(), 0);
+		}
+
+		// lost connection is reported
+		{
+			shutdown(fds[0], SHUT_RDWR);
+			pthread_join(thread, NULL);
+
+			bool failed = false;
+			Geometry received;
+			try {
+				/* receiver may not have noticed yet, then request
+				 * fails while waiting */
+				remote.GetGeometry(received, BBoxi::ForGeoTile(12, 5, 5), 0);
+			} catch (Exception&) {
+				failed = true;
+			}
+			EXPECT_TRUE(failed);
+		}
+	}
+
+	close(fds[0]);
+
+	GeometryServer::Statistics stats;
+	server.GetStatistics(stats);
+	EXPECT_INT(stats.connections, 1);
+	EXPECT_INT(stats.failed, 1);
+
+	// server goes away while layer is loading
+	for (int sync = 0; sync < 2; ++sync) {
+		TestDatasource layer_source;
+		layer_source.SetGate(false);
+		GeometryServer layer_server(layer_source, 777, 1);
+
+		int layer_fds[2];
+		EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, layer_fds) == 0);
+
+		ServeArg layer_arg = { &layer_server, layer_fds[0], false };
+		EXPECT_TRUE(pthread_create(&thread, NULL, ServeThread, &layer_arg) == 0);
+
+		{
+			RemoteGeometryDatasource layer_remote(layer_fds[1]);
+			std::auto_ptr<GeometryLayer> layer(sync ? new SyncGeometryLayer(layer_remote) : new GeometryLayer(MercatorProjection(), layer_remote));
+			layer->SetLevel(2);
+			layer->SetFlags(GATED_FLAGS);
+			layer->LoadArea(BBoxi::ForGeoTile(4, 1, 1));
+
+			for (int i = 0; i < 1000 && layer_remote.GetPendingCount() == 0; ++i)
+				usleep(1000);
+			EXPECT_TRUE(layer_remote.GetPendingCount() > 0);
+
+			shutdown(layer_fds[0], SHUT_RDWR);
+			layer_source.SetGate(true);
+			pthread_join(thread, NULL);
+
+			TileManager::Statistics layer_stats;
+			for (int i = 0; i < 1000; ++i) {
+				layer->GetStatistics(layer_stats);
+				if (layer_stats.loading == 0)
+					break;
+				usleep(1000);
+			}
+			EXPECT_INT(layer_stats.loading, 0);
+			EXPECT_INT(layer_stats.failed, 1);
+			EXPECT_INT(layer_stats.requests, 0);
+		}
+
+		close(layer_fds[0]);
+	}
+
+	// only loopback is listened on unless all addresses are asked for
+	{
+		int fd = GeometryProtocol::Listen("0");
+		EXPECT_TRUE(IsLoopback(fd));
+		close(fd);
+
+		fd = GeometryProtocol::Listen("*:0");
+		EXPECT_TRUE(!IsLoopback(fd));
+		close(fd);
+	}
+
+	// client with too many queued requests is dropped
+	{
+		TestDatasource flood_source;
+		flood_source.SetGate(false);
+		GeometryServer flood_server(flood_source, 777, 1);
+
+		int flood_fds[2];
+		EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, flood_fds) == 0);
+
+		ServeArg flood_arg = { &flood_server, flood_fds[0], false };
+		EXPECT_TRUE(pthread_create(&thread, NULL, ServeThread, &flood_arg) == 0);
+
+		{
+			RemoteGeometryDatasource flood_remote(flood_fds[1]);
+
+			/* first request blocks the only thread, the rest
+			 * are queued */
+			for (int i = 0; i < GeometryServer::MAX_QUEUED_REQUESTS + 10; ++i)
+				flood_remote.Request(BBoxi::ForGeoTile(12, i, 0), GATED_FLAGS);
+
+			flood_source.SetGate(true);
+			for (int i = 0; i < 2000 && !flood_arg.done; ++i)
+				usleep(1000);
+			EXPECT_TRUE(flood_arg.done);
+
+			shutdown(flood_fds[0], SHUT_RDWR);
+			pthread_join(thread, NULL);
+
+			GeometryServer::Statistics flood_stats;
+			flood_server.GetStatistics(flood_stats);
+			EXPECT_TRUE(flood_stats.requests >= (unsigned int)GeometryServer::MAX_QUEUED_REQUESTS);
+			EXPECT_TRUE(flood_stats.requests <= (unsigned int)GeometryServer::MAX_QUEUED_REQUESTS + 1);
+		}
+
+		close(flood_fds[0]);
+	}
+END_TEST()
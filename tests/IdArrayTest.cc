@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that id_array behaves the same as std::map
+ * for sorted, unsorted, sparse, dense and out of range ids.
+ */
+
+#include <glosm/id_array.hh>
+
+#include "testing.h"
+
+#include <cstdlib>
+#include <map>
+
+typedef id_array<int, 8> TestArray;
+typedef std::map<osmid_t, int> ReferenceMap;
+
+struct CountingVisitor {
+	const ReferenceMap& reference;
+	int visited;
+	int mismatches;
+
+	CountingVisitor(const ReferenceMap& r) : reference(r), visited(0), mismatches(0) {
+	}
+
+	void operator()(osmid_t id, int value) {
+		ReferenceMap::const_iterator i = reference.find(id);
+		if (i == reference.end() || i->second != value)
+			mismatches++;
+		visited++;
+	}
+};
+
+static int CountMismatches(const TestArray& array, const ReferenceMap& reference, osmid_t from, osmid_t to) {
+	int mismatches = 0;
+	for (osmid_t id = from; id < to; ++id) {
+		ReferenceMap::const_iterator i = reference.find(id);
+		const int* value = array.get(id);
+		if (i == reference.end() ? value != NULL : (value == NULL || *value != i->second))
+			mismatches++;
+	}
+	return mismatches;
+}
+
+BEGIN_TEST()
+	srand(1);
+
+	// empty
+	{
+		TestArray array;
+		EXPECT_TRUE(array.empty());
+		EXPECT_TRUE(array.get(0) == NULL);
+		EXPECT_TRUE(array.get(-1) == NULL);
+		EXPECT_TRUE(array.get(1000000) == NULL);
+	}
+
+	// sorted dense input, pages become flat
+	{
+		TestArray array;
+		ReferenceMap reference;
+		for (osmid_t id = 1; id < 10000; ++id) {
+			if (id % 7 == 0)
+				continue;
+			array.insert(id, id * 3);
+			reference[id] = id * 3;
+		}
+
+		EXPECT_INT(array.size(), (int)reference.size());
+		EXPECT_INT(CountMismatches(array, reference, -10, 10010), 0);
+	}
+
+	// unsorted sparse input, out of range ids, replacement
+	{
+		TestArray array;
+		ReferenceMap reference;
+		for (int i = 0; i < 5000; ++i) {
+			osmid_t id = rand() % 20000 - 1000;
+			if (i % 100 == 0)
+				id += (osmid_t)1 << 40;
+			bool inserted = array.insert(std::make_pair(id, i));
+			EXPECT_TRUE(inserted == (reference.find(id) == reference.end()));
+			reference[id] = i;
+		}
+
+		EXPECT_INT(array.size(), (int)reference.size());
+		EXPECT_INT(CountMismatches(array, reference, -1010, 19010), 0);
+
+		int far_mismatches = 0;
+		for (ReferenceMap::const_iterator i = reference.begin(); i != reference.end(); ++i)
+			if (array.get(i->first) == NULL || *array.get(i->first) != i->second)
+				far_mismatches++;
+		EXPECT_INT(far_mismatches, 0);
+
+		array.compact();
+
+		CountingVisitor visitor(reference);
+		array.for_each(visitor);
+		EXPECT_INT(visitor.visited, (int)reference.size());
+		EXPECT_INT(visitor.mismatches, 0);
+
+		array.clear();
+		EXPECT_TRUE(array.empty());
+		EXPECT_TRUE(array.get(reference.begin()->first) == NULL);
+	}
+END_TEST()
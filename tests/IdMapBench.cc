@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a microbenchmark for id_map variants, with access
+ * patterns typical for OSM data loading: ids are mostly increasing
+ * with gaps, ways reference nodes with close ids, and multipolygons
+ * reference ways more or less randomly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <glosm/id_map.hh>
+#include <glosm/osmtypes.h>
+
+struct NodeData {
+	int x, y;
+	NodeData(int v = 0) : x(v), y(v) {}
+	int Check() const { return x; }
+};
+
+struct WayData {
+	char payload[96];
+	int check;
+	WayData(int v = 0) : check(v) {}
+	int Check() const { return check; }
+};
+
+static float Elapsed(const struct timeval& start) {
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	return (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
+}
+
+template <class M>
+void Bench(const char* name, const std::vector<osmid_t>& ids, const std::vector<osmid_t>& queries) {
+	struct timeval start;
+	M map;
+
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < ids.size(); ++i)
+		map.insert(std::make_pair(ids[i], typename M::mapped_type(i)));
+	float insert_time = Elapsed(start);
+
+	/* value is used, as it would be by real code */
+	long found = 0;
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < queries.size(); ++i) {
+		typename M::const_iterator el = map.find(queries[i]);
+		if (el != map.end() && el->second.Check() >= 0)
+			found++;
+	}
+	float find_time = Elapsed(start);
+
+	long missed = 0;
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < queries.size(); ++i)
+		if (map.find(queries[i] + ids.back() + 1) == map.end())
+			missed++;
+	float miss_time = Elapsed(start);
+
+	fprintf(stderr, "  %-24s insert %.3fs, find %.3fs (%ld found), miss %.3fs (%ld missed)\n", name, insert_time, find_time, found, miss_time, missed);
+}
+
+template <class T>
+void BenchPattern(const char* title, const std::vector<osmid_t>& ids, const std::vector<osmid_t>& queries) {
+	fprintf(stderr, "%s: %d elements, %d lookups\n", title, (int)ids.size(), (int)queries.size());
+	Bench<id_map<osmid_t, T> >("chaining", ids, queries);
+	Bench<id_map<osmid_t, T, 1048576, ID_MAP_OPEN_ADDRESSING> >("open addressing", ids, queries);
+}
+
+int main() {
+	srand(1);
+
+	/* increasing ids with random gaps, like in a regional extract */
+	std::vector<osmid_t> node_ids;
+	osmid_t id = 100000000;
+	for (int i = 0; i < 4000000; ++i)
+		node_ids.push_back(id += 1 + rand() % 8);
+
+	/* ways reference runs of nodes with close ids */
+	std::vector<osmid_t> node_refs;
+	for (int i = 0; i < 8000000; ++i) {
+		if (i % 8 == 0)
+			id = node_ids[rand() % node_ids.size()];
+		node_refs.push_back(node_ids[std::min((size_t)(std::lower_bound(node_ids.begin(), node_ids.end(), id) - node_ids.begin()) + i % 8, node_ids.size() - 1)]);
+	}
+
+	BenchPattern<NodeData>("Nodes, way references", node_ids, node_refs);
+
+	std::vector<osmid_t> way_ids;
+	id = 10000000;
+	for (int i = 0; i < 500000; ++i)
+		way_ids.push_back(id += 1 + rand() % 4);
+
+	/* multipolygon members are scattered */
+	std::vector<osmid_t> way_refs;
+	for (int i = 0; i < 4000000; ++i)
+		way_refs.push_back(way_ids[rand() % way_ids.size()]);
+
+	BenchPattern<WayData>("Ways, relation members", way_ids, way_refs);
+
+	return 0;
+}
@@ -32,9 +32,16 @@
 
 #include "testing.h"
 
-typedef id_map<unsigned int, unsigned int, sizeof(unsigned int)*8> TestMap;
+#include <cstdlib>
+#include <map>
+
+typedef id_map<unsigned int, unsigned int, sizeof(unsigned int)*8> ChainedMap;
+typedef id_map<unsigned int, unsigned int, sizeof(unsigned int)*8, ID_MAP_OPEN_ADDRESSING> OpenMap;
+
+template <class TestMap>
+int TestBasic() {
+	int num_failing_tests_ = 0;
 
-BEGIN_TEST()
 	// create
 	TestMap map(8);
 
@@ -46,7 +53,7 @@ BEGIN_TEST()
 	int ksum = 0, vsum = 0;
 	{
 		for (unsigned int i = 0; i < 8; ++i) {
-			std::pair<TestMap::iterator, bool> res = map.insert(std::make_pair(i, 1024 - i));
+			std::pair<typename TestMap::iterator, bool> res = map.insert(std::make_pair(i, 1024 - i));
 			EXPECT_TRUE(res.second);
 			EXPECT_TRUE(res.first->first == i && res.first->second == 1024 - i);
 			ksum += i;
@@ -60,7 +67,7 @@ BEGIN_TEST()
 	// read
 	{
 		int testksum = 0, testvsum = 0, iterations = 0;
-		for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
+		for (typename TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
 			testksum += i->first;
 			testvsum += i->second;
 		}
@@ -77,7 +84,7 @@ BEGIN_TEST()
 	{
 		int testksum = 0, testvsum = 0;
 		for (unsigned int i = 0; i < 8; ++i) {
-			TestMap::iterator el = map.find(i);
+			typename TestMap::iterator el = map.find(i);
 			EXPECT_TRUE(el != map.end());
 			assert(el != map.end());
 			testksum += el->first;
@@ -91,7 +98,7 @@ BEGIN_TEST()
 	// fill extra, will trigger rehashes and page allocs
 	{
 		for (unsigned int i = 8; i < 32; ++i) {
-			std::pair<TestMap::iterator, bool> res = map.insert(std::make_pair(i, 1024 - i));
+			std::pair<typename TestMap::iterator, bool> res = map.insert(std::make_pair(i, 1024 - i));
 			EXPECT_TRUE(res.second);
 			EXPECT_TRUE(res.first->first == i && res.first->second == 1024 - i);
 			ksum += i;
@@ -105,7 +112,7 @@ BEGIN_TEST()
 	// read
 	{
 		int testksum = 0, testvsum = 0, iterations = 0;
-		for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
+		for (typename TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
 			testksum += i->first;
 			testvsum += i->second;
 		}
@@ -119,7 +126,7 @@ BEGIN_TEST()
 	{
 		int testksum = 0, testvsum = 0;
 		for (unsigned int i = 0; i < 32; ++i) {
-			TestMap::iterator el = map.find(i);
+			typename TestMap::iterator el = map.find(i);
 			EXPECT_TRUE(el != map.end());
 			assert(el != map.end());
 			testksum += el->first;
@@ -140,7 +147,7 @@ BEGIN_TEST()
 	// read
 	{
 		int testksum = 0, testvsum = 0, iterations = 0;
-		for (TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
+		for (typename TestMap::const_iterator i = map.begin(); i != map.end(); ++i, ++iterations) {
 			testksum += i->first;
 			testvsum += i->second;
 		}
@@ -154,7 +161,7 @@ BEGIN_TEST()
 	{
 		int testksum = 0, testvsum = 0;
 		for (unsigned int i = 0; i < 4; ++i) {
-			TestMap::iterator el = map.find(i);
+			typename TestMap::iterator el = map.find(i);
 			EXPECT_TRUE(el != map.end());
 			assert(el != map.end());
 			testksum += el->first;
@@ -165,9 +172,75 @@ BEGIN_TEST()
 		EXPECT_INT(testksum, ksum);
 
 		for (unsigned int i = 4; i < 33; ++i) {
-			TestMap::iterator el = map.find(i);
+			typename TestMap::iterator el = map.find(i);
 			EXPECT_TRUE(el == map.end());
 		}
 	}
 
+	return num_failing_tests_;
+}
+
+template <class TestMap>
+int TestDuplicates() {
+	int num_failing_tests_ = 0;
+
+	TestMap map(8);
+	map.insert(std::make_pair(5U, 1U));
+	map.insert(std::make_pair(6U, 2U));
+	map.insert(std::make_pair(5U, 3U));
+
+	// newer element shadows older one
+	EXPECT_INT(map.size(), 3);
+	EXPECT_INT(map.find(5)->second, 3);
+
+	// and older one is back after removal
+	map.erase_last();
+	EXPECT_INT(map.find(5)->second, 1);
+
+	map.erase_last();
+	EXPECT_TRUE(map.find(6) == map.end());
+	EXPECT_INT(map.find(5)->second, 1);
+
+	return num_failing_tests_;
+}
+
+template <class TestMap>
+int TestRandom() {
+	int num_failing_tests_ = 0;
+
+	srand(1);
+
+	// sparse ids with common low bits, as a stress for hashing
+	TestMap map(8);
+	std::map<unsigned int, unsigned int> reference;
+	for (unsigned int i = 0; i < 20000; ++i) {
+		unsigned int key = (rand() % 100000) * 1024;
+		if (reference.find(key) != reference.end())
+			continue;
+		map.insert(std::make_pair(key, i));
+		reference.insert(std::make_pair(key, i));
+	}
+
+	int mismatches = 0;
+	for (std::map<unsigned int, unsigned int>::const_iterator i = reference.begin(); i != reference.end(); ++i) {
+		typename TestMap::const_iterator el = map.find(i->first);
+		if (el == map.end() || el->second != i->second)
+			mismatches++;
+		if (map.find(i->first + 1) != map.end())
+			mismatches++;
+	}
+
+	EXPECT_INT(map.size(), (int)reference.size());
+	EXPECT_INT(mismatches, 0);
+
+	return num_failing_tests_;
+}
+
+BEGIN_TEST()
+	num_failing_tests_ += TestBasic<ChainedMap>();
+	num_failing_tests_ += TestBasic<OpenMap>();
+	num_failing_tests_ += TestDuplicates<ChainedMap>();
+	num_failing_tests_ += TestDuplicates<OpenMap>();
+	num_failing_tests_ += TestRandom<ChainedMap>();
+	num_failing_tests_ += TestRandom<OpenMap>();
 END_TEST()
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks decisions of impostor cache which don't need
+ * GL: impostor is rendered again when direction to the viewer or
+ * distance to it change too much, only a limited number of updates
+ * is done per frame, tiles close to the viewer aren't drawn as
+ * impostors and images which don't fit into texture are refused.
+ */
+
+#include <glosm/ImpostorCache.hh>
+
+#include "testing.h"
+
+#include <cmath>
+
+/* model matrix of tile for viewer at given tile coordinates */
+static void ViewerAt(float x, float y, float z, float model[16]) {
+	for (int i = 0; i < 16; ++i)
+		model[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	model[12] = -x;
+	model[13] = -y;
+	model[14] = -z;
+}
+
+/* begins frame with 512x256 viewport and 90 degrees view angle */
+static void BeginFrame(ImpostorCache& cache, float meter = 1.0f) {
+	float projection[16] = {
+		1.0f, 0.0f, 0.0f, 0.0f,
+		0.0f, 1.0f, 0.0f, 0.0f,
+		0.0f, 0.0f, -1.0f, -1.0f,
+		0.0f, 0.0f, -1.0f, 0.0f,
+	};
+	int viewport[4] = { 0, 0, 512, 256 };
+	cache.BeginFrame(projection, viewport, meter);
+}
+
+BEGIN_TEST()
+	{
+		// disabled until parameters are set
+		ImpostorCache cache;
+		EXPECT_TRUE(!cache.IsEnabled());
+		cache.SetParameters(100.0f, 256, 0.05f);
+		EXPECT_TRUE(cache.IsEnabled());
+		cache.SetParameters(0.0f, 256, 0.05f);
+		EXPECT_TRUE(!cache.IsEnabled());
+	}
+
+	{
+		// updates are limited per frame
+		ImpostorCache cache;
+		cache.SetParameters(100.0f, 256, 0.05f);
+		EXPECT_TRUE(!cache.TakeUpdate());
+
+		BeginFrame(cache);
+		int updates = 0;
+		while (updates < 100 && cache.TakeUpdate())
+			updates++;
+		EXPECT_INT(updates, 4);
+
+		BeginFrame(cache);
+		EXPECT_TRUE(cache.TakeUpdate());
+	}
+
+	{
+		// tiles closer than impostor distance are drawn as is
+		ImpostorCache cache;
+		cache.SetParameters(100.0f, 256, 0.05f);
+		BeginFrame(cache, 2.0f);
+
+		EXPECT_TRUE(cache.IsTooClose(Vector3f(150.0f, -1.0f, -1.0f), Vector3f(250.0f, 1.0f, 1.0f)));
+		EXPECT_TRUE(!cache.IsTooClose(Vector3f(250.0f, -1.0f, -1.0f), Vector3f(350.0f, 1.0f, 1.0f)));
+		EXPECT_TRUE(!cache.IsTooClose(Vector3f(-350.0f, 250.0f, -1.0f), Vector3f(350.0f, 350.0f, 1.0f)));
+		EXPECT_TRUE(cache.IsTooClose(Vector3f(-10.0f, -10.0f, -10.0f), Vector3f(10.0f, 10.0f, 10.0f)));
+	}
+
+	{
+		// impostor is valid until distance changes by 1.25 times
+		// either way or direction changes by the angle
+		ImpostorCache cache;
+		cache.SetParameters(100.0f, 256, 0.05f);
+
+		ImpostorCache::Impostor impostor;
+		impostor.eye = Vector3f(1000.0f, 0.0f, 0.0f);
+		impostor.center = Vector3f(0.0f, 0.0f, 0.0f);
+
+		float model[16];
+		ViewerAt(1000.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(cache.IsValid(impostor, model));
+		ViewerAt(1240.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(cache.IsValid(impostor, model));
+		ViewerAt(1260.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(!cache.IsValid(impostor, model));
+		ViewerAt(810.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(cache.IsValid(impostor, model));
+		ViewerAt(790.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(!cache.IsValid(impostor, model));
+
+		ViewerAt(1000.0f * cos(0.04f), 0.0f, 1000.0f * sin(0.04f), model);
+		EXPECT_TRUE(cache.IsValid(impostor, model));
+		ViewerAt(1000.0f * cos(0.06f), 0.0f, 1000.0f * sin(0.06f), model);
+		EXPECT_TRUE(!cache.IsValid(impostor, model));
+
+		// only relative position matters
+		impostor.eye = Vector3f(1500.0f, 500.0f, 0.0f);
+		impostor.center = Vector3f(500.0f, 500.0f, 0.0f);
+		ViewerAt(1500.0f, 500.0f, 0.0f, model);
+		EXPECT_TRUE(cache.IsValid(impostor, model));
+		ViewerAt(1000.0f, 0.0f, 0.0f, model);
+		EXPECT_TRUE(!cache.IsValid(impostor, model));
+	}
+
+	{
+		// image takes as many texels as screen pixels and must
+		// fit into texture
+		ImpostorCache cache;
+		cache.SetParameters(100.0f, 256, 0.05f);
+		BeginFrame(cache);
+
+		int width = 0, height = 0;
+		EXPECT_TRUE(cache.GetImageSize(100.0f, 100.0f, 100.0f, width, height));
+		EXPECT_INT(width, 256);
+		EXPECT_INT(height, 128);
+
+		EXPECT_TRUE(cache.GetImageSize(50.0f, 200.0f, 200.0f, width, height));
+		EXPECT_INT(width, 64);
+		EXPECT_INT(height, 128);
+
+		EXPECT_TRUE(!cache.GetImageSize(101.0f, 100.0f, 100.0f, width, height));
+		EXPECT_TRUE(!cache.GetImageSize(100.0f, 201.0f, 100.0f, width, height));
+		EXPECT_TRUE(cache.GetImageSize(100.0f, 200.0f, 100.0f, width, height));
+
+		// tiny image still takes a texel
+		EXPECT_TRUE(cache.GetImageSize(0.0f, 0.001f, 100.0f, width, height));
+		EXPECT_INT(width, 1);
+		EXPECT_INT(height, 1);
+	}
+END_TEST()
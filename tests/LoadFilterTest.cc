@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that load filter drops ways by tags and clip
+ * region, keeps multipolygons made of untagged ways, and drops
+ * relations if requested.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/Exception.hh>
+#include <glosm/geomath.h>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const char* FILTER_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.0' lon='20.0'/>\n"
+	" <node id='2' lat='10.1' lon='20.1'/>\n"
+	" <node id='3' lat='11.0' lon='21.0'/>\n"
+	" <node id='4' lat='11.0' lon='21.1'/>\n"
+	" <node id='5' lat='11.1' lon='21.1'/>\n"
+	" <node id='6' lat='10.5' lon='20.5'/>\n"
+	" <node id='7' lat='10.5' lon='20.6'/>\n"
+	" <node id='8' lat='10.6' lon='20.6'/>\n"
+	" <node id='9' lat='50.0' lon='60.0'/>\n"
+	" <node id='10' lat='50.1' lon='60.1'/>\n"
+	" <node id='11' lat='0.0' lon='20.7'/>\n"
+	" <node id='12' lat='30.0' lon='20.7'/>\n"
+	" <way id='1'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>\n"
+	" <way id='2'><nd ref='3'/><nd ref='4'/><nd ref='5'/><nd ref='3'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	" <way id='3'><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='6'/></way>\n"
+	" <way id='4'><nd ref='9'/><nd ref='10'/><tag k='highway' v='primary'/></way>\n"
+	" <way id='5'><nd ref='11'/><nd ref='12'/><tag k='power' v='line'/></way>\n"
+	" <relation id='20'><member type='way' ref='3' role='outer'/><tag k='type' v='multipolygon'/><tag k='landuse' v='forest'/></relation>\n"
+	" <relation id='21'><member type='way' ref='1' role=''/><tag k='type' v='route'/></relation>\n"
+	"</osm>\n";
+
+static int CountWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+	return ways.size();
+}
+
+static int CountWays(const OsmDatasource& datasource, OsmDatasource::Way::Class_t cls) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+
+	int count = 0;
+	for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+		if ((*w)->Class == cls)
+			count++;
+	return count;
+}
+
+static Vector2i Pos(double lon, double lat) {
+	return Vector2i(lon * GEOM_UNITSINDEGREE, lat * GEOM_UNITSINDEGREE);
+}
+
+BEGIN_TEST()
+	TempDir dir("loadfilter");
+
+	std::string path = dir.WriteFile("filter.osm", FILTER_OSM);
+
+	/* no filter: 5 ways and a multipolygon */
+	{
+		PreloadedXmlDatasource datasource;
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 6);
+		EXPECT_NO_EXCEPTION(datasource.GetRelation(21));
+	}
+
+	/* untagged multipolygon member is not needed after the multipolygon is made */
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.tags.push_back("highway");
+		filter.tags.push_back("landuse=forest");
+		filter.tags.push_back("power=tower");
+
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::PACK_NODE_REFS);
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 3);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::LANDUSE), 1);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::BUILDING), 0);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::POWER_LINE), 0);
+		EXPECT_NO_EXCEPTION(datasource.GetRelation(21));
+	}
+
+	/* clip region; power line crosses it without any node inside */
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.clip_bbox = BBoxi(Pos(19.0, 9.0), Pos(22.0, 12.0));
+
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::INLINE_NODES);
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 5);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::MAJOR_HIGHWAY), 0);
+	}
+
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.clip_polygon.push_back(Pos(19.0, 9.0));
+		filter.clip_polygon.push_back(Pos(23.0, 9.0));
+		filter.clip_polygon.push_back(Pos(19.0, 13.0));
+
+		PreloadedXmlDatasource datasource;
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 5);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::MAJOR_HIGHWAY), 0);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::POWER_LINE), 1);
+	}
+
+	/* triangle leaving out the building and the power line */
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.clip_polygon.push_back(Pos(19.0, 9.0));
+		filter.clip_polygon.push_back(Pos(20.65, 9.0));
+		filter.clip_polygon.push_back(Pos(20.65, 12.0));
+
+		PreloadedXmlDatasource datasource;
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 3);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::BUILDING), 0);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::POWER_LINE), 0);
+	}
+
+	/* relations dropped after multipolygons are made */
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.drop_relations = true;
+
+		PreloadedXmlDatasource datasource;
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountWays(datasource), 6);
+		EXPECT_INT(CountWays(datasource, OsmDatasource::Way::LANDUSE), 1);
+		EXPECT_EXCEPTION(datasource.GetRelation(20), DataException);
+		EXPECT_EXCEPTION(datasource.GetRelation(21), DataException);
+
+		std::vector<BBoxi> dirty;
+		EXPECT_EXCEPTION(datasource.ApplyChange(path.c_str(), dirty), Exception);
+	}
+END_TEST()
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that mesh optimizations preserve the mesh
+ * while sharing vertices and improving vertex cache locality.
+ */
+
+#include <glosm/MeshOptimizer.hh>
+
+#include "testing.h"
+
+#include <algorithm>
+#include <vector>
+
+static const int GRID = 32;
+
+/* triangle with rotation applied so smallest vertex is first;
+ * this way winding is kept while comparing */
+static std::vector<Vector3i> CanonicalTriangle(const Vector3i& a, const Vector3i& b, const Vector3i& c) {
+	MeshOptimizer::WeldKey ka(a), kb(b), kc(c);
+	std::vector<Vector3i> t;
+	if (!(kb < ka) && !(kc < ka)) {
+		t.push_back(a); t.push_back(b); t.push_back(c);
+	} else if (!(kc < kb)) {
+		t.push_back(b); t.push_back(c); t.push_back(a);
+	} else {
+		t.push_back(c); t.push_back(a); t.push_back(b);
+	}
+	return t;
+}
+
+static bool TriangleLess(const std::vector<Vector3i>& a, const std::vector<Vector3i>& b) {
+	for (int i = 0; i < 3; ++i) {
+		MeshOptimizer::WeldKey ka(a[i]), kb(b[i]);
+		if (ka < kb)
+			return true;
+		if (kb < ka)
+			return false;
+	}
+	return false;
+}
+
+static std::vector<std::vector<Vector3i> > Triangles(const std::vector<Vector3i>& vertices, const std::vector<unsigned int>& indices) {
+	std::vector<std::vector<Vector3i> > triangles;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+		triangles.push_back(CanonicalTriangle(vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]));
+	std::sort(triangles.begin(), triangles.end(), TriangleLess);
+	return triangles;
+}
+
+BEGIN_TEST()
+	/* grid of quads, each made of two triangles with its own
+	 * unshared vertices, like GeometryTile builds them */
+	std::vector<Vector3i> vertices;
+	std::vector<unsigned int> indices;
+	for (int y = 0; y < GRID; ++y) {
+		for (int x = 0; x < GRID; ++x) {
+			unsigned int base = vertices.size();
+			vertices.push_back(Vector3i(x, y, 0));
+			vertices.push_back(Vector3i(x + 1, y, 0));
+			vertices.push_back(Vector3i(x + 1, y + 1, 0));
+			vertices.push_back(Vector3i(x, y + 1, 0));
+
+			indices.push_back(base);
+			indices.push_back(base + 1);
+			indices.push_back(base + 2);
+			indices.push_back(base);
+			indices.push_back(base + 2);
+			indices.push_back(base + 3);
+		}
+	}
+
+	std::vector<std::vector<Vector3i> > original = Triangles(vertices, indices);
+
+	/* welding */
+	std::vector<MeshOptimizer::WeldKey> keys;
+	for (size_t i = 0; i < vertices.size(); ++i)
+		keys.push_back(MeshOptimizer::WeldKey(vertices[i], Vector3f(0.0f, 0.0f, 1.0f)));
+
+	std::vector<unsigned int> remap;
+	size_t count = MeshOptimizer::BuildWeldMap(keys, remap);
+	EXPECT_INT(count, (GRID + 1) * (GRID + 1));
+
+	MeshOptimizer::RemapVertices(vertices, indices, remap, count);
+	EXPECT_INT((int)vertices.size(), (GRID + 1) * (GRID + 1));
+	EXPECT_TRUE(Triangles(vertices, indices) == original);
+
+	/* different normals prevent welding */
+	{
+		std::vector<MeshOptimizer::WeldKey> k;
+		k.push_back(MeshOptimizer::WeldKey(Vector3i(1, 2, 3), Vector3f(0.0f, 0.0f, 1.0f)));
+		k.push_back(MeshOptimizer::WeldKey(Vector3i(1, 2, 3), Vector3f(0.0f, 1.0f, 0.0f)));
+		k.push_back(MeshOptimizer::WeldKey(Vector3i(1, 2, 3), Vector3f(0.0f, 0.0f, 1.0f)));
+		std::vector<unsigned int> r;
+		EXPECT_INT(MeshOptimizer::BuildWeldMap(k, r), 2);
+		EXPECT_INT(r[2], 0);
+	}
+
+	/* vertex cache optimization */
+	float acmr_before = MeshOptimizer::GetACMR(indices, vertices.size());
+
+	MeshOptimizer::OptimizeVertexCache(indices, vertices.size());
+	EXPECT_INT((int)indices.size(), GRID * GRID * 6);
+	EXPECT_TRUE(Triangles(vertices, indices) == original);
+
+	float acmr_after = MeshOptimizer::GetACMR(indices, vertices.size());
+	EXPECT_TRUE(acmr_after < acmr_before);
+	EXPECT_TRUE(acmr_after < 0.8f);
+
+	/* fetch order */
+	count = MeshOptimizer::BuildFetchMap(indices, vertices.size(), remap);
+	EXPECT_INT(count, (int)vertices.size());
+
+	MeshOptimizer::RemapVertices(vertices, indices, remap, count);
+	EXPECT_TRUE(Triangles(vertices, indices) == original);
+	EXPECT_INT(indices[0], 0);
+END_TEST()
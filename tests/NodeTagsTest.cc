@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that node tag table keeps only tagged nodes,
+ * shares identical tag sets and finds nodes by id and bbox, that
+ * datasource loads node tags only when asked to and updates them
+ * with changes, and that generator places models for them.
+ */
+
+#include <glosm/NodeTagTable.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/DummyHeightmap.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/Model.hh>
+#include <glosm/Exception.hh>
+#include <glosm/geomath.h>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const char* NODES_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.000' lon='20.000'/>\n"
+	" <node id='2' lat='10.001' lon='20.001'><tag k='natural' v='tree'/></node>\n"
+	" <node id='3' lat='10.002' lon='20.002'><tag k='natural' v='tree'/></node>\n"
+	" <node id='4' lat='10.003' lon='20.003'><tag k='highway' v='street_lamp'/></node>\n"
+	" <node id='5' lat='10.004' lon='20.004'><tag k='man_made' v='mast'/><tag k='height' v='40'/></node>\n"
+	" <node id='6' lat='10.005' lon='20.005'><tag k='name' v='unknown'/></node>\n"
+	" <node id='7' lat='10.006' lon='20.006'/>\n"
+	" <way id='1'><nd ref='1'/><nd ref='7'/><tag k='highway' v='residential'/></way>\n"
+	"</osm>\n";
+
+static const char* NODES_OSC =
+	"<osmChange>\n"
+	" <modify>\n"
+	"  <node id='3' lat='10.002' lon='20.002'/>\n"
+	"  <node id='7' lat='10.006' lon='20.006'><tag k='natural' v='tree'/></node>\n"
+	" </modify>\n"
+	" <delete>\n"
+	"  <node id='4' lat='10.003' lon='20.003'/>\n"
+	" </delete>\n"
+	"</osmChange>\n";
+
+static Vector2i Pos(double lon, double lat) {
+	return Vector2i(lon * GEOM_UNITSINDEGREE, lat * GEOM_UNITSINDEGREE);
+}
+
+static TagList Tags(const char* key, const char* value) {
+	TagList tags;
+	tags.insert(key, value);
+	return tags;
+}
+
+static int CountTaggedNodes(const OsmDatasource& datasource) {
+	std::vector<OsmDatasource::TaggedNode> nodes;
+	datasource.GetTaggedNodes(nodes, BBoxi::ForEarth());
+	return nodes.size();
+}
+
+static int CountInstances(const Geometry& geom, int model) {
+	int count = 0;
+	for (Geometry::InstanceVector::const_iterator i = geom.GetInstances().begin(); i != geom.GetInstances().end(); ++i)
+		if (i->model == model)
+			count++;
+	return count;
+}
+
+BEGIN_TEST()
+	/* table alone */
+	{
+		NodeTagTable table;
+		table.Add(30, Pos(1.0, 1.0), Tags("natural", "tree"));
+		table.Add(10, Pos(2.0, 2.0), Tags("natural", "tree"));
+		table.Add(20, Pos(3.0, 3.0), Tags("highway", "street_lamp"));
+		table.Add(40, Pos(4.0, 4.0), Tags("natural", "tree"));
+		table.Add(40, Pos(4.0, 4.0), TagList()); /* tags removed */
+		table.Add(20, Pos(3.5, 3.5), Tags("man_made", "mast")); /* replaced */
+		table.Build();
+
+		EXPECT_INT(table.size(), 3);
+		EXPECT_INT(table.GetTagsCount(), 3); /* tree set is shared */
+
+		NodeTagTable::TaggedNode node;
+		EXPECT_TRUE(table.Find(10, node));
+		EXPECT_TRUE(node.Pos == Pos(2.0, 2.0));
+		EXPECT_INT(node.TagsCount, 1);
+		EXPECT_INT(node.Get(STR_NATURAL), STR_TREE);
+		EXPECT_INT(node.Get(STR_HIGHWAY), STR_NONE);
+
+		EXPECT_TRUE(table.Find(20, node));
+		EXPECT_TRUE(node.Pos == Pos(3.5, 3.5));
+		EXPECT_INT(node.Get(STR_MAN_MADE), STR_MAST);
+		EXPECT_INT(node.Get(STR_HIGHWAY), STR_NONE);
+
+		EXPECT_TRUE(!table.Find(40, node));
+		EXPECT_TRUE(!table.Find(15, node));
+
+		std::vector<NodeTagTable::TaggedNode> found;
+		table.Query(found, BBoxi(Pos(0.5, 0.5), Pos(2.5, 2.5)));
+		EXPECT_INT(found.size(), 2);
+
+		table.Clear();
+		EXPECT_INT(table.size(), 0);
+		EXPECT_TRUE(!table.Find(10, node));
+	}
+
+	TempDir dir("nodetags");
+
+	std::string path = dir.WriteFile("nodes.osm", NODES_OSM);
+	std::string change_path = dir.WriteFile("nodes.osc", NODES_OSC);
+
+	/* node tags are skipped by default */
+	{
+		PreloadedXmlDatasource datasource;
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountTaggedNodes(datasource), 0);
+	}
+
+	/* and kept when asked to, even if nodes are dropped */
+	{
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::FAST_XML_SCAN | PreloadedXmlDatasource::NODE_TAGS);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountTaggedNodes(datasource), 5);
+
+		DummyHeightmap heightmap;
+		GeometryGenerator generator(datasource, heightmap);
+
+		/* generator places models for known kinds of nodes */
+		Geometry detail;
+		generator.GetGeometry(detail, BBoxi(Pos(19.9, 9.9), Pos(20.1, 10.1)), GeometryDatasource::DETAIL);
+		EXPECT_INT(detail.GetInstances().size(), 4);
+		EXPECT_INT(CountInstances(detail, Model::TREE), 2);
+		EXPECT_INT(CountInstances(detail, Model::STREET_LAMP), 1);
+		EXPECT_INT(CountInstances(detail, Model::MAST), 1);
+
+		/* but only for detail geometry */
+		Geometry ground;
+		generator.GetGeometry(ground, BBoxi(Pos(19.9, 9.9), Pos(20.1, 10.1)), GeometryDatasource::GROUND);
+		EXPECT_INT(ground.GetInstances().size(), 0);
+	}
+
+	/* tags follow changes, and their places are dirty */
+	{
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::NODE_TAGS);
+		datasource.Load(path.c_str());
+
+		std::vector<BBoxi> dirty;
+		datasource.ApplyChange(change_path.c_str(), dirty);
+		EXPECT_INT(CountTaggedNodes(datasource), 4);
+
+		std::vector<OsmDatasource::TaggedNode> nodes;
+		datasource.GetTaggedNodes(nodes, BBoxi(Pos(20.0015, 10.0015), Pos(20.0065, 10.0065)));
+		EXPECT_INT(nodes.size(), 3);
+
+		bool found_removed = false, found_added = false;
+		for (std::vector<BBoxi>::const_iterator i = dirty.begin(); i != dirty.end(); ++i) {
+			if (i->Contains(Pos(20.002, 10.002)))
+				found_removed = true;
+			if (i->Contains(Pos(20.006, 10.006)))
+				found_added = true;
+		}
+		EXPECT_TRUE(found_removed);
+		EXPECT_TRUE(found_added);
+	}
+
+	/* nodes outside clip region are dropped */
+	{
+		PreloadedXmlDatasource::LoadFilter filter;
+		filter.clip_bbox = BBoxi(Pos(19.0, 9.0), Pos(20.0025, 10.0025));
+
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::NODE_TAGS);
+		datasource.SetLoadFilter(filter);
+		datasource.Load(path.c_str());
+		EXPECT_INT(CountTaggedNodes(datasource), 2);
+	}
+END_TEST()
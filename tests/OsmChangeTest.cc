@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that applying OsmChange to loaded data gives
+ * the same ways as loading already changed data, and that dirty
+ * areas and maximal height cover the changes. Geometry generated
+ * after invalidating dirty areas matches the changed data.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/HeightmapDatasource.hh>
+#include <glosm/Exception.hh>
+#include <glosm/geomath.h>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const char* BASE_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.0' lon='20.0'/>\n"
+	" <node id='2' lat='10.1' lon='20.1'/>\n"
+	" <node id='3' lat='11.0' lon='21.0'/>\n"
+	" <node id='4' lat='11.1' lon='21.1'/>\n"
+	" <node id='5' lat='12.0' lon='22.0'/>\n"
+	" <node id='6' lat='12.0' lon='22.1'/>\n"
+	" <node id='7' lat='12.1' lon='22.1'/>\n"
+	" <node id='8' lat='13.0' lon='23.0'/>\n"
+	" <node id='9' lat='13.0' lon='23.1'/>\n"
+	" <node id='10' lat='13.1' lon='23.1'/>\n"
+	" <way id='10'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>\n"
+	" <way id='11'><nd ref='3'/><nd ref='4'/><tag k='highway' v='primary'/></way>\n"
+	" <way id='13'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='5'/></way>\n"
+	" <way id='14'><nd ref='8'/><nd ref='9'/><nd ref='10'/><nd ref='8'/></way>\n"
+	" <relation id='20'><member type='way' ref='13' role='outer'/><tag k='type' v='multipolygon'/><tag k='landuse' v='forest'/></relation>\n"
+	" <relation id='22'><member type='way' ref='14' role='outer'/><tag k='type' v='multipolygon'/><tag k='natural' v='water'/></relation>\n"
+	"</osm>\n";
+
+static const char* CHANGE_OSC =
+	"<osmChange version='0.6'>\n"
+	" <modify>\n"
+	"  <node id='1' lat='10.2' lon='20.2'/>\n"
+	"  <node id='6' lat='12.0' lon='22.5'/>\n"
+	" </modify>\n"
+	" <create>\n"
+	"  <node id='100' lat='10.5' lon='22.5'/>\n"
+	"  <node id='101' lat='10.6' lon='22.6'/>\n"
+	"  <way id='30'><nd ref='100'/><nd ref='101'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	" </create>\n"
+	" <delete>\n"
+	"  <way id='11'/>\n"
+	"  <relation id='22'/>\n"
+	"  <node id='3'/>\n"
+	"  <node id='4'/>\n"
+	" </delete>\n"
+	"</osmChange>\n";
+
+static const char* CHANGED_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.2' lon='20.2'/>\n"
+	" <node id='2' lat='10.1' lon='20.1'/>\n"
+	" <node id='5' lat='12.0' lon='22.0'/>\n"
+	" <node id='6' lat='12.0' lon='22.5'/>\n"
+	" <node id='7' lat='12.1' lon='22.1'/>\n"
+	" <node id='8' lat='13.0' lon='23.0'/>\n"
+	" <node id='9' lat='13.0' lon='23.1'/>\n"
+	" <node id='10' lat='13.1' lon='23.1'/>\n"
+	" <node id='100' lat='10.5' lon='22.5'/>\n"
+	" <node id='101' lat='10.6' lon='22.6'/>\n"
+	" <way id='10'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>\n"
+	" <way id='13'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='5'/></way>\n"
+	" <way id='14'><nd ref='8'/><nd ref='9'/><nd ref='10'/><nd ref='8'/></way>\n"
+	" <way id='30'><nd ref='100'/><nd ref='101'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	" <relation id='20'><member type='way' ref='13' role='outer'/><tag k='type' v='multipolygon'/><tag k='landuse' v='forest'/></relation>\n"
+	"</osm>\n";
+
+/* road and building crossing left edge of GEOMGEN_BBOX, so
+ * their geometry is cached */
+static const char* GEOMGEN_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.0000' lon='20.0000'/>\n"
+	" <node id='2' lat='10.0000' lon='20.0010'/>\n"
+	" <node id='3' lat='10.0010' lon='20.0000'/>\n"
+	" <node id='4' lat='10.0012' lon='20.0000'/>\n"
+	" <node id='5' lat='10.0012' lon='20.0010'/>\n"
+	" <node id='6' lat='10.0010' lon='20.0010'/>\n"
+	" <way id='1'><nd ref='1'/><nd ref='2'/><tag k='highway' v='residential'/></way>\n"
+	" <way id='2'><nd ref='3'/><nd ref='4'/><nd ref='5'/><nd ref='6'/><nd ref='3'/><tag k='building' v='yes'/><tag k='height' v='10'/></way>\n"
+	"</osm>\n";
+
+/* road gets longer, and building moves north to other terrain */
+static const char* GEOMGEN_OSC =
+	"<osmChange version='0.6'>\n"
+	" <create>\n"
+	"  <node id='7' lat='10.0000' lon='20.0020'/>\n"
+	" </create>\n"
+	" <modify>\n"
+	"  <way id='1'><nd ref='1'/><nd ref='7'/><tag k='highway' v='residential'/></way>\n"
+	"  <node id='3' lat='10.0030' lon='20.0000'/>\n"
+	"  <node id='4' lat='10.0032' lon='20.0000'/>\n"
+	"  <node id='5' lat='10.0032' lon='20.0010'/>\n"
+	"  <node id='6' lat='10.0030' lon='20.0010'/>\n"
+	" </modify>\n"
+	"</osmChange>\n";
+
+static const BBoxi GEOMGEN_BBOX(20.0005 * GEOM_UNITSINDEGREE, 9.9 * GEOM_UNITSINDEGREE, 20.1 * GEOM_UNITSINDEGREE, 10.1 * GEOM_UNITSINDEGREE);
+
+/* uneven terrain, so buildings moved get other elevation */
+class SlopeHeightmap : public HeightmapDatasource {
+public:
+	virtual void GetHeightmap(const BBoxi& /*unused*/, int /*unused*/, Heightmap& /*unused*/) const {
+	}
+
+	virtual osmint_t GetHeight(const Vector2i& where) const {
+		return (where.y / 300) % 1000;
+	}
+};
+
+static bool SameGeometry(const Geometry& a, const Geometry& b) {
+	return a.GetLinesVertices() == b.GetLinesVertices() && a.GetLinesLengths() == b.GetLinesLengths() &&
+		a.GetConvexVertices() == b.GetConvexVertices() && a.GetConvexLengths() == b.GetConvexLengths() &&
+		a.GetInstances() == b.GetInstances();
+}
+
+/* ways as sorted list of their properties, ignoring ids */
+static std::vector<std::string> DescribeWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+
+	std::vector<std::string> result;
+	for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%d %d %d %d class %d closed %d cw %d nodes %d height %d", (*w)->BBox.left, (*w)->BBox.bottom, (*w)->BBox.right, (*w)->BBox.top, (int)(*w)->Class, (int)(*w)->Closed, (int)(*w)->Clockwise, (int)(*w)->GetNodesCount(), (int)(*w)->MaxHeight);
+		result.push_back(buf);
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+static int CountWays(const OsmDatasource& datasource, const BBoxi& bbox) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, bbox);
+	return ways.size();
+}
+
+static bool Covers(const std::vector<BBoxi>& areas, const Vector2i& point) {
+	for (std::vector<BBoxi>::const_iterator a = areas.begin(); a != areas.end(); ++a)
+		if (a->Contains(point))
+			return true;
+	return false;
+}
+
+BEGIN_TEST()
+	TempDir dir("osmchange");
+
+	std::string base = dir.WriteFile("base.osm", BASE_OSM);
+	std::string change = dir.WriteFile("change.osc", CHANGE_OSC);
+	std::string changed = dir.WriteFile("changed.osm", CHANGED_OSM);
+
+	Vector2i old_pos(20 * GEOM_UNITSINDEGREE, 10 * GEOM_UNITSINDEGREE);
+	Vector2i new_pos(20.2 * GEOM_UNITSINDEGREE, 10.2 * GEOM_UNITSINDEGREE);
+	Vector2i deleted_pos(21 * GEOM_UNITSINDEGREE, 11 * GEOM_UNITSINDEGREE);
+	Vector2i created_pos(22.5 * GEOM_UNITSINDEGREE, 10.5 * GEOM_UNITSINDEGREE);
+
+	int flags[] = { 0, PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::OVERVIEW_LAYERS, PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::SPATIAL_LAYOUT };
+	for (int i = 0; i < 3; ++i) {
+		PreloadedXmlDatasource expected(flags[i]);
+		expected.Load(changed.c_str());
+
+		PreloadedXmlDatasource datasource(flags[i]);
+		datasource.Load(base.c_str());
+
+		EXPECT_INT(CountWays(datasource, BBoxi(old_pos, old_pos)), 1);
+		EXPECT_INT(CountWays(datasource, BBoxi(deleted_pos, deleted_pos)), 1);
+		EXPECT_INT(datasource.GetMaxHeight(), 0);
+
+		std::vector<BBoxi> dirty;
+		EXPECT_NO_EXCEPTION(datasource.ApplyChange(change.c_str(), dirty));
+
+		EXPECT_TRUE(DescribeWays(datasource) == DescribeWays(expected));
+		EXPECT_INT(datasource.GetMaxHeight(), 10 * GEOM_UNITSINMETER);
+		EXPECT_INT(expected.GetMaxHeight(), 10 * GEOM_UNITSINMETER);
+
+		EXPECT_INT(CountWays(datasource, BBoxi(old_pos, old_pos)), 0);
+		EXPECT_INT(CountWays(datasource, BBoxi(new_pos, new_pos)), 1);
+		EXPECT_INT(CountWays(datasource, BBoxi(deleted_pos, deleted_pos)), 0);
+		EXPECT_INT(CountWays(datasource, BBoxi(created_pos, created_pos)), 1);
+		EXPECT_EXCEPTION(datasource.GetWay(11), DataException);
+		EXPECT_NO_EXCEPTION(datasource.GetWay(30));
+
+		EXPECT_TRUE(Covers(dirty, old_pos));
+		EXPECT_TRUE(Covers(dirty, new_pos));
+		EXPECT_TRUE(Covers(dirty, deleted_pos));
+		EXPECT_TRUE(Covers(dirty, created_pos));
+		EXPECT_TRUE(!Covers(dirty, Vector2i(0, 0)));
+
+		/* second application changes nothing */
+		dirty.clear();
+		datasource.ApplyChange(change.c_str(), dirty);
+		EXPECT_TRUE(DescribeWays(datasource) == DescribeWays(expected));
+	}
+
+	/* nodes are needed to find affected ways */
+	{
+		PreloadedXmlDatasource datasource(PreloadedXmlDatasource::INLINE_NODES);
+		datasource.Load(base.c_str());
+
+		std::vector<BBoxi> dirty;
+		EXPECT_EXCEPTION(datasource.ApplyChange(change.c_str(), dirty), Exception);
+	}
+
+	/* cached way geometry and elevations are dropped for dirty areas */
+	{
+		std::string geomgen = dir.WriteFile("geomgen.osm", GEOMGEN_OSM);
+		std::string geomgen_change = dir.WriteFile("geomgen.osc", GEOMGEN_OSC);
+
+		PreloadedXmlDatasource datasource;
+		datasource.Load(geomgen.c_str());
+
+		SlopeHeightmap heightmap;
+		GeometryGenerator generator(datasource, heightmap);
+		generator.PrecomputeElevations(1);
+
+		Geometry before;
+		generator.GetGeometry(before, GEOMGEN_BBOX, GeometryDatasource::DETAIL);
+		EXPECT_TRUE(generator.GetWayCacheSize() > 0);
+
+		std::vector<BBoxi> dirty;
+		datasource.ApplyChange(geomgen_change.c_str(), dirty);
+		for (std::vector<BBoxi>::const_iterator d = dirty.begin(); d != dirty.end(); ++d)
+			generator.InvalidateWays(*d);
+		EXPECT_INT(generator.GetWayCacheSize(), 0);
+
+		GeometryGenerator fresh(datasource, heightmap);
+		Geometry expected, got;
+		fresh.GetGeometry(expected, GEOMGEN_BBOX, GeometryDatasource::DETAIL);
+		generator.GetGeometry(got, GEOMGEN_BBOX, GeometryDatasource::DETAIL);
+
+		EXPECT_TRUE(!SameGeometry(before, expected));
+		EXPECT_TRUE(SameGeometry(got, expected));
+	}
+END_TEST()
@@ -0,0 +1,439 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that PreloadedPbfDatasource loads the same data
+ * as PreloadedXmlDatasource from a PBF dump which is built here,
+ * with dense and plain nodes, raw and zlib compressed blobs and
+ * non-default coordinate granularity and offsets, and that broken
+ * dumps are rejected.
+ */
+
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/XMLParser.hh>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <zlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ * protocol buffers wire format writer
+ */
+
+static void PutVarint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+static uint64_t ZigZag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static void PutVarintField(std::string& out, int field, uint64_t value) {
+	PutVarint(out, field << 3);
+	PutVarint(out, value);
+}
+
+static void PutSVarintField(std::string& out, int field, int64_t value) {
+	PutVarintField(out, field, ZigZag(value));
+}
+
+static void PutBytesField(std::string& out, int field, const std::string& data) {
+	PutVarint(out, field << 3 | 2);
+	PutVarint(out, data.size());
+	out += data;
+}
+
+/* packed field of deltas between values, as ids and refs are stored */
+static void PutDeltasField(std::string& out, int field, const std::vector<int64_t>& values) {
+	std::string packed;
+	int64_t last = 0;
+	for (size_t i = 0; i < values.size(); ++i) {
+		PutVarint(packed, ZigZag(values[i] - last));
+		last = values[i];
+	}
+	PutBytesField(out, field, packed);
+}
+
+static void PutPackedField(std::string& out, int field, const std::vector<uint64_t>& values) {
+	std::string packed;
+	for (size_t i = 0; i < values.size(); ++i)
+		PutVarint(packed, values[i]);
+	PutBytesField(out, field, packed);
+}
+
+/* blob header and blob of a file block */
+static std::string MakeFileBlock(const char* type, const std::string& data, bool compress) {
+	std::string blob;
+	if (compress) {
+		uLongf len = compressBound(data.size());
+		std::vector<char> zdata(len);
+		compress2((Bytef*)&zdata[0], &len, (const Bytef*)data.data(), data.size(), 9);
+		PutVarintField(blob, 2, data.size());
+		PutBytesField(blob, 3, std::string(&zdata[0], len));
+	} else {
+		PutBytesField(blob, 1, data);
+	}
+
+	std::string header;
+	PutBytesField(header, 1, type);
+	PutVarintField(header, 3, blob.size());
+
+	std::string block;
+	for (int shift = 24; shift >= 0; shift -= 8)
+		block += (char)(header.size() >> shift & 0xff);
+	return block + header + blob;
+}
+
+/*
+ * test data
+ */
+
+struct TestNode {
+	int64_t id;
+	/* in microdegrees, so 1000 nanodegrees granularity is exact */
+	int lat;
+	int lon;
+	const char* key;
+	const char* value;
+};
+
+static const TestNode NODES[] = {
+	{ 1, 53891234, -29541111, "natural", "tree" },
+	{ 2, 53891634, -29541111, NULL, NULL },
+	{ 3, 53891634, -29540511, NULL, NULL },
+	{ 4, 53891234, -29540511, NULL, NULL },
+	{ 5, 53892000, -29539000, "highway", "street_lamp" },
+	/* stored as plain node */
+	{ 7, 53893000, -29538000, "natural", "tree" },
+};
+
+static const int NDENSE = 5;
+static const int NNODES = 6;
+
+static const int64_t GRANULARITY = 1000;
+static const int64_t LAT_OFFSET = 500000000;
+static const int64_t LON_OFFSET = -250000000;
+
+static std::string FormatMicrodegrees(int value) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%s%d.%06d", value < 0 ? "-" : "", abs(value) / 1000000, abs(value) % 1000000);
+	return buf;
+}
+
+static std::string MakeXml() {
+	std::string xml = "<osm>\n <bounds minlat='53.8' minlon='-29.6' maxlat='53.9' maxlon='-29.5'/>\n";
+	for (int i = 0; i < NNODES; ++i) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), " <node id='%d'", (int)NODES[i].id);
+		xml += std::string(buf) + " lat='" + FormatMicrodegrees(NODES[i].lat) + "' lon='" + FormatMicrodegrees(NODES[i].lon) + "'";
+		if (NODES[i].key)
+			xml += std::string("><tag k='") + NODES[i].key + "' v='" + NODES[i].value + "'/></node>\n";
+		else
+			xml += "/>\n";
+	}
+	xml +=
+		" <way id='10'><nd ref='1'/><nd ref='2'/><nd ref='3'/><nd ref='4'/><nd ref='1'/>"
+		"<tag k='building' v='yes'/><tag k='height' v='12'/></way>\n"
+		" <way id='12'><nd ref='5'/><nd ref='7'/><tag k='highway' v='residential'/><tag k='name' v='Test street'/></way>\n"
+		" <relation id='20'><member type='way' ref='12' role=''/><member type='node' ref='5' role='stop'/>"
+		"<tag k='type' v='route'/></relation>\n"
+		"</osm>\n";
+	return xml;
+}
+
+static std::string MakeHeader() {
+	std::string bbox;
+	PutSVarintField(bbox, 1, -29600000000LL);
+	PutSVarintField(bbox, 2, -29500000000LL);
+	PutSVarintField(bbox, 3, 53900000000LL);
+	PutSVarintField(bbox, 4, 53800000000LL);
+
+	std::string header;
+	PutBytesField(header, 1, bbox);
+	PutBytesField(header, 4, "OsmSchema-V0.6");
+	PutBytesField(header, 4, "DenseNodes");
+	return header;
+}
+
+/* string table of a block; first string is always empty */
+static std::string MakeStringTable(const char* const* strings, int count) {
+	std::string table;
+	PutBytesField(table, 1, "");
+	for (int i = 0; i < count; ++i)
+		PutBytesField(table, 1, strings[i]);
+	return table;
+}
+
+/* dense nodes with granularity and offsets */
+static std::string MakeDenseBlock() {
+	static const char* const strings[] = { "natural", "tree", "highway", "street_lamp" };
+
+	std::vector<int64_t> ids, lats, lons;
+	std::vector<uint64_t> keys_vals;
+	for (int i = 0; i < NDENSE; ++i) {
+		ids.push_back(NODES[i].id);
+		lats.push_back((NODES[i].lat * 1000LL - LAT_OFFSET) / GRANULARITY);
+		lons.push_back((NODES[i].lon * 1000LL - LON_OFFSET) / GRANULARITY);
+		for (int s = 0; NODES[i].key && s < 4; s += 2) {
+			if (strcmp(NODES[i].key, strings[s]) == 0) {
+				keys_vals.push_back(s + 1);
+				keys_vals.push_back(s + 2);
+			}
+		}
+		keys_vals.push_back(0);
+	}
+
+	std::string dense;
+	PutDeltasField(dense, 1, ids);
+	PutDeltasField(dense, 8, lats);
+	PutDeltasField(dense, 9, lons);
+	PutPackedField(dense, 10, keys_vals);
+
+	std::string group;
+	PutBytesField(group, 2, dense);
+
+	std::string block;
+	PutBytesField(block, 1, MakeStringTable(strings, 4));
+	PutBytesField(block, 2, group);
+	PutVarintField(block, 17, GRANULARITY);
+	PutVarintField(block, 19, LAT_OFFSET);
+	PutVarintField(block, 20, LON_OFFSET);
+	return block;
+}
+
+/* plain node, ways and relation with default granularity; tag
+ * key of first way may be replaced with given string index */
+static std::string MakeDataBlock(uint64_t bad_key = 0) {
+	static const char* const strings[] = { "natural", "tree", "building", "yes", "height", "12", "highway", "residential", "name", "Test street", "type", "route", "stop" };
+
+	const TestNode& plain = NODES[NNODES - 1];
+	std::string node;
+	PutSVarintField(node, 1, plain.id);
+	PutPackedField(node, 2, std::vector<uint64_t>(1, 1));
+	PutPackedField(node, 3, std::vector<uint64_t>(1, 2));
+	PutSVarintField(node, 8, plain.lat * 10LL);
+	PutSVarintField(node, 9, plain.lon * 10LL);
+
+	std::string nodes;
+	PutBytesField(nodes, 1, node);
+
+	std::string ways;
+	{
+		uint64_t keys[] = { bad_key ? bad_key : 3, 5 }, vals[] = { 4, 6 };
+		int64_t refs[] = { 1, 2, 3, 4, 1 };
+		std::string way;
+		PutVarintField(way, 1, 10);
+		PutPackedField(way, 2, std::vector<uint64_t>(keys, keys + 2));
+		PutPackedField(way, 3, std::vector<uint64_t>(vals, vals + 2));
+		PutDeltasField(way, 8, std::vector<int64_t>(refs, refs + 5));
+		PutBytesField(ways, 3, way);
+	}
+	{
+		uint64_t keys[] = { 7, 9 }, vals[] = { 8, 10 };
+		int64_t refs[] = { 5, 7 };
+		std::string way;
+		PutVarintField(way, 1, 12);
+		PutPackedField(way, 2, std::vector<uint64_t>(keys, keys + 2));
+		PutPackedField(way, 3, std::vector<uint64_t>(vals, vals + 2));
+		PutDeltasField(way, 8, std::vector<int64_t>(refs, refs + 2));
+		PutBytesField(ways, 3, way);
+	}
+
+	std::string relations;
+	{
+		uint64_t roles[] = { 0, 13 }, types[] = { 1, 0 };
+		int64_t memids[] = { 12, 5 };
+		std::string relation;
+		PutVarintField(relation, 1, 20);
+		PutPackedField(relation, 2, std::vector<uint64_t>(1, 11));
+		PutPackedField(relation, 3, std::vector<uint64_t>(1, 12));
+		PutPackedField(relation, 8, std::vector<uint64_t>(roles, roles + 2));
+		PutDeltasField(relation, 9, std::vector<int64_t>(memids, memids + 2));
+		PutPackedField(relation, 10, std::vector<uint64_t>(types, types + 2));
+		PutBytesField(relations, 4, relation);
+	}
+
+	std::string block;
+	PutBytesField(block, 1, MakeStringTable(strings, 13));
+	PutBytesField(block, 2, nodes);
+	PutBytesField(block, 2, ways);
+	PutBytesField(block, 2, relations);
+	return block;
+}
+
+static std::string MakePbf(uint64_t bad_key = 0) {
+	return MakeFileBlock("OSMHeader", MakeHeader(), false) +
+		MakeFileBlock("OSMData", MakeDenseBlock(), true) +
+		MakeFileBlock("OSMData", MakeDataBlock(bad_key), false);
+}
+
+static bool SameBBox(const BBoxi& a, const BBoxi& b) {
+	return a.left == b.left && a.bottom == b.bottom && a.right == b.right && a.top == b.top;
+}
+
+static bool SameTags(const OsmDatasource::TagsMap& a, const OsmDatasource::TagsMap& b) {
+	return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+static bool SameTaggedNodes(const OsmDatasource& a, const OsmDatasource& b) {
+	std::vector<OsmDatasource::TaggedNode> na, nb;
+	a.GetTaggedNodes(na, BBoxi::ForEarth());
+	b.GetTaggedNodes(nb, BBoxi::ForEarth());
+	if (na.size() != nb.size())
+		return false;
+	for (size_t i = 0; i < na.size(); ++i)
+		if (na[i].Id != nb[i].Id || na[i].Pos != nb[i].Pos || na[i].TagsCount != nb[i].TagsCount || !std::equal(na[i].Tags, na[i].Tags + na[i].TagsCount, nb[i].Tags))
+			return false;
+	return true;
+}
+
+/* loads a broken dump; returns true if it was rejected */
+static bool Rejects(const TempDir& dir, const std::string& data, int nthreads = 1) {
+	PreloadedPbfDatasource pbf(0, nthreads);
+	try {
+		pbf.Load(dir.WriteFile("broken.osm.pbf", data).c_str());
+	} catch (ParsingException&) {
+		return true;
+	}
+	return false;
+}
+
+BEGIN_TEST()
+	TempDir dir("pbf");
+
+	PreloadedXmlDatasource xml(PreloadedXmlDatasource::NODE_TAGS);
+	xml.Load(dir.WriteFile("test.osm", MakeXml()).c_str());
+
+	std::string pbf_path = dir.WriteFile("test.osm.pbf", MakePbf());
+
+	/* single thread, and several decoding blocks in parallel */
+	for (int nthreads = 1; nthreads <= 4; nthreads += 3) {
+		PreloadedPbfDatasource pbf(PreloadedXmlDatasource::NODE_TAGS, nthreads);
+		pbf.Load(pbf_path.c_str());
+
+		EXPECT_TRUE(SameBBox(pbf.GetBBox(), xml.GetBBox()));
+
+		int mismatches = 0;
+		for (int i = 0; i < NNODES; ++i)
+			if (pbf.GetNode(NODES[i].id).Pos != xml.GetNode(NODES[i].id).Pos)
+				mismatches++;
+		EXPECT_INT(mismatches, 0);
+
+		EXPECT_TRUE(SameTaggedNodes(pbf, xml));
+
+		for (osmid_t id = 10; id <= 12; id += 2) {
+			const OsmDatasource::Way& a = pbf.GetWay(id);
+			const OsmDatasource::Way& b = xml.GetWay(id);
+			EXPECT_TRUE(a.Nodes == b.Nodes);
+			EXPECT_TRUE(SameTags(a.Tags, b.Tags));
+			EXPECT_INT(a.Class, b.Class);
+			EXPECT_TRUE(SameBBox(a.BBox, b.BBox));
+		}
+		EXPECT_INT(pbf.GetWay(10).Class, OsmDatasource::Way::BUILDING);
+
+		const OsmDatasource::Relation& a = pbf.GetRelation(20);
+		const OsmDatasource::Relation& b = xml.GetRelation(20);
+		EXPECT_INT(a.Members.size(), 2);
+		EXPECT_INT(b.Members.size(), 2);
+		for (size_t i = 0; i < a.Members.size() && i < b.Members.size(); ++i)
+			EXPECT_TRUE(a.Members[i].Type == b.Members[i].Type && a.Members[i].Ref == b.Members[i].Ref && a.Members[i].Role == b.Members[i].Role);
+		EXPECT_TRUE(SameTags(a.Tags, b.Tags));
+	}
+
+	/* node tags are only loaded when asked for */
+	{
+		PreloadedPbfDatasource pbf;
+		pbf.Load(pbf_path.c_str());
+		std::vector<OsmDatasource::TaggedNode> nodes;
+		pbf.GetTaggedNodes(nodes, BBoxi::ForEarth());
+		EXPECT_INT(nodes.size(), 0);
+		EXPECT_TRUE(pbf.GetNode(5).Pos == xml.GetNode(5).Pos);
+	}
+
+	/* broken dumps */
+	std::string good = MakePbf();
+	std::string header = MakeFileBlock("OSMHeader", MakeHeader(), false);
+	std::string dense = MakeFileBlock("OSMData", MakeDenseBlock(), true);
+	std::string data = MakeFileBlock("OSMData", MakeDataBlock(), false);
+
+	EXPECT_TRUE(!Rejects(dir, good));
+
+	/* file ends in the middle of a blob */
+	EXPECT_TRUE(Rejects(dir, good.substr(0, good.size() - 10)));
+
+	/* and in the middle of blob header length */
+	EXPECT_TRUE(Rejects(dir, header + dense.substr(0, 2)));
+
+	/* compressed data is cut, but blob sizes are consistent */
+	{
+		std::string data = MakeDenseBlock();
+		uLongf len = compressBound(data.size());
+		std::vector<char> zdata(len);
+		compress2((Bytef*)&zdata[0], &len, (const Bytef*)data.data(), data.size(), 9);
+
+		std::string blob;
+		PutVarintField(blob, 2, data.size());
+		PutBytesField(blob, 3, std::string(&zdata[0], len / 2));
+
+		std::string blob_header;
+		PutBytesField(blob_header, 1, "OSMData");
+		PutVarintField(blob_header, 3, blob.size());
+
+		std::string block;
+		for (int shift = 24; shift >= 0; shift -= 8)
+			block += (char)(blob_header.size() >> shift & 0xff);
+
+		EXPECT_TRUE(Rejects(dir, header + block + blob_header + blob));
+		EXPECT_TRUE(Rejects(dir, header + block + blob_header + blob + data, 4));
+	}
+
+	/* raw block data is cut in the middle of a varint */
+	{
+		std::string block = MakeDataBlock();
+		size_t cut = block.size() - 1;
+		while (cut > 0 && !(block[cut - 1] & 0x80))
+			cut--;
+		EXPECT_TRUE(cut > 0);
+		EXPECT_TRUE(Rejects(dir, header + MakeFileBlock("OSMData", block.substr(0, cut), false)));
+	}
+
+	/* string table index out of range */
+	EXPECT_TRUE(Rejects(dir, MakePbf(100)));
+
+	/* unsupported required feature */
+	{
+		std::string features = MakeHeader();
+		PutBytesField(features, 4, "HistoricalInformation");
+		EXPECT_TRUE(Rejects(dir, MakeFileBlock("OSMHeader", features, false) + dense + data));
+	}
+END_TEST()
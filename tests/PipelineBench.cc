@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a benchmark of whole data pipeline: loading OSM XML,
+ * getting ways by bbox, generating geometry, constructing tiles,
+ * fetching heightmaps and (optionally) rendering tiles with tiler.
+ *
+ * Besides testdata, it generates synthetic city of given size
+ * with a grid of streets and buildings, and synthetic SRTM chunk
+ * under it, so results are reproducible. Each stage is run
+ * several times and best time is reported; results are printed
+ * to stderr and written as JSON (to stdout by default), for
+ * tracking regressions.
+ *
+ * Usage: PipelineBench [-d testdata] [-s citysize] [-t glosm-tiler] [-o results.json]
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/GeometryGenerator.hh>
+#include <glosm/GeometryTile.hh>
+#include <glosm/MercatorProjection.hh>
+#include <glosm/DummyHeightmap.hh>
+#include <glosm/SRTMDatasource.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/Timer.hh>
+#include <glosm/geomath.h>
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef TESTDATA_DIR
+#	define TESTDATA_DIR "../testdata"
+#endif
+
+/* runs of each stage; best one is reported */
+static const int REPEATS = 3;
+
+/* synthetic city: blocks of 0.001 degree (~110m) from 0.5E 0.5N, in
+ * the middle of N00E000 SRTM chunk */
+static const double CITY_ORIGIN = 0.5;
+static const double CITY_BLOCK = 0.001;
+
+struct BenchResult {
+	std::string name;
+	double seconds;
+	double count;
+	std::string unit;
+
+	BenchResult(const std::string& n, double s, double c, const std::string& u) : name(n), seconds(s), count(c), unit(u) {
+	}
+};
+
+static std::vector<BenchResult> bench_results;
+
+static void ReportBench(const std::string& name, double seconds, double count, const char* unit) {
+	fprintf(stderr, "  %-40s %10.4f sec, %12.0f %s, %14.1f %s/sec\n", name.c_str(), seconds, count, unit, seconds > 0.0 ? count / seconds : 0.0, unit);
+	bench_results.push_back(BenchResult(name, seconds, count, unit));
+}
+
+static BBoxi GetCityBBox(int size) {
+	return BBoxi(
+			(osmint_t)(CITY_ORIGIN * GEOM_UNITSINDEGREE),
+			(osmint_t)(CITY_ORIGIN * GEOM_UNITSINDEGREE),
+			(osmint_t)((CITY_ORIGIN + size * CITY_BLOCK) * GEOM_UNITSINDEGREE),
+			(osmint_t)((CITY_ORIGIN + size * CITY_BLOCK) * GEOM_UNITSINDEGREE)
+		);
+}
+
+/* writes size x size blocks, each with 4 buildings, streets between
+ * blocks and a park in every 5th block */
+static void WriteCity(const char* path, int size) {
+	FILE* f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	srand(1);
+
+	fprintf(f, "<?xml version='1.0' encoding='UTF-8'?>\n<osm version='0.6' generator='PipelineBench'>\n");
+
+	/* street intersections are nodes 1..(size+1)^2 */
+	long id = 1;
+	for (int y = 0; y <= size; ++y)
+		for (int x = 0; x <= size; ++x)
+			fprintf(f, " <node id='%ld' lat='%.7f' lon='%.7f'/>\n", id++, CITY_ORIGIN + y * CITY_BLOCK, CITY_ORIGIN + x * CITY_BLOCK);
+
+	/* building corners */
+	const double offsets[4][2] = { { 0.1, 0.1 }, { 0.55, 0.1 }, { 0.1, 0.55 }, { 0.55, 0.55 } };
+	const double side = 0.35;
+	long first_corner = id;
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			for (int b = 0; b < 4; ++b) {
+				double lon = CITY_ORIGIN + (x + offsets[b][0]) * CITY_BLOCK;
+				double lat = CITY_ORIGIN + (y + offsets[b][1]) * CITY_BLOCK;
+				fprintf(f, " <node id='%ld' lat='%.7f' lon='%.7f'/>\n", id++, lat, lon);
+				fprintf(f, " <node id='%ld' lat='%.7f' lon='%.7f'/>\n", id++, lat, lon + side * CITY_BLOCK);
+				fprintf(f, " <node id='%ld' lat='%.7f' lon='%.7f'/>\n", id++, lat + side * CITY_BLOCK, lon + side * CITY_BLOCK);
+				fprintf(f, " <node id='%ld' lat='%.7f' lon='%.7f'/>\n", id++, lat + side * CITY_BLOCK, lon);
+			}
+		}
+	}
+
+	long way = 1;
+
+	/* streets */
+	for (int y = 0; y <= size; ++y) {
+		fprintf(f, " <way id='%ld'>\n", way++);
+		for (int x = 0; x <= size; ++x)
+			fprintf(f, "  <nd ref='%ld'/>\n", 1 + (long)y * (size + 1) + x);
+		fprintf(f, "  <tag k='highway' v='residential'/>\n </way>\n");
+	}
+	for (int x = 0; x <= size; ++x) {
+		fprintf(f, " <way id='%ld'>\n", way++);
+		for (int y = 0; y <= size; ++y)
+			fprintf(f, "  <nd ref='%ld'/>\n", 1 + (long)y * (size + 1) + x);
+		fprintf(f, "  <tag k='highway' v='%s'/>\n </way>\n", x % 4 == 0 ? "primary" : "residential");
+	}
+
+	/* buildings, parks */
+	long corner = first_corner;
+	for (int block = 0; block < size * size; ++block) {
+		for (int b = 0; b < 4; ++b, corner += 4) {
+			fprintf(f, " <way id='%ld'>\n", way++);
+			for (int i = 0; i <= 4; ++i)
+				fprintf(f, "  <nd ref='%ld'/>\n", corner + i % 4);
+			fprintf(f, "  <tag k='building' v='yes'/>\n  <tag k='building:levels' v='%d'/>\n", 1 + rand() % 12);
+			if (rand() % 3 == 0)
+				fprintf(f, "  <tag k='building:roof:shape' v='pitched'/>\n");
+			fprintf(f, " </way>\n");
+		}
+
+		if (block % 5 == 0) {
+			long c = corner - 16;
+			fprintf(f, " <way id='%ld'>\n  <nd ref='%ld'/>\n  <nd ref='%ld'/>\n  <nd ref='%ld'/>\n  <nd ref='%ld'/>\n  <nd ref='%ld'/>\n", way++, c, c + 5, c + 14, c + 11, c);
+			fprintf(f, "  <tag k='leisure' v='park'/>\n </way>\n");
+		}
+	}
+
+	fprintf(f, "</osm>\n");
+	fclose(f);
+}
+
+/* writes SRTM3 chunk with smooth hills under the city */
+static void WriteHgt(const char* dir) {
+	std::string path = std::string(dir) + "/N00E000.hgt";
+	FILE* f = fopen(path.c_str(), "wb");
+	if (f == NULL) {
+		perror(path.c_str());
+		exit(1);
+	}
+
+	std::vector<unsigned char> row(1201 * 2);
+	for (int y = 0; y < 1201; ++y) {
+		for (int x = 0; x < 1201; ++x) {
+			int h = 100 + (int)(50.0 * sin(x * 0.05) * cos(y * 0.07));
+			row[x * 2] = (h >> 8) & 0xff;
+			row[x * 2 + 1] = h & 0xff;
+		}
+		fwrite(&row[0], 1, row.size(), f);
+	}
+
+	fclose(f);
+}
+
+/* tile-sized bboxes of given level covering area */
+static void GetTileBBoxes(const BBoxi& area, int level, std::vector<BBoxi>& out) {
+	osmint_t lonspan = GEOM_LONSPAN >> level;
+	osmint_t latspan = GEOM_LATSPAN >> level;
+
+	for (osmlong_t x = (osmlong_t)area.left - ((osmlong_t)area.left - GEOM_MINLON) % lonspan; x < area.right; x += lonspan)
+		for (osmlong_t y = (osmlong_t)area.bottom - ((osmlong_t)area.bottom - GEOM_MINLAT) % latspan; y < area.top; y += latspan)
+			out.push_back(BBoxi((osmint_t)x, (osmint_t)y, (osmint_t)(x + lonspan), (osmint_t)(y + latspan)));
+}
+
+static void BenchLoad(const std::string& name, const std::string& path, int flags = 0) {
+	double best = 0.0;
+	size_t size = 0;
+	for (int i = 0; i < REPEATS; ++i) {
+		PreloadedXmlDatasource datasource(flags);
+		Timer timer;
+		datasource.Load(path.c_str());
+		double t = timer.Count();
+		if (i == 0 || t < best)
+			best = t;
+
+		FILE* f = fopen(path.c_str(), "r");
+		if (f) {
+			fseek(f, 0, SEEK_END);
+			size = ftell(f);
+			fclose(f);
+		}
+	}
+
+	ReportBench(((flags & PreloadedXmlDatasource::FAST_XML_SCAN) ? "xml_scan/" : "xml_load/") + name, best, size, "bytes");
+}
+
+static void BenchGetWays(const PreloadedXmlDatasource& datasource, const BBoxi& area) {
+	for (int level = 12; level <= 16; level += 2) {
+		std::vector<BBoxi> bboxes;
+		GetTileBBoxes(area, level, bboxes);
+
+		double best = 0.0;
+		for (int i = 0; i < REPEATS; ++i) {
+			std::vector<const OsmDatasource::Way*> ways;
+			Timer timer;
+			for (std::vector<BBoxi>::const_iterator b = bboxes.begin(); b != bboxes.end(); ++b) {
+				ways.clear();
+				datasource.GetWays(ways, *b);
+			}
+			double t = timer.Count();
+			if (i == 0 || t < best)
+				best = t;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "get_ways/level%d", level);
+		ReportBench(name, best, bboxes.size(), "queries");
+	}
+}
+
+static void BenchGetGeometry(const PreloadedXmlDatasource& datasource, HeightmapDatasource& heightmap, const BBoxi& area) {
+	static const struct {
+		const char* name;
+		int flags;
+		int level;
+	} variants[] = {
+		{ "ground", GeometryDatasource::GROUND, 14 },
+		{ "ground_simplified", GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY, 12 },
+		{ "detail", GeometryDatasource::DETAIL, 14 },
+	};
+
+	MercatorProjection projection;
+
+	for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+		std::vector<BBoxi> bboxes;
+		GetTileBBoxes(area, variants[v].level, bboxes);
+
+		double best_generate = 0.0, best_tile = 0.0;
+		size_t vertices = 0;
+		for (int i = 0; i < REPEATS; ++i) {
+			/* fresh generator, so ways are not taken from its cache */
+			GeometryGenerator generator(datasource, heightmap);
+
+			std::vector<Geometry> geometries(bboxes.size());
+			Timer timer;
+			for (size_t b = 0; b < bboxes.size(); ++b)
+				generator.GetGeometry(geometries[b], bboxes[b], variants[v].flags);
+			double t = timer.Count();
+			if (i == 0 || t < best_generate)
+				best_generate = t;
+
+			vertices = 0;
+			timer.Count();
+			for (size_t b = 0; b < bboxes.size(); ++b) {
+				GeometryTile tile(projection, geometries[b], bboxes[b].GetCenter(), bboxes[b], GeometryTile::WELD_VERTICES | GeometryTile::QUANTIZE_VERTICES);
+				vertices += geometries[b].GetLinesVertices().size() + geometries[b].GetConvexVertices().size();
+			}
+			t = timer.Count();
+			if (i == 0 || t < best_tile)
+				best_tile = t;
+		}
+
+		ReportBench(std::string("get_geometry/") + variants[v].name, best_generate, bboxes.size(), "tiles");
+		ReportBench(std::string("geometry_tile/") + variants[v].name, best_tile, vertices, "vertices");
+	}
+}
+
+static void BenchHeightmap(const char* srtmdir, const BBoxi& area) {
+	for (int level = 12; level <= 16; level += 2) {
+		std::vector<BBoxi> bboxes;
+		GetTileBBoxes(area, level, bboxes);
+
+		double best = 0.0;
+		size_t points = 0;
+		for (int i = 0; i < REPEATS; ++i) {
+			/* chunk is loaded once, then fetches hit the cache */
+			SRTMDatasource srtm(srtmdir);
+			HeightmapDatasource::Heightmap heightmap;
+			srtm.GetHeightmap(bboxes[0], 1, heightmap);
+
+			points = 0;
+			Timer timer;
+			for (std::vector<BBoxi>::const_iterator b = bboxes.begin(); b != bboxes.end(); ++b) {
+				srtm.GetHeightmap(*b, 1, heightmap);
+				points += heightmap.points.size();
+			}
+			double t = timer.Count();
+			if (i == 0 || t < best)
+				best = t;
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), "srtm_heightmap/level%d", level);
+		ReportBench(name, best, points, "points");
+	}
+}
+
+static void BenchTiler(const char* tiler, const std::string& osm, const BBoxi& area, const std::string& outdir) {
+	char command[1024];
+	snprintf(command, sizeof(command), "'%s' -b egl -z 14 -Z 17 -x %f -X %f -y %f -Y %f '%s' '%s' 2>&1",
+			tiler,
+			(double)area.left / GEOM_UNITSINDEGREE, (double)area.right / GEOM_UNITSINDEGREE,
+			(double)area.bottom / GEOM_UNITSINDEGREE, (double)area.top / GEOM_UNITSINDEGREE,
+			osm.c_str(), outdir.c_str());
+
+	double best = 0.0;
+	int tiles = 0;
+	for (int i = 0; i < REPEATS; ++i) {
+		FILE* p = popen(command, "r");
+		if (p == NULL) {
+			perror("popen");
+			return;
+		}
+
+		/* tiler reports rendering time without loading */
+		char line[1024];
+		double seconds = -1.0;
+		while (fgets(line, sizeof(line), p) != NULL) {
+			double s;
+			int n;
+			if (sscanf(line, "%lf seconds, %d tiles", &s, &n) == 2) {
+				seconds = s;
+				tiles = n;
+			}
+		}
+
+		if (pclose(p) != 0 || seconds < 0.0) {
+			fprintf(stderr, "  tiler failed, skipped\n");
+			return;
+		}
+
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+
+	ReportBench("tiler/city", best, tiles, "tiles");
+}
+
+static void WriteResults(const char* path, int citysize) {
+	FILE* f = path ? fopen(path, "w") : stdout;
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(f, "{\n  \"city_size\": %d,\n  \"cpus\": %ld,\n  \"benchmarks\": [\n", citysize, sysconf(_SC_NPROCESSORS_ONLN));
+	for (size_t i = 0; i < bench_results.size(); ++i) {
+		const BenchResult& r = bench_results[i];
+		fprintf(f, "    { \"name\": \"%s\", \"seconds\": %.6f, \"count\": %.0f, \"unit\": \"%s\", \"rate\": %.3f }%s\n",
+				r.name.c_str(), r.seconds, r.count, r.unit.c_str(), r.seconds > 0.0 ? r.count / r.seconds : 0.0,
+				i + 1 < bench_results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+
+	if (f != stdout)
+		fclose(f);
+}
+
+int main(int argc, char** argv) {
+	const char* testdata = TESTDATA_DIR;
+	const char* tiler = NULL;
+	const char* output = NULL;
+	int citysize = 40;
+
+	int c;
+	while ((c = getopt(argc, argv, "d:s:t:o:")) != -1) {
+		switch (c) {
+		case 'd': testdata = optarg; break;
+		case 's': citysize = atoi(optarg); break;
+		case 't': tiler = optarg; break;
+		case 'o': output = optarg; break;
+		default:
+			fprintf(stderr, "Usage: %s [-d testdata] [-s citysize] [-t glosm-tiler] [-o results.json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (citysize < 1)
+		citysize = 1;
+
+	char dir[] = "/tmp/glosm-bench-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	std::string dirname = dir;
+	std::string small_city = dirname + "/city-small.osm";
+	std::string city = dirname + "/city.osm";
+
+	WriteCity(small_city.c_str(), std::max(1, citysize / 4));
+	WriteCity(city.c_str(), citysize);
+	WriteHgt(dir);
+
+	BBoxi area = GetCityBBox(citysize);
+
+	try {
+		fprintf(stderr, "XML loading:\n");
+		BenchLoad("glosm.osm", std::string(testdata) + "/glosm.osm");
+		BenchLoad("glosm.osm", std::string(testdata) + "/glosm.osm", PreloadedXmlDatasource::FAST_XML_SCAN);
+		BenchLoad("grid.osm", std::string(testdata) + "/grid.osm");
+		BenchLoad("city-small", small_city);
+		BenchLoad("city", city);
+		BenchLoad("city", city, PreloadedXmlDatasource::FAST_XML_SCAN);
+
+		PreloadedXmlDatasource datasource;
+		datasource.Load(city.c_str());
+		DummyHeightmap heightmap;
+
+		fprintf(stderr, "Getting ways:\n");
+		BenchGetWays(datasource, area);
+
+		fprintf(stderr, "Generating geometry:\n");
+		BenchGetGeometry(datasource, heightmap, area);
+
+		fprintf(stderr, "Fetching heightmaps:\n");
+		BenchHeightmap(dir, area);
+
+		if (tiler) {
+			fprintf(stderr, "Rendering tiles:\n");
+			BenchTiler(tiler, city, area, dirname + "/tiles");
+		}
+	} catch (std::exception& e) {
+		fprintf(stderr, "Exception: %s\n", e.what());
+		return 1;
+	}
+
+	WriteResults(output, citysize);
+
+	std::string cleanup = "rm -rf '" + dirname + "'";
+	if (system(cleanup.c_str()) != 0)
+		fprintf(stderr, "Cannot remove %s\n", dir);
+
+	return 0;
+}
@@ -31,6 +31,15 @@
 #include <glosm/MercatorProjection.hh>
 #include <glosm/SphericalProjection.hh>
 
+#include <vector>
+
+static const Vector3i refs[] = {
+	Vector3i(GEOM_UNITSINDEGREE * 45, GEOM_UNITSINDEGREE * 60, 10),
+	Vector3i(GEOM_UNITSINDEGREE * -45, GEOM_UNITSINDEGREE * -60, 10),
+	Vector3i(GEOM_UNITSINDEGREE * 45, GEOM_UNITSINDEGREE * -60, 10),
+	Vector3i(GEOM_UNITSINDEGREE * -45, GEOM_UNITSINDEGREE * 60, 10),
+};
+
 void ProjBench(Projection projection) {
 	int count = 0;
 
@@ -49,15 +58,80 @@ void ProjBench(Projection projection) {
 
 	float sec = (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
 
-	fprintf(stderr, "  %d points, %f seconds, %f points per second\n", count, sec, (float)count/sec);
+	fprintf(stderr, "  Project:     %d points, %f seconds, %f points per second\n", count, sec, (float)count/sec);
+}
+
+void ProjManyBench(Projection projection) {
+	/* same points as above, batched; runs of consecutive points
+	 * share longitude, like terrain grid columns do */
+	std::vector<Vector3i> points;
+	for (int lon = GEOM_MINLON; lon <= GEOM_MAXLON; lon += GEOM_UNITSINDEGREE/4)
+		for (int lat = GEOM_MINLAT; lat <= GEOM_MAXLAT; lat += GEOM_UNITSINDEGREE/4)
+			points.push_back(Vector3i(lon, lat, 10));
+
+	std::vector<Vector3f> out(points.size());
+	int count = 0;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	for (unsigned int i = 0; i < sizeof(refs)/sizeof(refs[0]); ++i) {
+		projection.ProjectMany(&points[0], points.size(), refs[i], &out[0]);
+		count += points.size();
+	}
+	gettimeofday(&end, NULL);
+
+	float sec = (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
+
+	/* check that batched path matches scalar one */
+	int mismatches = 0;
+	for (size_t i = 0; i < points.size(); ++i) {
+		Vector3f scalar = projection.Project(points[i], refs[3]);
+		if (scalar.x != out[i].x || scalar.y != out[i].y || scalar.z != out[i].z)
+			mismatches++;
+	}
+
+	fprintf(stderr, "  ProjectMany: %d points, %f seconds, %f points per second, %d mismatches\n", count, sec, (float)count/sec, mismatches);
+}
+
+void ProjTileBench(Projection projection) {
+	/* points of a tile around each ref, like in geometry tiles;
+	 * latitude changes with each point, so it's never cached */
+	std::vector<Vector3i> points;
+	for (int x = 0; x < 256; ++x)
+		for (int y = 0; y < 256; ++y)
+			points.push_back(Vector3i(x * (GEOM_UNITSINDEGREE / 10000), y * (GEOM_UNITSINDEGREE / 10000), 10));
+
+	std::vector<Vector3i> shifted(points.size());
+	std::vector<Vector3f> out(points.size());
+	int count = 0;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	for (int pass = 0; pass < 25; ++pass) {
+		for (unsigned int i = 0; i < sizeof(refs)/sizeof(refs[0]); ++i) {
+			for (size_t j = 0; j < points.size(); ++j)
+				shifted[j] = refs[i] + points[j];
+			projection.ProjectMany(&shifted[0], shifted.size(), refs[i], &out[0]);
+			count += points.size();
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	float sec = (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
+
+	fprintf(stderr, "  Tile:        %d points, %f seconds, %f points per second\n", count, sec, (float)count/sec);
 }
 
 int main() {
 	fprintf(stderr, "MercatorProjection:\n");
 	ProjBench(MercatorProjection());
+	ProjManyBench(MercatorProjection());
+	ProjTileBench(MercatorProjection());
 
 	fprintf(stderr, "SphericalProjection:\n");
 	ProjBench(SphericalProjection());
+	ProjManyBench(SphericalProjection());
+	ProjTileBench(SphericalProjection());
 
 	return 0;
 }
@@ -21,12 +21,15 @@
 /*
  * This test projects a point using Mercator projection, then
  * unprojects it. Result of project/unproject should match the
- * original point if the point is not far from origin.
+ * original point if the point is not far from origin. It also
+ * checks that series approximation used by Mercator projector
+ * near reference point is as accurate as float result allows.
  */
 
 #include <stdio.h>
 #include <limits>
 #include <stdlib.h>
+#include <math.h>
 
 #include <glosm/MercatorProjection.hh>
 #include <glosm/SphericalProjection.hh>
@@ -90,11 +93,80 @@ int ProjTest(Projection projection) {
 	return result;
 }
 
+int ProjManyTest(Projection projection) {
+	/* batched projection must match the scalar one exactly;
+	 * repeated coordinates exercise per-axis caching */
+	Vector3i points[] = {
+		Vector3i(100000000, 500000000, 1000),
+		Vector3i(100000000, 500000000, 2000),
+		Vector3i(100000000, 500001000, 2000),
+		Vector3i(100001000, 500001000, 0),
+		Vector3i(-100000000, -500000000, 0),
+		Vector3i(-100000000, 500001000, 5000),
+	};
+	Vector3i ref(100000000, 500000000, 100);
+
+	const unsigned int npoints = sizeof(points)/sizeof(points[0]);
+
+	Vector3f batched[npoints];
+	projection.ProjectMany(points, npoints, ref, batched);
+
+	int result = 0;
+	for (unsigned int i = 0; i < npoints; ++i) {
+		Vector3f scalar = projection.Project(points[i], ref);
+		if (scalar.x != batched[i].x || scalar.y != batched[i].y || scalar.z != batched[i].z) {
+			printf("ProjectMany mismatch for point %u\n", i);
+			result = 1;
+		}
+	}
+
+	return result;
+}
+
+int MercatorApproxTest() {
+	MercatorProjection projection;
+	int result = 0;
+	double maxyerror = 0.0, maxzerror = 0.0;
+
+	for (int reflat = -80; reflat <= 80; reflat += 5) {
+		Vector3i ref(0, reflat * GEOM_UNITSINDEGREE, 100);
+		double refy = mercator((double)ref.y * GEOM_DEG_TO_RAD);
+
+		/* points on both sides of series range */
+		for (int i = -1000; i <= 1000; ++i) {
+			Vector3i point(1000, ref.y + i * (GEOM_UNITSINDEGREE / 400), 100000);
+			double lat = (double)point.y * GEOM_DEG_TO_RAD;
+
+			double y = mercator(lat) - refy;
+			double z = (double)(point.z - ref.z) / GEOM_UNITSINMETER / (WGS84_EARTH_EQ_RADIUS * cos(lat));
+
+			Vector3f projected = projection.Project(point, ref);
+
+			/* beyond float rounding */
+			double yerror = fabs(projected.y - y) - fabs(y) * std::numeric_limits<float>::epsilon();
+			double zerror = fabs(projected.z - z) / fabs(z) - std::numeric_limits<float>::epsilon();
+
+			maxyerror = std::max(maxyerror, yerror);
+			maxzerror = std::max(maxzerror, zerror);
+		}
+	}
+
+	printf("Mercator approximation: max y error %g rad, max relative z error %g beyond float rounding\n", maxyerror, maxzerror);
+
+	if (maxyerror > 1e-10 || maxzerror > 0.0)
+		result = 1;
+
+	return result;
+}
+
 int main() {
 	int result = 0;
 
 	result |= ProjTest(MercatorProjection());
 	result |= ProjTest(SphericalProjection());
+	result |= ProjManyTest(MercatorProjection());
+	result |= ProjManyTest(SphericalProjection());
+	result |= MercatorApproxTest();
 
 	return result;
 }
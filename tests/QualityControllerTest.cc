@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that QualityController maps quality to layer
+ * settings within bounds, and that it lowers quality on slow
+ * frames and raises it on fast ones.
+ */
+
+#include <glosm/QualityController.hh>
+#include <glosm/GeometryLayer.hh>
+#include <glosm/GeometryDatasource.hh>
+#include <glosm/MercatorProjection.hh>
+
+#include "testing.h"
+
+class EmptyDatasource : public GeometryDatasource {
+public:
+	virtual void GetGeometry(Geometry& /*unused*/, const BBoxi& /*unused*/, int /*unused*/) const {
+	}
+};
+
+static size_t GetSizeLimit(const TileManager& layer) {
+	TileManager::Statistics stats;
+	layer.GetStatistics(stats);
+	return stats.size_limit;
+}
+
+BEGIN_TEST()
+	EmptyDatasource datasource;
+	GeometryLayer layer(MercatorProjection(), datasource);
+
+	QualityController controller(25.0f);
+	controller.AddLayer(&layer, QualityController::LayerBounds(1000.0f, 3000.0f, 0.5f, 1.5f, 1000, 3000));
+
+	// starts in the middle of bounds
+	EXPECT_TRUE(controller.GetQuality() == 0.5f);
+	EXPECT_INT(GetSizeLimit(layer), 2000);
+
+	// clamped to bounds
+	controller.SetQuality(2.0f);
+	EXPECT_TRUE(controller.GetQuality() == 1.0f);
+	EXPECT_INT(GetSizeLimit(layer), 3000);
+
+	controller.SetQuality(-1.0f);
+	EXPECT_TRUE(controller.GetQuality() == 0.0f);
+	EXPECT_INT(GetSizeLimit(layer), 1000);
+
+	// slow frames lower quality once per interval
+	controller.SetQuality(0.5f);
+	for (int i = 0; i < 9; ++i)
+		controller.Update(0.1f);
+	EXPECT_TRUE(controller.GetQuality() == 0.5f);
+	controller.Update(0.1f);
+	EXPECT_TRUE(controller.GetQuality() < 0.5f);
+	EXPECT_TRUE(GetSizeLimit(layer) < 2000);
+
+	// frames within target keep it
+	float quality = controller.GetQuality();
+	for (int i = 0; i < 100; ++i)
+		controller.Update(0.04f);
+	EXPECT_TRUE(controller.GetQuality() == quality);
+
+	// fast frames raise it, but slower than it was lowered
+	for (int i = 0; i < 60; ++i)
+		controller.Update(0.02f);
+	EXPECT_TRUE(controller.GetQuality() > quality);
+	EXPECT_TRUE(controller.GetQuality() < 0.5f);
+
+	// and up to the max bounds eventually
+	for (int i = 0; i < 5000; ++i)
+		controller.Update(0.01f);
+	EXPECT_TRUE(controller.GetQuality() == 1.0f);
+	EXPECT_INT(GetSizeLimit(layer), 3000);
+END_TEST()
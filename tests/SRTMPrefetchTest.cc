@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that SRTMDatasource::Prefetch() loads chunks
+ * in background, nearest first and within cache limit, and that
+ * prefetched chunks are then used without loading them again.
+ */
+
+#include <glosm/SRTMDatasource.hh>
+#include <glosm/geomath.h>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const int TEST_HEIGHT = 100;
+
+static void WriteFlatChunk(const std::string& filename) {
+	/* SRTM3, big-endian */
+	std::vector<unsigned char> data(1201 * 1201 * 2);
+	for (size_t i = 0; i < data.size(); i += 2) {
+		data[i] = TEST_HEIGHT >> 8;
+		data[i + 1] = TEST_HEIGHT & 0xff;
+	}
+
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (f == NULL || fwrite(&data[0], data.size(), 1, f) != 1)
+		abort();
+	fclose(f);
+}
+
+/* waits for background loads to happen; gives up after 5 seconds */
+static unsigned int WaitForLoads(const SRTMDatasource& srtm, unsigned int loads) {
+	SRTMDatasource::Statistics stats;
+	for (int i = 0; i < 500; ++i) {
+		srtm.GetStatistics(stats);
+		if (stats.loads >= loads)
+			break;
+		usleep(10000);
+	}
+	return stats.loads;
+}
+
+static BBoxi DegreeBBox(double left, double bottom, double right, double top) {
+	return BBoxi((osmint_t)(left * GEOM_UNITSINDEGREE), (osmint_t)(bottom * GEOM_UNITSINDEGREE), (osmint_t)(right * GEOM_UNITSINDEGREE), (osmint_t)(top * GEOM_UNITSINDEGREE));
+}
+
+BEGIN_TEST()
+	TempDir dir("srtm");
+
+	WriteFlatChunk(dir.GetPath() + "/N00E000.hgt");
+
+	int flags[] = { 0, SRTMDatasource::MMAP_CHUNKS };
+	for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); ++f) {
+		// prefetched chunk is used afterwards
+		{
+			SRTMDatasource srtm(dir.GetPath().c_str(), flags[f]);
+			srtm.Prefetch(DegreeBBox(0.2, 0.2, 0.4, 0.4));
+
+			EXPECT_INT(WaitForLoads(srtm, 1), 1);
+
+			/* same chunks are not queued again */
+			srtm.Prefetch(DegreeBBox(0.2, 0.2, 0.5, 0.5));
+
+			EXPECT_INT(srtm.GetHeight(Vector2i(0.3 * GEOM_UNITSINDEGREE, 0.3 * GEOM_UNITSINDEGREE)), TEST_HEIGHT * GEOM_UNITSINMETER);
+
+			SRTMDatasource::Statistics stats;
+			srtm.GetStatistics(stats);
+			EXPECT_INT(stats.loads, 1);
+		}
+
+		// nearest chunks within half of cache limit
+		{
+			SRTMDatasource srtm(dir.GetPath().c_str(), flags[f]);
+			srtm.SetSizeLimit(2 * 1200 * 1200 * 2);
+			srtm.Prefetch(DegreeBBox(0.1, 0.1, 1.5, 0.9));
+
+			EXPECT_INT(WaitForLoads(srtm, 1), 1);
+			usleep(100000);
+
+			SRTMDatasource::Statistics stats;
+			srtm.GetStatistics(stats);
+			EXPECT_INT(stats.loads, 1);
+
+			/* nearest chunk is the one which exists */
+			EXPECT_INT(srtm.GetHeight(Vector2i(0.5 * GEOM_UNITSINDEGREE, 0.5 * GEOM_UNITSINDEGREE)), TEST_HEIGHT * GEOM_UNITSINMETER);
+			srtm.GetStatistics(stats);
+			EXPECT_INT(stats.loads, 1);
+		}
+
+		// destroying datasource with pending prefetches
+		{
+			SRTMDatasource srtm(dir.GetPath().c_str(), flags[f]);
+			srtm.Prefetch(DegreeBBox(0.1, 0.1, 0.9, 0.9));
+		}
+	}
+END_TEST()
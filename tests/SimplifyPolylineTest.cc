@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that polylines are simplified within given
+ * tolerance, keeping endpoints, and that the tolerance is the same
+ * for all tiles of a level.
+ */
+
+#include <glosm/GeometryOperations.hh>
+#include <glosm/geomath.h>
+
+#include "testing.h"
+
+#include <cmath>
+#include <vector>
+
+BEGIN_TEST()
+	/* collinear points are dropped */
+	{
+		std::vector<Vector2i> line;
+		for (int i = 0; i <= 100; ++i)
+			line.push_back(Vector2i(i * 1000, 0));
+		SimplifyPolyline(line, 10);
+		EXPECT_INT(line.size(), 2);
+		EXPECT_TRUE(line.front() == Vector2i(0, 0));
+		EXPECT_TRUE(line.back() == Vector2i(100000, 0));
+	}
+
+	/* deviations larger than tolerance are kept, smaller are not */
+	{
+		std::vector<Vector2i> line;
+		line.push_back(Vector2i(0, 0));
+		line.push_back(Vector2i(1000, 255));
+		line.push_back(Vector2i(2000, 500));
+		line.push_back(Vector2i(3000, 0));
+		SimplifyPolyline(line, 10);
+		EXPECT_INT(line.size(), 3);
+		EXPECT_TRUE(line[1] == Vector2i(2000, 500));
+	}
+
+	/* closed rings stay closed */
+	{
+		std::vector<Vector2i> ring;
+		for (int i = 0; i < 1000; ++i)
+			ring.push_back(Vector2i((int)(100000 * cos(i * 2.0 * M_PI / 1000)), (int)(100000 * sin(i * 2.0 * M_PI / 1000))));
+		ring.push_back(ring.front());
+		SimplifyPolyline(ring, 1000);
+		EXPECT_TRUE(ring.size() > 4 && ring.size() < 100);
+		EXPECT_TRUE(ring.front() == ring.back());
+	}
+
+	/* tolerance */
+	EXPECT_INT(GetSimplifyTolerance(100), 0);
+	EXPECT_INT(GetSimplifyTolerance((osmlong_t)GEOM_LONSPAN >> 10), 4096);
+	EXPECT_INT(GetSimplifyTolerance(((osmlong_t)GEOM_LONSPAN >> 10) - 1), 4096);
+	EXPECT_INT(GetSimplifyTolerance(GEOM_LONSPAN), 4194304);
+END_TEST()
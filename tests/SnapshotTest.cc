@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that snapshot written from XML data is read
+ * back by MmapOsmDatasource with the same ways, also when several
+ * threads request them at once, that holes of multipolygons are
+ * kept, and that damaged snapshots are rejected instead of being
+ * read out of bounds.
+ */
+
+#include <glosm/MmapOsmDatasource.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/OsmSnapshot.hh>
+#include <glosm/geomath.h>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static std::string ReadFile(const std::string& path) {
+	std::string data;
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == NULL)
+		return data;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, n);
+	fclose(f);
+	return data;
+}
+
+/* square area with a square hole */
+static const char* HOLE_OSM =
+	"<osm>\n"
+	" <node id='1' lat='10.0' lon='20.0'/>\n"
+	" <node id='2' lat='10.0' lon='20.3'/>\n"
+	" <node id='3' lat='10.3' lon='20.3'/>\n"
+	" <node id='4' lat='10.3' lon='20.0'/>\n"
+	" <node id='5' lat='10.1' lon='20.1'/>\n"
+	" <node id='6' lat='10.2' lon='20.1'/>\n"
+	" <node id='7' lat='10.2' lon='20.2'/>\n"
+	" <node id='8' lat='10.1' lon='20.2'/>\n"
+	" <way id='1'><nd ref='1'/><nd ref='2'/><nd ref='3'/><nd ref='4'/><nd ref='1'/></way>\n"
+	" <way id='2'><nd ref='5'/><nd ref='6'/><nd ref='7'/><nd ref='8'/><nd ref='5'/></way>\n"
+	" <relation id='1'><member type='way' ref='1' role='outer'/><member type='way' ref='2' role='inner'/><tag k='type' v='multipolygon'/><tag k='natural' v='water'/></relation>\n"
+	"</osm>\n";
+
+static int CountWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+	return ways.size();
+}
+
+/* ways as sorted list of their rings, coordinates and tags;
+ * coordinates are stored inline in snapshots and referenced by
+ * XML ways */
+static std::vector<std::string> DescribeWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+
+	std::vector<std::string> result;
+	for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w) {
+		char buf[64];
+		std::string desc;
+		snprintf(buf, sizeof(buf), "class %d closed %d cw %d rings", (int)(*w)->Class, (int)(*w)->Closed, (int)(*w)->Clockwise);
+		desc += buf;
+		for (std::vector<unsigned int>::const_iterator r = (*w)->Rings.begin(); r != (*w)->Rings.end(); ++r) {
+			snprintf(buf, sizeof(buf), " %u", *r);
+			desc += buf;
+		}
+		desc += ":";
+		std::vector<Vector2i> coords((*w)->GetCoordsBegin(), (*w)->GetCoordsEnd());
+		if (coords.empty()) {
+			OsmDatasource::Way::NodeIterator iterator(**w);
+			osmid_t id;
+			while (iterator.Next(id))
+				coords.push_back(datasource.GetNode(id).Pos);
+		}
+		for (std::vector<Vector2i>::const_iterator c = coords.begin(); c != coords.end(); ++c) {
+			snprintf(buf, sizeof(buf), " %d,%d", c->x, c->y);
+			desc += buf;
+		}
+		for (OsmDatasource::TagsMap::const_iterator t = (*w)->Tags.begin(); t != (*w)->Tags.end(); ++t)
+			desc += " " + StringTable::Instance().Get(t->first) + "=" + StringTable::Instance().Get(t->second);
+		result.push_back(desc);
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+struct GetWaysTask {
+	const OsmDatasource* datasource;
+	std::vector<const OsmDatasource::Way*> ways;
+};
+
+static void* GetWaysThread(void* arg) {
+	GetWaysTask* task = static_cast<GetWaysTask*>(arg);
+	task->datasource->GetWays(task->ways, BBoxi::ForEarth());
+	return NULL;
+}
+
+static OsmSnapshot::Header GetHeader(const std::string& snapshot) {
+	OsmSnapshot::Header header;
+	memcpy(&header, snapshot.data(), sizeof(header));
+	return header;
+}
+
+/* changes children range of index root node */
+static std::string SetRootChildren(const std::string& snapshot, uint32_t first, uint32_t count) {
+	typedef OsmSnapshot::Index::Node Node;
+	OsmSnapshot::Header header = GetHeader(snapshot);
+	size_t root = header.index_nodes_offset + (header.nindex_nodes - 1) * sizeof(Node);
+
+	std::string damaged = snapshot;
+	damaged.replace(root + offsetof(Node, first), sizeof(first), reinterpret_cast<const char*>(&first), sizeof(first));
+	damaged.replace(root + offsetof(Node, count), sizeof(count), reinterpret_cast<const char*>(&count), sizeof(count));
+	return damaged;
+}
+
+BEGIN_TEST()
+	TempDir dir("snapshot");
+	std::string path = dir.GetPath() + "/glosm.snapshot";
+
+	PreloadedXmlDatasource xml;
+	xml.Load(TESTDATA_DIR "/glosm.osm");
+	xml.WriteSnapshot(path.c_str());
+
+	std::string snapshot = ReadFile(path);
+	EXPECT_TRUE(snapshot.size() > sizeof(OsmSnapshot::Header));
+
+	{
+		MmapOsmDatasource mmap;
+		mmap.Load(path.c_str());
+		EXPECT_INT(CountWays(mmap), CountWays(xml));
+		EXPECT_TRUE(DescribeWays(mmap) == DescribeWays(xml));
+	}
+
+	// ways created by concurrent requests are shared
+	{
+		MmapOsmDatasource mmap;
+		mmap.Load(path.c_str());
+
+		static const int NTHREADS = 4;
+		GetWaysTask tasks[NTHREADS];
+		pthread_t threads[NTHREADS];
+		for (int i = 0; i < NTHREADS; ++i) {
+			tasks[i].datasource = &mmap;
+			EXPECT_INT(pthread_create(&threads[i], NULL, GetWaysThread, &tasks[i]), 0);
+		}
+		for (int i = 0; i < NTHREADS; ++i)
+			pthread_join(threads[i], NULL);
+
+		std::vector<const OsmDatasource::Way*> ways;
+		mmap.GetWays(ways, BBoxi::ForEarth());
+		EXPECT_INT(ways.size(), CountWays(xml));
+
+		int mismatches = 0;
+		for (int i = 0; i < NTHREADS; ++i)
+			if (tasks[i].ways != ways)
+				mismatches++;
+		EXPECT_INT(mismatches, 0);
+	}
+
+	// multipolygon keeps its hole
+	{
+		std::string hole_osm = dir.WriteFile("hole.osm", HOLE_OSM);
+		std::string hole_path = dir.GetPath() + "/hole.snapshot";
+
+		PreloadedXmlDatasource hole_xml;
+		hole_xml.Load(hole_osm.c_str());
+		hole_xml.WriteSnapshot(hole_path.c_str());
+
+		MmapOsmDatasource mmap;
+		mmap.Load(hole_path.c_str());
+
+		Vector2i inside(20.05 * GEOM_UNITSINDEGREE, 10.05 * GEOM_UNITSINDEGREE);
+		std::vector<const OsmDatasource::Way*> ways;
+		mmap.GetWays(ways, BBoxi(inside, inside));
+
+		const OsmDatasource::Way* area = NULL;
+		for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w)
+			if ((*w)->Tags.Get(STR_NATURAL) != STR_NONE)
+				area = *w;
+
+		EXPECT_TRUE(area != NULL);
+		if (area != NULL) {
+			EXPECT_INT(area->Rings.size(), 2);
+			EXPECT_INT(area->GetCoordsCount(), 10);
+		}
+		EXPECT_TRUE(DescribeWays(mmap) == DescribeWays(hole_xml));
+	}
+
+	// rings not covering coords of a way
+	{
+		std::string hole = ReadFile(dir.GetPath() + "/hole.snapshot");
+		OsmSnapshot::Header hole_header = GetHeader(hole);
+		EXPECT_TRUE(hole_header.nrings > 0);
+
+		uint32_t ring = 1;
+		hole.replace(hole_header.rings_offset, sizeof(ring), reinterpret_cast<const char*>(&ring), sizeof(ring));
+
+		MmapOsmDatasource mmap;
+		std::string damaged = dir.WriteFile("rings.snapshot", hole);
+		mmap.Load(damaged.c_str());
+		EXPECT_EXCEPTION(CountWays(mmap), DataException);
+	}
+
+	OsmSnapshot::Header header = GetHeader(snapshot);
+	uint32_t root = header.nindex_nodes - 1;
+
+	// more children than node may have
+	{
+		MmapOsmDatasource mmap;
+		std::string damaged = dir.WriteFile("count.snapshot", SetRootChildren(snapshot, 0, 17));
+		EXPECT_EXCEPTION(mmap.Load(damaged.c_str()), DataException);
+	}
+
+	// root referring to itself
+	{
+		MmapOsmDatasource mmap;
+		std::string damaged = dir.WriteFile("cycle.snapshot", SetRootChildren(snapshot, root, 1));
+		EXPECT_EXCEPTION(mmap.Load(damaged.c_str()), DataException);
+	}
+
+	// more leaves than nodes
+	{
+		OsmSnapshot::Header leaves_header = header;
+		leaves_header.nindex_leaves = header.nindex_nodes + 1;
+		std::string leaves = snapshot;
+		leaves.replace(0, sizeof(leaves_header), reinterpret_cast<const char*>(&leaves_header), sizeof(leaves_header));
+
+		MmapOsmDatasource mmap;
+		std::string damaged = dir.WriteFile("leaves.snapshot", leaves);
+		EXPECT_EXCEPTION(mmap.Load(damaged.c_str()), DataException);
+	}
+
+	// truncated file
+	{
+		MmapOsmDatasource mmap;
+		std::string damaged = dir.WriteFile("truncated.snapshot", snapshot.substr(0, snapshot.size() / 2));
+		EXPECT_EXCEPTION(mmap.Load(damaged.c_str()), DataException);
+	}
+END_TEST()
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that SpatialIndex returns exactly the same
+ * set of items as a linear scan does.
+ */
+
+#include <glosm/SpatialIndex.hh>
+
+#include "testing.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+static osmint_t RandomCoord(int range) {
+	return (osmint_t)(rand() % (2 * range)) - range;
+}
+
+static BBoxi RandomBBox(int range, int maxsize) {
+	osmint_t x = RandomCoord(range);
+	osmint_t y = RandomCoord(range);
+	return BBoxi(x, y, x + rand() % maxsize, y + rand() % maxsize);
+}
+
+BEGIN_TEST()
+	srand(1);
+
+	// empty index
+	{
+		SpatialIndex<int> index;
+		index.Build();
+
+		std::vector<int> found;
+		index.Query(BBoxi::ForEarth(), found);
+		EXPECT_TRUE(found.empty());
+	}
+
+	// compare with linear scan
+	{
+		SpatialIndex<int> index;
+		std::vector<BBoxi> boxes;
+
+		for (int i = 0; i < 10000; ++i) {
+			boxes.push_back(RandomBBox(1000000, 10000));
+			index.Insert(boxes.back(), i);
+		}
+		index.Build();
+
+		EXPECT_INT(index.size(), 10000);
+
+		int mismatches = 0;
+		for (int q = 0; q < 200; ++q) {
+			BBoxi query = RandomBBox(1000000, 200000);
+
+			std::vector<int> found;
+			index.Query(query, found);
+			std::sort(found.begin(), found.end());
+
+			std::vector<int> expected;
+			for (int i = 0; i < (int)boxes.size(); ++i)
+				if (boxes[i].Intersects(query))
+					expected.push_back(i);
+
+			if (found != expected)
+				mismatches++;
+		}
+
+		EXPECT_INT(mismatches, 0);
+
+		std::vector<int> all;
+		index.Query(BBoxi::ForEarth(), all);
+		EXPECT_INT(all.size(), 10000);
+	}
+
+	// updates keep index consistent with linear scan
+	{
+		SpatialIndex<int> index;
+		std::vector<BBoxi> boxes;
+
+		for (int i = 0; i < 5000; ++i) {
+			boxes.push_back(RandomBBox(1000000, 10000));
+			index.Insert(boxes.back(), i);
+		}
+		index.Build();
+
+		int notfound = 0;
+		for (int i = 0; i < 5000; i += 3) {
+			BBoxi moved = (i % 2) ? RandomBBox(1000000, 10000) : BBoxi::Empty();
+			if (!index.Update(boxes[i], i, moved))
+				notfound++;
+			boxes[i] = moved;
+		}
+
+		EXPECT_INT(notfound, 0);
+		EXPECT_TRUE(!index.Update(BBoxi(2000000, 2000000, 2000001, 2000001), 1, BBoxi::Empty()));
+
+		int mismatches = 0;
+		for (int q = 0; q < 200; ++q) {
+			BBoxi query = RandomBBox(1000000, 200000);
+
+			std::vector<int> found;
+			index.Query(query, found);
+			std::sort(found.begin(), found.end());
+
+			std::vector<int> expected;
+			for (int i = 0; i < (int)boxes.size(); ++i)
+				if (boxes[i].Intersects(query))
+					expected.push_back(i);
+
+			if (found != expected)
+				mismatches++;
+		}
+
+		EXPECT_INT(mismatches, 0);
+	}
+
+	// built trees are valid, damaged ones are not
+	{
+		typedef SpatialIndex<int, 4> Index;
+		Index index;
+		for (int i = 0; i < 1000; ++i)
+			index.Insert(RandomBBox(1000000, 10000), i);
+		index.Build();
+
+		std::vector<Index::Node> nodes = index.GetNodes();
+		size_t nitems = index.size();
+		size_t nleaves = index.GetLeafCount();
+		size_t root = nodes.size() - 1;
+		EXPECT_TRUE(Index::ValidateTree(&nodes[0], nitems, nodes.size(), nleaves));
+		EXPECT_TRUE(!Index::ValidateTree(&nodes[0], nitems - 1, nodes.size(), nleaves));
+		EXPECT_TRUE(!Index::ValidateTree(&nodes[0], nitems, nodes.size(), nodes.size() + 1));
+
+		// too many children
+		std::vector<Index::Node> damaged = nodes;
+		damaged[root].count = 5;
+		EXPECT_TRUE(!Index::ValidateTree(&damaged[0], nitems, damaged.size(), nleaves));
+
+		// cycle
+		damaged = nodes;
+		damaged[root].first = root;
+		damaged[root].count = 1;
+		EXPECT_TRUE(!Index::ValidateTree(&damaged[0], nitems, damaged.size(), nleaves));
+
+		// leaf past items
+		damaged = nodes;
+		damaged[0].first = nitems - 1;
+		EXPECT_TRUE(!Index::ValidateTree(&damaged[0], nitems, damaged.size(), nleaves));
+		damaged[0].first = (unsigned int)-1;
+		EXPECT_TRUE(!Index::ValidateTree(&damaged[0], nitems, damaged.size(), nleaves));
+
+		// chain deeper than traversal stack
+		std::vector<Index::Node> chain(1, Index::Node(0, 1));
+		for (unsigned int i = 1; i < Index::MAX_DEPTH + 1; ++i)
+			chain.push_back(Index::Node(i - 1, 1));
+		EXPECT_TRUE(Index::ValidateTree(&chain[0], 1, Index::MAX_DEPTH, 1));
+		EXPECT_TRUE(!Index::ValidateTree(&chain[0], 1, chain.size(), 1));
+	}
+
+	// clear
+	{
+		SpatialIndex<int> index;
+		index.Insert(BBoxi(0, 0, 1, 1), 1);
+		index.Build();
+		index.clear();
+
+		EXPECT_TRUE(index.empty());
+	}
+END_TEST()
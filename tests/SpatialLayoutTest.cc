@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that reordering ways in memory with
+ * SPATIAL_LAYOUT keeps the same ways, with the same coords,
+ * available by id and by area.
+ */
+
+#include <glosm/PreloadedXmlDatasource.hh>
+
+#include "testing.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const int LOAD_FLAGS = PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::OVERVIEW_LAYERS;
+
+/* ways of an area as sorted list of their properties */
+static std::vector<std::string> DescribeWays(const OsmDatasource& datasource, const BBoxi& bbox) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, bbox);
+
+	std::vector<std::string> result;
+	for (std::vector<const OsmDatasource::Way*>::const_iterator w = ways.begin(); w != ways.end(); ++w) {
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%d %d %d %d class %d rings %d height %d", (*w)->BBox.left, (*w)->BBox.bottom, (*w)->BBox.right, (*w)->BBox.top, (int)(*w)->Class, (int)(*w)->Rings.size(), (int)(*w)->MaxHeight);
+		std::string description = buf;
+		for (OsmDatasource::Way::CoordsList::const_iterator c = (*w)->Coords.begin(); c != (*w)->Coords.end(); ++c) {
+			snprintf(buf, sizeof(buf), " %d,%d", c->x, c->y);
+			description += buf;
+		}
+		result.push_back(description);
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+BEGIN_TEST()
+	PreloadedXmlDatasource expected(LOAD_FLAGS);
+	expected.Load(TESTDATA_DIR "/glosm.osm");
+
+	PreloadedXmlDatasource datasource(LOAD_FLAGS | PreloadedXmlDatasource::SPATIAL_LAYOUT);
+	datasource.Load(TESTDATA_DIR "/glosm.osm");
+
+	EXPECT_TRUE(!DescribeWays(datasource, BBoxi::ForEarth()).empty());
+	EXPECT_TRUE(DescribeWays(datasource, BBoxi::ForEarth()) == DescribeWays(expected, BBoxi::ForEarth()));
+	EXPECT_INT(datasource.GetMaxHeight(), expected.GetMaxHeight());
+
+	/* parts of the dump */
+	BBoxi bbox = datasource.GetBBox();
+	int mismatches = 0;
+	for (int x = 0; x < 4; ++x) {
+		for (int y = 0; y < 4; ++y) {
+			osmint_t width = (bbox.right - bbox.left) / 4, height = (bbox.top - bbox.bottom) / 4;
+			BBoxi part(bbox.left + x * width, bbox.bottom + y * height, bbox.left + (x + 1) * width, bbox.bottom + (y + 1) * height);
+			if (DescribeWays(datasource, part) != DescribeWays(expected, part))
+				mismatches++;
+		}
+	}
+	EXPECT_INT(mismatches, 0);
+
+	/* overview layers are built from relaid ways */
+	for (int level = 0; level < 12; level += 4) {
+		std::vector<const OsmDatasource::Way*> ways, expected_ways;
+		datasource.GetOverviewWays(ways, BBoxi::ForEarth(), level);
+		expected.GetOverviewWays(expected_ways, BBoxi::ForEarth(), level);
+		EXPECT_INT((int)ways.size(), (int)expected_ways.size());
+	}
+END_TEST()
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that StringTable gives well known strings their
+ * fixed ids, interns each distinct string once, keeps strings in
+ * place as pages are added and gives the same ids to strings
+ * interned from several threads at once.
+ */
+
+#include <glosm/StringTable.hh>
+
+#include "testing.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+/* strings per page of the table */
+static const int PAGE_SIZE = 1 << 16;
+
+static const int NTHREADS = 4;
+static const int NSHARED = 1000;
+
+static std::string MakeString(const char* prefix, int n) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%s%d", prefix, n);
+	return buf;
+}
+
+struct InternArg {
+	std::vector<strid_t> ids;
+};
+
+static void* InternThread(void* arg) {
+	InternArg* intern = static_cast<InternArg*>(arg);
+	for (int i = 0; i < NSHARED; ++i)
+		intern->ids.push_back(StringTable::Instance().Intern(MakeString("shared", i).c_str()));
+	return NULL;
+}
+
+BEGIN_TEST()
+	StringTable& table = StringTable::Instance();
+
+	// well known strings
+	EXPECT_TRUE(table.GetCount() >= STR_WELL_KNOWN_COUNT);
+	EXPECT_TRUE(table.Get(STR_BUILDING) == "building");
+	EXPECT_TRUE(table.Get(STR_BUILDING_PART_HEIGHT) == "building:part:height");
+	EXPECT_TRUE(table.Get(STR_YES) == "yes");
+	EXPECT_INT(table.Find("highway"), STR_HIGHWAY);
+	EXPECT_INT(table.Intern("multipolygon"), STR_MULTIPOLYGON);
+	EXPECT_INT(table.Find("not interned"), STR_NONE);
+	EXPECT_INT(table.Find(""), STR_NONE);
+
+	// new strings get next ids, once
+	{
+		strid_t count = table.GetCount();
+		strid_t a = table.Intern("test:a");
+		strid_t b = table.Intern("test:b");
+		EXPECT_INT(a, count);
+		EXPECT_INT(b, count + 1);
+		EXPECT_INT(table.Intern("test:a"), a);
+		EXPECT_INT(table.Find("test:b"), b);
+		EXPECT_INT(table.GetCount(), count + 2);
+		EXPECT_TRUE(table.Get(a) == "test:a");
+
+		/* lookup doesn't depend on the buffer string came from */
+		std::string copy = "test:b";
+		EXPECT_INT(table.Intern(copy.c_str()), b);
+	}
+
+	// strings stay in place when pages are added
+	{
+		strid_t first = table.Intern("page:first");
+		const std::string& stored = table.Get(first);
+		const char* data = stored.c_str();
+
+		int mismatches = 0;
+		for (int i = 0; i < PAGE_SIZE + 10; ++i)
+			if (table.Intern(MakeString("page:", i).c_str()) != first + 1 + i)
+				mismatches++;
+		EXPECT_INT(mismatches, 0);
+		EXPECT_TRUE(table.GetCount() > (strid_t)PAGE_SIZE);
+
+		for (int i = 0; i < PAGE_SIZE + 10; ++i)
+			if (table.Get(first + 1 + i) != MakeString("page:", i))
+				mismatches++;
+		EXPECT_INT(mismatches, 0);
+
+		EXPECT_TRUE(&table.Get(first) == &stored);
+		EXPECT_TRUE(table.Get(first).c_str() == data);
+		EXPECT_TRUE(stored == "page:first");
+	}
+
+	// concurrent interning
+	{
+		InternArg args[NTHREADS];
+		pthread_t threads[NTHREADS];
+		for (int i = 0; i < NTHREADS; ++i)
+			EXPECT_TRUE(pthread_create(&threads[i], NULL, InternThread, &args[i]) == 0);
+		for (int i = 0; i < NTHREADS; ++i)
+			pthread_join(threads[i], NULL);
+
+		int mismatches = 0;
+		for (int i = 0; i < NSHARED; ++i) {
+			strid_t id = args[0].ids[i];
+			if (table.Get(id) != MakeString("shared", i))
+				mismatches++;
+			for (int j = 1; j < NTHREADS; ++j)
+				if (args[j].ids[i] != id)
+					mismatches++;
+		}
+		EXPECT_INT(mismatches, 0);
+	}
+END_TEST()
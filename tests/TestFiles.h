@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TESTFILES_H
+#define TESTFILES_H
+
+/*
+ * Temporary files for tests which load data from disk
+ */
+
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Writes content (which may be binary) to a file in dir
+ *
+ * @return path of the file
+ */
+inline std::string WriteFile(const std::string& dir, const char* name, const std::string& content) {
+	std::string path = dir + "/" + name;
+	FILE* f = fopen(path.c_str(), "wb");
+	if (f == NULL)
+		throw std::runtime_error("cannot create " + path);
+	if (!content.empty() && fwrite(content.data(), content.size(), 1, f) != 1) {
+		fclose(f);
+		throw std::runtime_error("cannot write " + path);
+	}
+	fclose(f);
+	return path;
+}
+
+/**
+ * Removes directory with everything in it
+ */
+inline void RemoveTree(const std::string& path) {
+	DIR* dir = opendir(path.c_str());
+	if (dir != NULL) {
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL) {
+			std::string name = entry->d_name;
+			if (name == "." || name == "..")
+				continue;
+			std::string child = path + "/" + name;
+			struct stat st;
+			if (lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+				RemoveTree(child);
+			else
+				unlink(child.c_str());
+		}
+		closedir(dir);
+	}
+	rmdir(path.c_str());
+}
+
+/**
+ * Temporary directory, removed with its contents when going out
+ * of scope
+ */
+class TempDir {
+private:
+	std::string path_;
+
+	TempDir(const TempDir&);
+	TempDir& operator=(const TempDir&);
+
+public:
+	TempDir(const char* name = "test") {
+		std::string templ = std::string("/tmp/glosm-") + name + "-XXXXXX";
+		std::vector<char> buf(templ.begin(), templ.end());
+		buf.push_back('\0');
+		if (mkdtemp(&buf[0]) == NULL)
+			throw std::runtime_error("cannot create temporary directory");
+		path_ = &buf[0];
+	}
+
+	~TempDir() {
+		RemoveTree(path_);
+	}
+
+	const std::string& GetPath() const {
+		return path_;
+	}
+
+	std::string WriteFile(const char* name, const std::string& content) const {
+		return ::WriteFile(path_, name, content);
+	}
+};
+
+#endif
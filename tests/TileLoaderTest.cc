@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that TileLoader shared by several layers takes
+ * their tiles in global priority order, and that a layer may be
+ * detached while its tile is being loaded without blocking other
+ * layers and without the loader touching it afterwards.
+ */
+
+#include <glosm/TileLoader.hh>
+
+#include "FakeLayer.h"
+#include "testing.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <vector>
+
+/* tiles of all layers in order they were spawned; spawning for
+ * layers with bit set in closed mask blocks until it's cleared */
+class SpawnLog {
+protected:
+	mutable pthread_mutex_t mutex_;
+	mutable pthread_cond_t cond_;
+	int closed_;
+	int spawning_;
+	std::vector<int> entries_;
+
+public:
+	SpawnLog(int closed = 0) : closed_(closed), spawning_(0) {
+		pthread_mutex_init(&mutex_, NULL);
+		pthread_cond_init(&cond_, NULL);
+	}
+
+	~SpawnLog() {
+		pthread_cond_destroy(&cond_);
+		pthread_mutex_destroy(&mutex_);
+	}
+
+	void Record(int layer, int tile) {
+		pthread_mutex_lock(&mutex_);
+		entries_.push_back(layer * 100 + tile);
+		spawning_++;
+		while (closed_ & (1 << layer))
+			pthread_cond_wait(&cond_, &mutex_);
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	void SetClosed(int closed) {
+		pthread_mutex_lock(&mutex_);
+		closed_ = closed;
+		pthread_cond_broadcast(&cond_);
+		pthread_mutex_unlock(&mutex_);
+	}
+
+	std::vector<int> GetEntries() const {
+		pthread_mutex_lock(&mutex_);
+		std::vector<int> entries = entries_;
+		pthread_mutex_unlock(&mutex_);
+		return entries;
+	}
+
+	/* gives up after 5 seconds */
+	bool WaitForSpawning(int count) const {
+		for (int i = 0; i < 500; ++i) {
+			pthread_mutex_lock(&mutex_);
+			bool reached = spawning_ >= count;
+			pthread_mutex_unlock(&mutex_);
+			if (reached)
+				return true;
+			usleep(10000);
+		}
+		return false;
+	}
+};
+
+/* level 2 tile by its number */
+static BBoxi NumberedTile(int tile) {
+	return BBoxi::ForGeoTile(2, tile % 4, tile / 4);
+}
+
+/* layer which logs its tiles and is loaded by given loader */
+class LoggedLayer : public FakeLayer {
+protected:
+	SpawnLog& log_;
+	int name_;
+
+public:
+	LoggedLayer(SpawnLog& log, int name, TileLoader& loader) : log_(log), name_(name) {
+		SetLoader(&loader);
+	}
+
+	virtual ~LoggedLayer() {
+		/* loader threads use log_ */
+		StopLoading();
+	}
+
+	virtual Tile* SpawnTile(const BBoxi& bbox, int flags) const {
+		int tile = 0;
+		while (tile < 15 && !NumberedTile(tile).Contains(bbox.GetCenter()))
+			tile++;
+		log_.Record(name_, tile);
+		return FakeLayer::SpawnTile(bbox, flags);
+	}
+
+	/* queues tile with given priority, like a load pass does */
+	void Queue(int tile, float priority) {
+		pthread_mutex_lock(&queue_mutex_);
+		EnqueueTile(TileId(2, tile % 4, tile / 4), NumberedTile(tile), priority, 0);
+		pthread_mutex_unlock(&queue_mutex_);
+		loader_->Wakeup();
+	}
+};
+
+struct DeleteArg {
+	LoggedLayer* layer;
+	volatile bool done;
+};
+
+static void* DeleteThread(void* arg) {
+	DeleteArg* del = static_cast<DeleteArg*>(arg);
+	delete del->layer;
+	del->done = true;
+	return NULL;
+}
+
+BEGIN_TEST()
+	// most important tile of all layers is taken first
+	{
+		SpawnLog log(1 << 1);
+		TileLoader loader(1);
+		LoggedLayer a(log, 1, loader);
+		LoggedLayer b(log, 2, loader);
+
+		/* the only thread is busy while tiles are queued */
+		a.Queue(0, 0.0f);
+		EXPECT_TRUE(log.WaitForSpawning(1));
+
+		a.Queue(1, 1.0f);
+		b.Queue(2, 2.0f);
+		b.Queue(3, 3.0f);
+		a.Queue(4, 4.0f);
+		a.Queue(5, 5.0f);
+		b.Queue(6, 6.0f);
+		log.SetClosed(0);
+
+		EXPECT_TRUE(log.WaitForSpawning(7));
+
+		int order[] = { 100, 101, 202, 203, 104, 105, 206 };
+		EXPECT_TRUE(log.GetEntries() == std::vector<int>(order, order + 7));
+	}
+
+	// layer detached while its tile is loaded
+	{
+		SpawnLog log((1 << 1) | (1 << 2));
+		TileLoader loader(2);
+		DeleteArg del = { new LoggedLayer(log, 1, loader), false };
+		LoggedLayer b(log, 2, loader);
+
+		/* both threads are busy with a tile each */
+		del.layer->Queue(0, 0.0f);
+		b.Queue(1, 1.0f);
+		EXPECT_TRUE(log.WaitForSpawning(2));
+		del.layer->Queue(2, 2.0f);
+
+		pthread_t thread;
+		EXPECT_TRUE(pthread_create(&thread, NULL, DeleteThread, &del) == 0);
+		usleep(50000);
+		EXPECT_TRUE(!del.done);
+
+		/* other layer is still loaded, but not tiles of the
+		 * one being detached */
+		log.SetClosed(1 << 1);
+		b.Queue(3, 3.0f);
+		EXPECT_TRUE(log.WaitForSpawning(3));
+		usleep(50000);
+		EXPECT_TRUE(!del.done);
+
+		log.SetClosed(0);
+		pthread_join(thread, NULL);
+		EXPECT_TRUE(del.done);
+
+		b.Queue(4, 4.0f);
+		EXPECT_TRUE(log.WaitForSpawning(4));
+
+		int spawned[] = { 100, 201, 203, 204 };
+		std::vector<int> entries = log.GetEntries();
+		std::sort(entries.begin(), entries.end());
+		EXPECT_TRUE(entries == std::vector<int>(spawned, spawned + 4));
+	}
+END_TEST()
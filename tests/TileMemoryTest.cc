@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that TileManager accounts tiles waiting for
+ * upload as system memory and uploaded ones as GPU memory, and
+ * that GPU size limit only evicts tiles holding GPU data.
+ * Evicted tiles are queued for destruction. Impostor textures
+ * count against both limits.
+ */
+
+#include "FakeLayer.h"
+#include "testing.h"
+
+static const size_t FAKE_TILE_SIZE = 1000;
+
+BEGIN_TEST()
+	FakeLayer layer(FAKE_TILE_SIZE);
+	layer.SetSizeLimit(1000000);
+
+	// synchronously loaded tile is not uploaded yet
+	layer.LoadArea(BBoxi::ForGeoTile(4, 5, 5), TileManager::SYNC);
+	EXPECT_INT(GetStats(layer).tiles, 1);
+	EXPECT_INT(GetStats(layer).ram_bytes, FAKE_TILE_SIZE);
+	EXPECT_INT(GetStats(layer).gpu_bytes, 0);
+
+	// asynchronously loaded tile is uploaded before placing
+	layer.LoadArea(BBoxi::ForGeoTile(4, 9, 5));
+	EXPECT_TRUE(layer.WaitForTiles(2));
+	EXPECT_INT(GetStats(layer).tiles, 2);
+	EXPECT_INT(GetStats(layer).ram_bytes, FAKE_TILE_SIZE);
+	EXPECT_INT(GetStats(layer).gpu_bytes, FAKE_TILE_SIZE);
+	EXPECT_INT(GetStats(layer).bytes, 2 * FAKE_TILE_SIZE);
+
+	// both tiles above are no longer needed after this
+	layer.LoadArea(BBoxi::ForGeoTile(4, 13, 9), TileManager::SYNC);
+	EXPECT_INT(GetStats(layer).tiles, 3);
+
+	// total is within limits
+	layer.GarbageCollect();
+	EXPECT_INT(GetStats(layer).tiles, 3);
+
+	// GPU limit only evicts tile with GPU data
+	layer.SetGpuSizeLimit(1);
+	EXPECT_INT(GetStats(layer).gpu_size_limit, 1);
+	layer.GarbageCollect();
+	EXPECT_INT(GetStats(layer).tiles, 2);
+	EXPECT_INT(GetStats(layer).gpu_bytes, 0);
+	EXPECT_INT(GetStats(layer).ram_bytes, 2 * FAKE_TILE_SIZE);
+
+	// evicted tile is only destroyed on next frame
+	EXPECT_INT(GetStats(layer).reclaiming, 1);
+
+	// total limit evicts the rest of unneeded tiles
+	layer.SetSizeLimit(FAKE_TILE_SIZE);
+	layer.GarbageCollect();
+	EXPECT_INT(GetStats(layer).tiles, 1);
+	EXPECT_INT(GetStats(layer).ram_bytes, FAKE_TILE_SIZE);
+
+	// so is everything dropped by Clear()
+	layer.Clear();
+	EXPECT_INT(GetStats(layer).tiles, 0);
+	EXPECT_INT(GetStats(layer).bytes, 0);
+	EXPECT_INT(GetStats(layer).reclaiming, 3);
+
+	{
+		// tiles fit the limit, but not with their impostors
+		FakeLayer impostor_layer(FAKE_TILE_SIZE);
+		impostor_layer.LoadArea(BBoxi::ForGeoTile(4, 5, 5), TileManager::SYNC);
+		impostor_layer.LoadArea(BBoxi::ForGeoTile(4, 9, 5), TileManager::SYNC);
+		impostor_layer.LoadArea(BBoxi::ForGeoTile(4, 13, 9), TileManager::SYNC);
+		size_t impostor_size = impostor_layer.AddImpostors();
+		EXPECT_INT(GetStats(impostor_layer).impostors, 3);
+
+		impostor_layer.SetSizeLimit(3 * impostor_size + 3 * FAKE_TILE_SIZE);
+		impostor_layer.GarbageCollect();
+		EXPECT_INT(GetStats(impostor_layer).tiles, 3);
+
+		impostor_layer.SetSizeLimit(2 * impostor_size);
+		impostor_layer.GarbageCollect();
+		EXPECT_INT(GetStats(impostor_layer).tiles, 1);
+		EXPECT_INT(GetStats(impostor_layer).impostors, 1);
+	}
+
+	{
+		// impostor is on GPU even when its tile is not uploaded
+		FakeLayer gpu_layer(FAKE_TILE_SIZE);
+		gpu_layer.SetSizeLimit(1000000000);
+		gpu_layer.LoadArea(BBoxi::ForGeoTile(4, 5, 5), TileManager::SYNC);
+		gpu_layer.LoadArea(BBoxi::ForGeoTile(4, 13, 9), TileManager::SYNC);
+		size_t impostor_size = gpu_layer.AddImpostors();
+		EXPECT_INT(GetStats(gpu_layer).gpu_bytes, 0);
+
+		gpu_layer.SetGpuSizeLimit(impostor_size);
+		gpu_layer.GarbageCollect();
+		EXPECT_INT(GetStats(gpu_layer).tiles, 1);
+		EXPECT_INT(GetStats(gpu_layer).impostors, 1);
+	}
+END_TEST()
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that TileManager keeps asynchronous tile
+ * requests in flight without blocking loading threads, builds
+ * tiles of ready ones and cancels ones no longer needed, also
+ * when tiles are loaded for several viewers at once, and that
+ * failed requests are dropped and retried later. With several
+ * viewers, finer tiles needed by one of them are rendered in
+ * place of coarse ones needed by another.
+ */
+
+#include <glosm/FirstPersonViewer.hh>
+
+#include <glosm/Exception.hh>
+
+#include "FakeLayer.h"
+#include "testing.h"
+
+/* requests in this column of tiles get ready only when opened */
+static const int GATED_X = 1;
+
+/* requests in this column of tiles fail when finished */
+static const int FAILING_X = 2;
+
+class GatedLayer : public FakeLayer {
+protected:
+	class FakeRequest : public TileRequest {
+	protected:
+		const GatedLayer& layer_;
+		BBoxi bbox_;
+		bool gated_;
+		bool failing_;
+
+	public:
+		FakeRequest(const GatedLayer& layer, const BBoxi& bbox, bool gated, bool failing) : layer_(layer), bbox_(bbox), gated_(gated), failing_(failing) {
+		}
+
+		virtual ~FakeRequest() {
+			__sync_fetch_and_add(&layer_.destroyed, 1);
+		}
+
+		virtual bool IsReady() const {
+			return !gated_ || layer_.gate_open;
+		}
+
+		virtual Tile* Finish() {
+			__sync_fetch_and_add(&layer_.finished, 1);
+			if (failing_)
+				throw Exception() << "request failed";
+			return new FakeTile(bbox_.GetCenter());
+		}
+	};
+
+public:
+	volatile bool gate_open;
+	volatile bool refuse_requests;
+	mutable volatile int submitted;
+	mutable volatile int finished;
+	mutable volatile int destroyed;
+
+	GatedLayer() : gate_open(false), refuse_requests(false), submitted(0), finished(0), destroyed(0) {
+	}
+
+	virtual ~GatedLayer() {
+		/* requests refer to counters of this class */
+		StopLoading();
+	}
+
+	virtual TileRequest* RequestTile(const BBoxi& bbox, int /*unused*/) const {
+		__sync_fetch_and_add(&submitted, 1);
+		if (refuse_requests)
+			throw Exception() << "request refused";
+		return new FakeRequest(*this, bbox, BBoxi::ForGeoTile(2, GATED_X, 1).Contains(bbox.GetCenter()), BBoxi::ForGeoTile(2, FAILING_X, 1).Contains(bbox.GetCenter()));
+	}
+
+	void OpenGate() {
+		gate_open = true;
+		NotifyRequestReady();
+	}
+
+	bool WaitFor(volatile int& counter, int value) {
+		for (int i = 0; i < 500 && counter < value; ++i)
+			usleep(10000);
+		return counter >= value;
+	}
+};
+
+/* layer of several levels which tells which ones are drawn */
+class LodLayer : public FakeLayer {
+public:
+	LodLayer() {
+		SetLevelRange(12, 14);
+		SetRange(8000.0f);
+	}
+
+	/* level of tile drawn at given point, or -1 if none */
+	int GetLeafLevel(const Vector2i& pos) {
+		pthread_mutex_lock(&tiles_mutex_);
+		int level = 0;
+		QuadNode* node = &root_;
+		while (node != NULL && node->leaf_generation != generation_) {
+			QuadNode* next = NULL;
+			for (int i = 0; i < 4; ++i)
+				if (node->childs[i] != NULL && node->childs[i]->bbox.Contains(pos))
+					next = node->childs[i];
+			node = next;
+			level++;
+		}
+		pthread_mutex_unlock(&tiles_mutex_);
+		return node != NULL ? level : -1;
+	}
+};
+
+/* interior of a single level 2 tile */
+static BBoxi InsideTile(int x, int y) {
+	return BBoxi::ForGeoTile(4, x * 4 + 1, y * 4 + 1);
+}
+
+BEGIN_TEST()
+	// ungated requests are finished, gated ones stay in flight
+	{
+		GatedLayer layer;
+		BBoxi bbox = InsideTile(GATED_X, 1);
+		bbox.Include(InsideTile(0, 1));
+		layer.LoadArea(bbox);
+
+		EXPECT_TRUE(layer.WaitFor(layer.finished, 1));
+		EXPECT_TRUE(layer.WaitFor(layer.submitted, 2));
+		usleep(50000);
+		EXPECT_INT(layer.finished, 1);
+		EXPECT_INT(GetStats(layer).requests, 1);
+
+		layer.OpenGate();
+		EXPECT_TRUE(layer.WaitFor(layer.finished, 2));
+		EXPECT_INT(layer.PlaceTiles(), 2);
+		EXPECT_INT(GetStats(layer).requests, 0);
+		EXPECT_INT(GetStats(layer).cancelled, 0);
+	}
+
+	// request for tile which is no longer needed is cancelled
+	{
+		GatedLayer layer;
+		layer.LoadArea(InsideTile(GATED_X, 1));
+		EXPECT_TRUE(layer.WaitFor(layer.submitted, 1));
+		usleep(50000);
+
+		// needed again by next pass, kept
+		layer.LoadArea(InsideTile(GATED_X, 1));
+		EXPECT_INT(GetStats(layer).requests, 1);
+		EXPECT_INT(GetStats(layer).cancelled, 0);
+
+		layer.LoadArea(InsideTile(0, 1));
+		EXPECT_TRUE(layer.WaitFor(layer.destroyed, 2));
+		EXPECT_INT(layer.finished, 1);
+		EXPECT_INT(GetStats(layer).requests, 0);
+		EXPECT_INT(GetStats(layer).cancelled, 1);
+
+		layer.OpenGate();
+		usleep(50000);
+		EXPECT_INT(layer.finished, 1);
+		EXPECT_INT(layer.PlaceTiles(), 1);
+	}
+
+	// tiles needed by any of several viewers are kept
+	{
+		GatedLayer layer;
+		layer.SetRange(1000.0f);
+		FirstPersonViewer near(Vector3i(InsideTile(0, 1).GetCenter(), 100 * GEOM_UNITSINMETER));
+		FirstPersonViewer gated(Vector3i(InsideTile(GATED_X, 1).GetCenter(), 100 * GEOM_UNITSINMETER));
+		TileManager::ViewerVector viewers;
+		viewers.push_back(&near);
+		viewers.push_back(&gated);
+
+		layer.LoadLocality(viewers);
+		EXPECT_TRUE(layer.WaitFor(layer.submitted, 2));
+		EXPECT_TRUE(layer.WaitFor(layer.finished, 1));
+		usleep(50000);
+
+		// viewers moved a bit, both localities are still loaded
+		near.SetPos(Vector3i(InsideTile(0, 1).GetCenter(), 2000 * GEOM_UNITSINMETER));
+		gated.SetPos(Vector3i(InsideTile(GATED_X, 1).GetCenter(), 2000 * GEOM_UNITSINMETER));
+		layer.LoadLocality(viewers);
+		EXPECT_INT(GetStats(layer).requests, 1);
+		EXPECT_INT(GetStats(layer).cancelled, 0);
+
+		// only first viewer is left
+		layer.LoadLocality(near);
+		EXPECT_TRUE(layer.WaitFor(layer.destroyed, 2));
+		EXPECT_INT(GetStats(layer).requests, 0);
+		EXPECT_INT(GetStats(layer).cancelled, 1);
+		EXPECT_INT(layer.PlaceTiles(), 1);
+	}
+
+	// finer tiles of close viewer win over coarse ones of far one
+	for (int order = 0; order < 2; ++order) {
+		LodLayer layer;
+		Vector2i pos = BBoxi::ForGeoTile(14, 8200, 8200).GetCenter();
+		Vector2i aside = BBoxi::ForGeoTile(14, 8202, 8200).GetCenter();
+		FirstPersonViewer near(Vector3i(pos, 10 * GEOM_UNITSINMETER));
+		FirstPersonViewer far(Vector3i(pos, 20000 * GEOM_UNITSINMETER));
+		TileManager::ViewerVector viewers;
+		viewers.push_back(order ? &near : &far);
+		viewers.push_back(order ? &far : &near);
+
+		layer.LoadLocality(viewers);
+		EXPECT_INT(layer.GetLeafLevel(pos), 14);
+		EXPECT_TRUE(layer.GetLeafLevel(aside) >= 12);
+
+		layer.LoadLocality(far);
+		EXPECT_INT(layer.GetLeafLevel(pos), 12);
+	}
+
+	// failed request is dropped and not made again at once
+	{
+		GatedLayer layer;
+		BBoxi bbox = InsideTile(FAILING_X, 1);
+		bbox.Include(InsideTile(FAILING_X + 1, 1));
+		layer.LoadArea(bbox);
+
+		EXPECT_TRUE(layer.WaitFor(layer.destroyed, 2));
+		EXPECT_TRUE(layer.WaitForTiles(1));
+		EXPECT_INT(GetStats(layer).failed, 1);
+		EXPECT_INT(GetStats(layer).requests, 0);
+
+		layer.LoadArea(bbox);
+		usleep(50000);
+		EXPECT_INT(layer.submitted, 2);
+		EXPECT_INT(GetStats(layer).queued, 0);
+		EXPECT_INT(GetStats(layer).loading, 0);
+	}
+
+	// refused request is made again after a delay
+	{
+		GatedLayer layer;
+		layer.refuse_requests = true;
+		layer.LoadArea(InsideTile(0, 1));
+		EXPECT_TRUE(layer.WaitFor(layer.submitted, 1));
+		usleep(50000);
+		EXPECT_INT(GetStats(layer).failed, 1);
+		EXPECT_INT(GetStats(layer).loading, 0);
+
+		layer.refuse_requests = false;
+		usleep(2100000);
+		layer.LoadArea(InsideTile(0, 1));
+		EXPECT_TRUE(layer.WaitForTiles(1));
+		EXPECT_INT(layer.submitted, 2);
+	}
+
+	// pending requests are dropped with the layer
+	{
+		GatedLayer* layer = new GatedLayer;
+		layer->LoadArea(InsideTile(GATED_X, 1));
+		EXPECT_TRUE(layer->WaitFor(layer->submitted, 1));
+		delete layer;
+	}
+END_TEST()
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a microbenchmark for polygon triangulation on a large
+ * lake-like polygon: noisy concave outline with islands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <glosm/Triangulator.hh>
+
+#include <cmath>
+#include <vector>
+
+static const int NISLANDS = 20;
+
+static void AddRing(std::vector<Vector2i>& points, std::vector<unsigned int>& lengths, int cx, int cy, int radius, int n) {
+	for (int i = 0; i < n; ++i) {
+		double a = 2.0 * M_PI * i / n;
+		double r = radius * (0.8 + 0.1 * sin(a * 17.0) + 0.1 * (double)rand() / RAND_MAX);
+		points.push_back(Vector2i(cx + (int)(r * cos(a)), cy + (int)(r * sin(a))));
+	}
+	lengths.push_back(n);
+}
+
+static void TriangulatorBench(int nvertices) {
+	std::vector<Vector2i> points;
+	std::vector<unsigned int> lengths;
+
+	srand(1);
+	AddRing(points, lengths, 0, 0, 10000000, nvertices);
+	for (int i = 0; i < NISLANDS; ++i)
+		AddRing(points, lengths, (i % 5 - 2) * 2000000, (i / 5 - 2) * 2000000, 300000, nvertices / 100 + 3);
+
+	Triangulator::IndexVector triangles;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	Triangulator::Triangulate(&points[0], &lengths[0], lengths.size(), triangles);
+	gettimeofday(&end, NULL);
+
+	float sec = (float)(end.tv_sec - start.tv_sec) + (float)(end.tv_usec - start.tv_usec)/1000000.0f;
+
+	fprintf(stderr, "  %7u vertices: %7u triangles, %f seconds\n", (unsigned int)points.size(), (unsigned int)triangles.size() / 3, sec);
+}
+
+int main() {
+	fprintf(stderr, "Lake with %d islands:\n", NISLANDS);
+	TriangulatorBench(1000);
+	TriangulatorBench(10000);
+	TriangulatorBench(100000);
+
+	return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that polygons, with and without holes, are
+ * triangulated into expected number of triangles of the same
+ * winding which cover exactly polygon area.
+ */
+
+#include <glosm/Triangulator.hh>
+
+#include "testing.h"
+
+#include <cmath>
+#include <vector>
+
+struct Polygon {
+	std::vector<Vector2i> points;
+	std::vector<unsigned int> lengths;
+
+	/* adds regular-ish ring with radius modulated to be concave */
+	void AddRing(int cx, int cy, int radius, int n, int spikes, bool reverse) {
+		for (int i = 0; i < n; ++i) {
+			double a = 2.0 * M_PI * (reverse ? n - i : i) / n;
+			double r = radius * (spikes ? (i % 2 ? 1.0 : 0.6) : 1.0);
+			points.push_back(Vector2i(cx + (int)(r * cos(a)), cy + (int)(r * sin(a))));
+		}
+		lengths.push_back(n);
+	}
+
+	/* doubled area, always positive */
+	double RingArea(unsigned int ring) const {
+		unsigned int start = 0;
+		for (unsigned int i = 0; i < ring; ++i)
+			start += lengths[i];
+		double area = 0.0;
+		for (unsigned int i = 0; i < lengths[ring]; ++i) {
+			const Vector2i& a = points[start + i];
+			const Vector2i& b = points[start + (i + 1) % lengths[ring]];
+			area += (double)a.x * b.y - (double)b.x * a.y;
+		}
+		return fabs(area);
+	}
+
+	double Area() const {
+		double area = RingArea(0);
+		for (unsigned int i = 1; i < lengths.size(); ++i)
+			area -= RingArea(i);
+		return area;
+	}
+};
+
+/* checks triangulation; returns number of triangles or -1 on error */
+static int Check(const Polygon& polygon) {
+	Triangulator::IndexVector triangles;
+	size_t count = Triangulator::Triangulate(&polygon.points[0], &polygon.lengths[0], polygon.lengths.size(), triangles);
+
+	if (count * 3 != triangles.size())
+		return -1;
+
+	double area = 0.0;
+	int positive = 0, negative = 0;
+	for (size_t i = 0; i < triangles.size(); i += 3) {
+		const Vector2i& a = polygon.points[triangles[i]];
+		const Vector2i& b = polygon.points[triangles[i + 1]];
+		const Vector2i& c = polygon.points[triangles[i + 2]];
+		double t = ((double)b.x - a.x) * ((double)c.y - a.y) - ((double)c.x - a.x) * ((double)b.y - a.y);
+		if (t > 0)
+			positive++;
+		else if (t < 0)
+			negative++;
+		area += fabs(t);
+	}
+
+	if (positive && negative)
+		return -1;
+	if (fabs(area - polygon.Area()) > polygon.Area() * 1e-9)
+		return -1;
+
+	return count;
+}
+
+BEGIN_TEST()
+	/* convex, either winding */
+	{
+		Polygon polygon;
+		polygon.AddRing(0, 0, 1000, 6, 0, false);
+		EXPECT_INT(Check(polygon), 4);
+	}
+	{
+		Polygon polygon;
+		polygon.AddRing(0, 0, 1000, 6, 0, true);
+		EXPECT_INT(Check(polygon), 4);
+	}
+
+	/* concave quad; convex ones are fanned directly */
+	{
+		Polygon polygon;
+		polygon.points.push_back(Vector2i(0, 0));
+		polygon.points.push_back(Vector2i(100, 50));
+		polygon.points.push_back(Vector2i(0, 100));
+		polygon.points.push_back(Vector2i(30, 50));
+		polygon.lengths.push_back(4);
+		EXPECT_INT(Check(polygon), 2);
+	}
+
+	/* concave star */
+	{
+		Polygon polygon;
+		polygon.AddRing(1000, -1000, 1000, 20, 1, false);
+		EXPECT_INT(Check(polygon), 18);
+	}
+
+	/* square with square hole */
+	{
+		Polygon polygon;
+		polygon.points.push_back(Vector2i(0, 0));
+		polygon.points.push_back(Vector2i(100, 0));
+		polygon.points.push_back(Vector2i(100, 100));
+		polygon.points.push_back(Vector2i(0, 100));
+		polygon.lengths.push_back(4);
+		polygon.points.push_back(Vector2i(25, 25));
+		polygon.points.push_back(Vector2i(75, 25));
+		polygon.points.push_back(Vector2i(75, 75));
+		polygon.points.push_back(Vector2i(25, 75));
+		polygon.lengths.push_back(4);
+		EXPECT_INT(Check(polygon), 8);
+	}
+
+	/* large lake with islands, uses z-order hashing */
+	{
+		Polygon polygon;
+		polygon.AddRing(0, 0, 1000000, 2000, 1, false);
+		polygon.AddRing(-200000, 0, 100000, 100, 1, true);
+		polygon.AddRing(200000, 0, 100000, 100, 0, false);
+		polygon.AddRing(0, 300000, 50000, 50, 1, false);
+		EXPECT_INT(Check(polygon), 2000 + 100 + 100 + 50 + 2 * 3 - 2);
+	}
+
+	/* degenerate input must not crash */
+	{
+		Polygon polygon;
+		for (int i = 0; i < 10; ++i)
+			polygon.points.push_back(Vector2i(i, i));
+		polygon.lengths.push_back(10);
+		Triangulator::IndexVector triangles;
+		Triangulator::Triangulate(&polygon.points[0], &polygon.lengths[0], polygon.lengths.size(), triangles);
+		EXPECT_TRUE(triangles.size() % 3 == 0);
+	}
+END_TEST()
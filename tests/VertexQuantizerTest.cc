@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that quantized vertices are restored within
+ * stated precision.
+ */
+
+#include <glosm/VertexQuantizer.hh>
+
+#include "testing.h"
+
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+static float RandomFloat(float range) {
+	return ((float)rand() / (float)RAND_MAX * 2.0f - 1.0f) * range;
+}
+
+BEGIN_TEST()
+	srand(1);
+
+	/* flat tile-like cloud: wide in x/y, low in z */
+	std::vector<Vector3f> points;
+	for (int i = 0; i < 10000; ++i)
+		points.push_back(Vector3f(RandomFloat(5000.0f) + 1000.0f, RandomFloat(4000.0f) - 3000.0f, RandomFloat(100.0f) + 100.0f));
+
+	VertexQuantizer quantizer;
+	for (std::vector<Vector3f>::const_iterator i = points.begin(); i != points.end(); ++i)
+		quantizer.Include(*i);
+	quantizer.Prepare();
+
+	/* 10 km span given 16 bits */
+	EXPECT_TRUE(quantizer.GetPrecision() < 0.1f);
+
+	int bad_positions = 0;
+	for (std::vector<Vector3f>::const_iterator i = points.begin(); i != points.end(); ++i) {
+		GLshort packed[3];
+		quantizer.QuantizePosition(*i, packed);
+		Vector3f restored = quantizer.DequantizePosition(packed);
+		float tolerance = quantizer.GetPrecision() * 1.01f;
+		if (fabsf(restored.x - i->x) > tolerance || fabsf(restored.y - i->y) > tolerance || fabsf(restored.z - i->z) > tolerance)
+			bad_positions++;
+	}
+	EXPECT_INT(bad_positions, 0);
+
+	/* normals are restored by GL_NORMALIZE, so compare directions */
+	int bad_normals = 0;
+	for (int i = 0; i < 10000; ++i) {
+		Vector3f normal = Vector3f(RandomFloat(1.0f), RandomFloat(1.0f), RandomFloat(1.0f)).Normalized();
+		GLbyte packed[3];
+		VertexQuantizer::QuantizeNormal(normal, packed);
+		Vector3f restored = Vector3f(packed[0], packed[1], packed[2]).Normalized();
+		if (restored.DotProduct(normal) < 0.9995f)
+			bad_normals++;
+	}
+	EXPECT_INT(bad_normals, 0);
+
+	/* degenerate range */
+	{
+		VertexQuantizer single;
+		single.Include(Vector3f(1.0f, 2.0f, 3.0f));
+		single.Prepare();
+
+		GLshort packed[3];
+		single.QuantizePosition(Vector3f(1.0f, 2.0f, 3.0f), packed);
+		Vector3f restored = single.DequantizePosition(packed);
+		EXPECT_TRUE(restored.x == 1.0f && restored.y == 2.0f && restored.z == 3.0f);
+	}
+END_TEST()
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that WayMerger assembles closed ways from
+ * shuffled and reversed parts, and handles unclosed ones.
+ */
+
+#include <glosm/WayMerger.hh>
+
+#include "testing.h"
+
+#include <vector>
+
+typedef OsmDatasource::Way::NodesList NodesList;
+
+static NodesList MakeChain(osmid_t from, osmid_t to) {
+	NodesList nodes;
+	if (from < to)
+		for (osmid_t i = from; i <= to; ++i)
+			nodes.push_back(i);
+	else
+		for (osmid_t i = from; i >= to; --i)
+			nodes.push_back(i);
+	return nodes;
+}
+
+/* checks that way is a closed ring going over nodes 1..n in either direction */
+static bool IsRing(const NodesList& nodes, osmid_t n) {
+	if (nodes.size() != (size_t)n + 1 || nodes.front() != nodes.back())
+		return false;
+	for (size_t i = 1; i < nodes.size(); ++i) {
+		osmid_t delta = (nodes[i] - nodes[i - 1] + n) % n;
+		if (delta != 1 && delta != n - 1)
+			return false;
+	}
+	return true;
+}
+
+BEGIN_TEST()
+	/* ring of 1000 parts, added out of order, every third reversed */
+	{
+		const int nparts = 1000;
+		std::vector<NodesList> parts;
+		for (int i = 0; i < nparts - 1; ++i) {
+			osmid_t from = i * 10 + 1, to = (i + 1) * 10 + 1;
+			parts.push_back((i % 3 == 0) ? MakeChain(to, from) : MakeChain(from, to));
+		}
+
+		/* last part wraps around to node 1 */
+		parts.push_back(MakeChain((nparts - 1) * 10 + 1, nparts * 10));
+		parts.back().push_back(1);
+
+		WayMerger merger;
+		for (int i = 0; i < nparts; ++i)
+			merger.AddWay(parts[(i * 7) % nparts]);
+
+		NodesList out;
+		EXPECT_TRUE(merger.GetNextWay(out));
+		EXPECT_TRUE(IsRing(out, nparts * 10));
+		EXPECT_TRUE(!merger.GetNextWay(out));
+	}
+
+	/* two rings plus a dangling part */
+	{
+		NodesList a1 = MakeChain(1, 3), a2 = MakeChain(3, 4);
+		a2.push_back(1);
+		NodesList b = MakeChain(10, 13);
+		b.push_back(10);
+		NodesList dangling = MakeChain(20, 25);
+
+		WayMerger merger;
+		merger.AddWay(dangling);
+		merger.AddWay(b);
+		merger.AddWay(a2);
+		merger.AddWay(a1);
+
+		NodesList out;
+		int rings = 0;
+		while (merger.GetNextWay(out)) {
+			EXPECT_TRUE(out.front() == out.back());
+			rings++;
+		}
+		EXPECT_INT(rings, 2);
+	}
+
+	/* unclosed ways on request */
+	{
+		NodesList a = MakeChain(1, 5), b = MakeChain(8, 5);
+
+		WayMerger merger(WayMerger::UNCLOSED_WAYS);
+		merger.AddWay(a);
+		merger.AddWay(b);
+
+		NodesList out;
+		EXPECT_TRUE(merger.GetNextWay(out));
+		EXPECT_INT(out.size(), 8);
+		EXPECT_TRUE(out.front() == 1 && out.back() == 8);
+		EXPECT_TRUE(!merger.GetNextWay(out));
+	}
+END_TEST()
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This test checks that built-in XML scanner produces the same
+ * element events as Expat, falls back to Expat for documents it
+ * doesn't support, and reports malformed ones.
+ */
+
+#include <glosm/XMLParser.hh>
+#include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/Exception.hh>
+
+#include "TestFiles.h"
+#include "testing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+/* records elements and attributes as text */
+class XMLRecorder : public XMLParser {
+public:
+	std::string events;
+
+	XMLRecorder(bool scan) : XMLParser(XMLParser::HANDLE_ELEMENTS | (scan ? XMLParser::FAST_SCAN : 0)) {
+	}
+
+	virtual void StartElement(const char* name, const char** atts) {
+		events += "<";
+		events += name;
+		for (const char** att = atts; *att; att += 2) {
+			events += " ";
+			events += att[0];
+			events += "=[";
+			events += att[1];
+			events += "]";
+		}
+		events += ">";
+	}
+
+	virtual void EndElement(const char* name) {
+		events += "</";
+		events += name;
+		events += ">";
+	}
+};
+
+static std::string Record(const std::string& path, bool scan) {
+	XMLRecorder recorder(scan);
+	recorder.Load(path.c_str());
+	return recorder.events;
+}
+
+static int CountWays(const OsmDatasource& datasource) {
+	std::vector<const OsmDatasource::Way*> ways;
+	datasource.GetWays(ways, BBoxi::ForEarth());
+	return ways.size();
+}
+
+BEGIN_TEST()
+	TempDir dir("xmlscanner");
+
+	std::string plain = dir.WriteFile("plain.osm",
+		"\xef\xbb\xbf<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<!-- comment with <tags> -->\n"
+		"<osm version='0.6'>\n"
+		" <node id='1' lat = \"10.5\" lon='-20.25'/>\n"
+		" <way id='2'\n"
+		"   visible='true'><nd ref='1' /><tag k='name' v='a &amp; b &lt;&gt; &quot;&apos; &#1055;&#x439;'/>\n"
+		"  <tag k='note' v='line\n"
+		"break\ttab'/>\n"
+		" </way >\n"
+		" <relation id='3'><member type='way' ref='2' role=''/></relation>\n"
+		"</osm>\n");
+	std::string doctype = dir.WriteFile("doctype.osm",
+		"<?xml version='1.0'?>\n"
+		"<!DOCTYPE osm [ <!ENTITY custom 'value'> ]>\n"
+		"<osm><tag k='k' v='&custom;'/></osm>\n");
+	std::string latin1 = dir.WriteFile("latin1.osm",
+		"<?xml version='1.0' encoding='ISO-8859-1'?>\n"
+		"<osm><tag k='k' v='\xe9'/></osm>\n");
+	std::string mismatched = dir.WriteFile("mismatched.osm", "<osm><way></node></osm>\n");
+	std::string unclosed = dir.WriteFile("unclosed.osm", "<osm><way id='1'></way>\n");
+	std::string badentity = dir.WriteFile("badentity.osm", "<osm><tag k='k' v='&nbsp;'/></osm>\n");
+	std::string badattr = dir.WriteFile("badattr.osm", "<osm><node id=1/></osm>\n");
+
+	{
+		std::string expected = Record(plain, false);
+		EXPECT_STRING(Record(plain, true), expected);
+		EXPECT_STRING(Record(doctype, true), Record(doctype, false));
+		EXPECT_STRING(Record(doctype, true), "<osm><tag k=[k] v=[value]></tag></osm>");
+		EXPECT_STRING(Record(latin1, true), "<osm><tag k=[k] v=[\xc3\xa9]></tag></osm>");
+
+		EXPECT_EXCEPTION(Record(mismatched, true), ParsingException);
+		EXPECT_EXCEPTION(Record(unclosed, true), ParsingException);
+		EXPECT_EXCEPTION(Record(badentity, true), ParsingException);
+		EXPECT_EXCEPTION(Record(badattr, true), ParsingException);
+
+		EXPECT_STRING(Record(TESTDATA_DIR "/glosm.osm", true), Record(TESTDATA_DIR "/glosm.osm", false));
+		EXPECT_STRING(Record(TESTDATA_DIR "/grid.osm", true), Record(TESTDATA_DIR "/grid.osm", false));
+
+		PreloadedXmlDatasource expat, scanned(PreloadedXmlDatasource::FAST_XML_SCAN | PreloadedXmlDatasource::PIPELINED_LOAD);
+		expat.Load(TESTDATA_DIR "/glosm.osm");
+		scanned.Load(TESTDATA_DIR "/glosm.osm");
+		EXPECT_INT(CountWays(scanned), CountWays(expat));
+		EXPECT_TRUE(scanned.GetBBox().left == expat.GetBBox().left && scanned.GetBBox().top == expat.GetBBox().top);
+	}
+END_TEST()
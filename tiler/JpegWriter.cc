@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "JpegWriter.hh"
+
+#include "PixelBuffer.hh"
+
+#include <stdexcept>
+
+#if defined(WITH_JPEG)
+#include <stddef.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+/* libjpeg destination manager appending to a vector */
+struct JpegVectorDestination {
+	struct jpeg_destination_mgr pub;
+	std::vector<unsigned char>* out;
+	size_t start;
+};
+
+static const size_t JPEG_CHUNK_SIZE = 16384;
+
+static void jpeg_init_vector_fn(j_compress_ptr cinfo) {
+	JpegVectorDestination* dest = reinterpret_cast<JpegVectorDestination*>(cinfo->dest);
+	dest->start = dest->out->size();
+	dest->out->resize(dest->start + JPEG_CHUNK_SIZE);
+	dest->pub.next_output_byte = &(*dest->out)[dest->start];
+	dest->pub.free_in_buffer = JPEG_CHUNK_SIZE;
+}
+
+static boolean jpeg_empty_vector_fn(j_compress_ptr cinfo) {
+	JpegVectorDestination* dest = reinterpret_cast<JpegVectorDestination*>(cinfo->dest);
+	size_t used = dest->out->size();
+	dest->out->resize(used + JPEG_CHUNK_SIZE);
+	dest->pub.next_output_byte = &(*dest->out)[used];
+	dest->pub.free_in_buffer = JPEG_CHUNK_SIZE;
+	return TRUE;
+}
+
+static void jpeg_term_vector_fn(j_compress_ptr cinfo) {
+	JpegVectorDestination* dest = reinterpret_cast<JpegVectorDestination*>(cinfo->dest);
+	dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+}
+
+static void jpeg_error_fn(j_common_ptr cinfo) {
+	char message[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, message);
+	throw JpegWriterException() << "jpeg write error: " << message;
+}
+#endif
+
+void JpegWriter::Write(const PixelBuffer& buffer, int x, int y, int width, int height, int quality, std::vector<unsigned char>& out) {
+	if (x + width > buffer.GetWidth())
+		throw std::logic_error("output image is wider than input buffer");
+
+	if (y + height > buffer.GetHeight())
+		throw std::logic_error("output image is higher than input buffer");
+
+#if defined(WITH_JPEG)
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_error_fn;
+	jpeg_create_compress(&cinfo);
+
+	JpegVectorDestination dest;
+	dest.pub.init_destination = jpeg_init_vector_fn;
+	dest.pub.empty_output_buffer = jpeg_empty_vector_fn;
+	dest.pub.term_destination = jpeg_term_vector_fn;
+	dest.out = &out;
+	dest.start = 0;
+	cinfo.dest = &dest.pub;
+
+	try {
+		cinfo.image_width = width;
+		cinfo.image_height = height;
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_RGB;
+
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		jpeg_start_compress(&cinfo, TRUE);
+
+		/* ugly cast is hack for jpeg interface which takes non-const JSAMPROW */
+		while (cinfo.next_scanline < cinfo.image_height) {
+			JSAMPROW row = const_cast<JSAMPLE*>(buffer.GetReverseRowPointer(y + cinfo.next_scanline, x));
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+
+		jpeg_finish_compress(&cinfo);
+	} catch (...) {
+		jpeg_destroy_compress(&cinfo);
+		throw;
+	}
+
+	jpeg_destroy_compress(&cinfo);
+#else
+	(void)quality;
+	(void)out;
+	throw JpegWriterException() << "JPEG output requires libjpeg support";
+#endif
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JPEGWRITER_HH
+#define JPEGWRITER_HH
+
+#include <glosm/Exception.hh>
+
+#include <vector>
+
+class PixelBuffer;
+
+class JpegWriterException : public Exception {
+};
+
+/**
+ * Encoder of RGB image areas into JPEG
+ *
+ * Requires libjpeg; if it's not available, Write() throws.
+ */
+class JpegWriter {
+public:
+	/**
+	 * Encodes image area and appends it to a buffer
+	 *
+	 * @param quality 1..100
+	 */
+	static void Write(const PixelBuffer& buffer, int x, int y, int width, int height, int quality, std::vector<unsigned char>& out);
+};
+
+#endif
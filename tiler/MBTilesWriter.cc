@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "MBTilesWriter.hh"
+
+#include <glosm/Guard.hh>
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(WITH_SQLITE)
+#	include <sqlite3.h>
+#endif
+
+#if defined(WITH_SQLITE)
+
+/* FNV-1a */
+static uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static const char* MBTILES_SCHEMA =
+	"CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+	"CREATE UNIQUE INDEX IF NOT EXISTS metadata_name ON metadata (name);"
+	"CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);"
+	"CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row);"
+	"CREATE TABLE IF NOT EXISTS images (tile_data BLOB, tile_id TEXT);"
+	"CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);"
+	"CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+
+MBTilesWriter::MBTilesWriter(const char* path) : db_(NULL), insert_image_(NULL), insert_map_(NULL), batch_tiles_(0), ntiles_(0), nimages_(0) {
+	int errn;
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if (sqlite3_open(path, &db_) != SQLITE_OK) {
+		std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+		sqlite3_close(db_);
+		pthread_mutex_destroy(&mutex_);
+		throw MBTilesException() << "cannot open " << path << ": " << error;
+	}
+
+	try {
+		/* other rendering processes may hold the lock for a while */
+		sqlite3_busy_timeout(db_, 600000);
+
+		Exec("PRAGMA journal_mode=WAL");
+		Exec("PRAGMA synchronous=NORMAL");
+
+		Begin();
+		Exec(MBTILES_SCHEMA);
+		Commit();
+
+		if (sqlite3_prepare_v2(db_, "INSERT OR IGNORE INTO images (tile_id, tile_data) VALUES (?, ?)", -1, &insert_image_, NULL) != SQLITE_OK)
+			throw MBTilesException() << "cannot prepare statement: " << sqlite3_errmsg(db_);
+		if (sqlite3_prepare_v2(db_, "INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?)", -1, &insert_map_, NULL) != SQLITE_OK)
+			throw MBTilesException() << "cannot prepare statement: " << sqlite3_errmsg(db_);
+	} catch (...) {
+		Close();
+		pthread_mutex_destroy(&mutex_);
+		throw;
+	}
+}
+
+MBTilesWriter::~MBTilesWriter() {
+	try {
+		Flush();
+	} catch (std::exception& e) {
+		warnx("%s", e.what());
+	}
+
+	Close();
+	pthread_mutex_destroy(&mutex_);
+}
+
+void MBTilesWriter::Close() {
+	sqlite3_finalize(insert_image_);
+	sqlite3_finalize(insert_map_);
+	sqlite3_close(db_);
+}
+
+void MBTilesWriter::Exec(const char* sql) {
+	char* error = NULL;
+	if (sqlite3_exec(db_, sql, NULL, NULL, &error) != SQLITE_OK) {
+		std::string message = error ? error : "unknown error";
+		sqlite3_free(error);
+		throw MBTilesException() << "sqlite error: " << message;
+	}
+}
+
+void MBTilesWriter::Begin() {
+	/* immediate, so concurrent writers wait on busy timeout
+	 * instead of failing on lock upgrade */
+	Exec("BEGIN IMMEDIATE");
+}
+
+void MBTilesWriter::Commit() {
+	Exec("COMMIT");
+}
+
+void MBTilesWriter::SetMetadata(const char* name, const std::string& value) {
+	Guard guard(mutex_);
+
+	sqlite3_stmt* stmt;
+	if (sqlite3_prepare_v2(db_, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)", -1, &stmt, NULL) != SQLITE_OK)
+		throw MBTilesException() << "cannot prepare statement: " << sqlite3_errmsg(db_);
+
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(stmt, 2, value.c_str(), -1, SQLITE_TRANSIENT);
+	int ret = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (ret != SQLITE_DONE)
+		throw MBTilesException() << "cannot set metadata: " << sqlite3_errmsg(db_);
+}
+
+void MBTilesWriter::AddTile(int zoom, int x, int y, const std::vector<unsigned char>& data) {
+	/* identical tiles share an image; size is added to make
+	 * hash collisions even less likely */
+	char id[32];
+	snprintf(id, sizeof(id), "%016" PRIx64 "%08x", HashBytes(data.empty() ? NULL : &data[0], data.size()), (unsigned int)data.size());
+
+	Guard guard(mutex_);
+
+	if (batch_tiles_ == 0)
+		Begin();
+
+	sqlite3_bind_text(insert_image_, 1, id, -1, SQLITE_STATIC);
+	sqlite3_bind_blob(insert_image_, 2, data.empty() ? NULL : &data[0], data.size(), SQLITE_STATIC);
+	int ret = sqlite3_step(insert_image_);
+	sqlite3_reset(insert_image_);
+	if (ret != SQLITE_DONE)
+		throw MBTilesException() << "cannot store tile image: " << sqlite3_errmsg(db_);
+
+	nimages_ += sqlite3_changes(db_);
+
+	/* MBTiles uses TMS row order */
+	sqlite3_bind_int(insert_map_, 1, zoom);
+	sqlite3_bind_int(insert_map_, 2, x);
+	sqlite3_bind_int(insert_map_, 3, (1 << zoom) - 1 - y);
+	sqlite3_bind_text(insert_map_, 4, id, -1, SQLITE_STATIC);
+	ret = sqlite3_step(insert_map_);
+	sqlite3_reset(insert_map_);
+	if (ret != SQLITE_DONE)
+		throw MBTilesException() << "cannot store tile: " << sqlite3_errmsg(db_);
+
+	ntiles_++;
+
+	if (++batch_tiles_ >= BATCH_SIZE) {
+		Commit();
+		batch_tiles_ = 0;
+	}
+}
+
+void MBTilesWriter::Flush() {
+	Guard guard(mutex_);
+
+	if (batch_tiles_ > 0) {
+		Commit();
+		batch_tiles_ = 0;
+	}
+}
+
+void MBTilesWriter::GetStatistics(int& ntiles, int& nimages) {
+	Guard guard(mutex_);
+
+	ntiles = ntiles_;
+	nimages = nimages_;
+}
+
+#else
+
+MBTilesWriter::MBTilesWriter(const char* path) : db_(NULL), insert_image_(NULL), insert_map_(NULL), batch_tiles_(0), ntiles_(0), nimages_(0) {
+	throw MBTilesException() << "cannot write " << path << ": MBTiles output requires SQLite support, which was not compiled in";
+}
+
+MBTilesWriter::~MBTilesWriter() {
+}
+
+void MBTilesWriter::SetMetadata(const char*, const std::string&) {
+}
+
+void MBTilesWriter::AddTile(int, int, int, const std::vector<unsigned char>&) {
+}
+
+void MBTilesWriter::Flush() {
+}
+
+void MBTilesWriter::GetStatistics(int& ntiles, int& nimages) {
+	ntiles = nimages = 0;
+}
+
+#endif
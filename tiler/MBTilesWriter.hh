@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MBTILESWRITER_HH
+#define MBTILESWRITER_HH
+
+#include <glosm/Exception.hh>
+#include <glosm/NonCopyable.hh>
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+class MBTilesException: public Exception {
+};
+
+/**
+ * Writer of MBTiles tile archive
+ *
+ * Stores tiles in a single SQLite database instead of a tree of
+ * files. Identical tiles (e.g. empty sea) are stored once, using
+ * map/images tables with tiles view as described in MBTiles
+ * spec. Writes are batched into transactions.
+ *
+ * Safe to use from multiple threads; several processes may write
+ * the same archive, each with its own writer.
+ *
+ * Requires SQLite; if it's not available, constructor throws.
+ */
+class MBTilesWriter: private NonCopyable {
+protected:
+	/** Number of tiles written in a single transaction */
+	static const int BATCH_SIZE = 1024;
+
+protected:
+	sqlite3* db_;
+	sqlite3_stmt* insert_image_;
+	sqlite3_stmt* insert_map_;
+
+	pthread_mutex_t mutex_;
+
+	/* protected by mutex_ */
+	int batch_tiles_;
+	int ntiles_;
+	int nimages_;
+	/* /protected by mutex_ */
+
+protected:
+	void Exec(const char* sql);
+	void Begin();
+	void Commit();
+	void Close();
+
+public:
+	/**
+	 * Opens or creates archive
+	 *
+	 * @param path archive file
+	 */
+	MBTilesWriter(const char* path);
+
+	/** Commits pending tiles and closes archive */
+	~MBTilesWriter();
+
+	/**
+	 * Sets metadata value (name, bounds, minzoom etc.)
+	 */
+	void SetMetadata(const char* name, const std::string& value);
+
+	/**
+	 * Adds or replaces a tile
+	 *
+	 * @param zoom zoom level
+	 * @param x column
+	 * @param y row, in OSM (not TMS) order
+	 * @param data PNG data
+	 */
+	void AddTile(int zoom, int x, int y, const std::vector<unsigned char>& data);
+
+	/**
+	 * Commits tiles written so far
+	 */
+	void Flush();
+
+	/** Returns number of tiles and distinct images written */
+	void GetStatistics(int& ntiles, int& nimages);
+};
+
+#endif
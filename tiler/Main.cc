@@ -20,25 +20,53 @@
 
 #include <glosm/MercatorProjection.hh>
 #include <glosm/PreloadedXmlDatasource.hh>
+#include <glosm/MmapOsmDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
+#include <glosm/Geometry.hh>
+#include <glosm/GeometryCache.hh>
+#include <glosm/GeometryDiskCache.hh>
 #include <glosm/GeometryGenerator.hh>
 #include <glosm/GeometryLayer.hh>
+#include <glosm/TileShader.hh>
+#include <glosm/TileBatch.hh>
 #include <glosm/OrthoViewer.hh>
+#include <glosm/RemoteGeometryDatasource.hh>
 #include <glosm/DummyHeightmap.hh>
+#include <glosm/SpatialIndex.hh>
+#include <glosm/Trace.hh>
 #include <glosm/geomath.h>
 
+#include "MBTilesWriter.hh"
 #include "PBuffer.hh"
 #include "PixelBuffer.hh"
+#include "PngEncoder.hh"
 #include "PngWriter.hh"
+#include "TileBuckets.hh"
+#include "TileFormat.hh"
+#include "TileManifest.hh"
 
 #include <GL/glx.h>
 #include <X11/Xlib.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
 
 struct LevelInfo {
 	int tiling;
@@ -50,17 +78,17 @@ struct LevelInfo {
 };
 
 static LevelInfo LevelInfos[] = {
-	{ 0, GeometryDatasource::GROUND }, /* 0 */
-	{ 1, GeometryDatasource::GROUND }, /* 1 */
-	{ 2, GeometryDatasource::GROUND }, /* 2 */
-	{ 3, GeometryDatasource::GROUND }, /* 3 */
-	{ 4, GeometryDatasource::GROUND }, /* 4 */
-	{ 5, GeometryDatasource::GROUND }, /* 5 */
-	{ 6, GeometryDatasource::GROUND }, /* 6 */
-	{ 7, GeometryDatasource::GROUND }, /* 7 */
-	{ 8, GeometryDatasource::GROUND }, /* 8 */
-	{ 9, GeometryDatasource::GROUND }, /* 9 */
-	{ 10, GeometryDatasource::GROUND }, /* 10 */
+	{ 0, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 0 */
+	{ 1, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 1 */
+	{ 2, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 2 */
+	{ 3, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 3 */
+	{ 4, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 4 */
+	{ 5, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 5 */
+	{ 6, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 6 */
+	{ 7, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 7 */
+	{ 8, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 8 */
+	{ 9, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 9 */
+	{ 10, GeometryDatasource::GROUND | GeometryDatasource::SIMPLIFY }, /* 10 */
 	{ 11, GeometryDatasource::EVERYTHING }, /* 11 */
 	{ 12, GeometryDatasource::EVERYTHING }, /* 12 */
 	{ 12, GeometryDatasource::EVERYTHING }, /* 13 */
@@ -72,92 +100,1058 @@ static LevelInfo LevelInfos[] = {
 };
 
 void usage(const char* progname) {
-	fprintf(stderr, "Usage: %s [-0123456789] [-s skew] [-z minzoom] [-Z maxzoom] [-m multisamples] -x minlon -X maxlon -y minlat -Y maxlat infile.osm outdir\n", progname);
+	fprintf(stderr, "Usage: %s [-0123456789] [-s skew] [-z minzoom] [-Z maxzoom] [-m multisamples] [-M metatile] [-j encoders] [-p] [-w workers] [-k shard/nshards] [-b auto|glx|egl|osmesa] [-d display[,display...]] [-g] [-f format[:minzoom[-maxzoom]][,...]] [-u] [-c cachedir] [-C change.osc ...] [-B bucketzoom [-T tmpdir]] [-o columns|hilbert|depth] -x minlon -X maxlon -y minlat -Y maxlat <infile.osm[.gz|.bz2|.zst]|infile.osm.pbf|infile.snapshot> outdir\n", progname);
+	fprintf(stderr, "       %s [options] -r [host:]port|path -x minlon -X maxlon -y minlat -Y maxlat outdir\n", progname);
+	fprintf(stderr, "       %s -S outfile.snapshot <infile.osm[.gz|.bz2|.zst]|infile.osm.pbf>\n", progname);
 	exit(1);
 }
 
-int RenderTiles(PBuffer& pbuffer, OrthoViewer& viewer, GeometryLayer& layer, const char* target, float minlon, float minlat, float maxlon, float maxlat, int minzoom, int maxzoom, int pnglevel) {
-	int x, y, zoom, ntiles = 0;
-	PixelBuffer pixels(256, 256, 3);
+static bool HasSuffix(const char* str, const char* suffix) {
+	size_t len = strlen(str);
+	size_t suffixlen = strlen(suffix);
+	return len > suffixlen && strcmp(str + len - suffixlen, suffix) == 0;
+}
+
+/* nodes are inlined unless changes are to be applied to loaded data */
+static PreloadedXmlDatasource* CreateOsmDatasource(const char* filename, int extra_flags = 0, bool keep_nodes = false) {
+	int flags = PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::SPATIAL_LAYOUT | extra_flags;
+	if (!keep_nodes)
+		flags |= PreloadedXmlDatasource::INLINE_NODES;
+
+	if (HasSuffix(filename, ".pbf"))
+		return new PreloadedPbfDatasource(flags);
+	else
+		return new PreloadedXmlDatasource(flags | PreloadedXmlDatasource::PIPELINED_LOAD | PreloadedXmlDatasource::FAST_XML_SCAN);
+}
+
+typedef SpatialIndex<int> TilerDirtyIndex;
+
+/** Metatile which is rendered, but not yet read back */
+struct TilerMetatile {
+	int width;
+	int height;
+	PngEncoder::ImageVector images;
+
+	TilerMetatile(int w, int h, const PngEncoder::ImageVector& i): width(w), height(h), images(i) {}
+};
+
+typedef std::deque<TilerMetatile> TilerMetatileQueue;
+
+/** Order of metatiles in RenderTiles() */
+enum TilerOrder {
+	/* by columns, then by rows, each zoom in turn */
+	ORDER_COLUMNS,
+
+	/* along Hilbert curve, each zoom in turn */
+	ORDER_HILBERT,
+
+	/* along Hilbert curve, with consecutive zooms which share
+	 * geometry level interleaved, so metatiles under one at lower
+	 * zoom are rendered right after it */
+	ORDER_DEPTH,
+};
+
+/** Options shared by all rendering processes */
+struct TilerSettings {
+	const char* infile;
+	const char* target;
+
+	int pnglevel;
+	float minlat, maxlat, minlon, maxlon;
+	int minzoom, maxzoom;
+	float skew;
+	int multisamples;
+	int metatile;
+	int encoders;
+	bool pipelined;
+	const char* cachedir;
+	PBuffer::Backend backend;
+	bool incremental;
+
+	/* render with TileShader instead of fixed function */
+	bool shaders;
+
+	/* write MBTiles archive instead of tile tree */
+	bool archive;
+
+	/* write geometry instead of rendering, no GL is used */
+	bool vector;
+
+	/* order metatiles are rendered in */
+	TilerOrder order;
+
+	/* tile format for each zoom */
+	TileFormat formats[sizeof(LevelInfos)/sizeof(LevelInfos[0])];
+
+	/* change files applied to infile */
+	std::vector<const char*> changes;
+
+	/* only tiles intersecting these areas are rendered if set */
+	const TilerDirtyIndex* dirty;
+
+	/* if bucket_zoom >= 0, only tiles within this tile are rendered */
+	int bucket_zoom;
+	int bucket_x, bucket_y;
+
+	/* geometry server address; if set, no data is loaded */
+	const char* server;
+};
+
+/** Where and how rendered tiles are written */
+struct TilerOutput {
+	PngEncoder* encoder;
+	int pnglevel;
+
+	/* tiles go into archive instead of files if set */
+	MBTilesWriter* archive;
+
+	/* blank tiles are symlinked to <target>/blank.<extension>;
+	 * extensions of blank tiles already written */
+	bool link_blank;
+	unsigned char blank_color[3];
+	std::string target;
+	std::set<std::string> blanks;
+
+	int nlinked;
+};
+
+/* FNV-1a */
+static uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+template <class T>
+static uint64_t HashVector(const std::vector<T>& v, uint64_t hash) {
+	size_t size = v.size();
+	hash = HashBytes(&size, sizeof(size), hash);
+	return v.empty() ? hash : HashBytes(&v[0], v.size() * sizeof(T), hash);
+}
+
+/** Hash of geometry of a single layer tile */
+struct TilerGeometryHash {
+	uint64_t hash;
+	bool empty;
+};
+
+typedef std::map<std::pair<int, int>, TilerGeometryHash> TilerGeometryHashMap;
+
+/**
+ * Hashes geometry which is rendered into given area
+ *
+ * That is, geometry of all layer tiles of given level which
+ * intersect the area; these are the same tiles GeometryLayer
+ * loads, so the geometry is taken from (and left in) the cache.
+ *
+ * @param empty set to whether there's no geometry at all
+ */
+static uint64_t HashAreaGeometry(const GeometryDatasource& source, const BBoxi& bbox, int level, int flags, TilerGeometryHashMap& hashes, uint64_t hash, bool& empty) {
+	double ntiles = (double)(1 << level);
+	int minx = std::max(0, (int)floor(((double)bbox.left + 1800000000.0) / 3600000000.0 * ntiles) - 1);
+	int maxx = std::min((1 << level) - 1, (int)floor(((double)bbox.right + 1800000000.0) / 3600000000.0 * ntiles) + 1);
+	int miny = std::max(0, (int)floor((900000000.0 - (double)bbox.top) / 1800000000.0 * ntiles) - 1);
+	int maxy = std::min((1 << level) - 1, (int)floor((900000000.0 - (double)bbox.bottom) / 1800000000.0 * ntiles) + 1);
+
+	empty = true;
+	for (int x = minx; x <= maxx; ++x) {
+		for (int y = miny; y <= maxy; ++y) {
+			BBoxi tilebbox = BBoxi::ForGeoTile(level, x, y);
+			if (!bbox.Intersects(tilebbox))
+				continue;
+
+			TilerGeometryHashMap::iterator tile = hashes.find(std::make_pair(x, y));
+			if (tile == hashes.end()) {
+				Geometry geometry;
+				source.GetGeometry(geometry, tilebbox, flags);
+
+				TilerGeometryHash tilehash;
+				tilehash.hash = HashVector(geometry.GetLinesVertices(), 14695981039346656037ULL);
+				tilehash.hash = HashVector(geometry.GetLinesLengths(), tilehash.hash);
+				tilehash.hash = HashVector(geometry.GetConvexVertices(), tilehash.hash);
+				tilehash.hash = HashVector(geometry.GetConvexLengths(), tilehash.hash);
+				tilehash.hash = HashVector(geometry.GetInstances(), tilehash.hash);
+				tilehash.empty = geometry.GetLinesVertices().empty() && geometry.GetConvexVertices().empty() && geometry.GetInstances().empty();
+
+				tile = hashes.insert(std::make_pair(std::make_pair(x, y), tilehash)).first;
+			}
+
+			hash = HashBytes(&tile->second.hash, sizeof(tile->second.hash), hash);
+			empty = empty && tile->second.empty;
+		}
+	}
+
+	return hash;
+}
+
+static bool IsBlank(const PixelBuffer& pixels, int x, int y, const unsigned char* color) {
+	for (int row = 0; row < 256; ++row) {
+		const unsigned char* pixel = pixels.GetReverseRowPointer(y + row, x);
+		for (int i = 0; i < 256; ++i, pixel += 3)
+			if (pixel[0] != color[0] || pixel[1] != color[1] || pixel[2] != color[2])
+				return false;
+	}
+	return true;
+}
+
+/**
+ * Makes tile a symlink to the shared blank tile
+ *
+ * @return false if that's not possible, so tile has to be written
+ */
+static bool LinkBlank(TilerOutput& output, const PixelBuffer& pixels, const PngEncoder::Image& image) {
+	std::string extension = image.format.GetExtension();
+	if (output.blanks.find(extension) == output.blanks.end()) {
+		/* written once per process; rename is atomic, so it's
+		 * safe with several workers */
+		std::string blank_path = output.target + "/blank." + extension;
+		char temp_path[FILENAME_MAX];
+		snprintf(temp_path, sizeof(temp_path), "%s.%d", blank_path.c_str(), (int)getpid());
+
+		PngEncoder::Image blank(temp_path, image.x, image.y, image.zoom, image.column, image.row, image.format);
+		PngEncoder::WriteImage(pixels, blank, 256, 256, output.pnglevel, NULL);
+
+		if (rename(temp_path, blank_path.c_str()) != 0) {
+			unlink(temp_path);
+			return false;
+		}
+		output.blanks.insert(extension);
+	}
+
+	/* tiles are <target>/<zoom>/<x>/<y>.<extension> */
+	if (symlink(("../../blank." + extension).c_str(), image.path.c_str()) != 0)
+		return false;
+
+	output.nlinked++;
+	return true;
+}
+
+/**
+ * Writes rendered tiles, either directly or via encoder
+ */
+static void WriteMetatile(TilerOutput& output, std::auto_ptr<PixelBuffer> pixels, const PngEncoder::ImageVector& images) {
+	PngEncoder::ImageVector encode;
+	encode.reserve(images.size());
+
+	for (PngEncoder::ImageVector::const_iterator i = images.begin(); i != images.end(); ++i) {
+		/* never write through symlink to blank tile */
+		if (!output.archive)
+			unlink(i->path.c_str());
+
+		if (output.link_blank && IsBlank(*pixels, i->x, i->y, output.blank_color) && LinkBlank(output, *pixels, *i))
+			continue;
+
+		encode.push_back(*i);
+	}
+
+	if (output.encoder) {
+		output.encoder->Encode(pixels.release(), encode);
+	} else {
+		for (PngEncoder::ImageVector::const_iterator i = encode.begin(); i != encode.end(); ++i)
+			PngEncoder::WriteImage(*pixels, *i, 256, 256, output.pnglevel, output.archive);
+	}
+}
+
+static void FinishMetatile(PBuffer& pbuffer, TilerOutput& output, TilerMetatileQueue& pending) {
+	const TilerMetatile& metatile = pending.front();
+
+	std::auto_ptr<PixelBuffer> pixels(new PixelBuffer(metatile.width, metatile.height, 3));
+	pbuffer.FinishGetPixels(*pixels);
+	WriteMetatile(output, pixels, metatile.images);
+
+	pending.pop_front();
+}
+
+/**
+ * Renders tiles of a single shard
+ *
+ * Metatile columns are distributed between shards round-robin,
+ * which keeps neighbouring metatiles within a process while
+ * balancing dense areas between processes.
+ */
+/* OrthoViewer clips everything above 1km */
+static const double MAX_VISIBLE_HEIGHT = 1000.0;
+
+/**
+ * Returns how far down request area must be expanded to include
+ * objects below it which are skewed into it
+ *
+ * OrthoViewer shifts points up by skew times their height, which
+ * in Mercator corresponds to the same latitude difference
+ * anywhere.
+ *
+ * @param max_height maximal object height in geometry units
+ */
+static osmint_t GetSkewMargin(float skew, osmint_t max_height) {
+	double height = std::min((double)max_height / GEOM_UNITSINMETER, MAX_VISIBLE_HEIGHT);
+	return (osmint_t)ceil(skew * height / WGS84_EARTH_EQ_LENGTH * 360.0 * GEOM_UNITSINDEGREE);
+}
+
+/**
+ * Returns distance along Hilbert curve filling 2^order x 2^order grid
+ */
+static uint64_t GetHilbertIndex(int order, uint64_t x, uint64_t y) {
+	uint64_t n = (uint64_t)1 << order;
+	uint64_t d = 0;
+	for (uint64_t s = n / 2; s > 0; s /= 2) {
+		uint64_t rx = (x & s) ? 1 : 0;
+		uint64_t ry = (y & s) ? 1 : 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		/* rotate quadrant so curve is continuous */
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+/** Metatile scheduled for rendering, see RenderTiles() */
+struct TilerMetatileRef {
+	int zoom;
+	int x, y; /* first tile, aligned to metatile size */
+
+	/* position along traversal curve */
+	uint64_t key;
+
+	TilerMetatileRef(int z, int xx, int yy, uint64_t k): zoom(z), x(xx), y(yy), key(k) {}
+
+	/* metatiles starting the same curve section go from lower zoom */
+	bool operator<(const TilerMetatileRef& other) const {
+		if (key != other.key)
+			return key < other.key;
+		return zoom < other.zoom;
+	}
+};
+
+typedef std::vector<TilerMetatileRef> TilerMetatileRefVector;
+
+/** Per-zoom state of RenderTiles() */
+struct TilerZoom {
+	int minxtile, maxxtile, minytile, maxytile;
+
+	std::string extension;
+	uint64_t hash;
+
+	TileManifest manifest;
+	TilerGeometryHashMap geometry_hashes;
+
+	TilerZoom(const char* target, int zoom): manifest(target, zoom) {}
+};
+
+int RenderTiles(PBuffer& pbuffer, OrthoViewer& viewer, GeometryLayer& layer, const GeometryDatasource& geometry_source, PngEncoder* encoder, MBTilesWriter* archive, const TilerSettings& settings, osmint_t max_height, int shard, int nshards) {
+	const char* target = settings.target;
+	int metatile = settings.metatile;
+
+	int zoom, ntiles = 0, nskipped = 0, nclean = 0;
+	TilerMetatileQueue pending;
+
+	/* expand requests down for skewed buildings to show correctly */
+	osmint_t skew_margin = GetSkewMargin(settings.skew, max_height);
 
 	char path[FILENAME_MAX];
 	snprintf(path, sizeof(path), "%s", target);
-	mkdir(path, 0777);
-	for (zoom = minzoom; zoom <= maxzoom; zoom++) {
+	if (!archive)
+		mkdir(path, 0777);
+
+	TilerOutput output;
+	output.encoder = encoder;
+	output.pnglevel = settings.pnglevel;
+	output.archive = archive;
+	output.link_blank = settings.incremental;
+	output.target = target;
+	output.nlinked = 0;
+
+	if (output.link_blank) {
+		/* find out how clear color looks after readback */
+		PixelBuffer pixels(1, 1, 3);
+		glViewport(0, 0, 1, 1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		pbuffer.GetPixels(pixels, 0, 0);
+		memcpy(output.blank_color, pixels.GetData(), 3);
+	}
+
+	/* tiles depend on rendering options as well as on geometry */
+	uint64_t settings_hash = 14695981039346656037ULL;
+	settings_hash = HashBytes(&settings.skew, sizeof(settings.skew), settings_hash);
+	settings_hash = HashBytes(&settings.multisamples, sizeof(settings.multisamples), settings_hash);
+	settings_hash = HashBytes(&settings.pnglevel, sizeof(settings.pnglevel), settings_hash);
+
+	for (zoom = settings.minzoom; zoom <= settings.maxzoom; ) {
+		/* zooms rendered together */
+		int lastzoom = zoom;
+		if (settings.order == ORDER_DEPTH)
+			while (lastzoom < settings.maxzoom && !(LevelInfos[lastzoom + 1] != LevelInfos[zoom]))
+				lastzoom++;
+
 		layer.SetLevel(LevelInfos[zoom].tiling);
 		layer.SetFlags(LevelInfos[zoom].flags);
 		if (zoom > 0 && LevelInfos[zoom-1] != LevelInfos[zoom])
 			layer.Clear();
 
-		int minxtile = (int)((minlon + 180.0)/360.0*powf(2.0, zoom));
-		int maxxtile = (int)((maxlon + 180.0)/360.0*powf(2.0, zoom));
-		int minytile = (int)((-mercator(maxlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, zoom));
-		int maxytile = (int)((-mercator(minlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, zoom));
+		std::vector<TilerZoom> levels;
+		TilerMetatileRefVector metatiles;
+		for (int z = zoom; z <= lastzoom; ++z) {
+			levels.push_back(TilerZoom(target, z));
+			TilerZoom& level = levels.back();
 
-		snprintf(path, sizeof(path), "%s/%d", target, zoom);
+			const TileFormat& format = settings.formats[z];
+			level.extension = format.GetExtension();
+			level.hash = HashBytes(&format.type, sizeof(format.type), settings_hash);
+			level.hash = HashBytes(&format.quality, sizeof(format.quality), level.hash);
+
+			level.minxtile = (int)((settings.minlon + 180.0)/360.0*powf(2.0, z));
+			level.maxxtile = (int)((settings.maxlon + 180.0)/360.0*powf(2.0, z));
+			level.minytile = (int)((-mercator(settings.maxlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, z));
+			level.maxytile = (int)((-mercator(settings.minlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, z));
+
+			if (settings.bucket_zoom >= 0) {
+				int shift = z - settings.bucket_zoom;
+				level.minxtile = std::max(level.minxtile, settings.bucket_x << shift);
+				level.maxxtile = std::min(level.maxxtile, ((settings.bucket_x + 1) << shift) - 1);
+				level.minytile = std::max(level.minytile, settings.bucket_y << shift);
+				level.maxytile = std::min(level.maxytile, ((settings.bucket_y + 1) << shift) - 1);
+			}
+
+			snprintf(path, sizeof(path), "%s/%d", target, z);
+			if (!archive)
+				mkdir(path, 0777);
+
+			/* metatiles are aligned to their size, and are cropped
+			 * to requested tiles, so tiles are the same regardless
+			 * of requested area */
+			for (int metax = level.minxtile - level.minxtile % metatile; metax <= level.maxxtile; metax += metatile) {
+				if ((metax / metatile) % nshards != shard)
+					continue;
+
+				for (int metay = level.minytile - level.minytile % metatile; metay <= level.maxytile; metay += metatile) {
+					/* position of metatile area on the grid of last
+					 * zoom; area of power of two size covers single
+					 * section of the curve, which starts at the key */
+					int shift = lastzoom - z;
+					uint64_t key = metatiles.size();
+					if (settings.order != ORDER_COLUMNS) {
+						int section = 0;
+						while (section < lastzoom && ((uint64_t)2 << section) <= ((uint64_t)metatile << shift))
+							section++;
+						key = GetHilbertIndex(lastzoom, (uint64_t)metax << shift, (uint64_t)metay << shift) >> (2 * section) << (2 * section);
+					}
+					metatiles.push_back(TilerMetatileRef(z, metax, metay, key));
+				}
+			}
+		}
+
+		if (settings.order != ORDER_COLUMNS)
+			std::stable_sort(metatiles.begin(), metatiles.end());
+
+		for (TilerMetatileRefVector::const_iterator ref = metatiles.begin(); ref != metatiles.end(); ++ref) {
+			TilerZoom& level = levels[ref->zoom - zoom];
+
+			int x0 = std::max(ref->x, level.minxtile), x1 = std::min(ref->x + metatile - 1, level.maxxtile);
+			int y0 = std::max(ref->y, level.minytile), y1 = std::min(ref->y + metatile - 1, level.maxytile);
+
+			for (int x = x0; x <= x1 && !archive; ++x) {
+				snprintf(path, sizeof(path), "%s/%d/%d", target, ref->zoom, x);
+				mkdir(path, 0777);
+			}
+
+			int width = (x1 - x0 + 1) * 256;
+			int height = (y1 - y0 + 1) * 256;
+
+			BBoxi bbox = BBoxi::ForMercatorTile(ref->zoom, x0, y0);
+			bbox.Include(BBoxi::ForMercatorTile(ref->zoom, x1, y1));
+			viewer.SetBBox(bbox);
+
+			BBoxi request_bbox = bbox;
+			request_bbox.bottom -= skew_margin;
+
+			PngEncoder::ImageVector images;
+			bool all_empty = true;
+			for (int x = x0; x <= x1; ++x) {
+				for (int y = y0; y <= y1; ++y) {
+					snprintf(path, sizeof(path), "%s/%d/%d/%d.%s", target, ref->zoom, x, y, level.extension.c_str());
+
+					BBoxi tile_request_bbox = BBoxi::ForMercatorTile(ref->zoom, x, y);
+					tile_request_bbox.bottom -= skew_margin;
+
+					if (settings.dirty) {
+						std::vector<int> changed;
+						settings.dirty->Query(tile_request_bbox, changed);
+						if (changed.empty()) {
+							nclean++;
+							continue;
+						}
+					}
+
+					if (settings.incremental) {
+						bool empty;
+						uint64_t hash = HashAreaGeometry(geometry_source, tile_request_bbox, LevelInfos[ref->zoom].tiling, LevelInfos[ref->zoom].flags, level.geometry_hashes, level.hash, empty);
+
+						uint64_t stored_hash;
+						struct stat st;
+						if (level.manifest.GetHash(x, y, stored_hash) && stored_hash == hash && lstat(path, &st) == 0) {
+							nskipped++;
+							continue;
+						}
+
+						level.manifest.SetHash(x, y, hash);
+						all_empty = all_empty && empty;
+					}
+
+					/* pixel buffer rows go from top to bottom, as tile y does */
+					images.push_back(PngEncoder::Image(path, (x - x0) * 256, (y - y0) * 256, ref->zoom, x, y, settings.formats[ref->zoom]));
+				}
+			}
+			ntiles += images.size();
+
+			if (images.empty())
+				continue;
+
+			/* no geometry at all, tiles are known to be blank */
+			if (settings.incremental && all_empty && output.blanks.find(level.extension) != output.blanks.end()) {
+				bool linked = true;
+				for (PngEncoder::ImageVector::const_iterator i = images.begin(); i != images.end() && linked; ++i) {
+					unlink(i->path.c_str());
+					if (symlink(("../../blank." + level.extension).c_str(), i->path.c_str()) == 0)
+						output.nlinked++;
+					else
+						linked = false;
+				}
+				if (linked)
+					continue;
+			}
+
+			/* only clear area in use, partial metatiles are common
+			 * on low zooms and on the edges */
+			glViewport(0, 0, width, height);
+			glScissor(0, 0, width, height);
+			glEnable(GL_SCISSOR_TEST);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glDisable(GL_SCISSOR_TEST);
+			layer.GarbageCollect();
+			layer.LoadArea(request_bbox, TileManager::SYNC);
+			layer.Render(viewer);
+
+			if (encoder && pbuffer.HasAsyncReadback()) {
+				/* next metatile is rendered while this one is read */
+				pbuffer.StartGetPixels(width, height);
+				pending.push_back(TilerMetatile(width, height, images));
+
+				if (pbuffer.GetPendingReadbacks() > 1)
+					FinishMetatile(pbuffer, output, pending);
+			} else {
+				glFinish();
+
+				std::auto_ptr<PixelBuffer> pixels(new PixelBuffer(width, height, 3));
+				pbuffer.GetPixels(*pixels, 0, 0);
+
+				WriteMetatile(output, pixels, images);
+			}
+		}
+
+		if (settings.incremental) {
+			/* hashes may only be stored once tiles are written */
+			while (!pending.empty())
+				FinishMetatile(pbuffer, output, pending);
+
+			if (encoder)
+				encoder->Wait();
+
+			for (std::vector<TilerZoom>::iterator level = levels.begin(); level != levels.end(); ++level)
+				level->manifest.Save();
+		}
+
+		zoom = lastzoom + 1;
+	}
+
+	while (!pending.empty())
+		FinishMetatile(pbuffer, output, pending);
+
+	if (encoder)
+		encoder->Wait();
+
+	if (settings.incremental)
+		fprintf(stderr, "%d tiles unchanged, %d blank tiles linked\n", nskipped, output.nlinked);
+	if (settings.dirty)
+		fprintf(stderr, "%d tiles outside changed areas skipped\n", nclean);
+
+	return ntiles;
+}
+
+/**
+ * Writes tiles of a single shard as serialized geometry
+ *
+ * Each tile is requested from geometry source by its own bbox,
+ * so geometry is already cropped to the tile. Tiles without
+ * geometry are not written, as the client can tell them from
+ * missing ones.
+ */
+int WriteGeometryTiles(const GeometryDatasource& geometry_source, MBTilesWriter* archive, const TilerSettings& settings, int shard, int nshards) {
+	const char* target = settings.target;
+	int metatile = settings.metatile;
+
+	int ntiles = 0, nempty = 0, nskipped = 0, nclean = 0;
+
+	char path[FILENAME_MAX];
+	snprintf(path, sizeof(path), "%s", target);
+	if (!archive)
 		mkdir(path, 0777);
-		for (x = minxtile; x <= maxxtile; ++x) {
-			snprintf(path, sizeof(path), "%s/%d/%d", target, zoom, x);
+
+	for (int zoom = settings.minzoom; zoom <= settings.maxzoom; zoom++) {
+		TileManifest manifest(target, zoom);
+
+		const TileFormat& format = settings.formats[zoom];
+		uint64_t zoom_hash = HashBytes(&format.type, sizeof(format.type));
+		zoom_hash = HashBytes(&LevelInfos[zoom].flags, sizeof(LevelInfos[zoom].flags), zoom_hash);
+
+		int minxtile = (int)((settings.minlon + 180.0)/360.0*powf(2.0, zoom));
+		int maxxtile = (int)((settings.maxlon + 180.0)/360.0*powf(2.0, zoom));
+		int minytile = (int)((-mercator(settings.maxlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, zoom));
+		int maxytile = (int)((-mercator(settings.minlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, zoom));
+
+		if (settings.bucket_zoom >= 0) {
+			int shift = zoom - settings.bucket_zoom;
+			minxtile = std::max(minxtile, settings.bucket_x << shift);
+			maxxtile = std::min(maxxtile, ((settings.bucket_x + 1) << shift) - 1);
+			minytile = std::max(minytile, settings.bucket_y << shift);
+			maxytile = std::min(maxytile, ((settings.bucket_y + 1) << shift) - 1);
+		}
+
+		snprintf(path, sizeof(path), "%s/%d", target, zoom);
+		if (!archive)
 			mkdir(path, 0777);
-			for (y = minytile; y <= maxytile; ++y) {
-				snprintf(path, sizeof(path), "%s/%d/%d/%d.png", target, zoom, x, y);
 
+		/* sharded by metatile columns, same as RenderTiles() */
+		for (int x = minxtile; x <= maxxtile; ++x) {
+			if ((x / metatile) % nshards != shard)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%d/%d", target, zoom, x);
+			if (!archive)
+				mkdir(path, 0777);
+
+			for (int y = minytile; y <= maxytile; ++y) {
 				BBoxi bbox = BBoxi::ForMercatorTile(zoom, x, y);
-				viewer.SetBBox(bbox);
 
-				BBoxi request_bbox = bbox;
-				/* expand request 1km down for skewed buildings to show correctly
-				 * that is, we assume maximum object height of 1km */
+				if (settings.dirty) {
+					std::vector<int> changed;
+					settings.dirty->Query(bbox, changed);
+					if (changed.empty()) {
+						nclean++;
+						continue;
+					}
+				}
 
-				/* @todo take skew into account */
-				request_bbox.bottom -= 1000.0 / WGS84_EARTH_EQ_LENGTH * 360.0 * GEOM_UNITSINDEGREE;
+				snprintf(path, sizeof(path), "%s/%d/%d/%d.%s", target, zoom, x, y, format.GetExtension());
 
-				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-				layer.GarbageCollect();
-				layer.LoadArea(request_bbox, TileManager::SYNC);
-				layer.Render(viewer);
-				glFinish();
+				Geometry geometry;
+				geometry_source.GetGeometry(geometry, bbox, LevelInfos[zoom].flags);
 
-				pbuffer.GetPixels(pixels, 0, 0);
+				bool empty = geometry.GetLinesVertices().empty() && geometry.GetConvexVertices().empty() && geometry.GetInstances().empty();
 
-				PngWriter writer(path, 256, 256, pnglevel);
-				writer.WriteImage(pixels, 0, 0);
+				std::vector<unsigned char> data;
+				if (!empty)
+					geometry.Serialize(data);
 
 				ntiles++;
+
+				if (settings.incremental) {
+					uint64_t hash = HashVector(data, zoom_hash);
+
+					uint64_t stored_hash;
+					struct stat st;
+					if (manifest.GetHash(x, y, stored_hash) && stored_hash == hash && (empty || lstat(path, &st) == 0)) {
+						nskipped++;
+						continue;
+					}
+
+					manifest.SetHash(x, y, hash);
+				}
+
+				if (empty) {
+					/* tile may have had geometry on previous run */
+					if (!archive)
+						unlink(path);
+					nempty++;
+					continue;
+				}
+
+				if (archive) {
+					archive->AddTile(zoom, x, y, data);
+					continue;
+				}
+
+				FILE* file = fopen(path, "wb");
+				if (file == NULL)
+					throw SystemError() << "cannot open output file: " << path;
+
+				bool ok = fwrite(&data[0], data.size(), 1, file) == 1;
+				if (fclose(file) != 0)
+					ok = false;
+
+				if (!ok)
+					throw SystemError() << "cannot write output file: " << path;
+			}
+		}
+
+		if (settings.incremental)
+			manifest.Save();
+	}
+
+	fprintf(stderr, "%d tiles without geometry not written\n", nempty);
+	if (settings.incremental)
+		fprintf(stderr, "%d tiles unchanged\n", nskipped);
+	if (settings.dirty)
+		fprintf(stderr, "%d tiles outside changed areas skipped\n", nclean);
+
+	return ntiles;
+}
+
+/**
+ * Sets up rendering pipeline and renders tiles of a single shard
+ *
+ * @param pbuffer context to render with, NULL if tiles are
+ *        written as geometry
+ * @param osm_datasource data to generate geometry from, or NULL
+ *        to take it from settings.server
+ * @param threads number of geometry and encoder threads, 0 means one per CPU
+ */
+int RenderShard(PBuffer* pbuffer, const OsmDatasource* osm_datasource, const TilerSettings& settings, int shard, int nshards, int threads) {
+	DummyHeightmap heightmap;
+	std::auto_ptr<GeometryGenerator> geometry_generator;
+	std::auto_ptr<RemoteGeometryDatasource> remote_geometry;
+	const GeometryDatasource* geometry_source;
+	osmint_t max_height;
+
+	if (osm_datasource) {
+		geometry_generator.reset(new GeometryGenerator(*osm_datasource, heightmap));
+
+		/* tiles are loaded synchronously one by one, so spread each
+		 * tile over all CPUs available to this process */
+		geometry_generator->SetThreads(threads);
+
+		geometry_source = geometry_generator.get();
+		max_height = osm_datasource->GetMaxHeight();
+	} else {
+		/* each worker has its own connection */
+		remote_geometry.reset(new RemoteGeometryDatasource(settings.server));
+		geometry_source = remote_geometry.get();
+		max_height = remote_geometry->GetMaxHeight();
+	}
+
+	/* geometry persists between runs on the same data; cache
+	 * files are replaced atomically, so it may be shared by
+	 * processes */
+	std::auto_ptr<GeometryDiskCache> geometry_disk_cache;
+	if (settings.cachedir) {
+		std::string dataset_id = GeometryDiskCache::GetFileId(settings.infile);
+		for (std::vector<const char*>::const_iterator change = settings.changes.begin(); change != settings.changes.end() && !dataset_id.empty(); ++change) {
+			std::string change_id = GeometryDiskCache::GetFileId(*change);
+			dataset_id = change_id.empty() ? change_id : dataset_id + "+" + change_id;
+		}
+		if (settings.bucket_zoom >= 0 && !dataset_id.empty()) {
+			/* tiles of other buckets have different geometry on their edges */
+			char bucket[64];
+			snprintf(bucket, sizeof(bucket), "/%d/%d/%d", settings.bucket_zoom, settings.bucket_x, settings.bucket_y);
+			dataset_id += bucket;
+		}
+		if (dataset_id.empty()) {
+			fprintf(stderr, "Cannot stat %s, not using geometry cache\n", settings.infile);
+		} else {
+			geometry_disk_cache.reset(new GeometryDiskCache(*geometry_source, settings.cachedir, dataset_id));
+			geometry_source = geometry_disk_cache.get();
+		}
+	}
+
+	/* tile archive is written by encoder threads */
+	std::auto_ptr<MBTilesWriter> archive;
+	if (settings.archive) {
+		archive.reset(new MBTilesWriter(settings.target));
+
+		char value[256];
+		archive->SetMetadata("name", settings.infile);
+		archive->SetMetadata("type", "baselayer");
+		archive->SetMetadata("format", settings.formats[settings.maxzoom].GetExtension());
+		snprintf(value, sizeof(value), "%f,%f,%f,%f", settings.minlon, settings.minlat, settings.maxlon, settings.maxlat);
+		archive->SetMetadata("bounds", value);
+		snprintf(value, sizeof(value), "%d", settings.minzoom);
+		archive->SetMetadata("minzoom", value);
+		snprintf(value, sizeof(value), "%d", settings.maxzoom);
+		archive->SetMetadata("maxzoom", value);
+	}
+
+	int ntiles;
+	if (settings.vector) {
+		/* every tile is requested once, so there's no use in caching */
+		ntiles = WriteGeometryTiles(*geometry_source, archive.get(), settings, shard, nshards);
+	} else {
+		glClearColor(0.5, 0.5, 0.5, 0.0);
+
+		OrthoViewer viewer;
+		viewer.SetSkew(settings.skew);
+
+		/* geometry survives layer.Clear() and tile eviction */
+		GeometryCache geometry_cache(*geometry_source, 64*1024*1024);
+
+		/* shader must outlive layer */
+		std::auto_ptr<TileShader> shader;
+		if (settings.shaders)
+			shader.reset(new TileShader(TileBatch::IsSupported() ? TileShader::BATCHED : 0));
+
+		GeometryLayer layer(MercatorProjection(), geometry_cache);
+		layer.SetSizeLimit(128*1024*1024);
+		layer.SetShader(shader.get());
+
+		/* readback and PNG compression overlap with rendering */
+		std::auto_ptr<PngEncoder> encoder;
+		if (settings.pipelined)
+			encoder.reset(new PngEncoder(256, 256, settings.pnglevel, settings.encoders ? settings.encoders : threads, archive.get()));
+
+		ntiles = RenderTiles(*pbuffer, viewer, layer, geometry_cache, encoder.get(), archive.get(), settings, max_height, shard, nshards);
+	}
+
+	if (archive.get()) {
+		archive->Flush();
+
+		int nstored, nimages;
+		archive->GetStatistics(nstored, nimages);
+		fprintf(stderr, "%d tiles stored as %d distinct %s\n", nstored, nimages, settings.vector ? "blobs" : "images");
+	}
+
+	return ntiles;
+}
+
+/**
+ * Renders tiles of buckets of a single shard, one bucket at a time
+ *
+ * Only one bucket is loaded at any moment, so memory use is
+ * bounded by bucket size.
+ */
+int RenderBuckets(PBuffer* pbuffer, TileBuckets& buckets, const TilerSettings& settings, int shard, int nshards, int threads) {
+	int ntiles = 0;
+	for (size_t i = shard; i < buckets.GetCount(); i += nshards) {
+		TilerSettings bucket_settings = settings;
+		bucket_settings.bucket_zoom = buckets.GetZoom();
+		buckets.GetTile(i, bucket_settings.bucket_x, bucket_settings.bucket_y);
+
+		fprintf(stderr, "Rendering bucket %d/%d/%d (%d of %d)...\n", bucket_settings.bucket_zoom, bucket_settings.bucket_x, bucket_settings.bucket_y, (int)i + 1, (int)buckets.GetCount());
+
+		std::string path = buckets.Prepare(i);
+		std::auto_ptr<PreloadedXmlDatasource> datasource(CreateOsmDatasource(path.c_str(), PreloadedXmlDatasource::OVERVIEW_LAYERS));
+		datasource->Load(path.c_str());
+		buckets.Remove(i);
+
+		ntiles += RenderShard(pbuffer, datasource.get(), bucket_settings, 0, 1, threads);
+	}
+
+	return ntiles;
+}
+
+/**
+ * Forks rendering processes and waits for them
+ *
+ * Workers inherit loaded datasource, so it's only loaded once
+ * and shared copy-on-write (or via page cache for snapshots).
+ * Each worker creates its own GLX context, optionally on its
+ * own display, which allows using several GPUs.
+ *
+ * If buckets are given, workers render buckets instead, each
+ * loading its ones.
+ *
+ * @return total number of rendered tiles
+ */
+int RenderWorkers(const OsmDatasource* osm_datasource, TileBuckets* buckets, const TilerSettings& settings, int nworkers, int shard, int nshards, const std::vector<std::string>& displays) {
+	int threads = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN) / nworkers);
+
+	/* workers report their tile counts through a pipe */
+	int fds[2];
+	if (pipe(fds) != 0)
+		throw SystemError() << "pipe failed";
+
+	std::vector<pid_t> workers;
+	for (int i = 0; i < nworkers; ++i) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			int errn = errno;
+			close(fds[0]);
+			close(fds[1]);
+			for (std::vector<pid_t>::iterator w = workers.begin(); w != workers.end(); ++w)
+				waitpid(*w, NULL, 0);
+			throw SystemError(errn) << "fork failed";
+		}
+
+		if (pid == 0) {
+			close(fds[0]);
+
+			int status = 0;
+			try {
+				const char* display = displays.empty() ? NULL : displays[i % displays.size()].c_str();
+				std::auto_ptr<PBuffer> pbuffer;
+				if (!settings.vector)
+					pbuffer.reset(new PBuffer(256 * settings.metatile, 256 * settings.metatile, settings.multisamples, settings.backend, display));
+
+				int ntiles;
+				if (buckets)
+					ntiles = RenderBuckets(pbuffer.get(), *buckets, settings, shard * nworkers + i, nshards * nworkers, threads);
+				else
+					ntiles = RenderShard(pbuffer.get(), osm_datasource, settings, shard * nworkers + i, nshards * nworkers, threads);
+				if (write(fds[1], &ntiles, sizeof(ntiles)) != sizeof(ntiles))
+					status = 1;
+			} catch (std::exception &e) {
+				fprintf(stderr, "Worker %d: exception: %s\n", i, e.what());
+				status = 1;
+			} catch (...) {
+				fprintf(stderr, "Worker %d: unknown exception\n", i);
+				status = 1;
 			}
+
+			/* don't run parent's destructors */
+			Trace::Flush();
+			_exit(status);
 		}
+
+		workers.push_back(pid);
 	}
 
+	close(fds[1]);
+
+	int ntiles = 0, count;
+	while (read(fds[0], &count, sizeof(count)) == sizeof(count))
+		ntiles += count;
+	close(fds[0]);
+
+	int nfailed = 0;
+	for (std::vector<pid_t>::iterator w = workers.begin(); w != workers.end(); ++w) {
+		int status;
+		if (waitpid(*w, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			nfailed++;
+	}
+
+	if (nfailed > 0)
+		throw Exception() << nfailed << " of " << nworkers << " rendering workers failed";
+
 	return ntiles;
 }
 
 int real_main(int argc, char** argv) {
 	const char* progname = argv[0];
 
-	int pnglevel = 6;
+	Trace::Init();
+
+	TilerSettings settings;
+	settings.pnglevel = 6;
+
+	settings.minlat = settings.maxlat = settings.minlon = settings.maxlon = 0.0f;
+	settings.minzoom = 0;
+	settings.maxzoom = 18;
+
+	settings.skew = 1.0f;
+
+	settings.multisamples = 4;
+
+	/* tiles rendered in a single pass, per side */
+	settings.metatile = 8;
+
+	/* PNG encoder threads, 0 means one per CPU */
+	settings.encoders = 0;
+	settings.pipelined = true;
+
+	settings.cachedir = NULL;
+	settings.backend = PBuffer::AUTO;
+	settings.incremental = false;
+	settings.shaders = false;
+	settings.dirty = NULL;
+	settings.bucket_zoom = -1;
+	settings.bucket_x = settings.bucket_y = 0;
+	settings.server = NULL;
+	settings.order = ORDER_HILBERT;
 
-	float minlat = 0.0f, maxlat = 0.0f, minlon = 0.0f, maxlon = 0.0f;
-	int minzoom = 0, maxzoom = 18;
+	/* streaming mode */
+	int bucket_zoom = -1;
+	const char* bucket_dir = getenv("TMPDIR");
+	if (bucket_dir == NULL)
+		bucket_dir = "/tmp";
 
-	float skew = 1.0f;
+	const char* formats = NULL;
 
-	int multisamples = 4;
+	/* rendering processes, and part of tiles to render */
+	int nworkers = 1;
+	int shard = 0, nshards = 1;
+	std::vector<std::string> displays;
+
+	const char* snapshot = NULL;
 
 	int c;
-	while ((c = getopt(argc, argv, "0123456789s:z:Z:x:X:y:Y:m:")) != -1) {
+	while ((c = getopt(argc, argv, "0123456789s:z:Z:x:X:y:Y:m:M:j:pw:k:d:b:guS:c:C:B:T:f:r:o:")) != -1) {
 		switch (c) {
 		case '0': case '1': case '2': case '3': case '4':
 		case '5': case '6': case '7': case '8': case '9':
-				  pnglevel = c - '0';
+				  settings.pnglevel = c - '0';
 				  break;
-		case 's': skew = strtof(optarg, NULL); break;
-		case 'z': minzoom = (int)strtol(optarg, NULL, 10); break;
-		case 'Z': maxzoom = (int)strtol(optarg, NULL, 10); break;
-		case 'x': minlon = strtof(optarg, NULL); break;
-		case 'X': maxlon = strtof(optarg, NULL); break;
-		case 'y': minlat = strtof(optarg, NULL); break;
-		case 'Y': maxlat = strtof(optarg, NULL); break;
-		case 'm': multisamples = (int)strtol(optarg, NULL, 10); break;
+		case 's': settings.skew = strtof(optarg, NULL); break;
+		case 'z': settings.minzoom = (int)strtol(optarg, NULL, 10); break;
+		case 'Z': settings.maxzoom = (int)strtol(optarg, NULL, 10); break;
+		case 'x': settings.minlon = strtof(optarg, NULL); break;
+		case 'X': settings.maxlon = strtof(optarg, NULL); break;
+		case 'y': settings.minlat = strtof(optarg, NULL); break;
+		case 'Y': settings.maxlat = strtof(optarg, NULL); break;
+		case 'm': settings.multisamples = (int)strtol(optarg, NULL, 10); break;
+		case 'M': settings.metatile = (int)strtol(optarg, NULL, 10); break;
+		case 'j': settings.encoders = (int)strtol(optarg, NULL, 10); break;
+		case 'p': settings.pipelined = false; break;
+		case 'w': nworkers = (int)strtol(optarg, NULL, 10); break;
+		case 'k':
+			if (sscanf(optarg, "%d/%d", &shard, &nshards) != 2)
+				usage(progname);
+			break;
+		case 'd':
+			for (const char* display = optarg; *display; ) {
+				const char* end = strchr(display, ',');
+				if (end == NULL)
+					end = display + strlen(display);
+				if (end != display)
+					displays.push_back(std::string(display, end));
+				display = *end ? end + 1 : end;
+			}
+			break;
+		case 'b':
+			if (strcmp(optarg, "auto") == 0)
+				settings.backend = PBuffer::AUTO;
+			else if (strcmp(optarg, "glx") == 0)
+				settings.backend = PBuffer::GLX;
+			else if (strcmp(optarg, "egl") == 0)
+				settings.backend = PBuffer::EGL;
+			else if (strcmp(optarg, "osmesa") == 0)
+				settings.backend = PBuffer::OSMESA;
+			else
+				usage(progname);
+			break;
+		case 'g': settings.shaders = true; break;
+		case 'u': settings.incremental = true; break;
+		case 'S': snapshot = optarg; break;
+		case 'c': settings.cachedir = optarg; break;
+		case 'C': settings.changes.push_back(optarg); break;
+		case 'f': formats = optarg; break;
+		case 'B': bucket_zoom = (int)strtol(optarg, NULL, 10); break;
+		case 'T': bucket_dir = optarg; break;
+		case 'r': settings.server = optarg; break;
+		case 'o':
+			if (strcmp(optarg, "columns") == 0)
+				settings.order = ORDER_COLUMNS;
+			else if (strcmp(optarg, "hilbert") == 0)
+				settings.order = ORDER_HILBERT;
+			else if (strcmp(optarg, "depth") == 0)
+				settings.order = ORDER_DEPTH;
+			else
+				usage(progname);
+			break;
 		default:
 			usage(progname);
 		}
@@ -166,35 +1160,162 @@ int real_main(int argc, char** argv) {
 	argc -= optind;
 	argv += optind;
 
-	if (minlon < -180.0f || maxlon > 180.0 || minlon > maxlon)
+	if (snapshot) {
+		if (argc != 1)
+			usage(progname);
+
+		std::auto_ptr<PreloadedXmlDatasource> osm_datasource(CreateOsmDatasource(argv[0]));
+
+		fprintf(stderr, "Loading OSM data...\n");
+		osm_datasource->Load(argv[0]);
+
+		fprintf(stderr, "Writing snapshot...\n");
+		osm_datasource->WriteSnapshot(snapshot);
+
+		return 0;
+	}
+
+	if (settings.minlon < -180.0f || settings.maxlon > 180.0 || settings.minlon > settings.maxlon)
+		usage(progname);
+	if (settings.minlat < -85.0f || settings.maxlat > 85.0 || settings.minlat > settings.maxlat)
 		usage(progname);
-	if (minlat < -85.0f || maxlat > 85.0 || minlat > maxlat)
+	if (settings.minzoom < 0 || settings.minzoom > settings.maxzoom)
 		usage(progname);
-	if (minzoom < 0 || minzoom > maxzoom)
+	if (settings.skew <= 0.0)
 		usage(progname);
-	if (skew <= 0.0)
+	if (settings.metatile < 1)
 		usage(progname);
-	if (argc != 2)
+	if (settings.encoders < 0)
 		usage(progname);
+	if (nworkers < 1 || nshards < 1 || shard < 0 || shard >= nshards)
+		usage(progname);
+	if (argc != (settings.server ? 1 : 2))
+		usage(progname);
+
+	settings.infile = settings.server ? settings.server : argv[0];
+	settings.target = argv[argc - 1];
+	settings.archive = HasSuffix(settings.target, ".mbtiles");
+
+	if (settings.archive && settings.incremental)
+		throw Exception() << "incremental mode is not supported with MBTiles output";
+
+	/* format[:minzoom[-maxzoom]], later ones override earlier */
+	for (const char* spec = formats; spec && *spec; ) {
+		const char* end = strchr(spec, ',');
+		if (end == NULL)
+			end = spec + strlen(spec);
+
+		std::string item(spec, end);
+		std::string::size_type colon = item.find(':');
+		const int nzooms = sizeof(settings.formats)/sizeof(settings.formats[0]);
+		int minzoom = 0, maxzoom = nzooms - 1;
+		if (colon != std::string::npos) {
+			int n = sscanf(item.c_str() + colon + 1, "%d-%d", &minzoom, &maxzoom);
+			if (n == 1)
+				maxzoom = minzoom;
+			else if (n != 2)
+				usage(progname);
+		}
+
+		TileFormat format;
+		if (!TileFormat::Parse(item.substr(0, colon), format) || minzoom < 0 || minzoom > maxzoom || maxzoom >= nzooms)
+			usage(progname);
+		if (!format.IsSupported())
+			throw Exception() << item.substr(0, colon) << " output is not supported by this build";
 
-	/* OpenGL init */
-	PBuffer pbuffer(256, 256, multisamples);
-	glClearColor(0.5, 0.5, 0.5, 0.0);
+		for (int zoom = minzoom; zoom <= maxzoom; ++zoom)
+			settings.formats[zoom] = format;
+
+		spec = *end ? end + 1 : end;
+	}
+
+	/* MBTiles declares single format for all tiles */
+	for (int zoom = settings.minzoom; zoom < settings.maxzoom && settings.archive; ++zoom)
+		if (settings.formats[zoom].type != settings.formats[settings.maxzoom].type)
+			throw Exception() << "MBTiles output requires the same tile format for all zooms";
+
+	if (settings.server) {
+		if (bucket_zoom >= 0 || !settings.changes.empty())
+			throw Exception() << "bucketed rendering and changes are not supported with geometry server";
+		if (settings.cachedir)
+			throw Exception() << "geometry cache is not supported with geometry server, use server's own cache";
+	}
+
+	if (bucket_zoom >= 0) {
+		if (bucket_zoom > settings.minzoom)
+			throw Exception() << "minimal zoom must not be lower than bucket zoom";
+		if (HasSuffix(settings.infile, ".pbf") || HasSuffix(settings.infile, ".snapshot"))
+			throw Exception() << "bucketed rendering requires OSM XML input";
+		if (!settings.changes.empty())
+			throw Exception() << "changes cannot be applied in bucketed rendering";
+	}
+
+	/* geometry is written as is, so GL is not needed at all */
+	settings.vector = settings.formats[settings.maxzoom].IsVector();
+	for (int zoom = settings.minzoom; zoom < settings.maxzoom; ++zoom)
+		if (settings.formats[zoom].IsVector() != settings.vector)
+			throw Exception() << "geometry tiles cannot be mixed with image formats";
+
+	/* OpenGL init; workers create their own contexts after fork,
+	 * as X connections cannot be shared */
+	std::auto_ptr<PBuffer> pbuffer;
+	if (nworkers == 1 && !settings.vector) {
+		pbuffer.reset(new PBuffer(256 * settings.metatile, 256 * settings.metatile, settings.multisamples, settings.backend, displays.empty() ? NULL : displays.front().c_str()));
+		fprintf(stderr, "Using %s backend\n", pbuffer->GetBackendName());
+	}
 
 	/* glosm init */
-	OrthoViewer viewer;
-	viewer.SetSkew(skew);
-	PreloadedXmlDatasource osm_datasource;
+	std::auto_ptr<OsmDatasource> osm_datasource;
+	std::auto_ptr<TileBuckets> buckets;
+	TilerDirtyIndex dirty;
 
-	fprintf(stderr, "Loading OSM data...\n");
-	osm_datasource.Load(argv[0]);
+	if (settings.server) {
+		fprintf(stderr, "Using geometry server at %s\n", settings.server);
+	} else if (bucket_zoom >= 0) {
+		int minx = (int)((settings.minlon + 180.0)/360.0*powf(2.0, bucket_zoom));
+		int maxx = (int)((settings.maxlon + 180.0)/360.0*powf(2.0, bucket_zoom));
+		int miny = (int)((-mercator(settings.maxlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, bucket_zoom));
+		int maxy = (int)((-mercator(settings.minlat/180.0*M_PI)/M_PI*180.0 + 180.0)/360.0*powf(2.0, bucket_zoom));
 
-	fprintf(stderr, "Creating geometry...\n");
-	DummyHeightmap heightmap;
-	GeometryGenerator geometry_generator(osm_datasource, heightmap);
+		/* object heights are not known before loading, so buckets
+		 * cover request expansion in RenderTiles() for any visible
+		 * height, plus 100m for wide lines crossing bucket edges */
+		osmint_t skew_margin = GetSkewMargin(settings.skew, std::numeric_limits<osmint_t>::max());
+		osmint_t line_margin = 100.0 / WGS84_EARTH_EQ_LENGTH * 360.0 * GEOM_UNITSINDEGREE;
+
+		buckets.reset(new TileBuckets(bucket_dir, bucket_zoom, minx, maxx, miny, maxy, line_margin, skew_margin));
+
+		fprintf(stderr, "Sorting OSM data into %d buckets...\n", (int)buckets->GetCount());
+		buckets->Build(settings.infile);
+	} else if (HasSuffix(settings.infile, ".snapshot")) {
+		if (!settings.changes.empty())
+			throw Exception() << "changes cannot be applied to snapshots";
+
+		MmapOsmDatasource* datasource = new MmapOsmDatasource;
+		osm_datasource.reset(datasource);
+		datasource->Load(settings.infile);
+	} else {
+		/* overviews are used by GROUND | SIMPLIFY levels */
+		PreloadedXmlDatasource* datasource = CreateOsmDatasource(settings.infile, PreloadedXmlDatasource::OVERVIEW_LAYERS, !settings.changes.empty());
+		osm_datasource.reset(datasource);
+		datasource->Load(settings.infile);
 
-	GeometryLayer layer(MercatorProjection(), geometry_generator);
-	layer.SetSizeLimit(128*1024*1024);
+		/* only tiles of changed areas are rerendered; geometry
+		 * generators are only created by RenderShard(), so they
+		 * cache no ways to invalidate with these areas */
+		if (!settings.changes.empty()) {
+			std::vector<BBoxi> areas;
+			for (std::vector<const char*>::const_iterator change = settings.changes.begin(); change != settings.changes.end(); ++change) {
+				fprintf(stderr, "Applying %s...\n", *change);
+				datasource->ApplyChange(*change, areas);
+			}
+
+			for (size_t i = 0; i < areas.size(); ++i)
+				dirty.Insert(areas[i], (int)i);
+			dirty.Build();
+			settings.dirty = &dirty;
+		}
+	}
 
 	/* Rendering */
 	fprintf(stderr, "Rendering...\n");
@@ -202,7 +1323,13 @@ int real_main(int argc, char** argv) {
 	struct timeval begin, end;
 
 	gettimeofday(&begin, NULL);
-	int ntiles = RenderTiles(pbuffer, viewer, layer, argv[1], minlon, minlat, maxlon, maxlat, minzoom, maxzoom, pnglevel);
+	int ntiles;
+	if (nworkers == 1 && buckets.get())
+		ntiles = RenderBuckets(pbuffer.get(), *buckets, settings, shard, nshards, 0);
+	else if (nworkers == 1)
+		ntiles = RenderShard(pbuffer.get(), osm_datasource.get(), settings, shard, nshards, 0);
+	else
+		ntiles = RenderWorkers(osm_datasource.get(), buckets.get(), settings, nworkers, shard, nshards, displays);
 	gettimeofday(&end, NULL);
 
 	float dt = (float)(end.tv_sec - begin.tv_sec) + (float)(end.tv_usec - begin.tv_usec)/1000000.0f;
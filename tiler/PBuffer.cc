@@ -18,114 +18,591 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#include <glosm/util/gl.h>
+#include <glosm/Trace.hh>
+
 #include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <X11/Xlib.h>
+#include <GL/glx.h>
+
+#if defined(WITH_EGL)
+#	include <EGL/egl.h>
+#	include <EGL/eglext.h>
+#endif
+
+#if defined(WITH_OSMESA)
+#	include <GL/osmesa.h>
+#endif
+
+#include <string>
+#include <vector>
+
 #include "PBuffer.hh"
 
 #include "PixelBuffer.hh"
 
-static bool CheckGLXVersion(Display* display, int screen) {
-	const char *glxversion;
-
-	glxversion = glXGetClientString(display, GLX_VERSION);
-	if (strstr(glxversion, "1.3") == NULL && strstr(glxversion, "1.4") == NULL)
+static bool HasExtension(const char* extensions, const char* name) {
+	if (extensions == NULL)
 		return false;
 
-	glxversion = glXQueryServerString(display, screen, GLX_VERSION);
-	if (strstr(glxversion, "1.3") == NULL && strstr(glxversion, "1.4") == NULL)
+	size_t len = strlen(name);
+	for (const char* pos = extensions; (pos = strstr(pos, name)) != NULL; pos += len)
+		if ((pos == extensions || pos[-1] == ' ') && (pos[len] == ' ' || pos[len] == '\0'))
+			return true;
+
+	return false;
+}
+
+static bool HasGLExtension(const char* name) {
+	return HasExtension((const char*)glGetString(GL_EXTENSIONS), name);
+}
+
+static bool HasGLVersion(int reqmajor, int reqminor) {
+	const char* version = (const char*)glGetString(GL_VERSION);
+	int major = 0, minor = 0;
+	if (version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2)
 		return false;
 
-	return true;
+	return major > reqmajor || (major == reqmajor && minor >= reqminor);
 }
 
-PBuffer::PBuffer(int width, int height, int samples) : width_(width), height_(height), display_(NULL), context_(NULL), pbuffer_(None) {
-	if ((display_ = XOpenDisplay(NULL)) == NULL)
-		throw PBufferException() << "cannot open default X display";
+/**
+ * Backend-specific OpenGL context with offscreen surface
+ */
+class PBufferContext {
+public:
+	virtual ~PBufferContext() {}
 
-	int screen = DefaultScreen(display_);
+	/** Makes rendered pixels available to glReadPixels */
+	virtual void PrepareRead() {}
 
-	if (!CheckGLXVersion(display_, screen)) {
-		XCloseDisplay(display_);
-		throw PBufferException() << "GLX 1.3 or 1.4 required, but not available";
-	}
-
-	int fbattribs[] = {
-		GLX_RENDER_TYPE, GLX_RGBA_BIT,
-		GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT,
-		GLX_RED_SIZE, 8,
-		GLX_GREEN_SIZE, 8,
-		GLX_BLUE_SIZE, 8,
-		GLX_DEPTH_SIZE, 16,
-		None, None,
-		None, None,
-		None
-	};
-
-	if (samples > 1) {
-		fbattribs[12] = GLX_SAMPLE_BUFFERS;
-		fbattribs[13] = 1;
-		fbattribs[14] = GLX_SAMPLES;
-		fbattribs[15] = samples;
-	}
-
-	int pbattribs[] = {
-		GLX_PBUFFER_WIDTH, width_,
-		GLX_PBUFFER_HEIGHT, height_,
-		GLX_LARGEST_PBUFFER, False,
-		GLX_PRESERVED_CONTENTS, False,
-		None
-	};
-
-	int nconfigs;
-	GLXFBConfig *fbconfigs;
-	if ((fbconfigs = glXChooseFBConfig(display_, screen, fbattribs, &nconfigs)) == NULL) {
-		XCloseDisplay(display_);
-		throw PBufferException() << "glxChooseFBConfig failed";
+	virtual bool IsDirect() const { return true; }
+
+	virtual const char* GetName() const = 0;
+};
+
+/*
+ * GLX pbuffer
+ */
+
+class GLXPBufferContext: public PBufferContext {
+protected:
+	Display* display_;
+	GLXContext context_;
+	GLXPbuffer pbuffer_;
+
+protected:
+	static bool CheckGLXVersion(Display* display, int screen) {
+		const char *glxversion;
+
+		glxversion = glXGetClientString(display, GLX_VERSION);
+		if (strstr(glxversion, "1.3") == NULL && strstr(glxversion, "1.4") == NULL)
+			return false;
+
+		glxversion = glXQueryServerString(display, screen, GLX_VERSION);
+		if (strstr(glxversion, "1.3") == NULL && strstr(glxversion, "1.4") == NULL)
+			return false;
+
+		return true;
 	}
 
-	if (nconfigs == 0) {
+public:
+	GLXPBufferContext(int width, int height, int samples, const char* display) : display_(NULL), context_(NULL), pbuffer_(None) {
+		if ((display_ = XOpenDisplay(display)) == NULL) {
+			if (display)
+				throw PBufferException() << "cannot open X display " << display;
+			throw PBufferException() << "cannot open default X display";
+		}
+
+		int screen = DefaultScreen(display_);
+
+		if (!CheckGLXVersion(display_, screen)) {
+			XCloseDisplay(display_);
+			throw PBufferException() << "GLX 1.3 or 1.4 required, but not available";
+		}
+
+		int fbattribs[] = {
+			GLX_RENDER_TYPE, GLX_RGBA_BIT,
+			GLX_DRAWABLE_TYPE, GLX_PBUFFER_BIT,
+			GLX_RED_SIZE, 8,
+			GLX_GREEN_SIZE, 8,
+			GLX_BLUE_SIZE, 8,
+			GLX_DEPTH_SIZE, 16,
+			None, None,
+			None, None,
+			None
+		};
+
+		if (samples > 1) {
+			fbattribs[12] = GLX_SAMPLE_BUFFERS;
+			fbattribs[13] = 1;
+			fbattribs[14] = GLX_SAMPLES;
+			fbattribs[15] = samples;
+		}
+
+		int pbattribs[] = {
+			GLX_PBUFFER_WIDTH, width,
+			GLX_PBUFFER_HEIGHT, height,
+			GLX_LARGEST_PBUFFER, False,
+			GLX_PRESERVED_CONTENTS, False,
+			None
+		};
+
+		int nconfigs;
+		GLXFBConfig *fbconfigs;
+		if ((fbconfigs = glXChooseFBConfig(display_, screen, fbattribs, &nconfigs)) == NULL) {
+			XCloseDisplay(display_);
+			throw PBufferException() << "glxChooseFBConfig failed";
+		}
+
+		if (nconfigs == 0) {
+			XFree(fbconfigs);
+			XCloseDisplay(display_);
+			throw PBufferException() << "no suitable configs returned by glxChooseFBConfig";
+		}
+
+		/* Just use first config */
+		GLXFBConfig fbconfig = fbconfigs[0];
 		XFree(fbconfigs);
-		XCloseDisplay(display_);
-		throw PBufferException() << "no suitable configs returned by glxChooseFBConfig";
-	}
 
-	/* Just use first config */
-	GLXFBConfig fbconfig = fbconfigs[0];
-	XFree(fbconfigs);
+		if ((pbuffer_ = glXCreatePbuffer(display_, fbconfig, pbattribs)) == None) {
+			XCloseDisplay(display_);
+			throw PBufferException() << "glXCreatePbuffer failed";
+		}
 
-	if ((pbuffer_ = glXCreatePbuffer(display_, fbconfig, pbattribs)) == None) {
-		XCloseDisplay(display_);
-		throw PBufferException() << "glXCreatePbuffer failed";
-	}
+		if ((context_ = glXCreateNewContext(display_, fbconfig, GLX_RGBA_TYPE, NULL, True)) == NULL) {
+			glXDestroyPbuffer(display_, pbuffer_);
+			XCloseDisplay(display_);
+			throw PBufferException() << "glXCreateNewContext failed";
+		}
 
-	if ((context_ = glXCreateNewContext(display_, fbconfig, GLX_RGBA_TYPE, NULL, True)) == NULL) {
-		glXDestroyPbuffer(display_, pbuffer_);
-		XCloseDisplay(display_);
-		throw PBufferException() << "glXCreateNewContext failed";
+		if (!glXMakeCurrent(display_, pbuffer_, context_)) {
+			glXDestroyContext(display_, context_);
+			glXDestroyPbuffer(display_, pbuffer_);
+			XCloseDisplay(display_);
+			throw PBufferException() << "glXMakeCurrent failed";
+		}
 	}
 
-	if (!glXMakeCurrent(display_, pbuffer_, context_)) {
+	virtual ~GLXPBufferContext() {
+		if (!glXMakeCurrent(display_, None, NULL))
+			warnx("cannot reset GLX context: glXMakeCurrent failed");
 		glXDestroyContext(display_, context_);
 		glXDestroyPbuffer(display_, pbuffer_);
 		XCloseDisplay(display_);
-		throw PBufferException() << "glXMakeCurrent failed";
 	}
+
+	virtual bool IsDirect() const {
+		return glXIsDirect(display_, context_);
+	}
+
+	virtual const char* GetName() const {
+		return "GLX";
+	}
+};
+
+#if defined(WITH_EGL)
+/*
+ * EGL pbuffer, or surfaceless context rendering into framebuffer
+ * object; doesn't need X display
+ */
+
+class EGLPBufferContext: public PBufferContext {
+protected:
+	EGLDisplay display_;
+	EGLContext context_;
+	EGLSurface surface_;
+
+	/* surfaceless mode; rendering goes into framebuffer_, which is
+	 * resolved into resolve_framebuffer_ when multisampled */
+	GLuint framebuffer_;
+	GLuint renderbuffers_[2];
+	GLuint resolve_framebuffer_;
+	GLuint resolve_renderbuffer_;
+
+	int width_;
+	int height_;
+
+protected:
+	static EGLDisplay GetDisplay(const char* device) {
+		const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+		PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+		if (HasExtension(extensions, "EGL_EXT_platform_base"))
+			get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+		/* devices allow choosing GPU without any window system */
+		PFNEGLQUERYDEVICESEXTPROC query_devices = NULL;
+		if (get_platform_display && HasExtension(extensions, "EGL_EXT_platform_device"))
+			query_devices = (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+
+		int ndevice = device ? (int)strtol(device, NULL, 10) : 0;
+
+		if (query_devices) {
+			static const int MAX_DEVICES = 32;
+			EGLDeviceEXT devices[MAX_DEVICES];
+			EGLint ndevices;
+			if (query_devices(MAX_DEVICES, devices, &ndevices) && ndevice < ndevices) {
+				EGLDisplay display = get_platform_display(EGL_PLATFORM_DEVICE_EXT, devices[ndevice], NULL);
+				if (display != EGL_NO_DISPLAY)
+					return display;
+			}
+		}
+
+		if (device)
+			throw PBufferException() << "cannot use EGL device " << device;
+
+		if (get_platform_display && HasExtension(extensions, "EGL_MESA_platform_surfaceless")) {
+			EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY)
+				return display;
+		}
+
+		return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	void Destroy() {
+		eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		if (context_ != EGL_NO_CONTEXT)
+			eglDestroyContext(display_, context_);
+		if (surface_ != EGL_NO_SURFACE)
+			eglDestroySurface(display_, surface_);
+		eglTerminate(display_);
+	}
+
+	void CreateFramebuffer(GLuint* framebuffer, GLuint* renderbuffers, int nrenderbuffers, int samples) {
+		static const GLenum formats[] = { GL_RGB8, GL_DEPTH_COMPONENT16 };
+		static const GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_DEPTH_ATTACHMENT };
+
+		glGenFramebuffers(1, framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, *framebuffer);
+
+		glGenRenderbuffers(nrenderbuffers, renderbuffers);
+		for (int i = 0; i < nrenderbuffers; ++i) {
+			glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[i]);
+			if (samples > 1)
+				glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, formats[i], width_, height_);
+			else
+				glRenderbufferStorage(GL_RENDERBUFFER, formats[i], width_, height_);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachments[i], GL_RENDERBUFFER, renderbuffers[i]);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			throw PBufferException() << "cannot create complete framebuffer object";
+	}
+
+	void InitFramebuffers(int samples) {
+		if (!HasGLVersion(3, 0) && !HasGLExtension("GL_ARB_framebuffer_object"))
+			throw PBufferException() << "surfaceless EGL context requires framebuffer objects, but they're not available";
+
+		CreateFramebuffer(&framebuffer_, renderbuffers_, 2, samples);
+		if (samples > 1)
+			CreateFramebuffer(&resolve_framebuffer_, &resolve_renderbuffer_, 1, 1);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+		glViewport(0, 0, width_, height_);
+	}
+
+public:
+	EGLPBufferContext(int width, int height, int samples, const char* device) : display_(EGL_NO_DISPLAY), context_(EGL_NO_CONTEXT), surface_(EGL_NO_SURFACE), framebuffer_(0), resolve_framebuffer_(0), resolve_renderbuffer_(0), width_(width), height_(height) {
+		renderbuffers_[0] = renderbuffers_[1] = 0;
+
+		if ((display_ = GetDisplay(device)) == EGL_NO_DISPLAY)
+			throw PBufferException() << "cannot get EGL display";
+
+		if (!eglInitialize(display_, NULL, NULL))
+			throw PBufferException() << "eglInitialize failed";
+
+		if (!eglBindAPI(EGL_OPENGL_API)) {
+			eglTerminate(display_);
+			throw PBufferException() << "EGL doesn't support desktop OpenGL";
+		}
+
+		EGLint cfgattribs[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8,
+			EGL_GREEN_SIZE, 8,
+			EGL_BLUE_SIZE, 8,
+			EGL_DEPTH_SIZE, 16,
+			EGL_NONE, EGL_NONE,
+			EGL_NONE, EGL_NONE,
+			EGL_NONE
+		};
+
+		if (samples > 1) {
+			cfgattribs[12] = EGL_SAMPLE_BUFFERS;
+			cfgattribs[13] = 1;
+			cfgattribs[14] = EGL_SAMPLES;
+			cfgattribs[15] = samples;
+		}
+
+		EGLConfig config;
+		EGLint nconfigs = 0;
+		bool surfaceless = !eglChooseConfig(display_, cfgattribs, &config, 1, &nconfigs) || nconfigs == 0;
+
+		if (surfaceless) {
+			/* no pbuffer configs (e.g. surfaceless platform); use
+			 * any config and render into framebuffer object */
+			if (!HasExtension(eglQueryString(display_, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+				eglTerminate(display_);
+				throw PBufferException() << "EGL has neither suitable pbuffer configs nor surfaceless contexts";
+			}
+
+			cfgattribs[1] = 0;
+			cfgattribs[12] = EGL_NONE;
+			if (!eglChooseConfig(display_, cfgattribs, &config, 1, &nconfigs) || nconfigs == 0) {
+				eglTerminate(display_);
+				throw PBufferException() << "no suitable configs returned by eglChooseConfig";
+			}
+		} else {
+			EGLint pbattribs[] = {
+				EGL_WIDTH, width,
+				EGL_HEIGHT, height,
+				EGL_NONE
+			};
+
+			if ((surface_ = eglCreatePbufferSurface(display_, config, pbattribs)) == EGL_NO_SURFACE) {
+				eglTerminate(display_);
+				throw PBufferException() << "eglCreatePbufferSurface failed";
+			}
+		}
+
+		if ((context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT, NULL)) == EGL_NO_CONTEXT) {
+			Destroy();
+			throw PBufferException() << "eglCreateContext failed";
+		}
+
+		if (!eglMakeCurrent(display_, surface_, surface_, context_)) {
+			Destroy();
+			throw PBufferException() << "eglMakeCurrent failed";
+		}
+
+		if (surfaceless) {
+			try {
+				InitFramebuffers(samples);
+			} catch (...) {
+				Destroy();
+				throw;
+			}
+		}
+	}
+
+	virtual ~EGLPBufferContext() {
+		if (framebuffer_) {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glDeleteFramebuffers(1, &framebuffer_);
+			glDeleteRenderbuffers(2, renderbuffers_);
+		}
+		if (resolve_framebuffer_) {
+			glDeleteFramebuffers(1, &resolve_framebuffer_);
+			glDeleteRenderbuffers(1, &resolve_renderbuffer_);
+		}
+		Destroy();
+	}
+
+	virtual void PrepareRead() {
+		if (!resolve_framebuffer_)
+			return;
+
+		/* reads go from resolved buffer, drawing goes on into
+		 * multisampled one */
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolve_framebuffer_);
+		glBlitFramebuffer(0, 0, width_, height_, 0, 0, width_, height_, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, resolve_framebuffer_);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer_);
+	}
+
+	virtual const char* GetName() const {
+		return surface_ == EGL_NO_SURFACE ? "EGL (surfaceless)" : "EGL";
+	}
+};
+#endif
+
+#if defined(WITH_OSMESA)
+/*
+ * OSMesa software rendering into client memory
+ */
+
+class OSMesaPBufferContext: public PBufferContext {
+protected:
+	OSMesaContext context_;
+	std::vector<unsigned char> pixels_;
+
+public:
+	OSMesaPBufferContext(int width, int height, int /* samples are not supported */) : pixels_(width * height * 4) {
+		if ((context_ = OSMesaCreateContextExt(OSMESA_RGBA, 16, 0, 0, NULL)) == NULL)
+			throw PBufferException() << "OSMesaCreateContextExt failed";
+
+		if (!OSMesaMakeCurrent(context_, &pixels_[0], GL_UNSIGNED_BYTE, width, height)) {
+			OSMesaDestroyContext(context_);
+			throw PBufferException() << "OSMesaMakeCurrent failed";
+		}
+	}
+
+	virtual ~OSMesaPBufferContext() {
+		OSMesaDestroyContext(context_);
+	}
+
+	virtual const char* GetName() const {
+		return "OSMesa";
+	}
+};
+#endif
+
+static PBufferContext* CreatePBufferContext(PBuffer::Backend backend, int width, int height, int samples, const char* display) {
+	switch (backend) {
+	case PBuffer::GLX:
+		return new GLXPBufferContext(width, height, samples, display);
+	case PBuffer::EGL:
+#if defined(WITH_EGL)
+		return new EGLPBufferContext(width, height, samples, display);
+#else
+		throw PBufferException() << "EGL support not compiled in";
+#endif
+	case PBuffer::OSMESA:
+#if defined(WITH_OSMESA)
+		return new OSMesaPBufferContext(width, height, samples);
+#else
+		throw PBufferException() << "OSMesa support not compiled in";
+#endif
+	default:
+		break;
+	}
+
+	/* try backends in order of preference, X display given means
+	 * user wants GLX */
+	std::vector<PBuffer::Backend> backends;
+	if (display || getenv("DISPLAY"))
+		backends.push_back(PBuffer::GLX);
+#if defined(WITH_EGL)
+	backends.push_back(PBuffer::EGL);
+#endif
+#if defined(WITH_OSMESA)
+	backends.push_back(PBuffer::OSMESA);
+#endif
+	if (backends.empty())
+		backends.push_back(PBuffer::GLX);
+
+	std::string errors;
+	for (std::vector<PBuffer::Backend>::iterator i = backends.begin(); i != backends.end(); ++i) {
+		try {
+			return CreatePBufferContext(*i, width, height, samples, display);
+		} catch (PBufferException& e) {
+			if (!errors.empty())
+				errors += "; ";
+			errors += e.what();
+		}
+	}
+
+	throw PBufferException() << "no usable OpenGL backend: " << errors;
+}
+
+PBuffer::PBuffer(int width, int height, int samples, Backend backend, const char* display) : width_(width), height_(height), context_(NULL), has_pack_buffers_(false), first_pending_(0), num_pending_(0) {
+	context_ = CreatePBufferContext(backend, width, height, samples, display);
+
+	InitPackBuffers();
+}
+
+void PBuffer::InitPackBuffers() {
+	/* pixel buffer objects are core since OpenGL 2.1 */
+	if (!HasGLVersion(2, 1) && !HasGLExtension("GL_ARB_pixel_buffer_object"))
+		return;
+
+	for (int i = 0; i < NUM_PACK_BUFFERS; ++i) {
+		glGenBuffers(1, &pack_buffers_[i].id);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pack_buffers_[i].id);
+		glBufferData(GL_PIXEL_PACK_BUFFER, width_ * height_ * 3, NULL, GL_STREAM_READ);
+		pack_buffers_[i].width = pack_buffers_[i].height = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	has_pack_buffers_ = glGetError() == GL_NO_ERROR;
 }
 
 PBuffer::~PBuffer() {
-	if (!glXMakeCurrent(display_, None, NULL))
-		warnx("cannot reset GLX context: glXMakeCurrent failed");
-	glXDestroyContext(display_, context_);
-	glXDestroyPbuffer(display_, pbuffer_);
-	XCloseDisplay(display_);
+	if (has_pack_buffers_)
+		for (int i = 0; i < NUM_PACK_BUFFERS; ++i)
+			glDeleteBuffers(1, &pack_buffers_[i].id);
+	delete context_;
 }
 
 bool PBuffer::IsDirect() const {
-	return glXIsDirect(display_, context_);
+	return context_->IsDirect();
+}
+
+const char* PBuffer::GetBackendName() const {
+	return context_->GetName();
 }
 
 void PBuffer::GetPixels(PixelBuffer& buffer, int x, int y) {
+	TRACE_SCOPE("PBuffer::GetPixels");
+
+	context_->PrepareRead();
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 	glReadPixels(x, y, buffer.GetWidth(), buffer.GetHeight(), GL_RGB, GL_UNSIGNED_BYTE, buffer.GetData());
 }
+
+bool PBuffer::HasAsyncReadback() const {
+	return has_pack_buffers_;
+}
+
+void PBuffer::StartGetPixels(int width, int height) {
+	TRACE_SCOPE("PBuffer::StartGetPixels");
+
+	if (!has_pack_buffers_)
+		throw PBufferException() << "asynchronous readback is not supported";
+	if (num_pending_ == NUM_PACK_BUFFERS)
+		throw PBufferException() << "too many pending readbacks";
+	if (width > width_ || height > height_)
+		throw PBufferException() << "readback area is larger than pbuffer";
+
+	PackBuffer& pack = pack_buffers_[(first_pending_ + num_pending_) % NUM_PACK_BUFFERS];
+	pack.width = width;
+	pack.height = height;
+
+	context_->PrepareRead();
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pack.id);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	num_pending_++;
+}
+
+void PBuffer::FinishGetPixels(PixelBuffer& buffer) {
+	TRACE_SCOPE("PBuffer::FinishGetPixels");
+
+	if (num_pending_ == 0)
+		throw PBufferException() << "no pending readbacks";
+
+	PackBuffer& pack = pack_buffers_[first_pending_];
+	if (buffer.GetWidth() != pack.width || buffer.GetHeight() != pack.height || buffer.GetBPP() != 3)
+		throw PBufferException() << "pixel buffer does not match readback area";
+
+	first_pending_ = (first_pending_ + 1) % NUM_PACK_BUFFERS;
+	num_pending_--;
+
+	/* blocks until transfer is complete */
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, pack.id);
+	const unsigned char* data = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (data == NULL) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		throw PBufferException() << "glMapBuffer failed";
+	}
+
+	memcpy(buffer.GetData(), data, pack.width * pack.height * 3);
+
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+int PBuffer::GetPendingReadbacks() const {
+	return num_pending_;
+}
@@ -23,32 +23,100 @@
 
 #include <glosm/Exception.hh>
 
-#include <X11/Xlib.h>
-#include <GL/glx.h>
-
-#include <vector>
+#include <glosm/util/gl.h>
 
 class PBufferException: public Exception {
 };
 
 class PixelBuffer;
+class PBufferContext;
 
+/**
+ * Offscreen OpenGL rendering target
+ *
+ * Creates OpenGL context and offscreen surface for it, using one
+ * of available backends: GLX pbuffer (requires X display), EGL
+ * pbuffer or surfaceless context with framebuffer object (for
+ * headless render servers) or OSMesa software renderer.
+ */
 class PBuffer {
+public:
+	enum Backend {
+		/** EGL if there's no X display, otherwise GLX; OSMesa if those fail */
+		AUTO,
+		GLX,
+		EGL,
+		OSMESA
+	};
+
+protected:
+	/** Number of readbacks which may be in flight at once */
+	static const int NUM_PACK_BUFFERS = 2;
+
+	/** Readback into pixel pack buffer object */
+	struct PackBuffer {
+		GLuint id;
+		int width;
+		int height;
+	};
+
 protected:
 	int width_;
 	int height_;
 
-	Display* display_;
-	GLXContext context_;
-	GLXPbuffer pbuffer_;
+	PBufferContext* context_;
+
+	bool has_pack_buffers_;
+	PackBuffer pack_buffers_[NUM_PACK_BUFFERS];
+	int first_pending_;
+	int num_pending_;
+
+protected:
+	void InitPackBuffers();
 
 public:
-	PBuffer(int width, int height, int samples);
+	/**
+	 * Constructs pbuffer and makes its context current
+	 *
+	 * @param backend backend to use
+	 * @param display X display name for GLX or device number
+	 *        for EGL, NULL for default one
+	 */
+	PBuffer(int width, int height, int samples, Backend backend = AUTO, const char* display = NULL);
 	~PBuffer();
 
 	void GetPixels(PixelBuffer& buffer, int x, int y);
 
+	/**
+	 * Checks whether asynchronous readback is supported
+	 *
+	 * It requires pixel buffer objects
+	 */
+	bool HasAsyncReadback() const;
+
+	/**
+	 * Starts asynchronous readback of lower left area
+	 *
+	 * Returns immediately, so next frame may be rendered while
+	 * pixels are transferred. At most NUM_PACK_BUFFERS readbacks
+	 * may be pending.
+	 */
+	void StartGetPixels(int width, int height);
+
+	/**
+	 * Completes earliest pending readback
+	 *
+	 * @param buffer buffer of the same size as requested area
+	 */
+	void FinishGetPixels(PixelBuffer& buffer);
+
+	/** Returns number of pending readbacks */
+	int GetPendingReadbacks() const;
+
 	bool IsDirect() const;
+
+	/** Returns name of backend in use */
+	const char* GetBackendName() const;
 };
 
 #endif
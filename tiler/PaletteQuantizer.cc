@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "PaletteQuantizer.hh"
+
+#include "PixelBuffer.hh"
+
+#include <stdint.h>
+
+#include <algorithm>
+
+/* reduced colors are 5 bits per channel */
+static const int QUANTIZER_BITS = 5;
+static const int QUANTIZER_BINS = 1 << (QUANTIZER_BITS * 3);
+
+static int GetBinChannel(int bin, int channel) {
+	return (bin >> (QUANTIZER_BITS * (2 - channel))) & ((1 << QUANTIZER_BITS) - 1);
+}
+
+struct QuantizerBinLess {
+	int channel;
+
+	QuantizerBinLess(int c): channel(c) {}
+
+	bool operator()(int a, int b) const {
+		return GetBinChannel(a, channel) < GetBinChannel(b, channel);
+	}
+};
+
+/** Range of histogram bins forming single palette entry */
+struct QuantizerBox {
+	int begin;
+	int end;
+	uint32_t count;
+};
+
+/* open addressing table of tile colors; twice as large as palette,
+ * so probe chains stay short */
+static const int QUANTIZER_EXACT_SLOTS = PaletteQuantizer::MAX_COLORS * 2;
+static const uint32_t QUANTIZER_EMPTY_SLOT = 0xffffffff;
+
+static bool QuantizeExact(const PixelBuffer& pixels, int x, int y, int width, int height, std::vector<unsigned char>& palette, std::vector<unsigned char>& indices) {
+	uint32_t slot_colors[QUANTIZER_EXACT_SLOTS];
+	unsigned char slot_indices[QUANTIZER_EXACT_SLOTS];
+	std::fill(slot_colors, slot_colors + QUANTIZER_EXACT_SLOTS, QUANTIZER_EMPTY_SLOT);
+
+	palette.clear();
+	indices.resize(width * height);
+
+	/* neighbouring pixels are mostly the same color */
+	uint32_t last_color = QUANTIZER_EMPTY_SLOT;
+	unsigned char last_index = 0;
+
+	for (int row = 0; row < height; ++row) {
+		const unsigned char* pixel = pixels.GetReverseRowPointer(y + row, x);
+		unsigned char* out = &indices[row * width];
+		for (int col = 0; col < width; ++col, pixel += 3) {
+			uint32_t color = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+			if (color != last_color) {
+				int slot = ((color * 2654435761U) >> 16) % QUANTIZER_EXACT_SLOTS;
+				while (slot_colors[slot] != color && slot_colors[slot] != QUANTIZER_EMPTY_SLOT)
+					slot = (slot + 1) % QUANTIZER_EXACT_SLOTS;
+
+				if (slot_colors[slot] == QUANTIZER_EMPTY_SLOT) {
+					if (palette.size() == PaletteQuantizer::MAX_COLORS * 3)
+						return false;
+					slot_colors[slot] = color;
+					slot_indices[slot] = palette.size() / 3;
+					palette.push_back(pixel[0]);
+					palette.push_back(pixel[1]);
+					palette.push_back(pixel[2]);
+				}
+
+				last_color = color;
+				last_index = slot_indices[slot];
+			}
+			out[col] = last_index;
+		}
+	}
+
+	return true;
+}
+
+void PaletteQuantizer::Quantize(const PixelBuffer& pixels, int x, int y, int width, int height, std::vector<unsigned char>& palette, std::vector<unsigned char>& indices) {
+	if (QuantizeExact(pixels, x, y, width, height, palette, indices))
+		return;
+
+	/* histogram, with color sums for averaging entries */
+	std::vector<uint32_t> counts(QUANTIZER_BINS, 0);
+	std::vector<uint32_t> sums(QUANTIZER_BINS * 3, 0);
+	const int shift = 8 - QUANTIZER_BITS;
+
+	for (int row = 0; row < height; ++row) {
+		const unsigned char* pixel = pixels.GetReverseRowPointer(y + row, x);
+		for (int col = 0; col < width; ++col, pixel += 3) {
+			int bin = ((pixel[0] >> shift) << (QUANTIZER_BITS * 2)) | ((pixel[1] >> shift) << QUANTIZER_BITS) | (pixel[2] >> shift);
+			counts[bin]++;
+			sums[bin * 3] += pixel[0];
+			sums[bin * 3 + 1] += pixel[1];
+			sums[bin * 3 + 2] += pixel[2];
+		}
+	}
+
+	std::vector<int> bins;
+	for (int bin = 0; bin < QUANTIZER_BINS; ++bin)
+		if (counts[bin] > 0)
+			bins.push_back(bin);
+
+	/* median cut: split most populated box along its longest
+	 * side, until there are enough boxes */
+	std::vector<QuantizerBox> boxes;
+	QuantizerBox all = { 0, (int)bins.size(), (uint32_t)(width * height) };
+	boxes.push_back(all);
+
+	while (boxes.size() < (size_t)MAX_COLORS) {
+		int best = -1;
+		for (int i = 0; i < (int)boxes.size(); ++i)
+			if (boxes[i].end - boxes[i].begin > 1 && (best == -1 || boxes[i].count > boxes[best].count))
+				best = i;
+		if (best == -1)
+			break;
+
+		QuantizerBox& box = boxes[best];
+
+		int channel = 0, longest = -1;
+		for (int c = 0; c < 3; ++c) {
+			int min = 1 << QUANTIZER_BITS, max = -1;
+			for (int i = box.begin; i < box.end; ++i) {
+				min = std::min(min, GetBinChannel(bins[i], c));
+				max = std::max(max, GetBinChannel(bins[i], c));
+			}
+			if (max - min > longest) {
+				longest = max - min;
+				channel = c;
+			}
+		}
+
+		std::sort(bins.begin() + box.begin, bins.begin() + box.end, QuantizerBinLess(channel));
+
+		/* weighted median, leaving at least one bin on each side */
+		uint32_t half = 0;
+		int split = box.begin;
+		while (split < box.end - 1 && (half + counts[bins[split]]) * 2 <= box.count)
+			half += counts[bins[split++]];
+		if (split == box.begin)
+			half += counts[bins[split++]];
+
+		QuantizerBox upper = { split, box.end, box.count - half };
+		box.end = split;
+		box.count = half;
+		boxes.push_back(upper);
+	}
+
+	/* entries are averages of real colors in them */
+	std::vector<unsigned char> bin_index(QUANTIZER_BINS, 0);
+	palette.clear();
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		uint64_t sum[3] = { 0, 0, 0 };
+		for (int b = boxes[i].begin; b < boxes[i].end; ++b) {
+			bin_index[bins[b]] = i;
+			for (int c = 0; c < 3; ++c)
+				sum[c] += sums[bins[b] * 3 + c];
+		}
+		for (int c = 0; c < 3; ++c)
+			palette.push_back((sum[c] + boxes[i].count / 2) / boxes[i].count);
+	}
+
+	indices.resize(width * height);
+	for (int row = 0; row < height; ++row) {
+		const unsigned char* pixel = pixels.GetReverseRowPointer(y + row, x);
+		for (int col = 0; col < width; ++col, pixel += 3) {
+			int bin = ((pixel[0] >> shift) << (QUANTIZER_BITS * 2)) | ((pixel[1] >> shift) << QUANTIZER_BITS) | (pixel[2] >> shift);
+			indices[row * width + col] = bin_index[bin];
+		}
+	}
+}
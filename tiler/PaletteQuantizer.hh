@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PALETTEQUANTIZER_HH
+#define PALETTEQUANTIZER_HH
+
+#include <vector>
+
+class PixelBuffer;
+
+/**
+ * Reduces colors of an RGB image area to a palette of up to 256
+ *
+ * Tiles of flat areas usually have few colors and get exact
+ * palette. Otherwise, colors are reduced to 5 bits per channel
+ * and split into palette entries by median cut, without
+ * dithering, which would only add noise to antialiased edges.
+ */
+class PaletteQuantizer {
+public:
+	static const int MAX_COLORS = 256;
+
+public:
+	/**
+	 * Quantizes image area
+	 *
+	 * @param palette receives RGB triplets of palette entries
+	 * @param indices receives palette index per pixel, rows
+	 *        top to bottom, like GetReverseRowPointer() gives them
+	 */
+	static void Quantize(const PixelBuffer& pixels, int x, int y, int width, int height, std::vector<unsigned char>& palette, std::vector<unsigned char>& indices);
+};
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "PngEncoder.hh"
+
+#include "JpegWriter.hh"
+#include "MBTilesWriter.hh"
+#include "PixelBuffer.hh"
+#include "PngWriter.hh"
+#include "WebpWriter.hh"
+
+#include <glosm/Guard.hh>
+#include <glosm/Trace.hh>
+
+#include <stdio.h>
+#include <stdexcept>
+#include <unistd.h>
+
+PngEncoder::PngEncoder(int width, int height, int compression, int nthreads, MBTilesWriter* archive) : width_(width), height_(height), compression_(compression), archive_(archive), num_buffers_(0), num_running_(0), die_flag_(false) {
+	int errn;
+
+	if ((errn = pthread_mutex_init(&mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+
+	if ((errn = pthread_cond_init(&queue_cond_, 0)) != 0) {
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if ((errn = pthread_cond_init(&done_cond_, 0)) != 0) {
+		pthread_cond_destroy(&queue_cond_);
+		pthread_mutex_destroy(&mutex_);
+		throw SystemError(errn) << "pthread_cond_init failed";
+	}
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_t thread;
+		if ((errn = pthread_create(&thread, NULL, ThreadFuncWrapper, (void*)this)) != 0) {
+			if (threads_.empty()) {
+				pthread_cond_destroy(&done_cond_);
+				pthread_cond_destroy(&queue_cond_);
+				pthread_mutex_destroy(&mutex_);
+				throw SystemError(errn) << "pthread_create failed";
+			}
+			break;
+		}
+		threads_.push_back(thread);
+	}
+
+	/* one buffer per thread is in work, one more is waiting */
+	max_buffers_ = threads_.size() + 1;
+}
+
+PngEncoder::~PngEncoder() {
+	Shutdown();
+
+	pthread_cond_destroy(&done_cond_);
+	pthread_cond_destroy(&queue_cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+void PngEncoder::Shutdown() {
+	pthread_mutex_lock(&mutex_);
+	die_flag_ = true;
+	pthread_cond_broadcast(&queue_cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	/* threads drain the queue before exiting */
+	for (ThreadVector::iterator i = threads_.begin(); i != threads_.end(); ++i)
+		pthread_join(*i, NULL);
+
+	threads_.clear();
+}
+
+void PngEncoder::ThreadFunc() {
+	pthread_mutex_lock(&mutex_);
+	while (1) {
+		while (queue_.empty() && !die_flag_)
+			pthread_cond_wait(&queue_cond_, &mutex_);
+
+		if (queue_.empty())
+			break;
+
+		Job job = queue_.front();
+		queue_.pop_front();
+		num_running_++;
+
+		pthread_mutex_unlock(&mutex_);
+
+		std::string error;
+		try {
+			WriteImage(*job.buffer->pixels, job.image, width_, height_, compression_, archive_);
+		} catch (std::exception& e) {
+			error = e.what();
+		}
+
+		pthread_mutex_lock(&mutex_);
+
+		if (!error.empty() && error_.empty())
+			error_ = error;
+
+		if (--job.buffer->refs == 0) {
+			delete job.buffer->pixels;
+			delete job.buffer;
+			num_buffers_--;
+		}
+
+		num_running_--;
+		pthread_cond_broadcast(&done_cond_);
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void* PngEncoder::ThreadFuncWrapper(void* arg) {
+	static_cast<PngEncoder*>(arg)->ThreadFunc();
+	return NULL;
+}
+
+void PngEncoder::Encode(PixelBuffer* pixels, const ImageVector& images) {
+	Guard guard(mutex_);
+
+	while (num_buffers_ >= max_buffers_ && error_.empty())
+		pthread_cond_wait(&done_cond_, &mutex_);
+
+	if (!error_.empty() || images.empty()) {
+		delete pixels;
+		if (!error_.empty())
+			throw PngWriterException() << error_;
+		return;
+	}
+
+	SharedBuffer* buffer = new SharedBuffer;
+	buffer->pixels = pixels;
+	buffer->refs = images.size();
+	num_buffers_++;
+
+	for (ImageVector::const_iterator i = images.begin(); i != images.end(); ++i)
+		queue_.push_back(Job(buffer, *i));
+
+	pthread_cond_broadcast(&queue_cond_);
+}
+
+void PngEncoder::Wait() {
+	Guard guard(mutex_);
+
+	while (!queue_.empty() || num_running_ > 0)
+		pthread_cond_wait(&done_cond_, &mutex_);
+
+	if (!error_.empty())
+		throw PngWriterException() << error_;
+}
+
+static void EncodeImage(const PixelBuffer& pixels, const PngEncoder::Image& image, int width, int height, int compression, std::vector<unsigned char>& data) {
+	switch (image.format.type) {
+	case TileFormat::JPEG:
+		JpegWriter::Write(pixels, image.x, image.y, width, height, image.format.quality, data);
+		break;
+	case TileFormat::WEBP:
+		WebpWriter::Write(pixels, image.x, image.y, width, height, image.format.quality, data);
+		break;
+	default:
+		{
+			PngWriter writer(data, width, height, compression, image.format.type == TileFormat::PNG8);
+			writer.WriteImage(pixels, image.x, image.y);
+		}
+		break;
+	}
+}
+
+void PngEncoder::WriteImage(const PixelBuffer& pixels, const Image& image, int width, int height, int compression, MBTilesWriter* archive) {
+	TRACE_SCOPE("PngEncoder::WriteImage");
+
+	if (archive) {
+		std::vector<unsigned char> data;
+		EncodeImage(pixels, image, width, height, compression, data);
+		archive->AddTile(image.zoom, image.column, image.row, data);
+		return;
+	}
+
+	/* PNG is written directly to file */
+	if (image.format.type == TileFormat::PNG || image.format.type == TileFormat::PNG8) {
+		PngWriter writer(image.path.c_str(), width, height, compression, image.format.type == TileFormat::PNG8);
+		writer.WriteImage(pixels, image.x, image.y);
+		return;
+	}
+
+	std::vector<unsigned char> data;
+	EncodeImage(pixels, image, width, height, compression, data);
+
+	FILE* file = fopen(image.path.c_str(), "wb");
+	if (file == NULL)
+		throw PngWriterException() << "cannot open output file: " << image.path;
+
+	bool ok = fwrite(&data[0], data.size(), 1, file) == 1;
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok)
+		throw PngWriterException() << "cannot write output file: " << image.path;
+}
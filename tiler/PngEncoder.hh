@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PNGENCODER_HH
+#define PNGENCODER_HH
+
+#include <glosm/Exception.hh>
+
+#include "TileFormat.hh"
+
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class PixelBuffer;
+class MBTilesWriter;
+
+/**
+ * Pool of threads encoding tile images
+ *
+ * Pixel buffers are queued by rendering thread and are then
+ * sliced into tiles and compressed in parallel, so rendering
+ * does not wait for compression. Despite the name, images may
+ * be written in any TileFormat.
+ */
+class PngEncoder {
+public:
+	/** Area of pixel buffer to be written as a tile */
+	struct Image {
+		std::string path;
+		int x;
+		int y;
+
+		/* tile coordinates, used for archive output */
+		int zoom;
+		int column;
+		int row;
+
+		TileFormat format;
+
+		Image(const std::string& p, int xx, int yy, int z, int c, int r, const TileFormat& f = TileFormat()): path(p), x(xx), y(yy), zoom(z), column(c), row(r), format(f) {}
+	};
+
+	typedef std::vector<Image> ImageVector;
+
+protected:
+	/** Pixel buffer shared by images which are cut from it */
+	struct SharedBuffer {
+		PixelBuffer* pixels;
+		int refs;
+	};
+
+	struct Job {
+		SharedBuffer* buffer;
+		Image image;
+
+		Job(SharedBuffer* b, const Image& i): buffer(b), image(i) {}
+	};
+
+	typedef std::deque<Job> JobQueue;
+	typedef std::vector<pthread_t> ThreadVector;
+
+protected:
+	int width_;
+	int height_;
+	int compression_;
+	int max_buffers_;
+
+	MBTilesWriter* archive_;
+
+	pthread_mutex_t mutex_;
+	pthread_cond_t queue_cond_;
+	pthread_cond_t done_cond_;
+
+	JobQueue queue_;
+	int num_buffers_;
+	int num_running_;
+	bool die_flag_;
+	std::string error_;
+
+	ThreadVector threads_;
+
+protected:
+	void ThreadFunc();
+	static void* ThreadFuncWrapper(void* arg);
+
+	void Shutdown();
+
+public:
+	/**
+	 * Constructs encoder and starts its threads
+	 *
+	 * @param width width of written images
+	 * @param height height of written images
+	 * @param compression compression level of PNG formats
+	 * @param nthreads number of threads, 0 means one per CPU
+	 * @param archive archive to write tiles to instead of files
+	 */
+	PngEncoder(int width, int height, int compression, int nthreads, MBTilesWriter* archive = NULL);
+
+	/** Waits for queued images and stops threads */
+	~PngEncoder();
+
+	/**
+	 * Queues images for writing
+	 *
+	 * Takes ownership of pixel buffer. Blocks if too many
+	 * buffers are already queued, so memory usage is bounded.
+	 *
+	 * @throw PngWriterException if previous write failed
+	 */
+	void Encode(PixelBuffer* pixels, const ImageVector& images);
+
+	/**
+	 * Waits till all queued images are written
+	 *
+	 * @throw PngWriterException if any write failed
+	 */
+	void Wait();
+
+	/**
+	 * Writes single image in calling thread
+	 *
+	 * @param compression compression level of PNG formats
+	 * @param archive archive to write tile to, NULL to write file
+	 */
+	static void WriteImage(const PixelBuffer& pixels, const Image& image, int width, int height, int compression, MBTilesWriter* archive);
+};
+
+#endif
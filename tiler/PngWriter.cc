@@ -20,6 +20,7 @@
 
 #include "PngWriter.hh"
 
+#include "PaletteQuantizer.hh"
 #include "PixelBuffer.hh"
 
 #include <png.h>
@@ -30,12 +31,18 @@ static void png_error_fn(png_struct*, const char* e) {
 	throw PngWriterException() << "png write error: " << e;
 }
 
-PngWriter::PngWriter(const char* filename, int width, int height, int compression): width_(width), height_(height) {
+static void png_write_vector_fn(png_struct* png_ptr, png_byte* data, png_size_t length) {
+	std::vector<unsigned char>* out = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png_ptr));
+	out->insert(out->end(), data, data + length);
+}
+
+static void png_flush_vector_fn(png_struct*) {
+}
+
+PngWriter::PngWriter(const char* filename, int width, int height, int compression, bool paletted): file_(NULL), width_(width), height_(height), paletted_(paletted), started_(false) {
 	if ((png_ptr_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_fn, NULL)) == NULL)
 		throw PngWriterException() << "png_create_write_struct failed";
 
-	png_set_compression_level(png_ptr_, compression);
-
 	if ((info_ptr_ = png_create_info_struct(png_ptr_)) == NULL) {
 		png_destroy_write_struct(&png_ptr_, NULL);
 		throw PngWriterException() << "png_create_info_struct failed";
@@ -48,15 +55,45 @@ PngWriter::PngWriter(const char* filename, int width, int height, int compressio
 
 	png_init_io(png_ptr_, file_);
 
-	png_set_IHDR(png_ptr_, info_ptr_, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	Init(compression);
+}
 
-	png_write_info(png_ptr_, info_ptr_);
+PngWriter::PngWriter(std::vector<unsigned char>& out, int width, int height, int compression, bool paletted): file_(NULL), width_(width), height_(height), paletted_(paletted), started_(false) {
+	if ((png_ptr_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, png_error_fn, NULL)) == NULL)
+		throw PngWriterException() << "png_create_write_struct failed";
+
+	if ((info_ptr_ = png_create_info_struct(png_ptr_)) == NULL) {
+		png_destroy_write_struct(&png_ptr_, NULL);
+		throw PngWriterException() << "png_create_info_struct failed";
+	}
+
+	png_set_write_fn(png_ptr_, &out, png_write_vector_fn, png_flush_vector_fn);
+
+	Init(compression);
+}
+
+void PngWriter::Init(int compression) {
+	png_set_compression_level(png_ptr_, compression);
+
+	/* filters only make paletted images larger, and skipping
+	 * filter selection makes compression much faster */
+	if (paletted_)
+		png_set_filter(png_ptr_, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+
+	/* paletted header is written with palette */
+	if (!paletted_) {
+		png_set_IHDR(png_ptr_, info_ptr_, width_, height_, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_write_info(png_ptr_, info_ptr_);
+		started_ = true;
+	}
 }
 
 PngWriter::~PngWriter() {
-	png_write_end(png_ptr_, NULL);
+	if (started_)
+		png_write_end(png_ptr_, NULL);
 	png_destroy_write_struct(&png_ptr_, &info_ptr_);
-	fclose(file_);
+	if (file_)
+		fclose(file_);
 }
 
 void PngWriter::WriteImage(const PixelBuffer& buffer, int x, int y) {
@@ -66,6 +103,11 @@ void PngWriter::WriteImage(const PixelBuffer& buffer, int x, int y) {
 	if (y + height_ > buffer.GetHeight())
 		throw std::logic_error("output image is higher than input buffer");
 
+	if (paletted_) {
+		WritePalettedImage(buffer, x, y);
+		return;
+	}
+
 	png_bytep* row_pointers = new png_bytep[height_];
 
 	/* ugly cast is hack for png interface which takes non-const png_pytepp */
@@ -76,3 +118,27 @@ void PngWriter::WriteImage(const PixelBuffer& buffer, int x, int y) {
 
 	delete[] row_pointers;
 }
+
+void PngWriter::WritePalettedImage(const PixelBuffer& buffer, int x, int y) {
+	std::vector<unsigned char> palette;
+	std::vector<unsigned char> indices;
+	PaletteQuantizer::Quantize(buffer, x, y, width_, height_, palette, indices);
+
+	std::vector<png_color> colors(palette.size() / 3);
+	for (size_t i = 0; i < colors.size(); ++i) {
+		colors[i].red = palette[i * 3];
+		colors[i].green = palette[i * 3 + 1];
+		colors[i].blue = palette[i * 3 + 2];
+	}
+
+	png_set_IHDR(png_ptr_, info_ptr_, width_, height_, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_set_PLTE(png_ptr_, info_ptr_, &colors[0], colors.size());
+	png_write_info(png_ptr_, info_ptr_);
+	started_ = true;
+
+	std::vector<png_bytep> row_pointers(height_);
+	for (int i = 0; i < height_; ++i)
+		row_pointers[i] = &indices[i * width_];
+
+	png_write_image(png_ptr_, &row_pointers[0]);
+}
@@ -25,6 +25,8 @@
 
 #include <png.h>
 
+#include <vector>
+
 class PixelBuffer;
 
 class PngWriterException : public Exception {
@@ -37,9 +39,29 @@ protected:
 	png_infop info_ptr_;
 	int width_;
 	int height_;
+	bool paletted_;
+	bool started_;
+
+protected:
+	void Init(int compression);
+
+	/**
+	 * Quantizes image and writes it with its palette
+	 */
+	void WritePalettedImage(const PixelBuffer& buffer, int x, int y);
 
 public:
-	PngWriter(const char* filename, int width, int height, int compression);
+	/**
+	 * Constructs writer to a file
+	 *
+	 * @param paletted write 8-bit paletted image, see PaletteQuantizer
+	 */
+	PngWriter(const char* filename, int width, int height, int compression, bool paletted = false);
+
+	/**
+	 * Constructs writer which appends PNG data to a buffer
+	 */
+	PngWriter(std::vector<unsigned char>& out, int width, int height, int compression, bool paletted = false);
 	virtual ~PngWriter();
 
 	void WriteImage(const PixelBuffer& buffer, int x, int y);
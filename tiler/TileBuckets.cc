@@ -0,0 +1,713 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "TileBuckets.hh"
+
+#include <glosm/ParsingHelpers.hh>
+#include <glosm/XMLParser.hh>
+#include <glosm/geomath.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+/* stored latitudes are biased, so zero record means missing one */
+static const osmint_t TILEBUCKETS_LAT_BIAS = 1000000000;
+
+/* sparse files are grown by at least this */
+static const uint64_t TILEBUCKETS_MIN_FILE_SIZE = 64 * 1024 * 1024;
+
+/** Node as stored in bucket file before sorting */
+struct TileBucketsNode {
+	osmid_t id;
+	osmint_t lon;
+	osmint_t lat;
+
+	bool operator<(const TileBucketsNode& other) const {
+		return id < other.id;
+	}
+
+	bool operator==(const TileBucketsNode& other) const {
+		return id == other.id;
+	}
+};
+
+/**
+ * Sparse file of fixed size records indexed by id, mapped into memory
+ *
+ * Records never written read as zeroes. Dirty pages are written
+ * back by the system, so resident size is bounded by page cache
+ * rather than by number of records. Negative ids (as in files
+ * produced by editors) are kept in a separate file.
+ */
+class TileBucketsIdFile: private NonCopyable {
+protected:
+	struct Mapping {
+		int fd;
+		char* data;
+		uint64_t size;
+	};
+
+protected:
+	Mapping positive_;
+	Mapping negative_;
+	size_t record_size_;
+
+protected:
+	static void Open(Mapping& mapping, const std::string& path) {
+		mapping.data = NULL;
+		mapping.size = 0;
+		if ((mapping.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+			throw SystemError() << "cannot create " << path;
+
+		/* only used through the mapping */
+		unlink(path.c_str());
+	}
+
+	static void Close(Mapping& mapping) {
+		if (mapping.data != NULL)
+			munmap(mapping.data, mapping.size);
+		if (mapping.fd != -1)
+			close(mapping.fd);
+	}
+
+	static void Grow(Mapping& mapping, uint64_t needed) {
+		uint64_t size = std::max(mapping.size * 2, TILEBUCKETS_MIN_FILE_SIZE);
+		while (size < needed)
+			size *= 2;
+
+		if (ftruncate(mapping.fd, size) != 0)
+			throw SystemError() << "cannot grow id file";
+
+		void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mapping.fd, 0);
+		if (data == MAP_FAILED)
+			throw SystemError() << "cannot map id file";
+
+		if (mapping.data != NULL)
+			munmap(mapping.data, mapping.size);
+
+		mapping.data = static_cast<char*>(data);
+		mapping.size = size;
+	}
+
+public:
+	TileBucketsIdFile(const std::string& path, size_t record_size) : record_size_(record_size) {
+		negative_.fd = -1;
+		negative_.data = NULL;
+		Open(positive_, path);
+		try {
+			Open(negative_, path + ".neg");
+		} catch (...) {
+			Close(positive_);
+			throw;
+		}
+	}
+
+	~TileBucketsIdFile() {
+		Close(positive_);
+		Close(negative_);
+	}
+
+	/**
+	 * Returns record, or NULL if it's beyond the file
+	 */
+	const osmint_t* Get(osmid_t id) const {
+		const Mapping& mapping = id < 0 ? negative_ : positive_;
+		uint64_t index = id < 0 ? -(id + 1) : id;
+
+		if ((index + 1) * record_size_ > mapping.size)
+			return NULL;
+		return reinterpret_cast<const osmint_t*>(mapping.data + index * record_size_);
+	}
+
+	/**
+	 * Returns writable record, growing the file if needed
+	 */
+	osmint_t* Put(osmid_t id) {
+		Mapping& mapping = id < 0 ? negative_ : positive_;
+		uint64_t index = id < 0 ? -(id + 1) : id;
+
+		if ((index + 1) * record_size_ > mapping.size)
+			Grow(mapping, (index + 1) * record_size_);
+		return reinterpret_cast<osmint_t*>(mapping.data + index * record_size_);
+	}
+};
+
+static void AppendEscaped(std::string& out, const std::string& str) {
+	for (std::string::const_iterator c = str.begin(); c != str.end(); ++c) {
+		switch (*c) {
+		case '&': out += "&amp;"; break;
+		case '<': out += "&lt;"; break;
+		case '>': out += "&gt;"; break;
+		case '"': out += "&quot;"; break;
+		case '\n': out += "&#10;"; break;
+		case '\r': out += "&#13;"; break;
+		case '\t': out += "&#9;"; break;
+		default: out += *c; break;
+		}
+	}
+}
+
+/* exact, as coordinates are stored with 7 decimal digits */
+static void AppendCoord(std::string& out, osmint_t value) {
+	char buf[32];
+	unsigned int abs = value < 0 ? -(unsigned int)value : value;
+	snprintf(buf, sizeof(buf), "%s%u.%07u", value < 0 ? "-" : "", abs / GEOM_UNITSINDEGREE, abs % GEOM_UNITSINDEGREE);
+	out += buf;
+}
+
+static void AppendId(std::string& out, osmid_t id) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%lld", (long long)id);
+	out += buf;
+}
+
+/**
+ * Parser which sorts OSM XML into TileBuckets
+ *
+ * In the first pass all objects are sorted and multipolygon
+ * members missing from buckets are collected into extra_ways;
+ * in the second pass only these are added.
+ */
+class TileBucketsParser: public XMLParser {
+public:
+	typedef std::vector<std::pair<osmid_t, size_t> > ExtraWaysVector;
+
+	struct Member {
+		std::string type;
+		osmid_t ref;
+		std::string role;
+	};
+
+	typedef std::vector<std::pair<std::string, std::string> > TagsVector;
+
+public:
+	/* (way id, bucket index), sorted after first pass */
+	ExtraWaysVector extra_ways;
+	bool extra_pass;
+
+protected:
+	enum CurrentObject {
+		NONE,
+		NODE,
+		WAY,
+		RELATION,
+	};
+
+protected:
+	TileBuckets& buckets_;
+	TileBucketsIdFile& nodes_;
+	TileBucketsIdFile& way_bboxes_;
+
+	int tag_level_;
+	CurrentObject current_;
+
+	osmid_t id_;
+	std::vector<osmid_t> refs_;
+	std::vector<Member> members_;
+	TagsVector tags_;
+
+	std::vector<size_t> found_;
+	std::string text_;
+
+protected:
+	static void ParseTag(TagsVector& tags, const char** atts) {
+		const char* key = "";
+		const char* value = "";
+		for (const char** att = atts; *att; ++att) {
+			if (StrEq<1>(*att, "k"))
+				key = *(++att);
+			else if (StrEq<1>(*att, "v"))
+				value = *(++att);
+			else
+				++att;
+		}
+		tags.push_back(std::make_pair(std::string(key), std::string(value)));
+	}
+
+	void AppendTags(std::string& out) const {
+		for (TagsVector::const_iterator tag = tags_.begin(); tag != tags_.end(); ++tag) {
+			out += "<tag k=\"";
+			AppendEscaped(out, tag->first);
+			out += "\" v=\"";
+			AppendEscaped(out, tag->second);
+			out += "\"/>\n";
+		}
+	}
+
+	void SerializeWay() {
+		text_ = "<way id=\"";
+		AppendId(text_, id_);
+		text_ += "\">\n";
+		for (std::vector<osmid_t>::const_iterator ref = refs_.begin(); ref != refs_.end(); ++ref) {
+			text_ += "<nd ref=\"";
+			AppendId(text_, *ref);
+			text_ += "\"/>\n";
+		}
+		AppendTags(text_);
+		text_ += "</way>\n";
+	}
+
+	void SerializeRelation() {
+		text_ = "<relation id=\"";
+		AppendId(text_, id_);
+		text_ += "\">\n";
+		for (std::vector<Member>::const_iterator member = members_.begin(); member != members_.end(); ++member) {
+			text_ += "<member type=\"";
+			AppendEscaped(text_, member->type);
+			text_ += "\" ref=\"";
+			AppendId(text_, member->ref);
+			text_ += "\" role=\"";
+			AppendEscaped(text_, member->role);
+			text_ += "\"/>\n";
+		}
+		AppendTags(text_);
+		text_ += "</relation>\n";
+	}
+
+	/* way and all its nodes known */
+	void AddWayTo(size_t bucket) {
+		buckets_.AddWay(bucket, text_);
+		for (std::vector<osmid_t>::const_iterator ref = refs_.begin(); ref != refs_.end(); ++ref) {
+			const osmint_t* pos = nodes_.Get(*ref);
+			if (pos != NULL && pos[1] != 0)
+				buckets_.AddNode(bucket, *ref, Vector2i(pos[0], pos[1] - TILEBUCKETS_LAT_BIAS));
+		}
+	}
+
+	void FinishWay() {
+		if (extra_pass) {
+			ExtraWaysVector::const_iterator first = std::lower_bound(extra_ways.begin(), extra_ways.end(), std::make_pair(id_, (size_t)0));
+			if (first == extra_ways.end() || first->first != id_)
+				return;
+
+			SerializeWay();
+			for (ExtraWaysVector::const_iterator extra = first; extra != extra_ways.end() && extra->first == id_; ++extra)
+				AddWayTo(extra->second);
+			return;
+		}
+
+		/* missing nodes are left to datasource to deal with */
+		BBoxi bbox(BBoxi::Empty());
+		for (std::vector<osmid_t>::const_iterator ref = refs_.begin(); ref != refs_.end(); ++ref) {
+			const osmint_t* pos = nodes_.Get(*ref);
+			if (pos != NULL && pos[1] != 0)
+				bbox.Include(Vector2i(pos[0], pos[1] - TILEBUCKETS_LAT_BIAS));
+		}
+
+		if (bbox.IsEmpty())
+			return;
+
+		osmint_t* record = way_bboxes_.Put(id_);
+		record[0] = bbox.left;
+		record[1] = bbox.bottom + TILEBUCKETS_LAT_BIAS;
+		record[2] = bbox.right;
+		record[3] = bbox.top;
+
+		found_.clear();
+		buckets_.FindBuckets(bbox, found_);
+		if (found_.empty())
+			return;
+
+		SerializeWay();
+		for (std::vector<size_t>::const_iterator bucket = found_.begin(); bucket != found_.end(); ++bucket)
+			AddWayTo(*bucket);
+	}
+
+	void FinishRelation() {
+		if (extra_pass)
+			return;
+
+		/* only multipolygons are rendered */
+		bool multipolygon = false;
+		for (TagsVector::const_iterator tag = tags_.begin(); tag != tags_.end(); ++tag)
+			if (tag->first == "type" && tag->second == "multipolygon")
+				multipolygon = true;
+		if (!multipolygon)
+			return;
+
+		BBoxi bbox(BBoxi::Empty());
+		std::vector<std::pair<osmid_t, BBoxi> > ways;
+		for (std::vector<Member>::const_iterator member = members_.begin(); member != members_.end(); ++member) {
+			if (member->type != "way")
+				continue;
+
+			const osmint_t* record = way_bboxes_.Get(member->ref);
+			if (record == NULL || record[1] == 0)
+				continue;
+
+			ways.push_back(std::make_pair(member->ref, BBoxi(record[0], record[1] - TILEBUCKETS_LAT_BIAS, record[2], record[3])));
+			bbox.Include(ways.back().second);
+		}
+
+		if (bbox.IsEmpty())
+			return;
+
+		found_.clear();
+		buckets_.FindBuckets(bbox, found_);
+		if (found_.empty())
+			return;
+
+		SerializeRelation();
+		for (std::vector<size_t>::const_iterator bucket = found_.begin(); bucket != found_.end(); ++bucket) {
+			buckets_.AddRelation(*bucket, text_);
+
+			/* members intersecting the bucket are already there */
+			for (std::vector<std::pair<osmid_t, BBoxi> >::const_iterator way = ways.begin(); way != ways.end(); ++way)
+				if (!way->second.Intersects(buckets_.buckets_[*bucket].bbox))
+					extra_ways.push_back(std::make_pair(way->first, *bucket));
+		}
+	}
+
+	virtual void StartElement(const char* name, const char** atts) {
+		if (tag_level_ == 1) {
+			id_ = 0;
+			osmint_t lat = 0, lon = 0;
+			for (const char** att = atts; *att; ++att) {
+				if (StrEq<1>(*att, "id"))
+					id_ = strtoll(*(++att), NULL, 10);
+				else if (StrEq<2>(*att, "lat"))
+					lat = ParseCoord(*(++att));
+				else if (StrEq<2>(*att, "lon"))
+					lon = ParseCoord(*(++att));
+				else
+					++att;
+			}
+
+			refs_.clear();
+			members_.clear();
+			tags_.clear();
+
+			if (StrEq<1>(name, "node")) {
+				current_ = NODE;
+				if (!extra_pass) {
+					osmint_t* record = nodes_.Put(id_);
+					record[0] = lon;
+					record[1] = lat + TILEBUCKETS_LAT_BIAS;
+				}
+			} else if (StrEq<1>(name, "way")) {
+				current_ = WAY;
+			} else if (StrEq<1>(name, "relation")) {
+				current_ = RELATION;
+			} else {
+				current_ = NONE;
+			}
+		} else if (tag_level_ == 2 && current_ == WAY) {
+			if (StrEq<1>(name, "nd")) {
+				if (**atts && StrEq<0>(*atts, "ref"))
+					refs_.push_back(strtoll(*(atts+1), NULL, 10));
+				else
+					throw ParsingException() << "no ref attribute for nd tag";
+			} else if (StrEq<1>(name, "tag")) {
+				ParseTag(tags_, atts);
+			}
+		} else if (tag_level_ == 2 && current_ == RELATION) {
+			if (StrEq<1>(name, "member")) {
+				Member member;
+				member.ref = 0;
+				for (const char** att = atts; *att; ++att) {
+					if (StrEq<2>(*att, "ref"))
+						member.ref = strtoll(*(++att), NULL, 10);
+					else if (StrEq<1>(*att, "type"))
+						member.type = *(++att);
+					else if (StrEq<2>(*att, "role"))
+						member.role = *(++att);
+					else
+						++att;
+				}
+				members_.push_back(member);
+			} else if (StrEq<1>(name, "tag")) {
+				ParseTag(tags_, atts);
+			}
+		} else if (tag_level_ == 0 && !StrEq<-1>(name, "osm")) {
+			throw ParsingException() << "unexpected root element (" << name << " instead of osm)";
+		}
+
+		++tag_level_;
+	}
+
+	virtual void EndElement(const char* /*name*/) {
+		--tag_level_;
+
+		if (tag_level_ != 1)
+			return;
+
+		if (current_ == WAY)
+			FinishWay();
+		else if (current_ == RELATION)
+			FinishRelation();
+
+		current_ = NONE;
+	}
+
+public:
+	TileBucketsParser(TileBuckets& buckets, TileBucketsIdFile& nodes, TileBucketsIdFile& way_bboxes)
+		: XMLParser(XMLParser::HANDLE_ELEMENTS | XMLParser::READ_AHEAD),
+		  extra_pass(false),
+		  buckets_(buckets),
+		  nodes_(nodes),
+		  way_bboxes_(way_bboxes),
+		  tag_level_(0),
+		  current_(NONE),
+		  id_(0) {
+	}
+};
+
+TileBuckets::TileBuckets(const char* parent, int zoom, int minx, int maxx, int miny, int maxy, osmint_t margin, osmint_t bottom_margin)
+	: zoom_(zoom), minx_(minx), miny_(miny), width_(maxx - minx + 1), height_(maxy - miny + 1), buffered_(0) {
+	std::string directory = std::string(parent) + "/glosm-buckets.XXXXXX";
+	std::vector<char> path(directory.begin(), directory.end());
+	path.push_back('\0');
+	if (mkdtemp(&path[0]) == NULL)
+		throw SystemError() << "cannot create bucket directory in " << parent;
+	directory_ = &path[0];
+
+	for (int x = minx; x <= maxx; ++x) {
+		BBoxi bbox = BBoxi::ForMercatorTile(zoom, x, miny);
+		column_lefts_.push_back(bbox.left - margin);
+		column_rights_.push_back(bbox.right + margin);
+	}
+
+	/* rows go from north to south, edges are stored south to north */
+	for (int y = maxy; y >= miny; --y) {
+		BBoxi bbox = BBoxi::ForMercatorTile(zoom, minx, y);
+		row_bottoms_.push_back(bbox.bottom - margin - bottom_margin);
+		row_tops_.push_back(bbox.top + margin);
+	}
+
+	for (int x = minx; x <= maxx; ++x) {
+		for (int y = miny; y <= maxy; ++y) {
+			BBoxi bbox(column_lefts_[x - minx], row_bottoms_[maxy - y], column_rights_[x - minx], row_tops_[maxy - y]);
+			buckets_.push_back(Bucket(x, y, bbox));
+		}
+	}
+}
+
+TileBuckets::~TileBuckets() {
+	for (size_t i = 0; i < buckets_.size(); ++i)
+		Remove(i);
+	rmdir(directory_.c_str());
+}
+
+std::string TileBuckets::GetPath(size_t index, const char* suffix) const {
+	char path[FILENAME_MAX];
+	snprintf(path, sizeof(path), "%s/%d-%d.%s", directory_.c_str(), buckets_[index].x, buckets_[index].y, suffix);
+	return path;
+}
+
+static void AppendToFile(const std::string& path, std::string& data) {
+	if (data.empty())
+		return;
+
+	FILE* file = fopen(path.c_str(), "ab");
+	if (file == NULL)
+		throw SystemError() << "cannot open bucket file " << path;
+
+	bool ok = fwrite(data.data(), data.size(), 1, file) == 1;
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok)
+		throw SystemError() << "cannot write bucket file " << path;
+
+	std::string().swap(data);
+}
+
+void TileBuckets::Flush() {
+	for (size_t i = 0; i < buckets_.size(); ++i) {
+		AppendToFile(GetPath(i, "nodes"), buckets_[i].nodes);
+		AppendToFile(GetPath(i, "ways"), buckets_[i].ways);
+		AppendToFile(GetPath(i, "relations"), buckets_[i].relations);
+	}
+	buffered_ = 0;
+}
+
+void TileBuckets::FindBuckets(const BBoxi& bbox, std::vector<size_t>& out) const {
+	/* edges are monotonic even though expanded buckets overlap */
+	int firstx = std::lower_bound(column_rights_.begin(), column_rights_.end(), bbox.left) - column_rights_.begin();
+	int lastx = std::upper_bound(column_lefts_.begin(), column_lefts_.end(), bbox.right) - column_lefts_.begin() - 1;
+	int firstrow = std::lower_bound(row_tops_.begin(), row_tops_.end(), bbox.bottom) - row_tops_.begin();
+	int lastrow = std::upper_bound(row_bottoms_.begin(), row_bottoms_.end(), bbox.top) - row_bottoms_.begin() - 1;
+
+	for (int x = firstx; x <= lastx; ++x)
+		for (int row = firstrow; row <= lastrow; ++row)
+			out.push_back(x * height_ + (height_ - 1 - row));
+}
+
+void TileBuckets::AddNode(size_t index, osmid_t id, const Vector2i& pos) {
+	TileBucketsNode node;
+	memset(&node, 0, sizeof(node));
+	node.id = id;
+	node.lon = pos.x;
+	node.lat = pos.y;
+
+	buckets_[index].nodes.append(reinterpret_cast<const char*>(&node), sizeof(node));
+	if ((buffered_ += sizeof(node)) > FLUSH_SIZE)
+		Flush();
+}
+
+void TileBuckets::AddWay(size_t index, const std::string& way) {
+	buckets_[index].ways += way;
+	if ((buffered_ += way.size()) > FLUSH_SIZE)
+		Flush();
+}
+
+void TileBuckets::AddRelation(size_t index, const std::string& relation) {
+	buckets_[index].relations += relation;
+	if ((buffered_ += relation.size()) > FLUSH_SIZE)
+		Flush();
+}
+
+void TileBuckets::Build(const char* filename) {
+	TileBucketsIdFile nodes(directory_ + "/nodes.tmp", 2 * sizeof(osmint_t));
+	TileBucketsIdFile way_bboxes(directory_ + "/ways.tmp", 4 * sizeof(osmint_t));
+
+	TileBucketsParser parser(*this, nodes, way_bboxes);
+	parser.Load(filename);
+
+	if (!parser.extra_ways.empty()) {
+		std::sort(parser.extra_ways.begin(), parser.extra_ways.end());
+		parser.extra_ways.erase(std::unique(parser.extra_ways.begin(), parser.extra_ways.end()), parser.extra_ways.end());
+
+		parser.extra_pass = true;
+		parser.Load(filename);
+	}
+
+	Flush();
+}
+
+size_t TileBuckets::GetCount() const {
+	return buckets_.size();
+}
+
+int TileBuckets::GetZoom() const {
+	return zoom_;
+}
+
+void TileBuckets::GetTile(size_t index, int& x, int& y) const {
+	x = buckets_[index].x;
+	y = buckets_[index].y;
+}
+
+static void CopyFile(const std::string& path, FILE* out) {
+	FILE* in = fopen(path.c_str(), "rb");
+	if (in == NULL)
+		return; /* nothing was added */
+
+	char buf[65536];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, len, 1, out) != 1) {
+			fclose(in);
+			throw SystemError() << "cannot write bucket file";
+		}
+	}
+
+	bool ok = !ferror(in);
+	fclose(in);
+	if (!ok)
+		throw SystemError() << "cannot read bucket file " << path;
+}
+
+std::string TileBuckets::Prepare(size_t index) {
+	/* nodes shared by ways are added once per way */
+	std::vector<TileBucketsNode> nodes;
+	std::string nodes_path = GetPath(index, "nodes");
+	FILE* in = fopen(nodes_path.c_str(), "rb");
+	if (in != NULL) {
+		TileBucketsNode node;
+		while (fread(&node, sizeof(node), 1, in) == 1)
+			nodes.push_back(node);
+		fclose(in);
+	}
+
+	std::sort(nodes.begin(), nodes.end());
+	nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+	std::string path = GetPath(index, "osm");
+	FILE* out = fopen(path.c_str(), "wb");
+	if (out == NULL)
+		throw SystemError() << "cannot create bucket file " << path;
+
+	try {
+		const BBoxi& bbox = buckets_[index].bbox;
+		std::string text = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<osm version=\"0.6\" generator=\"glosm-tiler\">\n<bounds minlat=\"";
+		AppendCoord(text, std::max(bbox.bottom, (osmint_t)GEOM_MINLAT));
+		text += "\" minlon=\"";
+		AppendCoord(text, std::max(bbox.left, (osmint_t)GEOM_MINLON));
+		text += "\" maxlat=\"";
+		AppendCoord(text, std::min(bbox.top, (osmint_t)GEOM_MAXLAT));
+		text += "\" maxlon=\"";
+		AppendCoord(text, std::min(bbox.right, (osmint_t)GEOM_MAXLON));
+		text += "\"/>\n";
+
+		for (std::vector<TileBucketsNode>::const_iterator node = nodes.begin(); node != nodes.end(); ++node) {
+			text += "<node id=\"";
+			AppendId(text, node->id);
+			text += "\" lat=\"";
+			AppendCoord(text, node->lat);
+			text += "\" lon=\"";
+			AppendCoord(text, node->lon);
+			text += "\"/>\n";
+
+			if (text.size() > 65536) {
+				if (fwrite(text.data(), text.size(), 1, out) != 1)
+					throw SystemError() << "cannot write bucket file " << path;
+				text.clear();
+			}
+		}
+
+		if (!text.empty() && fwrite(text.data(), text.size(), 1, out) != 1)
+			throw SystemError() << "cannot write bucket file " << path;
+
+		CopyFile(GetPath(index, "ways"), out);
+		CopyFile(GetPath(index, "relations"), out);
+
+		if (fputs("</osm>\n", out) == EOF)
+			throw SystemError() << "cannot write bucket file " << path;
+	} catch (...) {
+		fclose(out);
+		throw;
+	}
+
+	if (fclose(out) != 0)
+		throw SystemError() << "cannot write bucket file " << path;
+
+	unlink(nodes_path.c_str());
+	unlink(GetPath(index, "ways").c_str());
+	unlink(GetPath(index, "relations").c_str());
+
+	return path;
+}
+
+void TileBuckets::Remove(size_t index) {
+	unlink(GetPath(index, "nodes").c_str());
+	unlink(GetPath(index, "ways").c_str());
+	unlink(GetPath(index, "relations").c_str());
+	unlink(GetPath(index, "osm").c_str());
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEBUCKETS_HH
+#define TILEBUCKETS_HH
+
+#include <glosm/BBox.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Math.hh>
+#include <glosm/NonCopyable.hh>
+#include <glosm/osmtypes.h>
+
+#include <string>
+#include <vector>
+
+class TileBucketsException: public Exception {
+};
+
+/**
+ * OSM data split into spatial buckets on disk
+ *
+ * Used to render inputs which don't fit into memory: ways are
+ * sorted into buckets by mercator tile of given zoom they
+ * intersect, after which tiles of a bucket may be rendered with
+ * only that bucket loaded. Bucket areas are expanded by a margin,
+ * so ways drawn into a tile from outside of it are not lost.
+ *
+ * Ways crossing bucket borders are stored in each bucket, and
+ * multipolygons are stored with all their member ways. While
+ * sorting, node coordinates and way bboxes are kept in sparse
+ * files indexed by id, so memory use doesn't depend on input
+ * size. Only OSM XML input is supported, with objects ordered
+ * as in planet dumps: nodes, then ways, then relations.
+ */
+class TileBuckets: private NonCopyable {
+	friend class TileBucketsParser;
+
+protected:
+	/** Bytes of buffered bucket data before it's written out */
+	static const size_t FLUSH_SIZE = 64 * 1024 * 1024;
+
+	struct Bucket {
+		int x;
+		int y;
+		BBoxi bbox; /* with margin */
+
+		/* buffered data not yet appended to files */
+		std::string nodes;
+		std::string ways;
+		std::string relations;
+
+		Bucket(int xx, int yy, const BBoxi& b): x(xx), y(yy), bbox(b) {}
+	};
+
+	typedef std::vector<Bucket> BucketVector;
+
+protected:
+	std::string directory_;
+	int zoom_;
+	int minx_, miny_;
+	int width_, height_;
+
+	/* by x, then by y */
+	BucketVector buckets_;
+
+	/* expanded bucket edges per column and per row, for
+	 * finding buckets intersecting a bbox */
+	std::vector<osmint_t> column_lefts_, column_rights_;
+	std::vector<osmint_t> row_bottoms_, row_tops_;
+
+	size_t buffered_;
+
+protected:
+	std::string GetPath(size_t index, const char* suffix) const;
+
+	/**
+	 * Appends buffered data of all buckets to their files
+	 */
+	void Flush();
+
+	/**
+	 * Appends indexes of buckets intersecting bbox to a vector
+	 */
+	void FindBuckets(const BBoxi& bbox, std::vector<size_t>& out) const;
+
+	/**
+	 * Adds serialized node to a bucket
+	 */
+	void AddNode(size_t index, osmid_t id, const Vector2i& pos);
+
+	/**
+	 * Adds serialized way to a bucket
+	 */
+	void AddWay(size_t index, const std::string& way);
+
+	/**
+	 * Adds serialized relation to a bucket
+	 */
+	void AddRelation(size_t index, const std::string& relation);
+
+public:
+	/**
+	 * Constructs empty buckets for a range of tiles
+	 *
+	 * @param parent directory to create bucket directory in
+	 * @param zoom zoom level of bucket tiles
+	 * @param minx, maxx, miny, maxy range of bucket tiles
+	 * @param margin distance buckets are expanded by
+	 * @param bottom_margin extra distance buckets are expanded by
+	 *        down, for skewed objects
+	 */
+	TileBuckets(const char* parent, int zoom, int minx, int maxx, int miny, int maxy, osmint_t margin, osmint_t bottom_margin);
+
+	/**
+	 * Destructor; removes all bucket files
+	 */
+	~TileBuckets();
+
+	/**
+	 * Sorts OSM data into buckets
+	 *
+	 * Input is read twice if there are multipolygons spanning
+	 * several buckets.
+	 */
+	void Build(const char* filename);
+
+	/**
+	 * Returns number of buckets
+	 */
+	size_t GetCount() const;
+
+	/**
+	 * Returns zoom level of bucket tiles
+	 */
+	int GetZoom() const;
+
+	/**
+	 * Returns tile coordinates of a bucket
+	 */
+	void GetTile(size_t index, int& x, int& y) const;
+
+	/**
+	 * Writes OSM XML file with data of a bucket
+	 *
+	 * @return path to the file, which is to be removed with Remove()
+	 */
+	std::string Prepare(size_t index);
+
+	/**
+	 * Removes files of a bucket
+	 */
+	void Remove(size_t index);
+};
+
+#endif
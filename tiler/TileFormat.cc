@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "TileFormat.hh"
+
+#include <stdlib.h>
+
+const char* TileFormat::GetExtension() const {
+	switch (type) {
+	case JPEG:
+		return "jpg";
+	case WEBP:
+		return "webp";
+	case GEOMETRY:
+		return "geom";
+	default:
+		return "png";
+	}
+}
+
+bool TileFormat::IsSupported() const {
+	switch (type) {
+#if !defined(WITH_JPEG)
+	case JPEG:
+		return false;
+#endif
+#if !defined(WITH_WEBP)
+	case WEBP:
+		return false;
+#endif
+	default:
+		return true;
+	}
+}
+
+bool TileFormat::Parse(const std::string& spec, TileFormat& format) {
+	std::string::size_type slash = spec.find('/');
+	std::string name = spec.substr(0, slash);
+
+	if (name == "png")
+		format = TileFormat(PNG);
+	else if (name == "png8")
+		format = TileFormat(PNG8);
+	else if (name == "jpeg" || name == "jpg")
+		format = TileFormat(JPEG);
+	else if (name == "webp")
+		format = TileFormat(WEBP);
+	else if (name == "geometry" || name == "geom")
+		format = TileFormat(GEOMETRY);
+	else
+		return false;
+
+	if (slash != std::string::npos) {
+		char* end;
+		format.quality = strtol(spec.c_str() + slash + 1, &end, 10);
+		if (*end != '\0' || format.quality < 1 || format.quality > 100)
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEFORMAT_HH
+#define TILEFORMAT_HH
+
+#include <string>
+
+/**
+ * Format of written tiles
+ */
+struct TileFormat {
+	enum Type {
+		/** 24-bit RGB PNG */
+		PNG,
+
+		/** 8-bit paletted PNG, see PaletteQuantizer */
+		PNG8,
+
+		/** JPEG; requires libjpeg */
+		JPEG,
+
+		/** lossy WebP; requires libwebp */
+		WEBP,
+
+		/** serialized Geometry, see Geometry::Serialize() */
+		GEOMETRY,
+	};
+
+	Type type;
+
+	/* for lossy formats, 1..100 */
+	int quality;
+
+	TileFormat(Type t = PNG, int q = 85): type(t), quality(q) {}
+
+	/**
+	 * Returns tile file extension
+	 */
+	const char* GetExtension() const;
+
+	/**
+	 * Checks whether format is supported by this build
+	 */
+	bool IsSupported() const;
+
+	/**
+	 * Checks whether tiles are written as geometry, not rendered
+	 */
+	bool IsVector() const {
+		return type == GEOMETRY;
+	}
+
+	/**
+	 * Parses format name with optional quality, e.g. "jpeg/80"
+	 *
+	 * @return false if format is unknown
+	 */
+	static bool Parse(const std::string& spec, TileFormat& format);
+
+	bool operator==(const TileFormat& other) const {
+		return type == other.type && quality == other.quality;
+	}
+
+	bool operator!=(const TileFormat& other) const {
+		return !(*this == other);
+	}
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "TileManifest.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+TileManifest::TileManifest(const std::string& target, int zoom) : target_(target), zoom_(zoom) {
+}
+
+std::string TileManifest::GetColumnPath(int x) const {
+	char path[FILENAME_MAX];
+	snprintf(path, sizeof(path), "%s/%d/%d/.hashes", target_.c_str(), zoom_, x);
+	return path;
+}
+
+TileManifest::Column& TileManifest::GetColumn(int x) {
+	ColumnMap::iterator column = columns_.find(x);
+	if (column != columns_.end())
+		return column->second;
+
+	column = columns_.insert(std::make_pair(x, Column())).first;
+
+	/* missing or malformed file just means tiles are rerendered */
+	FILE* file = fopen(GetColumnPath(x).c_str(), "r");
+	if (file == NULL)
+		return column->second;
+
+	int y;
+	uint64_t hash;
+	while (fscanf(file, "%d %" SCNx64, &y, &hash) == 2)
+		column->second.hashes[y] = hash;
+
+	fclose(file);
+
+	return column->second;
+}
+
+bool TileManifest::GetHash(int x, int y, uint64_t& hash) {
+	Column& column = GetColumn(x);
+	HashMap::const_iterator i = column.hashes.find(y);
+	if (i == column.hashes.end())
+		return false;
+
+	hash = i->second;
+	return true;
+}
+
+void TileManifest::SetHash(int x, int y, uint64_t hash) {
+	Column& column = GetColumn(x);
+	column.hashes[y] = hash;
+	column.dirty = true;
+}
+
+void TileManifest::Save() {
+	for (ColumnMap::iterator column = columns_.begin(); column != columns_.end(); ++column) {
+		if (!column->second.dirty)
+			continue;
+
+		/* write to temporary file and rename, so interrupted run
+		 * never leaves truncated manifest */
+		std::string path = GetColumnPath(column->first);
+		std::string temp_path = path + ".tmp";
+
+		FILE* file = fopen(temp_path.c_str(), "w");
+		if (file == NULL)
+			throw TileManifestException() << "cannot create tile manifest " << temp_path;
+
+		for (HashMap::const_iterator i = column->second.hashes.begin(); i != column->second.hashes.end(); ++i)
+			fprintf(file, "%d %016" PRIx64 "\n", i->first, i->second);
+
+		bool ok = !ferror(file);
+		if (fclose(file) != 0)
+			ok = false;
+
+		if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+			remove(temp_path.c_str());
+			throw TileManifestException() << "cannot write tile manifest " << path;
+		}
+
+		column->second.dirty = false;
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEMANIFEST_HH
+#define TILEMANIFEST_HH
+
+#include <glosm/Exception.hh>
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+class TileManifestException: public Exception {
+};
+
+/**
+ * Stored hashes of rendered tiles of single zoom level
+ *
+ * Used to skip rendering of tiles which didn't change since
+ * previous run. Hashes are stored per tile column, in
+ * <target>/<zoom>/<x>/.hashes, so processes rendering different
+ * columns never write the same file.
+ */
+class TileManifest {
+protected:
+	typedef std::map<int, uint64_t> HashMap;
+
+	struct Column {
+		HashMap hashes;
+		bool dirty;
+
+		Column(): dirty(false) {}
+	};
+
+	typedef std::map<int, Column> ColumnMap;
+
+protected:
+	std::string target_;
+	int zoom_;
+
+	ColumnMap columns_;
+
+protected:
+	std::string GetColumnPath(int x) const;
+	Column& GetColumn(int x);
+
+public:
+	/**
+	 * Constructs empty manifest
+	 *
+	 * @param target tile directory
+	 * @param zoom zoom level
+	 */
+	TileManifest(const std::string& target, int zoom);
+
+	/**
+	 * Gets stored hash for a tile
+	 *
+	 * @return false if there's no hash stored for the tile
+	 */
+	bool GetHash(int x, int y, uint64_t& hash);
+
+	/**
+	 * Updates hash for a tile
+	 *
+	 * Change is not stored until Save() is called, which should
+	 * be done after the tile is written.
+	 */
+	void SetHash(int x, int y, uint64_t hash);
+
+	/**
+	 * Writes changed columns
+	 *
+	 * @throw TileManifestException if writing fails
+	 */
+	void Save();
+};
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2010-2012 Dmitry Marakasov
+ *
+ * This file is part of glosm.
+ *
+ * glosm is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * glosm is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with glosm.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "WebpWriter.hh"
+
+#include "PixelBuffer.hh"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(WITH_WEBP)
+#include <stdlib.h>
+#include <webp/encode.h>
+#endif
+
+void WebpWriter::Write(const PixelBuffer& buffer, int x, int y, int width, int height, int quality, std::vector<unsigned char>& out) {
+	if (x + width > buffer.GetWidth())
+		throw std::logic_error("output image is wider than input buffer");
+
+	if (y + height > buffer.GetHeight())
+		throw std::logic_error("output image is higher than input buffer");
+
+#if defined(WITH_WEBP)
+	/* encoder takes top to bottom rows with positive stride */
+	std::vector<unsigned char> rgb(width * height * 3);
+	for (int i = 0; i < height; ++i)
+		memcpy(&rgb[i * width * 3], buffer.GetReverseRowPointer(y + i, x), width * 3);
+
+	uint8_t* data = NULL;
+	size_t size = WebPEncodeRGB(&rgb[0], width, height, width * 3, (float)quality, &data);
+	if (size == 0)
+		throw WebpWriterException() << "webp encoding failed";
+
+	out.insert(out.end(), data, data + size);
+	free(data);
+#else
+	(void)quality;
+	(void)out;
+	throw WebpWriterException() << "WebP output requires libwebp support";
+#endif
+}
@@ -21,23 +21,40 @@
 #include "GlosmViewer.hh"
 
 #include <glosm/Math.hh>
+#include <glosm/GeometryTile.hh>
+#include <glosm/TerrainTile.hh>
 #include <glosm/MercatorProjection.hh>
 #include <glosm/SphericalProjection.hh>
 #include <glosm/Timer.hh>
+#include <glosm/Trace.hh>
 #include <glosm/CheckGL.hh>
+#include <glosm/Exception.hh>
+#include <glosm/Guard.hh>
 #include <glosm/geomath.h>
 
 #include <glosm/util/gl.h>
 
 #include <getopt.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#if !defined(WIN32)
+#	include <sys/resource.h>
+#endif
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 
+/* camera path time each replayed frame advances by */
+static const double REPLAY_FRAME_STEP = 1.0 / 60.0;
+
+/* seconds per frame all layers may spend on maintenance, such
+ * as uploads and garbage collection, before it's postponed */
+static const float MAINTENANCE_BUDGET = 0.004f;
+
 GlosmViewer::GlosmViewer() : projection_(MercatorProjection()), viewer_(new FirstPersonViewer) {
 	screenw_ = screenh_ = 1;
 	nframes_ = 0;
@@ -60,24 +77,156 @@ GlosmViewer::GlosmViewer() : projection_(MercatorProjection()), viewer_(new Firs
 	terrain_shown_ = true;
 
 	no_glew_check_ = false;
+	use_shaders_ = false;
 
 	start_lon_ = start_lat_ = start_ele_ = start_yaw_ = start_pitch_ = nan("");
+
+	target_fps_ = 0.0f;
+
+	stats_file_ = NULL;
+
+	replay_time_ = 0.0;
+	record_file_ = NULL;
+
+	osm_format_ = OSM_XML;
+	progressive_ = false;
+	impostor_distance_ = 0.0f;
+	viewport_count_ = 1;
+	loading_ = false;
+	load_failed_ = false;
+
+	int errn;
+	if ((errn = pthread_mutex_init(&load_mutex_, 0)) != 0)
+		throw SystemError(errn) << "pthread_mutex_init failed";
+}
+
+GlosmViewer::~GlosmViewer() {
+	/* loading can't be interrupted, and loaded data is destroyed
+	 * along with viewer, so wait for it */
+	if (loading_)
+		pthread_join(load_thread_, NULL);
+	pthread_mutex_destroy(&load_mutex_);
+
+	if (stats_file_ != NULL && stats_file_ != stderr)
+		fclose(stats_file_);
+	if (record_file_ != NULL)
+		fclose(record_file_);
+}
+
+static bool HasSuffix(const std::string& str, const char* suffix) {
+	size_t len = strlen(suffix);
+	return str.length() > len && str.compare(str.length() - len, len, suffix) == 0;
+}
+
+static void DumpLayerStatistics(FILE* f, long when, const char* name, const TileManager* layer, TileManager::Statistics& last, float period) {
+	if (layer == NULL)
+		return;
+
+	TileManager::Statistics stats;
+	layer->GetStatistics(stats);
+
+	unsigned int loaded = stats.loaded - last.loaded;
+
+	fprintf(f, "%ld layer name=%s queued=%u loading=%u tiles=%u bytes=%u speculative_bytes=%u size_limit=%u gpu_bytes=%u ram_bytes=%u gpu_size_limit=%u reclaiming=%u requests=%u impostors=%u impostor_bytes=%u impostor_updates_per_sec=%.2f maintenance_ms_per_sec=%.3f maintenance_overruns_per_sec=%.2f deferred_passes_per_sec=%.2f loaded_per_sec=%.2f dropped_per_sec=%.2f evicted_per_sec=%.2f cancelled_per_sec=%.2f passes_per_sec=%.2f spawn_ms_avg=%.2f gc_ms_per_sec=%.3f spawn_ms_histogram=",
+			when, name,
+			(unsigned int)stats.queued, (unsigned int)stats.loading, (unsigned int)stats.tiles,
+			(unsigned int)stats.bytes, (unsigned int)stats.speculative_bytes, (unsigned int)stats.size_limit,
+			(unsigned int)stats.gpu_bytes, (unsigned int)stats.ram_bytes, (unsigned int)stats.gpu_size_limit, (unsigned int)stats.reclaiming, (unsigned int)stats.requests,
+			(unsigned int)stats.impostors, (unsigned int)stats.impostor_bytes, (stats.impostor_updates - last.impostor_updates) / period,
+			(stats.maintenance_time - last.maintenance_time) * 1000.0 / period, (stats.maintenance_overruns - last.maintenance_overruns) / period, (stats.deferred_passes - last.deferred_passes) / period,
+			loaded / period, (stats.dropped - last.dropped) / period, (stats.evicted - last.evicted) / period, (stats.cancelled - last.cancelled) / period,
+			(stats.load_passes - last.load_passes) / period,
+			loaded ? (stats.spawn_time - last.spawn_time) * 1000.0 / loaded : 0.0,
+			(stats.gc_time - last.gc_time) * 1000.0 / period);
+
+	/* buckets are "under 1, 2, 4... ms", comma separated */
+	for (int i = 0; i < TileManager::NUM_SPAWN_TIME_BUCKETS; ++i)
+		fprintf(f, "%s%u", i ? "," : "", stats.spawn_times[i] - last.spawn_times[i]);
+	fprintf(f, "\n");
+
+	last = stats;
+}
+
+static bool IsRegularFile(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* upper bound of milliseconds under which given part of pop-ins fit */
+static float GetPopinPercentile(const TileManager::Statistics& stats, float part) {
+	unsigned int count = 0;
+	for (int i = 0; i < TileManager::NUM_POPIN_TIME_BUCKETS - 1; ++i) {
+		count += stats.popin_times[i];
+		if (count >= stats.popins * part)
+			return std::min((float)(1 << i), stats.popin_max * 1000.0f);
+	}
+	return stats.popin_max * 1000.0f;
+}
+
+static void ReportLayerPopins(FILE* f, long when, const char* name, const TileManager* layer) {
+	if (layer == NULL)
+		return;
+
+	TileManager::Statistics stats;
+	layer->GetStatistics(stats);
+
+	if (when < 0)
+		fprintf(f, "Tile pop-in (%s): %u tiles, avg %.1f ms, p50 under %.0f ms, p90 under %.0f ms, max %.1f ms\n",
+				name, stats.popins, stats.popins ? stats.popin_time * 1000.0 / stats.popins : 0.0,
+				GetPopinPercentile(stats, 0.5f), GetPopinPercentile(stats, 0.9f), stats.popin_max * 1000.0f);
+	else
+		fprintf(f, "%ld replay_layer name=%s popins=%u popin_ms_avg=%.2f popin_ms_p50=%.0f popin_ms_p90=%.0f popin_ms_max=%.2f\n",
+				when, name, stats.popins, stats.popins ? stats.popin_time * 1000.0 / stats.popins : 0.0,
+				GetPopinPercentile(stats, 0.5f), GetPopinPercentile(stats, 0.9f), stats.popin_max * 1000.0f);
+}
+
+static bool CompareCameraPathTime(const GlosmViewer::CameraPathPoint& a, const GlosmViewer::CameraPathPoint& b) {
+	return a.time < b.time;
+}
+
+static float GetFrameTimePercentile(const std::vector<float>& sorted, float part) {
+	if (sorted.empty())
+		return 0.0f;
+	return sorted[std::min(sorted.size() - 1, (size_t)(sorted.size() * part))] * 1000.0f;
 }
 
 void GlosmViewer::Usage(int status, bool detailed, const char* progname) {
-	fprintf(stderr, "Usage: %s [-sfh] [-t <path>] [-l lon,lat,ele,yaw,pitch] <file.osm|-> [file.gpx ...]\n", progname);
+	fprintf(stderr, "Usage: %s [-sfghp] [-t <path>] [-c <path>] [-i <distance>] [-V <count>] [-F <fps>] [-S <file>] [-R <file>] [-l lon,lat,ele,yaw,pitch|<file>] <file.osm[.gz|.bz2|.zst]|file.osm.pbf|file.snapshot|-> [file.gpx ...]\n", progname);
+	fprintf(stderr, "       %s [options] -r [host:]port|path [file.gpx ...]\n", progname);
 	if (detailed) {
 		fprintf(stderr, "Options:\n");
 		//               [==================================72==================================]
 		fprintf(stderr, "  -h       - show this help\n");
 		fprintf(stderr, "  -s       - use spherical projection instead of mercator\n");
+		fprintf(stderr, "  -g       - render with shaders instead of fixed function pipeline\n");
+		fprintf(stderr, "             (requires OpenGL 3.0 or vertex array objects support)\n");
 		fprintf(stderr, "  -t path  - add terrain layer, argument specifies path to directory\n");
 		fprintf(stderr, "             with SRTM data (*.hgt files)\n");
+		fprintf(stderr, "  -c path  - cache generated geometry in given directory, so it's\n");
+		fprintf(stderr, "             reused by next runs on the same data\n");
+		fprintf(stderr, "  -p       - load OSM data in background and start rendering right\n");
+		fprintf(stderr, "             away; map appears once it's loaded, and viewer is moved\n");
+		fprintf(stderr, "             to it unless position is given with -l. Not compatible\n");
+		fprintf(stderr, "             with -c\n");
+		fprintf(stderr, "  -i dist  - draw map details farther than given distance in meters\n");
+		fprintf(stderr, "             as cached images, and show them twice as far as usual.\n");
+		fprintf(stderr, "             Fixed function pipeline only\n");
+		fprintf(stderr, "  -V count - split window into given number of side by side viewports\n");
+		fprintf(stderr, "             looking in adjacent directions, for panoramic displays\n");
+		fprintf(stderr, "  -F fps   - adjust ranges, detail and memory limits of layers to\n");
+		fprintf(stderr, "             hold given frame rate\n");
+		fprintf(stderr, "  -S file  - append statistics of layers and datasources to file\n");
+		fprintf(stderr, "             every 10 seconds, one line per object (- for stderr)\n");
 		fprintf(stderr, "  -l ...   - set initial viewer's location and direction\n");
 		fprintf(stderr, "             argument is comma-separated list of longitude, latitude,\n");
 		fprintf(stderr, "             elevation, pitch and yaw, each of those may be empty for\n");
 		fprintf(stderr, "             program default (e.g. -l ,,100.0,, or -l ,,100.0). Units\n");
 		fprintf(stderr, "             are degrees and meters\n");
+		fprintf(stderr, "  -l file  - replay camera path from file as fast as possible, then\n");
+		fprintf(stderr, "             report frame times, tile pop-in latency and peak memory\n");
+		fprintf(stderr, "  -R file  - record camera path to file, for replaying with -l\n");
+		fprintf(stderr, "  -r addr  - take geometry from glosm-geomserver at given address\n");
+		fprintf(stderr, "             instead of loading OSM data\n");
 #if defined(WITH_GLEW)
 		fprintf(stderr, "  -f       - ignore glew errors\n");
 #endif
@@ -86,15 +235,52 @@ void GlosmViewer::Usage(int status, bool detailed, const char* progname) {
 }
 
 void GlosmViewer::Init(int argc, char** argv) {
+	Trace::Init();
+
 	/* argument parsing */
 	int c;
 	const char* progname = argv[0];
 	const char* srtmpath = NULL;
-	while ((c = getopt(argc, argv, "sfht:l:")) != -1) {
+	while ((c = getopt(argc, argv, "sfghpt:c:i:l:S:R:r:F:V:")) != -1) {
 		switch (c) {
 		case 's': projection_ = SphericalProjection(); break;
+		case 'g': use_shaders_ = true; break;
 		case 't': srtmpath = optarg; break;
+		case 'c': cache_dir_ = optarg; break;
+		case 'p': progressive_ = true; break;
+		case 'i':
+			if ((impostor_distance_ = strtod(optarg, NULL)) <= 0.0f)
+				throw Exception() << "bad impostor distance: " << optarg;
+			break;
+		case 'V':
+			if ((viewport_count_ = strtol(optarg, NULL, 10)) <= 0)
+				throw Exception() << "bad viewport count: " << optarg;
+			break;
+		case 'F':
+			if ((target_fps_ = strtod(optarg, NULL)) <= 0.0f)
+				throw Exception() << "bad target frame rate: " << optarg;
+			break;
+		case 'r':
+			fprintf(stderr, "Connecting to geometry server at %s...\n", optarg);
+			remote_geometry_.reset(new RemoteGeometryDatasource(optarg));
+			break;
+		case 'S':
+			if (strcmp(optarg, "-") == 0)
+				stats_file_ = stderr;
+			else if ((stats_file_ = fopen(optarg, "a")) == NULL)
+				throw SystemError() << "cannot open " << optarg;
+			break;
+		case 'R':
+			if ((record_file_ = fopen(optarg, "w")) == NULL)
+				throw SystemError() << "cannot open " << optarg;
+			fprintf(record_file_, "# time lon lat ele yaw pitch\n");
+			break;
 		case 'l': {
+					  if (IsRegularFile(optarg)) {
+						  LoadCameraPath(optarg);
+						  break;
+					  }
+
 					  int n = 0;
 					  char* start = optarg;
 					  char* end;
@@ -135,16 +321,27 @@ void GlosmViewer::Init(int argc, char** argv) {
 	for (int narg = 0; narg < argc; ++narg) {
 		std::string file = argv[narg];
 
-		if (file == "-" || file.rfind(".osm") == file.length() - 4) {
-			fprintf(stderr, "Loading %s as OSM...\n", file == "-" ? "stdin" : argv[narg]);
-			if (osm_datasource_.get() == NULL) {
-				Timer t;
-				osm_datasource_.reset(new PreloadedXmlDatasource);
-				osm_datasource_->Load(argv[narg]);
-				fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
-			} else {
-				fprintf(stderr, "Only single OSM file may be loaded at once, skipped\n");
+		if (remote_geometry_.get() && !HasSuffix(file, ".gpx")) {
+			fprintf(stderr, "Not loading %s - geometry is taken from server\n", argv[narg]);
+			continue;
+		}
+
+		if (file == "-" || HasSuffix(file, ".osm") || HasSuffix(file, ".osm.gz") || HasSuffix(file, ".osm.bz2") || HasSuffix(file, ".osm.zst") || HasSuffix(file, ".pbf") || HasSuffix(file, ".snapshot")) {
+			if (!osm_file_.empty()) {
+				fprintf(stderr, "Only single OSM file may be loaded at once, skipped %s\n", argv[narg]);
+				continue;
 			}
+
+			osm_file_ = file;
+			if (HasSuffix(file, ".pbf"))
+				osm_format_ = OSM_PBF;
+			else if (HasSuffix(file, ".snapshot"))
+				osm_format_ = OSM_SNAPSHOT;
+			else
+				osm_format_ = OSM_XML;
+
+			if (file != "-")
+				dataset_id_ = GeometryDiskCache::GetFileId(argv[narg]);
 		} else if (file.rfind(".gpx") == file.length() - 4) {
 			fprintf(stderr, "Loading %s as GPX...\n", argv[narg]);
 			if (gpx_datasource_.get() == NULL)
@@ -159,18 +356,40 @@ void GlosmViewer::Init(int argc, char** argv) {
 	}
 
 	if (srtmpath) {
-		heightmap_datasource_.reset(new SRTMDatasource(srtmpath));
+		/* terrain affects geometry as well */
+		if (!dataset_id_.empty())
+			dataset_id_ += std::string("|srtm:") + srtmpath;
+		heightmap_datasource_.reset(new SRTMDatasource(srtmpath, SRTMDatasource::MMAP_CHUNKS));
 		viewer_->SetHeightmapDatasource(heightmap_datasource_.get());
 	} else {
 		heightmap_datasource_.reset(new DummyHeightmap());
 	}
 
-	if (osm_datasource_.get() == NULL)
+	if (osm_file_.empty() && remote_geometry_.get() == NULL)
 		throw Exception() << "no osm dump specified";
 
+	if (!osm_file_.empty()) {
+		if (progressive_) {
+			/* geometry generated before data is loaded is empty,
+			 * and it must not get into persistent cache */
+			if (!cache_dir_.empty())
+				throw Exception() << "geometry cache cannot be used with progressive loading";
+
+			deferred_datasource_.reset(new DeferredOsmDatasource);
+
+			int errn;
+			if ((errn = pthread_create(&load_thread_, NULL, LoadThread, this)) != 0)
+				throw SystemError(errn) << "pthread_create failed";
+			loading_ = true;
+		} else {
+			LoadOsmData();
+		}
+	}
+
 	gettimeofday(&curtime_, NULL);
 	prevtime_ = curtime_;
 	fpstime_ = curtime_;
+	record_start_ = curtime_;
 }
 
 void GlosmViewer::InitGL() {
@@ -192,40 +411,222 @@ void GlosmViewer::InitGL() {
 #endif
 	CheckGL();
 
-	geometry_generator_.reset(new GeometryGenerator(*osm_datasource_, *heightmap_datasource_));
-	ground_layer_.reset(new GeometryLayer(projection_, *geometry_generator_));
-	detail_layer_.reset(new GeometryLayer(projection_, *geometry_generator_));
+	const GeometryDatasource* geometry_source = remote_geometry_.get();
+	if (geometry_source == NULL) {
+		if (deferred_datasource_.get())
+			geometry_generator_.reset(new GeometryGenerator(*deferred_datasource_, *heightmap_datasource_));
+		else
+			geometry_generator_.reset(new GeometryGenerator(*osm_datasource_, *heightmap_datasource_));
+		geometry_source = geometry_generator_.get();
+
+		/* so tile loading doesn't wait for terrain to be sampled;
+		 * not possible with progressive loading, as it can't run
+		 * concurrently with tile loading */
+		if (dynamic_cast<const SRTMDatasource*>(heightmap_datasource_.get()) != NULL && !deferred_datasource_.get())
+			geometry_generator_->PrecomputeElevations();
+	}
+	if (!cache_dir_.empty()) {
+		if (dataset_id_.empty()) {
+			fprintf(stderr, "Cannot identify OSM data, not using geometry cache\n");
+		} else {
+			geometry_disk_cache_.reset(new GeometryDiskCache(*geometry_source, cache_dir_.c_str(), dataset_id_));
+			geometry_source = geometry_disk_cache_.get();
+		}
+	}
+	geometry_cache_.reset(new GeometryCache(*geometry_source, 128*1024*1024));
+	ground_layer_.reset(new GeometryLayer(projection_, *geometry_cache_));
+	detail_layer_.reset(new GeometryLayer(projection_, *geometry_cache_));
 
-	ground_layer_->SetLevel(9);
+	ground_layer_->SetLevelRange(6, 9);
 	ground_layer_->SetRange(1000000.0);
 	ground_layer_->SetFlags(GeometryDatasource::GROUND);
 	ground_layer_->SetHeightEffect(false);
 	ground_layer_->SetSizeLimit(32*1024*1024);
+	ground_layer_->SetTileFlags(GeometryTile::WELD_VERTICES);
 
 	detail_layer_->SetLevel(12);
 	detail_layer_->SetRange(10000.0);
 	detail_layer_->SetFlags(GeometryDatasource::DETAIL);
 	detail_layer_->SetHeightEffect(true);
 	detail_layer_->SetSizeLimit(96*1024*1024);
+	detail_layer_->SetTileFlags(GeometryTile::WELD_VERTICES | GeometryTile::QUANTIZE_VERTICES);
+	/* in street level views most buildings are hidden by nearest ones;
+	 * query results are only valid for a single viewport */
+	detail_layer_->SetOcclusionCulling(viewport_count_ == 1);
+	/* so tiles don't pop in late on fast flights */
+	detail_layer_->SetPrefetch(3.0f, 16*1024*1024);
 
 	if (gpx_datasource_.get()) {
 		gpx_layer_.reset(new GPXLayer(projection_, *gpx_datasource_, *heightmap_datasource_));
-		gpx_layer_->SetLevel(10);
-		gpx_layer_->SetRange(10000.0);
+		/* distant tracks are made of coarser tiles with simplified tracks */
+		gpx_layer_->SetLevelRange(9, 13);
+		gpx_layer_->SetRange(50000.0);
 		gpx_layer_->SetHeightEffect(true);
 		gpx_layer_->SetSizeLimit(32*1024*1024);
+		gpx_layer_->SetPrefetch(3.0f, 4*1024*1024);
 	}
 
 	if (heightmap_datasource_.get()) {
 		terrain_layer_.reset(new TerrainLayer(projection_, *heightmap_datasource_));
-		terrain_layer_->SetLevel(12);
-		terrain_layer_->SetRange(20000.0);
+		/* distant terrain is made of coarser tiles with sparser grid */
+		terrain_layer_->SetLevelRange(8, 12);
+		terrain_layer_->SetRange(100000.0);
 		terrain_layer_->SetHeightEffect(false);
 		terrain_layer_->SetSizeLimit(32*1024*1024);
+		terrain_layer_->SetPrefetch(3.0f, 4*1024*1024);
+		terrain_layer_->SetTileFlags(TerrainTile::QUANTIZE_VERTICES);
+	}
+
+	/* defaults above are in the middle of bounds, so controller
+	 * starts from them */
+	if (target_fps_ > 0.0f) {
+		quality_controller_.reset(new QualityController(target_fps_));
+		quality_controller_->AddLayer(ground_layer_.get(), QualityController::LayerBounds(500000.0, 1500000.0, 0.5, 1.5, 16*1024*1024, 48*1024*1024));
+		quality_controller_->AddLayer(detail_layer_.get(), QualityController::LayerBounds(2000.0, 18000.0, 1.0, 1.0, 48*1024*1024, 144*1024*1024));
+		if (gpx_layer_.get())
+			quality_controller_->AddLayer(gpx_layer_.get(), QualityController::LayerBounds(25000.0, 75000.0, 0.5, 1.5, 16*1024*1024, 48*1024*1024));
+		if (terrain_layer_.get())
+			quality_controller_->AddLayer(terrain_layer_.get(), QualityController::LayerBounds(50000.0, 150000.0, 0.5, 1.5, 16*1024*1024, 48*1024*1024));
+	}
+
+	/* all layers share one pool of threads, which loads most
+	 * important tiles first, whichever layer they belong to */
+	tile_loader_.reset(new TileLoader(0));
+	ground_layer_->SetLoader(tile_loader_.get());
+	detail_layer_->SetLoader(tile_loader_.get());
+	if (gpx_layer_.get())
+		gpx_layer_->SetLoader(tile_loader_.get());
+	if (terrain_layer_.get())
+		terrain_layer_->SetLoader(tile_loader_.get());
+
+	/* maintenance of all layers shares per frame budget, so
+	 * bursts of uploads or evictions are spread over frames */
+	frame_scheduler_.reset(new FrameScheduler(MAINTENANCE_BUDGET));
+	ground_layer_->SetScheduler(frame_scheduler_.get());
+	detail_layer_->SetScheduler(frame_scheduler_.get());
+	if (gpx_layer_.get())
+		gpx_layer_->SetScheduler(frame_scheduler_.get());
+	if (terrain_layer_.get())
+		terrain_layer_->SetScheduler(frame_scheduler_.get());
+
+	if (use_shaders_) {
+		/* draw tiles of each layer with few multi-draw calls
+		 * where supported, see TileBatch */
+		tile_shader_.reset(new TileShader(TileBatch::IsSupported() ? TileShader::BATCHED : 0));
+		ground_layer_->SetShader(tile_shader_.get());
+		detail_layer_->SetShader(tile_shader_.get());
+		if (gpx_layer_.get())
+			gpx_layer_->SetShader(tile_shader_.get());
+		if (terrain_layer_.get()) {
+			/* with mercator, terrain is displaced on GPU from
+			 * height textures, which are much cheaper to build */
+			if (projection_.Is<MercatorProjection>()) {
+				try {
+					terrain_shader_.reset(new TileShader(TileShader::TERRAIN));
+					terrain_layer_->SetTileFlags(TerrainTile::HEIGHT_TEXTURE);
+				} catch (GLUnsupportedException& e) {
+					fprintf(stderr, "Not using terrain height textures: %s\n", e.what());
+				}
+			}
+			terrain_layer_->SetShader(terrain_shader_.get() ? terrain_shader_.get() : tile_shader_.get());
+		}
+	}
+
+	if (impostor_distance_ > 0.0f) {
+		if (use_shaders_) {
+			fprintf(stderr, "Impostors are not supported with shaders\n");
+		} else if (viewport_count_ > 1) {
+			fprintf(stderr, "Impostors are not supported with several viewports\n");
+		} else {
+			try {
+				detail_layer_->SetImpostors(impostor_distance_);
+				/* distant tiles are cheap to draw now */
+				detail_layer_->SetRange(20000.0);
+			} catch (GLUnsupportedException& e) {
+				fprintf(stderr, "Not using impostors: %s\n", e.what());
+			}
+		}
+	}
+
+	SetStartPosition(*geometry_source);
+}
+
+void GlosmViewer::LoadOsmData() {
+	const char* name = osm_file_ == "-" ? "stdin" : osm_file_.c_str();
+
+	Timer t;
+	switch (osm_format_) {
+	case OSM_XML: {
+			fprintf(stderr, "Loading %s as OSM...\n", name);
+			PreloadedXmlDatasource* datasource = new PreloadedXmlDatasource(PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::PIPELINED_LOAD | PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::FAST_XML_SCAN | PreloadedXmlDatasource::NODE_TAGS);
+			osm_datasource_.reset(datasource);
+			datasource->Load(osm_file_.c_str());
+		} break;
+	case OSM_PBF: {
+			fprintf(stderr, "Loading %s as OSM PBF...\n", name);
+			PreloadedPbfDatasource* datasource = new PreloadedPbfDatasource(PreloadedXmlDatasource::INLINE_NODES | PreloadedXmlDatasource::PACK_NODE_REFS | PreloadedXmlDatasource::NODE_TAGS);
+			osm_datasource_.reset(datasource);
+			datasource->Load(osm_file_.c_str());
+		} break;
+	case OSM_SNAPSHOT: {
+			fprintf(stderr, "Loading %s as OSM snapshot...\n", name);
+			MmapOsmDatasource* datasource = new MmapOsmDatasource;
+			osm_datasource_.reset(datasource);
+			datasource->Load(osm_file_.c_str());
+		} break;
+	}
+	fprintf(stderr, "Loaded in %.3f seconds\n", t.Count());
+}
+
+void* GlosmViewer::LoadThread(void* arg) {
+	GlosmViewer* self = static_cast<GlosmViewer*>(arg);
+
+	try {
+		self->LoadOsmData();
+		self->deferred_datasource_->Publish(*self->osm_datasource_);
+	} catch (std::exception& e) {
+		Guard guard(self->load_mutex_);
+		self->load_failed_ = true;
+		self->load_error_ = e.what();
+	}
+
+	return NULL;
+}
+
+void GlosmViewer::CheckLoading() {
+	if (!loading_)
+		return;
+
+	{
+		Guard guard(load_mutex_);
+		if (load_failed_) {
+			pthread_join(load_thread_, NULL);
+			loading_ = false;
+			throw Exception() << "cannot load " << osm_file_ << ": " << load_error_;
+		}
 	}
 
-	Vector3i startpos = geometry_generator_->GetCenter();
-	osmint_t startheight = fabs((float)geometry_generator_->GetBBox().top - (float)geometry_generator_->GetBBox().bottom) / GEOM_LONSPAN * WGS84_EARTH_EQ_LENGTH * GEOM_UNITSINMETER / 10.0;
+	if (!deferred_datasource_->IsPublished())
+		return;
+
+	pthread_join(load_thread_, NULL);
+	loading_ = false;
+
+	/* tiles loaded so far are empty; they are still rendered
+	 * until reloaded ones replace them */
+	geometry_cache_->Clear();
+	ground_layer_->InvalidateArea(BBoxi::ForEarth());
+	detail_layer_->InvalidateArea(BBoxi::ForEarth());
+
+	if (std::isnan(start_lon_) && std::isnan(start_lat_))
+		SetStartPosition(*geometry_generator_);
+}
+
+void GlosmViewer::SetStartPosition(const GeometryDatasource& source) {
+	Vector3i startpos = source.GetCenter();
+	BBoxi bbox = source.GetBBox();
+	/* bbox is empty while data is being loaded */
+	osmint_t startheight = bbox.IsEmpty() ? 1000 * GEOM_UNITSINMETER : fabs((float)bbox.top - (float)bbox.bottom) / GEOM_LONSPAN * WGS84_EARTH_EQ_LENGTH * GEOM_UNITSINMETER / 10.0;
 	float startyaw = 0;
 	float startpitch = -M_PI_4;
 
@@ -247,44 +648,114 @@ void GlosmViewer::InitGL() {
 #endif
 }
 
+void GlosmViewer::UpdateViewports() {
+	viewports_.resize(viewport_count_);
+	if (viewport_count_ == 1) {
+		viewports_.front() = *viewer_;
+		return;
+	}
+
+	float hfov = 2.0f * atanf(tanf(viewer_->GetFov() / 2.0f) * viewer_->GetAspect());
+	for (int i = 0; i < viewport_count_; ++i) {
+		viewports_[i] = *viewer_;
+		/* yaw grows to the left */
+		viewports_[i].SetRotation(viewer_->GetYaw() + ((float)(viewport_count_ - 1) / 2.0f - (float)i) * hfov, viewer_->GetPitch());
+	}
+}
+
+template <class L>
+void GlosmViewer::RenderLayer(L& layer) {
+	TileManager::ViewerVector viewers;
+	for (std::vector<FirstPersonViewer>::const_iterator i = viewports_.begin(); i != viewports_.end(); ++i)
+		viewers.push_back(&*i);
+
+	layer.GarbageCollect();
+	layer.LoadLocality(viewers);
+
+	if (viewport_count_ == 1) {
+		layer.Render(viewports_.front());
+		return;
+	}
+
+	for (int i = 0; i < viewport_count_; ++i) {
+		int left = screenw_ * i / viewport_count_;
+		glViewport(left, 0, screenw_ * (i + 1) / viewport_count_ - left, screenh_);
+		layer.Render(viewports_[i]);
+	}
+	glViewport(0, 0, screenw_, screenh_);
+}
+
 void GlosmViewer::Render() {
+	CheckLoading();
+
 	/* update scene */
 	gettimeofday(&curtime_, NULL);
 	float dt = (float)(curtime_.tv_sec - prevtime_.tv_sec) + (float)(curtime_.tv_usec - prevtime_.tv_usec)/1000000.0f;
 
+	if (!replay_path_.empty()) {
+		/* first frame time includes initialization */
+		if (replay_time_ > replay_path_.front().time)
+			replay_frame_times_.push_back(dt);
+
+		if (replay_time_ > replay_path_.back().time)
+			FinishReplay();
+
+		ReplayCameraPath();
+	}
+
+	/* terrain chunks within half a degree are loaded in
+	 * background, before tiles near chunk boundary need them */
+	const SRTMDatasource* srtm = dynamic_cast<const SRTMDatasource*>(heightmap_datasource_.get());
+	if (srtm != NULL) {
+		const Vector3d& pos = viewer_->MutablePos();
+		srtm->Prefetch(BBoxi(
+				(osmint_t)(pos.x - GEOM_UNITSINDEGREE / 2), (osmint_t)(pos.y - GEOM_UNITSINDEGREE / 2),
+				(osmint_t)(pos.x + GEOM_UNITSINDEGREE / 2), (osmint_t)(pos.y + GEOM_UNITSINDEGREE / 2)
+			));
+	}
+
 	/* render frame */
+	frame_scheduler_->BeginFrame();
+
 	glClearColor(0.5, 0.5, 0.5, 0.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	if (ground_shown_) {
-		ground_layer_->GarbageCollect();
-		ground_layer_->LoadLocality(*viewer_);
-		ground_layer_->Render(*viewer_);
-	}
+	UpdateViewports();
 
-	if (detail_shown_) {
-		detail_layer_->GarbageCollect();
-		detail_layer_->LoadLocality(*viewer_);
-		detail_layer_->Render(*viewer_);
-	}
+	if (ground_shown_)
+		RenderLayer(*ground_layer_);
 
-	if (gpx_shown_ && gpx_layer_.get()) {
-		gpx_layer_->GarbageCollect();
-		gpx_layer_->LoadLocality(*viewer_);
-		gpx_layer_->Render(*viewer_);
-	}
+	if (detail_shown_)
+		RenderLayer(*detail_layer_);
 
-	if (terrain_shown_ && terrain_layer_.get()) {
-		terrain_layer_->GarbageCollect();
-		terrain_layer_->LoadLocality(*viewer_);
-		terrain_layer_->Render(*viewer_);
+	if (gpx_shown_ && gpx_layer_.get())
+		RenderLayer(*gpx_layer_);
+
+	if (terrain_shown_ && terrain_layer_.get())
+		RenderLayer(*terrain_layer_);
+
+	{
+		/* waits for vsync and GPU */
+		TRACE_SCOPE("GlosmViewer::Flip");
+		glFlush();
+		Flip();
 	}
 
-	glFlush();
-	Flip();
+	if (record_file_ != NULL) {
+		Vector3d& pos = viewer_->MutablePos();
+		fprintf(record_file_, "%.3f %.7f %.7f %.2f %.4f %.4f\n",
+				(double)(curtime_.tv_sec - record_start_.tv_sec) + (double)(curtime_.tv_usec - record_start_.tv_usec)/1000000.0,
+				pos.x / GEOM_UNITSINDEGREE, pos.y / GEOM_UNITSINDEGREE, pos.z / GEOM_UNITSINMETER,
+				viewer_->GetYaw(), viewer_->GetPitch());
+	}
 
-	/* movement */
-	if (movementflags_) {
+	if (!replay_path_.empty()) {
+		/* path time doesn't depend on frame rate, so each run
+		 * renders the same sequence of frames */
+		replay_time_ += REPLAY_FRAME_STEP;
+	} else {
+		/* movement; viewer is moved even with no keys pressed, so
+		 * it knows it has stopped */
 		float myspeed = speed_;
 		float height = viewer_->MutablePos().z / GEOM_UNITSINMETER;
 
@@ -298,25 +769,33 @@ void GlosmViewer::Render() {
 			myspeed /= 5.0;
 
 		viewer_->Move(movementflags_, myspeed, dt);
+		if (lockheight_ != 0)
+			viewer_->MutablePos().z = lockheight_;
 	}
-	if (lockheight_ != 0)
-		viewer_->MutablePos().z = lockheight_;
 
 	/* update FPS */
 	float fpst = (float)(curtime_.tv_sec - fpstime_.tv_sec) + (float)(curtime_.tv_usec - fpstime_.tv_usec)/1000000.0f;
 
 	if (fpst > 10.0) {
 		fprintf(stderr, "FPS: %.3f\n", (float)nframes_/fpst);
+		if (stats_file_ != NULL) {
+			fprintf(stats_file_, "%ld fps fps=%.3f\n", (long)curtime_.tv_sec, (float)nframes_/fpst);
+			DumpStatistics(fpst);
+		}
 		fpstime_ = curtime_;
 		nframes_ = 0;
 	}
 
+	if (quality_controller_.get())
+		quality_controller_->Update(dt);
+
 	prevtime_ = curtime_;
 	nframes_++;
 
 #if !defined(DEBUG_FPS)
-	/* frame limiter */
-	usleep(10000);
+	/* frame limiter; replay renders as fast as possible */
+	if (replay_path_.empty())
+		usleep(10000);
 #endif
 }
 
@@ -341,7 +820,7 @@ void GlosmViewer::Resize(int w, int h) {
 		fov = 2.0f * atanf((float)h / wanted_h * tanf(wanted_fov/2.0f));
 	}
 	fov = wanted_fov;
-	aspect = (float)w/(float)h;
+	aspect = (float)w/(float)viewport_count_/(float)h;
 
 	glViewport(0, 0, w, h);
 
@@ -445,7 +924,7 @@ void GlosmViewer::MouseMove(int x, int y) {
 		int dx = x - drag_start_pos_.x;
 		int dy = y - drag_start_pos_.y;
 
-		float yawdelta = -(float)dx / (float)screenw_ * viewer_->GetFov() * viewer_->GetAspect();
+		float yawdelta = -(float)dx / (float)screenw_ * viewer_->GetFov() * viewer_->GetAspect() * (float)viewport_count_;
 		float pitchdelta = (float)dy / (float)screenh_ * viewer_->GetFov();
 
 		viewer_->SetRotation(drag_start_yaw_ + yawdelta, drag_start_pitch_ + pitchdelta);
@@ -481,3 +960,200 @@ void GlosmViewer::MouseButton(int button, bool pressed, int x, int y) {
 		}
 	}
 }
+
+void GlosmViewer::DumpStatistics(float period) {
+	long when = (long)curtime_.tv_sec;
+
+	DumpLayerStatistics(stats_file_, when, "ground", ground_layer_.get(), ground_stats_, period);
+	DumpLayerStatistics(stats_file_, when, "detail", detail_layer_.get(), detail_stats_, period);
+	DumpLayerStatistics(stats_file_, when, "gpx", gpx_layer_.get(), gpx_stats_, period);
+	DumpLayerStatistics(stats_file_, when, "terrain", terrain_layer_.get(), terrain_stats_, period);
+
+	if (geometry_generator_.get()) {
+		GeometryGenerator::Statistics stats;
+		geometry_generator_->GetStatistics(stats);
+
+		unsigned int requests = stats.requests - geometry_stats_.requests;
+		unsigned int ways = stats.ways - geometry_stats_.ways;
+		double scale = requests ? 1000.0 / requests : 0.0;
+
+		fprintf(stats_file_, "%ld geometry requests_per_sec=%.2f ways_per_request=%.1f way_cache_hit_rate=%.3f way_cache_bytes=%u get_ways_ms_avg=%.2f generate_ms_avg=%.2f crop_ms_avg=%.2f\n",
+				when, requests / period,
+				requests ? (double)ways / requests : 0.0,
+				ways ? (double)(stats.cached_ways - geometry_stats_.cached_ways) / ways : 0.0,
+				(unsigned int)geometry_generator_->GetWayCacheSize(),
+				(stats.get_ways_time - geometry_stats_.get_ways_time) * scale,
+				(stats.generate_time - geometry_stats_.generate_time) * scale,
+				(stats.crop_time - geometry_stats_.crop_time) * scale);
+
+		geometry_stats_ = stats;
+	}
+
+	const SRTMDatasource* srtm = dynamic_cast<const SRTMDatasource*>(heightmap_datasource_.get());
+	if (srtm != NULL) {
+		SRTMDatasource::Statistics stats;
+		srtm->GetStatistics(stats);
+
+		unsigned int lookups = stats.lookups - srtm_stats_.lookups;
+
+		fprintf(stats_file_, "%ld srtm lookups_per_sec=%.2f hit_rate=%.4f loads_per_sec=%.2f evictions_per_sec=%.2f bytes=%u size_limit=%u\n",
+				when, lookups / period,
+				lookups ? 1.0 - (double)(stats.loads - srtm_stats_.loads) / lookups : 1.0,
+				(stats.loads - srtm_stats_.loads) / period,
+				(stats.evictions - srtm_stats_.evictions) / period,
+				(unsigned int)stats.size, (unsigned int)stats.size_limit);
+
+		srtm_stats_ = stats;
+	}
+
+	{
+		FrameScheduler::Statistics stats;
+		frame_scheduler_->GetStatistics(stats);
+
+		unsigned int frames = stats.frames - scheduler_stats_.frames;
+
+		fprintf(stats_file_, "%ld scheduler budget_ms=%.2f maintenance_ms_avg=%.3f maintenance_ms_max=%.3f overruns_per_sec=%.2f overrun_rate=%.3f\n",
+				when, MAINTENANCE_BUDGET * 1000.0f,
+				frames ? (stats.time - scheduler_stats_.time) * 1000.0 / frames : 0.0,
+				stats.max_time * 1000.0f,
+				(stats.overruns - scheduler_stats_.overruns) / period,
+				frames ? (double)(stats.overruns - scheduler_stats_.overruns) / frames : 0.0);
+
+		scheduler_stats_ = stats;
+	}
+
+	if (quality_controller_.get())
+		fprintf(stats_file_, "%ld quality quality=%.2f\n", when, quality_controller_->GetQuality());
+
+	fflush(stats_file_);
+}
+
+void GlosmViewer::LoadCameraPath(const char* filename) {
+	FILE* f = fopen(filename, "r");
+	if (f == NULL)
+		throw SystemError() << "cannot open " << filename;
+
+	CameraPath path;
+	char line[1024];
+	int nline = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		nline++;
+
+		char* start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\0')
+			continue;
+
+		CameraPathPoint point;
+		if (sscanf(start, "%lf %lf %lf %lf %lf %lf", &point.time, &point.lon, &point.lat, &point.ele, &point.yaw, &point.pitch) != 6) {
+			fclose(f);
+			throw Exception() << filename << ":" << nline << ": expected time, longitude, latitude, elevation, yaw and pitch";
+		}
+
+		if (!path.empty() && point.time < path.back().time) {
+			fclose(f);
+			throw Exception() << filename << ":" << nline << ": time goes backwards";
+		}
+
+		path.push_back(point);
+	}
+
+	fclose(f);
+
+	if (path.empty())
+		throw Exception() << "no points in camera path " << filename;
+
+	replay_path_.swap(path);
+	replay_time_ = replay_path_.front().time;
+	replay_frame_times_.clear();
+}
+
+void GlosmViewer::ReplayCameraPath() {
+	/* segment containing current time */
+	CameraPathPoint key;
+	key.time = replay_time_;
+	size_t next = std::upper_bound(replay_path_.begin(), replay_path_.end(), key, CompareCameraPathTime) - replay_path_.begin();
+
+	const CameraPathPoint& a = replay_path_[next > 0 ? next - 1 : 0];
+	const CameraPathPoint& b = replay_path_[std::min(next, replay_path_.size() - 1)];
+
+	double duration = b.time - a.time;
+	double t = duration > 0.0 ? (replay_time_ - a.time) / duration : 0.0;
+
+	/* yaw goes the shortest way around */
+	double dyaw = b.yaw - a.yaw;
+	if (dyaw > M_PI)
+		dyaw -= 2.0 * M_PI;
+	if (dyaw < -M_PI)
+		dyaw += 2.0 * M_PI;
+
+	double lat = a.lat + (b.lat - a.lat) * t;
+
+	viewer_->SetPos(Vector3i(
+				(osmint_t)((a.lon + (b.lon - a.lon) * t) * GEOM_UNITSINDEGREE),
+				(osmint_t)(lat * GEOM_UNITSINDEGREE),
+				(osmint_t)((a.ele + (b.ele - a.ele) * t) * GEOM_UNITSINMETER)
+			));
+	viewer_->SetRotation(a.yaw + dyaw * t, a.pitch + (b.pitch - a.pitch) * t);
+
+	if (duration > 0.0) {
+		double meters_in_degree = WGS84_EARTH_EQ_LENGTH / 360.0;
+		viewer_->SetVelocity(Vector3f(
+					(b.lon - a.lon) * meters_in_degree * cos(lat / 180.0 * M_PI) / duration,
+					(b.lat - a.lat) * meters_in_degree / duration,
+					(b.ele - a.ele) / duration
+				));
+	} else {
+		viewer_->SetVelocity(Vector3f());
+	}
+}
+
+void GlosmViewer::FinishReplay() {
+	std::vector<float> sorted(replay_frame_times_);
+	std::sort(sorted.begin(), sorted.end());
+
+	double total = 0.0;
+	for (std::vector<float>::const_iterator i = sorted.begin(); i != sorted.end(); ++i)
+		total += *i;
+
+	long peak_rss = 0;
+#if !defined(WIN32)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#	if defined(__APPLE__)
+		peak_rss = usage.ru_maxrss / 1024;
+#	else
+		peak_rss = usage.ru_maxrss;
+#	endif
+	}
+#endif
+
+	fprintf(stderr, "Replay: %u frames in %.3f seconds (%.2f fps)\n", (unsigned int)sorted.size(), total, total > 0.0 ? sorted.size() / total : 0.0);
+	fprintf(stderr, "Frame time: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+			GetFrameTimePercentile(sorted, 0.5f), GetFrameTimePercentile(sorted, 0.9f),
+			GetFrameTimePercentile(sorted, 0.99f), GetFrameTimePercentile(sorted, 1.0f));
+	ReportLayerPopins(stderr, -1, "ground", ground_layer_.get());
+	ReportLayerPopins(stderr, -1, "detail", detail_layer_.get());
+	ReportLayerPopins(stderr, -1, "gpx", gpx_layer_.get());
+	ReportLayerPopins(stderr, -1, "terrain", terrain_layer_.get());
+	fprintf(stderr, "Peak memory: %.1f MB\n", peak_rss / 1024.0);
+
+	if (stats_file_ != NULL && stats_file_ != stderr) {
+		long when = (long)curtime_.tv_sec;
+
+		fprintf(stats_file_, "%ld replay frames=%u seconds=%.3f frame_ms_p50=%.2f frame_ms_p90=%.2f frame_ms_p99=%.2f frame_ms_max=%.2f peak_rss_kb=%ld\n",
+				when, (unsigned int)sorted.size(), total,
+				GetFrameTimePercentile(sorted, 0.5f), GetFrameTimePercentile(sorted, 0.9f),
+				GetFrameTimePercentile(sorted, 0.99f), GetFrameTimePercentile(sorted, 1.0f),
+				peak_rss);
+		ReportLayerPopins(stats_file_, when, "ground", ground_layer_.get());
+		ReportLayerPopins(stats_file_, when, "detail", detail_layer_.get());
+		ReportLayerPopins(stats_file_, when, "gpx", gpx_layer_.get());
+		ReportLayerPopins(stats_file_, when, "terrain", terrain_layer_.get());
+		fflush(stats_file_);
+	}
+
+	if (record_file_ != NULL)
+		fflush(record_file_);
+
+	exit(0);
+}
@@ -21,19 +21,34 @@
 #ifndef GLOSMVIEWER_HH
 #define GLOSMVIEWER_HH
 
+#include <glosm/DeferredOsmDatasource.hh>
 #include <glosm/DummyHeightmap.hh>
 #include <glosm/FirstPersonViewer.hh>
+#include <glosm/FrameScheduler.hh>
 #include <glosm/GPXLayer.hh>
+#include <glosm/GeometryCache.hh>
+#include <glosm/GeometryDiskCache.hh>
 #include <glosm/GeometryGenerator.hh>
 #include <glosm/GeometryLayer.hh>
+#include <glosm/MmapOsmDatasource.hh>
 #include <glosm/PreloadedGPXDatasource.hh>
+#include <glosm/PreloadedPbfDatasource.hh>
 #include <glosm/PreloadedXmlDatasource.hh>
 #include <glosm/Projection.hh>
+#include <glosm/QualityController.hh>
+#include <glosm/RemoteGeometryDatasource.hh>
 #include <glosm/SRTMDatasource.hh>
 #include <glosm/TerrainLayer.hh>
+#include <glosm/TileLoader.hh>
+#include <glosm/TileShader.hh>
+#include <glosm/TileBatch.hh>
 
+#include <cstdio>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include <pthread.h>
 #include <sys/time.h>
 
 class GlosmViewer {
@@ -53,10 +68,32 @@ public:
 		BUTTON_RIGHT
 	};
 
+	/**
+	 * Point of camera path, see LoadCameraPath()
+	 */
+	struct CameraPathPoint {
+		double time;
+		double lon;
+		double lat;
+		double ele;
+		double yaw;
+		double pitch;
+	};
+
+	typedef std::vector<CameraPathPoint> CameraPath;
+
+protected:
+	enum OsmFormat {
+		OSM_XML,
+		OSM_PBF,
+		OSM_SNAPSHOT,
+	};
+
 protected:
 	/* flags */
 	Projection projection_;
 	bool no_glew_check_;
+	bool use_shaders_;
 
 	double start_lon_;
 	double start_lat_;
@@ -64,16 +101,67 @@ protected:
 	double start_yaw_;
 	double start_pitch_;
 
+	std::string cache_dir_;
+	std::string dataset_id_;
+
+	/* OSM dump to load with LoadOsmData(), and its format */
+	std::string osm_file_;
+	OsmFormat osm_format_;
+
+	/* whether OSM dump is loaded in background while rendering */
+	bool progressive_;
+
+	/* frame rate to hold by adjusting layers; 0 to keep them fixed */
+	float target_fps_;
+
+	/* distance in meters beyond which detail tiles are drawn as
+	 * impostors; 0 to always draw geometry */
+	float impostor_distance_;
+
+	/* number of side by side viewports making a panorama */
+	int viewport_count_;
+
+	/* statistics are written here every period if set, see
+	 * DumpStatistics() */
+	FILE* stats_file_;
+
+	/* camera path to replay instead of user input, current
+	 * time on it and wall seconds each replayed frame took */
+	CameraPath replay_path_;
+	double replay_time_;
+	std::vector<float> replay_frame_times_;
+
+	/* camera path is appended here every frame if set */
+	FILE* record_file_;
+	struct timeval record_start_;
+
 	/* glosm objects */
 	std::auto_ptr<FirstPersonViewer> viewer_;
-	std::auto_ptr<PreloadedXmlDatasource> osm_datasource_;
+	/* copies of viewer_ turned for each viewport, see
+	 * UpdateViewports() */
+	std::vector<FirstPersonViewer> viewports_;
+	std::auto_ptr<OsmDatasource> osm_datasource_;
 	std::auto_ptr<PreloadedGPXDatasource> gpx_datasource_;
 	std::auto_ptr<HeightmapDatasource> heightmap_datasource_;
 	std::auto_ptr<GeometryGenerator> geometry_generator_;
+	/* with progressive loading, stands for osm_datasource_ until
+	 * load_thread_ loads and publishes it */
+	std::auto_ptr<DeferredOsmDatasource> deferred_datasource_;
+	/* replaces osm_datasource_ and geometry_generator_ if set */
+	std::auto_ptr<RemoteGeometryDatasource> remote_geometry_;
+	std::auto_ptr<GeometryDiskCache> geometry_disk_cache_;
+	std::auto_ptr<GeometryCache> geometry_cache_;
+	std::auto_ptr<TileShader> tile_shader_;
+	std::auto_ptr<TileShader> terrain_shader_;
+	/* must be destroyed after layers which use it */
+	std::auto_ptr<TileLoader> tile_loader_;
+	std::auto_ptr<FrameScheduler> frame_scheduler_;
 	std::auto_ptr<GeometryLayer> ground_layer_;
 	std::auto_ptr<GeometryLayer> detail_layer_;
 	std::auto_ptr<GPXLayer> gpx_layer_;
 	std::auto_ptr<TerrainLayer> terrain_layer_;
+	/* must be destroyed before layers it controls */
+	std::auto_ptr<QualityController> quality_controller_;
 
 	bool ground_shown_;
 	bool detail_shown_;
@@ -86,6 +174,15 @@ protected:
 	struct timeval prevtime_, curtime_, fpstime_;
 	int nframes_;
 
+	/* snapshots from previous DumpStatistics(), for rates */
+	TileManager::Statistics ground_stats_;
+	TileManager::Statistics detail_stats_;
+	TileManager::Statistics gpx_stats_;
+	TileManager::Statistics terrain_stats_;
+	GeometryGenerator::Statistics geometry_stats_;
+	SRTMDatasource::Statistics srtm_stats_;
+	FrameScheduler::Statistics scheduler_stats_;
+
 	int movementflags_;
 	float speed_;
 	bool slow_;
@@ -94,6 +191,15 @@ protected:
 
 	bool mouse_capture_;
 
+	/* background loading state, see LoadThread() */
+	pthread_t load_thread_;
+	bool loading_;
+	pthread_mutex_t load_mutex_;
+	/* protected by load_mutex_ */
+	bool load_failed_;
+	std::string load_error_;
+	/* /protected by load_mutex_ */
+
 	bool drag_;
 	Vector2<int> drag_start_pos_;
 	float drag_start_pitch_;
@@ -104,8 +210,86 @@ protected:
 	virtual void Flip() = 0;
 	virtual void ShowCursor(bool show) = 0;
 
+	/**
+	 * Writes statistics of layers and datasources to stats_file_
+	 *
+	 * @param period seconds since previous call, for rates
+	 */
+	void DumpStatistics(float period);
+
+	/**
+	 * Sets up viewports_ from viewer_ for current frame
+	 *
+	 * Viewports are placed left to right, each turned by its
+	 * horizontal field of view from the previous one, so they
+	 * are centered on viewer's direction.
+	 */
+	void UpdateViewports();
+
+	/**
+	 * Loads tiles around all viewports in a single pass and
+	 * draws each viewport from shared tiles
+	 */
+	template <class L>
+	void RenderLayer(L& layer);
+
+	/**
+	 * Creates datasource for osm_file_ and loads it
+	 */
+	void LoadOsmData();
+
+	/**
+	 * Thread which loads OSM data for progressive startup
+	 *
+	 * Loaded datasource is published to deferred_datasource_,
+	 * or error is recorded in load_error_.
+	 */
+	static void* LoadThread(void* arg);
+
+	/**
+	 * Checks whether background loading has finished
+	 *
+	 * Once it has, reloads all geometry, which was generated
+	 * without data so far. Rethrows loading error, if any.
+	 */
+	void CheckLoading();
+
+	/**
+	 * Places viewer over data of a datasource
+	 *
+	 * Location and direction given with -l take precedence.
+	 */
+	void SetStartPosition(const GeometryDatasource& source);
+
+	/**
+	 * Loads camera path to replay
+	 *
+	 * Each line of file is time in seconds, longitude, latitude,
+	 * elevation, yaw and pitch in the same units as for -l,
+	 * separated by spaces, with times not decreasing; lines
+	 * starting with # are ignored. Files written with -R are
+	 * in this format.
+	 */
+	void LoadCameraPath(const char* filename);
+
+	/**
+	 * Places viewer at current point of replayed camera path
+	 *
+	 * Position is interpolated between path points, and velocity
+	 * is set to that of current path segment, so tile prefetch
+	 * works as with live movement.
+	 */
+	void ReplayCameraPath();
+
+	/**
+	 * Reports frame time percentiles, tile pop-in latency and
+	 * peak memory of finished replay and exits
+	 */
+	void FinishReplay();
+
 public:
 	GlosmViewer();
+	virtual ~GlosmViewer();
 
 	virtual void Usage(int status, bool detailed, const char* progname);
 	virtual void Init(int argc, char** argv);